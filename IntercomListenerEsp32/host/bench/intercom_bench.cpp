@@ -0,0 +1,2252 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sdkconfig.h"
+#include "sim.hpp"
+#include "sensor_inputs.hpp"
+#include "tls_session_cache.hpp"
+#include "wake_profile.hpp"
+#include "event_log.hpp"
+#include "energy_account.hpp"
+#if CONFIG_INTERCOM_MQTT_ENABLED
+#include "mqtt_connection.hpp"
+#endif
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+#include "ulp_main.h"
+#include "ulp_pulse_config.h"
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+#include "https_connection.hpp"
+#endif
+#if CONFIG_INTERCOM_AUDIO_CLIP
+#include "ima_adpcm.hpp"
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+#include "notification_outbox.hpp"
+#endif
+
+/*
+   Wake-to-notify benchmark of the firmware running against the host simulation.
+
+   Every scenario boots the firmware in a forked child, because app_main and its globals live for
+   exactly one wake cycle. RTC memory is handed from one child to the next where a scenario models a
+   sequence of deep sleep wakes. Latencies are measured on the virtual clock from the first edge (or the wake)
+   to the moment the stand-in server has received the complete Telegram POST. With MQTT enabled every wake
+   also publishes to a stand-in broker, or to a real one given with --mqtt-broker.
+*/
+
+extern "C" void app_main();
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+extern sensor_inputs<sensor_channels> sensors;
+#endif
+extern tls_session_slot telegram_tls_session;
+#if CONFIG_INTERCOM_EVENT_LOG
+extern event_log_state event_history_state;
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+extern mqtt_session_state mqtt_session;
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+extern https_connection telegram_connection;
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+extern outbox_state outbox_memory;
+extern bool wifi_failed;
+bool notifications_busy();
+#endif
+
+namespace
+{
+    const int ring_pin = CONFIG_INTERCOM_RING_GPIO_PIN;
+    const int door_pin = CONFIG_INTERCOM_DOOR_GPIO_PIN;
+    const int wake_level = CONFIG_INTERCOM_WAKE_LEVEL;
+    const int idle_level = CONFIG_INTERCOM_WAKE_LEVEL ? 0 : 1;
+    const int64_t request_timeout_us = 20 * 1000 * 1000;
+    // Only notifications count; connection warm-up and keep-alive requests go to other Bot API methods.
+    const char *notify_path = "/sendMessage";
+
+    struct options
+    {
+        int warm_samples = 50;
+        int cold_samples = 10;
+        int storm_edges = 200000;
+        int journal_edges = 2000000;
+        int journal_rate = 1000000;
+        int pulses_per_ring = 120;
+        int noise_ms = 700;
+        int event_records = 60000;
+        // Deep sleep between two consecutive cold wakes, on the RTC clock.
+        int64_t sleep_s = 3 * 3600;
+        std::string events_dump;
+        sim::wifi::model wifi;
+        sim::net::model net;
+        // The monitor speed of platformio.ini. Every line the firmware logs holds up the task that logs it.
+        int console_baud = 115200;
+        // Loopback port of a real MQTT broker, e.g. mosquitto -p 1883. 0 runs the stand-in broker.
+        int mqtt_broker_port = 0;
+        bool verbose = false;
+    };
+
+    // What the chip keeps between wake cycles: RTC memory through deep sleep, NVS and the data partitions also through power loss.
+    struct device_memory
+    {
+        std::string rtc;
+        std::string nvs;
+        std::string flash;
+        // Not the chip's: the sessions the stand-in MQTT broker holds, which outlive the device's sleep and power loss.
+        std::string broker;
+    };
+
+    struct result
+    {
+        std::vector<double> samples;
+        std::map<std::string, double> metrics;
+        // Memory at the end of the wake cycle.
+        device_memory memory;
+        bool ok = true;
+    };
+
+    void write_hex(std::string& text, const char *key, const std::string& bytes)
+    {
+        text += key;
+        text += ' ';
+        for(unsigned char byte : bytes)
+        {
+            char hex[3];
+            snprintf(hex, sizeof(hex), "%02x", byte);
+            text += hex;
+        }
+        text += "\n";
+    }
+
+    void read_hex(const std::string& line, std::string& bytes)
+    {
+        for(size_t i = line.find(' ') + 1; i + 1 < line.size(); i += 2)
+        {
+            bytes.push_back(static_cast<char>(std::stoi(line.substr(i, 2), nullptr, 16)));
+        }
+    }
+
+    void write_result(int fd, const result& r)
+    {
+        std::string text = r.ok ? "ok\n" : "failed\n";
+        for(double sample : r.samples)
+        {
+            text += "sample " + std::to_string(sample) + "\n";
+        }
+        for(auto& [key, value] : r.metrics)
+        {
+            text += "metric " + key + " " + std::to_string(value) + "\n";
+        }
+        write_hex(text, "rtc", r.memory.rtc);
+        write_hex(text, "nvs", r.memory.nvs);
+        write_hex(text, "flash", r.memory.flash);
+        write_hex(text, "broker", r.memory.broker);
+        ssize_t unused = write(fd, text.data(), text.size());
+        (void)unused;
+    }
+
+    result read_result(int fd)
+    {
+        std::string text;
+        char chunk[4096];
+        ssize_t received;
+        while((received = read(fd, chunk, sizeof(chunk))) > 0)
+        {
+            text.append(chunk, received);
+        }
+
+        result r;
+        r.ok = text.rfind("ok\n", 0) == 0;
+        size_t pos = text.find('\n');
+        while(pos != std::string::npos && pos + 1 < text.size())
+        {
+            size_t end = text.find('\n', pos + 1);
+            std::string line = text.substr(pos + 1, end - pos - 1);
+            char key[128];
+            double value;
+            if(sscanf(line.c_str(), "sample %lf", &value) == 1)
+            {
+                r.samples.push_back(value);
+            }
+            else if(sscanf(line.c_str(), "metric %127s %lf", key, &value) == 2)
+            {
+                r.metrics[key] = value;
+            }
+            else if(line.rfind("rtc ", 0) == 0)
+            {
+                read_hex(line, r.memory.rtc);
+            }
+            else if(line.rfind("nvs ", 0) == 0)
+            {
+                read_hex(line, r.memory.nvs);
+            }
+            else if(line.rfind("flash ", 0) == 0)
+            {
+                read_hex(line, r.memory.flash);
+            }
+            else if(line.rfind("broker ", 0) == 0)
+            {
+                read_hex(line, r.memory.broker);
+            }
+            pos = end;
+        }
+        return r;
+    }
+
+    // Runs one wake cycle of the firmware in a child process and collects what the scenario reports.
+    // memory is what the chip wakes with, the result of an earlier cycle. Empty means the first power-on.
+    // sleep_us is how long the chip slept on that memory.
+    result run_isolated(const options& opts, const std::function<void(result&)>& scenario, const device_memory& memory = device_memory(),
+        int64_t sleep_us = 0)
+    {
+        int fds[2];
+        if(pipe(fds) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(fds[0]);
+            sim::clock::reset();
+            sim::log::set_cap(opts.verbose ? ESP_LOG_VERBOSE : ESP_LOG_ERROR);
+            sim::log::set_console_baud(opts.console_baud);
+            sim::wifi::configure(opts.wifi);
+            sim::net::configure(opts.net);
+            sim::gpio::preset(ring_pin, idle_level);
+            sim::gpio::preset(door_pin, idle_level);
+            if(sim::http_server::start() < 0)
+            {
+                _exit(2);
+            }
+#if CONFIG_INTERCOM_MQTT_ENABLED
+            if(opts.mqtt_broker_port > 0)
+            {
+                sim::net::route(CONFIG_INTERCOM_MQTT_PORT, opts.mqtt_broker_port);
+            }
+            else if(sim::mqtt_broker::start(CONFIG_INTERCOM_MQTT_PORT) < 0)
+            {
+                _exit(2);
+            }
+            sim::mqtt_broker::restore(memory.broker);
+#endif
+
+            sim::rtc::restore(memory.rtc);
+            sim::rtc::sleep_for(sleep_us);
+            sim::nvs::restore(memory.nvs);
+            sim::flash::restore(memory.flash);
+            result r;
+            scenario(r);
+            sim::flash::counters flash = sim::flash::stats();
+            r.metrics["flash_writes"] = static_cast<double>(flash.writes);
+            r.metrics["flash_erases"] = static_cast<double>(flash.erases);
+            r.metrics["flash_busy_ms"] = flash.busy_us / 1000.0;
+            r.memory = {sim::rtc::image(), sim::nvs::image(), sim::flash::image()};
+#if CONFIG_INTERCOM_MQTT_ENABLED
+            r.memory.broker = sim::mqtt_broker::image();
+#endif
+            write_result(fds[1], r);
+            close(fds[1]);
+
+            sim::shutdown();
+            sim::http_server::stop();
+#if CONFIG_INTERCOM_MQTT_ENABLED
+            sim::mqtt_broker::stop();
+#endif
+            _exit(0);
+        }
+
+        close(fds[1]);
+        result r = read_result(fds[0]);
+        close(fds[0]);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            r.ok = false;
+        }
+        return r;
+    }
+
+    // Sensor interrupts seen by the CPU, whichever capture mode the firmware uses.
+    uint64_t interrupt_count()
+    {
+        return sim::gpio::isr_count() + sim::rmt::isr_count() + sim::adc::isr_count();
+    }
+
+    // Gives the firmware time to finish reading the previous response before the next stimulus.
+    void settle()
+    {
+        sim::clock::sleep_for(50000);
+    }
+
+    // Shape of a signal at the sensor output, after the oscilloscope captures in the repository root.
+    struct line_signal
+    {
+        int64_t drop_us;
+        int64_t lead_in_us;
+        int64_t period_us;
+        int64_t wake_us;
+    };
+
+    const line_signal ring_signal = {500, 7000, 1000, 780};
+    const line_signal door_signal = {400, 16000, 840, 600};
+
+    // A short drop to the wake level, a plateau, then a pulse train that spends most of each period at the wake level.
+    // Edges are stamped on an absolute schedule, so a late harness thread neither skews nor accumulates timing.
+    void drive_signal(int pin, const line_signal& signal, int pulses)
+    {
+        int64_t t = sim::clock::now_us();
+        auto edge = [pin, &t](int level, int64_t hold_us)
+        {
+            sim::clock::sleep_until(t);
+            sim::gpio::drive_at(pin, level, t);
+            t += hold_us;
+        };
+
+        edge(wake_level, signal.drop_us);
+        edge(idle_level, signal.lead_in_us - signal.drop_us);
+        for(int i = 0; i < pulses; i++)
+        {
+            edge(wake_level, signal.wake_us);
+            edge(idle_level, signal.period_us - signal.wake_us);
+        }
+        sim::clock::sleep_until(t);
+    }
+
+    void drive_ring(int pin, int pulses)
+    {
+        drive_signal(pin, pin == ring_pin ? ring_signal : door_signal, pulses);
+    }
+
+    // Glitches of a few microseconds to a few hundred at random intervals, plus a burst of 50 Hz hum.
+    void drive_noise(int64_t duration_us, std::mt19937& rng)
+    {
+        std::uniform_int_distribution<int64_t> glitch_us(2, 300);
+        std::uniform_int_distribution<int64_t> gap_us(500, 40000);
+        std::uniform_int_distribution<int> pin_choice(0, 1);
+        int64_t end = sim::clock::now_us() + duration_us;
+        int64_t hum_at = sim::clock::now_us() + duration_us / 2;
+        while(sim::clock::now_us() < end)
+        {
+            int pin = pin_choice(rng) ? ring_pin : door_pin;
+            if(sim::clock::now_us() >= hum_at)
+            {
+                for(int i = 0; i < 10; i++)
+                {
+                    sim::gpio::drive(pin, wake_level);
+                    sim::clock::sleep_for(10000);
+                    sim::gpio::drive(pin, idle_level);
+                    sim::clock::sleep_for(10000);
+                }
+                hum_at = end;
+                continue;
+            }
+
+            sim::gpio::drive(pin, wake_level);
+            sim::clock::sleep_for(glitch_us(rng));
+            sim::gpio::drive(pin, idle_level);
+            sim::clock::sleep_for(gap_us(rng));
+        }
+    }
+
+    void scenario_warm_ring(const options& opts, result& r)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+
+        uint64_t interrupts_before = interrupt_count();
+        uint64_t led_transmissions_before = sim::rmt::transmissions();
+        uint64_t led_changes_before = sim::rmt::tx_level_changes();
+        for(int i = 0; i < opts.warm_samples; i++)
+        {
+            settle();
+            // Step past both cooldowns so every ring is eligible for a notification.
+            sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+
+            size_t expected = sim::http_server::request_count(notify_path) + 1;
+            int pin = i % 2 == 0 ? ring_pin : door_pin;
+            int64_t start = sim::clock::now_us();
+            drive_ring(pin, opts.pulses_per_ring);
+            if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path))
+            {
+                r.ok = false;
+                return;
+            }
+            r.samples.push_back((sim::http_server::requests(notify_path)[expected - 1].received_us - start) / 1000.0);
+        }
+        r.metrics["connections"] = static_cast<double>(sim::net::connections_opened());
+        r.metrics["interrupts"] = static_cast<double>(interrupt_count() - interrupts_before);
+        r.metrics["led_transmissions"] = static_cast<double>(sim::rmt::transmissions() - led_transmissions_before);
+        r.metrics["led_changes"] = static_cast<double>(sim::rmt::tx_level_changes() - led_changes_before);
+    }
+
+    // The server drops the kept-alive connection while the device idles. The next ring must still get through,
+    // paying for one reconnect, and the ring after it must be back on a warm connection.
+    void scenario_stale_connection(const options& opts, result& r)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+
+        for(int i = 0; i < 2; i++)
+        {
+            settle();
+            sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+            if(i == 0)
+            {
+                sim::http_server::drop_connections();
+                settle();
+            }
+
+            uint64_t connections_before = sim::net::connections_opened();
+            size_t expected = sim::http_server::request_count(notify_path) + 1;
+            int64_t start = sim::clock::now_us();
+            drive_ring(ring_pin, opts.pulses_per_ring);
+            if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path))
+            {
+                r.ok = false;
+                return;
+            }
+            r.samples.push_back((sim::http_server::requests(notify_path)[expected - 1].received_us - start) / 1000.0);
+            r.metrics[i == 0 ? "reconnects_stale" : "reconnects_after"] = static_cast<double>(sim::net::connections_opened() - connections_before);
+        }
+    }
+
+    // Boots, sends the boot notification and steps past the cooldowns, ready for a ring.
+    bool boot_awake()
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            return false;
+        }
+#endif
+        settle();
+        sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+        return true;
+    }
+
+    // The server answers 503 a few times. The ring must still be delivered after backing off.
+    void scenario_retry(const options& opts, result& r, int failures)
+    {
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+
+        size_t before = sim::http_server::request_count(notify_path);
+        sim::http_server::fail_requests(failures, 503, notify_path);
+        int64_t start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        size_t expected = before + failures + 1;
+        if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        r.samples.push_back((sim::http_server::requests(notify_path)[expected - 1].received_us - start) / 1000.0);
+        r.metrics["attempts"] = static_cast<double>(sim::http_server::request_count(notify_path) - before);
+    }
+
+    // The server takes the ring's request but the response never arrives. The connection must not send it again on its
+    // own; the dispatcher does, after its backoff, silently and marked as a possible repeat.
+    void scenario_lost_response(const options& opts, result& r)
+    {
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+
+        size_t before = sim::http_server::request_count(notify_path);
+        sim::http_server::fail_requests(1, 0, notify_path);
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 2, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        // Give an attempt that should not exist the chance to show up.
+        sim::clock::sleep_for(2000000);
+        auto requests = sim::http_server::requests(notify_path);
+        r.metrics["attempts"] = static_cast<double>(requests.size() - before);
+        r.metrics["resent_after_ms"] = (requests[before + 1].received_us - requests[before].received_us) / 1000.0;
+        r.metrics["first_silent"] = requests[before].body.find("\"disable_notification\":true") != std::string::npos ? 1 : 0;
+        r.metrics["resent_silent"] = requests[before + 1].body.find("\"disable_notification\":true") != std::string::npos
+            && requests[before + 1].body.find("may be a repeat") != std::string::npos ? 1 : 0;
+        r.ok = r.metrics["attempts"] == 2 && r.metrics["resent_after_ms"] >= CONFIG_INTERCOM_NOTIFICATION_RETRY_BASE_MS
+            && r.metrics["first_silent"] == 0 && r.metrics["resent_silent"] == 1;
+    }
+
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    // The server sends its bodies in chunks, answers one ring 204 without a body, and one without a length on a kept-alive
+    // connection. The chunked body must come out decoded, on the same connection. The response without a length must
+    // count as delivered, and must not hold up the door ring right behind it for the read timeout.
+    void scenario_response_framing(const options& opts, result& r)
+    {
+        sim::http_server::set_response_framing(sim::http_server::framing::chunked);
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+
+        uint64_t connections_before = sim::net::connections_opened();
+        size_t before = sim::http_server::request_count(notify_path);
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        settle();
+        r.metrics["chunked_decoded"] = strcmp(telegram_connection.response(), "{\"ok\":true,\"result\":{}}") == 0 ? 1 : 0;
+
+        sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+        sim::http_server::fail_requests(1, 204, notify_path);
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 2, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        settle();
+        r.metrics["reconnects_kept_alive"] = static_cast<double>(sim::net::connections_opened() - connections_before);
+
+        sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+        sim::http_server::set_response_framing(sim::http_server::framing::unframed);
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 3, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        sim::http_server::set_response_framing(sim::http_server::framing::content_length);
+        int64_t door_start = sim::clock::now_us();
+        drive_ring(door_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 4, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        // Give a repeat of any of the three, which should not exist, the chance to show up.
+        sim::clock::sleep_for(2000000);
+        auto requests = sim::http_server::requests(notify_path);
+        r.metrics["door_ms"] = (requests[before + 3].received_us - door_start) / 1000.0;
+        r.metrics["attempts"] = static_cast<double>(requests.size() - before);
+        r.ok = r.metrics["chunked_decoded"] == 1 && r.metrics["reconnects_kept_alive"] == 0 && r.metrics["attempts"] == 4
+            && r.metrics["door_ms"] < HTTPS_CONNECTION_TIMEOUT_MS / 2;
+    }
+#endif
+
+    // Every response takes slow_ms. A door ring right after an apartment ring arrives while the first
+    // notification is in flight; it must be classified and queued without losing edges.
+    void scenario_slow_network(const options& opts, result& r, int64_t slow_ms)
+    {
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+        uint32_t overflows_before = sensors.journal.overflows();
+#endif
+        size_t before = sim::http_server::request_count(notify_path);
+        sim::http_server::set_response_delay(slow_ms * 1000);
+        int64_t ring_start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        int64_t door_start = sim::clock::now_us();
+        drive_ring(door_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(before + 2, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        auto requests = sim::http_server::requests(notify_path);
+        r.samples.push_back((requests[before].received_us - ring_start) / 1000.0);
+        r.metrics["door_ms"] = (requests[before + 1].received_us - door_start) / 1000.0;
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+        r.metrics["edges_dropped"] = static_cast<double>(sensors.journal.overflows() - overflows_before);
+#endif
+        sim::http_server::set_response_delay(0);
+    }
+
+    // A ring wakes the chip from power-on and the door bell rings while Wi-Fi is still connecting. The
+    // server answers 503 a few times, and the apartment rings again during the backoff, past the cooldown.
+    // All three events should reach the chat in one successful request.
+    void scenario_burst(const options& opts, result& r, int failures)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_EXT0);
+        sim::gpio::preset(ring_pin, wake_level);
+        sim::http_server::fail_requests(failures, 503, notify_path);
+        int64_t start = sim::clock::now_us();
+        sim::boot(app_main);
+        sim::clock::sleep_for(ring_signal.lead_in_us + opts.pulses_per_ring * ring_signal.period_us);
+        sim::gpio::drive(ring_pin, idle_level);
+        sim::clock::sleep_for(50000);
+        drive_ring(door_pin, opts.pulses_per_ring);
+
+        int64_t repeat_at = start + (CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL;
+        sim::clock::sleep_for(repeat_at - sim::clock::now_us());
+        drive_ring(ring_pin, opts.pulses_per_ring);
+
+        if(!sim::http_server::wait_for_requests(failures + 1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        // Give a request that should not exist the chance to show up.
+        sim::clock::sleep_for(2000000);
+        auto requests = sim::http_server::requests(notify_path);
+        const std::string& body = requests[failures].body;
+        r.ok = body.find("Intercom Ring! (2 times in") != std::string::npos && body.find("\\nDoor Bell Ring!") != std::string::npos;
+        if(!r.ok)
+        {
+            fprintf(stderr, "burst: unexpected body %s\n", body.c_str());
+        }
+        r.samples.push_back((requests[failures].received_us - start) / 1000.0);
+        r.metrics["requests"] = static_cast<double>(requests.size());
+        r.metrics["delivered_requests"] = static_cast<double>(requests.size() - failures);
+    }
+
+    void scenario_cold_ring(const options& opts, result& r, bool reject_sessions)
+    {
+        if(reject_sessions)
+        {
+            sim::net::reject_sessions();
+        }
+        // The line is still at the wake level when the chip comes out of deep sleep on EXT0.
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_EXT0);
+        sim::gpio::preset(ring_pin, wake_level);
+        int64_t start = sim::clock::now_us();
+        sim::boot(app_main);
+        sim::clock::sleep_for(ring_signal.lead_in_us + opts.pulses_per_ring * ring_signal.period_us);
+        sim::gpio::drive(ring_pin, idle_level);
+
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        r.samples.push_back((sim::http_server::requests(notify_path)[0].received_us - start) / 1000.0);
+        // Skips the idle rest of the wake. It ends in deep sleep, which records the last timing probe.
+        settle();
+        sim::clock::advance(CONFIG_INTERCOM_DEEP_SLEEP_DELAY * 1000000LL);
+        if(!sim::wait_for([]() { return sim::sleep::entered(); }, request_timeout_us))
+        {
+            r.ok = false;
+            return;
+        }
+
+        const tls_handshake_stats& tls = telegram_tls_session.stats;
+        r.metrics["tls_full"] = tls.full;
+        r.metrics["tls_resumed"] = tls.resumed;
+        r.metrics["tls_rejected"] = tls.rejected;
+        r.metrics["tls_full_ms"] = tls.full ? tls.full_us / 1000.0 / tls.full : 0;
+        r.metrics["tls_resumed_ms"] = tls.resumed ? tls.resumed_us / 1000.0 / tls.resumed : 0;
+        r.metrics["dhcp"] = static_cast<double>(sim::wifi::dhcp_count());
+        r.metrics["nvs_writes"] = static_cast<double>(sim::nvs::write_count());
+        r.metrics["full_calibrations"] = static_cast<double>(sim::wifi::full_calibrations());
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+        for(uint8_t e = 0; e < static_cast<uint8_t>(energy_state::count); e++)
+        {
+            r.metrics[std::string("energy_wake_ms_") + energy_state_name(static_cast<energy_state>(e))] = energy_account.wake.state_us[e] / 1000.0;
+        }
+        r.metrics["energy_wake_uah"] = energy_account.wake.charge_uc / 3600.0;
+        r.metrics["energy_total_mah"] = energy_account.total.charge_uc / static_cast<double>(ENERGY_MAH_UC);
+        r.metrics["energy_sleep_s"] = energy_account.total.state_us[static_cast<size_t>(energy_state::deep_sleep)] / 1e6;
+        r.metrics["energy_wakes"] = energy_account.total.wakes;
+        r.metrics["energy_wakes_today"] = energy_account.today.wakes;
+        r.metrics["energy_wakes_yesterday"] = energy_account.yesterday.wakes;
+        // Average current of the wake itself, deep sleep left out: uC per ms is mA.
+        uint64_t awake_us = 0;
+        for(uint8_t e = static_cast<uint8_t>(energy_state::cpu_active); e < static_cast<uint8_t>(energy_state::count); e++)
+        {
+            awake_us += energy_account.wake.state_us[e];
+        }
+        uint64_t sleep_uc = energy_charge_uc(energy_state::deep_sleep, energy_account.wake.state_us[static_cast<size_t>(energy_state::deep_sleep)]);
+        r.metrics["energy_awake_ma"] = awake_us > 0 ? (energy_account.wake.charge_uc - sleep_uc) / (awake_us / 1000.0) : 0;
+#endif
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+        sim::power::light_sleep_stats light = sim::power::light_sleep();
+        r.metrics["light_sleeps"] = static_cast<double>(light.sleeps);
+        r.metrics["light_slept_ms"] = light.slept_us / 1000.0;
+        r.metrics["light_listen_ms"] = light.beacon_listen_us / 1000.0;
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+        r.metrics["mqtt_published"] = mqtt_session.published;
+        r.metrics["mqtt_resumed"] = mqtt_session.sessions_resumed;
+        r.metrics["mqtt_new"] = mqtt_session.sessions_new;
+#endif
+    }
+
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    // Waits until the broker has acknowledged count messages since power-on, as the firmware counts them, so
+    // it works against any broker.
+    bool wait_for_mqtt_acks(uint32_t count)
+    {
+        return sim::wait_for([count]() { return mqtt_session.magic == MQTT_SESSION_MAGIC && mqtt_session.published >= count; }, request_timeout_us);
+    }
+
+    // A ring goes to Telegram and to the broker. The connection then idles past half the keep-alive interval
+    // and must be pinged rather than dropped.
+    void scenario_mqtt_ring(const options& opts, result& r)
+    {
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!wait_for_mqtt_acks(1))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+
+        uint32_t acked = mqtt_session.published;
+        size_t requests = sim::http_server::request_count(notify_path);
+        int64_t start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!wait_for_mqtt_acks(acked + 1) || !sim::http_server::wait_for_requests(requests + 1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        r.samples.push_back((sim::clock::now_us() - start) / 1000.0);
+        if(opts.mqtt_broker_port > 0)
+        {
+            return;
+        }
+
+        const std::string topic = CONFIG_INTERCOM_MQTT_TOPIC "/" + std::string(sensor_channels[sensor_channel_ring].name);
+        auto messages = sim::mqtt_broker::messages(topic);
+        r.ok = messages.size() == 1 && messages[0].qos == 1 && messages[0].payload.find("\"event\":\"ring\"") != std::string::npos
+            && messages[0].payload.find("\"count\":1") != std::string::npos;
+        if(!r.ok)
+        {
+            fprintf(stderr, "mqtt: unexpected messages on %s: %zu, %s\n", topic.c_str(), messages.size(),
+                messages.empty() ? "" : messages.back().payload.c_str());
+            return;
+        }
+        // Latency to the moment the broker had the message, not to its acknowledgement.
+        r.samples.back() = (messages[0].received_us - start) / 1000.0;
+
+        // Not long enough for deep sleep.
+        sim::clock::advance((CONFIG_INTERCOM_MQTT_KEEP_ALIVE / 2 + 1) * 1000000LL);
+        r.ok = sim::wait_for([]() { return sim::mqtt_broker::pings() > 0; }, 3000000);
+        sim::clock::sleep_for(100000);
+        r.metrics["pings"] = static_cast<double>(sim::mqtt_broker::pings());
+        r.metrics["connections"] = static_cast<double>(sim::mqtt_broker::connections());
+    }
+
+    // The broker takes a PUBLISH and drops the connection before its PUBACK. The firmware must reconnect into
+    // the same session and send the message again with its packet identifier and the DUP flag.
+    void scenario_mqtt_redelivery(const options& opts, result& r)
+    {
+        if(!boot_awake())
+        {
+            r.ok = false;
+            return;
+        }
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!wait_for_mqtt_acks(1))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+
+        const std::string topic = CONFIG_INTERCOM_MQTT_TOPIC "/" + std::string(sensor_channels[sensor_channel_ring].name);
+        uint32_t acked = mqtt_session.published;
+        uint64_t resumed = sim::mqtt_broker::sessions_resumed();
+        sim::mqtt_broker::drop_publishes(1);
+        int64_t start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!wait_for_mqtt_acks(acked + 1))
+        {
+            r.ok = false;
+            return;
+        }
+        auto messages = sim::mqtt_broker::messages(topic);
+        r.ok = messages.size() == 2 && !messages[0].dup && messages[1].dup && messages[0].packet_id == messages[1].packet_id
+            && sim::mqtt_broker::sessions_resumed() == resumed + 1 && mqtt_session.redelivered == 1;
+        if(!r.ok)
+        {
+            fprintf(stderr, "mqtt redelivery: %zu message(s) on %s, %u redelivered\n", messages.size(), topic.c_str(),
+                static_cast<unsigned>(mqtt_session.redelivered));
+            return;
+        }
+        r.samples.push_back((messages[1].received_us - start) / 1000.0);
+    }
+#endif
+
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    // Reads the timing probes the firmware left in RTC memory, like the report it logs before deep sleep.
+    void read_wake_profile(result& r, uint16_t cycles)
+    {
+        for(uint8_t p = 0; p < static_cast<uint8_t>(wake_phase::count); p++)
+        {
+            wake_phase phase = static_cast<wake_phase>(p);
+            wake_phase_summary summary = wake_profile_summarize(wake_profile, phase, cycles);
+            std::string name = wake_phase_name(phase);
+            r.metrics[name + "_n"] = summary.count;
+            r.metrics[name + "_p50"] = summary.p50_us / 1000.0;
+            r.metrics[name + "_p90"] = summary.p90_us / 1000.0;
+            r.metrics[name + "_max"] = summary.max_us / 1000.0;
+        }
+    }
+#endif
+
+#if CONFIG_INTERCOM_EVENT_LOG
+    // Reads the whole event history the way the firmware would, flash and the records still pending in RTC memory.
+    void read_event_history(result& r, const std::string& dump_path)
+    {
+        event_history.begin(event_history_state);
+        r.metrics["pending"] = event_history_state.pending_count;
+        size_t total = event_history.query(0, UINT32_MAX, [&r](const event_record& record)
+        {
+            // Sensor records count per channel, e.g. events_ring.
+            const char* name = record.kind == event_kind::sensor ? sensor_channel_name(EVENT_FLAGS_CHANNEL(record.flags)) : event_kind_name(record.kind);
+            r.metrics[std::string("events_") + name]++;
+            return true;
+        });
+        r.metrics["events"] = static_cast<double>(total);
+
+        if(!dump_path.empty())
+        {
+            std::string image = sim::flash::partition_image(EVENT_LOG_PARTITION_LABEL);
+            FILE *dump = fopen(dump_path.c_str(), "wb");
+            if(dump == nullptr || fwrite(image.data(), 1, image.size(), dump) != image.size())
+            {
+                perror(dump_path.c_str());
+                r.ok = false;
+            }
+            if(dump != nullptr)
+            {
+                fclose(dump);
+            }
+        }
+    }
+
+    // An event log partition in memory with the semantics of NOR flash: erasing sets a sector to 0xff, writing
+    // only clears bits. The power can be cut after a given number of bytes, in the middle of a write or erase.
+    struct nor_partition
+    {
+        std::vector<uint8_t> bytes;
+        std::vector<uint32_t> sector_erases;
+        // Bytes still written or erased before the power goes, -1 for none.
+        int64_t power_left = -1;
+        bool powered = true;
+
+        explicit nor_partition(size_t size) : bytes(size, 0xff), sector_erases(size / EVENT_LOG_SEGMENT_SIZE, 0)
+        {
+        }
+
+        // How much of an operation of length bytes gets done before the power goes.
+        size_t allow(size_t length)
+        {
+            if(power_left < 0 || static_cast<int64_t>(length) <= power_left)
+            {
+                power_left -= power_left < 0 ? 0 : static_cast<int64_t>(length);
+                return length;
+            }
+            size_t done = static_cast<size_t>(power_left);
+            power_left = -1;
+            powered = false;
+            return done;
+        }
+
+        event_log_storage storage()
+        {
+            event_log_storage target = {};
+            target.context = this;
+            target.size = bytes.size();
+            target.read = [](void* context, size_t offset, void* data, size_t length)
+            {
+                nor_partition& flash = *static_cast<nor_partition*>(context);
+                memcpy(data, flash.bytes.data() + offset, length);
+                return ESP_OK;
+            };
+            target.write = [](void* context, size_t offset, const void* data, size_t length)
+            {
+                nor_partition& flash = *static_cast<nor_partition*>(context);
+                if(!flash.powered)
+                {
+                    return ESP_FAIL;
+                }
+                size_t done = flash.allow(length);
+                for(size_t i = 0; i < done; i++)
+                {
+                    flash.bytes[offset + i] &= static_cast<const uint8_t*>(data)[i];
+                }
+                return done == length ? ESP_OK : ESP_FAIL;
+            };
+            target.erase = [](void* context, size_t offset, size_t length)
+            {
+                nor_partition& flash = *static_cast<nor_partition*>(context);
+                if(!flash.powered)
+                {
+                    return ESP_FAIL;
+                }
+                // An erase cut short leaves part of the sector as it was.
+                size_t done = flash.allow(length);
+                std::fill(flash.bytes.begin() + offset, flash.bytes.begin() + offset + done, 0xff);
+                for(size_t sector = offset / EVENT_LOG_SEGMENT_SIZE; sector < (offset + length) / EVENT_LOG_SEGMENT_SIZE; sector++)
+                {
+                    flash.sector_erases[sector]++;
+                }
+                return done == length ? ESP_OK : ESP_FAIL;
+            };
+            return target;
+        }
+    };
+
+    /*
+        Appends records in batches like the firmware does on its way to deep sleep, several times around the
+        ring, and cuts the power at random points of a write or erase now and then. After every cut the log
+        is scanned from scratch, as after a power loss, and must hold exactly the records written before the
+        cut, minus the oldest segments, plus whatever records of the interrupted batch made it to flash
+        complete. Random time range queries are checked against the same records filtered by brute force.
+    */
+    void event_log_stress(const options& opts, result& r)
+    {
+        const size_t partition_size = 0x20000;
+        const size_t segments = partition_size / EVENT_LOG_SEGMENT_SIZE;
+        nor_partition flash(partition_size);
+        std::mt19937 rng(1234);
+
+        // Every record that reached flash, in write order. The log must hold a suffix of it.
+        std::vector<event_record> written;
+        event_log_cursor cursor = {};
+        uint32_t time_s = 0;
+        uint32_t serial = 0;
+        uint64_t power_cuts = 0;
+        uint64_t check_errors = 0;
+        uint64_t queries = 0;
+        uint64_t segments_read = 0;
+        uint64_t segments_holding = 0;
+        uint64_t sealed_checked = 0;
+
+        // Reads the log back after a scan and checks it against the tail of written. Returns what it holds.
+        auto check_log = [&](event_log_store& store)
+        {
+            std::vector<event_record> held;
+            store.query(0, UINT32_MAX, [&held](const event_record& record)
+            {
+                held.push_back(record);
+                return true;
+            });
+            bool suffix = held.size() <= written.size()
+                && std::equal(held.begin(), held.end(), written.end() - held.size(), [](const event_record& a, const event_record& b)
+                {
+                    return memcmp(&a, &b, sizeof(a)) == 0;
+                });
+            // Everything but the segment being erased and the open one stays, less the slots of torn records.
+            size_t retained = std::min(written.size(), (segments - 2) * EVENT_LOG_RECORDS_PER_SEGMENT - power_cuts);
+            if(!suffix || held.size() < retained)
+            {
+                check_errors++;
+            }
+            for(size_t index = 0; index < store.segments(); index++)
+            {
+                if(store.segment(index).state == event_segment_state::sealed)
+                {
+                    sealed_checked++;
+                    check_errors += store.verify(index) == ESP_OK ? 0 : 1;
+                }
+            }
+            return held;
+        };
+
+        auto check_queries = [&](event_log_store& store, const std::vector<event_record>& held, int count)
+        {
+            for(int q = 0; q < count && !held.empty(); q++)
+            {
+                uint32_t from_s = std::uniform_int_distribution<uint32_t>(0, time_s)(rng);
+                uint32_t to_s = from_s + std::uniform_int_distribution<uint32_t>(0, 3600)(rng);
+                std::vector<uint32_t> expected;
+                for(const event_record& record : held)
+                {
+                    if(record.time_s >= from_s && record.time_s <= to_s)
+                    {
+                        expected.push_back(record.value);
+                    }
+                }
+                std::vector<uint32_t> found;
+                size_t read = 0;
+                store.query(from_s, to_s, [&found](const event_record& record)
+                {
+                    found.push_back(record.value);
+                    return true;
+                }, &read);
+                queries++;
+                segments_read += read;
+                check_errors += found == expected ? 0 : 1;
+            }
+            for(size_t index = 0; index < store.segments(); index++)
+            {
+                segments_holding += store.segment(index).count > 0 ? 1 : 0;
+            }
+        };
+
+        while(serial < static_cast<uint32_t>(opts.event_records))
+        {
+            event_record batch[EVENT_LOG_PENDING];
+            size_t count = std::uniform_int_distribution<size_t>(1, EVENT_LOG_PENDING)(rng);
+            for(size_t i = 0; i < count; i++)
+            {
+                time_s += std::uniform_int_distribution<uint32_t>(0, 40)(rng);
+                batch[i] = {time_s, static_cast<uint16_t>(serial % 1000), event_kind::sensor, 0, serial, static_cast<uint16_t>(serial / 8), 0};
+                event_record_seal(batch[i]);
+                serial++;
+            }
+
+            // One batch in fifty loses the power, mostly within its records, otherwise within the erase or the
+            // footer of a segment change, if the batch makes one.
+            // The last trip around the ring runs without, so the final queries see one clock, as between power losses.
+            bool last_trip = serial + segments * EVENT_LOG_RECORDS_PER_SEGMENT >= static_cast<uint32_t>(opts.event_records);
+            int cut = last_trip ? 200 : std::uniform_int_distribution<int>(0, 199)(rng);
+            if(cut < 3)
+            {
+                flash.power_left = std::uniform_int_distribution<int64_t>(0, count * sizeof(event_record) - 1)(rng);
+            }
+            else if(cut == 3)
+            {
+                flash.power_left = std::uniform_int_distribution<int64_t>(0, EVENT_LOG_SEGMENT_SIZE + 2 * sizeof(event_record))(rng);
+            }
+
+            event_log_store store;
+            store.attach(flash.storage());
+            esp_err_t err = store.resume(cursor);
+            if(err == ESP_OK)
+            {
+                err = store.append(batch, count);
+            }
+            if(err == ESP_OK)
+            {
+                cursor = store.position();
+                written.insert(written.end(), batch, batch + count);
+                flash.power_left = -1;
+                continue;
+            }
+
+            // Power loss: RTC memory and its cursor are gone, the clock starts over.
+            power_cuts++;
+            flash.powered = true;
+            flash.power_left = -1;
+            cursor = {};
+            time_s = 0;
+            event_log_store rebooted;
+            rebooted.attach(flash.storage());
+            if(rebooted.scan() != ESP_OK)
+            {
+                check_errors++;
+                break;
+            }
+            // The records of the batch that were written out whole before the cut count as written.
+            std::vector<event_record> held;
+            rebooted.query(0, UINT32_MAX, [&held](const event_record& record)
+            {
+                held.push_back(record);
+                return true;
+            });
+            for(size_t i = 0; i < count && !held.empty(); i++)
+            {
+                if(std::any_of(held.end() - std::min<size_t>(held.size(), count), held.end(), [&](const event_record& record)
+                {
+                    return record.value == batch[i].value;
+                }))
+                {
+                    written.push_back(batch[i]);
+                }
+            }
+            held = check_log(rebooted);
+            check_queries(rebooted, held, 20);
+        }
+
+        event_log_store final_store;
+        final_store.attach(flash.storage());
+        final_store.scan();
+        std::vector<event_record> held = check_log(final_store);
+        uint64_t recovery_queries = queries;
+        queries = 0;
+        segments_read = 0;
+        segments_holding = 0;
+        check_queries(final_store, held, 2000);
+
+        auto [fewest, most] = std::minmax_element(flash.sector_erases.begin(), flash.sector_erases.end());
+        r.metrics["records"] = serial;
+        r.metrics["written"] = static_cast<double>(written.size());
+        r.metrics["held"] = static_cast<double>(held.size());
+        r.metrics["power_cuts"] = static_cast<double>(power_cuts);
+        r.metrics["queries"] = static_cast<double>(recovery_queries + queries);
+        r.metrics["segments_read"] = queries ? static_cast<double>(segments_read) / queries : 0;
+        r.metrics["segments_holding"] = static_cast<double>(segments_holding);
+        r.metrics["sealed_checked"] = static_cast<double>(sealed_checked);
+        r.metrics["erases_min"] = *fewest;
+        r.metrics["erases_max"] = *most;
+        r.metrics["check_errors"] = static_cast<double>(check_errors);
+        // Every sector is erased once per trip around the ring; a cut erase is repeated.
+        r.ok = check_errors == 0 && *most - *fewest <= 2;
+    }
+#endif
+
+    void scenario_edge_storm(const options& opts, result& r)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+        settle();
+        sim::clock::advance((CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN + 500) * 1000LL);
+
+        size_t expected = sim::http_server::request_count(notify_path) + 1;
+        uint64_t waits_before = sim::stats::event_group_waits();
+        uint64_t isr_count_before = sim::gpio::isr_count();
+        uint64_t isr_time_before = sim::gpio::isr_time_ns();
+        uint64_t interrupts_before = interrupt_count();
+
+        auto wall_start = std::chrono::steady_clock::now();
+        for(int i = 0; i < opts.storm_edges; i++)
+        {
+            sim::gpio::drive(ring_pin, i % 2 == 0 ? wake_level : idle_level);
+        }
+        sim::gpio::drive(ring_pin, idle_level);
+        double storm_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+        // The storm itself has no ring signature. A real ring right after it must still get through.
+        settle();
+        int64_t start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+
+        if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+
+        settle();
+        uint64_t loop_wakeups = sim::stats::event_group_waits() - waits_before;
+        uint64_t isr_count = sim::gpio::isr_count() - isr_count_before;
+        r.samples.push_back((sim::http_server::requests(notify_path)[expected - 1].received_us - start) / 1000.0);
+        r.metrics["edges"] = static_cast<double>(opts.storm_edges);
+        r.metrics["storm_s"] = storm_s;
+        r.metrics["edges_per_s"] = opts.storm_edges / storm_s;
+        r.metrics["loop_wakeups"] = static_cast<double>(loop_wakeups);
+        r.metrics["loop_wakeups_per_s"] = loop_wakeups / storm_s;
+        r.metrics["isr_ns_avg"] = isr_count ? static_cast<double>(sim::gpio::isr_time_ns() - isr_time_before) / isr_count : 0;
+        r.metrics["interrupts"] = static_cast<double>(interrupt_count() - interrupts_before);
+        r.metrics["notifications"] = static_cast<double>(sim::http_server::request_count(notify_path) - expected + 1);
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+        r.metrics["journal_recorded"] = static_cast<double>(sensors.journal.recorded());
+        r.metrics["journal_overflows"] = static_cast<double>(sensors.journal.overflows());
+        r.metrics["journal_high_watermark"] = static_cast<double>(sensors.journal.high_watermark());
+#endif
+    }
+
+    // Wakes on the timer with Wi-Fi off, feeds line noise and then one real ring.
+    // Noise must not bring Wi-Fi up; the ring must, and its latency includes the connection.
+    void scenario_noise(const options& opts, result& r)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_TIMER);
+        sim::boot(app_main);
+        settle();
+
+        std::mt19937 rng(1234);
+        drive_noise(opts.noise_ms * 1000LL, rng);
+        settle();
+        r.metrics["wifi_starts_on_noise"] = static_cast<double>(sim::wifi::start_count());
+        r.metrics["notifications_on_noise"] = static_cast<double>(sim::http_server::request_count(notify_path));
+
+        int64_t start = sim::clock::now_us();
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        r.samples.push_back((sim::http_server::requests(notify_path)[0].received_us - start) / 1000.0);
+    }
+
+#if CONFIG_INTERCOM_AUDIO_CLIP
+    const double audio_tone_hz = 440;
+    // Mid-range bias and the amplitude of the tone, in ADC counts.
+    const int audio_bias_counts = 2048;
+    const int audio_tone_counts = 600;
+
+    // Share of the power of samples[begin, end) in the Goertzel bin of tone_hz.
+    double tone_share(const std::vector<int16_t>& samples, size_t begin, size_t end, double tone_hz)
+    {
+        double coefficient = 2 * std::cos(2 * M_PI * tone_hz / CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ);
+        double s1 = 0;
+        double s2 = 0;
+        double energy = 0;
+        for(size_t i = begin; i < end; i++)
+        {
+            double s0 = samples[i] + coefficient * s1 - s2;
+            s2 = s1;
+            s1 = s0;
+            energy += static_cast<double>(samples[i]) * samples[i];
+        }
+        double power = s1 * s1 + s2 * s2 - coefficient * s1 * s2;
+        return energy > 0 ? 2 * power / (static_cast<double>(end - begin) * energy) : 0;
+    }
+
+    double rms(const std::vector<int16_t>& samples, size_t begin, size_t end)
+    {
+        double energy = 0;
+        for(size_t i = begin; i < end; i++)
+        {
+            energy += static_cast<double>(samples[i]) * samples[i];
+        }
+        return end > begin ? std::sqrt(energy / static_cast<double>(end - begin)) : 0;
+    }
+
+    // A ring with a voice on the audio line, stood in for by a tone from the ring on and silence before it. The
+    // clip must follow the notification as a WAV document, reach back before the ring and carry the tone.
+    void scenario_audio_clip(const options& opts, result& r)
+    {
+        auto tone_start = std::make_shared<std::atomic<int64_t>>(INT64_MAX);
+        sim::adc::set_waveform(CONFIG_INTERCOM_AUDIO_GPIO_PIN, [tone_start](int64_t t)
+        {
+            int64_t start = tone_start->load();
+            return t < start ? audio_bias_counts
+                : audio_bias_counts + static_cast<int>(std::lround(audio_tone_counts * std::sin(2 * M_PI * audio_tone_hz * static_cast<double>(t - start) / 1e6)));
+        });
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+        // Recorded in real time, so the history before the ring is there to keep.
+        sim::clock::sleep_for((CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS + 500) * 1000LL);
+
+        size_t expected = sim::http_server::request_count(notify_path) + 1;
+        tone_start->store(sim::clock::now_us());
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path)
+            || !sim::http_server::wait_for_requests(1, CONFIG_INTERCOM_AUDIO_CLIP_MS * 1000LL + request_timeout_us, "/sendDocument"))
+        {
+            r.ok = false;
+            return;
+        }
+        sim::http_server::request notification = sim::http_server::requests(notify_path)[expected - 1];
+        sim::http_server::request upload = sim::http_server::requests("/sendDocument")[0];
+
+        // The file part, up to the closing boundary.
+        size_t file_head = upload.body.find("filename=");
+        size_t file_start = file_head == std::string::npos ? std::string::npos : upload.body.find("\r\n\r\n", file_head);
+        size_t file_end = upload.body.rfind("\r\n--");
+        if(file_start == std::string::npos || file_end == std::string::npos || file_end < file_start + 4 + IMA_ADPCM_WAV_HEADER_BYTES)
+        {
+            fprintf(stderr, "audio clip: no WAV file in the sendDocument body\n");
+            r.ok = false;
+            return;
+        }
+        std::string wav = upload.body.substr(file_start + 4, file_end - file_start - 4);
+        uint32_t blocks = static_cast<uint32_t>((wav.size() - IMA_ADPCM_WAV_HEADER_BYTES) / IMA_ADPCM_BLOCK_BYTES);
+        uint8_t header[IMA_ADPCM_WAV_HEADER_BYTES];
+        ima_adpcm_wav_header(header, CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ, blocks);
+        if(wav.size() != IMA_ADPCM_WAV_HEADER_BYTES + blocks * IMA_ADPCM_BLOCK_BYTES || memcmp(wav.data(), header, sizeof(header)) != 0)
+        {
+            fprintf(stderr, "audio clip: WAV file of %zu bytes does not match its header\n", wav.size());
+            r.ok = false;
+            return;
+        }
+
+        std::vector<int16_t> samples(static_cast<size_t>(blocks) * IMA_ADPCM_BLOCK_SAMPLES);
+        for(uint32_t i = 0; i < blocks; i++)
+        {
+            ima_adpcm_decode_block(reinterpret_cast<const uint8_t*>(wav.data()) + IMA_ADPCM_WAV_HEADER_BYTES + i * IMA_ADPCM_BLOCK_BYTES,
+                samples.data() + static_cast<size_t>(i) * IMA_ADPCM_BLOCK_SAMPLES);
+        }
+        // The tone starts with the ring; anything a third of its amplitude is it.
+        size_t onset = 0;
+        while(onset < samples.size() && std::abs(samples[onset]) < audio_tone_counts * 16 / 3)
+        {
+            onset++;
+        }
+        const size_t rate = CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ;
+        double pre_ms = onset * 1000.0 / rate;
+        double tone = onset + rate + rate / 2 <= samples.size() ? tone_share(samples, onset + rate / 2, onset + rate + rate / 2, audio_tone_hz) : 0;
+        double before_rms = onset > rate / 10 ? rms(samples, 0, onset - rate / 20) : 0;
+        double after_rms = onset + rate + rate / 2 <= samples.size() ? rms(samples, onset + rate / 2, onset + rate + rate / 2) : 0;
+
+        r.metrics["clip_ms"] = samples.size() * 1000.0 / rate;
+        r.metrics["pre_ms"] = pre_ms;
+        const https_upload_stats& stats = telegram_connection.upload_stats();
+        r.metrics["bytes"] = static_cast<double>(upload.body.size());
+        r.metrics["upload_kib_s"] = stats.duration_us > 0 ? stats.bytes * 1e6 / 1024 / static_cast<double>(stats.duration_us) : 0;
+        r.metrics["upload_heap"] = static_cast<double>(stats.heap_used);
+        r.metrics["after_notification_ms"] = (upload.received_us - notification.received_us) / 1000.0;
+        r.metrics["tone_share"] = tone;
+        r.metrics["snr_db"] = before_rms > 0 ? 20 * std::log10(after_rms / before_rms) : 0;
+        r.metrics["psram_kib"] = sim::heap::psram().peak / 1024.0;
+        r.metrics["internal_bytes"] = static_cast<double>(sim::heap::internal().peak);
+        r.metrics["dropped_frames"] = static_cast<double>(sim::adc::dropped_frames());
+        r.samples.push_back((upload.received_us - tone_start->load()) / 1000.0);
+
+        // Whole pre-trigger history, give or take a block each way, the tone clean after the ring.
+        double block_ms = IMA_ADPCM_BLOCK_SAMPLES * 1000.0 / rate;
+        r.ok = onset < samples.size() && pre_ms > CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS - block_ms
+            && pre_ms < CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS + 3 * block_ms
+            && r.metrics["clip_ms"] >= CONFIG_INTERCOM_AUDIO_CLIP_MS && tone > 0.9
+            && upload.chunked && stats.bytes == static_cast<int>(upload.body.size());
+    }
+#endif
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    // Sends a command to the bot and waits for the reply, which goes to sendMessage like a notification but without
+    // parse_mode. Returns the reply body, or an empty string, and the round trip from the command in sample_ms.
+    std::string command_round_trip(const std::string& text, long long chat_id, double& sample_ms)
+    {
+        size_t expected = sim::http_server::request_count(notify_path) + 1;
+        int64_t sent = sim::clock::now_us();
+        sim::http_server::post_update(text, chat_id);
+        if(!sim::http_server::wait_for_requests(expected, request_timeout_us, notify_path))
+        {
+            fprintf(stderr, "commands: no reply to %s\n", text.c_str());
+            return "";
+        }
+        sim::http_server::request reply = sim::http_server::requests(notify_path)[expected - 1];
+        if(reply.body.find("parse_mode") != std::string::npos)
+        {
+            fprintf(stderr, "commands: a notification in place of the reply to %s\n", text.c_str());
+            return "";
+        }
+        sample_ms = (reply.received_us - sent) / 1000.0;
+        return reply.body;
+    }
+
+    // Commands sent while a long poll waits: /status round trips, /mute as a group chat sends it with escapes in the
+    // text, a ring it silences, a command from another chat that is ignored, and /awake 0, which must put the chip to
+    // sleep without waiting for the poll that is parked.
+    void scenario_commands(const options& opts, result& r)
+    {
+        const long long chat_id = std::atoll(CONFIG_INTERCOM_TELEGRAM_CHAT_ID);
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+        sim::boot(app_main);
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, "/getUpdates"))
+        {
+            r.ok = false;
+            return;
+        }
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+#endif
+        settle();
+
+        for(int i = 0; i < 5; i++)
+        {
+            double sample_ms = 0;
+            std::string reply = command_round_trip("/status", chat_id, sample_ms);
+            if(reply.find("Awake for") == std::string::npos)
+            {
+                r.ok = false;
+                return;
+            }
+            r.samples.push_back(sample_ms);
+            settle();
+        }
+
+        // Only the command from the own chat is answered, and the other chat's /mute does not take.
+        double ignored_ms = 0;
+        sim::http_server::post_update("/mute 60", chat_id + 1);
+        std::string status = command_round_trip("/status", chat_id, ignored_ms);
+        bool foreign_ignored = !status.empty() && status.find("Muted") == std::string::npos;
+
+        double mute_ms = 0;
+        std::string muted = command_round_trip("/mute@IntercomListenerBot 5 \"right away\"\n\xc3\xa9", chat_id, mute_ms);
+        size_t notifications = sim::http_server::request_count(notify_path);
+        drive_ring(ring_pin, opts.pulses_per_ring);
+        sim::clock::sleep_for(2000000);
+        bool ring_muted = sim::http_server::request_count(notify_path) == notifications;
+
+        double awake_ms = 0;
+        std::string awake = command_round_trip("/awake 0", chat_id, awake_ms);
+        int64_t replied = sim::clock::now_us();
+        bool slept = sim::wait_for([]() { return sim::sleep::entered(); }, CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S * 1000000LL);
+
+        r.metrics["mute_ms"] = mute_ms;
+        r.metrics["awake_ms"] = awake_ms;
+        r.metrics["sleep_after_ms"] = (sim::clock::now_us() - replied) / 1000.0;
+        r.metrics["polls"] = static_cast<double>(sim::http_server::request_count("/getUpdates"));
+        r.ok = foreign_ignored && muted.find("Muted for 5 min.") != std::string::npos && ring_muted
+            && awake.find("Sleeping in") != std::string::npos && slept;
+        if(!r.ok)
+        {
+            fprintf(stderr, "commands: other chat %s, mute reply %s, ring %s, awake reply %s, %s\n", foreign_ignored ? "ignored" : "obeyed",
+                muted.c_str(), ring_muted ? "muted" : "notified", awake.c_str(), slept ? "asleep" : "still awake");
+        }
+    }
+#endif
+
+#if CONFIG_INTERCOM_OUTBOX
+    enum class outbox_wake
+    {
+        // Power-on without Wi-Fi: the boot notification and a ring are kept.
+        offline_boot,
+        // The server answers 503 until the deadline: a ring and a door ring are kept along with the backlog.
+        unavailable,
+        // Without Wi-Fi again: the ring no longer fits RTC memory, which spills to NVS.
+        offline,
+        // Everything works: the backlog goes out once, next to the ring of the wake.
+        online,
+        // Every request goes out but no response comes back: the backlog and the ring stay, unconfirmed.
+        lost
+    };
+
+    // One wake of the outbox scenario. The chip wakes on a ring, except for offline_boot, which powers on and rings
+    // once awake. The wake ends in deep sleep.
+    void scenario_outbox(const options& opts, result& r, outbox_wake wake)
+    {
+        bool offline = wake == outbox_wake::offline_boot || wake == outbox_wake::offline;
+        if(offline)
+        {
+            sim::wifi::model wifi = opts.wifi;
+            wifi.failed_attempts = 1000;
+            sim::wifi::configure(wifi);
+        }
+        if(wake == outbox_wake::unavailable)
+        {
+            sim::http_server::set_status(503);
+        }
+        if(wake == outbox_wake::lost)
+        {
+            sim::http_server::fail_requests(1000, 0, notify_path);
+        }
+
+        int64_t start = sim::clock::now_us();
+        if(wake == outbox_wake::offline_boot)
+        {
+            sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_UNDEFINED);
+            sim::boot(app_main);
+            settle();
+            drive_ring(ring_pin, opts.pulses_per_ring);
+        }
+        else
+        {
+            sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_EXT0);
+            sim::gpio::preset(ring_pin, wake_level);
+            sim::boot(app_main);
+            sim::clock::sleep_for(ring_signal.lead_in_us + opts.pulses_per_ring * ring_signal.period_us);
+            sim::gpio::drive(ring_pin, idle_level);
+        }
+
+        if(offline)
+        {
+            // Sleep must not wait out the notification deadline once the station gave up.
+            if(!sim::wait_for([]() { return wifi_failed; }, request_timeout_us))
+            {
+                r.ok = false;
+                return;
+            }
+            settle();
+            sim::clock::advance(CONFIG_INTERCOM_DEEP_SLEEP_DELAY * 1000000LL);
+        }
+        else if(wake == outbox_wake::unavailable)
+        {
+            if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+            {
+                r.ok = false;
+                return;
+            }
+            settle();
+            drive_ring(door_pin, opts.pulses_per_ring);
+            // The door ring has to be attempted before the deadline is skipped.
+            int64_t door_timeout = sim::clock::now_us() + request_timeout_us;
+            auto door_attempted = []()
+            {
+                for(const sim::http_server::request& request : sim::http_server::requests(notify_path))
+                {
+                    if(request.body.find("Door Bell Ring!") != std::string::npos)
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            while(!door_attempted())
+            {
+                if(sim::clock::now_us() > door_timeout)
+                {
+                    fprintf(stderr, "outbox: the door ring was never sent\n");
+                    r.ok = false;
+                    return;
+                }
+                settle();
+            }
+            // Lets the sensors see the line go quiet, or the deadline finds it still ringing and keeps the chip awake.
+            settle();
+            sim::clock::advance((CONFIG_INTERCOM_NOTIFICATION_DEADLINE + 1) * 1000000LL);
+        }
+        else if(wake == outbox_wake::lost)
+        {
+            // The dispatcher gives up after its last attempt.
+            if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path)
+                || !sim::wait_for([]() { return !notifications_busy(); }, request_timeout_us))
+            {
+                r.ok = false;
+                return;
+            }
+            for(const sim::http_server::request& request : sim::http_server::requests(notify_path))
+            {
+                r.metrics["alerting"] += request.body.find("\"disable_notification\":false") != std::string::npos ? 1 : 0;
+            }
+            r.metrics["requests"] = static_cast<double>(sim::http_server::request_count(notify_path));
+            settle();
+            sim::clock::advance(CONFIG_INTERCOM_DEEP_SLEEP_DELAY * 1000000LL);
+        }
+        else
+        {
+            if(!sim::wait_for([]() { return outbox_memory.count + outbox_memory.spilled == 0; }, request_timeout_us))
+            {
+                r.ok = false;
+                return;
+            }
+            // Give a second backlog that should not exist the chance to show up.
+            sim::clock::sleep_for(2000000);
+            for(const sim::http_server::request& request : sim::http_server::requests(notify_path))
+            {
+                if(request.body.find(OUTBOX_TEXT_HEAD) != std::string::npos)
+                {
+                    r.metrics["backlogs"]++;
+                    r.metrics["backlog_ms"] = (request.received_us - start) / 1000.0;
+                    r.metrics["ring_lines"] += request.body.find("\\nIntercom Ring! (3 times, 6") != std::string::npos ? 1 : 0;
+                    r.metrics["door_lines"] += request.body.find("\\nDoor Bell Ring! (5") != std::string::npos ? 1 : 0;
+                    r.metrics["boot_lines"] += request.body.find("\\nIntercom Listener booted! (6") != std::string::npos ? 1 : 0;
+                    r.metrics["power_loss_lines"] += request.body.find("before a power loss)") != std::string::npos ? 1 : 0;
+                    r.metrics["repeat_backlogs"] += request.body.find("\"disable_notification\":true") != std::string::npos ? 1 : 0;
+                    if(opts.verbose)
+                    {
+                        fprintf(stderr, "outbox: backlog %s\n", request.body.c_str());
+                    }
+                }
+            }
+            r.metrics["requests"] = static_cast<double>(sim::http_server::request_count(notify_path));
+            settle();
+            sim::clock::advance(CONFIG_INTERCOM_DEEP_SLEEP_DELAY * 1000000LL);
+        }
+
+        if(!sim::wait_for([]() { return sim::sleep::entered(); }, request_timeout_us))
+        {
+            r.ok = false;
+            return;
+        }
+        r.metrics["awake_ms"] = (sim::clock::now_us() - start) / 1000.0;
+        r.metrics["kept"] = outbox_memory.count + outbox_memory.spilled;
+        r.metrics["spilled"] = outbox_memory.spilled;
+    }
+#endif
+
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+    // Levels of both lines during a deep sleep, as edges in nanoseconds from the first run of the ULP program.
+    struct sleep_lines
+    {
+        std::vector<std::pair<int64_t, int>> ring;
+        std::vector<std::pair<int64_t, int>> door;
+
+        std::vector<std::pair<int64_t, int>>& of(int pin)
+        {
+            return pin == ring_pin ? ring : door;
+        }
+
+        int level(int gpio, int64_t time_ns) const
+        {
+            const std::vector<std::pair<int64_t, int>>& edges = gpio == ring_pin ? ring : door;
+            auto after = std::upper_bound(edges.begin(), edges.end(), std::make_pair(time_ns, INT32_MAX));
+            return after == edges.begin() ? idle_level : std::prev(after)->second;
+        }
+
+        void add_signal(int pin, const line_signal& signal, int pulses, int64_t start_us)
+        {
+            std::vector<std::pair<int64_t, int>>& edges = of(pin);
+            int64_t t = start_us;
+            edges.emplace_back(t * 1000, wake_level);
+            edges.emplace_back((t + signal.drop_us) * 1000, idle_level);
+            t += signal.lead_in_us;
+            for(int i = 0; i < pulses; i++)
+            {
+                edges.emplace_back(t * 1000, wake_level);
+                edges.emplace_back((t + signal.wake_us) * 1000, idle_level);
+                t += signal.period_us;
+            }
+        }
+    };
+
+    // Like drive_noise, on the lines of a sleeping chip: glitches on both, then half a second of 50 Hz hum on the ring line.
+    sleep_lines sleep_noise(int64_t duration_us, std::mt19937& rng)
+    {
+        std::uniform_int_distribution<int64_t> glitch_us(2, 300);
+        std::uniform_int_distribution<int64_t> gap_us(500, 40000);
+        std::uniform_int_distribution<int> pin_choice(0, 1);
+        sleep_lines lines;
+        int64_t hum_at = duration_us / 2;
+        for(int64_t t = 0; t < hum_at; )
+        {
+            std::vector<std::pair<int64_t, int>>& edges = lines.of(pin_choice(rng) ? ring_pin : door_pin);
+            edges.emplace_back(t * 1000, wake_level);
+            t += glitch_us(rng);
+            edges.emplace_back(t * 1000, idle_level);
+            t += gap_us(rng);
+        }
+        for(int64_t t = hum_at; t < duration_us; t += 20000)
+        {
+            lines.ring.emplace_back(t * 1000, wake_level);
+            lines.ring.emplace_back((t + 10000) * 1000, idle_level);
+        }
+        std::sort(lines.ring.begin(), lines.ring.end());
+        std::sort(lines.door.begin(), lines.door.end());
+        return lines;
+    }
+
+    /*
+        Goes to deep sleep with the ULP pulse detector, lets it watch noise and then one ring or door signal
+        starting at signal_us into the sleep. The noise must not wake the CPU; the signal must, on its channel.
+    */
+    void scenario_ulp_sleep(const options& opts, result& r, int pin, int64_t signal_us)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_TIMER);
+        sim::boot(app_main);
+        settle();
+        sim::clock::advance(CONFIG_INTERCOM_DEEP_SLEEP_DELAY * 1000000LL);
+        if(!sim::wait_for([]() { return sim::sleep::entered(); }, request_timeout_us))
+        {
+            r.ok = false;
+            return;
+        }
+
+        const int64_t noise_us = 2000000;
+        std::mt19937 rng(static_cast<unsigned>(signal_us));
+        sleep_lines noise = sleep_noise(noise_us, rng);
+        sim::ulp::sleep_report on_noise = sim::ulp::sleep([&](int gpio, int64_t t) { return noise.level(gpio, t); }, noise_us);
+
+        sleep_lines ring;
+        ring.add_signal(pin, pin == ring_pin ? ring_signal : door_signal, opts.pulses_per_ring, signal_us);
+        sim::ulp::sleep_report on_ring = sim::ulp::sleep([&](int gpio, int64_t t) { return ring.level(gpio, t); }, signal_us + 2000000);
+
+        uint32_t expected = pin == ring_pin ? ULP_WAKE_RING : ULP_WAKE_DOOR;
+        r.ok = !on_noise.woke && on_ring.woke && (ulp_wake_channel & UINT16_MAX) == expected;
+        if(!r.ok)
+        {
+            fprintf(stderr, "ULP: noise %s, signal %s on channel %u\n", on_noise.woke ? "woke the CPU" : "passed",
+                    on_ring.woke ? "woke the CPU" : "missed", static_cast<unsigned>(ulp_wake_channel & UINT16_MAX));
+        }
+        r.metrics["detection_ms"] = (on_ring.wake_us - signal_us) / 1000.0;
+        r.metrics["rejected"] = static_cast<double>(ulp_rejected_bursts & UINT16_MAX);
+        r.metrics["activations"] = static_cast<double>(on_noise.activations + on_ring.activations);
+        r.metrics["busy_us"] = static_cast<double>(on_noise.busy_us + on_ring.busy_us);
+        r.metrics["sleep_us"] = static_cast<double>(noise_us + std::max<int64_t>(on_ring.wake_us, 0));
+    }
+
+    // The wake the ULP asked for. Latency runs from the wake; the bench adds the detection time in front.
+    void scenario_ulp_wake(result& r, int pin)
+    {
+        sim::sleep::set_wakeup_cause(ESP_SLEEP_WAKEUP_ULP);
+        int64_t start = sim::clock::now_us();
+        sim::boot(app_main);
+        if(!sim::http_server::wait_for_requests(1, request_timeout_us, notify_path))
+        {
+            r.ok = false;
+            return;
+        }
+        auto requests = sim::http_server::requests(notify_path);
+        r.ok = requests[0].body.find(pin == ring_pin ? "Intercom Ring!" : "Door Bell Ring!") != std::string::npos;
+        r.samples.push_back((requests[0].received_us - start) / 1000.0);
+    }
+#endif
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+    /*
+        Feeds an edge journal from a producer thread at a fixed edge rate while a consumer drains it in
+        batches and now and then stalls, like the main task inside a blocking HTTPS call. Every record
+        carries a sequence number, so the consumer can check ordering and that each gap is an accounted drop.
+    */
+    void journal_stress(const options& opts, result& r)
+    {
+        edge_journal<CONFIG_INTERCOM_EDGE_JOURNAL_SIZE> journal;
+        const uint32_t total = static_cast<uint32_t>(opts.journal_edges);
+        std::atomic<bool> producer_done{false};
+
+        auto wall_start = std::chrono::steady_clock::now();
+        std::thread producer([&]()
+        {
+            for(uint32_t seq = 0; seq < total; seq++)
+            {
+                auto due = wall_start + std::chrono::nanoseconds(seq * 1000000000ULL / opts.journal_rate);
+                while(std::chrono::steady_clock::now() < due)
+                {
+                    // Leaves the core to the consumer on single-CPU hosts.
+                    std::this_thread::yield();
+                }
+                journal.push(edge_record{seq, static_cast<uint8_t>(seq & 1), static_cast<uint8_t>(seq & 1)});
+            }
+            producer_done = true;
+        });
+
+        uint64_t received = 0;
+        uint64_t gaps = 0;
+        uint64_t order_errors = 0;
+        uint64_t batches = 0;
+        int64_t expected_seq = 0;
+        edge_record batch[16];
+        while(true)
+        {
+            bool done = producer_done.load();
+            size_t count = journal.drain(batch, 16);
+            if(count == 0)
+            {
+                if(done)
+                {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+
+            batches++;
+            for(size_t i = 0; i < count; i++)
+            {
+                int64_t seq = batch[i].cycles;
+                if(seq < expected_seq || batch[i].channel != (seq & 1))
+                {
+                    order_errors++;
+                }
+                gaps += seq - expected_seq;
+                expected_seq = seq + 1;
+                received++;
+            }
+
+            if(batches % 256 == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+        producer.join();
+        gaps += total - expected_seq;
+        double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+        r.metrics["edges"] = total;
+        r.metrics["edges_per_s"] = total / elapsed_s;
+        r.metrics["received"] = static_cast<double>(received);
+        r.metrics["overflows"] = journal.overflows();
+        r.metrics["batches"] = static_cast<double>(batches);
+        r.metrics["high_watermark"] = journal.high_watermark();
+        r.metrics["order_errors"] = static_cast<double>(order_errors);
+        r.ok = order_errors == 0 && gaps == journal.overflows() && received + journal.overflows() == total;
+    }
+#endif
+
+    double percentile(std::vector<double> values, double p)
+    {
+        if(values.empty())
+        {
+            return 0;
+        }
+        std::sort(values.begin(), values.end());
+        size_t rank = static_cast<size_t>(p / 100.0 * values.size() + 0.999999);
+        rank = std::clamp<size_t>(rank, 1, values.size());
+        return values[rank - 1];
+    }
+
+    void print_latency(const char *name, const std::vector<double>& samples)
+    {
+        printf("%-14s %8zu %10.2f %10.2f %10.2f %10.2f\n", name, samples.size(),
+               percentile(samples, 50), percentile(samples, 90), percentile(samples, 99), percentile(samples, 100));
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --warm-samples N     rings measured while Wi-Fi is up (default 50)\n"
+            "  --cold-samples N     wake cycles measured from EXT0 wake (default 10)\n"
+            "  --storm-edges N      edges injected in the edge storm (default 200000)\n"
+            "  --journal-edges N    edges pushed through the edge journal stress test (default 2000000)\n"
+            "  --journal-rate N     edges per second pushed by the stress test producer (default 1000000)\n"
+            "  --pulses N           pulses per ring burst (default 120)\n"
+            "  --noise-ms N         line noise injected before the ring in the noise scenario (default 700)\n"
+            "  --event-records N    events appended by the event log stress test (default 60000)\n"
+            "  --events-dump PATH   write the event log partition after the cold wakes to PATH, for intercom_events\n"
+            "  --sleep-s N          deep sleep between two cold wakes (default 10800)\n"
+            "  --wifi-init-ms N     modeled esp_wifi_init time\n"
+            "  --phy-cal-ms N       modeled full RF calibration time, without calibration data in NVS\n"
+            "  --wifi-start-ms N    modeled esp_wifi_start to STA_START delay\n"
+            "  --wifi-assoc-ms N    modeled scan and association time\n"
+            "  --wifi-direct-ms N   modeled association time with a known BSSID and channel\n"
+            "  --wifi-dhcp-ms N     modeled DHCP time\n"
+            "  --wifi-failures N    association attempts that fail before one succeeds\n"
+            "  --dns-ms N           modeled DNS lookup time, once per wake\n"
+            "  --tcp-ms N           modeled TCP connect time per connection\n"
+            "  --tls-ms N           modeled TLS handshake time per connection\n"
+            "  --uplink-kbit N      modeled upload bandwidth, 0 for unlimited (default 2000)\n"
+            "  --console-baud N     UART console speed the log output is paced at, 0 for none (default 115200)\n"
+            "  --mqtt-broker PORT   publish to a real MQTT broker on this loopback port instead of the stand-in\n"
+            "  --verbose            show firmware logs\n", self);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    // A home connection's upstream, which the audio clip upload is paced by.
+    opts.net.uplink_bytes_per_s = 2000 * 1000 / 8;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> long long
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return atoll(argv[++i]);
+        };
+
+        if(arg == "--warm-samples") opts.warm_samples = static_cast<int>(next());
+        else if(arg == "--cold-samples") opts.cold_samples = static_cast<int>(next());
+        else if(arg == "--storm-edges") opts.storm_edges = static_cast<int>(next());
+        else if(arg == "--journal-edges") opts.journal_edges = static_cast<int>(next());
+        else if(arg == "--journal-rate") opts.journal_rate = static_cast<int>(next());
+        else if(arg == "--pulses") opts.pulses_per_ring = static_cast<int>(next());
+        else if(arg == "--noise-ms") opts.noise_ms = static_cast<int>(next());
+        else if(arg == "--event-records") opts.event_records = static_cast<int>(next());
+        else if(arg == "--events-dump") opts.events_dump = argv[++i];
+        else if(arg == "--sleep-s") opts.sleep_s = next();
+        else if(arg == "--wifi-init-ms") opts.wifi.init_us = next() * 1000;
+        else if(arg == "--phy-cal-ms") opts.wifi.phy_full_cal_us = next() * 1000;
+        else if(arg == "--wifi-start-ms") opts.wifi.start_us = next() * 1000;
+        else if(arg == "--wifi-assoc-ms") opts.wifi.assoc_us = next() * 1000;
+        else if(arg == "--wifi-direct-ms") opts.wifi.direct_assoc_us = next() * 1000;
+        else if(arg == "--wifi-dhcp-ms") opts.wifi.dhcp_us = next() * 1000;
+        else if(arg == "--wifi-failures") opts.wifi.failed_attempts = static_cast<int>(next());
+        else if(arg == "--dns-ms") opts.net.dns_us = next() * 1000;
+        else if(arg == "--tcp-ms") opts.net.connect_us = next() * 1000;
+        else if(arg == "--tls-ms") opts.net.tls_handshake_us = next() * 1000;
+        else if(arg == "--uplink-kbit") opts.net.uplink_bytes_per_s = next() * 1000 / 8;
+        else if(arg == "--console-baud") opts.console_baud = static_cast<int>(next());
+        else if(arg == "--mqtt-broker") opts.mqtt_broker_port = static_cast<int>(next());
+        else if(arg == "--verbose") opts.verbose = true;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bool ok = true;
+    printf("%-14s %8s %10s %10s %10s %10s\n", "latency", "samples", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+
+    result warm = run_isolated(opts, [&](result& r) { scenario_warm_ring(opts, r); });
+    ok &= warm.ok;
+    print_latency("warm_ring", warm.samples);
+
+    // Consecutive deep sleep wakes: the first starts from power-on, every later one with the RTC memory of the one before.
+    std::vector<double> cold_first_samples;
+    std::vector<double> cold_samples;
+    device_memory memory;
+    result cold;
+    double cold_dhcp = 0;
+    double cold_nvs_writes = 0;
+    double cold_full_calibrations = 0;
+    int cold_flash_wakes = 0;
+    double cold_flash_erases = 0;
+    for(int i = 0; i < opts.cold_samples; i++)
+    {
+        cold = run_isolated(opts, [&](result& r) { scenario_cold_ring(opts, r, false); }, memory, opts.sleep_s * 1000000);
+        ok &= cold.ok;
+        memory = cold.memory;
+        cold_flash_wakes += cold.metrics["flash_writes"] > 0 ? 1 : 0;
+        cold_flash_erases += cold.metrics["flash_erases"];
+        cold_dhcp += cold.metrics["dhcp"];
+        cold_nvs_writes += cold.metrics["nvs_writes"];
+        cold_full_calibrations += cold.metrics["full_calibrations"];
+        std::vector<double>& samples = i == 0 ? cold_first_samples : cold_samples;
+        samples.insert(samples.end(), cold.samples.begin(), cold.samples.end());
+    }
+    print_latency("cold_first", cold_first_samples);
+    print_latency("cold_ring", cold_samples);
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    result profile = run_isolated(opts, [&](result& r) { read_wake_profile(r, static_cast<uint16_t>(opts.cold_samples)); }, memory);
+#endif
+#if CONFIG_INTERCOM_EVENT_LOG
+    result history = run_isolated(opts, [&](result& r) { read_event_history(r, opts.events_dump); }, memory);
+    // The first wake is a power-on; every wake rings once.
+    history.ok &= history.metrics["events_power_on"] == 1 && history.metrics["events_ring"] == opts.cold_samples
+        && history.metrics["events_delivered"] >= opts.cold_samples;
+    ok &= history.ok;
+#endif
+
+    result rejected = run_isolated(opts, [&](result& r) { scenario_cold_ring(opts, r, true); }, memory);
+    ok &= rejected.ok;
+    print_latency("cold_rejected", rejected.samples);
+
+    // RTC memory lost, NVS kept: the cached AP comes back from flash, the address does not.
+    result power_loss = run_isolated(opts, [&](result& r) { scenario_cold_ring(opts, r, false); }, {std::string(), memory.nvs, memory.flash, memory.broker});
+    ok &= power_loss.ok;
+    print_latency("cold_power_off", power_loss.samples);
+
+    // The router moved to another channel since the last wake: the cached AP is given up after a few attempts.
+    options moved_opts = opts;
+    moved_opts.wifi.channel = opts.wifi.channel == 11 ? 1 : 11;
+    result moved = run_isolated(moved_opts, [&](result& r) { scenario_cold_ring(moved_opts, r, false); }, memory);
+    ok &= moved.ok;
+    print_latency("cold_moved_ap", moved.samples);
+
+    result stale = run_isolated(opts, [&](result& r) { scenario_stale_connection(opts, r); });
+    ok &= stale.ok;
+    print_latency("stale_conn", {stale.samples.begin(), stale.samples.begin() + std::min<size_t>(1, stale.samples.size())});
+
+    const int retry_failures = 2;
+    result retry = run_isolated(opts, [&](result& r) { scenario_retry(opts, r, retry_failures); });
+    ok &= retry.ok;
+    print_latency("retry_503", retry.samples);
+
+    result lost = run_isolated(opts, [&](result& r) { scenario_lost_response(opts, r); });
+    ok &= lost.ok;
+
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    result framing = run_isolated(opts, [&](result& r) { scenario_response_framing(opts, r); });
+    ok &= framing.ok;
+#endif
+
+    const int64_t slow_ms = 1500;
+    result slow = run_isolated(opts, [&](result& r) { scenario_slow_network(opts, r, slow_ms); });
+    ok &= slow.ok;
+    print_latency("slow_network", slow.samples);
+
+    const int burst_failures = 4;
+    result burst = run_isolated(opts, [&](result& r) { scenario_burst(opts, r, burst_failures); });
+    ok &= burst.ok;
+    print_latency("burst", burst.samples);
+
+    result storm = run_isolated(opts, [&](result& r) { scenario_edge_storm(opts, r); });
+    ok &= storm.ok;
+    print_latency("edge_storm", storm.samples);
+
+    result noise = run_isolated(opts, [&](result& r) { scenario_noise(opts, r); });
+    ok &= noise.ok;
+    print_latency("after_noise", noise.samples);
+
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    result mqtt = run_isolated(opts, [&](result& r) { scenario_mqtt_ring(opts, r); });
+    ok &= mqtt.ok;
+    print_latency("mqtt_ring", mqtt.samples);
+
+    // Every wake but the first finds its session on the broker; every ring is acknowledged.
+    bool mqtt_sessions_ok = cold.metrics["mqtt_resumed"] == opts.cold_samples - 1 && cold.metrics["mqtt_new"] == 1
+        && cold.metrics["mqtt_published"] == opts.cold_samples;
+    ok &= mqtt_sessions_ok;
+
+    result redelivery;
+    if(opts.mqtt_broker_port == 0)
+    {
+        redelivery = run_isolated(opts, [&](result& r) { scenario_mqtt_redelivery(opts, r); });
+        ok &= redelivery.ok;
+        print_latency("mqtt_redeliver", redelivery.samples);
+    }
+#endif
+
+#if CONFIG_INTERCOM_AUDIO_CLIP
+    result audio = run_isolated(opts, [&](result& r) { scenario_audio_clip(opts, r); });
+    ok &= audio.ok;
+    print_latency("audio_clip", audio.samples);
+#endif
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    result commands = run_isolated(opts, [&](result& r) { scenario_commands(opts, r); });
+    ok &= commands.ok;
+    print_latency("command", commands.samples);
+#endif
+
+#if CONFIG_INTERCOM_OUTBOX
+    // Undelivered events pile up over three wakes, about an hour to ten minutes before the wake that delivers them, so the
+    // backlog lists the ring as "Intercom Ring! (3 times, 6x min to 10 min ago)" and the door ring as "(5x min ago)".
+    result offline_boot = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::offline_boot); });
+    result unavailable = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::unavailable); }, offline_boot.memory, 10 * 60 * 1000000LL);
+    result offline = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::offline); }, unavailable.memory, 40 * 60 * 1000000LL);
+    result flushed = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::online); }, offline.memory, 10 * 60 * 1000000LL);
+    result after_flush = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::online); }, flushed.memory, 60 * 1000000LL);
+    // RTC memory lost before the delivering wake: what was spilled to NVS comes back, without its ages.
+    result power_lost = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::online); },
+        {std::string(), offline.memory.nvs, offline.memory.flash, offline.memory.broker});
+    bool outbox_ok = offline_boot.ok && unavailable.ok && offline.ok && flushed.ok && after_flush.ok && power_lost.ok
+        && offline_boot.metrics["kept"] == 2 && unavailable.metrics["kept"] == 4 && offline.metrics["kept"] == 5 && offline.metrics["spilled"] == 4
+        && offline.metrics["awake_ms"] < CONFIG_INTERCOM_NOTIFICATION_DEADLINE * 1000.0
+        && flushed.metrics["backlogs"] == 1 && flushed.metrics["ring_lines"] == 1 && flushed.metrics["door_lines"] == 1 && flushed.metrics["boot_lines"] == 1
+        && flushed.metrics["kept"] == 0 && flushed.metrics["repeat_backlogs"] == 0 && after_flush.metrics["backlogs"] == 0
+        && power_lost.metrics["backlogs"] == 1 && power_lost.metrics["power_loss_lines"] == 1 && power_lost.metrics["kept"] == 0;
+    ok &= outbox_ok;
+    if(!outbox_ok)
+    {
+        fprintf(stderr, "outbox: kept %.0f, %.0f, %.0f (%.0f in NVS), offline wake %.0f ms; backlogs %.0f (ring %.0f, door %.0f, boot %.0f), "
+            "%.0f kept, then %.0f; after a power loss %.0f backlog(s), %.0f line(s) without ages\n", offline_boot.metrics["kept"],
+            unavailable.metrics["kept"], offline.metrics["kept"], offline.metrics["spilled"], offline.metrics["awake_ms"], flushed.metrics["backlogs"],
+            flushed.metrics["ring_lines"], flushed.metrics["door_lines"], flushed.metrics["boot_lines"], flushed.metrics["kept"],
+            after_flush.metrics["backlogs"], power_lost.metrics["backlogs"], power_lost.metrics["power_loss_lines"]);
+    }
+
+    // The backlog and the ring of a wake go out, but their responses are lost. The next wake sends them again as one
+    // backlog, silently and marked as a possible repeat; so does the wake after a power loss, from what NVS kept.
+    result lost_backlog = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::lost); }, offline.memory, 10 * 60 * 1000000LL);
+    result resent = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::online); }, lost_backlog.memory, 10 * 60 * 1000000LL);
+    result resent_after_power_loss = run_isolated(opts, [&](result& r) { scenario_outbox(opts, r, outbox_wake::online); },
+        {std::string(), lost_backlog.memory.nvs, lost_backlog.memory.flash, lost_backlog.memory.broker});
+    bool unconfirmed_ok = lost_backlog.ok && resent.ok && resent_after_power_loss.ok
+        && lost_backlog.metrics["requests"] >= CONFIG_INTERCOM_NOTIFICATION_MAX_ATTEMPTS && lost_backlog.metrics["alerting"] <= 2
+        && lost_backlog.metrics["kept"] == 6 && resent.metrics["backlogs"] == 1 && resent.metrics["repeat_backlogs"] == 1 && resent.metrics["kept"] == 0
+        && resent_after_power_loss.metrics["backlogs"] == 1 && resent_after_power_loss.metrics["repeat_backlogs"] == 1;
+    ok &= unconfirmed_ok;
+    if(!unconfirmed_ok)
+    {
+        fprintf(stderr, "outbox: lost responses: %.0f request(s), %.0f alerting, %.0f kept; then %.0f backlog(s), %.0f marked as a repeat, %.0f kept; "
+            "after a power loss %.0f backlog(s), %.0f marked\n", lost_backlog.metrics["requests"], lost_backlog.metrics["alerting"],
+            lost_backlog.metrics["kept"], resent.metrics["backlogs"], resent.metrics["repeat_backlogs"], resent.metrics["kept"],
+            resent_after_power_loss.metrics["backlogs"], resent_after_power_loss.metrics["repeat_backlogs"]);
+    }
+#endif
+
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+    // Sleeps of the ULP detector, each ending in a wake for a ring or door signal at a different ULP timer phase.
+    std::vector<double> sleep_samples;
+    std::vector<double> sleep_detection;
+    device_memory sleep_memory;
+    int sleep_wakes = 0;
+    double sleep_rejected = 0;
+    double sleep_activations = 0;
+    double sleep_busy_us = 0;
+    double sleep_us = 0;
+    for(int i = 0; i < opts.cold_samples; i++)
+    {
+        int pin = i % 2 == 0 ? ring_pin : door_pin;
+        int64_t signal_us = 500000 + i * 3700;
+        result asleep = run_isolated(opts, [&](result& r) { scenario_ulp_sleep(opts, r, pin, signal_us); }, sleep_memory);
+        ok &= asleep.ok;
+        sleep_detection.push_back(asleep.metrics["detection_ms"]);
+        sleep_rejected = asleep.metrics["rejected"];
+        sleep_activations += asleep.metrics["activations"];
+        sleep_busy_us += asleep.metrics["busy_us"];
+        sleep_us += asleep.metrics["sleep_us"];
+        if(!asleep.ok)
+        {
+            continue;
+        }
+        result woken = run_isolated(opts, [&](result& r) { scenario_ulp_wake(r, pin); }, asleep.memory);
+        ok &= woken.ok;
+        sleep_memory = woken.memory;
+        sleep_wakes += woken.ok ? 1 : 0;
+        for(double sample : woken.samples)
+        {
+            sleep_samples.push_back(sample + asleep.metrics["detection_ms"]);
+        }
+    }
+    print_latency("ulp_detect", sleep_detection);
+    print_latency("ulp_ring", sleep_samples);
+#endif
+
+    printf("\nnoise: %d ms of glitches and hum started Wi-Fi %.0f time(s) and sent %.0f notification(s)\n",
+           opts.noise_ms, noise.metrics["wifi_starts_on_noise"], noise.metrics["notifications_on_noise"]);
+    printf("edge storm: %.0f edges in %.3f s (%.0f edges/s), %.0f main loop wakeups (%.0f/s), %.0f interrupts, GPIO ISR %.0f ns avg, %.0f notification(s)\n",
+           storm.metrics["edges"], storm.metrics["storm_s"], storm.metrics["edges_per_s"],
+           storm.metrics["loop_wakeups"], storm.metrics["loop_wakeups_per_s"], storm.metrics["interrupts"],
+           storm.metrics["isr_ns_avg"], storm.metrics["notifications"]);
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+    printf("edge journal during storm: %.0f recorded, %.0f dropped, high watermark %.0f of %d\n",
+           storm.metrics["journal_recorded"], storm.metrics["journal_overflows"], storm.metrics["journal_high_watermark"],
+           CONFIG_INTERCOM_EDGE_JOURNAL_SIZE);
+
+    result journal;
+    journal_stress(opts, journal);
+    ok &= journal.ok;
+    printf("edge journal stress: %.0f edges at %.0f edges/s, %.0f drained in %.0f batches, %.0f dropped, %.0f out of order, high watermark %.0f\n",
+           journal.metrics["edges"], journal.metrics["edges_per_s"], journal.metrics["received"], journal.metrics["batches"],
+           journal.metrics["overflows"], journal.metrics["order_errors"], journal.metrics["high_watermark"]);
+#endif
+    printf("warm rings used %.0f connection(s) and %.0f sensor interrupt(s) for %zu notification(s)\n",
+           warm.metrics["connections"], warm.metrics["interrupts"], warm.samples.size());
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+    printf("LED patterns during the warm rings: %.0f RMT transmission(s), %.0f LED change(s) played without the CPU\n",
+           warm.metrics["led_transmissions"], warm.metrics["led_changes"]);
+#endif
+    printf("TLS over %d wake(s): %.0f resumed (avg %.1f ms), %.0f full (avg %.1f ms); a rotated ticket key gave %.0f rejected resumption(s)\n",
+           opts.cold_samples, cold.metrics["tls_resumed"], cold.metrics["tls_resumed_ms"], cold.metrics["tls_full"], cold.metrics["tls_full_ms"],
+           rejected.metrics["tls_rejected"]);
+    printf("Wi-Fi over %d wake(s): %.0f DHCP exchange(s), %.0f NVS write(s); %.0f DHCP after power loss, %.0f after the AP moved\n",
+           opts.cold_samples, cold_dhcp, cold_nvs_writes, power_loss.metrics["dhcp"], moved.metrics["dhcp"]);
+    printf("RF calibration: %.0f full over %d wake(s) from blank NVS, %.0f after power loss\n",
+           cold_full_calibrations, opts.cold_samples, power_loss.metrics["full_calibrations"]);
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    // Every cold wake but the first follows a sleep of --sleep-s; the days roll over on the RTC clock.
+    double slept_s = static_cast<double>(opts.sleep_s) * (opts.cold_samples - 1);
+    bool energy_ok = std::abs(cold.metrics["energy_sleep_s"] - slept_s) < 1 && cold.metrics["energy_wakes"] == opts.cold_samples
+        && cold.metrics["energy_wakes_today"] + cold.metrics["energy_wakes_yesterday"] <= opts.cold_samples
+        && (slept_s < 24 * 3600) == (cold.metrics["energy_wakes_yesterday"] == 0);
+    ok &= energy_ok;
+    printf("energy over %d wake(s) %lld s apart: %.3f mAh, %.0f s of sleep booked; the last ring cost %.1f uAh "
+           "(cpu %.0f ms, scan %.0f ms, idle %.0f ms, tls %.0f ms, light %.0f ms), %.2f mA awake on average; %.0f wake(s) today, %.0f yesterday%s\n",
+           opts.cold_samples, static_cast<long long>(opts.sleep_s), cold.metrics["energy_total_mah"], cold.metrics["energy_sleep_s"],
+           cold.metrics["energy_wake_uah"], cold.metrics["energy_wake_ms_cpu"], cold.metrics["energy_wake_ms_scan"],
+           cold.metrics["energy_wake_ms_idle"], cold.metrics["energy_wake_ms_tls"], cold.metrics["energy_wake_ms_light"],
+           cold.metrics["energy_awake_ma"], cold.metrics["energy_wakes_today"], cold.metrics["energy_wakes_yesterday"],
+           energy_ok ? "" : " (expected otherwise)");
+#endif
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+    // What the chip slept is what the exit callback booked, but for rounding to the microsecond.
+    bool light_ok = cold.metrics["light_sleeps"] > 0;
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    light_ok &= std::abs(cold.metrics["light_slept_ms"] - cold.metrics["energy_wake_ms_light"]) < 1;
+#endif
+    ok &= light_ok;
+    printf("light sleep in the last wake: %.0f time(s), %.0f ms asleep, %.0f ms awake for beacons%s\n", cold.metrics["light_sleeps"],
+           cold.metrics["light_slept_ms"], cold.metrics["light_listen_ms"], light_ok ? "" : " (expected otherwise)");
+#endif
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    printf("wake phases over %d cold wake(s), from the RTC timing probes:\n", opts.cold_samples);
+    printf("  %-14s %6s %10s %10s %10s\n", "phase", "n", "p50_ms", "p90_ms", "max_ms");
+    for(uint8_t p = 0; p < static_cast<uint8_t>(wake_phase::count); p++)
+    {
+        std::string name = wake_phase_name(static_cast<wake_phase>(p));
+        printf("  %-14s %6.0f %10.2f %10.2f %10.2f\n", name.c_str(), profile.metrics[name + "_n"], profile.metrics[name + "_p50"],
+               profile.metrics[name + "_p90"], profile.metrics[name + "_max"]);
+    }
+#endif
+#if CONFIG_INTERCOM_EVENT_LOG
+    printf("event log over %d wake(s): %.0f event(s), %.0f ring, %.0f delivered, %.0f power-on, %.0f still pending in RTC memory; "
+           "flash written on %d wake(s), %.0f sector erase(s)\n",
+           opts.cold_samples, history.metrics["events"], history.metrics["events_ring"], history.metrics["events_delivered"],
+           history.metrics["events_power_on"], history.metrics["pending"], cold_flash_wakes, cold_flash_erases);
+
+    result events;
+    event_log_stress(opts, events);
+    ok &= events.ok;
+    printf("event log stress: %.0f events, %.0f power cut(s), %.0f held after %.0f trip(s) around the ring, sector erases %.0f..%.0f; "
+           "%.0f range queries checked, ranges of up to an hour read %.1f of %.0f segment(s) on average, %.0f sealed segment CRC(s) checked, %.0f error(s)\n",
+           events.metrics["records"], events.metrics["power_cuts"], events.metrics["held"],
+           events.metrics["written"] / (EVENT_LOG_RECORDS_PER_SEGMENT * (0x20000 / EVENT_LOG_SEGMENT_SIZE)),
+           events.metrics["erases_min"], events.metrics["erases_max"], events.metrics["queries"], events.metrics["segments_read"],
+           events.metrics["segments_holding"], events.metrics["sealed_checked"], events.metrics["check_errors"]);
+#endif
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+    printf("ULP: %d of %d signal(s) woke the CPU and were notified, %.0f burst(s) of noise rejected in the last sleep; "
+           "%.0f activation(s) over %.1f s asleep, busy %.3f%% of it\n",
+           sleep_wakes, opts.cold_samples, sleep_rejected, sleep_activations, sleep_us / 1e6,
+           sleep_us > 0 ? sleep_busy_us * 100.0 / sleep_us : 0.0);
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    printf("MQTT over %d wake(s): %.0f session(s) resumed, %.0f new, %.0f message(s) acknowledged%s; ",
+           opts.cold_samples, cold.metrics["mqtt_resumed"], cold.metrics["mqtt_new"], cold.metrics["mqtt_published"], mqtt_sessions_ok ? "" : " (expected otherwise)");
+    if(opts.mqtt_broker_port == 0)
+    {
+        printf("idle connection pinged %.0f time(s) on %.0f connection(s); a PUBACK lost with the connection was %s\n",
+               mqtt.metrics["pings"], mqtt.metrics["connections"], redelivery.ok ? "redelivered with DUP" : "not redelivered");
+    }
+    else
+    {
+        printf("broker on port %d\n", opts.mqtt_broker_port);
+    }
+#endif
+#if CONFIG_INTERCOM_AUDIO_CLIP
+    printf("audio clip: %.0f ms, %.0f ms of it before the ring, %.0f byte chunked upload %.0f ms after the notification at %.0f KiB/s, "
+           "%.0f byte(s) of heap taken while it streamed; %.0f Hz tone %.1f%% of the power after the ring, %.1f dB above the silence before it; "
+           "%.0f KiB of PSRAM, %.0f byte(s) of internal heap, %.0f ADC frame(s) dropped\n",
+           audio.metrics["clip_ms"], audio.metrics["pre_ms"], audio.metrics["bytes"], audio.metrics["after_notification_ms"],
+           audio.metrics["upload_kib_s"], audio.metrics["upload_heap"], audio_tone_hz, audio.metrics["tone_share"] * 100, audio.metrics["snr_db"],
+           audio.metrics["psram_kib"], audio.metrics["internal_bytes"], audio.metrics["dropped_frames"]);
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    printf("commands: /mute answered in %.0f ms and held off a ring, /awake 0 in %.0f ms and asleep %.0f ms after it; "
+           "%.0f long poll(s) of up to %d s in the wake\n",
+           commands.metrics["mute_ms"], commands.metrics["awake_ms"], commands.metrics["sleep_after_ms"], commands.metrics["polls"],
+           CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S);
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+    printf("outbox: %.0f undelivered event(s) over three wakes, %.0f of them spilled to NVS, went out in %.0f backlog %.0f ms into the "
+           "next online wake; none repeated the wake after; a wake without Wi-Fi slept after %.0f ms\n",
+           offline.metrics["kept"], offline.metrics["spilled"], flushed.metrics["backlogs"], flushed.metrics["backlog_ms"], offline.metrics["awake_ms"]);
+    printf("outbox with lost responses: %.0f request(s) without an answer, %.0f of them alerting; the next wake sent %.0f backlog, "
+           "%.0f of them marked as a possible repeat, %.0f after a power loss\n", lost_backlog.metrics["requests"], lost_backlog.metrics["alerting"],
+           resent.metrics["backlogs"],
+           resent.metrics["repeat_backlogs"], resent_after_power_loss.metrics["repeat_backlogs"]);
+#endif
+    printf("retries: %d answer(s) of 503, delivered on attempt %.0f\n", retry_failures, retry.metrics["attempts"]);
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    printf("response framing: chunked body %s, %.0f reconnect(s) over chunked and 204 responses, door ring %.0f ms behind a response without a length, %.0f attempt(s) for 4 rings\n",
+        framing.metrics["chunked_decoded"] == 1 ? "decoded" : "not decoded", framing.metrics["reconnects_kept_alive"], framing.metrics["door_ms"],
+        framing.metrics["attempts"]);
+#endif
+    printf("lost response: sent again by the dispatcher %.0f ms later, %.0f attempt(s) in all, %s\n", lost.metrics["resent_after_ms"],
+        lost.metrics["attempts"], lost.metrics["resent_silent"] == 1 ? "silently as a possible repeat" : "alerting again");
+    printf("slow network (%lld ms responses): door ring during the ring notification queued and notified %.0f ms after it started, %.0f edge(s) dropped\n",
+           static_cast<long long>(slow_ms), slow.metrics["door_ms"], slow.metrics["edges_dropped"]);
+    printf("burst: ring, door and a repeated ring behind %d answer(s) of 503 went out in %.0f successful request(s), %.0f in total\n",
+           burst_failures, burst.metrics["delivered_requests"], burst.metrics["requests"]);
+    printf("dropped connection: %.0f reconnect(s) for the first ring, %.0f for the next (%.2f ms)\n",
+           stale.metrics["reconnects_stale"], stale.metrics["reconnects_after"], stale.samples.size() > 1 ? stale.samples[1] : 0.0);
+
+    if(!ok)
+    {
+        fprintf(stderr, "one or more scenarios failed\n");
+        return 1;
+    }
+    return 0;
+}
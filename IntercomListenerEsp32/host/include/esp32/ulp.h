@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The RTC slow memory the ULP sees. In the simulation a reserved block of the RTC memory section. */
+uint32_t *sim_ulp_memory(void);
+#define RTC_SLOW_MEM (sim_ulp_memory())
+
+/* The simulation takes the preprocessed assembler text of the program as its binary. */
+esp_err_t ulp_load_binary(uint32_t load_addr, const uint8_t *program_binary, size_t program_size);
+esp_err_t ulp_run(uint32_t entry_point);
+esp_err_t ulp_set_wakeup_period(size_t period_index, uint32_t period_us);
+
+#ifdef __cplusplus
+}
+#endif
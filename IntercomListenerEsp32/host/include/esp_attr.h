@@ -0,0 +1,8 @@
+#pragma once
+
+/* Placement attributes have no meaning on the host, except that RTC memory is gathered in one section
+   so the simulation can carry it across deep sleep (see sim::rtc). */
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR __attribute__((section("rtc_slow_mem"), used))
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_slow_mem"), used))
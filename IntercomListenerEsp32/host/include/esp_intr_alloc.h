@@ -0,0 +1,7 @@
+#pragma once
+
+/* Allocation flags are accepted and ignored: interrupts run on the thread that raises them. */
+#define ESP_INTR_FLAG_LEVEL1 (1 << 1)
+#define ESP_INTR_FLAG_IRAM (1 << 10)
+
+typedef struct intr_handle_data_t* intr_handle_t;
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_tls_last_error
+{
+    esp_err_t last_error;
+    int esp_tls_error_code;
+    int esp_tls_flags;
+} esp_tls_last_error_t;
+
+typedef struct esp_tls_last_error *esp_tls_error_handle_t;
+
+typedef struct esp_tls_cfg
+{
+    const char **alpn_protos;
+    const unsigned char *cacert_buf;
+    unsigned int cacert_bytes;
+    esp_err_t (*crt_bundle_attach)(void *conf);
+    int timeout_ms;
+    bool non_block;
+    const char *common_name;
+    bool skip_common_name;
+    bool is_plain_tcp;
+} esp_tls_cfg_t;
+
+esp_err_t esp_tls_plain_tcp_connect(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle,
+    int *sockfd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "esp_bit_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define configSTACK_DEPTH_TYPE uint32_t
+#define configMAX_PRIORITIES 25
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY (TickType_t) 0xffffffffUL
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t) (((TickType_t) (xTimeInMs) * (TickType_t) configTICK_RATE_HZ) / (TickType_t) 1000U))
+
+#define pdFALSE ((BaseType_t) 0)
+#define pdTRUE ((BaseType_t) 1)
+#define pdPASS (pdTRUE)
+#define pdFAIL (pdFALSE)
+#define errQUEUE_EMPTY ((BaseType_t) 0)
+#define errQUEUE_FULL ((BaseType_t) 0)
+
+#define portYIELD_FROM_ISR(x) ((void) (x))
+
+/* A spinlock, as on the dual-core ESP32. Critical sections do not nest on the same lock. */
+typedef struct
+{
+    uint32_t owner;
+    uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+
+void sim_port_enter_critical(portMUX_TYPE *mux);
+void sim_port_exit_critical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux) sim_port_enter_critical(mux)
+#define portEXIT_CRITICAL(mux) sim_port_exit_critical(mux)
+#define portENTER_CRITICAL_ISR(mux) sim_port_enter_critical(mux)
+#define portEXIT_CRITICAL_ISR(mux) sim_port_exit_critical(mux)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sim_event_group *EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+void vEventGroupDelete(EventGroupHandle_t event_group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t event_group, const EventBits_t bits_to_wait_for, const BaseType_t clear_on_exit,
+                                const BaseType_t wait_for_all_bits, TickType_t ticks_to_wait);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t event_group, const EventBits_t bits_to_set);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t event_group, const EventBits_t bits_to_clear);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t event_group);
+BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t event_group, const EventBits_t bits_to_set, BaseType_t *higher_priority_task_woken);
+
+#ifdef __cplusplus
+}
+#endif
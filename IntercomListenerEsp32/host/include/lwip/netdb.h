@@ -0,0 +1,18 @@
+#pragma once
+
+#include <netdb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int lwip_getaddrinfo(const char *nodename, const char *servname, const struct addrinfo *hints, struct addrinfo **res);
+void lwip_freeaddrinfo(struct addrinfo *ai);
+
+#ifdef __cplusplus
+}
+#endif
+
+// As in lwIP with LWIP_COMPAT_SOCKETS: firmware code calls the standard names.
+#define getaddrinfo(nodename, servname, hints, res) lwip_getaddrinfo(nodename, servname, hints, res)
+#define freeaddrinfo(ai) lwip_freeaddrinfo(ai)
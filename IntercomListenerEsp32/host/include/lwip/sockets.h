@@ -0,0 +1,5 @@
+#pragma once
+
+// The sim's sockets are the host's, so the standard names lwIP maps to with LWIP_COMPAT_SOCKETS work as they are.
+#include <errno.h>
+#include <sys/socket.h>
@@ -0,0 +1,19 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The configuration the firmware selects with CONFIG_INTERCOM_TLS_SESSION_RESUMPTION. */
+#define MBEDTLS_X509_TRUSTED_CERTIFICATE_CALLBACK
+
+typedef struct mbedtls_x509_crt
+{
+    int unused;
+} mbedtls_x509_crt;
+
+typedef int mbedtls_x509_crt_ca_cb_t(void *p_ctx, mbedtls_x509_crt const *child, mbedtls_x509_crt **candidate_cas);
+
+#ifdef __cplusplus
+}
+#endif
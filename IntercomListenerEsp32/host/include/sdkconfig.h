@@ -0,0 +1,211 @@
+#pragma once
+
+/* Host simulation configuration.
+   Mirrors the defaults of src/Kconfig.projbuild so the firmware sources build unchanged on Linux.
+   Keep it in sync when adding Kconfig options. Choices guarded by #if can be switched per target in CMakeLists.txt. */
+
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ 240
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_MBEDTLS_CERTIFICATE_BUNDLE 1
+#ifndef CONFIG_ULP_COPROC_ENABLED
+#define CONFIG_ULP_COPROC_ENABLED 0
+#endif
+#if CONFIG_ULP_COPROC_ENABLED
+#define CONFIG_ULP_COPROC_TYPE_FSM 1
+#define CONFIG_ULP_COPROC_RESERVE_MEM 1024
+#endif
+#ifndef CONFIG_ESP_PHY_CALIBRATION_AND_DATA_STORAGE
+#define CONFIG_ESP_PHY_CALIBRATION_AND_DATA_STORAGE 1
+#endif
+#ifndef CONFIG_PM_ENABLE
+#define CONFIG_PM_ENABLE 0
+#endif
+#ifndef CONFIG_FREERTOS_USE_TICKLESS_IDLE
+#define CONFIG_FREERTOS_USE_TICKLESS_IDLE 0
+#endif
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+#define CONFIG_FREERTOS_IDLE_TIME_BEFORE_SLEEP 3
+#define CONFIG_PM_LIGHT_SLEEP_CALLBACKS 1
+#endif
+#ifndef CONFIG_SPIRAM
+#define CONFIG_SPIRAM 0
+#endif
+
+/* IntercomListener General */
+#define CONFIG_INTERCOM_BOOT_NOTIFICATION 1
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+#define CONFIG_INTERCOM_RING_GPIO_PIN 34
+#define CONFIG_INTERCOM_DOOR_GPIO_PIN 35
+#else
+#define CONFIG_INTERCOM_RING_GPIO_PIN 27
+#define CONFIG_INTERCOM_DOOR_GPIO_PIN 26
+#endif
+#define CONFIG_INTERCOM_DOOR_GPIO_PIN_PULL_DISABLED 1
+#define CONFIG_INTERCOM_RING_GPIO_PIN_PULL_DISABLED 1
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT
+#define CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD 30000
+#define CONFIG_INTERCOM_CAPTURE_GLITCH_FILTER_NS 3000
+#elif CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+#define CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ 20000
+#define CONFIG_INTERCOM_TONE_BLOCK_SAMPLES 160
+#define CONFIG_INTERCOM_TONE_MIN_BLOCKS 3
+#else
+#define CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR 1
+#define CONFIG_INTERCOM_EDGE_JOURNAL_SIZE 64
+#endif
+#ifndef CONFIG_INTERCOM_BURST_CLASSIFIER
+#define CONFIG_INTERCOM_BURST_CLASSIFIER 1
+#endif
+#define CONFIG_INTERCOM_RING_DETECTION_COOLDOWN 1000
+#define CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN 5000
+#define CONFIG_INTERCOM_WAKE_LEVEL 0
+#define CONFIG_INTERCOM_LOG_LEVEL_INFO 1
+#define CONFIG_INTERCOM_DEEP_SLEEP_ENABLED 1
+#define CONFIG_INTERCOM_DEEP_SLEEP_DELAY 30
+#define CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT 1
+#define CONFIG_INTERCOM_DEEP_SLEEP_DURATION 120
+#ifndef CONFIG_INTERCOM_WAKE_PROFILE
+#define CONFIG_INTERCOM_WAKE_PROFILE 1
+#endif
+#define CONFIG_INTERCOM_WAKE_PROFILE_RECORDS 128
+#define CONFIG_INTERCOM_WAKE_PROFILE_REPORT_CYCLES 8
+#define CONFIG_INTERCOM_WAKE_PROFILE_REPORT_INTERVAL 8
+#ifndef CONFIG_INTERCOM_ULP_PULSE_WAKE
+#define CONFIG_INTERCOM_ULP_PULSE_WAKE 0
+#endif
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+#define CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS 20
+#endif
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE && CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+#define CONFIG_INTERCOM_LIGHT_SLEEP 1
+#define CONFIG_INTERCOM_LIGHT_SLEEP_MIN_FREQ_MHZ 40
+#endif
+#ifndef CONFIG_INTERCOM_EVENT_LOG
+#define CONFIG_INTERCOM_EVENT_LOG 1
+#endif
+#if CONFIG_INTERCOM_EVENT_LOG
+#define CONFIG_INTERCOM_EVENT_LOG_BATCH 8
+#endif
+#ifndef CONFIG_INTERCOM_ENERGY_ACCOUNTING
+#define CONFIG_INTERCOM_ENERGY_ACCOUNTING 1
+#endif
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+#define CONFIG_INTERCOM_ENERGY_SLEEP_UA 30
+#else
+#define CONFIG_INTERCOM_ENERGY_SLEEP_UA 10
+#endif
+#define CONFIG_INTERCOM_ENERGY_CPU_MA 40
+#define CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA 110
+#define CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA 60
+#define CONFIG_INTERCOM_ENERGY_TLS_MA 120
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+#define CONFIG_INTERCOM_ENERGY_LIGHT_SLEEP_UA 1500
+#endif
+#define CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH 7000
+#define CONFIG_INTERCOM_ENERGY_BATTERY_MAH 2500
+#endif
+#ifndef CONFIG_INTERCOM_SLEEP_SCHEDULER
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER 0
+#endif
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER_MIN_HOLD 5
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD 300
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER_LATENCY_TARGET_MS 500
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS 1500
+#ifdef CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED
+#define CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_DURATION 3600
+#endif
+#endif
+#define CONFIG_INTERCOM_LED_BLUE_GPIO_PIN 4
+#define CONFIG_INTERCOM_LED_GREEN_GPIO_PIN 2
+#define CONFIG_INTERCOM_LED_RED_GPIO_PIN 0
+#if !defined(CONFIG_INTERCOM_LED_PATTERN_RMT) && !CONFIG_INTERCOM_SENSOR_CAPTURE_RMT && !CONFIG_INTERCOM_LIGHT_SLEEP
+#define CONFIG_INTERCOM_LED_PATTERN_RMT 1
+#endif
+
+/* IntercomListener Telegram Notifications */
+#define CONFIG_INTERCOM_TELEGRAM_ENABLED 1
+#define CONFIG_INTERCOM_TELEGRAM_API_KEY "0000000000:host-simulation"
+#define CONFIG_INTERCOM_TELEGRAM_CHAT_ID "1"
+#ifndef CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE
+#define CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE 1
+#endif
+#define CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE_REFRESH 45
+#ifndef CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+#define CONFIG_INTERCOM_TLS_SESSION_RESUMPTION 1
+#endif
+#define CONFIG_INTERCOM_TLS_SESSION_CACHE_SIZE 2048
+#define CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE 4
+#define CONFIG_INTERCOM_NOTIFICATION_MAX_ATTEMPTS 5
+#define CONFIG_INTERCOM_NOTIFICATION_RETRY_BASE_MS 500
+#define CONFIG_INTERCOM_NOTIFICATION_RETRY_MAX_MS 8000
+#define CONFIG_INTERCOM_NOTIFICATION_DEADLINE 60
+#ifndef CONFIG_INTERCOM_NOTIFICATION_COALESCE_MS
+#define CONFIG_INTERCOM_NOTIFICATION_COALESCE_MS 0
+#endif
+#define CONFIG_INTERCOM_NOTIFICATION_TASK_STACK 8192
+#ifndef CONFIG_INTERCOM_OUTBOX
+#define CONFIG_INTERCOM_OUTBOX 1
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+// Small, so that the bench sees entries spill to NVS within a few wakes.
+#define CONFIG_INTERCOM_OUTBOX_RTC_SIZE 4
+#define CONFIG_INTERCOM_OUTBOX_FLASH_SIZE 64
+#endif
+#ifndef CONFIG_INTERCOM_AUDIO_CLIP
+#define CONFIG_INTERCOM_AUDIO_CLIP 0
+#endif
+#if CONFIG_INTERCOM_AUDIO_CLIP
+#define CONFIG_INTERCOM_AUDIO_GPIO_PIN 36
+#define CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ 8000
+#define CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS 2000
+#define CONFIG_INTERCOM_AUDIO_CLIP_MS 10000
+#define CONFIG_INTERCOM_AUDIO_BUFFER_KB 256
+#endif
+#ifndef CONFIG_INTERCOM_TELEGRAM_COMMANDS
+#define CONFIG_INTERCOM_TELEGRAM_COMMANDS 0
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+#ifndef CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S
+#define CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S 25
+#endif
+#define CONFIG_INTERCOM_TELEGRAM_COMMAND_MUTE_MAX_MIN 1440
+#define CONFIG_INTERCOM_TELEGRAM_COMMAND_AWAKE_MAX_MIN 30
+#define CONFIG_INTERCOM_TELEGRAM_COMMAND_TASK_STACK 8192
+#endif
+
+/* IntercomListener MQTT Notifications */
+#ifndef CONFIG_INTERCOM_MQTT_ENABLED
+#define CONFIG_INTERCOM_MQTT_ENABLED 0
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+#define CONFIG_INTERCOM_MQTT_HOST "broker.sim"
+#define CONFIG_INTERCOM_MQTT_PORT 1883
+#define CONFIG_INTERCOM_MQTT_CLIENT_ID "intercom-listener"
+#define CONFIG_INTERCOM_MQTT_USERNAME ""
+#define CONFIG_INTERCOM_MQTT_PASSWORD ""
+#define CONFIG_INTERCOM_MQTT_TOPIC "intercom"
+#ifndef CONFIG_INTERCOM_MQTT_KEEP_ALIVE
+#define CONFIG_INTERCOM_MQTT_KEEP_ALIVE 60
+#endif
+#define CONFIG_INTERCOM_MQTT_PAYLOAD_JSON 1
+#endif
+
+/* IntercomListener WiFi */
+#define CONFIG_INTERCOM_WIFI_SSID "intercom-sim"
+#define CONFIG_INTERCOM_WIFI_PASSWORD "intercom-sim"
+#define CONFIG_INTERCOM_WIFI_WPA3_SAE_PWE_BOTH 1
+#define CONFIG_INTERCOM_WIFI_PW_ID ""
+#define CONFIG_INTERCOM_WIFI_MAXIMUM_RETRY 5
+#define CONFIG_INTERCOM_WIFI_AUTH_WPA2_PSK 1
+#ifndef CONFIG_INTERCOM_WIFI_FAST_CONNECT
+#define CONFIG_INTERCOM_WIFI_FAST_CONNECT 1
+#endif
+#define CONFIG_INTERCOM_WIFI_FAST_CONNECT_MAX_FAILURES 2
+#define CONFIG_INTERCOM_WIFI_FAST_CONNECT_IP_MAX_AGE 3600
+#ifndef CONFIG_INTERCOM_EARLY_WIFI_START
+#define CONFIG_INTERCOM_EARLY_WIFI_START 1
+#endif
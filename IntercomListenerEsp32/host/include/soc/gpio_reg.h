@@ -0,0 +1,25 @@
+#pragma once
+
+/* The GPIO matrix registers the sensor interrupt reads, at their ESP32 addresses. GPIO_IN1 and
+   GPIO_STATUS1 hold GPIO 32 to 39 in their low bits. GPIO_PINn_REG follow GPIO_PIN0_REG 4 bytes apart;
+   of their fields only the interrupt type and the light sleep wake-up enable are modelled. */
+
+#include "soc/soc.h"
+
+#define DR_REG_GPIO_BASE 0x3ff44000
+
+#define GPIO_IN_REG (DR_REG_GPIO_BASE + 0x3c)
+#define GPIO_IN1_REG (DR_REG_GPIO_BASE + 0x40)
+#define GPIO_STATUS_REG (DR_REG_GPIO_BASE + 0x44)
+#define GPIO_STATUS_W1TS_REG (DR_REG_GPIO_BASE + 0x48)
+#define GPIO_STATUS_W1TC_REG (DR_REG_GPIO_BASE + 0x4c)
+#define GPIO_STATUS1_REG (DR_REG_GPIO_BASE + 0x50)
+#define GPIO_STATUS1_W1TS_REG (DR_REG_GPIO_BASE + 0x54)
+#define GPIO_STATUS1_W1TC_REG (DR_REG_GPIO_BASE + 0x58)
+#define GPIO_PIN0_REG (DR_REG_GPIO_BASE + 0x88)
+
+#define GPIO_PIN0_WAKEUP_ENABLE (1u << 10)
+#define GPIO_PIN0_INT_TYPE 0x00000007
+#define GPIO_PIN0_INT_TYPE_M ((GPIO_PIN0_INT_TYPE_V) << (GPIO_PIN0_INT_TYPE_S))
+#define GPIO_PIN0_INT_TYPE_V 0x7
+#define GPIO_PIN0_INT_TYPE_S 7
@@ -0,0 +1,11 @@
+#pragma once
+
+/* The RTC_CNTL registers the ULP program touches, at their ESP32 addresses. Preprocessor only. */
+
+#define DR_REG_RTCCNTL_BASE 0x3ff48000
+
+#define RTC_CNTL_STATE0_REG (DR_REG_RTCCNTL_BASE + 0x18)
+#define RTC_CNTL_ULP_CP_SLP_TIMER_EN_S 24
+
+#define RTC_CNTL_LOW_POWER_ST_REG (DR_REG_RTCCNTL_BASE + 0xc0)
+#define RTC_CNTL_RDY_FOR_WAKEUP_S 19
@@ -0,0 +1,8 @@
+#pragma once
+
+/* Input levels of the RTC IOs, at their ESP32 address. Preprocessor only. */
+
+#define DR_REG_RTCIO_BASE 0x3ff48400
+
+#define RTC_GPIO_IN_REG (DR_REG_RTCIO_BASE + 0x24)
+#define RTC_GPIO_IN_NEXT_S 14
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Peripheral register access. The simulation backs the registers it models, see sim/gpio.cpp; any other
+   address reads as 0 and ignores writes. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t sim_reg_read(uint32_t address);
+void sim_reg_write(uint32_t address, uint32_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define REG_READ(_r) sim_reg_read((uint32_t)(_r))
+#define REG_WRITE(_r, _v) sim_reg_write((uint32_t)(_r), (uint32_t)(_v))
+#define REG_GET_FIELD(_r, _f) ((REG_READ(_r) >> (_f##_S)) & (_f##_V))
+#define REG_SET_FIELD(_r, _f, _v) REG_WRITE((_r), ((REG_READ(_r) & ~((_f##_V) << (_f##_S))) | (((_v) & (_f##_V)) << (_f##_S))))
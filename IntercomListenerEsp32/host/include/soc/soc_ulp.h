@@ -0,0 +1,12 @@
+#pragma once
+
+#include "soc/rtc_cntl_reg.h"
+
+/* Register access macros of the ULP assembler, as in ESP-IDF: peripheral registers are addressed in
+   words from the RTC_CNTL base. */
+
+#define READ_RTC_REG(rtc_reg, low_bit, bit_width) \
+    reg_rd (((rtc_reg) - DR_REG_RTCCNTL_BASE) / 4), ((low_bit) + (bit_width) - 1), (low_bit)
+
+#define WRITE_RTC_REG(rtc_reg, low_bit, bit_width, value) \
+    reg_wr (((rtc_reg) - DR_REG_RTCCNTL_BASE) / 4), ((low_bit) + (bit_width) - 1), (low_bit), ((value) & 0xff)
@@ -0,0 +1,18 @@
+#pragma once
+
+#include_next <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The chip's RTC clock on the simulation's virtual clock: it counts from power-on and keeps counting through
+   deep sleep, see sim::rtc::sleep_for. */
+int sim_gettimeofday(struct timeval *tv, void *tz);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Like the lwIP names in lwip/netdb.h: firmware code calls the standard name.
+#define gettimeofday(tv, tz) sim_gettimeofday(tv, tz)
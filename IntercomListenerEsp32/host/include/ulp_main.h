@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Stands in for the header ulp_embed_binary generates from the .global symbols of ulp/ulp_main.S.
+   Each name refers to the word of simulated RTC slow memory the loaded program keeps it in. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t *sim_ulp_symbol(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define ulp_entry (*sim_ulp_symbol("entry"))
+#define ulp_wake_channel (*sim_ulp_symbol("wake_channel"))
+#define ulp_rejected_bursts (*sim_ulp_symbol("rejected_bursts"))
+#define ulp_activations (*sim_ulp_symbol("activations"))
+#define ulp_burst_pulses (*sim_ulp_symbol("burst_pulses"))
+#define ulp_burst_samples (*sim_ulp_symbol("burst_samples"))
+#define ulp_burst_wake_samples (*sim_ulp_symbol("burst_wake_samples"))
+#define ulp_burst_period_min (*sim_ulp_symbol("burst_period_min"))
+#define ulp_burst_period_max (*sim_ulp_symbol("burst_period_max"))
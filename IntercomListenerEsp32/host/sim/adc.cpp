@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "kernel.hpp"
+#include "esp_adc/adc_continuous.h"
+
+/*
+   ADC continuous mode. The pattern entries are converted in turn at sample_freq_hz on the virtual clock; a
+   conversion reads the level its pin had at that instant, as the conditioned line would show it: a high level
+   near 2.2 V, a low one near 0.25 V, a few counts of noise on both. A pin given a waveform by the harness reads
+   that instead, like an audio line biased to mid-range. Every frame of conv_frame_size bytes goes
+   into the pool and raises on_conv_done, or on_pool_ovf and is dropped when the pool has no room for it.
+
+   Virtual time skipped by clock::advance is not converted: the next frame starts where the clock landed, as if
+   the reader had kept up. Frames the service thread got to late are converted all the same, back to back, as
+   DMA would have gone on meanwhile. Handles are not freed, as their pin observers keep a pointer to them.
+*/
+
+struct adc_continuous_ctx_t
+{
+    struct line
+    {
+        int gpio = -1;
+        uint8_t channel = 0;
+        int level = 0;
+        // Edges since the start of the frame in progress.
+        std::vector<std::pair<int64_t, int>> edges;
+    };
+
+    std::mutex mutex;
+    uint32_t frame_bytes = 0;
+    uint32_t pool_bytes = 0;
+    uint32_t sample_freq_hz = 0;
+    std::vector<line> lines;
+    adc_continuous_evt_cbs_t callbacks = {};
+    void *user_data = nullptr;
+
+    bool running = false;
+    int64_t frame_start_us = 0;
+    uint64_t conversions = 0;
+    uint64_t generation = 0;
+    uint64_t frame_call = 0;
+    // clock::advance total at the last frame.
+    int64_t advanced_us = 0;
+    uint32_t noise = 0x2545f491;
+    std::vector<uint8_t> frame;
+
+    // Under the kernel lock, which adc_continuous_read waits on.
+    std::deque<uint8_t> pool;
+};
+
+namespace
+{
+    const uint16_t high_counts = 2900;
+    const uint16_t low_counts = 300;
+    const int noise_counts = 8;
+    // A service thread this late is taken for a stalled host, and the frames it missed are skipped after all.
+    const int64_t max_catch_up_us = 1000000;
+
+    std::atomic<uint64_t> isr_count{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> dropped_frames{0};
+
+    // GPIO of each ADC1 channel on ESP32.
+    const int adc1_gpio[] = {36, 37, 38, 39, 32, 33, 34, 35};
+
+    std::mutex waveform_mutex;
+    std::map<int, std::function<int(int64_t)>> waveforms;
+
+    int64_t conversion_time(const adc_continuous_ctx_t *adc, uint64_t conversion)
+    {
+        return adc->frame_start_us + static_cast<int64_t>(conversion * 1000000ULL / adc->sample_freq_hz);
+    }
+
+    int64_t frame_us(const adc_continuous_ctx_t *adc)
+    {
+        return static_cast<int64_t>(adc->frame_bytes / SOC_ADC_DIGI_RESULT_BYTES * 1000000ULL / adc->sample_freq_hz);
+    }
+
+    void on_edge(adc_continuous_ctx_t *adc, size_t index, int level)
+    {
+        std::lock_guard<std::mutex> lock(adc->mutex);
+        adc_continuous_ctx_t::line& line = adc->lines[index];
+        if(adc->running)
+        {
+            // An edge the harness got to after its frame was converted counts from the next one.
+            line.edges.emplace_back(std::max(sim::clock::now_us(), adc->frame_start_us), level);
+        }
+        else
+        {
+            line.level = level;
+        }
+    }
+
+    void schedule_frame(adc_continuous_ctx_t *adc);
+
+    // Converts the frame that ends now and hands it to the pool. Channel lock held.
+    void convert_frame(adc_continuous_ctx_t *adc)
+    {
+        uint32_t count = adc->frame_bytes / SOC_ADC_DIGI_RESULT_BYTES;
+        std::vector<size_t> next_edge(adc->lines.size(), 0);
+        std::vector<std::function<int(int64_t)>> line_waveforms(adc->lines.size());
+        {
+            std::lock_guard<std::mutex> lock(waveform_mutex);
+            for(size_t index = 0; index < adc->lines.size(); index++)
+            {
+                auto waveform = waveforms.find(adc->lines[index].gpio);
+                if(waveform != waveforms.end())
+                {
+                    line_waveforms[index] = waveform->second;
+                }
+            }
+        }
+        for(uint32_t i = 0; i < count; i++)
+        {
+            size_t index = i % adc->lines.size();
+            adc_continuous_ctx_t::line& line = adc->lines[index];
+            int64_t t = conversion_time(adc, i);
+            while(next_edge[index] < line.edges.size() && line.edges[next_edge[index]].first <= t)
+            {
+                line.level = line.edges[next_edge[index]++].second;
+            }
+
+            adc->noise ^= adc->noise << 13;
+            adc->noise ^= adc->noise >> 17;
+            adc->noise ^= adc->noise << 5;
+            int value = line_waveforms[index] ? line_waveforms[index](t) : line.level ? high_counts : low_counts;
+            value = std::clamp(value + static_cast<int>(adc->noise % (2 * noise_counts + 1)) - noise_counts, 0, 4095);
+
+            adc_digi_output_data_t result = {};
+            result.type1.data = static_cast<uint16_t>(value);
+            result.type1.channel = line.channel;
+            adc->frame[2 * i] = static_cast<uint8_t>(result.val);
+            adc->frame[2 * i + 1] = static_cast<uint8_t>(result.val >> 8);
+        }
+
+        for(size_t index = 0; index < adc->lines.size(); index++)
+        {
+            adc_continuous_ctx_t::line& line = adc->lines[index];
+            line.edges.erase(line.edges.begin(), line.edges.begin() + static_cast<std::ptrdiff_t>(next_edge[index]));
+        }
+        adc->conversions += count;
+    }
+
+    void on_frame(adc_continuous_ctx_t *adc, uint64_t generation)
+    {
+        bool stored;
+        adc_continuous_evt_data_t event = {};
+        {
+            std::lock_guard<std::mutex> lock(adc->mutex);
+            if(adc->generation != generation || !adc->running)
+            {
+                return;
+            }
+
+            convert_frame(adc);
+            {
+                std::lock_guard<std::mutex> kernel_lock(sim::kernel::mutex());
+                stored = adc->pool.size() + adc->frame_bytes <= adc->pool_bytes;
+                if(stored)
+                {
+                    adc->pool.insert(adc->pool.end(), adc->frame.begin(), adc->frame.end());
+                }
+            }
+            event.conv_frame_buffer = adc->frame.data();
+            event.size = adc->frame_bytes;
+
+            int64_t now = sim::clock::now_us();
+            int64_t advanced = sim::kernel::advanced_us();
+            adc->frame_start_us += frame_us(adc);
+            if(advanced != adc->advanced_us || now > adc->frame_start_us + max_catch_up_us)
+            {
+                adc->advanced_us = advanced;
+                adc->frame_start_us = now;
+                for(adc_continuous_ctx_t::line& line : adc->lines)
+                {
+                    if(!line.edges.empty())
+                    {
+                        line.level = line.edges.back().second;
+                        line.edges.clear();
+                    }
+                }
+            }
+            schedule_frame(adc);
+        }
+        sim::kernel::notify();
+
+        frames++;
+        isr_count++;
+        if(!stored)
+        {
+            dropped_frames++;
+        }
+        adc_continuous_callback_t callback = stored ? adc->callbacks.on_conv_done : adc->callbacks.on_pool_ovf;
+        if(callback != nullptr)
+        {
+            callback(adc, &event, adc->user_data);
+        }
+    }
+
+    // Channel lock held.
+    void schedule_frame(adc_continuous_ctx_t *adc)
+    {
+        uint64_t generation = adc->generation;
+        adc->frame_call = sim::schedule_at(adc->frame_start_us + frame_us(adc), [adc, generation]()
+        {
+            on_frame(adc, generation);
+        });
+    }
+}
+
+namespace sim::adc
+{
+    uint64_t isr_count()
+    {
+        return ::isr_count.load();
+    }
+
+    uint64_t frames()
+    {
+        return ::frames.load();
+    }
+
+    uint64_t dropped_frames()
+    {
+        return ::dropped_frames.load();
+    }
+
+    void set_waveform(int gpio, std::function<int(int64_t t_us)> counts)
+    {
+        std::lock_guard<std::mutex> lock(waveform_mutex);
+        if(counts)
+        {
+            waveforms[gpio] = std::move(counts);
+        }
+        else
+        {
+            waveforms.erase(gpio);
+        }
+    }
+}
+
+extern "C"
+{
+    esp_err_t adc_continuous_new_handle(const adc_continuous_handle_cfg_t *hdl_config, adc_continuous_handle_t *ret_handle)
+    {
+        if(hdl_config == nullptr || ret_handle == nullptr || hdl_config->conv_frame_size == 0
+            || hdl_config->conv_frame_size % SOC_ADC_DIGI_DATA_BYTES_PER_CONV != 0 || hdl_config->max_store_buf_size < hdl_config->conv_frame_size)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        auto adc = new adc_continuous_ctx_t();
+        adc->frame_bytes = hdl_config->conv_frame_size;
+        adc->pool_bytes = hdl_config->max_store_buf_size;
+        adc->frame.resize(adc->frame_bytes);
+        *ret_handle = adc;
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_config(adc_continuous_handle_t handle, const adc_continuous_config_t *config)
+    {
+        if(handle == nullptr || config == nullptr || config->pattern_num == 0 || config->pattern_num > SOC_ADC_PATT_LEN_MAX
+            || config->sample_freq_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW || config->sample_freq_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH
+            || config->conv_mode != ADC_CONV_SINGLE_UNIT_1 || config->format != ADC_DIGI_OUTPUT_FORMAT_TYPE1)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if(handle->running || !handle->lines.empty())
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        for(uint32_t i = 0; i < config->pattern_num; i++)
+        {
+            const adc_digi_pattern_config_t& entry = config->adc_pattern[i];
+            if(entry.unit != ADC_UNIT_1 || entry.channel >= std::size(adc1_gpio))
+            {
+                handle->lines.clear();
+                return ESP_ERR_INVALID_ARG;
+            }
+            adc_continuous_ctx_t::line line;
+            line.gpio = adc1_gpio[entry.channel];
+            line.channel = entry.channel;
+            line.level = sim::gpio::level(line.gpio);
+            handle->lines.push_back(line);
+        }
+        handle->sample_freq_hz = config->sample_freq_hz;
+
+        for(size_t i = 0; i < handle->lines.size(); i++)
+        {
+            sim::kernel::observe_pin(handle->lines[i].gpio, [handle, i](int level) { on_edge(handle, i, level); });
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_register_event_callbacks(adc_continuous_handle_t handle, const adc_continuous_evt_cbs_t *cbs, void *user_data)
+    {
+        if(handle == nullptr || cbs == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        handle->callbacks = *cbs;
+        handle->user_data = user_data;
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_start(adc_continuous_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if(handle->running || handle->lines.empty())
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        handle->running = true;
+        handle->generation++;
+        handle->frame_start_us = sim::clock::now_us();
+        handle->advanced_us = sim::kernel::advanced_us();
+        schedule_frame(handle);
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_read(adc_continuous_handle_t handle, uint8_t *buf, uint32_t length_max, uint32_t *out_length, uint32_t timeout_ms)
+    {
+        if(handle == nullptr || buf == nullptr || out_length == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        int64_t deadline = timeout_ms == UINT32_MAX ? -1 : sim::clock::now_us() + timeout_ms * 1000LL;
+        if(!sim::kernel::wait_until(lock, deadline, [handle]() { return !handle->pool.empty(); }))
+        {
+            *out_length = 0;
+            return ESP_ERR_TIMEOUT;
+        }
+
+        // Whole conversions, as the driver hands them out.
+        uint32_t length = std::min<uint32_t>(length_max, static_cast<uint32_t>(handle->pool.size()));
+        length -= length % SOC_ADC_DIGI_DATA_BYTES_PER_CONV;
+        std::copy(handle->pool.begin(), handle->pool.begin() + length, buf);
+        handle->pool.erase(handle->pool.begin(), handle->pool.begin() + length);
+        *out_length = length;
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_stop(adc_continuous_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if(!handle->running)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        handle->running = false;
+        handle->generation++;
+        sim::cancel(handle->frame_call);
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_deinit(adc_continuous_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if(handle->running)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t adc_continuous_io_to_channel(int io_num, adc_unit_t *unit_id, adc_channel_t *channel)
+    {
+        if(unit_id == nullptr || channel == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        // Only ADC1 is modelled; ADC2 is not available while Wi-Fi runs anyway.
+        for(size_t i = 0; i < std::size(adc1_gpio); i++)
+        {
+            if(adc1_gpio[i] == io_num)
+            {
+                *unit_id = ADC_UNIT_1;
+                *channel = static_cast<adc_channel_t>(i);
+                return ESP_OK;
+            }
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+}
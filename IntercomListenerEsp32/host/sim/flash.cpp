@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "kernel.hpp"
+#include "sim.hpp"
+#include "esp_partition.h"
+
+/*
+   The data partitions of partitions.csv that the firmware opens with esp_partition_*, as NOR flash:
+   erasing sets whole 4 KiB sectors to 0xff and writing can only clear bits, so a write over data that
+   was not erased leaves the AND of both, as on the chip. Erases and page programs hold up the calling
+   task for the typical times of a 4 MB SPI flash.
+*/
+
+namespace
+{
+    constexpr size_t sector_size = 4096;
+    constexpr size_t page_size = 256;
+    constexpr int64_t sector_erase_us = 45000;
+    constexpr int64_t page_program_us = 700;
+
+    // Only the partitions the firmware opens by label. Keep in step with partitions.csv.
+    const esp_partition_t partitions[] =
+    {
+        {nullptr, ESP_PARTITION_TYPE_DATA, static_cast<esp_partition_subtype_t>(0x40), 0x1d0000, 0x20000, sector_size, "events", false, false},
+    };
+
+    struct flash_state
+    {
+        std::mutex mutex;
+        std::vector<uint8_t> contents[sizeof(partitions) / sizeof(partitions[0])];
+        sim::flash::counters stats;
+    };
+
+    flash_state& state()
+    {
+        static flash_state instance;
+        return instance;
+    }
+
+    // Caller holds the mutex.
+    std::vector<uint8_t>& contents_of(const esp_partition_t *partition)
+    {
+        size_t index = static_cast<size_t>(partition - partitions);
+        std::vector<uint8_t>& contents = state().contents[index];
+        if(contents.size() != partition->size)
+        {
+            contents.assign(partition->size, 0xff);
+        }
+        return contents;
+    }
+
+    bool known(const esp_partition_t *partition)
+    {
+        return partition >= partitions && partition < partitions + sizeof(partitions) / sizeof(partitions[0]);
+    }
+
+    void spend(int64_t duration_us)
+    {
+        sim::kernel::busy_for(duration_us);
+    }
+}
+
+namespace sim::flash
+{
+    std::string image()
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::string text;
+        for(const esp_partition_t& partition : partitions)
+        {
+            const std::vector<uint8_t>& contents = contents_of(&partition);
+            text.append(contents.begin(), contents.end());
+        }
+        return text;
+    }
+
+    void restore(const std::string& flash_image)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        size_t pos = 0;
+        for(const esp_partition_t& partition : partitions)
+        {
+            std::vector<uint8_t>& contents = contents_of(&partition);
+            if(pos + partition.size <= flash_image.size())
+            {
+                std::copy(flash_image.begin() + pos, flash_image.begin() + pos + partition.size, contents.begin());
+            }
+            else
+            {
+                std::fill(contents.begin(), contents.end(), 0xff);
+            }
+            pos += partition.size;
+        }
+    }
+
+    std::string partition_image(const char *label)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for(const esp_partition_t& partition : partitions)
+        {
+            if(std::strcmp(partition.label, label) == 0)
+            {
+                const std::vector<uint8_t>& contents = contents_of(&partition);
+                return std::string(contents.begin(), contents.end());
+            }
+        }
+        return std::string();
+    }
+
+    counters stats()
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.stats;
+    }
+}
+
+extern "C"
+{
+    const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+    {
+        for(const esp_partition_t& partition : partitions)
+        {
+            if((type == ESP_PARTITION_TYPE_ANY || partition.type == type) && (subtype == ESP_PARTITION_SUBTYPE_ANY || partition.subtype == subtype)
+                && (label == nullptr || std::strcmp(partition.label, label) == 0))
+            {
+                return &partition;
+            }
+        }
+        return nullptr;
+    }
+
+    esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+    {
+        if(!known(partition) || dst == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(src_offset > partition->size || size > partition->size - src_offset)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::memcpy(dst, contents_of(partition).data() + src_offset, size);
+        s.stats.reads++;
+        s.stats.bytes_read += size;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+    {
+        if(!known(partition) || src == nullptr || partition->readonly)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(dst_offset > partition->size || size > partition->size - dst_offset)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t pages = size == 0 ? 0 : (dst_offset + size - 1) / page_size - dst_offset / page_size + 1;
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            uint8_t *target = contents_of(partition).data() + dst_offset;
+            const uint8_t *bytes = static_cast<const uint8_t*>(src);
+            for(size_t i = 0; i < size; i++)
+            {
+                target[i] &= bytes[i];
+            }
+            s.stats.writes++;
+            s.stats.bytes_written += size;
+            s.stats.busy_us += static_cast<int64_t>(pages) * page_program_us;
+        }
+        spend(static_cast<int64_t>(pages) * page_program_us);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+    {
+        if(!known(partition) || offset % partition->erase_size != 0 || size % partition->erase_size != 0 || partition->readonly)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(offset > partition->size || size > partition->size - offset)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t sectors = size / sector_size;
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            std::vector<uint8_t>& contents = contents_of(partition);
+            std::fill(contents.begin() + offset, contents.begin() + offset + size, 0xff);
+            s.stats.erases += sectors;
+            s.stats.busy_us += static_cast<int64_t>(sectors) * sector_erase_us;
+        }
+        spend(static_cast<int64_t>(sectors) * sector_erase_us);
+        return ESP_OK;
+    }
+}
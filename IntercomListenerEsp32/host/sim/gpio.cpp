@@ -0,0 +1,501 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "kernel.hpp"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "soc/gpio_reg.h"
+
+namespace
+{
+    struct pin_state
+    {
+        std::atomic<int> level{0};
+        gpio_mode_t mode = GPIO_MODE_DISABLE;
+        gpio_int_type_t intr_type = GPIO_INTR_DISABLE;
+        bool intr_enabled = false;
+        bool wakeup_enabled = false;
+        gpio_isr_t isr_handler = nullptr;
+        void *isr_arg = nullptr;
+        std::vector<sim::kernel::pin_observer> observers;
+    };
+
+    struct gpio_state
+    {
+        std::mutex mutex;
+        std::array<pin_state, GPIO_NUM_MAX> pins;
+        bool isr_service_installed = false;
+        // Handler of the whole GPIO interrupt from gpio_isr_register, which takes precedence over the ISR service.
+        gpio_isr_t isr = nullptr;
+        void *isr_arg = nullptr;
+        // GPIO_STATUS_REG and GPIO_STATUS1_REG as one mask: set by a triggering edge, cleared by the handler.
+        uint64_t intr_status = 0;
+        // A level interrupt is asserted again while the handler runs; it runs once more when it returns.
+        bool level_pending = false;
+        std::atomic<uint64_t> isr_count{0};
+        std::atomic<uint64_t> isr_time_ns{0};
+    };
+
+    gpio_state& state()
+    {
+        static gpio_state instance;
+        return instance;
+    }
+
+    // Set while the calling thread runs the GPIO interrupt handler.
+    thread_local bool in_isr = false;
+
+    bool valid_pin(int pin)
+    {
+        return pin >= 0 && pin < GPIO_NUM_MAX;
+    }
+
+    bool level_type(gpio_int_type_t type)
+    {
+        return type == GPIO_INTR_LOW_LEVEL || type == GPIO_INTR_HIGH_LEVEL;
+    }
+
+    bool edge_triggers(gpio_int_type_t type, int old_level, int new_level)
+    {
+        switch(type)
+        {
+            case GPIO_INTR_POSEDGE:
+                return old_level == 0 && new_level == 1;
+            case GPIO_INTR_NEGEDGE:
+                return old_level == 1 && new_level == 0;
+            case GPIO_INTR_ANYEDGE:
+                return old_level != new_level;
+            case GPIO_INTR_LOW_LEVEL:
+                return new_level == 0;
+            case GPIO_INTR_HIGH_LEVEL:
+                return new_level == 1;
+            default:
+                return false;
+        }
+    }
+
+    void run_handler(gpio_isr_t handler, void *arg)
+    {
+        auto& s = state();
+        sim::kernel::isr_scope isr;
+        in_isr = true;
+        auto start = std::chrono::steady_clock::now();
+        handler(arg);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        in_isr = false;
+        s.isr_count++;
+        s.isr_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+
+    /*
+        Unlike an edge, a level keeps its interrupt asserted: setting the type or clearing the status of a pin
+        at its level raises the interrupt again. Only the handler from gpio_isr_register sees it. Returns the
+        handler to run once the GPIO lock is released, null if none or if the handler running now takes it.
+    */
+    gpio_isr_t assert_level(gpio_state& s, int pin)
+    {
+        const pin_state& p = s.pins[pin];
+        if(!p.intr_enabled || !level_type(p.intr_type) || !edge_triggers(p.intr_type, p.level, p.level) || s.isr == nullptr)
+        {
+            return nullptr;
+        }
+        s.intr_status |= 1ULL << pin;
+        if(in_isr)
+        {
+            s.level_pending = true;
+            return nullptr;
+        }
+        return s.isr;
+    }
+
+    void raise(gpio_isr_t handler)
+    {
+        if(handler != nullptr)
+        {
+            run_handler(handler, state().isr_arg);
+        }
+    }
+}
+
+namespace sim::gpio
+{
+    void preset(int pin, int level)
+    {
+        if(valid_pin(pin))
+        {
+            state().pins[pin].level = level ? 1 : 0;
+        }
+    }
+
+    void drive(int pin, int level)
+    {
+        if(!valid_pin(pin))
+        {
+            return;
+        }
+
+        auto& s = state();
+        gpio_isr_t handler = nullptr;
+        void *arg = nullptr;
+        std::vector<sim::kernel::pin_observer> observers;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            pin_state& p = s.pins[pin];
+            int old_level = p.level.exchange(level ? 1 : 0);
+            if(p.intr_enabled && edge_triggers(p.intr_type, old_level, p.level))
+            {
+                s.intr_status |= 1ULL << pin;
+                if(s.isr != nullptr)
+                {
+                    handler = s.isr;
+                    arg = s.isr_arg;
+                }
+                else if(s.isr_service_installed)
+                {
+                    // The service clears the status before it calls the handler of the pin.
+                    s.intr_status &= ~(1ULL << pin);
+                    handler = p.isr_handler;
+                    arg = p.isr_arg;
+                }
+            }
+            if(old_level != p.level)
+            {
+                observers = p.observers;
+            }
+        }
+
+        for(auto& observer : observers)
+        {
+            observer(level ? 1 : 0);
+        }
+
+        while(handler != nullptr)
+        {
+            run_handler(handler, arg);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            handler = s.level_pending ? s.isr : nullptr;
+            arg = s.isr_arg;
+            s.level_pending = false;
+        }
+    }
+
+    void drive_at(int pin, int level, int64_t at_us)
+    {
+        sim::kernel::edge_time_scope edge_time(at_us);
+        drive(pin, level);
+    }
+
+    int level(int pin)
+    {
+        return valid_pin(pin) ? state().pins[pin].level.load() : 0;
+    }
+
+    uint64_t isr_count()
+    {
+        return state().isr_count.load();
+    }
+
+    uint64_t isr_time_ns()
+    {
+        return state().isr_time_ns.load();
+    }
+}
+
+namespace sim::kernel
+{
+    void observe_pin(int pin, pin_observer observer)
+    {
+        if(valid_pin(pin))
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            state().pins[pin].observers.push_back(std::move(observer));
+        }
+    }
+}
+
+extern "C"
+{
+    esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().pins[gpio_num].mode = mode;
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        state().pins[gpio_num].level = level ? 1 : 0;
+        return ESP_OK;
+    }
+
+    int gpio_get_level(gpio_num_t gpio_num)
+    {
+        return sim::gpio::level(gpio_num);
+    }
+
+    esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        gpio_isr_t handler;
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            state().pins[gpio_num].intr_type = intr_type;
+            handler = assert_level(state(), gpio_num);
+        }
+        raise(handler);
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_intr_enable(gpio_num_t gpio_num)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        gpio_isr_t handler;
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            state().pins[gpio_num].intr_enabled = true;
+            handler = assert_level(state(), gpio_num);
+        }
+        raise(handler);
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_intr_disable(gpio_num_t gpio_num)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().pins[gpio_num].intr_enabled = false;
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+    {
+        if(!valid_pin(gpio_num) || !level_type(intr_type))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        gpio_isr_t handler;
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            state().pins[gpio_num].intr_type = intr_type;
+            state().pins[gpio_num].wakeup_enabled = true;
+            handler = assert_level(state(), gpio_num);
+        }
+        raise(handler);
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().pins[gpio_num].intr_type = GPIO_INTR_DISABLE;
+        state().pins[gpio_num].wakeup_enabled = false;
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags, gpio_isr_handle_t *handle)
+    {
+        if(fn == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().isr = fn;
+        state().isr_arg = arg;
+        if(handle != nullptr)
+        {
+            *handle = nullptr;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        if(state().isr_service_installed)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        state().isr_service_installed = true;
+        return ESP_OK;
+    }
+
+    void gpio_uninstall_isr_service(void)
+    {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().isr_service_installed = false;
+    }
+
+    esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        if(!state().isr_service_installed)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        state().pins[gpio_num].isr_handler = isr_handler;
+        state().pins[gpio_num].isr_arg = args;
+        return ESP_OK;
+    }
+
+    esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num)
+    {
+        if(!valid_pin(gpio_num))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().pins[gpio_num].isr_handler = nullptr;
+        state().pins[gpio_num].isr_arg = nullptr;
+        return ESP_OK;
+    }
+
+    uint32_t sim_reg_read(uint32_t address)
+    {
+        auto& s = state();
+        switch(address)
+        {
+            case GPIO_IN_REG:
+            case GPIO_IN1_REG:
+            {
+                int first = address == GPIO_IN_REG ? 0 : 32;
+                uint32_t levels = 0;
+                for(int pin = first; pin < GPIO_NUM_MAX && pin < first + 32; pin++)
+                {
+                    levels |= static_cast<uint32_t>(s.pins[pin].level.load()) << (pin - first);
+                }
+                return levels;
+            }
+            case GPIO_STATUS_REG:
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                return static_cast<uint32_t>(s.intr_status);
+            }
+            case GPIO_STATUS1_REG:
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                return static_cast<uint32_t>(s.intr_status >> 32);
+            }
+            default:
+                break;
+        }
+        if(address >= GPIO_PIN0_REG && address < GPIO_PIN0_REG + 4 * GPIO_NUM_MAX && address % 4 == 0)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            const pin_state& p = s.pins[(address - GPIO_PIN0_REG) / 4];
+            return (static_cast<uint32_t>(p.intr_type) << GPIO_PIN0_INT_TYPE_S) | (p.wakeup_enabled ? GPIO_PIN0_WAKEUP_ENABLE : 0);
+        }
+        return 0;
+    }
+
+    void sim_reg_write(uint32_t address, uint32_t value)
+    {
+        auto& s = state();
+        gpio_isr_t handler = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            uint64_t cleared = 0;
+            switch(address)
+            {
+                case GPIO_STATUS_W1TC_REG:
+                    cleared = value;
+                    break;
+                case GPIO_STATUS1_W1TC_REG:
+                    cleared = static_cast<uint64_t>(value) << 32;
+                    break;
+                case GPIO_STATUS_W1TS_REG:
+                    s.intr_status |= value;
+                    break;
+                case GPIO_STATUS1_W1TS_REG:
+                    s.intr_status |= static_cast<uint64_t>(value) << 32;
+                    break;
+                default:
+                    if(address >= GPIO_PIN0_REG && address < GPIO_PIN0_REG + 4 * GPIO_NUM_MAX && address % 4 == 0)
+                    {
+                        int pin = static_cast<int>((address - GPIO_PIN0_REG) / 4);
+                        s.pins[pin].intr_type = static_cast<gpio_int_type_t>((value & GPIO_PIN0_INT_TYPE_M) >> GPIO_PIN0_INT_TYPE_S);
+                        s.pins[pin].wakeup_enabled = (value & GPIO_PIN0_WAKEUP_ENABLE) != 0;
+                        handler = assert_level(s, pin);
+                    }
+                    break;
+            }
+            s.intr_status &= ~cleared;
+            for(int pin = 0; cleared != 0 && pin < GPIO_NUM_MAX; pin++)
+            {
+                if(cleared & (1ULL << pin))
+                {
+                    gpio_isr_t again = assert_level(s, pin);
+                    handler = handler != nullptr ? handler : again;
+                }
+            }
+        }
+        raise(handler);
+    }
+
+    esp_err_t rtc_gpio_init(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t rtc_gpio_deinit(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    // The pads keep their levels in the simulation, whichever domain drives them.
+    esp_err_t rtc_gpio_set_direction(gpio_num_t gpio_num, rtc_gpio_mode_t mode)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t rtc_gpio_pullup_en(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t rtc_gpio_pulldown_en(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t rtc_gpio_hold_en(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t rtc_gpio_hold_dis(gpio_num_t gpio_num)
+    {
+        return valid_pin(gpio_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+}
@@ -0,0 +1,118 @@
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include "sim.hpp"
+#include "esp_heap_caps.h"
+
+/*
+   heap_caps_malloc books every allocation against internal RAM or the PSRAM of a WROVER module, with the
+   sizes an ESP32 has free after boot. Only what the firmware allocates through heap_caps is counted; plain
+   malloc and new are not.
+*/
+
+namespace
+{
+    const size_t internal_capacity = 300 * 1024;
+    const size_t psram_capacity = 4 * 1024 * 1024;
+
+    struct heap_state
+    {
+        std::mutex mutex;
+        sim::heap::usage internal{internal_capacity};
+        sim::heap::usage psram{psram_capacity};
+        // Size and region of every live allocation.
+        std::unordered_map<void*, std::pair<size_t, bool>> blocks;
+    };
+
+    heap_state& heap()
+    {
+        static heap_state instance;
+        return instance;
+    }
+
+    sim::heap::usage& region(heap_state& h, bool psram)
+    {
+        return psram ? h.psram : h.internal;
+    }
+}
+
+namespace sim::heap
+{
+    usage internal()
+    {
+        std::lock_guard<std::mutex> lock(::heap().mutex);
+        return ::heap().internal;
+    }
+
+    usage psram()
+    {
+        std::lock_guard<std::mutex> lock(::heap().mutex);
+        return ::heap().psram;
+    }
+}
+
+extern "C"
+{
+    void *heap_caps_malloc(size_t size, uint32_t caps)
+    {
+        auto& h = heap();
+        bool psram = (caps & MALLOC_CAP_SPIRAM) != 0;
+        std::lock_guard<std::mutex> lock(h.mutex);
+        sim::heap::usage& r = region(h, psram);
+        // PSRAM is not DMA capable, nor is anything executable outside IRAM.
+        if(size == 0 || (psram && (caps & (MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_EXEC)) != 0) || r.used + size > r.capacity)
+        {
+            r.failures++;
+            return nullptr;
+        }
+        void *ptr = std::malloc(size);
+        if(ptr == nullptr)
+        {
+            r.failures++;
+            return nullptr;
+        }
+        h.blocks[ptr] = {size, psram};
+        r.used += size;
+        r.peak = r.used > r.peak ? r.used : r.peak;
+        r.allocations++;
+        return ptr;
+    }
+
+    void heap_caps_free(void *ptr)
+    {
+        if(ptr == nullptr)
+        {
+            return;
+        }
+        auto& h = heap();
+        std::lock_guard<std::mutex> lock(h.mutex);
+        auto block = h.blocks.find(ptr);
+        if(block != h.blocks.end())
+        {
+            region(h, block->second.second).used -= block->second.first;
+            h.blocks.erase(block);
+        }
+        std::free(ptr);
+    }
+
+    size_t heap_caps_get_free_size(uint32_t caps)
+    {
+        auto& h = heap();
+        std::lock_guard<std::mutex> lock(h.mutex);
+        sim::heap::usage& r = region(h, (caps & MALLOC_CAP_SPIRAM) != 0);
+        return r.capacity - r.used;
+    }
+
+    size_t heap_caps_get_minimum_free_size(uint32_t caps)
+    {
+        auto& h = heap();
+        std::lock_guard<std::mutex> lock(h.mutex);
+        sim::heap::usage& r = region(h, (caps & MALLOC_CAP_SPIRAM) != 0);
+        return r.capacity - r.peak;
+    }
+
+    size_t heap_caps_get_largest_free_block(uint32_t caps)
+    {
+        return heap_caps_get_free_size(caps);
+    }
+}
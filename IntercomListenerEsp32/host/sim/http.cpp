@@ -0,0 +1,1192 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "kernel.hpp"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_heap_caps.h"
+#include "esp_tls.h"
+#include "lwip/netdb.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+
+/*
+   Plain HTTP/1.1 over loopback stands in for HTTPS to api.telegram.org.
+   DNS, TCP and TLS costs are not real here; they are added as modeled virtual delays per new connection.
+   esp_tls_plain_tcp_connect pays for DNS and TCP. The mbedTLS handshake on top models session resumption:
+   a session offered by the client is accepted when it was issued under the server's current ticket key, and
+   the handshake then costs tls_resume_us instead of tls_handshake_us. Records go out as plain bytes. Connections to a port
+   given to sim::net::route go to the loopback port it names instead, e.g. the stand-in MQTT broker.
+*/
+
+namespace
+{
+    struct header
+    {
+        std::string key;
+        std::string value;
+    };
+
+    bool send_all(int fd, const char *data, size_t len)
+    {
+        while(len > 0)
+        {
+            ssize_t written = ::send(fd, data, len, MSG_NOSIGNAL);
+            if(written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+
+    // Appends what fd has to buffer until it holds at least size bytes.
+    bool receive_at_least(int fd, std::string& buffer, size_t size)
+    {
+        while(buffer.size() < size)
+        {
+            char chunk[1024];
+            ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+            if(received <= 0)
+            {
+                return false;
+            }
+            buffer.append(chunk, received);
+        }
+        return true;
+    }
+
+    // Appends what fd has to buffer until it holds delimiter. Returns its position.
+    size_t receive_until(int fd, std::string& buffer, const char* delimiter)
+    {
+        size_t found;
+        while((found = buffer.find(delimiter)) == std::string::npos)
+        {
+            if(!receive_at_least(fd, buffer, buffer.size() + 1))
+            {
+                return std::string::npos;
+            }
+        }
+        return found;
+    }
+
+    // Decodes a chunked body from the front of buffer into body. Trailers are skipped.
+    bool read_chunked_body(int fd, std::string& buffer, std::string& body)
+    {
+        body.clear();
+        while(true)
+        {
+            size_t line_end = receive_until(fd, buffer, "\r\n");
+            if(line_end == std::string::npos)
+            {
+                return false;
+            }
+            size_t size = std::stoul(buffer.substr(0, line_end), nullptr, 16);
+            buffer.erase(0, line_end + 2);
+            if(size == 0)
+            {
+                size_t trailer_end;
+                while((trailer_end = receive_until(fd, buffer, "\r\n")) != 0)
+                {
+                    if(trailer_end == std::string::npos)
+                    {
+                        return false;
+                    }
+                    buffer.erase(0, trailer_end + 2);
+                }
+                buffer.erase(0, 2);
+                return true;
+            }
+            if(!receive_at_least(fd, buffer, size + 2) || buffer.compare(size, 2, "\r\n") != 0)
+            {
+                return false;
+            }
+            body.append(buffer, 0, size);
+            buffer.erase(0, size + 2);
+        }
+    }
+
+    // Reads one HTTP message head and its body, Content-Length or chunked, from fd. buffer keeps bytes of the
+    // next message. chunked, if given, tells which of the two the body was.
+    bool read_message(int fd, std::string& buffer, std::string& head, std::string& body, bool* chunked = nullptr)
+    {
+        size_t head_end = receive_until(fd, buffer, "\r\n\r\n");
+        if(head_end == std::string::npos)
+        {
+            return false;
+        }
+
+        head = buffer.substr(0, head_end + 2);
+        buffer.erase(0, head_end + 4);
+
+        size_t content_length = 0;
+        std::string lower = head;
+        for(char& c : lower)
+        {
+            c = static_cast<char>(tolower(c));
+        }
+        bool is_chunked = lower.find("transfer-encoding: chunked") != std::string::npos;
+        if(chunked != nullptr)
+        {
+            *chunked = is_chunked;
+        }
+        if(is_chunked)
+        {
+            return read_chunked_body(fd, buffer, body);
+        }
+        size_t pos = lower.find("content-length:");
+        if(pos != std::string::npos)
+        {
+            content_length = std::stoul(head.substr(pos + 15));
+        }
+
+        if(!receive_at_least(fd, buffer, content_length))
+        {
+            return false;
+        }
+        body = buffer.substr(0, content_length);
+        buffer.erase(0, content_length);
+        return true;
+    }
+
+    std::vector<header> parse_headers(const std::string& head)
+    {
+        std::vector<header> headers;
+        size_t line_start = head.find("\r\n");
+        while(line_start != std::string::npos && line_start + 2 < head.size())
+        {
+            line_start += 2;
+            size_t line_end = head.find("\r\n", line_start);
+            std::string line = head.substr(line_start, line_end - line_start);
+            size_t colon = line.find(':');
+            if(colon != std::string::npos)
+            {
+                size_t value_start = line.find_first_not_of(' ', colon + 1);
+                headers.push_back({line.substr(0, colon), value_start == std::string::npos ? "" : line.substr(value_start)});
+            }
+            line_start = line_end;
+        }
+        return headers;
+    }
+
+    struct server_state
+    {
+        std::mutex mutex;
+        int listen_fd = -1;
+        int port = 0;
+        std::atomic<bool> running{false};
+        std::thread accept_thread;
+        std::vector<std::thread> connection_threads;
+        std::vector<int> connection_fds;
+
+        int status_code = 200;
+        int64_t response_delay_us = 0;
+        sim::http_server::framing response_framing = sim::http_server::framing::content_length;
+        int64_t idle_timeout_us = 0;
+        // The next failures_left requests whose path contains failure_path are answered with failure_status, or not at all if it is 0.
+        int failures_left = 0;
+        int failure_status = 503;
+        std::string failure_path;
+        std::vector<sim::http_server::request> requests;
+        // Bot API updates not yet confirmed by a getUpdates offset past them, as JSON objects.
+        std::vector<std::pair<int64_t, std::string>> updates;
+        int64_t next_update_id = 700000000;
+    };
+
+    std::string json_string(const std::string& text)
+    {
+        std::string quoted = "\"";
+        for(unsigned char c : text)
+        {
+            if(c == '"' || c == '\\')
+            {
+                quoted += '\\';
+                quoted += static_cast<char>(c);
+            }
+            else if(c < 0x20)
+            {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                quoted += escape;
+            }
+            else
+            {
+                quoted += static_cast<char>(c);
+            }
+        }
+        return quoted + "\"";
+    }
+
+    // Value of name in the query string of path, or fallback.
+    long long query_parameter(const std::string& path, const std::string& name, long long fallback)
+    {
+        size_t query = path.find('?');
+        for(size_t at = query; at != std::string::npos; at = path.find('&', at + 1))
+        {
+            if(path.compare(at + 1, name.size() + 1, name + "=") == 0)
+            {
+                return std::atoll(path.c_str() + at + 1 + name.size() + 1);
+            }
+        }
+        return fallback;
+    }
+
+    server_state& server()
+    {
+        static server_state instance;
+        return instance;
+    }
+
+    struct net_state
+    {
+        std::mutex mutex;
+        sim::net::model model;
+        std::atomic<uint64_t> connections_opened{0};
+        std::atomic<uint64_t> handshakes_full{0};
+        std::atomic<uint64_t> handshakes_resumed{0};
+        std::atomic<uint32_t> ticket_epoch{1};
+        std::set<std::string> resolved;
+        // Port the firmware dials to loopback port.
+        std::map<int, int> routes;
+    };
+
+    net_state& net()
+    {
+        static net_state instance;
+        return instance;
+    }
+
+    // Caller holds the kernel lock.
+    size_t count_matching(const std::string& path_contains)
+    {
+        size_t count = 0;
+        for(const sim::http_server::request& r : server().requests)
+        {
+            count += r.path.find(path_contains) != std::string::npos;
+        }
+        return count;
+    }
+
+    // A long poll as the Bot API answers it: at once with the updates from offset on, or once one is posted,
+    // or with none after timeout seconds. Updates before offset are confirmed and forgotten.
+    std::string get_updates(const std::string& path)
+    {
+        auto& s = server();
+        long long offset = query_parameter(path, "offset", 0);
+        long long limit = query_parameter(path, "limit", 100);
+        int64_t timeout_us = query_parameter(path, "timeout", 0) * 1000000;
+
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        auto confirmed = [offset](const std::pair<int64_t, std::string>& update) { return update.first < offset; };
+        s.updates.erase(std::remove_if(s.updates.begin(), s.updates.end(), confirmed), s.updates.end());
+        sim::kernel::wait_until(lock, sim::clock::now_us() + timeout_us, [&s]() { return !s.updates.empty() || !s.running; });
+
+        std::string result;
+        for(size_t i = 0; i < s.updates.size() && static_cast<long long>(i) < limit; i++)
+        {
+            result += (i > 0 ? "," : "") + s.updates[i].second;
+        }
+        return "{\"ok\":true,\"result\":[" + result + "]}";
+    }
+
+    void serve_connection(int fd)
+    {
+        auto& s = server();
+        std::string buffer;
+        std::string head;
+        std::string body;
+        bool chunked = false;
+        int64_t last_response_us = sim::clock::now_us();
+        while(s.running && read_message(fd, buffer, head, body, &chunked))
+        {
+            int64_t idle_timeout_us;
+            {
+                std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+                idle_timeout_us = s.idle_timeout_us;
+            }
+            // The server would have closed the connection while it idled; the request never reaches it.
+            if(idle_timeout_us > 0 && sim::clock::now_us() - last_response_us > idle_timeout_us)
+            {
+                break;
+            }
+
+            size_t method_end = head.find(' ');
+            size_t path_end = head.find(' ', method_end + 1);
+
+            int status_code;
+            int64_t delay_us;
+            sim::http_server::framing response_framing;
+            {
+                std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+                s.requests.push_back({sim::clock::now_us(), head.substr(0, method_end), head.substr(method_end + 1, path_end - method_end - 1), body, chunked});
+                status_code = s.status_code;
+                delay_us = s.response_delay_us;
+                response_framing = s.response_framing;
+                if(s.failures_left > 0 && s.requests.back().path.find(s.failure_path) != std::string::npos)
+                {
+                    s.failures_left--;
+                    status_code = s.failure_status;
+                }
+            }
+            sim::kernel::notify();
+
+            if(delay_us > 0)
+            {
+                sim::clock::sleep_for(delay_us);
+            }
+            if(status_code == 0)
+            {
+                break;
+            }
+
+            bool close_after = head.find("Connection: close") != std::string::npos;
+            std::string response_body = status_code == 200 ? "{\"ok\":true,\"result\":{}}" : "{\"ok\":false,\"error_code\":" + std::to_string(status_code) + "}";
+            if(status_code == 200 && head.find("/getUpdates") != std::string::npos)
+            {
+                response_body = get_updates(head.substr(method_end + 1, path_end - method_end - 1));
+            }
+            std::string response = "HTTP/1.1 " + std::to_string(status_code) + (status_code == 200 ? " OK" : " Error") + "\r\n"
+                "Content-Type: application/json\r\n"
+                "Connection: " + (close_after ? "close" : "keep-alive") + "\r\n";
+            if(status_code == 204 || status_code == 304)
+            {
+                response += "\r\n";
+            }
+            else if(response_framing == sim::http_server::framing::chunked)
+            {
+                response = "HTTP/1.1 100 Continue\r\n\r\n" + response + "Transfer-Encoding: chunked\r\n\r\n";
+                for(size_t at = 0; at < response_body.size(); at += 7)
+                {
+                    std::string chunk = response_body.substr(at, 7);
+                    char size[16];
+                    snprintf(size, sizeof(size), "%zx", chunk.size());
+                    response += std::string(size) + (at == 0 ? ";sim=1" : "") + "\r\n" + chunk + "\r\n";
+                }
+                response += "0\r\nX-Sim-Trailer: 1\r\n\r\n";
+            }
+            else if(response_framing == sim::http_server::framing::unframed)
+            {
+                response += "\r\n" + response_body;
+            }
+            else
+            {
+                response += "Content-Length: " + std::to_string(response_body.size()) + "\r\n\r\n" + response_body;
+            }
+            if(!send_all(fd, response.data(), response.size()) || close_after)
+            {
+                break;
+            }
+            last_response_us = sim::clock::now_us();
+        }
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    void accept_routine()
+    {
+        auto& s = server();
+        while(s.running)
+        {
+            pollfd pfd = {s.listen_fd, POLLIN, 0};
+            if(::poll(&pfd, 1, 50) <= 0)
+            {
+                continue;
+            }
+
+            int fd = ::accept(s.listen_fd, nullptr, nullptr);
+            if(fd < 0)
+            {
+                continue;
+            }
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.connection_fds.push_back(fd);
+            s.connection_threads.emplace_back(serve_connection, fd);
+        }
+    }
+}
+
+namespace sim
+{
+    namespace net
+    {
+        void configure(const model& net_model)
+        {
+            std::lock_guard<std::mutex> lock(::net().mutex);
+            ::net().model = net_model;
+        }
+
+        uint64_t connections_opened()
+        {
+            return ::net().connections_opened.load();
+        }
+
+        void reject_sessions()
+        {
+            ::net().ticket_epoch++;
+        }
+
+        uint64_t handshakes_full()
+        {
+            return ::net().handshakes_full.load();
+        }
+
+        uint64_t handshakes_resumed()
+        {
+            return ::net().handshakes_resumed.load();
+        }
+
+        void route(int port, int loopback_port)
+        {
+            std::lock_guard<std::mutex> lock(::net().mutex);
+            if(loopback_port > 0)
+            {
+                ::net().routes[port] = loopback_port;
+            }
+            else
+            {
+                ::net().routes.erase(port);
+            }
+        }
+    }
+
+    namespace http_server
+    {
+        int start()
+        {
+            auto& s = server();
+            s.listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            ::setsockopt(s.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            if(::bind(s.listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(s.listen_fd, 16) != 0)
+            {
+                ::close(s.listen_fd);
+                s.listen_fd = -1;
+                return -1;
+            }
+
+            socklen_t addr_len = sizeof(addr);
+            ::getsockname(s.listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+            s.port = ntohs(addr.sin_port);
+            s.running = true;
+            s.accept_thread = std::thread(accept_routine);
+            return s.port;
+        }
+
+        void stop()
+        {
+            auto& s = server();
+            if(!s.running)
+            {
+                return;
+            }
+            s.running = false;
+            // Ends any long poll parked in get_updates.
+            sim::kernel::notify();
+            s.accept_thread.join();
+
+            std::vector<std::thread> threads;
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                for(int fd : s.connection_fds)
+                {
+                    ::shutdown(fd, SHUT_RDWR);
+                }
+                threads.swap(s.connection_threads);
+            }
+            for(auto& thread : threads)
+            {
+                thread.join();
+            }
+            for(int fd : s.connection_fds)
+            {
+                ::close(fd);
+            }
+            s.connection_fds.clear();
+            ::close(s.listen_fd);
+            s.listen_fd = -1;
+        }
+
+        void set_status(int status_code)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            server().status_code = status_code;
+        }
+
+        void fail_requests(int count, int status_code, const std::string& path_contains)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            server().failures_left = count;
+            server().failure_status = status_code;
+            server().failure_path = path_contains;
+        }
+
+        int64_t post_update(const std::string& text, long long chat_id)
+        {
+            int64_t update_id;
+            {
+                std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+                auto& s = server();
+                update_id = s.next_update_id++;
+                std::string from = "{\"id\":" + std::to_string(chat_id) + ",\"is_bot\":false,\"first_name\":\"Sim\"}";
+                size_t command_length = text.compare(0, 1, "/") == 0 ? text.find(' ') : 0;
+                command_length = command_length == std::string::npos ? text.size() : command_length;
+                std::string entities = command_length > 0
+                    ? ",\"entities\":[{\"offset\":0,\"length\":" + std::to_string(command_length) + ",\"type\":\"bot_command\"}]" : "";
+                s.updates.emplace_back(update_id, "{\"update_id\":" + std::to_string(update_id) + ",\"message\":{\"message_id\":"
+                    + std::to_string(update_id % 100000) + ",\"from\":" + from + ",\"chat\":{\"id\":" + std::to_string(chat_id)
+                    + ",\"first_name\":\"Sim\",\"type\":\"private\"},\"date\":" + std::to_string(1700000000 + sim::clock::now_us() / 1000000)
+                    + ",\"text\":" + json_string(text) + entities + "}}");
+            }
+            sim::kernel::notify();
+            return update_id;
+        }
+
+        void set_response_delay(int64_t delay_us)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            server().response_delay_us = delay_us;
+        }
+
+        void set_response_framing(framing response_framing)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            server().response_framing = response_framing;
+        }
+
+        void set_idle_timeout(int64_t timeout_us)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            server().idle_timeout_us = timeout_us;
+        }
+
+        void drop_connections()
+        {
+            auto& s = server();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            for(int fd : s.connection_fds)
+            {
+                ::shutdown(fd, SHUT_RDWR);
+            }
+        }
+
+        size_t request_count(const std::string& path_contains)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            return count_matching(path_contains);
+        }
+
+        std::vector<request> requests(const std::string& path_contains)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            std::vector<request> matching;
+            for(const request& r : server().requests)
+            {
+                if(r.path.find(path_contains) != std::string::npos)
+                {
+                    matching.push_back(r);
+                }
+            }
+            return matching;
+        }
+
+        bool wait_for_requests(size_t count, int64_t timeout_us, const std::string& path_contains)
+        {
+            return sim::wait_for([count, &path_contains]() { return count_matching(path_contains) >= count; }, timeout_us);
+        }
+    }
+}
+
+struct esp_http_client
+{
+    esp_http_client_config_t config;
+    std::string host;
+    std::string path;
+    esp_http_client_method_t method = HTTP_METHOD_GET;
+    std::vector<header> headers;
+    std::string post_data;
+
+    int fd = -1;
+    std::string receive_buffer;
+    int status_code = -1;
+    int64_t content_length = -1;
+};
+
+namespace
+{
+    void dispatch(esp_http_client_handle_t client, esp_http_client_event_id_t id, void *data = nullptr, int data_len = 0,
+                  const char *key = nullptr, const char *value = nullptr)
+    {
+        if(client->config.event_handler == nullptr)
+        {
+            return;
+        }
+        esp_http_client_event_t event = {};
+        event.event_id = id;
+        event.client = client;
+        event.data = data;
+        event.data_len = data_len;
+        event.user_data = client->config.user_data;
+        event.header_key = const_cast<char*>(key);
+        event.header_value = const_cast<char*>(value);
+        client->config.event_handler(&event);
+    }
+
+    const char *method_name(esp_http_client_method_t method)
+    {
+        switch(method)
+        {
+            case HTTP_METHOD_POST: return "POST";
+            case HTTP_METHOD_PUT: return "PUT";
+            case HTTP_METHOD_PATCH: return "PATCH";
+            case HTTP_METHOD_DELETE: return "DELETE";
+            case HTTP_METHOD_HEAD: return "HEAD";
+            default: return "GET";
+        }
+    }
+
+    void close_connection(esp_http_client_handle_t client)
+    {
+        if(client->fd >= 0)
+        {
+            ::close(client->fd);
+            client->fd = -1;
+            client->receive_buffer.clear();
+            dispatch(client, HTTP_EVENT_DISCONNECTED);
+        }
+    }
+
+    sim::net::model net_model()
+    {
+        std::lock_guard<std::mutex> lock(net().mutex);
+        return net().model;
+    }
+
+    void spend(int64_t duration_us)
+    {
+        if(duration_us > 0)
+        {
+            sim::kernel::busy_for(duration_us);
+        }
+    }
+
+    // Virtual time the lookup of host costs: dns_us the first time, nothing once it is cached.
+    int64_t resolve_us(const char *host)
+    {
+        std::lock_guard<std::mutex> lock(net().mutex);
+        return net().resolved.insert(host != nullptr ? host : "").second ? net().model.dns_us : 0;
+    }
+
+    // Connects to the stand-in server, or where sim::net::route sends device_port, after setup_us of virtual
+    // time spent on TCP and TLS. Returns the socket or -1.
+    int connect_socket(int64_t setup_us, int device_port = 0)
+    {
+        int port = server().port;
+        {
+            std::lock_guard<std::mutex> lock(net().mutex);
+            auto route = net().routes.find(device_port);
+            if(route != net().routes.end())
+            {
+                port = route->second;
+            }
+            else if(!server().running)
+            {
+                return -1;
+            }
+        }
+
+        spend(setup_us);
+
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        net().connections_opened++;
+        return fd;
+    }
+
+    esp_err_t open_connection(esp_http_client_handle_t client)
+    {
+        if(client->fd >= 0)
+        {
+            return ESP_OK;
+        }
+
+        sim::net::model model = net_model();
+        int64_t setup_us = resolve_us(client->config.host) + model.connect_us;
+        if(client->config.transport_type == HTTP_TRANSPORT_OVER_SSL)
+        {
+            setup_us += model.tls_handshake_us;
+            net().handshakes_full++;
+        }
+
+        int fd = connect_socket(setup_us);
+        if(fd < 0)
+        {
+            return ESP_ERR_HTTP_CONNECT;
+        }
+        client->fd = fd;
+        dispatch(client, HTTP_EVENT_ON_CONNECTED);
+        return ESP_OK;
+    }
+}
+
+// mbedTLS defaults for CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN and _OUT_CONTENT_LEN.
+#define SIM_TLS_IN_RECORD_BYTES 16384
+#define SIM_TLS_OUT_RECORD_BYTES 4096
+
+extern "C"
+{
+    esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+    {
+        auto client = new esp_http_client();
+        client->config = *config;
+        client->method = config->method;
+        client->host = config->host != nullptr ? config->host : "localhost";
+        client->path = config->path != nullptr ? config->path : "/";
+        if(config->url != nullptr)
+        {
+            esp_http_client_set_url(client, config->url);
+        }
+        if(config->transport_type == HTTP_TRANSPORT_UNKNOWN)
+        {
+            client->config.transport_type = HTTP_TRANSPORT_OVER_TCP;
+        }
+        return client;
+    }
+
+    esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url)
+    {
+        std::string value = url;
+        size_t scheme_end = value.find("://");
+        if(scheme_end != std::string::npos)
+        {
+            client->config.transport_type = value.compare(0, scheme_end, "https") == 0 ? HTTP_TRANSPORT_OVER_SSL : HTTP_TRANSPORT_OVER_TCP;
+            value.erase(0, scheme_end + 3);
+        }
+        size_t path_start = value.find('/');
+        client->host = value.substr(0, path_start);
+        client->path = path_start == std::string::npos ? "/" : value.substr(path_start);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+    {
+        client->method = method;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+    {
+        for(auto& h : client->headers)
+        {
+            if(strcasecmp(h.key.c_str(), key) == 0)
+            {
+                h.value = value;
+                return ESP_OK;
+            }
+        }
+        client->headers.push_back({key, value});
+        return ESP_OK;
+    }
+
+    esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len)
+    {
+        client->post_data.assign(data, len);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_http_client_perform(esp_http_client_handle_t client)
+    {
+        esp_err_t err = open_connection(client);
+        if(err != ESP_OK)
+        {
+            dispatch(client, HTTP_EVENT_ERROR);
+            return err;
+        }
+
+        std::string request = std::string(method_name(client->method)) + " " + client->path + " HTTP/1.1\r\n"
+            "Host: " + client->host + "\r\n"
+            "User-Agent: ESP32 HTTP Client/1.0\r\n";
+        for(auto& h : client->headers)
+        {
+            request += h.key + ": " + h.value + "\r\n";
+        }
+        request += "Content-Length: " + std::to_string(client->post_data.size()) + "\r\n\r\n";
+        request += client->post_data;
+
+        if(!send_all(client->fd, request.data(), request.size()))
+        {
+            close_connection(client);
+            return ESP_ERR_HTTP_WRITE_DATA;
+        }
+        dispatch(client, HTTP_EVENT_HEADER_SENT);
+
+        std::string head;
+        std::string body;
+        if(!read_message(client->fd, client->receive_buffer, head, body))
+        {
+            close_connection(client);
+            dispatch(client, HTTP_EVENT_ERROR);
+            return ESP_ERR_HTTP_FETCH_HEADER;
+        }
+
+        client->status_code = std::atoi(head.c_str() + head.find(' ') + 1);
+        client->content_length = static_cast<int64_t>(body.size());
+        bool server_closes = false;
+        for(auto& h : parse_headers(head))
+        {
+            dispatch(client, HTTP_EVENT_ON_HEADER, nullptr, 0, h.key.c_str(), h.value.c_str());
+            if(strcasecmp(h.key.c_str(), "Connection") == 0 && strcasecmp(h.value.c_str(), "close") == 0)
+            {
+                server_closes = true;
+            }
+        }
+        if(!body.empty())
+        {
+            dispatch(client, HTTP_EVENT_ON_DATA, body.data(), static_cast<int>(body.size()));
+        }
+        dispatch(client, HTTP_EVENT_ON_FINISH);
+
+        // Like ESP-IDF, the connection stays open unless the server closes it. keep_alive_enable only turns on TCP keep-alive probes.
+        if(server_closes)
+        {
+            close_connection(client);
+        }
+        return ESP_OK;
+    }
+
+    int esp_http_client_get_status_code(esp_http_client_handle_t client)
+    {
+        return client->status_code;
+    }
+
+    int64_t esp_http_client_get_content_length(esp_http_client_handle_t client)
+    {
+        return client->content_length;
+    }
+
+    esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+    {
+        close_connection(client);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+    {
+        if(client == nullptr)
+        {
+            return ESP_FAIL;
+        }
+        close_connection(client);
+        delete client;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_crt_bundle_attach(void *conf)
+    {
+        return ESP_OK;
+    }
+
+    // Every name resolves to the stand-in server.
+    int lwip_getaddrinfo(const char *nodename, const char *servname, const struct addrinfo *hints, struct addrinfo **res)
+    {
+        spend(resolve_us(nodename));
+        struct result
+        {
+            addrinfo info;
+            sockaddr_in addr;
+        };
+        result *r = static_cast<result *>(calloc(1, sizeof(result)));
+        r->addr.sin_family = AF_INET;
+        r->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        r->addr.sin_port = htons(servname != nullptr ? atoi(servname) : 0);
+        r->info.ai_family = AF_INET;
+        r->info.ai_socktype = hints != nullptr ? hints->ai_socktype : SOCK_STREAM;
+        r->info.ai_addrlen = sizeof(r->addr);
+        r->info.ai_addr = reinterpret_cast<sockaddr *>(&r->addr);
+        *res = &r->info;
+        return 0;
+    }
+
+    void lwip_freeaddrinfo(struct addrinfo *ai)
+    {
+        free(ai);
+    }
+
+    esp_err_t esp_tls_plain_tcp_connect(const char *host, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_error_handle_t error_handle,
+        int *sockfd)
+    {
+        *sockfd = connect_socket(resolve_us(host) + net_model().connect_us, port);
+        if(*sockfd < 0)
+        {
+            if(error_handle != nullptr)
+            {
+                error_handle->last_error = ESP_FAIL;
+            }
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+    void mbedtls_net_init(mbedtls_net_context *ctx)
+    {
+        ctx->fd = -1;
+    }
+
+    void mbedtls_net_free(mbedtls_net_context *ctx)
+    {
+        if(ctx->fd >= 0)
+        {
+            ::close(ctx->fd);
+            ctx->fd = -1;
+        }
+    }
+
+    int mbedtls_net_send(void *ctx, const unsigned char *buf, size_t len)
+    {
+        int64_t uplink = net_model().uplink_bytes_per_s;
+        if(uplink > 0)
+        {
+            spend(static_cast<int64_t>(len) * 1000000 / uplink);
+        }
+        ssize_t written = ::send(static_cast<mbedtls_net_context*>(ctx)->fd, buf, len, MSG_NOSIGNAL);
+        return written < 0 ? MBEDTLS_ERR_NET_SEND_FAILED : static_cast<int>(written);
+    }
+
+    int mbedtls_net_recv(void *ctx, unsigned char *buf, size_t len)
+    {
+        ssize_t received = ::recv(static_cast<mbedtls_net_context*>(ctx)->fd, buf, len, 0);
+        return received < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : static_cast<int>(received);
+    }
+
+    void mbedtls_entropy_init(mbedtls_entropy_context *ctx)
+    {
+        *ctx = {};
+    }
+
+    void mbedtls_entropy_free(mbedtls_entropy_context *ctx)
+    {
+        *ctx = {};
+    }
+
+    int mbedtls_entropy_func(void *data, unsigned char *output, size_t len)
+    {
+        std::random_device random;
+        for(size_t i = 0; i < len; i++)
+        {
+            output[i] = static_cast<unsigned char>(random());
+        }
+        return 0;
+    }
+
+    void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *ctx)
+    {
+        *ctx = {};
+    }
+
+    void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *ctx)
+    {
+        *ctx = {};
+    }
+
+    int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *ctx, int (*f_entropy)(void *, unsigned char *, size_t), void *p_entropy,
+        const unsigned char *custom, size_t len)
+    {
+        ctx->f_entropy = f_entropy;
+        ctx->p_entropy = p_entropy;
+        return 0;
+    }
+
+    int mbedtls_ctr_drbg_random(void *p_rng, unsigned char *output, size_t output_len)
+    {
+        auto ctx = static_cast<mbedtls_ctr_drbg_context*>(p_rng);
+        return ctx->f_entropy(ctx->p_entropy, output, output_len);
+    }
+
+    void mbedtls_ssl_config_init(mbedtls_ssl_config *conf)
+    {
+        *conf = {};
+    }
+
+    void mbedtls_ssl_config_free(mbedtls_ssl_config *conf)
+    {
+        *conf = {};
+    }
+
+    int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset)
+    {
+        conf->endpoint = endpoint;
+        return 0;
+    }
+
+    void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode)
+    {
+        conf->authmode = authmode;
+    }
+
+    void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+    {
+        conf->f_rng = f_rng;
+        conf->p_rng = p_rng;
+    }
+
+    void mbedtls_ssl_conf_ca_cb(mbedtls_ssl_config *conf, mbedtls_x509_crt_ca_cb_t f_ca_cb, void *p_ca_cb)
+    {
+        conf->f_ca_cb = f_ca_cb;
+        conf->p_ca_cb = p_ca_cb;
+    }
+
+    void mbedtls_ssl_init(mbedtls_ssl_context *ssl)
+    {
+        *ssl = {};
+    }
+
+    void mbedtls_ssl_free(mbedtls_ssl_context *ssl)
+    {
+        heap_caps_free(ssl->records_in);
+        heap_caps_free(ssl->records_out);
+        *ssl = {};
+    }
+
+    int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+    {
+        ssl->conf = conf;
+        ssl->records_in = heap_caps_malloc(SIM_TLS_IN_RECORD_BYTES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        ssl->records_out = heap_caps_malloc(SIM_TLS_OUT_RECORD_BYTES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        return ssl->records_in != nullptr && ssl->records_out != nullptr ? 0 : MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+
+    int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname)
+    {
+        return 0;
+    }
+
+    void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send, mbedtls_ssl_recv_t *f_recv,
+        mbedtls_ssl_recv_timeout_t *f_recv_timeout)
+    {
+        ssl->p_bio = p_bio;
+        ssl->f_send = f_send;
+        ssl->f_recv = f_recv;
+    }
+
+    int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+    {
+        ssl->offered = 1;
+        ssl->offered_session = *session;
+        return 0;
+    }
+
+    int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+    {
+        *session = ssl->session;
+        return 0;
+    }
+
+    int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl)
+    {
+        sim::net::model model = net_model();
+        bool resumed = ssl->offered && ssl->offered_session.id_len > 0 && ssl->offered_session.ticket_epoch == net().ticket_epoch.load();
+        spend(resumed ? model.tls_resume_us : model.tls_handshake_us);
+        if(resumed)
+        {
+            ssl->session = ssl->offered_session;
+            net().handshakes_resumed++;
+            return 0;
+        }
+
+        // Only a full handshake has a certificate chain to verify. Nothing in the chain is trusted on its own,
+        // so an empty list of candidates leaves the verdict to the certificate bundle, as on the device.
+        if(ssl->conf->f_ca_cb != nullptr)
+        {
+            mbedtls_x509_crt* candidates = nullptr;
+            ssl->conf->f_ca_cb(ssl->conf->p_ca_cb, nullptr, &candidates);
+        }
+        // A full handshake issues a fresh session under the current ticket key. IDs are random, as on a
+        // real server, so they differ from sessions issued to an earlier wake in another process.
+        std::random_device random;
+        ssl->session = {};
+        ssl->session.id_len = sizeof(ssl->session.id);
+        for(unsigned char& byte : ssl->session.id)
+        {
+            byte = static_cast<unsigned char>(random());
+        }
+        ssl->session.ticket_epoch = net().ticket_epoch.load();
+        net().handshakes_full++;
+        return 0;
+    }
+
+    int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len)
+    {
+        return ssl->f_recv(ssl->p_bio, buf, len);
+    }
+
+    int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+    {
+        return ssl->f_send(ssl->p_bio, buf, len);
+    }
+
+    void mbedtls_ssl_session_init(mbedtls_ssl_session *session)
+    {
+        *session = {};
+    }
+
+    void mbedtls_ssl_session_free(mbedtls_ssl_session *session)
+    {
+        *session = {};
+    }
+
+    int mbedtls_ssl_session_save(const mbedtls_ssl_session *session, unsigned char *buf, size_t buf_len, size_t *olen)
+    {
+        *olen = sizeof(*session);
+        if(buf_len < sizeof(*session))
+        {
+            return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+        }
+        memcpy(buf, session, sizeof(*session));
+        return 0;
+    }
+
+    int mbedtls_ssl_session_load(mbedtls_ssl_session *session, const unsigned char *buf, size_t len)
+    {
+        if(len != sizeof(*session))
+        {
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+        memcpy(session, buf, len);
+        return 0;
+    }
+}
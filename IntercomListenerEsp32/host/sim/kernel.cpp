@@ -0,0 +1,804 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kernel.hpp"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+
+struct sim_task
+{
+    std::string name;
+    TaskFunction_t code;
+    void *parameters;
+    std::thread thread;
+    std::atomic<bool> deleted{false};
+    // Notification value, under the kernel lock.
+    uint32_t notify_value = 0;
+};
+
+struct sim_event_group
+{
+    EventBits_t bits = 0;
+};
+
+struct sim_queue
+{
+    size_t length;
+    size_t item_size;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+namespace
+{
+    BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool to_front);
+    BaseType_t queue_read(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait, bool remove);
+
+    struct scheduled_call
+    {
+        uint64_t id;
+        std::function<void()> callback;
+    };
+
+    struct kernel_state
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<bool> stopping{false};
+        bool booted = false;
+
+        std::vector<std::unique_ptr<sim_task>> tasks;
+
+        std::multimap<int64_t, scheduled_call> schedule;
+        uint64_t next_call_id = 1;
+        std::thread service_thread;
+
+        std::atomic<uint64_t> event_group_waits{0};
+
+        // What decides whether the chip is idle, see observe_idle.
+        int running_tasks = 0;
+        int blocked_tasks = 0;
+        int active_contexts = 0;
+        bool idle = false;
+        sim::kernel::idle_observer idle_observer;
+
+        ~kernel_state()
+        {
+            stopping = true;
+            cv.notify_all();
+            for(auto& task : tasks)
+            {
+                if(task->thread.joinable())
+                {
+                    task->thread.join();
+                }
+            }
+            if(service_thread.joinable())
+            {
+                service_thread.join();
+            }
+        }
+    };
+
+    kernel_state& state()
+    {
+        static kernel_state instance;
+        return instance;
+    }
+
+    const auto clock_epoch = std::chrono::steady_clock::now();
+    std::atomic<int64_t> clock_offset_us{0};
+    std::atomic<int64_t> clock_advanced_us{0};
+
+    // Set while a harness thread raises the interrupts of a timestamped edge.
+    thread_local int64_t edge_time_us = -1;
+
+    thread_local sim_task *current_task = nullptr;
+
+    // Kernel lock held.
+    void update_idle(kernel_state& s)
+    {
+        bool idle = s.running_tasks > 0 && s.blocked_tasks == s.running_tasks && s.active_contexts == 0;
+        if(idle != s.idle)
+        {
+            s.idle = idle;
+            if(s.idle_observer)
+            {
+                s.idle_observer(idle, sim::clock::now_us());
+            }
+        }
+    }
+
+    // Adds delta to one of the idle counters, kernel lock held.
+    void count_idle(kernel_state& s, int& counter, int delta)
+    {
+        counter += delta;
+        update_idle(s);
+    }
+
+    void task_trampoline(sim_task *task)
+    {
+        auto& s = state();
+        current_task = task;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            count_idle(s, s.running_tasks, 1);
+        }
+        try
+        {
+            task->code(task->parameters);
+        }
+        catch(const sim::halt&)
+        {
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        count_idle(s, s.running_tasks, -1);
+    }
+
+    void start_task(sim_task *task)
+    {
+        task->thread = std::thread(task_trampoline, task);
+    }
+
+    void main_task_routine(void *arg)
+    {
+        reinterpret_cast<void (*)()>(arg)();
+    }
+
+    void service_routine()
+    {
+        auto& s = state();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        while(!s.stopping)
+        {
+            auto earliest = [&]() { return s.schedule.empty() ? -1 : s.schedule.begin()->first; };
+            int64_t deadline = earliest();
+
+            // Wake up early when a call is scheduled ahead of the one being waited for.
+            sim::kernel::wait_until(lock, deadline, [&]() { return s.stopping || earliest() != deadline; });
+            if(s.stopping)
+            {
+                break;
+            }
+            if(s.schedule.empty() || s.schedule.begin()->first > sim::clock::now_us())
+            {
+                continue;
+            }
+
+            auto call = std::move(s.schedule.begin()->second);
+            s.schedule.erase(s.schedule.begin());
+            count_idle(s, s.active_contexts, 1);
+            lock.unlock();
+            call.callback();
+            lock.lock();
+            count_idle(s, s.active_contexts, -1);
+        }
+    }
+}
+
+namespace sim
+{
+    namespace kernel
+    {
+        edge_time_scope::edge_time_scope(int64_t virtual_us)
+            : previous(edge_time_us)
+        {
+            edge_time_us = virtual_us;
+        }
+
+        edge_time_scope::~edge_time_scope()
+        {
+            edge_time_us = previous;
+        }
+
+        isr_scope::isr_scope()
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            count_idle(s, s.active_contexts, 1);
+        }
+
+        isr_scope::~isr_scope()
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            count_idle(s, s.active_contexts, -1);
+        }
+    }
+
+    namespace clock
+    {
+        int64_t now_us()
+        {
+            if(edge_time_us >= 0)
+            {
+                return edge_time_us;
+            }
+            auto elapsed = std::chrono::steady_clock::now() - clock_epoch;
+            return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + clock_offset_us.load();
+        }
+
+        void reset()
+        {
+            std::lock_guard<std::mutex> lock(state().mutex);
+            auto elapsed = std::chrono::steady_clock::now() - clock_epoch;
+            clock_offset_us = -std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        }
+
+        void advance(int64_t us)
+        {
+            {
+                std::lock_guard<std::mutex> lock(state().mutex);
+                clock_offset_us += us;
+                clock_advanced_us += us;
+            }
+            kernel::notify();
+        }
+
+        void sleep_for(int64_t us)
+        {
+            sleep_until(now_us() + us);
+        }
+
+        void sleep_until(int64_t virtual_us)
+        {
+            std::unique_lock<std::mutex> lock(state().mutex);
+            kernel::wait_until(lock, virtual_us, []() { return false; });
+        }
+    }
+
+    void boot(void (*entry)())
+    {
+        auto& s = state();
+        std::vector<sim_task*> pending;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.booted = true;
+            for(auto& task : s.tasks)
+            {
+                pending.push_back(task.get());
+            }
+            s.service_thread = std::thread(service_routine);
+        }
+
+        for(sim_task *task : pending)
+        {
+            start_task(task);
+        }
+
+        xTaskCreate(main_task_routine, "main", 3584, reinterpret_cast<void*>(entry), 1, nullptr);
+    }
+
+    void shutdown()
+    {
+        auto& s = state();
+        s.stopping = true;
+        kernel::notify();
+
+        std::vector<sim_task*> tasks;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            for(auto& task : s.tasks)
+            {
+                tasks.push_back(task.get());
+            }
+        }
+        for(sim_task *task : tasks)
+        {
+            if(task->thread.joinable() && task->thread.get_id() != std::this_thread::get_id())
+            {
+                task->thread.join();
+            }
+        }
+        if(s.service_thread.joinable())
+        {
+            s.service_thread.join();
+        }
+    }
+
+    uint64_t schedule_at(int64_t virtual_us, std::function<void()> callback)
+    {
+        auto& s = state();
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            id = s.next_call_id++;
+            s.schedule.emplace(virtual_us, scheduled_call{id, std::move(callback)});
+        }
+        kernel::notify();
+        return id;
+    }
+
+    uint64_t schedule_after(int64_t delay_us, std::function<void()> callback)
+    {
+        return schedule_at(clock::now_us() + delay_us, std::move(callback));
+    }
+
+    void cancel(uint64_t id)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for(auto it = s.schedule.begin(); it != s.schedule.end(); ++it)
+        {
+            if(it->second.id == id)
+            {
+                s.schedule.erase(it);
+                return;
+            }
+        }
+    }
+
+    bool wait_for(const std::function<bool()>& predicate, int64_t timeout_us)
+    {
+        std::unique_lock<std::mutex> lock(state().mutex);
+        return kernel::wait_until(lock, clock::now_us() + timeout_us, predicate);
+    }
+
+    namespace stats
+    {
+        uint64_t event_group_waits()
+        {
+            return state().event_group_waits.load();
+        }
+    }
+
+    namespace kernel
+    {
+        std::mutex& mutex()
+        {
+            return state().mutex;
+        }
+
+        void notify()
+        {
+            state().cv.notify_all();
+        }
+
+        bool stopping()
+        {
+            return state().stopping.load();
+        }
+
+        int64_t advanced_us()
+        {
+            return clock_advanced_us.load();
+        }
+
+        void observe_idle(idle_observer observer)
+        {
+            auto& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.idle_observer = std::move(observer);
+        }
+
+        // wait_until, and busy_for with blocks false.
+        bool wait(std::unique_lock<std::mutex>& lock, int64_t deadline_us, const std::function<bool()>& predicate, bool blocks);
+
+        bool wait_until(std::unique_lock<std::mutex>& lock, int64_t deadline_us, const std::function<bool()>& predicate)
+        {
+            return wait(lock, deadline_us, predicate, true);
+        }
+
+        void busy_for(int64_t duration_us)
+        {
+            std::unique_lock<std::mutex> lock(state().mutex);
+            wait(lock, clock::now_us() + duration_us, []() { return false; }, false);
+        }
+
+        bool wait(std::unique_lock<std::mutex>& lock, int64_t deadline_us, const std::function<bool()>& predicate, bool blocks)
+        {
+            auto& s = state();
+            // A task counts as blocked for the whole wait, also while it checks its predicate. Harness threads
+            // and the service thread are not tasks.
+            struct blocked_scope
+            {
+                kernel_state& s;
+                bool task;
+
+                blocked_scope(kernel_state& state, bool is_task)
+                    : s(state), task(is_task)
+                {
+                    if(task)
+                    {
+                        count_idle(s, s.blocked_tasks, 1);
+                    }
+                }
+
+                ~blocked_scope()
+                {
+                    if(task)
+                    {
+                        count_idle(s, s.blocked_tasks, -1);
+                    }
+                }
+            } blocked(s, blocks && current_task != nullptr);
+            while(true)
+            {
+                if(current_task != nullptr && (s.stopping || current_task->deleted))
+                {
+                    throw halt();
+                }
+                if(predicate())
+                {
+                    return true;
+                }
+                if(s.stopping)
+                {
+                    return false;
+                }
+
+                if(deadline_us < 0)
+                {
+                    s.cv.wait(lock);
+                    continue;
+                }
+
+                int64_t remaining = deadline_us - clock::now_us();
+                if(remaining <= 0)
+                {
+                    return false;
+                }
+                s.cv.wait_for(lock, std::chrono::microseconds(remaining));
+            }
+        }
+
+        int64_t deadline_from_ticks(uint32_t ticks)
+        {
+            if(ticks == portMAX_DELAY)
+            {
+                return -1;
+            }
+            return clock::now_us() + static_cast<int64_t>(ticks) * portTICK_PERIOD_MS * 1000;
+        }
+
+        void count_event_group_wait()
+        {
+            state().event_group_waits++;
+        }
+    }
+}
+
+extern "C"
+{
+    BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                           UBaseType_t priority, TaskHandle_t *created_task)
+    {
+        auto& s = state();
+        auto task = std::make_unique<sim_task>();
+        task->name = name;
+        task->code = task_code;
+        task->parameters = parameters;
+        sim_task *handle = task.get();
+
+        bool booted;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.tasks.push_back(std::move(task));
+            booted = s.booted;
+        }
+
+        // Like the FreeRTOS scheduler, tasks created before boot only start running once it is up.
+        if(booted)
+        {
+            start_task(handle);
+        }
+
+        if(created_task != nullptr)
+        {
+            *created_task = handle;
+        }
+        return pdPASS;
+    }
+
+    BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                                       UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+    {
+        return xTaskCreate(task_code, name, stack_depth, parameters, priority, created_task);
+    }
+
+    void vTaskDelete(TaskHandle_t task)
+    {
+        if(task == nullptr || task == current_task)
+        {
+            throw sim::halt();
+        }
+
+        task->deleted = true;
+        sim::kernel::notify();
+        if(task->thread.joinable())
+        {
+            task->thread.join();
+        }
+    }
+
+    void vTaskDelay(TickType_t ticks)
+    {
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        sim::kernel::wait_until(lock, sim::kernel::deadline_from_ticks(ticks), []() { return false; });
+    }
+
+    void sim_port_enter_critical(portMUX_TYPE *mux)
+    {
+        uint32_t expected = 0;
+        while(!__atomic_compare_exchange_n(&mux->owner, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            expected = 0;
+            std::this_thread::yield();
+        }
+        mux->count = 1;
+    }
+
+    void sim_port_exit_critical(portMUX_TYPE *mux)
+    {
+        mux->count = 0;
+        __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+    }
+
+    uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait)
+    {
+        sim_task *task = current_task;
+        if(task == nullptr)
+        {
+            return 0;
+        }
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        sim::kernel::wait_until(lock, sim::kernel::deadline_from_ticks(ticks_to_wait), [task]() { return task->notify_value != 0; });
+        uint32_t value = task->notify_value;
+        if(value != 0)
+        {
+            task->notify_value = clear_count_on_exit ? 0 : value - 1;
+        }
+        return value;
+    }
+
+    BaseType_t xTaskNotifyGive(TaskHandle_t task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            task->notify_value++;
+        }
+        sim::kernel::notify();
+        return pdPASS;
+    }
+
+    void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+    {
+        xTaskNotifyGive(task);
+        if(higher_priority_task_woken != nullptr)
+        {
+            *higher_priority_task_woken = pdTRUE;
+        }
+    }
+
+    TickType_t xTaskGetTickCount(void)
+    {
+        return static_cast<TickType_t>(sim::clock::now_us() / (portTICK_PERIOD_MS * 1000));
+    }
+
+    TaskHandle_t xTaskGetCurrentTaskHandle(void)
+    {
+        return current_task;
+    }
+
+    configSTACK_DEPTH_TYPE uxTaskGetStackHighWaterMark2(TaskHandle_t task)
+    {
+        return 0;
+    }
+
+    EventGroupHandle_t xEventGroupCreate(void)
+    {
+        return new sim_event_group();
+    }
+
+    void vEventGroupDelete(EventGroupHandle_t event_group)
+    {
+        delete event_group;
+    }
+
+    EventBits_t xEventGroupWaitBits(EventGroupHandle_t event_group, const EventBits_t bits_to_wait_for, const BaseType_t clear_on_exit,
+                                    const BaseType_t wait_for_all_bits, TickType_t ticks_to_wait)
+    {
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        auto satisfied = [&]()
+        {
+            EventBits_t set = event_group->bits & bits_to_wait_for;
+            return wait_for_all_bits ? set == bits_to_wait_for : set != 0;
+        };
+
+        bool met = sim::kernel::wait_until(lock, sim::kernel::deadline_from_ticks(ticks_to_wait), satisfied);
+        EventBits_t result = event_group->bits;
+        if(met && clear_on_exit)
+        {
+            event_group->bits &= ~bits_to_wait_for;
+        }
+        sim::kernel::count_event_group_wait();
+        return result;
+    }
+
+    EventBits_t xEventGroupSetBits(EventGroupHandle_t event_group, const EventBits_t bits_to_set)
+    {
+        EventBits_t result;
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            event_group->bits |= bits_to_set;
+            result = event_group->bits;
+        }
+        sim::kernel::notify();
+        return result;
+    }
+
+    EventBits_t xEventGroupClearBits(EventGroupHandle_t event_group, const EventBits_t bits_to_clear)
+    {
+        std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+        EventBits_t result = event_group->bits;
+        event_group->bits &= ~bits_to_clear;
+        return result;
+    }
+
+    EventBits_t xEventGroupGetBits(EventGroupHandle_t event_group)
+    {
+        std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+        return event_group->bits;
+    }
+
+    BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t event_group, const EventBits_t bits_to_set, BaseType_t *higher_priority_task_woken)
+    {
+        xEventGroupSetBits(event_group, bits_to_set);
+        if(higher_priority_task_woken != nullptr)
+        {
+            *higher_priority_task_woken = pdTRUE;
+        }
+        return pdPASS;
+    }
+
+    QueueHandle_t xQueueCreate(UBaseType_t queue_length, UBaseType_t item_size)
+    {
+        auto queue = new sim_queue();
+        queue->length = queue_length;
+        queue->item_size = item_size;
+        return queue;
+    }
+
+    void vQueueDelete(QueueHandle_t queue)
+    {
+        delete queue;
+    }
+
+    BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+    {
+        return queue_send(queue, item, ticks_to_wait, false);
+    }
+
+    BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+    {
+        return queue_send(queue, item, ticks_to_wait, false);
+    }
+
+    BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+    {
+        return queue_send(queue, item, ticks_to_wait, true);
+    }
+
+    BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *higher_priority_task_woken)
+    {
+        BaseType_t result = queue_send(queue, item, 0, false);
+        if(higher_priority_task_woken != nullptr)
+        {
+            *higher_priority_task_woken = result;
+        }
+        return result;
+    }
+
+    BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            queue->items.clear();
+            auto bytes = static_cast<const uint8_t*>(item);
+            queue->items.emplace_back(bytes, bytes + queue->item_size);
+        }
+        sim::kernel::notify();
+        return pdPASS;
+    }
+
+    BaseType_t xQueueOverwriteFromISR(QueueHandle_t queue, const void *item, BaseType_t *higher_priority_task_woken)
+    {
+        if(higher_priority_task_woken != nullptr)
+        {
+            *higher_priority_task_woken = pdTRUE;
+        }
+        return xQueueOverwrite(queue, item);
+    }
+
+    BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+    {
+        return queue_read(queue, buffer, ticks_to_wait, true);
+    }
+
+    BaseType_t xQueuePeek(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+    {
+        return queue_read(queue, buffer, ticks_to_wait, false);
+    }
+
+    UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+    {
+        std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+        return static_cast<UBaseType_t>(queue->items.size());
+    }
+
+    UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+    {
+        std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+        return static_cast<UBaseType_t>(queue->length - queue->items.size());
+    }
+
+    BaseType_t xQueueReset(QueueHandle_t queue)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            queue->items.clear();
+        }
+        sim::kernel::notify();
+        return pdPASS;
+    }
+}
+
+namespace
+{
+    BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool to_front)
+    {
+        {
+            std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+            bool has_space = sim::kernel::wait_until(lock, sim::kernel::deadline_from_ticks(ticks_to_wait), [queue]()
+            {
+                return queue->items.size() < queue->length;
+            });
+            if(!has_space)
+            {
+                return errQUEUE_FULL;
+            }
+
+            auto bytes = static_cast<const uint8_t*>(item);
+            if(to_front)
+            {
+                queue->items.emplace_front(bytes, bytes + queue->item_size);
+            }
+            else
+            {
+                queue->items.emplace_back(bytes, bytes + queue->item_size);
+            }
+        }
+        sim::kernel::notify();
+        return pdPASS;
+    }
+
+    BaseType_t queue_read(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait, bool remove)
+    {
+        {
+            std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+            bool has_item = sim::kernel::wait_until(lock, sim::kernel::deadline_from_ticks(ticks_to_wait), [queue]()
+            {
+                return !queue->items.empty();
+            });
+            if(!has_item)
+            {
+                return pdFALSE;
+            }
+
+            std::memcpy(buffer, queue->items.front().data(), queue->item_size);
+            if(remove)
+            {
+                queue->items.pop_front();
+            }
+        }
+        sim::kernel::notify();
+        return pdPASS;
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include "sim.hpp"
+
+/*
+   Internal plumbing shared by the simulated ESP-IDF components.
+
+   A single kernel lock and condition variable back every blocking primitive. Any state change
+   notifies all waiters, which then re-check their predicate against the virtual clock.
+*/
+namespace sim::kernel
+{
+    std::mutex& mutex();
+
+    // Wakes every waiter. Call with the kernel lock held or right after releasing it.
+    void notify();
+
+    // Waits until predicate holds or the virtual deadline passes (-1 waits forever).
+    // Throws sim::halt when called from a simulated task that is being torn down.
+    bool wait_until(std::unique_lock<std::mutex>& lock, int64_t deadline_us, const std::function<bool()>& predicate);
+
+    // Holds the calling thread for duration_us of virtual time, standing in for work a task does itself:
+    // unlike a wait, the chip is not idle meanwhile. Do not hold the kernel lock.
+    void busy_for(int64_t duration_us);
+
+    // True once shutdown() has been requested.
+    bool stopping();
+
+    // Virtual time skipped by clock::advance so far. Peripherals that run on their own tell a skip from a late
+    // service thread by it.
+    int64_t advanced_us();
+
+    // Converts FreeRTOS ticks to a virtual deadline, -1 for portMAX_DELAY.
+    int64_t deadline_from_ticks(uint32_t ticks);
+
+    void count_event_group_wait();
+
+    // Pins the clock of the calling thread to the time of an edge while its interrupts run,
+    // so handlers see the edge when it was meant to happen rather than when the harness got to it.
+    class edge_time_scope
+    {
+    public:
+        explicit edge_time_scope(int64_t virtual_us);
+        ~edge_time_scope();
+
+    private:
+        int64_t previous;
+    };
+
+    // Runs observer, under the kernel lock, whenever the chip goes idle or stops being idle. Idle is every
+    // running task blocked in the kernel with no interrupt handler and no service callback running.
+    using idle_observer = std::function<void(bool idle, int64_t now_us)>;
+    void observe_idle(idle_observer observer);
+
+    // Counts an interrupt handler that a harness thread runs as activity, so that the chip is not idle meanwhile.
+    // Do not hold the kernel lock.
+    class isr_scope
+    {
+    public:
+        isr_scope();
+        ~isr_scope();
+    };
+
+    // Modem sleep of the Wi-Fi driver, for the power management shim. Called under the kernel lock.
+    // True while the started station runs without power save, which keeps the chip out of light sleep.
+    bool wifi_blocks_light_sleep();
+    // Time the associated station spends awake for the beacons that fall in idle_us of light sleep.
+    int64_t wifi_beacon_listen_us(int64_t idle_us);
+
+    // Lets simulated peripherals watch the level of a pin. Observers run in the thread that drives the pin.
+    using pin_observer = std::function<void(int level)>;
+    void observe_pin(int pin, pin_observer observer);
+}
@@ -0,0 +1,435 @@
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "kernel.hpp"
+
+/*
+   Stand-in MQTT broker on loopback, reached through the routing of sim::net::route.
+   One thread per connection reads packets as they come; messages are stamped with the virtual clock when the
+   complete PUBLISH has arrived, which is when a real broker would store and acknowledge it.
+*/
+
+namespace
+{
+    struct broker_state
+    {
+        std::mutex mutex;
+        int listen_fd = -1;
+        int port = 0;
+        int device_port = 0;
+        std::atomic<bool> running{false};
+        std::thread accept_thread;
+        std::vector<std::thread> connection_threads;
+        std::vector<int> connection_fds;
+
+        // Guarded by the kernel lock.
+        std::set<std::string> sessions;
+        std::vector<sim::mqtt_broker::message> messages;
+        int drops_left = 0;
+        int refusals_left = 0;
+        uint8_t refusal_code = 3;
+
+        // Readable without the kernel lock, also from a sim::wait_for predicate.
+        std::atomic<uint64_t> connections{0};
+        std::atomic<uint64_t> sessions_resumed{0};
+        std::atomic<uint64_t> pings{0};
+    };
+
+    broker_state& broker()
+    {
+        static broker_state instance;
+        return instance;
+    }
+
+    bool send_all(int fd, const uint8_t *data, size_t len)
+    {
+        while(len > 0)
+        {
+            ssize_t written = ::send(fd, data, len, MSG_NOSIGNAL);
+            if(written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            len -= written;
+        }
+        return true;
+    }
+
+    bool receive_all(int fd, uint8_t *data, size_t len)
+    {
+        while(len > 0)
+        {
+            ssize_t received = ::recv(fd, data, len, 0);
+            if(received <= 0)
+            {
+                return false;
+            }
+            data += received;
+            len -= received;
+        }
+        return true;
+    }
+
+    bool read_packet(int fd, uint8_t& header, std::string& body)
+    {
+        if(!receive_all(fd, &header, 1))
+        {
+            return false;
+        }
+        size_t length = 0;
+        for(int i = 0; i < 4; i++)
+        {
+            uint8_t digit;
+            if(!receive_all(fd, &digit, 1))
+            {
+                return false;
+            }
+            length |= static_cast<size_t>(digit & 0x7f) << (7 * i);
+            if((digit & 0x80) == 0)
+            {
+                body.resize(length);
+                return receive_all(fd, reinterpret_cast<uint8_t *>(body.data()), length);
+            }
+        }
+        return false;
+    }
+
+    // Reads a two-byte length and that many bytes at pos. Returns false past the end of the body.
+    bool read_string(const std::string& body, size_t& pos, std::string& value)
+    {
+        if(pos + 2 > body.size())
+        {
+            return false;
+        }
+        size_t length = static_cast<uint8_t>(body[pos]) << 8 | static_cast<uint8_t>(body[pos + 1]);
+        if(pos + 2 + length > body.size())
+        {
+            return false;
+        }
+        value = body.substr(pos + 2, length);
+        pos += 2 + length;
+        return true;
+    }
+
+    // Answers CONNECT. Returns the client identifier, or an empty string if the connection is to be closed.
+    std::string accept_client(int fd, const std::string& body)
+    {
+        size_t pos = 0;
+        std::string protocol;
+        std::string client_id;
+        if(!read_string(body, pos, protocol) || protocol != "MQTT" || pos + 4 > body.size())
+        {
+            return std::string();
+        }
+        uint8_t flags = static_cast<uint8_t>(body[pos + 1]);
+        pos += 4;
+        if(!read_string(body, pos, client_id) || client_id.empty())
+        {
+            return std::string();
+        }
+
+        auto& b = broker();
+        uint8_t session_present = 0;
+        uint8_t return_code = 0;
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            b.connections++;
+            if(b.refusals_left > 0)
+            {
+                b.refusals_left--;
+                return_code = b.refusal_code;
+            }
+            else if((flags & 0x02) != 0)
+            {
+                b.sessions.erase(client_id);
+            }
+            else
+            {
+                session_present = b.sessions.insert(client_id).second ? 0 : 1;
+                b.sessions_resumed += session_present;
+            }
+        }
+
+        uint8_t connack[] = {0x20, 0x02, session_present, return_code};
+        if(!send_all(fd, connack, sizeof(connack)) || return_code != 0)
+        {
+            return std::string();
+        }
+        return client_id;
+    }
+
+    // Stores a PUBLISH and acknowledges it. Returns false when the connection is to be dropped.
+    bool receive_publish(int fd, uint8_t header, const std::string& body, const std::string& client_id)
+    {
+        sim::mqtt_broker::message m = {};
+        m.client_id = client_id;
+        m.qos = (header >> 1) & 0x03;
+        m.dup = (header & 0x08) != 0;
+        size_t pos = 0;
+        if(!read_string(body, pos, m.topic) || m.qos > 1 || (m.qos == 1 && pos + 2 > body.size()))
+        {
+            return false;
+        }
+        if(m.qos == 1)
+        {
+            m.packet_id = static_cast<uint16_t>(static_cast<uint8_t>(body[pos]) << 8 | static_cast<uint8_t>(body[pos + 1]));
+            pos += 2;
+        }
+        m.payload = body.substr(pos);
+
+        auto& b = broker();
+        bool drop;
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            m.received_us = sim::clock::now_us();
+            b.messages.push_back(m);
+            drop = b.drops_left > 0;
+            b.drops_left -= drop ? 1 : 0;
+        }
+        sim::kernel::notify();
+
+        if(drop)
+        {
+            return false;
+        }
+        if(m.qos == 1)
+        {
+            uint8_t puback[] = {0x40, 0x02, static_cast<uint8_t>(m.packet_id >> 8), static_cast<uint8_t>(m.packet_id)};
+            return send_all(fd, puback, sizeof(puback));
+        }
+        return true;
+    }
+
+    void serve_connection(int fd)
+    {
+        auto& b = broker();
+        std::string client_id;
+        uint8_t header;
+        std::string body;
+        while(b.running && read_packet(fd, header, body))
+        {
+            uint8_t type = header >> 4;
+            if(client_id.empty())
+            {
+                // The first packet must be CONNECT.
+                if(type != 1 || (client_id = accept_client(fd, body)).empty())
+                {
+                    break;
+                }
+                continue;
+            }
+
+            if(type == 3)
+            {
+                if(!receive_publish(fd, header, body, client_id))
+                {
+                    break;
+                }
+            }
+            else if(type == 12)
+            {
+                b.pings++;
+                sim::kernel::notify();
+                uint8_t pingresp[] = {0xd0, 0x00};
+                if(!send_all(fd, pingresp, sizeof(pingresp)))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                // DISCONNECT, or a packet a publishing client has no business sending.
+                break;
+            }
+        }
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    void accept_routine()
+    {
+        auto& b = broker();
+        while(b.running)
+        {
+            pollfd pfd = {b.listen_fd, POLLIN, 0};
+            if(::poll(&pfd, 1, 50) <= 0)
+            {
+                continue;
+            }
+
+            int fd = ::accept(b.listen_fd, nullptr, nullptr);
+            if(fd < 0)
+            {
+                continue;
+            }
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            std::lock_guard<std::mutex> lock(b.mutex);
+            b.connection_fds.push_back(fd);
+            b.connection_threads.emplace_back(serve_connection, fd);
+        }
+    }
+
+    // Caller holds the kernel lock.
+    size_t count_matching(const std::string& topic_prefix)
+    {
+        size_t count = 0;
+        for(const sim::mqtt_broker::message& m : broker().messages)
+        {
+            count += m.topic.compare(0, topic_prefix.size(), topic_prefix) == 0;
+        }
+        return count;
+    }
+}
+
+namespace sim
+{
+    namespace mqtt_broker
+    {
+        int start(int device_port)
+        {
+            auto& b = broker();
+            b.listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            ::setsockopt(b.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            if(::bind(b.listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(b.listen_fd, 16) != 0)
+            {
+                ::close(b.listen_fd);
+                b.listen_fd = -1;
+                return -1;
+            }
+
+            socklen_t addr_len = sizeof(addr);
+            ::getsockname(b.listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+            b.port = ntohs(addr.sin_port);
+            b.device_port = device_port;
+            b.running = true;
+            b.accept_thread = std::thread(accept_routine);
+            sim::net::route(device_port, b.port);
+            return b.port;
+        }
+
+        void stop()
+        {
+            auto& b = broker();
+            if(!b.running)
+            {
+                return;
+            }
+            sim::net::route(b.device_port, 0);
+            b.running = false;
+            b.accept_thread.join();
+
+            std::vector<std::thread> threads;
+            {
+                std::lock_guard<std::mutex> lock(b.mutex);
+                for(int fd : b.connection_fds)
+                {
+                    ::shutdown(fd, SHUT_RDWR);
+                }
+                threads.swap(b.connection_threads);
+            }
+            for(auto& thread : threads)
+            {
+                thread.join();
+            }
+            for(int fd : b.connection_fds)
+            {
+                ::close(fd);
+            }
+            b.connection_fds.clear();
+            ::close(b.listen_fd);
+            b.listen_fd = -1;
+        }
+
+        std::string image()
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            std::string text;
+            for(const std::string& client_id : broker().sessions)
+            {
+                text += client_id + "\n";
+            }
+            return text;
+        }
+
+        void restore(const std::string& broker_image)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            broker().sessions.clear();
+            for(size_t start = 0, end; (end = broker_image.find('\n', start)) != std::string::npos; start = end + 1)
+            {
+                broker().sessions.insert(broker_image.substr(start, end - start));
+            }
+        }
+
+        void drop_publishes(int count)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            broker().drops_left = count;
+        }
+
+        void refuse_connections(int count, uint8_t return_code)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            broker().refusals_left = count;
+            broker().refusal_code = return_code;
+        }
+
+        size_t message_count(const std::string& topic_prefix)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            return count_matching(topic_prefix);
+        }
+
+        std::vector<message> messages(const std::string& topic_prefix)
+        {
+            std::lock_guard<std::mutex> lock(sim::kernel::mutex());
+            std::vector<message> matching;
+            for(const message& m : broker().messages)
+            {
+                if(m.topic.compare(0, topic_prefix.size(), topic_prefix) == 0)
+                {
+                    matching.push_back(m);
+                }
+            }
+            return matching;
+        }
+
+        bool wait_for_messages(size_t count, int64_t timeout_us, const std::string& topic_prefix)
+        {
+            return sim::wait_for([count, &topic_prefix]() { return count_matching(topic_prefix) >= count; }, timeout_us);
+        }
+
+        uint64_t connections()
+        {
+            return broker().connections.load();
+        }
+
+        uint64_t sessions_resumed()
+        {
+            return broker().sessions_resumed.load();
+        }
+
+        uint64_t pings()
+        {
+            return broker().pings.load();
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "sim.hpp"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+/*
+   NVS as an in-memory map of (namespace, key) to bytes. Writes take effect at once; nvs_commit only checks
+   the handle. image() flattens the map so a harness can hand it to the next wake cycle.
+*/
+
+namespace
+{
+    struct nvs_state
+    {
+        std::mutex mutex;
+        std::map<std::string, std::vector<uint8_t>> entries;
+        std::vector<std::string> handles;
+        uint64_t writes = 0;
+    };
+
+    nvs_state& state()
+    {
+        static nvs_state instance;
+        return instance;
+    }
+
+    // Caller holds the mutex.
+    bool entry_key(nvs_handle_t handle, const char *key, std::string& out)
+    {
+        auto& s = state();
+        if(handle == 0 || handle > s.handles.size())
+        {
+            return false;
+        }
+        out = s.handles[handle - 1] + '\0' + key;
+        return true;
+    }
+}
+
+namespace sim::nvs
+{
+    std::string image()
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::string text;
+        for(auto& [key, value] : s.entries)
+        {
+            uint32_t lengths[2] = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+            text.append(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+            text.append(key);
+            text.append(value.begin(), value.end());
+        }
+        return text;
+    }
+
+    void restore(const std::string& nvs_image)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.entries.clear();
+        size_t pos = 0;
+        uint32_t lengths[2];
+        while(pos + sizeof(lengths) <= nvs_image.size())
+        {
+            std::memcpy(lengths, nvs_image.data() + pos, sizeof(lengths));
+            pos += sizeof(lengths);
+            if(pos + lengths[0] + lengths[1] > nvs_image.size())
+            {
+                break;
+            }
+            std::string key = nvs_image.substr(pos, lengths[0]);
+            pos += lengths[0];
+            s.entries[key].assign(nvs_image.begin() + pos, nvs_image.begin() + pos + lengths[1]);
+            pos += lengths[1];
+        }
+    }
+
+    uint64_t write_count()
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.writes;
+    }
+}
+
+extern "C"
+{
+    esp_err_t nvs_flash_init(void)
+    {
+        return ESP_OK;
+    }
+
+    esp_err_t nvs_flash_erase(void)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.entries.clear();
+        return ESP_OK;
+    }
+
+    esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.handles.push_back(namespace_name);
+        *out_handle = static_cast<nvs_handle_t>(s.handles.size());
+        return ESP_OK;
+    }
+
+    void nvs_close(nvs_handle_t handle)
+    {
+    }
+
+    esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::string name;
+        if(!entry_key(handle, key, name))
+        {
+            return ESP_ERR_NVS_INVALID_HANDLE;
+        }
+        auto it = s.entries.find(name);
+        if(it == s.entries.end())
+        {
+            return ESP_ERR_NVS_NOT_FOUND;
+        }
+        if(out_value == nullptr)
+        {
+            *length = it->second.size();
+            return ESP_OK;
+        }
+        if(*length < it->second.size())
+        {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        std::memcpy(out_value, it->second.data(), it->second.size());
+        *length = it->second.size();
+        return ESP_OK;
+    }
+
+    esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::string name;
+        if(!entry_key(handle, key, name))
+        {
+            return ESP_ERR_NVS_INVALID_HANDLE;
+        }
+        const uint8_t *bytes = static_cast<const uint8_t*>(value);
+        std::vector<uint8_t>& entry = s.entries[name];
+        // Like NVS, writing an unchanged value does not touch flash.
+        if(entry.size() != length || std::memcmp(entry.data(), bytes, length) != 0)
+        {
+            entry.assign(bytes, bytes + length);
+            s.writes++;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::string name;
+        if(!entry_key(handle, key, name))
+        {
+            return ESP_ERR_NVS_INVALID_HANDLE;
+        }
+        return s.entries.erase(name) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    esp_err_t nvs_commit(nvs_handle_t handle)
+    {
+        auto& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return handle == 0 || handle > s.handles.size() ? ESP_ERR_NVS_INVALID_HANDLE : ESP_OK;
+    }
+}
@@ -0,0 +1,199 @@
+#include <mutex>
+#include "kernel.hpp"
+#include "sim.hpp"
+#include "sdkconfig.h"
+#include "esp_pm.h"
+
+struct esp_pm_lock
+{
+    esp_pm_lock_type_t type;
+    int count = 0;
+};
+
+namespace
+{
+    // Expected idle time below which the FreeRTOS idle task does not enter light sleep, CONFIG_FREERTOS_IDLE_TIME_BEFORE_SLEEP.
+    constexpr int64_t idle_time_before_sleep_us = 3 * 1000000LL / CONFIG_FREERTOS_HZ;
+
+    /*
+        Automatic light sleep on the idle spans of the simulated chip. The sleep is booked once the span ends,
+        all of it, as the tickless idle task would have slept until the next timeout or interrupt. An associated
+        station with modem sleep wakes for the beacons in between, which the time slept leaves out.
+    */
+    struct pm_state
+    {
+        std::mutex mutex;
+        esp_pm_config_t config = {CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, false};
+        int no_light_sleep_locks = 0;
+        esp_pm_sleep_cbs_register_config_t callbacks = {};
+        // Virtual time the current idle span started, -1 while busy or unable to sleep.
+        int64_t idle_since_us = -1;
+        sim::power::light_sleep_stats stats;
+    };
+
+    pm_state& pm()
+    {
+        static pm_state instance;
+        return instance;
+    }
+
+    // Kernel lock held, which the Wi-Fi driver queries also take after it.
+    void on_idle(bool idle, int64_t now_us)
+    {
+        auto& p = pm();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if(idle)
+        {
+            bool can_sleep = p.config.light_sleep_enable && p.no_light_sleep_locks == 0 && !sim::kernel::wifi_blocks_light_sleep();
+            p.idle_since_us = can_sleep ? now_us : -1;
+            return;
+        }
+        if(p.idle_since_us < 0)
+        {
+            return;
+        }
+
+        int64_t idle_us = now_us - p.idle_since_us;
+        p.idle_since_us = -1;
+        if(idle_us < idle_time_before_sleep_us)
+        {
+            return;
+        }
+        int64_t listen_us = sim::kernel::wifi_beacon_listen_us(idle_us);
+        int64_t slept_us = idle_us - listen_us;
+        p.stats.sleeps++;
+        p.stats.slept_us += slept_us;
+        p.stats.beacon_listen_us += listen_us;
+        if(p.callbacks.enter_cb != nullptr)
+        {
+            p.callbacks.enter_cb(0, p.callbacks.enter_cb_user_arg);
+        }
+        if(p.callbacks.exit_cb != nullptr)
+        {
+            p.callbacks.exit_cb(slept_us, p.callbacks.exit_cb_user_arg);
+        }
+    }
+}
+
+namespace sim::power
+{
+    light_sleep_stats light_sleep()
+    {
+        auto& p = pm();
+        std::lock_guard<std::mutex> lock(p.mutex);
+        return p.stats;
+    }
+}
+
+extern "C"
+{
+    esp_err_t esp_pm_configure(const void *config)
+    {
+        if(config == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        const esp_pm_config_t& pm_config = *static_cast<const esp_pm_config_t*>(config);
+        if(pm_config.min_freq_mhz <= 0 || pm_config.min_freq_mhz > pm_config.max_freq_mhz)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pm().mutex);
+            pm().config = pm_config;
+        }
+        sim::kernel::observe_idle(on_idle);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_pm_get_configuration(void *config)
+    {
+        if(config == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(pm().mutex);
+        *static_cast<esp_pm_config_t*>(config) = pm().config;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char *name, esp_pm_lock_handle_t *out_handle)
+    {
+        if(out_handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        *out_handle = new esp_pm_lock{lock_type};
+        return ESP_OK;
+    }
+
+    esp_err_t esp_pm_lock_delete(esp_pm_lock_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(handle->count != 0)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        delete handle;
+        return ESP_OK;
+    }
+
+    // Only the light sleep lock matters here: the CPU and APB clocks do not change the virtual clock.
+    esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(pm().mutex);
+        if(handle->count++ == 0 && handle->type == ESP_PM_NO_LIGHT_SLEEP)
+        {
+            pm().no_light_sleep_locks++;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+    {
+        if(handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(pm().mutex);
+        if(handle->count == 0)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        if(--handle->count == 0 && handle->type == ESP_PM_NO_LIGHT_SLEEP)
+        {
+            pm().no_light_sleep_locks--;
+        }
+        return ESP_OK;
+    }
+
+    // One set of callbacks, which is all the firmware registers.
+    esp_err_t esp_pm_light_sleep_register_cbs(esp_pm_sleep_cbs_register_config_t *cbs_conf)
+    {
+        if(cbs_conf == nullptr || (cbs_conf->enter_cb == nullptr && cbs_conf->exit_cb == nullptr))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(pm().mutex);
+        pm().callbacks = *cbs_conf;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_pm_light_sleep_unregister_cbs(esp_pm_sleep_cbs_register_config_t *cbs_conf)
+    {
+        if(cbs_conf == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(pm().mutex);
+        pm().callbacks = {};
+        return ESP_OK;
+    }
+}
@@ -0,0 +1,476 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "kernel.hpp"
+#include "driver/rmt_rx.h"
+#include "driver/rmt_tx.h"
+
+/*
+   RMT receive channel. Edges on the bound pin are recorded as level/duration segments on the virtual clock;
+   the receive job ends, and the done callback runs once, when the line stays idle longer than signal_range_max_ns.
+
+   RMT transmit channel. The symbols of a transmission drive the bound pin on the virtual clock, once or in a loop
+   until the channel is disabled; a transmission that ends runs the done callback once.
+
+   Channels take their memory blocks from the 8 of 64 symbols that the ESP32 has, and are not given them back.
+*/
+
+struct rmt_channel_t
+{
+    std::mutex mutex;
+    int gpio = -1;
+    uint32_t resolution_hz = 1000000;
+    size_t mem_block_symbols = 64;
+    rmt_rx_done_callback_t on_recv_done = nullptr;
+    void *user_ctx = nullptr;
+    bool enabled = false;
+
+    bool receiving = false;
+    rmt_symbol_word_t *buffer = nullptr;
+    size_t buffer_symbols = 0;
+    rmt_receive_config_t config = {};
+
+    bool in_burst = false;
+    int segment_level = 0;
+    int64_t segment_start_us = 0;
+    std::vector<std::pair<int, uint32_t>> segments;
+    uint64_t idle_call = 0;
+    uint64_t generation = 0;
+
+    rmt_tx_done_callback_t on_trans_done = nullptr;
+    std::vector<std::pair<int, int64_t>> tx_segments;
+    int64_t tx_length_us = 0;
+    int64_t tx_start_us = 0;
+    bool tx_loop = false;
+    int tx_eot_level = 0;
+    uint64_t tx_call = 0;
+    std::atomic<bool> transmitting{false};
+};
+
+namespace
+{
+    std::atomic<uint64_t> isr_count{0};
+    std::atomic<uint64_t> transmissions{0};
+    std::atomic<uint64_t> tx_level_changes{0};
+    std::mutex memory_mutex;
+    size_t memory_symbols_free = 8 * 64;
+
+    bool allocate_memory(size_t symbols)
+    {
+        // Whole blocks, as the driver hands them out.
+        size_t blocks_symbols = (symbols + 63) / 64 * 64;
+        std::lock_guard<std::mutex> lock(memory_mutex);
+        if(blocks_symbols > memory_symbols_free)
+        {
+            return false;
+        }
+        memory_symbols_free -= blocks_symbols;
+        return true;
+    }
+
+    uint32_t to_ticks(const rmt_channel_t *channel, int64_t duration_us)
+    {
+        uint64_t ticks = static_cast<uint64_t>(duration_us) * channel->resolution_hz / 1000000ULL;
+        return static_cast<uint32_t>(std::min<uint64_t>(ticks, 0x7fff));
+    }
+
+    void finish_receive(rmt_channel_t *channel, uint64_t generation)
+    {
+        rmt_rx_done_event_data_t event = {};
+        rmt_rx_done_callback_t callback;
+        void *user_ctx;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            if(channel->generation != generation || !channel->receiving || !channel->in_burst)
+            {
+                return;
+            }
+
+            // The segment in progress is the idle level that ended the burst; hardware closes it with a zero duration.
+            channel->segments.emplace_back(channel->segment_level, 0);
+
+            size_t capacity = std::min(channel->buffer_symbols, channel->mem_block_symbols);
+            size_t count = 0;
+            for(size_t i = 0; i < channel->segments.size() && count < capacity; i += 2, count++)
+            {
+                rmt_symbol_word_t symbol = {};
+                symbol.level0 = channel->segments[i].first;
+                symbol.duration0 = channel->segments[i].second;
+                if(i + 1 < channel->segments.size())
+                {
+                    symbol.level1 = channel->segments[i + 1].first;
+                    symbol.duration1 = channel->segments[i + 1].second;
+                }
+                channel->buffer[count] = symbol;
+            }
+
+            event.received_symbols = channel->buffer;
+            event.num_symbols = count;
+            channel->receiving = false;
+            channel->in_burst = false;
+            channel->segments.clear();
+            channel->idle_call = 0;
+            callback = channel->on_recv_done;
+            user_ctx = channel->user_ctx;
+        }
+
+        isr_count++;
+        if(callback != nullptr)
+        {
+            callback(channel, &event, user_ctx);
+        }
+    }
+
+    void on_edge(rmt_channel_t *channel, int level)
+    {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        if(!channel->enabled || !channel->receiving)
+        {
+            return;
+        }
+
+        int64_t now = sim::clock::now_us();
+        if(!channel->in_burst)
+        {
+            channel->in_burst = true;
+            channel->segments.clear();
+        }
+        else
+        {
+            int64_t duration = now - channel->segment_start_us;
+            // Segments below the glitch filter are dropped, like the peripheral's input filter would.
+            if(duration * 1000 >= channel->config.signal_range_min_ns)
+            {
+                channel->segments.emplace_back(channel->segment_level, to_ticks(channel, duration));
+            }
+        }
+        channel->segment_level = level;
+        channel->segment_start_us = now;
+
+        if(channel->idle_call != 0)
+        {
+            sim::cancel(channel->idle_call);
+        }
+        uint64_t generation = ++channel->generation;
+        channel->idle_call = sim::schedule_at(now + channel->config.signal_range_max_ns / 1000, [channel, generation]()
+        {
+            finish_receive(channel, generation);
+        });
+    }
+}
+
+namespace
+{
+    void drive_tx(rmt_channel_t *channel, int level)
+    {
+        if(sim::gpio::level(channel->gpio) != level)
+        {
+            tx_level_changes++;
+        }
+        gpio_set_level(static_cast<gpio_num_t>(channel->gpio), level);
+    }
+
+    // Drives the segment the transmission is in at the current time and schedules the next one. Channel lock held.
+    void step_transmit(rmt_channel_t *channel, uint64_t generation);
+
+    void schedule_step(rmt_channel_t *channel, int64_t at_us)
+    {
+        uint64_t generation = channel->generation;
+        channel->tx_call = sim::schedule_at(at_us, [channel, generation]()
+        {
+            bool done = false;
+            rmt_tx_done_callback_t callback = nullptr;
+            void *user_ctx = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(channel->mutex);
+                if(channel->generation != generation || !channel->transmitting)
+                {
+                    return;
+                }
+                step_transmit(channel, generation);
+                if(!channel->transmitting)
+                {
+                    done = true;
+                    callback = channel->on_trans_done;
+                    user_ctx = channel->user_ctx;
+                }
+            }
+            if(done)
+            {
+                sim::kernel::notify();
+                rmt_tx_done_event_data_t event = {};
+                if(callback != nullptr)
+                {
+                    callback(channel, &event, user_ctx);
+                }
+            }
+        });
+    }
+
+    void step_transmit(rmt_channel_t *channel, uint64_t generation)
+    {
+        int64_t now = sim::clock::now_us();
+        int64_t elapsed = now - channel->tx_start_us;
+        if(!channel->tx_loop && elapsed >= channel->tx_length_us)
+        {
+            drive_tx(channel, channel->tx_eot_level);
+            channel->transmitting = false;
+            channel->tx_call = 0;
+            return;
+        }
+
+        // A loop that the clock skipped over picks up where it would be by now.
+        int64_t turn_start = channel->tx_start_us + (channel->tx_loop ? elapsed / channel->tx_length_us * channel->tx_length_us : 0);
+        int64_t position = now - turn_start;
+        int64_t segment_end = 0;
+        for(const auto& segment : channel->tx_segments)
+        {
+            segment_end += segment.second;
+            if(position < segment_end)
+            {
+                drive_tx(channel, segment.first);
+                break;
+            }
+        }
+        schedule_step(channel, turn_start + segment_end);
+    }
+}
+
+namespace sim::rmt
+{
+    uint64_t isr_count()
+    {
+        return ::isr_count.load();
+    }
+
+    uint64_t transmissions()
+    {
+        return ::transmissions.load();
+    }
+
+    uint64_t tx_level_changes()
+    {
+        return ::tx_level_changes.load();
+    }
+}
+
+extern "C"
+{
+    esp_err_t rmt_new_rx_channel(const rmt_rx_channel_config_t *config, rmt_channel_handle_t *ret_chan)
+    {
+        if(config == nullptr || ret_chan == nullptr || config->resolution_hz == 0 || config->mem_block_symbols < 64)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(!allocate_memory(config->mem_block_symbols))
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        auto channel = new rmt_channel_t();
+        channel->gpio = config->gpio_num;
+        channel->resolution_hz = config->resolution_hz;
+        channel->mem_block_symbols = config->mem_block_symbols;
+        sim::kernel::observe_pin(config->gpio_num, [channel](int level) { on_edge(channel, level); });
+        *ret_chan = channel;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_rx_register_event_callbacks(rmt_channel_handle_t rx_channel, const rmt_rx_event_callbacks_t *cbs, void *user_data)
+    {
+        if(rx_channel == nullptr || cbs == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(rx_channel->mutex);
+        rx_channel->on_recv_done = cbs->on_recv_done;
+        rx_channel->user_ctx = user_data;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_enable(rmt_channel_handle_t channel)
+    {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        channel->enabled = true;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_disable(rmt_channel_handle_t channel)
+    {
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            channel->enabled = false;
+            channel->receiving = false;
+            channel->in_burst = false;
+            channel->generation++;
+            if(channel->transmitting)
+            {
+                // A transmission stops where it is and the pin goes to the idle level, without a done callback.
+                if(channel->tx_call != 0)
+                {
+                    sim::cancel(channel->tx_call);
+                    channel->tx_call = 0;
+                }
+                channel->transmitting = false;
+                drive_tx(channel, channel->tx_eot_level);
+            }
+        }
+        sim::kernel::notify();
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_del_channel(rmt_channel_handle_t channel)
+    {
+        // Pin observers keep a pointer to the channel, so it is disabled rather than freed.
+        return rmt_disable(channel);
+    }
+
+    esp_err_t rmt_receive(rmt_channel_handle_t rx_channel, void *buffer, size_t buffer_size, const rmt_receive_config_t *config)
+    {
+        if(rx_channel == nullptr || buffer == nullptr || config == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        std::lock_guard<std::mutex> lock(rx_channel->mutex);
+        if(!rx_channel->enabled)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        rx_channel->buffer = static_cast<rmt_symbol_word_t*>(buffer);
+        rx_channel->buffer_symbols = buffer_size / sizeof(rmt_symbol_word_t);
+        rx_channel->config = *config;
+        rx_channel->receiving = true;
+        rx_channel->in_burst = false;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_new_tx_channel(const rmt_tx_channel_config_t *config, rmt_channel_handle_t *ret_chan)
+    {
+        if(config == nullptr || ret_chan == nullptr || config->resolution_hz == 0 || config->mem_block_symbols < 64)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        if(!allocate_memory(config->mem_block_symbols))
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        auto channel = new rmt_channel_t();
+        channel->gpio = config->gpio_num;
+        channel->resolution_hz = config->resolution_hz;
+        channel->mem_block_symbols = config->mem_block_symbols;
+        gpio_set_direction(config->gpio_num, GPIO_MODE_OUTPUT);
+        *ret_chan = channel;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_tx_register_event_callbacks(rmt_channel_handle_t tx_channel, const rmt_tx_event_callbacks_t *cbs, void *user_data)
+    {
+        if(tx_channel == nullptr || cbs == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(tx_channel->mutex);
+        tx_channel->on_trans_done = cbs->on_trans_done;
+        tx_channel->user_ctx = user_data;
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_transmit(rmt_channel_handle_t tx_channel, rmt_encoder_handle_t encoder, const void *payload, size_t payload_bytes,
+                           const rmt_transmit_config_t *config)
+    {
+        if(tx_channel == nullptr || encoder == nullptr || payload == nullptr || config == nullptr || payload_bytes % sizeof(rmt_symbol_word_t) != 0)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        const rmt_symbol_word_t *symbols = static_cast<const rmt_symbol_word_t*>(payload);
+        size_t count = payload_bytes / sizeof(rmt_symbol_word_t);
+        // The ESP32 loops only forever, and only over what fits the channel memory.
+        if(config->loop_count > 0 || (config->loop_count < 0 && count > tx_channel->mem_block_symbols))
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+
+        std::lock_guard<std::mutex> lock(tx_channel->mutex);
+        if(!tx_channel->enabled)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        if(tx_channel->transmitting)
+        {
+            // The driver queues transactions; the firmware never needs more than one in flight.
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        tx_channel->tx_segments.clear();
+        tx_channel->tx_length_us = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            const uint32_t durations[2] = {symbols[i].duration0, symbols[i].duration1};
+            const int levels[2] = {symbols[i].level0, symbols[i].level1};
+            bool end = false;
+            for(int half = 0; half < 2; half++)
+            {
+                // A zero duration marks the end of the transmission.
+                if(durations[half] == 0)
+                {
+                    end = true;
+                    break;
+                }
+                int64_t duration_us = static_cast<int64_t>(durations[half]) * 1000000 / tx_channel->resolution_hz;
+                tx_channel->tx_segments.emplace_back(levels[half], duration_us);
+                tx_channel->tx_length_us += duration_us;
+            }
+            if(end)
+            {
+                break;
+            }
+        }
+        if(tx_channel->tx_length_us == 0)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        transmissions++;
+        tx_channel->tx_loop = config->loop_count < 0;
+        tx_channel->tx_eot_level = config->flags.eot_level;
+        tx_channel->tx_start_us = sim::clock::now_us();
+        tx_channel->transmitting = true;
+        tx_channel->generation++;
+        step_transmit(tx_channel, tx_channel->generation);
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_tx_wait_all_done(rmt_channel_handle_t tx_channel, int timeout_ms)
+    {
+        if(tx_channel == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::unique_lock<std::mutex> lock(sim::kernel::mutex());
+        int64_t deadline = timeout_ms < 0 ? -1 : sim::clock::now_us() + static_cast<int64_t>(timeout_ms) * 1000;
+        bool done = sim::kernel::wait_until(lock, deadline, [tx_channel]() { return !tx_channel->transmitting; });
+        return done ? ESP_OK : ESP_ERR_TIMEOUT;
+    }
+
+    esp_err_t rmt_new_copy_encoder(const rmt_copy_encoder_config_t *config, rmt_encoder_handle_t *ret_encoder)
+    {
+        if(config == nullptr || ret_encoder == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        // Symbols are copied as they are; the handle only has to be a valid pointer.
+        static int copy_encoder;
+        *ret_encoder = reinterpret_cast<rmt_encoder_handle_t>(&copy_encoder);
+        return ESP_OK;
+    }
+
+    esp_err_t rmt_del_encoder(rmt_encoder_handle_t encoder)
+    {
+        return encoder == nullptr ? ESP_ERR_INVALID_ARG : ESP_OK;
+    }
+}
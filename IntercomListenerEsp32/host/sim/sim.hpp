@@ -0,0 +1,385 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "esp_log.h"
+#include "esp_sleep.h"
+
+/*
+   Harness API of the host simulation.
+
+   The firmware sources from src/ are compiled unchanged against the ESP-IDF shim headers in host/include.
+   Everything the firmware does through those headers is routed here: FreeRTOS tasks become threads,
+   GPIO levels and interrupts are driven by the harness, the hardware timer and the Wi-Fi driver run on a
+   virtual clock, esp_http_client and connections opened with esp_tls_plain_tcp_connect, mbedTLS on top or
+   not, talk plain HTTP to a local stand-in server, and those to the MQTT port reach a local stand-in broker.
+*/
+namespace sim
+{
+    // Thrown inside simulated tasks to unwind them when the simulation stops or the firmware enters deep sleep.
+    struct halt
+    {
+    };
+
+    namespace clock
+    {
+        // Virtual time in microseconds. It runs at real speed and can be moved forward by advance().
+        int64_t now_us();
+
+        // Restarts virtual time near zero, as the chip's timers do on every reset. Call before boot, with nothing scheduled.
+        void reset();
+
+        // Skips virtual time forward. Timers, delays and timeouts that fall into the skipped span expire at once.
+        void advance(int64_t us);
+
+        // Blocks the calling harness thread for the given span of virtual time.
+        void sleep_for(int64_t us);
+        void sleep_until(int64_t virtual_us);
+    }
+
+    // Starts tasks created before boot (static constructors) and runs entry as the main task.
+    void boot(void (*entry)());
+
+    // Unwinds every simulated task and stops the background services.
+    void shutdown();
+
+    // Runs a callback on the simulation service thread at the given virtual time.
+    uint64_t schedule_at(int64_t virtual_us, std::function<void()> callback);
+    uint64_t schedule_after(int64_t delay_us, std::function<void()> callback);
+    void cancel(uint64_t id);
+
+    // Blocks the harness until predicate holds or the virtual timeout passes. Predicate is evaluated under the kernel lock.
+    bool wait_for(const std::function<bool()>& predicate, int64_t timeout_us);
+
+    namespace gpio
+    {
+        // Sets a pin level without raising interrupts. Use before boot for the line state at wake.
+        void preset(int pin, int level);
+
+        // Drives a pin like an external signal would, raising the configured interrupt in the calling thread.
+        void drive(int pin, int level);
+
+        // Same, with the edge stamped at virtual time at_us. Interrupt handlers and peripherals see the clock at
+        // that instant, which keeps pulse timing exact when the harness thread wakes late on a busy host.
+        void drive_at(int pin, int level, int64_t at_us);
+
+        int level(int pin);
+
+        uint64_t isr_count();
+        uint64_t isr_time_ns();
+    }
+
+    namespace rmt
+    {
+        // Number of receive-done interrupts raised by RMT channels.
+        uint64_t isr_count();
+
+        // Number of transmissions started, and of pin level changes they have driven so far.
+        uint64_t transmissions();
+        uint64_t tx_level_changes();
+    }
+
+    namespace adc
+    {
+        // Number of frame interrupts raised by the continuous ADC, one per frame converted.
+        uint64_t isr_count();
+        uint64_t frames();
+        // Frames that found the pool full and were dropped.
+        uint64_t dropped_frames();
+
+        // Drives the ADC1 input on gpio with an analog signal instead of its logic level: counts(t_us) gives
+        // the 12 bit reading at every conversion, noise added. An empty function returns the pin to its level.
+        void set_waveform(int gpio, std::function<int(int64_t t_us)> counts);
+    }
+
+    // Allocations through heap_caps_malloc, by the capability they were made with.
+    namespace heap
+    {
+        struct usage
+        {
+            size_t capacity = 0;
+            size_t used = 0;
+            size_t peak = 0;
+            uint64_t allocations = 0;
+            uint64_t failures = 0;
+        };
+
+        usage internal();
+        usage psram();
+    }
+
+    namespace wifi
+    {
+        struct model
+        {
+            // esp_wifi_init: driver memory and tasks. Blocks the calling task.
+            int64_t init_us = 15000;
+            // RF calibration when esp_wifi_start enables the PHY, also on the calling task. With
+            // CONFIG_ESP_PHY_CALIBRATION_AND_DATA_STORAGE the data kept in NVS cuts it to a partial
+            // calibration after power-on and to none after deep sleep; without data it is a full one.
+            int64_t phy_full_cal_us = 100000;
+            int64_t phy_partial_cal_us = 20000;
+            int64_t phy_no_cal_us = 2000;
+            // From esp_wifi_start returning to WIFI_EVENT_STA_START.
+            int64_t start_us = 50000;
+            // Scan of every channel, then association.
+            int64_t assoc_us = 300000;
+            // Association when the station config names the AP's BSSID and channel: one probe, no scan.
+            int64_t direct_assoc_us = 60000;
+            int64_t dhcp_us = 100000;
+            // With modem sleep the associated station wakes for every beacon, 100 TU apart with DTIM 1,
+            // and listens for beacon_listen_us. Only light sleep makes that show, see sim::power.
+            int64_t beacon_interval_us = 102400;
+            int64_t beacon_listen_us = 2000;
+            // Number of association attempts that fail before one succeeds.
+            int failed_attempts = 0;
+            // The access point. A station config that names another BSSID or channel does not find it.
+            uint8_t bssid[6] = {0x02, 0x00, 0x00, 0x1c, 0x0b, 0x01};
+            uint8_t channel = 6;
+        };
+
+        void configure(const model& wifi_model);
+        bool has_ip();
+
+        // Number of times esp_wifi_start brought the radio up.
+        uint64_t start_count();
+
+        // Number of DHCP exchanges completed.
+        uint64_t dhcp_count();
+
+        // Number of full RF calibrations, the ones that find no data in NVS.
+        uint64_t full_calibrations();
+    }
+
+    // Automatic light sleep, once the firmware enabled it with esp_pm_configure: every span of at least three
+    // ticks with all tasks blocked and nothing else running counts as slept, less the beacon wakes of modem sleep.
+    namespace power
+    {
+        struct light_sleep_stats
+        {
+            uint64_t sleeps = 0;
+            int64_t slept_us = 0;
+            // Awake for beacons in between.
+            int64_t beacon_listen_us = 0;
+        };
+
+        light_sleep_stats light_sleep();
+    }
+
+    namespace net
+    {
+        struct model
+        {
+            // A name is looked up once per process, like lwIP's DNS table, which deep sleep clears.
+            int64_t dns_us = 10000;
+            int64_t connect_us = 10000;
+            int64_t tls_handshake_us = 150000;
+            // Abbreviated handshake with a session the server still accepts: no certificate chain, no key exchange.
+            int64_t tls_resume_us = 40000;
+            // Upstream bandwidth connection writes are paced to. 0 sends as fast as loopback takes them.
+            int64_t uplink_bytes_per_s = 0;
+        };
+
+        void configure(const model& net_model);
+        uint64_t connections_opened();
+
+        // Rotates the server's session ticket key, so every session issued so far is rejected.
+        void reject_sessions();
+
+        uint64_t handshakes_full();
+        uint64_t handshakes_resumed();
+
+        // Sends connections to port to loopback_port instead of the stand-in server. 0 removes the route.
+        void route(int port, int loopback_port);
+    }
+
+    namespace http_server
+    {
+        struct request
+        {
+            int64_t received_us;
+            std::string method;
+            std::string path;
+            // Decoded, if it came with chunked transfer encoding.
+            std::string body;
+            bool chunked;
+        };
+
+        // Listens on an ephemeral loopback port. esp_http_client connects here whatever host it is given.
+        int start();
+        void stop();
+
+        void set_status(int status_code);
+        void set_response_delay(int64_t delay_us);
+
+        // How responses carry their body. chunked splits it into small chunks with an extension and a trailer, after
+        // an interim 100 Continue; unframed sends neither a length nor chunks yet keeps the connection open.
+        // 204 and 304 responses never have a body.
+        enum class framing { content_length, chunked, unframed };
+        void set_response_framing(framing response_framing);
+
+        // Answers the next count requests whose path contains path_contains with status_code, then status as usual.
+        // A status_code of 0 closes the connection instead of answering, as when the response is lost on the way.
+        void fail_requests(int count, int status_code, const std::string& path_contains = "");
+
+        // Closes connections that stay idle for longer than timeout_us of virtual time. 0 keeps them forever.
+        void set_idle_timeout(int64_t timeout_us);
+
+        // Closes every open connection from the server side, like a server restart or a NAT dropping state.
+        void drop_connections();
+
+        // A message to the bot from chat_id, which the next getUpdates returns; a long poll waiting for one returns
+        // at once. Returns the update_id.
+        int64_t post_update(const std::string& text, long long chat_id);
+
+        // Requests received so far whose path contains path_contains.
+        size_t request_count(const std::string& path_contains = "");
+        std::vector<request> requests(const std::string& path_contains = "");
+
+        bool wait_for_requests(size_t count, int64_t timeout_us, const std::string& path_contains = "");
+    }
+
+    // Enough of an MQTT 3.1.1 broker for a client that publishes: CONNECT with a session kept per client
+    // identifier unless it asks for a clean one, PUBLISH at QoS 0 and 1, PINGREQ and DISCONNECT.
+    namespace mqtt_broker
+    {
+        struct message
+        {
+            int64_t received_us;
+            std::string client_id;
+            std::string topic;
+            std::string payload;
+            uint8_t qos;
+            bool dup;
+            uint16_t packet_id;
+        };
+
+        // Listens on an ephemeral loopback port and routes connections to device_port there.
+        int start(int device_port);
+        void stop();
+
+        // The client identifiers the broker holds a session for. The broker does not sleep with the device, so
+        // carry an image from one wake cycle to the next like rtc; an empty image is a broker without sessions.
+        std::string image();
+        void restore(const std::string& broker_image);
+
+        // Reads the next count PUBLISH packets and closes their connection instead of acknowledging them, as a
+        // broker that restarts or a NAT that drops the connection mid-flight would.
+        void drop_publishes(int count);
+
+        // Refuses the next count CONNECTs with return_code.
+        void refuse_connections(int count, uint8_t return_code);
+
+        // Messages received so far whose topic starts with topic_prefix, redeliveries included.
+        size_t message_count(const std::string& topic_prefix = "");
+        std::vector<message> messages(const std::string& topic_prefix = "");
+        bool wait_for_messages(size_t count, int64_t timeout_us, const std::string& topic_prefix = "");
+
+        // Counters, safe to read in a sim::wait_for predicate.
+        uint64_t connections();
+        // CONNECTs answered with the session present.
+        uint64_t sessions_resumed();
+        uint64_t pings();
+    }
+
+    namespace sleep
+    {
+        void set_wakeup_cause(esp_sleep_source_t cause, uint64_t ext1_status = 0);
+
+        bool entered();
+        int64_t entered_at_us();
+    }
+
+    // The ULP coprocessor during deep sleep, running the program the firmware loaded with ulp_load_binary and
+    // started with ulp_run. See ulp_fsm.hpp for the machine itself.
+    namespace ulp
+    {
+        struct sleep_report
+        {
+            // The program woke the CPU and the firmware had enabled ULP wakeup. Set the wakeup cause of the next boot to ESP_SLEEP_WAKEUP_ULP.
+            bool woke = false;
+            // From the start of the sleep, -1 without a wake.
+            int64_t wake_us = -1;
+            uint32_t activations = 0;
+            // Time the ULP spent running, against the sleep.
+            int64_t busy_us = 0;
+        };
+
+        // Runs the started program over duration_us of deep sleep, or until it wakes the CPU. level(gpio, time_ns)
+        // gives the level of a pin at time_ns from the start of the call, when the ULP timer fires for the first
+        // time. Does nothing when no program was started or after it woke the CPU.
+        sleep_report sleep(const std::function<int(int gpio, int64_t time_ns)>& level, int64_t duration_us);
+    }
+
+    // Contents of the NVS partition. Like rtc, an image can be carried to the next wake cycle; it also survives power loss.
+    namespace nvs
+    {
+        std::string image();
+        void restore(const std::string& nvs_image);
+
+        // Number of nvs_set_* calls that changed a value.
+        uint64_t write_count();
+    }
+
+    // Data partitions opened through esp_partition_*, like nvs carried from one wake cycle to the next and through power loss.
+    namespace flash
+    {
+        struct counters
+        {
+            uint64_t reads = 0;
+            uint64_t bytes_read = 0;
+            uint64_t writes = 0;
+            uint64_t bytes_written = 0;
+            // Sectors erased.
+            uint64_t erases = 0;
+            // Time the firmware spent waiting for erases and writes.
+            int64_t busy_us = 0;
+        };
+
+        // Every partition, in the order of partitions.csv. An empty image is a freshly erased chip.
+        std::string image();
+        void restore(const std::string& flash_image);
+
+        // Contents of one partition, as a dump read back from the chip would hold them.
+        std::string partition_image(const char *label);
+
+        counters stats();
+    }
+
+    // RTC slow memory: every RTC_DATA_ATTR variable of the firmware. Carry an image from one wake cycle to the
+    // next to model deep sleep, which keeps RTC memory while the rest of the chip restarts.
+    namespace rtc
+    {
+        std::string image();
+
+        // Overwrites RTC memory with an image taken by image(). Call before boot; an empty image leaves it as is.
+        // The RTC clock, which gettimeofday reads, goes on from where the image was taken.
+        void restore(const std::string& rtc_image);
+
+        // How long the chip slept before this boot: moves the RTC clock forward. Ignored on power-on, that
+        // is without a restored image.
+        void sleep_for(int64_t us);
+
+        // Microseconds since power-on, deep sleep included.
+        int64_t time_us();
+    }
+
+    namespace log
+    {
+        // Caps the verbosity of every tag regardless of esp_log_level_set calls made by the firmware.
+        void set_cap(esp_log_level_t level);
+
+        // Makes every line a task logs cost the time a UART console at this rate takes to send it, as
+        // the ROM printf behind ESP_LOG does by waiting on the TX FIFO. Applies whatever the cap. 0 turns it off.
+        void set_console_baud(int baud);
+    }
+
+    namespace stats
+    {
+        // Number of times any task returned from xEventGroupWaitBits.
+        uint64_t event_group_waits();
+    }
+}
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include "kernel.hpp"
+#include "sdkconfig.h"
+#include "esp_cpu.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <sys/time.h>
+
+namespace
+{
+    struct log_state
+    {
+        std::mutex mutex;
+        std::map<std::string, esp_log_level_t> tag_levels;
+        esp_log_level_t default_level = static_cast<esp_log_level_t>(CONFIG_LOG_DEFAULT_LEVEL);
+        esp_log_level_t cap = ESP_LOG_VERBOSE;
+        int console_baud = 0;
+    };
+
+    log_state& logs()
+    {
+        static log_state instance;
+        return instance;
+    }
+
+    struct sleep_state
+    {
+        std::mutex mutex;
+        esp_sleep_source_t wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+        uint64_t ext1_status = 0;
+        std::atomic<bool> entered{false};
+        std::atomic<int64_t> entered_at_us{-1};
+    };
+
+    sleep_state& sleeps()
+    {
+        static sleep_state instance;
+        return instance;
+    }
+
+    // The RTC clock reads base_us plus the virtual clock, which restarts on every boot.
+    struct rtc_clock_state
+    {
+        std::atomic<int64_t> base_us{0};
+        std::atomic<bool> restored{false};
+    };
+
+    rtc_clock_state& rtc_clock()
+    {
+        static rtc_clock_state instance;
+        return instance;
+    }
+}
+
+// Bounds of the section RTC_DATA_ATTR places variables in, provided by the linker. Null when the firmware has none.
+extern "C" char __start_rtc_slow_mem[] __attribute__((weak));
+extern "C" char __stop_rtc_slow_mem[] __attribute__((weak));
+
+namespace sim
+{
+    namespace log
+    {
+        void set_cap(esp_log_level_t level)
+        {
+            std::lock_guard<std::mutex> lock(logs().mutex);
+            logs().cap = level;
+        }
+
+        void set_console_baud(int baud)
+        {
+            std::lock_guard<std::mutex> lock(logs().mutex);
+            logs().console_baud = baud;
+        }
+    }
+
+    namespace rtc
+    {
+        // RTC memory followed by the RTC clock at deep sleep entry, or now if the chip is still awake.
+        std::string image()
+        {
+            if(__start_rtc_slow_mem == nullptr)
+            {
+                return std::string();
+            }
+            std::string rtc_image(__start_rtc_slow_mem, __stop_rtc_slow_mem);
+            int64_t awake_us = sleeps().entered ? sleeps().entered_at_us.load() : sim::clock::now_us();
+            int64_t clock_us = rtc_clock().base_us + awake_us;
+            rtc_image.append(reinterpret_cast<const char*>(&clock_us), sizeof(clock_us));
+            return rtc_image;
+        }
+
+        void restore(const std::string& rtc_image)
+        {
+            size_t memory_size = __start_rtc_slow_mem != nullptr ? static_cast<size_t>(__stop_rtc_slow_mem - __start_rtc_slow_mem) : 0;
+            int64_t clock_us;
+            if(__start_rtc_slow_mem == nullptr || rtc_image.size() != memory_size + sizeof(clock_us))
+            {
+                return;
+            }
+            std::copy(rtc_image.begin(), rtc_image.begin() + memory_size, __start_rtc_slow_mem);
+            memcpy(&clock_us, rtc_image.data() + memory_size, sizeof(clock_us));
+            rtc_clock().base_us = clock_us;
+            rtc_clock().restored = true;
+        }
+
+        void sleep_for(int64_t us)
+        {
+            if(rtc_clock().restored)
+            {
+                rtc_clock().base_us += us;
+            }
+        }
+
+        int64_t time_us()
+        {
+            return rtc_clock().base_us + sim::clock::now_us();
+        }
+    }
+
+    namespace sleep
+    {
+        void set_wakeup_cause(esp_sleep_source_t cause, uint64_t ext1_status)
+        {
+            std::lock_guard<std::mutex> lock(sleeps().mutex);
+            sleeps().wakeup_cause = cause;
+            sleeps().ext1_status = ext1_status;
+        }
+
+        bool entered()
+        {
+            return sleeps().entered.load();
+        }
+
+        int64_t entered_at_us()
+        {
+            return sleeps().entered_at_us.load();
+        }
+    }
+}
+
+extern "C"
+{
+    const char *esp_err_to_name(esp_err_t code)
+    {
+        switch(code)
+        {
+            case ESP_OK: return "ESP_OK";
+            case ESP_FAIL: return "ESP_FAIL";
+            case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+            case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+            case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+            case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+            case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+            case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+            case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+            case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+            case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+            default: return "UNKNOWN ERROR";
+        }
+    }
+
+    void esp_log_level_set(const char *tag, esp_log_level_t level)
+    {
+        std::lock_guard<std::mutex> lock(logs().mutex);
+        if(std::string(tag) == "*")
+        {
+            logs().default_level = level;
+            logs().tag_levels.clear();
+            return;
+        }
+        logs().tag_levels[tag] = level;
+    }
+
+    void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+    {
+        bool printed;
+        int baud;
+        {
+            std::lock_guard<std::mutex> lock(logs().mutex);
+            auto it = logs().tag_levels.find(tag);
+            esp_log_level_t tag_level = it != logs().tag_levels.end() ? it->second : logs().default_level;
+            if(level > tag_level)
+            {
+                return;
+            }
+            printed = level <= logs().cap;
+            baud = logs().console_baud;
+        }
+
+        static const char letters[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+        char message[512];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        char line[600];
+        int length = snprintf(line, sizeof(line), "%c (%lld) %s: %s\n", letters[level], static_cast<long long>(esp_timer_get_time() / 1000), tag, message);
+        if(printed)
+        {
+            fputs(line, stderr);
+        }
+
+        // Interrupt handlers and the service thread stand in for code that does not log on the device.
+        if(baud > 0 && xTaskGetCurrentTaskHandle() != nullptr)
+        {
+            // 10 bits per byte: start, 8 data, stop.
+            int64_t send_us = static_cast<int64_t>(std::min<size_t>(length, sizeof(line) - 1)) * 10 * 1000000 / baud;
+            sim::kernel::busy_for(send_us);
+        }
+    }
+
+    int64_t esp_timer_get_time(void)
+    {
+        return sim::clock::now_us();
+    }
+
+    int sim_gettimeofday(struct timeval *tv, void *tz)
+    {
+        int64_t now = sim::rtc::time_us();
+        tv->tv_sec = static_cast<time_t>(now / 1000000);
+        tv->tv_usec = static_cast<suseconds_t>(now % 1000000);
+        return 0;
+    }
+
+    esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void)
+    {
+        return static_cast<esp_cpu_cycle_count_t>(sim::clock::now_us() * CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    }
+
+    uint32_t esp_rom_get_cpu_ticks_per_us(void)
+    {
+        return CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    }
+
+    void esp_restart(void)
+    {
+        fprintf(stderr, "esp_restart called\n");
+        abort();
+    }
+
+    esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void)
+    {
+        std::lock_guard<std::mutex> lock(sleeps().mutex);
+        return sleeps().wakeup_cause;
+    }
+
+    uint64_t esp_sleep_get_ext1_wakeup_status(void)
+    {
+        std::lock_guard<std::mutex> lock(sleeps().mutex);
+        return sleeps().ext1_status;
+    }
+
+    esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level)
+    {
+        return ESP_OK;
+    }
+
+    esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode)
+    {
+        return ESP_OK;
+    }
+
+    esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+    {
+        return ESP_OK;
+    }
+
+    // Light sleep ends on any interrupt in the simulation, which has no sleep to wake from. See sim::power.
+    esp_err_t esp_sleep_enable_gpio_wakeup(void)
+    {
+        return ESP_OK;
+    }
+
+    esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source)
+    {
+        return ESP_OK;
+    }
+
+    void esp_deep_sleep_start(void)
+    {
+        sleeps().entered_at_us = sim::clock::now_us();
+        sleeps().entered = true;
+        sim::kernel::notify();
+        throw sim::halt();
+    }
+}
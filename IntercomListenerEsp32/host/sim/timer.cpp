@@ -0,0 +1,152 @@
+#include <mutex>
+#include "sim.hpp"
+#include "esp_timer.h"
+
+/*
+   High resolution timers on the virtual clock. ESP-IDF dispatches their callbacks on the esp_timer task, one
+   at a time; here the service thread of the kernel runs them, which serializes them the same way.
+*/
+
+struct esp_timer
+{
+    esp_timer_cb_t callback = nullptr;
+    void *arg = nullptr;
+    bool active = false;
+    uint64_t period_us = 0;
+    int64_t alarm_us = 0;
+    uint64_t scheduled_call = 0;
+    uint64_t generation = 0;
+};
+
+namespace
+{
+    std::mutex timers_mutex;
+
+    void fire(esp_timer *timer, uint64_t generation);
+
+    // Must be called with timers_mutex held.
+    void schedule(esp_timer *timer)
+    {
+        uint64_t generation = ++timer->generation;
+        timer->scheduled_call = sim::schedule_at(timer->alarm_us, [timer, generation]() { fire(timer, generation); });
+    }
+
+    void unschedule(esp_timer *timer)
+    {
+        timer->generation++;
+        if(timer->scheduled_call != 0)
+        {
+            sim::cancel(timer->scheduled_call);
+            timer->scheduled_call = 0;
+        }
+    }
+
+    void fire(esp_timer *timer, uint64_t generation)
+    {
+        esp_timer_cb_t callback;
+        void *arg;
+        {
+            std::lock_guard<std::mutex> lock(timers_mutex);
+            if(timer->generation != generation)
+            {
+                return;
+            }
+            timer->scheduled_call = 0;
+            if(timer->period_us > 0)
+            {
+                timer->alarm_us += static_cast<int64_t>(timer->period_us);
+                schedule(timer);
+            }
+            else
+            {
+                timer->active = false;
+            }
+            callback = timer->callback;
+            arg = timer->arg;
+        }
+        callback(arg);
+    }
+
+    esp_err_t start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+    {
+        if(timer == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        if(timer->active)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        timer->active = true;
+        timer->period_us = period_us;
+        timer->alarm_us = sim::clock::now_us() + static_cast<int64_t>(timeout_us);
+        schedule(timer);
+        return ESP_OK;
+    }
+}
+
+extern "C"
+{
+    esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+    {
+        if(create_args == nullptr || create_args->callback == nullptr || out_handle == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        esp_timer *timer = new esp_timer();
+        timer->callback = create_args->callback;
+        timer->arg = create_args->arg;
+        *out_handle = timer;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+    {
+        return start(timer, timeout_us, 0);
+    }
+
+    esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+    {
+        return period > 0 ? start(timer, period, period) : ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+    {
+        if(timer == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        if(!timer->active)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        timer->active = false;
+        unschedule(timer);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+    {
+        if(timer == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        {
+            std::lock_guard<std::mutex> lock(timers_mutex);
+            if(timer->active)
+            {
+                return ESP_ERR_INVALID_STATE;
+            }
+        }
+        delete timer;
+        return ESP_OK;
+    }
+
+    bool esp_timer_is_active(esp_timer_handle_t timer)
+    {
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        return timer != nullptr && timer->active;
+    }
+}
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include "sim.hpp"
+#include "ulp_fsm.hpp"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp32/ulp.h"
+#include "ulp_main.h"
+
+#ifndef CONFIG_ULP_COPROC_RESERVE_MEM
+#define CONFIG_ULP_COPROC_RESERVE_MEM 1024
+#endif
+
+// The program as the firmware build embeds it, see ulp_program.S. Absent from targets without the ULP.
+extern "C" const char _binary_ulp_main_bin_start[] __attribute__((weak));
+extern "C" const char _binary_ulp_main_bin_end[] __attribute__((weak));
+
+namespace
+{
+    constexpr size_t memory_words = CONFIG_ULP_COPROC_RESERVE_MEM / sizeof(uint32_t);
+
+    // The reserved start of RTC slow memory. In the RTC section, so program variables survive deep sleep with the rest.
+    RTC_DATA_ATTR uint32_t ulp_memory[memory_words];
+
+    struct ulp_state
+    {
+        std::mutex mutex;
+        sim::ulp_fsm::program code;
+        bool assembled = false;
+        bool started = false;
+        bool wakeup_enabled = false;
+        uint32_t entry = 0;
+        uint32_t period_us = 0;
+    };
+
+    ulp_state& ulp()
+    {
+        static ulp_state instance;
+        return instance;
+    }
+
+    bool assemble(const uint8_t *text, size_t size, sim::ulp_fsm::program& code)
+    {
+        // The embedded text is padded to whole words with zeros.
+        std::string source(reinterpret_cast<const char*>(text), size);
+        source.resize(std::strlen(source.c_str()));
+        std::string error;
+        if(!sim::ulp_fsm::assemble(source, code, error))
+        {
+            fprintf(stderr, "ULP program: %s\n", error.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Symbol addresses are those of the linked program, whether or not it has been loaded yet, as on the chip.
+    const sim::ulp_fsm::program& program_locked()
+    {
+        ulp_state& state = ulp();
+        if(!state.assembled && _binary_ulp_main_bin_start != nullptr)
+        {
+            state.assembled = assemble(reinterpret_cast<const uint8_t*>(_binary_ulp_main_bin_start),
+                                       static_cast<size_t>(_binary_ulp_main_bin_end - _binary_ulp_main_bin_start), state.code);
+        }
+        return state.code;
+    }
+}
+
+namespace sim
+{
+    namespace ulp
+    {
+        sleep_report sleep(const std::function<int(int gpio, int64_t time_ns)>& level, int64_t duration_us)
+        {
+            std::lock_guard<std::mutex> lock(::ulp().mutex);
+            ulp_state& state = ::ulp();
+            sleep_report report;
+            if(!state.started)
+            {
+                return report;
+            }
+            const sim::ulp_fsm::program& code = program_locked();
+            sim::ulp_fsm::sleep_result result = sim::ulp_fsm::sleep(code, ulp_memory, memory_words, state.entry, state.period_us,
+                                                                   duration_us * 1000, level);
+            // The program stops its own timer when it wakes the CPU; otherwise it keeps running into the next call.
+            state.started = !result.woke;
+            report.activations = result.activations;
+            report.busy_us = sim::ulp_fsm::cycles_to_ns(result.busy_cycles) / 1000;
+            report.woke = result.woke && state.wakeup_enabled;
+            report.wake_us = report.woke ? result.wake_ns / 1000 : -1;
+            return report;
+        }
+    }
+}
+
+extern "C"
+{
+    uint32_t *sim_ulp_memory(void)
+    {
+        return ulp_memory;
+    }
+
+    uint32_t *sim_ulp_symbol(const char *name)
+    {
+        std::lock_guard<std::mutex> lock(ulp().mutex);
+        const sim::ulp_fsm::program& code = program_locked();
+        auto found = code.symbols.find(name);
+        if(found == code.symbols.end() || found->second >= memory_words)
+        {
+            fprintf(stderr, "ULP symbol %s is not in the program\n", name);
+            abort();
+        }
+        return &ulp_memory[found->second];
+    }
+
+    esp_err_t ulp_load_binary(uint32_t load_addr, const uint8_t *program_binary, size_t program_size)
+    {
+        // Programs are linked for address 0; the simulation supports no other.
+        if(load_addr != 0 || program_binary == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(ulp().mutex);
+        ulp_state& state = ulp();
+        sim::ulp_fsm::program code;
+        if(!assemble(program_binary, program_size * sizeof(uint32_t), code))
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if(code.words() > memory_words)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        // Text words are opaque to the simulation. Data is copied and bss cleared, like the loader does.
+        std::fill(ulp_memory, ulp_memory + code.text.size(), 0);
+        std::copy(code.data.begin(), code.data.end(), ulp_memory + code.text.size());
+        state.code = std::move(code);
+        state.assembled = true;
+        state.started = false;
+        return ESP_OK;
+    }
+
+    esp_err_t ulp_run(uint32_t entry_point)
+    {
+        std::lock_guard<std::mutex> lock(ulp().mutex);
+        ulp_state& state = ulp();
+        if(!state.assembled || entry_point >= state.code.text.size())
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        state.entry = entry_point;
+        state.started = true;
+        return ESP_OK;
+    }
+
+    esp_err_t ulp_set_wakeup_period(size_t period_index, uint32_t period_us)
+    {
+        if(period_index > 4)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        std::lock_guard<std::mutex> lock(ulp().mutex);
+        if(period_index == 0)
+        {
+            ulp().period_us = period_us;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t esp_sleep_enable_ulp_wakeup(void)
+    {
+        std::lock_guard<std::mutex> lock(ulp().mutex);
+        ulp().wakeup_enabled = true;
+        return ESP_OK;
+    }
+}
@@ -0,0 +1,923 @@
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+#include "ulp_fsm.hpp"
+
+namespace sim::ulp_fsm
+{
+    namespace
+    {
+        // Execution plus fetch of the next instruction, from the ESP32 ULP instruction set reference.
+        constexpr uint64_t cycles_alu = 6;
+        constexpr uint64_t cycles_stage = 6;
+        constexpr uint64_t cycles_ld = 8;
+        constexpr uint64_t cycles_st = 8;
+        constexpr uint64_t cycles_jump = 4;
+        constexpr uint64_t cycles_halt = 2;
+        constexpr uint64_t cycles_wake = 6;
+        constexpr uint64_t cycles_wait = 6;
+        constexpr uint64_t cycles_reg_rd = 8;
+        constexpr uint64_t cycles_reg_wr = 12;
+
+        // GPIO of every RTC IO, by RTC IO number.
+        const int gpio_of_rtc_io[] = {36, 37, 38, 39, 34, 35, 25, 26, 33, 32, 4, 0, 2, 15, 13, 12, 14, 27};
+        constexpr int rtc_io_count = static_cast<int>(sizeof(gpio_of_rtc_io) / sizeof(gpio_of_rtc_io[0]));
+
+        struct assembly_error : std::runtime_error
+        {
+            using std::runtime_error::runtime_error;
+        };
+
+        std::string trim(const std::string& text)
+        {
+            size_t first = text.find_first_not_of(" \t\r");
+            if(first == std::string::npos)
+            {
+                return {};
+            }
+            size_t last = text.find_last_not_of(" \t\r");
+            return text.substr(first, last - first + 1);
+        }
+
+        std::string lower(std::string text)
+        {
+            for(char& c : text)
+            {
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            }
+            return text;
+        }
+
+        // Splits operands at the commas outside parentheses.
+        std::vector<std::string> split_operands(const std::string& text)
+        {
+            std::vector<std::string> operands;
+            int depth = 0;
+            std::string current;
+            for(char c : text)
+            {
+                if(c == '(')
+                {
+                    depth++;
+                }
+                else if(c == ')')
+                {
+                    depth--;
+                }
+                if(c == ',' && depth == 0)
+                {
+                    operands.push_back(trim(current));
+                    current.clear();
+                    continue;
+                }
+                current += c;
+            }
+            if(!trim(current).empty() || !operands.empty())
+            {
+                operands.push_back(trim(current));
+            }
+            return operands;
+        }
+
+        // Integer expressions with the C operators the preprocessed constants use. Symbols are resolved
+        // through the table, or rejected while it is null (first pass).
+        class expression
+        {
+        public:
+            expression(const std::string& text, const std::map<std::string, uint32_t> *symbols)
+                : text(text), symbols(symbols)
+            {
+            }
+
+            int64_t evaluate()
+            {
+                int64_t value = parse_or();
+                skip_space();
+                if(position != text.size())
+                {
+                    throw assembly_error("unexpected '" + text.substr(position) + "' in expression");
+                }
+                return value;
+            }
+
+        private:
+            const std::string& text;
+            const std::map<std::string, uint32_t> *symbols;
+            size_t position = 0;
+
+            void skip_space()
+            {
+                while(position < text.size() && std::isspace(static_cast<unsigned char>(text[position])))
+                {
+                    position++;
+                }
+            }
+
+            bool accept(const char *token)
+            {
+                skip_space();
+                size_t length = std::char_traits<char>::length(token);
+                if(text.compare(position, length, token) != 0)
+                {
+                    return false;
+                }
+                // Keep "<" from matching the start of "<<" and "<=".
+                if(length == 1 && position + 1 < text.size() && (token[0] == '<' || token[0] == '>') &&
+                   (text[position + 1] == token[0] || text[position + 1] == '='))
+                {
+                    return false;
+                }
+                position += length;
+                return true;
+            }
+
+            int64_t parse_or()
+            {
+                int64_t value = parse_xor();
+                while(accept("|"))
+                {
+                    value |= parse_xor();
+                }
+                return value;
+            }
+
+            int64_t parse_xor()
+            {
+                int64_t value = parse_and();
+                while(accept("^"))
+                {
+                    value ^= parse_and();
+                }
+                return value;
+            }
+
+            int64_t parse_and()
+            {
+                int64_t value = parse_shift();
+                while(accept("&"))
+                {
+                    value &= parse_shift();
+                }
+                return value;
+            }
+
+            int64_t parse_shift()
+            {
+                int64_t value = parse_sum();
+                while(true)
+                {
+                    if(accept("<<"))
+                    {
+                        value <<= parse_sum();
+                    }
+                    else if(accept(">>"))
+                    {
+                        value >>= parse_sum();
+                    }
+                    else
+                    {
+                        return value;
+                    }
+                }
+            }
+
+            int64_t parse_sum()
+            {
+                int64_t value = parse_product();
+                while(true)
+                {
+                    if(accept("+"))
+                    {
+                        value += parse_product();
+                    }
+                    else if(accept("-"))
+                    {
+                        value -= parse_product();
+                    }
+                    else
+                    {
+                        return value;
+                    }
+                }
+            }
+
+            int64_t parse_product()
+            {
+                int64_t value = parse_unary();
+                while(true)
+                {
+                    if(accept("*"))
+                    {
+                        value *= parse_unary();
+                    }
+                    else if(accept("/") || accept("%"))
+                    {
+                        bool modulo = text[position - 1] == '%';
+                        int64_t divisor = parse_unary();
+                        if(divisor == 0)
+                        {
+                            throw assembly_error("division by zero in expression");
+                        }
+                        value = modulo ? value % divisor : value / divisor;
+                    }
+                    else
+                    {
+                        return value;
+                    }
+                }
+            }
+
+            int64_t parse_unary()
+            {
+                if(accept("-"))
+                {
+                    return -parse_unary();
+                }
+                if(accept("+"))
+                {
+                    return parse_unary();
+                }
+                if(accept("~"))
+                {
+                    return ~parse_unary();
+                }
+                if(accept("("))
+                {
+                    int64_t value = parse_or();
+                    if(!accept(")"))
+                    {
+                        throw assembly_error("missing ')' in expression");
+                    }
+                    return value;
+                }
+                return parse_atom();
+            }
+
+            int64_t parse_atom()
+            {
+                skip_space();
+                size_t start = position;
+                while(position < text.size() &&
+                      (std::isalnum(static_cast<unsigned char>(text[position])) || text[position] == '_' || text[position] == '.'))
+                {
+                    position++;
+                }
+                std::string token = text.substr(start, position - start);
+                if(token.empty())
+                {
+                    throw assembly_error("expected a value in '" + text + "'");
+                }
+                if(std::isdigit(static_cast<unsigned char>(token[0])))
+                {
+                    size_t used = 0;
+                    // Drop the integer suffixes the preprocessor may leave on constants.
+                    std::string digits = token;
+                    while(!digits.empty() && (digits.back() == 'u' || digits.back() == 'U' || digits.back() == 'l' || digits.back() == 'L'))
+                    {
+                        digits.pop_back();
+                    }
+                    int64_t value = std::stoll(digits, &used, 0);
+                    if(used != digits.size())
+                    {
+                        throw assembly_error("bad number '" + token + "'");
+                    }
+                    return value;
+                }
+                if(symbols == nullptr)
+                {
+                    throw assembly_error("symbol '" + token + "' used before the first pass completed");
+                }
+                auto found = symbols->find(token);
+                if(found == symbols->end())
+                {
+                    throw assembly_error("undefined symbol '" + token + "'");
+                }
+                return found->second;
+            }
+        };
+
+        int64_t evaluate(const std::string& text, const std::map<std::string, uint32_t>& symbols)
+        {
+            return expression(text, &symbols).evaluate();
+        }
+
+        // r0..r3, or -1 when the operand is not a register.
+        int parse_register(const std::string& operand)
+        {
+            std::string name = lower(trim(operand));
+            if(name.size() == 2 && name[0] == 'r' && name[1] >= '0' && name[1] <= '3')
+            {
+                return name[1] - '0';
+            }
+            return -1;
+        }
+
+        int require_register(const std::string& operand)
+        {
+            int index = parse_register(operand);
+            if(index < 0)
+            {
+                throw assembly_error("expected a register, got '" + operand + "'");
+            }
+            return index;
+        }
+
+        condition parse_comparison(const std::string& operand)
+        {
+            std::string name = lower(trim(operand));
+            if(name == "lt")
+            {
+                return condition::lt;
+            }
+            if(name == "le")
+            {
+                return condition::le;
+            }
+            if(name == "gt")
+            {
+                return condition::gt;
+            }
+            if(name == "ge")
+            {
+                return condition::ge;
+            }
+            if(name == "eq")
+            {
+                return condition::equal;
+            }
+            throw assembly_error("expected lt, le, gt, ge or eq, got '" + operand + "'");
+        }
+
+        void expect_operands(const std::vector<std::string>& operands, size_t count, const std::string& mnemonic)
+        {
+            if(operands.size() != count)
+            {
+                throw assembly_error(mnemonic + " takes " + std::to_string(count) + " operands");
+            }
+        }
+
+        enum class section
+        {
+            text,
+            data,
+            bss
+        };
+
+        struct statement
+        {
+            int line;
+            section where;
+            std::string mnemonic;
+            std::vector<std::string> operands;
+        };
+
+        struct label
+        {
+            section where;
+            uint32_t offset;
+        };
+
+        instruction encode(const statement& s, const std::map<std::string, uint32_t>& symbols)
+        {
+            instruction ins;
+            ins.line = s.line;
+            const std::string& m = s.mnemonic;
+            const std::vector<std::string>& ops = s.operands;
+
+            static const std::map<std::string, alu_op> alu_ops = {
+                {"add", alu_op::add}, {"sub", alu_op::sub}, {"and", alu_op::and_},
+                {"or", alu_op::or_}, {"lsh", alu_op::lsh}, {"rsh", alu_op::rsh}};
+
+            if(m == "move")
+            {
+                expect_operands(ops, 2, m);
+                ins.op = opcode::alu;
+                ins.alu = alu_op::move;
+                ins.rd = static_cast<uint8_t>(require_register(ops[0]));
+                int source = parse_register(ops[1]);
+                ins.immediate = source < 0;
+                ins.rs1 = static_cast<uint8_t>(source < 0 ? 0 : source);
+                ins.value = ins.immediate ? static_cast<int32_t>(evaluate(ops[1], symbols)) : 0;
+            }
+            else if(auto found = alu_ops.find(m); found != alu_ops.end())
+            {
+                expect_operands(ops, 3, m);
+                ins.op = opcode::alu;
+                ins.alu = found->second;
+                ins.rd = static_cast<uint8_t>(require_register(ops[0]));
+                ins.rs1 = static_cast<uint8_t>(require_register(ops[1]));
+                int source = parse_register(ops[2]);
+                ins.immediate = source < 0;
+                ins.rs2 = static_cast<uint8_t>(source < 0 ? 0 : source);
+                ins.value = ins.immediate ? static_cast<int32_t>(evaluate(ops[2], symbols)) : 0;
+            }
+            else if(m == "st" || m == "ld")
+            {
+                expect_operands(ops, 3, m);
+                ins.op = m == "st" ? opcode::st : opcode::ld;
+                ins.rd = static_cast<uint8_t>(require_register(ops[0]));
+                ins.rs1 = static_cast<uint8_t>(require_register(ops[1]));
+                ins.value = static_cast<int32_t>(evaluate(ops[2], symbols));
+            }
+            else if(m == "jump")
+            {
+                if(ops.empty() || ops.size() > 2)
+                {
+                    throw assembly_error("jump takes a target and an optional condition");
+                }
+                ins.op = opcode::jump;
+                int target = parse_register(ops[0]);
+                ins.immediate = target < 0;
+                ins.rs1 = static_cast<uint8_t>(target < 0 ? 0 : target);
+                ins.value = ins.immediate ? static_cast<int32_t>(evaluate(ops[0], symbols)) : 0;
+                if(ops.size() == 2)
+                {
+                    std::string cond = lower(ops[1]);
+                    if(cond == "eq")
+                    {
+                        ins.cond = condition::eq;
+                    }
+                    else if(cond == "ov")
+                    {
+                        ins.cond = condition::ov;
+                    }
+                    else
+                    {
+                        throw assembly_error("jump condition must be eq or ov, got '" + ops[1] + "'");
+                    }
+                }
+            }
+            else if(m == "jumpr" || m == "jumps")
+            {
+                expect_operands(ops, 3, m);
+                ins.op = m == "jumpr" ? opcode::jumpr : opcode::jumps;
+                ins.value = static_cast<int32_t>(evaluate(ops[0], symbols));
+                ins.value2 = static_cast<int32_t>(evaluate(ops[1], symbols));
+                ins.cond = parse_comparison(ops[2]);
+                if(ins.value2 < 0 || ins.value2 > (ins.op == opcode::jumpr ? 0xffff : 0xff))
+                {
+                    throw assembly_error("threshold out of range");
+                }
+            }
+            else if(m == "stage_rst")
+            {
+                expect_operands(ops, 0, m);
+                ins.op = opcode::stage_rst;
+            }
+            else if(m == "stage_inc" || m == "stage_dec")
+            {
+                expect_operands(ops, 1, m);
+                ins.op = m == "stage_inc" ? opcode::stage_inc : opcode::stage_dec;
+                ins.value = static_cast<int32_t>(evaluate(ops[0], symbols));
+            }
+            else if(m == "halt" || m == "wake")
+            {
+                expect_operands(ops, 0, m);
+                ins.op = m == "halt" ? opcode::halt : opcode::wake;
+            }
+            else if(m == "nop")
+            {
+                expect_operands(ops, 0, m);
+                ins.op = opcode::wait;
+                ins.value = 0;
+            }
+            else if(m == "wait")
+            {
+                expect_operands(ops, 1, m);
+                ins.op = opcode::wait;
+                ins.value = static_cast<int32_t>(evaluate(ops[0], symbols));
+                if(ins.value < 0 || ins.value > 0xffff)
+                {
+                    throw assembly_error("wait cycles out of range");
+                }
+            }
+            else if(m == "reg_rd" || m == "reg_wr")
+            {
+                expect_operands(ops, m == "reg_rd" ? 3 : 4, m);
+                ins.op = m == "reg_rd" ? opcode::reg_rd : opcode::reg_wr;
+                ins.value = static_cast<int32_t>(evaluate(ops[0], symbols));
+                ins.value2 = static_cast<int32_t>(evaluate(ops[1], symbols));
+                ins.value3 = static_cast<int32_t>(evaluate(ops[2], symbols));
+                if(ins.op == opcode::reg_wr)
+                {
+                    ins.value4 = static_cast<int32_t>(evaluate(ops[3], symbols));
+                }
+                // REG_RD/REG_WR address the low 1 KB of the RTC peripherals and at most 16 bits at a time.
+                if(ins.value < 0 || ins.value > 0x3ff || ins.value3 < 0 || ins.value2 < ins.value3 ||
+                   ins.value2 > 31 || ins.value2 - ins.value3 > 15)
+                {
+                    throw assembly_error("register access out of range");
+                }
+            }
+            else
+            {
+                throw assembly_error("unknown instruction '" + m + "'");
+            }
+            return ins;
+        }
+    }
+
+    bool assemble(const std::string& source, program& out, std::string& error)
+    {
+        out = {};
+        std::vector<statement> statements;
+        std::map<std::string, label> labels;
+        std::map<std::string, std::string> definitions;
+        section where = section::text;
+        uint32_t size[3] = {};
+        int line_number = 0;
+
+        try
+        {
+            std::istringstream lines(source);
+            std::string raw;
+            bool in_comment = false;
+            while(std::getline(lines, raw))
+            {
+                line_number++;
+                // Comments the preprocessor left: /* */ across lines, and line comments.
+                std::string text;
+                for(size_t i = 0; i < raw.size(); i++)
+                {
+                    if(in_comment)
+                    {
+                        if(raw.compare(i, 2, "*/") == 0)
+                        {
+                            in_comment = false;
+                            i++;
+                        }
+                        continue;
+                    }
+                    if(raw.compare(i, 2, "/*") == 0)
+                    {
+                        in_comment = true;
+                        i++;
+                        continue;
+                    }
+                    if(raw.compare(i, 2, "//") == 0 || raw[i] == '#')
+                    {
+                        break;
+                    }
+                    text += raw[i];
+                }
+                text = trim(text);
+
+                while(true)
+                {
+                    size_t colon = text.find(':');
+                    if(colon == std::string::npos)
+                    {
+                        break;
+                    }
+                    std::string name = trim(text.substr(0, colon));
+                    if(name.empty() || name.find_first_of(" \t,") != std::string::npos)
+                    {
+                        break;
+                    }
+                    if(labels.count(name) != 0)
+                    {
+                        throw assembly_error("label '" + name + "' defined twice");
+                    }
+                    labels[name] = {where, size[static_cast<int>(where)]};
+                    text = trim(text.substr(colon + 1));
+                }
+                if(text.empty())
+                {
+                    continue;
+                }
+
+                size_t split = text.find_first_of(" \t");
+                std::string mnemonic = lower(text.substr(0, split));
+                std::vector<std::string> operands = split == std::string::npos ? std::vector<std::string>{} : split_operands(text.substr(split + 1));
+
+                if(mnemonic == ".text")
+                {
+                    where = section::text;
+                }
+                else if(mnemonic == ".data")
+                {
+                    where = section::data;
+                }
+                else if(mnemonic == ".bss")
+                {
+                    where = section::bss;
+                }
+                else if(mnemonic == ".global" || mnemonic == ".globl")
+                {
+                }
+                else if(mnemonic == ".set")
+                {
+                    expect_operands(operands, 2, mnemonic);
+                    definitions[operands[0]] = operands[1];
+                }
+                else if(mnemonic == ".long" || mnemonic == ".int")
+                {
+                    if(where == section::text)
+                    {
+                        throw assembly_error(".long in .text is not supported");
+                    }
+                    if(operands.empty())
+                    {
+                        throw assembly_error(".long without a value");
+                    }
+                    statements.push_back({line_number, where, mnemonic, operands});
+                    size[static_cast<int>(where)] += static_cast<uint32_t>(operands.size());
+                }
+                else if(mnemonic[0] == '.')
+                {
+                    throw assembly_error("unsupported directive '" + mnemonic + "'");
+                }
+                else
+                {
+                    if(where != section::text)
+                    {
+                        throw assembly_error("instruction outside .text");
+                    }
+                    statements.push_back({line_number, where, mnemonic, operands});
+                    size[static_cast<int>(section::text)]++;
+                }
+            }
+            if(in_comment)
+            {
+                throw assembly_error("unterminated comment");
+            }
+
+            // Text, then data, then bss, in words from the load address.
+            uint32_t base[3] = {0, size[0], size[0] + size[1]};
+            for(auto& [name, where_label] : labels)
+            {
+                out.symbols[name] = base[static_cast<int>(where_label.where)] + where_label.offset;
+            }
+            for(auto& [name, value] : definitions)
+            {
+                line_number = 0;
+                out.symbols[name] = static_cast<uint32_t>(evaluate(value, out.symbols));
+            }
+
+            out.data.assign(size[1] + size[2], 0);
+            uint32_t data_offset[3] = {0, 0, 0};
+            for(const statement& s : statements)
+            {
+                line_number = s.line;
+                if(s.mnemonic[0] == '.')
+                {
+                    int index = static_cast<int>(s.where);
+                    for(const std::string& operand : s.operands)
+                    {
+                        uint32_t value = static_cast<uint32_t>(evaluate(operand, out.symbols));
+                        if(s.where == section::bss && value != 0)
+                        {
+                            throw assembly_error("non-zero value in .bss");
+                        }
+                        out.data[base[index] - size[0] + data_offset[index]++] = value;
+                    }
+                }
+                else
+                {
+                    out.text.push_back(encode(s, out.symbols));
+                }
+            }
+            for(const instruction& ins : out.text)
+            {
+                bool static_target = (ins.op == opcode::jump && ins.immediate) || ins.op == opcode::jumpr || ins.op == opcode::jumps;
+                if(static_target && (ins.value < 0 || static_cast<size_t>(ins.value) >= out.text.size()))
+                {
+                    line_number = ins.line;
+                    throw assembly_error("jump target outside .text");
+                }
+            }
+        }
+        catch(const std::exception& e)
+        {
+            error = "line " + std::to_string(line_number) + ": " + e.what();
+            out = {};
+            return false;
+        }
+        return true;
+    }
+
+    machine::machine(const program& code, uint32_t *memory, size_t memory_words)
+        : code(code), memory(memory), memory_words(memory_words)
+    {
+    }
+
+    activation machine::run(uint32_t pc, int64_t start_ns, const peripherals& io, uint64_t max_cycles)
+    {
+        activation result;
+        auto fail = [&](const std::string& what)
+        {
+            throw std::runtime_error("ULP at word " + std::to_string(pc) + ": " + what);
+        };
+        auto compare = [](condition cond, uint32_t value, uint32_t threshold)
+        {
+            switch(cond)
+            {
+                case condition::lt: return value < threshold;
+                case condition::le: return value <= threshold;
+                case condition::gt: return value > threshold;
+                case condition::ge: return value >= threshold;
+                case condition::equal: return value == threshold;
+                default: return true;
+            }
+        };
+
+        while(result.cycles < max_cycles)
+        {
+            if(pc >= code.text.size())
+            {
+                fail("execution outside .text");
+            }
+            const instruction& ins = code.text[pc];
+            int64_t now_ns = start_ns + cycles_to_ns(result.cycles);
+            uint32_t next = pc + 1;
+            result.instructions++;
+
+            switch(ins.op)
+            {
+                case opcode::alu:
+                {
+                    uint32_t a = reg[ins.rs1];
+                    uint32_t b = ins.immediate ? static_cast<uint32_t>(ins.value) & 0xffff : reg[ins.alu == alu_op::move ? ins.rs1 : ins.rs2];
+                    uint32_t value = 0;
+                    overflow = false;
+                    switch(ins.alu)
+                    {
+                        case alu_op::move: value = b; break;
+                        case alu_op::add: value = a + b; overflow = value > 0xffff; break;
+                        case alu_op::sub: value = a - b; overflow = a < b; break;
+                        case alu_op::and_: value = a & b; break;
+                        case alu_op::or_: value = a | b; break;
+                        case alu_op::lsh: value = b > 15 ? 0 : a << b; break;
+                        case alu_op::rsh: value = b > 15 ? 0 : a >> b; break;
+                    }
+                    reg[ins.rd] = static_cast<uint16_t>(value);
+                    zero = reg[ins.rd] == 0;
+                    result.cycles += cycles_alu;
+                    break;
+                }
+                case opcode::st:
+                case opcode::ld:
+                {
+                    uint32_t address = (reg[ins.rs1] + static_cast<uint32_t>(ins.value)) & 0x7ff;
+                    if(address >= memory_words)
+                    {
+                        fail("access to word " + std::to_string(address) + " outside the reserved memory");
+                    }
+                    if(ins.op == opcode::st)
+                    {
+                        // The upper half records where the store came from, as on the chip. Readers mask it off.
+                        memory[address] = (static_cast<uint32_t>(pc & 0x7ff) << 21) | (static_cast<uint32_t>(ins.rs1) << 16) | reg[ins.rd];
+                        result.cycles += cycles_st;
+                    }
+                    else
+                    {
+                        reg[ins.rd] = static_cast<uint16_t>(memory[address]);
+                        result.cycles += cycles_ld;
+                    }
+                    break;
+                }
+                case opcode::jump:
+                {
+                    bool taken = ins.cond == condition::always || (ins.cond == condition::eq && zero) || (ins.cond == condition::ov && overflow);
+                    if(taken)
+                    {
+                        next = ins.immediate ? static_cast<uint32_t>(ins.value) : reg[ins.rs1];
+                    }
+                    result.cycles += cycles_jump;
+                    break;
+                }
+                case opcode::jumpr:
+                    if(compare(ins.cond, reg[0], static_cast<uint32_t>(ins.value2)))
+                    {
+                        next = static_cast<uint32_t>(ins.value);
+                    }
+                    result.cycles += cycles_jump;
+                    break;
+                case opcode::jumps:
+                    if(compare(ins.cond, stage, static_cast<uint32_t>(ins.value2)))
+                    {
+                        next = static_cast<uint32_t>(ins.value);
+                    }
+                    result.cycles += cycles_jump;
+                    break;
+                case opcode::stage_rst:
+                    stage = 0;
+                    result.cycles += cycles_stage;
+                    break;
+                case opcode::stage_inc:
+                    stage = static_cast<uint8_t>(stage + ins.value);
+                    result.cycles += cycles_stage;
+                    break;
+                case opcode::stage_dec:
+                    stage = static_cast<uint8_t>(stage - ins.value);
+                    result.cycles += cycles_stage;
+                    break;
+                case opcode::halt:
+                    result.cycles += cycles_halt;
+                    result.halted = true;
+                    return result;
+                case opcode::wake:
+                    if(io.wake)
+                    {
+                        io.wake(now_ns);
+                    }
+                    result.cycles += cycles_wake;
+                    break;
+                case opcode::wait:
+                    result.cycles += cycles_wait + static_cast<uint64_t>(ins.value);
+                    break;
+                case opcode::reg_rd:
+                {
+                    uint32_t value = io.read ? io.read(static_cast<uint32_t>(ins.value), now_ns) : 0;
+                    uint32_t width = static_cast<uint32_t>(ins.value2 - ins.value3 + 1);
+                    reg[0] = static_cast<uint16_t>((value >> ins.value3) & ((1u << width) - 1));
+                    result.cycles += cycles_reg_rd;
+                    break;
+                }
+                case opcode::reg_wr:
+                    if(io.write)
+                    {
+                        io.write(static_cast<uint32_t>(ins.value), ins.value2, ins.value3, static_cast<uint32_t>(ins.value4), now_ns);
+                    }
+                    result.cycles += cycles_reg_wr;
+                    break;
+            }
+            pc = next;
+        }
+        return result;
+    }
+
+    int rtc_io_of_gpio(int gpio)
+    {
+        for(int io = 0; io < rtc_io_count; io++)
+        {
+            if(gpio_of_rtc_io[io] == gpio)
+            {
+                return io;
+            }
+        }
+        return -1;
+    }
+
+    sleep_result sleep(const program& code, uint32_t *memory, size_t memory_words, uint32_t entry, int64_t period_us,
+                       int64_t duration_ns, const std::function<int(int gpio, int64_t time_ns)>& level)
+    {
+        sleep_result result;
+        bool timer_enabled = true;
+
+        peripherals io;
+        io.read = [&](uint32_t reg, int64_t time_ns) -> uint32_t
+        {
+            if(reg == reg_rtc_gpio_in)
+            {
+                uint32_t value = 0;
+                for(int rtc_io = 0; rtc_io < rtc_io_count; rtc_io++)
+                {
+                    if(level(gpio_of_rtc_io[rtc_io], time_ns))
+                    {
+                        value |= 1u << (14 + rtc_io);
+                    }
+                }
+                return value;
+            }
+            if(reg == reg_rtc_cntl_low_power_st)
+            {
+                // The main CPU is asleep for the whole run: always ready for wakeup.
+                return 1u << 19;
+            }
+            return 0;
+        };
+        io.write = [&](uint32_t reg, int high, int low, uint32_t value, int64_t)
+        {
+            if(reg == reg_rtc_cntl_state0 && low <= 24 && high >= 24 && ((value >> (24 - low)) & 1) == 0)
+            {
+                timer_enabled = false;
+            }
+        };
+        io.wake = [&](int64_t time_ns)
+        {
+            if(!result.woke)
+            {
+                result.woke = true;
+                result.wake_ns = time_ns;
+            }
+        };
+
+        machine ulp(code, memory, memory_words);
+        int64_t start_ns = 0;
+        while(start_ns < duration_ns && !result.woke && timer_enabled)
+        {
+            uint64_t budget = static_cast<uint64_t>((duration_ns - start_ns) * clock_hz / 1000000000LL) + 1;
+            activation run = ulp.run(entry, start_ns, io, budget);
+            result.activations++;
+            result.busy_cycles += run.cycles;
+            if(!run.halted)
+            {
+                break;
+            }
+            // The sleep timer counts the period from the HALT.
+            start_ns += cycles_to_ns(run.cycles) + period_us * 1000;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+   The ESP32 ULP FSM coprocessor, for running ulp/ulp_main.S on the host.
+
+   assemble() takes the program as the C preprocessor leaves it, the same text ulp_embed_binary hands to
+   the ULP assembler, and supports the instructions and directives the program uses. machine executes it
+   on 16-bit registers against a block of RTC slow memory and counts cycles at the rates of the ESP32 ULP
+   instruction set reference, so sample loops take as long as they would on the chip. Addresses are in
+   32-bit words from the load address, as on the ULP.
+
+   Self-contained: the firmware-facing ulp_* functions in ulp.cpp and the intercom_ulp tool both build on it.
+*/
+namespace sim::ulp_fsm
+{
+    // RTC_FAST_CLK, which clocks the FSM.
+    constexpr int64_t clock_hz = 8000000;
+
+    constexpr int64_t cycles_to_ns(uint64_t cycles)
+    {
+        return static_cast<int64_t>(cycles * 1000000000ULL / clock_hz);
+    }
+
+    enum class opcode : uint8_t
+    {
+        alu,
+        st,
+        ld,
+        jump,
+        jumpr,
+        jumps,
+        stage_rst,
+        stage_inc,
+        stage_dec,
+        halt,
+        wake,
+        wait,
+        reg_rd,
+        reg_wr
+    };
+
+    enum class alu_op : uint8_t
+    {
+        move,
+        add,
+        sub,
+        and_,
+        or_,
+        lsh,
+        rsh
+    };
+
+    enum class condition : uint8_t
+    {
+        always,
+        eq,
+        ov,
+        lt,
+        le,
+        gt,
+        ge,
+        equal
+    };
+
+    struct instruction
+    {
+        opcode op;
+        alu_op alu = alu_op::move;
+        condition cond = condition::always;
+        uint8_t rd = 0;
+        uint8_t rs1 = 0;
+        uint8_t rs2 = 0;
+        // The second ALU operand, or the target of a jump, is an immediate rather than a register.
+        bool immediate = true;
+        // Immediate operand, jump target, threshold, load/store offset or register address.
+        int32_t value = 0;
+        // Threshold of JUMPR/JUMPS, high bit of REG_RD/REG_WR.
+        int32_t value2 = 0;
+        // Low bit of REG_RD/REG_WR.
+        int32_t value3 = 0;
+        // Data of REG_WR.
+        int32_t value4 = 0;
+        int line = 0;
+    };
+
+    struct program
+    {
+        std::vector<instruction> text;
+        // .data as written, then .bss as zeros. Placed right after the text.
+        std::vector<uint32_t> data;
+        // Word address of every label, from the load address.
+        std::map<std::string, uint32_t> symbols;
+
+        size_t words() const
+        {
+            return text.size() + data.size();
+        }
+    };
+
+    // Assembles preprocessed ULP assembler. On failure returns false with the line and reason in error.
+    bool assemble(const std::string& source, program& out, std::string& error);
+
+    // What the program sees outside its memory. Register addresses are the words REG_RD/REG_WR encode.
+    struct peripherals
+    {
+        std::function<uint32_t(uint32_t reg, int64_t time_ns)> read;
+        std::function<void(uint32_t reg, int high, int low, uint32_t value, int64_t time_ns)> write;
+        std::function<void(int64_t time_ns)> wake;
+    };
+
+    struct activation
+    {
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        // False when the cycle budget ran out first.
+        bool halted = false;
+    };
+
+    class machine
+    {
+    public:
+        machine(const program& code, uint32_t *memory, size_t memory_words);
+
+        // Runs from pc until HALT or until max_cycles have passed. start_ns is the time of the first cycle.
+        // Throws std::runtime_error on a memory access or jump outside the program.
+        activation run(uint32_t pc, int64_t start_ns, const peripherals& io, uint64_t max_cycles);
+
+    private:
+        const program& code;
+        uint32_t *memory;
+        size_t memory_words;
+        uint16_t reg[4] = {};
+        uint8_t stage = 0;
+        bool zero = false;
+        bool overflow = false;
+    };
+
+    // Register word addresses, from DR_REG_RTCCNTL_BASE, that sleep() models.
+    constexpr uint32_t reg_rtc_cntl_state0 = 0x18 / 4;
+    constexpr uint32_t reg_rtc_cntl_low_power_st = 0xc0 / 4;
+    constexpr uint32_t reg_rtc_gpio_in = (0x3ff48424 - 0x3ff48000) / 4;
+
+    // RTC IO number of an RTC-capable GPIO, -1 for the others.
+    int rtc_io_of_gpio(int gpio);
+
+    struct sleep_result
+    {
+        bool woke = false;
+        // From the start of the sleep.
+        int64_t wake_ns = -1;
+        uint32_t activations = 0;
+        // Cycles the ULP ran, against the sleep duration.
+        uint64_t busy_cycles = 0;
+    };
+
+    // Deep sleep of duration_ns with the ULP timer starting the program at entry every period_us, from the
+    // start of the sleep. level(gpio, time_ns) gives the input level of a pin. Ends early on WAKE.
+    sleep_result sleep(const program& code, uint32_t *memory, size_t memory_words, uint32_t entry, int64_t period_us,
+                       int64_t duration_ns, const std::function<int(int gpio, int64_t time_ns)>& level);
+}
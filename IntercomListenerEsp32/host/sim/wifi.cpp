@@ -0,0 +1,652 @@
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "kernel.hpp"
+#include "sim.hpp"
+#include "sdkconfig.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "nvs.h"
+
+extern "C"
+{
+    ESP_EVENT_DEFINE_BASE(WIFI_EVENT);
+    ESP_EVENT_DEFINE_BASE(IP_EVENT);
+}
+
+namespace
+{
+    struct handler_entry
+    {
+        esp_event_base_t base;
+        int32_t id;
+        esp_event_handler_t handler;
+        void *arg;
+    };
+
+    std::mutex events_mutex;
+    std::vector<std::unique_ptr<handler_entry>> handlers;
+    bool default_loop_created = false;
+
+    bool same_base(esp_event_base_t a, esp_event_base_t b)
+    {
+        return a == b || (a != nullptr && b != nullptr && std::strcmp(a, b) == 0);
+    }
+
+    // Runs the registered handlers on the service thread, like the default event loop task would.
+    void post_event(esp_event_base_t base, int32_t id, const void *data, size_t size)
+    {
+        auto payload = std::make_shared<std::vector<uint8_t>>(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+        sim::schedule_after(0, [base, id, payload]()
+        {
+            std::vector<handler_entry> targets;
+            {
+                std::lock_guard<std::mutex> lock(events_mutex);
+                for(auto& entry : handlers)
+                {
+                    if(same_base(entry->base, base) && (entry->id == ESP_EVENT_ANY_ID || entry->id == id))
+                    {
+                        targets.push_back(*entry);
+                    }
+                }
+            }
+            for(auto& target : targets)
+            {
+                target.handler(target.arg, base, id, payload->empty() ? nullptr : payload->data());
+            }
+        });
+    }
+
+    enum class wifi_state
+    {
+        uninitialized,
+        stopped,
+        started,
+        connecting,
+        associated,
+        has_ip
+    };
+
+    struct wifi_driver
+    {
+        std::mutex mutex;
+        sim::wifi::model model;
+        wifi_state state = wifi_state::uninitialized;
+        wifi_config_t config = {};
+        int failures_left = 0;
+        uint64_t generation = 0;
+        uint64_t starts = 0;
+        uint64_t dhcp_leases = 0;
+        uint64_t full_calibrations = 0;
+        // The PHY keeps its calibration in RAM until the next reset.
+        bool phy_calibrated = false;
+        bool dhcp_stopped = false;
+        // The driver's default; it survives esp_wifi_deinit, as the setting does on the chip.
+        wifi_ps_type_t ps = WIFI_PS_MIN_MODEM;
+        esp_netif_ip_info_t ip_info = {};
+        esp_netif_dns_info_t dns[3] = {};
+    };
+
+    wifi_driver& driver()
+    {
+        static wifi_driver instance;
+        return instance;
+    }
+
+    // Blocks the calling task for the given span of virtual time, like the driver work done on it.
+    void spend(int64_t duration_us)
+    {
+        if(duration_us > 0)
+        {
+            sim::kernel::busy_for(duration_us);
+        }
+    }
+
+    // Time the PHY takes to come up, following esp_phy_load_cal_and_init: the data in NVS namespace "phy"
+    // skips calibration after deep sleep and shortens it after power-on. Stores the data of a full calibration.
+    int64_t phy_enable_us()
+    {
+        auto& d = driver();
+        sim::wifi::model model;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.phy_calibrated)
+            {
+                return d.model.phy_no_cal_us;
+            }
+            d.phy_calibrated = true;
+            model = d.model;
+        }
+
+#if CONFIG_ESP_PHY_CALIBRATION_AND_DATA_STORAGE
+        nvs_handle_t handle;
+        if(nvs_open("phy", NVS_READWRITE, &handle) == ESP_OK)
+        {
+            uint8_t cal_data[64];
+            size_t length = sizeof(cal_data);
+            esp_err_t err = nvs_get_blob(handle, "cal_data", cal_data, &length);
+            if(err != ESP_OK)
+            {
+                std::memset(cal_data, 0xa5, sizeof(cal_data));
+                nvs_set_blob(handle, "cal_data", cal_data, sizeof(cal_data));
+            }
+            nvs_close(handle);
+            if(err == ESP_OK)
+            {
+                return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED ? model.phy_partial_cal_us : model.phy_no_cal_us;
+            }
+        }
+#endif
+        std::lock_guard<std::mutex> lock(d.mutex);
+        d.full_calibrations++;
+        return model.phy_full_cal_us;
+    }
+
+    // A station config that pins the BSSID or channel only finds the access point there.
+    bool config_targets_ap(const wifi_config_t& config, const sim::wifi::model& model)
+    {
+        return (!config.sta.bssid_set || std::memcmp(config.sta.bssid, model.bssid, sizeof(model.bssid)) == 0)
+            && (config.sta.channel == 0 || config.sta.channel == model.channel);
+    }
+
+    bool config_skips_scan(const wifi_config_t& config)
+    {
+        return config.sta.bssid_set && config.sta.channel != 0;
+    }
+
+    void fill_ssid(uint8_t *ssid, uint8_t *ssid_len, const wifi_config_t& config)
+    {
+        size_t len = strnlen(reinterpret_cast<const char*>(config.sta.ssid), sizeof(config.sta.ssid));
+        std::memcpy(ssid, config.sta.ssid, len);
+        *ssid_len = static_cast<uint8_t>(len);
+    }
+
+    void post_disconnected(const wifi_config_t& config, const uint8_t *bssid, uint8_t reason)
+    {
+        wifi_event_sta_disconnected_t event = {};
+        fill_ssid(event.ssid, &event.ssid_len, config);
+        std::memcpy(event.bssid, bssid, sizeof(event.bssid));
+        event.reason = reason;
+        event.rssi = -55;
+        post_event(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event));
+    }
+
+    void post_got_ip()
+    {
+        ip_event_got_ip_t event = {};
+        {
+            std::lock_guard<std::mutex> lock(driver().mutex);
+            event.ip_info = driver().ip_info;
+        }
+        event.ip_changed = true;
+        post_event(IP_EVENT, IP_EVENT_STA_GOT_IP, &event, sizeof(event));
+    }
+
+    void finish_dhcp(uint64_t generation)
+    {
+        auto& d = driver();
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.generation != generation || d.state != wifi_state::associated)
+            {
+                return;
+            }
+            d.state = wifi_state::has_ip;
+            d.dhcp_leases++;
+            d.ip_info.ip.addr = 0x0204a8c0;       // 192.168.4.2
+            d.ip_info.netmask.addr = 0x00ffffff;  // 255.255.255.0
+            d.ip_info.gw.addr = 0x0104a8c0;       // 192.168.4.1
+            d.dns[ESP_NETIF_DNS_MAIN].ip.u_addr.ip4.addr = 0x0104a8c0;
+            d.dns[ESP_NETIF_DNS_MAIN].ip.type = ESP_IPADDR_TYPE_V4;
+        }
+        post_got_ip();
+    }
+
+    void finish_association(uint64_t generation)
+    {
+        auto& d = driver();
+        wifi_config_t config;
+        sim::wifi::model model;
+        bool failed;
+        bool dhcp;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.generation != generation || d.state != wifi_state::connecting)
+            {
+                return;
+            }
+            config = d.config;
+            model = d.model;
+            failed = !config_targets_ap(config, model);
+            if(!failed && d.failures_left > 0)
+            {
+                d.failures_left--;
+                failed = true;
+            }
+            if(failed)
+            {
+                d.state = wifi_state::started;
+            }
+            else
+            {
+                d.state = wifi_state::associated;
+            }
+            dhcp = !d.dhcp_stopped;
+        }
+
+        if(failed)
+        {
+            post_disconnected(config, config.sta.bssid_set ? config.sta.bssid : model.bssid, 201);  // WIFI_REASON_NO_AP_FOUND
+            return;
+        }
+
+        wifi_event_sta_connected_t event = {};
+        fill_ssid(event.ssid, &event.ssid_len, config);
+        std::memcpy(event.bssid, model.bssid, sizeof(model.bssid));
+        event.channel = model.channel;
+        event.authmode = config.sta.threshold.authmode;
+        post_event(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &event, sizeof(event));
+        if(dhcp)
+        {
+            sim::schedule_after(model.dhcp_us, [generation]() { finish_dhcp(generation); });
+        }
+    }
+}
+
+namespace sim::kernel
+{
+    bool wifi_blocks_light_sleep()
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.ps == WIFI_PS_NONE && d.state != wifi_state::uninitialized && d.state != wifi_state::stopped;
+    }
+
+    int64_t wifi_beacon_listen_us(int64_t idle_us)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.ps == WIFI_PS_NONE || (d.state != wifi_state::associated && d.state != wifi_state::has_ip) || d.model.beacon_interval_us <= 0)
+        {
+            return 0;
+        }
+        return idle_us / d.model.beacon_interval_us * d.model.beacon_listen_us;
+    }
+}
+
+namespace sim::wifi
+{
+    void configure(const model& wifi_model)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        d.model = wifi_model;
+        d.failures_left = wifi_model.failed_attempts;
+    }
+
+    bool has_ip()
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.state == wifi_state::has_ip;
+    }
+
+    uint64_t start_count()
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.starts;
+    }
+
+    uint64_t dhcp_count()
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.dhcp_leases;
+    }
+
+    uint64_t full_calibrations()
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.full_calibrations;
+    }
+}
+
+extern "C"
+{
+    esp_err_t esp_event_loop_create_default(void)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        if(default_loop_created)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        default_loop_created = true;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler,
+                                                  void *event_handler_arg, esp_event_handler_instance_t *instance)
+    {
+        if(event_handler == nullptr)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        std::lock_guard<std::mutex> lock(events_mutex);
+        auto entry = std::make_unique<handler_entry>(handler_entry{event_base, event_id, event_handler, event_handler_arg});
+        if(instance != nullptr)
+        {
+            *instance = entry.get();
+        }
+        handlers.push_back(std::move(entry));
+        return ESP_OK;
+    }
+
+    esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id, esp_event_handler_instance_t instance)
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        for(auto it = handlers.begin(); it != handlers.end(); ++it)
+        {
+            if(it->get() == instance)
+            {
+                handlers.erase(it);
+                return ESP_OK;
+            }
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data, size_t event_data_size, uint32_t ticks_to_wait)
+    {
+        post_event(event_base, event_id, event_data, event_data_size);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_netif_init(void)
+    {
+        return ESP_OK;
+    }
+
+    esp_netif_t *esp_netif_create_default_wifi_sta(void)
+    {
+        static int sta_netif;
+        return reinterpret_cast<esp_netif_t*>(&sta_netif);
+    }
+
+    esp_err_t esp_netif_dhcpc_start(esp_netif_t *esp_netif)
+    {
+        auto& d = driver();
+        uint64_t generation;
+        int64_t dhcp_us;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(!d.dhcp_stopped)
+            {
+                return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+            }
+            d.dhcp_stopped = false;
+            if(d.state != wifi_state::associated)
+            {
+                return ESP_OK;
+            }
+            generation = d.generation;
+            dhcp_us = d.model.dhcp_us;
+        }
+        sim::schedule_after(dhcp_us, [generation]() { finish_dhcp(generation); });
+        return ESP_OK;
+    }
+
+    esp_err_t esp_netif_dhcpc_stop(esp_netif_t *esp_netif)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.dhcp_stopped)
+        {
+            return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED;
+        }
+        d.dhcp_stopped = true;
+        return ESP_OK;
+    }
+
+    // Like esp_netif, a static address on an associated interface raises IP_EVENT_STA_GOT_IP.
+    esp_err_t esp_netif_set_ip_info(esp_netif_t *esp_netif, const esp_netif_ip_info_t *ip_info)
+    {
+        auto& d = driver();
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(!d.dhcp_stopped)
+            {
+                return ESP_ERR_INVALID_STATE;
+            }
+            d.ip_info = *ip_info;
+            if(d.state != wifi_state::associated || ip_info->ip.addr == 0)
+            {
+                return ESP_OK;
+            }
+            d.state = wifi_state::has_ip;
+        }
+        post_got_ip();
+        return ESP_OK;
+    }
+
+    esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        *ip_info = d.ip_info;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_netif_set_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(type < ESP_NETIF_DNS_MAIN || type > ESP_NETIF_DNS_FALLBACK)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        d.dns[type] = *dns;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_netif_get_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(type < ESP_NETIF_DNS_MAIN || type > ESP_NETIF_DNS_FALLBACK)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        *dns = d.dns[type];
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+    {
+        auto& d = driver();
+        int64_t init_us;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.state != wifi_state::uninitialized)
+            {
+                return ESP_OK;
+            }
+            d.state = wifi_state::stopped;
+            init_us = d.model.init_us;
+        }
+        spend(init_us);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_deinit(void)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.state != wifi_state::stopped)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        d.state = wifi_state::uninitialized;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        return d.state == wifi_state::uninitialized ? ESP_ERR_WIFI_NOT_INIT : ESP_OK;
+    }
+
+    esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.state == wifi_state::uninitialized)
+        {
+            return ESP_ERR_WIFI_NOT_INIT;
+        }
+        d.config = *conf;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_start(void)
+    {
+        auto& d = driver();
+        uint64_t generation;
+        int64_t start_us;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.state == wifi_state::uninitialized)
+            {
+                return ESP_ERR_WIFI_NOT_INIT;
+            }
+            if(d.state != wifi_state::stopped)
+            {
+                return ESP_OK;
+            }
+            d.state = wifi_state::started;
+            generation = ++d.generation;
+            start_us = d.model.start_us;
+            d.starts++;
+        }
+
+        spend(phy_enable_us());
+        sim::schedule_after(start_us, [generation]()
+        {
+            {
+                std::lock_guard<std::mutex> lock(driver().mutex);
+                if(driver().generation != generation)
+                {
+                    return;
+                }
+            }
+            post_event(WIFI_EVENT, WIFI_EVENT_STA_START, nullptr, 0);
+        });
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_stop(void)
+    {
+        auto& d = driver();
+        wifi_config_t config;
+        sim::wifi::model model;
+        bool was_associated;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.state == wifi_state::uninitialized)
+            {
+                return ESP_ERR_WIFI_NOT_INIT;
+            }
+            was_associated = d.state == wifi_state::associated || d.state == wifi_state::has_ip;
+            d.state = wifi_state::stopped;
+            d.generation++;
+            config = d.config;
+            model = d.model;
+        }
+
+        if(was_associated)
+        {
+            post_disconnected(config, model.bssid, 8);  // WIFI_REASON_ASSOC_LEAVE
+        }
+        post_event(WIFI_EVENT, WIFI_EVENT_STA_STOP, nullptr, 0);
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_connect(void)
+    {
+        auto& d = driver();
+        uint64_t generation;
+        int64_t assoc_us;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.state == wifi_state::uninitialized)
+            {
+                return ESP_ERR_WIFI_NOT_INIT;
+            }
+            if(d.state == wifi_state::stopped)
+            {
+                return ESP_ERR_WIFI_NOT_STARTED;
+            }
+            if(d.state != wifi_state::started)
+            {
+                return ESP_OK;
+            }
+            d.state = wifi_state::connecting;
+            generation = d.generation;
+            assoc_us = config_skips_scan(d.config) ? d.model.direct_assoc_us : d.model.assoc_us;
+        }
+
+        sim::schedule_after(assoc_us, [generation]() { finish_association(generation); });
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_disconnect(void)
+    {
+        auto& d = driver();
+        wifi_config_t config;
+        sim::wifi::model model;
+        {
+            std::lock_guard<std::mutex> lock(d.mutex);
+            if(d.state != wifi_state::associated && d.state != wifi_state::has_ip && d.state != wifi_state::connecting)
+            {
+                return ESP_OK;
+            }
+            d.state = wifi_state::started;
+            d.generation++;
+            config = d.config;
+            model = d.model;
+        }
+
+        post_disconnected(config, model.bssid, 8);  // WIFI_REASON_ASSOC_LEAVE
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_set_ps(wifi_ps_type_t type)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.state == wifi_state::uninitialized)
+        {
+            return ESP_ERR_WIFI_NOT_INIT;
+        }
+        d.ps = type;
+        return ESP_OK;
+    }
+
+    esp_err_t esp_wifi_get_ps(wifi_ps_type_t *type)
+    {
+        auto& d = driver();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        if(d.state == wifi_state::uninitialized)
+        {
+            return ESP_ERR_WIFI_NOT_INIT;
+        }
+        *type = d.ps;
+        return ESP_OK;
+    }
+}
@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "sdkconfig.h"
+#include "energy_account.hpp"
+
+/*
+   Battery life of the firmware for a rate of ring and door events, from the same current figures and the same
+   charge arithmetic as energy_account.hpp.
+
+   The Kconfig values are those of include/sdkconfig.h unless an sdkconfig file (the one idf.py or PlatformIO
+   writes next to the project) or NAME=VALUE arguments say otherwise, e.g.
+     intercom_battery --sdkconfig ../sdkconfig.az-delivery-devkit-v4 --events-per-day 12 CONFIG_INTERCOM_DEEP_SLEEP_DELAY=10
+   The awake times per wake default to typical figures of an ESP32 on a known access point; the "Wake N" lines
+   the firmware logs before deep sleep give the ones of a real installation.
+
+   Events are taken to arrive at random (Poisson). An event within the deep sleep delay of the previous one
+   finds the chip awake and only extends the wake, so a wake costs one boot, one association and one handshake
+   per notification sink however many events it takes in.
+*/
+
+namespace
+{
+    struct kconfig_value
+    {
+        const char* name;
+        long long value;
+    };
+
+#ifdef CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED
+#define BATTERY_TIMER_WAKE 1
+#else
+#define BATTERY_TIMER_WAKE 0
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+#define BATTERY_MQTT_TLS CONFIG_INTERCOM_MQTT_TLS
+#else
+#define BATTERY_MQTT_TLS 0
+#endif
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+#define BATTERY_LIGHT_SLEEP 1
+#define BATTERY_LIGHT_SLEEP_UA CONFIG_INTERCOM_ENERGY_LIGHT_SLEEP_UA
+#else
+#define BATTERY_LIGHT_SLEEP 0
+// The Kconfig default, for CONFIG_INTERCOM_LIGHT_SLEEP=y given as an argument.
+#define BATTERY_LIGHT_SLEEP_UA 1500
+#endif
+
+    // Every Kconfig symbol the model reads, with the value this build has.
+    kconfig_value kconfig[] =
+    {
+        {"CONFIG_INTERCOM_ENERGY_SLEEP_UA", CONFIG_INTERCOM_ENERGY_SLEEP_UA},
+        {"CONFIG_INTERCOM_ENERGY_CPU_MA", CONFIG_INTERCOM_ENERGY_CPU_MA},
+        {"CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA", CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA},
+        {"CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA", CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA},
+        {"CONFIG_INTERCOM_ENERGY_TLS_MA", CONFIG_INTERCOM_ENERGY_TLS_MA},
+        {"CONFIG_INTERCOM_ENERGY_LIGHT_SLEEP_UA", BATTERY_LIGHT_SLEEP_UA},
+        {"CONFIG_INTERCOM_LIGHT_SLEEP", BATTERY_LIGHT_SLEEP},
+        {"CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH", CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH},
+        {"CONFIG_INTERCOM_ENERGY_BATTERY_MAH", CONFIG_INTERCOM_ENERGY_BATTERY_MAH},
+        {"CONFIG_INTERCOM_DEEP_SLEEP_DELAY", CONFIG_INTERCOM_DEEP_SLEEP_DELAY},
+        {"CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT", CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT},
+        {"CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED", BATTERY_TIMER_WAKE},
+        {"CONFIG_INTERCOM_DEEP_SLEEP_DURATION", CONFIG_INTERCOM_DEEP_SLEEP_DURATION},
+        {"CONFIG_INTERCOM_TLS_SESSION_RESUMPTION", CONFIG_INTERCOM_TLS_SESSION_RESUMPTION},
+        {"CONFIG_INTERCOM_TELEGRAM_ENABLED", CONFIG_INTERCOM_TELEGRAM_ENABLED},
+        {"CONFIG_INTERCOM_MQTT_ENABLED", CONFIG_INTERCOM_MQTT_ENABLED},
+        {"CONFIG_INTERCOM_MQTT_TLS", BATTERY_MQTT_TLS},
+    };
+
+    long long& config(const char* name)
+    {
+        for(kconfig_value& entry : kconfig)
+        {
+            if(strcmp(entry.name, name) == 0)
+            {
+                return entry.value;
+            }
+        }
+        fprintf(stderr, "%s is not a symbol the model reads\n", name);
+        exit(1);
+    }
+
+    // Takes NAME=VALUE as sdkconfig writes it: y for a set bool, numbers as they are. Other symbols are ignored.
+    bool set_config(const std::string& line, bool strict)
+    {
+        size_t equals = line.find('=');
+        if(line.rfind("CONFIG_", 0) != 0 || equals == std::string::npos)
+        {
+            return false;
+        }
+        std::string name = line.substr(0, equals);
+        std::string value = line.substr(equals + 1);
+        for(kconfig_value& entry : kconfig)
+        {
+            if(name == entry.name)
+            {
+                entry.value = value == "y" ? 1 : value == "n" ? 0 : atoll(value.c_str());
+                return true;
+            }
+        }
+        if(strict)
+        {
+            fprintf(stderr, "%s is not a symbol the model reads\n", name.c_str());
+            exit(1);
+        }
+        return true;
+    }
+
+    bool read_sdkconfig(const char* path)
+    {
+        FILE *file = fopen(path, "r");
+        if(file == nullptr)
+        {
+            perror(path);
+            return false;
+        }
+        char text[512];
+        while(fgets(text, sizeof(text), file) != nullptr)
+        {
+            std::string line = text;
+            line.erase(line.find_last_not_of("\r\n") + 1);
+            // A bool that is off: "# CONFIG_X is not set".
+            char name[256];
+            if(sscanf(line.c_str(), "# %255s is not set", name) == 1)
+            {
+                set_config(std::string(name) + "=n", false);
+            }
+            else
+            {
+                set_config(line, false);
+            }
+        }
+        fclose(file);
+        return true;
+    }
+
+    // Awake time of one wake that is not spent holding for more events, in milliseconds.
+    struct wake_times
+    {
+        // Radio off: boot from deep sleep, setup, the flash writes before sleep.
+        double cpu_ms = 200;
+        // Wi-Fi start to association, with RF calibration data and the access point in NVS.
+        double scan_ms = 300;
+        // Per connection; 0 takes 150 ms with session resumption and 1200 ms without.
+        double tls_ms = 0;
+        // With light sleep, the share of the hold awake for beacons and keep-alive traffic: a 2 ms listen every 102.4 ms.
+        double listen_percent = 2;
+    };
+
+    struct day_model
+    {
+        double event_wakes;
+        double timer_wakes;
+        double state_s[static_cast<size_t>(energy_state::count)];
+        double charge_uc[static_cast<size_t>(energy_state::count)];
+        double total_uc;
+    };
+
+    double& at(double (&values)[static_cast<size_t>(energy_state::count)], energy_state state)
+    {
+        return values[static_cast<size_t>(state)];
+    }
+
+    int handshakes_per_wake()
+    {
+        return (config("CONFIG_INTERCOM_TELEGRAM_ENABLED") ? 1 : 0)
+            + (config("CONFIG_INTERCOM_MQTT_ENABLED") && config("CONFIG_INTERCOM_MQTT_TLS") ? 1 : 0);
+    }
+
+    double tls_ms(const wake_times& times)
+    {
+        if(times.tls_ms > 0)
+        {
+            return times.tls_ms;
+        }
+        return config("CONFIG_INTERCOM_TLS_SESSION_RESUMPTION") ? 150 : 1200;
+    }
+
+    energy_currents currents()
+    {
+        return
+        {
+            static_cast<uint32_t>(config("CONFIG_INTERCOM_ENERGY_SLEEP_UA")), static_cast<uint32_t>(config("CONFIG_INTERCOM_ENERGY_CPU_MA")),
+            static_cast<uint32_t>(config("CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA")), static_cast<uint32_t>(config("CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA")),
+            static_cast<uint32_t>(config("CONFIG_INTERCOM_ENERGY_TLS_MA")),
+            static_cast<uint32_t>(config("CONFIG_INTERCOM_LIGHT_SLEEP") ? config("CONFIG_INTERCOM_ENERGY_LIGHT_SLEEP_UA") : 0)
+        };
+    }
+
+    day_model model_day(double events_per_day, const wake_times& times)
+    {
+        const double day_s = ENERGY_DAY_US / 1e6;
+        double hold_s = static_cast<double>(config("CONFIG_INTERCOM_DEEP_SLEEP_DELAY"));
+        day_model day = {};
+
+        // An event starts a wake when none came in the hold before it. Each event keeps the chip awake for the
+        // hold or until the next event, whichever is sooner: on average (1 - e^(-rate hold)) / rate.
+        double rate = events_per_day / day_s;
+        day.event_wakes = events_per_day * std::exp(-rate * hold_s);
+        double held_s = rate > 0 ? day_s * (1 - std::exp(-rate * hold_s)) : 0;
+        double tls_s = day.event_wakes * handshakes_per_wake() * tls_ms(times) / 1000;
+
+        // A timer wake samples the lines with the radio off and goes back to sleep after the short delay.
+        if(config("CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED") && config("CONFIG_INTERCOM_DEEP_SLEEP_DURATION") > 0)
+        {
+            day.timer_wakes = day_s / config("CONFIG_INTERCOM_DEEP_SLEEP_DURATION");
+        }
+
+        double short_hold_s = day.timer_wakes * config("CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT");
+        double idle_s = std::max(held_s - tls_s, 0.0);
+        at(day.state_s, energy_state::cpu_active) = (day.event_wakes + day.timer_wakes) * times.cpu_ms / 1000;
+        at(day.state_s, energy_state::wifi_scan) = day.event_wakes * times.scan_ms / 1000;
+        at(day.state_s, energy_state::tls) = tls_s;
+        if(config("CONFIG_INTERCOM_LIGHT_SLEEP"))
+        {
+            // The holds sleep but for the beacons; the short hold of a timer wake has the radio off and none.
+            double listen_s = idle_s * times.listen_percent / 100;
+            at(day.state_s, energy_state::wifi_idle) = listen_s;
+            at(day.state_s, energy_state::light_sleep) = idle_s - listen_s + short_hold_s;
+        }
+        else
+        {
+            at(day.state_s, energy_state::cpu_active) += short_hold_s;
+            at(day.state_s, energy_state::wifi_idle) = idle_s;
+        }
+        double awake_s = 0;
+        for(uint8_t s = static_cast<uint8_t>(energy_state::cpu_active); s < static_cast<uint8_t>(energy_state::count); s++)
+        {
+            awake_s += day.state_s[s];
+        }
+        at(day.state_s, energy_state::deep_sleep) = std::max(day_s - awake_s, 0.0);
+
+        energy_currents figures = currents();
+        for(uint8_t s = 0; s < static_cast<uint8_t>(energy_state::count); s++)
+        {
+            day.charge_uc[s] = static_cast<double>(energy_charge_uc(static_cast<energy_state>(s), static_cast<uint64_t>(std::llround(day.state_s[s] * 1e6)), figures));
+            day.total_uc += day.charge_uc[s];
+        }
+        return day;
+    }
+
+    double battery_days(const day_model& day)
+    {
+        return day.total_uc > 0 ? config("CONFIG_INTERCOM_ENERGY_BATTERY_MAH") * static_cast<double>(ENERGY_MAH_UC) / day.total_uc : INFINITY;
+    }
+
+    double budget_percent(const day_model& day)
+    {
+        return day.total_uc / (config("CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH") * 3600.0) * 100;
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options] [CONFIG_NAME=VALUE ...]\n"
+            "  --events-per-day N   ring and door events a day to detail (default 5)\n"
+            "  --sdkconfig PATH     take the Kconfig values from an sdkconfig file\n"
+            "  --cpu-ms N           awake with the radio off per wake (default 200)\n"
+            "  --scan-ms N          Wi-Fi start to association per wake (default 300)\n"
+            "  --tls-ms N           TLS handshake per connection (default 150 with session resumption, else 1200)\n"
+            "  --listen-percent N   with light sleep, share of the hold awake for beacons (default 2)\n"
+            "Kconfig values given as arguments win over the sdkconfig file.\n", self);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double events_per_day = 5;
+    wake_times times;
+    std::vector<std::string> overrides;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> double
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return atof(argv[++i]);
+        };
+
+        if(arg == "--events-per-day") events_per_day = next();
+        else if(arg == "--cpu-ms") times.cpu_ms = next();
+        else if(arg == "--scan-ms") times.scan_ms = next();
+        else if(arg == "--tls-ms") times.tls_ms = next();
+        else if(arg == "--listen-percent") times.listen_percent = next();
+        else if(arg == "--sdkconfig")
+        {
+            if(i + 1 >= argc || !read_sdkconfig(argv[++i]))
+            {
+                return 1;
+            }
+        }
+        else if(arg.rfind("CONFIG_", 0) == 0) overrides.push_back(arg);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for(const std::string& line : overrides)
+    {
+        if(!set_config(line, true))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("currents: sleep %lld uA, cpu %lld mA, scan %lld mA, idle %lld mA, tls %lld mA, light %lld uA; hold %lld s after an event%s, "
+           "%d handshake(s) of %.0f ms per wake\n",
+           config("CONFIG_INTERCOM_ENERGY_SLEEP_UA"), config("CONFIG_INTERCOM_ENERGY_CPU_MA"), config("CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA"),
+           config("CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA"), config("CONFIG_INTERCOM_ENERGY_TLS_MA"), static_cast<long long>(currents().light_sleep_ua),
+           config("CONFIG_INTERCOM_DEEP_SLEEP_DELAY"), config("CONFIG_INTERCOM_LIGHT_SLEEP") ? " in light sleep" : "", handshakes_per_wake(), tls_ms(times));
+
+    printf("\n%12s %10s %12s %10s %12s\n", "events/day", "wakes", "mAh/day", "budget_%", "battery_days");
+    const double rates[] = {0, 1, 2, 5, 10, 20, 50, 100, 200};
+    for(double rate : rates)
+    {
+        day_model day = model_day(rate, times);
+        printf("%12.0f %10.1f %12.3f %10.0f %12.0f\n", rate, day.event_wakes + day.timer_wakes, day.total_uc / ENERGY_MAH_UC,
+               budget_percent(day), battery_days(day));
+    }
+
+    day_model day = model_day(events_per_day, times);
+    printf("\nat %.1f event(s) a day: %.1f event wake(s) and %.1f timer wake(s)\n", events_per_day, day.event_wakes, day.timer_wakes);
+    printf("  %-8s %12s %12s %8s\n", "state", "s/day", "mAh/day", "share");
+    for(uint8_t s = 0; s < static_cast<uint8_t>(energy_state::count); s++)
+    {
+        printf("  %-8s %12.1f %12.3f %7.1f%%\n", energy_state_name(static_cast<energy_state>(s)), day.state_s[s],
+               day.charge_uc[s] / ENERGY_MAH_UC, day.total_uc > 0 ? day.charge_uc[s] / day.total_uc * 100 : 0);
+    }
+    printf("  %.3f mAh a day, %.0f%% of the %.3f mAh budget; a %lld mAh battery lasts %.0f day(s)\n", day.total_uc / ENERGY_MAH_UC,
+           budget_percent(day), config("CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH") / 1000.0, config("CONFIG_INTERCOM_ENERGY_BATTERY_MAH"),
+           battery_days(day));
+    // 2 for a configuration over budget, so a script can try settings.
+    return budget_percent(day) <= 100 ? 0 : 2;
+}
@@ -0,0 +1,239 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "event_log.hpp"
+#include "sensor_channels.hpp"
+
+/*
+   Reader for a dump of the "events" partition, see event_log.hpp for the layout.
+
+   Read one off the device with
+     esptool.py read_flash 0x1d0000 0x20000 events.bin
+   (offset and size as in partitions.csv), or have intercom_bench --events-dump write one. Lists the
+   segments and the events in a time range, oldest first, and checks the CRC in the footer of every
+   sealed segment.
+*/
+
+namespace
+{
+    struct dump_file
+    {
+        std::vector<uint8_t> bytes;
+    };
+
+    event_log_storage dump_storage(dump_file& dump)
+    {
+        event_log_storage storage = {};
+        storage.context = &dump;
+        storage.size = dump.bytes.size();
+        storage.read = [](void* context, size_t offset, void* data, size_t length)
+        {
+            const dump_file& file = *static_cast<const dump_file*>(context);
+            if(offset + length > file.bytes.size())
+            {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(data, file.bytes.data() + offset, length);
+            return ESP_OK;
+        };
+        // The dump is read only.
+        storage.write = [](void*, size_t, const void*, size_t)
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        };
+        storage.erase = [](void*, size_t, size_t)
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        };
+        return storage;
+    }
+
+    const char* segment_state_name(event_segment_state state)
+    {
+        switch(state)
+        {
+            case event_segment_state::erased:
+                return "erased";
+            case event_segment_state::open:
+                return "open";
+            case event_segment_state::sealed:
+                return "sealed";
+            default:
+                return "corrupt";
+        }
+    }
+
+    // The notification_kind in flags of delivery records: a channel index, 0xff for the boot or 0xfe for a backlog of
+    // events delivered late, see notification_dispatcher.hpp.
+    const char* notification_name(uint8_t kind)
+    {
+        return kind == 0xff ? "boot" : kind == 0xfe ? "backlog" : sensor_channel_name(kind);
+    }
+
+    // Name an event is listed and filtered by: the channel for sensor records, the kind otherwise.
+    const char* event_name(const event_record& record)
+    {
+        return record.kind == event_kind::sensor ? sensor_channel_name(EVENT_FLAGS_CHANNEL(record.flags)) : event_kind_name(record.kind);
+    }
+
+    std::string describe(const event_record& record)
+    {
+        char text[96];
+        switch(record.kind)
+        {
+            case event_kind::power_on:
+                snprintf(text, sizeof(text), "wake cause %lu", static_cast<unsigned long>(record.value));
+                break;
+            case event_kind::sensor:
+                snprintf(text, sizeof(text), "at %lu ms after reset%s%s", static_cast<unsigned long>(record.value),
+                         record.flags & EVENT_FLAG_COOLDOWN ? ", within the cooldown" : "", record.flags & EVENT_FLAG_MUTED ? ", muted" : "");
+                break;
+            case event_kind::notification_delivered:
+                snprintf(text, sizeof(text), "%s, %lu ms after the event", notification_name(record.flags), static_cast<unsigned long>(record.value));
+                break;
+            case event_kind::notification_failed:
+                snprintf(text, sizeof(text), "%s, status %ld", notification_name(record.flags), static_cast<long>(static_cast<int32_t>(record.value)));
+                break;
+            case event_kind::error:
+                snprintf(text, sizeof(text), "%s %lu", event_error_name(static_cast<event_error>(record.flags)), static_cast<unsigned long>(record.value));
+                break;
+            default:
+                snprintf(text, sizeof(text), "flags 0x%02x value %lu", record.flags, static_cast<unsigned long>(record.value));
+                break;
+        }
+        return text;
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options] dump\n"
+            "  --from S        first second of the range (default 0)\n"
+            "  --to S          last second of the range (default all)\n"
+            "  --kind NAME     only events of this kind: power_on, sensor, delivered, failed, error,\n"
+            "                  or the name of a sensor channel, e.g. ring\n"
+            "  --segments      list the segments too\n"
+            "  --quiet         only the summary\n", self);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string path;
+    uint32_t from_s = 0;
+    uint32_t to_s = UINT32_MAX;
+    std::string kind;
+    bool list_segments = false;
+    bool quiet = false;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char*
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if(arg == "--from") from_s = static_cast<uint32_t>(strtoul(next(), nullptr, 0));
+        else if(arg == "--to") to_s = static_cast<uint32_t>(strtoul(next(), nullptr, 0));
+        else if(arg == "--kind") kind = next();
+        else if(arg == "--segments") list_segments = true;
+        else if(arg == "--quiet") quiet = true;
+        else if(arg.rfind("--", 0) == 0 || !path.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else path = arg;
+    }
+    if(path.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    dump_file dump;
+    FILE *file = fopen(path.c_str(), "rb");
+    if(file == nullptr)
+    {
+        perror(path.c_str());
+        return 1;
+    }
+    uint8_t chunk[4096];
+    size_t received;
+    while((received = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        dump.bytes.insert(dump.bytes.end(), chunk, chunk + received);
+    }
+    fclose(file);
+
+    event_log_store store;
+    store.attach(dump_storage(dump));
+    if(store.scan() != ESP_OK)
+    {
+        fprintf(stderr, "%s: %zu bytes is too small for an event log\n", path.c_str(), dump.bytes.size());
+        return 1;
+    }
+
+    size_t used = 0;
+    size_t sealed = 0;
+    size_t crc_errors = 0;
+    size_t corrupt = 0;
+    for(size_t index = 0; index < store.segments(); index++)
+    {
+        const event_segment_info& info = store.segment(index);
+        const char* check = "";
+        if(info.state == event_segment_state::sealed)
+        {
+            sealed++;
+            bool intact = store.verify(index) == ESP_OK;
+            crc_errors += intact ? 0 : 1;
+            check = intact ? "  crc ok" : "  CRC MISMATCH";
+        }
+        corrupt += info.state == event_segment_state::corrupt ? 1 : 0;
+        used += info.state == event_segment_state::open || info.state == event_segment_state::sealed ? 1 : 0;
+        if(list_segments && info.state != event_segment_state::erased)
+        {
+            printf("segment %2zu  %-7s  sequence %6lu  %3u event(s)  %10lu..%-10lu%s\n", index, segment_state_name(info.state),
+                   static_cast<unsigned long>(info.sequence), info.count, static_cast<unsigned long>(info.min_time_s),
+                   static_cast<unsigned long>(info.max_time_s), check);
+        }
+    }
+    if(list_segments)
+    {
+        printf("\n");
+    }
+
+    size_t counts[8] = {};
+    size_t shown = 0;
+    size_t segments_read = 0;
+    store.query(from_s, to_s, [&](const event_record& record)
+    {
+        if(!kind.empty() && kind != event_kind_name(record.kind) && kind != event_name(record))
+        {
+            return true;
+        }
+        shown++;
+        counts[static_cast<uint8_t>(record.kind) & 7]++;
+        if(!quiet)
+        {
+            printf("%10lu.%03u  wake %5u  %-9s  %s\n", static_cast<unsigned long>(record.time_s), record.time_ms, record.wake,
+                   event_name(record), describe(record).c_str());
+        }
+        return true;
+    }, &segments_read);
+
+    printf("%s%zu event(s) from %zu of %zu segment(s) in use:", quiet ? "" : "\n", shown, segments_read, used);
+    for(uint8_t k = static_cast<uint8_t>(event_kind::power_on); k <= static_cast<uint8_t>(event_kind::error); k++)
+    {
+        printf(" %zu %s", counts[k], event_kind_name(static_cast<event_kind>(k)));
+    }
+    printf("\n%zu sealed segment(s), %zu CRC mismatch(es), %zu corrupt header(s)\n", sealed, crc_errors, corrupt);
+    return crc_errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "trace_corpus.hpp"
+
+/*
+   Offline replay of sensor edge traces through the firmware's burst classifier.
+
+   Every trace, see trace_corpus.hpp for the format, is replayed through a fresh burst_tracker and the
+   first label it produces is scored against the header. --synthetic adds generated traces with timing
+   jitter around the recorded shapes.
+*/
+
+namespace
+{
+    using namespace trace_corpus;
+
+    int label_index(burst_label label)
+    {
+        switch(label)
+        {
+            case burst_label::ring:
+                return 1;
+            case burst_label::door:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options] [trace...]\n"
+            "  Replays the given traces, or every *.trace in %s when none are given.\n"
+            "  --synthetic N   also score N generated traces of each kind\n"
+            "  --seed N        seed of the generator (default 1)\n"
+            "  --jitter P      timing jitter of generated signals in percent (default 10)\n"
+            "  --verbose       print every trace with its features\n", self, INTERCOM_TRACE_DIR);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> paths;
+    int synthetic = 0;
+    unsigned seed = 1;
+    double jitter = 0.10;
+    bool verbose = false;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char*
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if(arg == "--synthetic") synthetic = atoi(next());
+        else if(arg == "--seed") seed = static_cast<unsigned>(atoi(next()));
+        else if(arg == "--jitter") jitter = atof(next()) / 100.0;
+        else if(arg == "--verbose") verbose = true;
+        else if(arg.rfind("--", 0) == 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else paths.push_back(arg);
+    }
+
+    if(paths.empty())
+    {
+        for(auto& entry : std::filesystem::directory_iterator(INTERCOM_TRACE_DIR))
+        {
+            if(entry.path().extension() == ".trace")
+            {
+                paths.push_back(entry.path().string());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+    }
+
+    std::vector<trace> traces;
+    for(const std::string& path : paths)
+    {
+        trace t;
+        if(!load_trace(path, t))
+        {
+            return 1;
+        }
+        traces.push_back(std::move(t));
+    }
+    add_synthetic(traces, synthetic, seed, jitter);
+
+    int confusion[3][3] = {};
+    int correct = 0;
+    for(const trace& t : traces)
+    {
+        burst_features features = {};
+        burst_label predicted = replay(t, features);
+        confusion[label_index(t.expected)][label_index(predicted)]++;
+        correct += predicted == t.expected;
+
+        if(verbose || (predicted != t.expected && t.name.rfind("synthetic", 0) != 0))
+        {
+            printf("%-32s %-6s -> %-6s lead-in %6u us, period %5u us (%u-%u), duty %3u/1000, %3u pulses%s\n",
+                   t.name.c_str(), burst_label_name(t.expected), burst_label_name(predicted),
+                   features.lead_in_us, features.period_avg_us, features.period_min_us, features.period_max_us,
+                   features.duty_permille, features.pulse_count, predicted == t.expected ? "" : "  MISMATCH");
+        }
+    }
+
+    const char *names[3] = {"noise", "ring", "door"};
+    printf("\n%-10s %8s %8s %8s\n", "expected", "noise", "ring", "door");
+    for(int row = 0; row < 3; row++)
+    {
+        printf("%-10s %8d %8d %8d\n", names[row], confusion[row][0], confusion[row][1], confusion[row][2]);
+    }
+
+    int noise_total = confusion[0][0] + confusion[0][1] + confusion[0][2];
+    int signal_total = static_cast<int>(traces.size()) - noise_total;
+    int false_wakes = confusion[0][1] + confusion[0][2];
+    int missed = confusion[1][0] + confusion[2][0];
+    printf("\n%zu traces, %.1f%% correct, %d of %d noise traces would start Wi-Fi, %d of %d rings missed\n",
+           traces.size(), traces.empty() ? 0.0 : 100.0 * correct / traces.size(), false_wakes, noise_total, missed, signal_total);
+
+    return correct == static_cast<int>(traces.size()) ? 0 : 2;
+}
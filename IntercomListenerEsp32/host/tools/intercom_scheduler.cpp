@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "sdkconfig.h"
+#include "energy_account.hpp"
+#include "sleep_scheduler.hpp"
+
+/*
+   Runs sleep_scheduler.hpp over weeks of synthetic ring and door events and compares it with fixed awake windows.
+
+   Events come at random with a daily profile, busy in the morning and the evening and quiet at night, and each
+   is followed by a repeat ring with some probability, 20 to 90 s later, as when a visitor rings again. Every
+   policy sees the same events. A cold wake costs the charge of a boot, a scan and a handshake; an awake window
+   costs the associated idle current; a repeat that finds the chip asleep is notified
+   CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS later.
+
+   PASS needs the scheduler to keep the latency of repeats within the target, or within what the longest window
+   gives where that misses the target too, and to cost no more than the cheapest fixed window whose repeats are
+   as fast. It gets there without knowing the gaps in
+   advance, and the first wakes, before the history counts, take the fixed CONFIG_INTERCOM_DEEP_SLEEP_DELAY. And its timer wakes to beat every fixed interval, whose wakes a day times the mean wait of an event for the next
+   wake is the same whatever the interval. The run is seeded, so the same arguments give the same figures.
+*/
+
+namespace
+{
+    // Relative event rate in each hour of the day.
+    const double hour_profile[SLEEP_SCHEDULER_HOURS] =
+    {
+        0.05, 0.02, 0.02, 0.02, 0.02, 0.05, 0.3, 1.0, 1.5, 1.0, 0.8, 0.8,
+        1.0, 1.0, 0.8, 0.8, 1.0, 1.5, 2.0, 2.0, 1.5, 0.8, 0.3, 0.1,
+    };
+
+    struct options
+    {
+        int days = 28;
+        double events_per_day = 8;
+        double repeat_probability = 0.4;
+        unsigned seed = 1;
+    };
+
+    std::vector<uint32_t> synthetic_events(const options& opts)
+    {
+        double profile_sum = 0;
+        for(double weight : hour_profile)
+        {
+            profile_sum += weight;
+        }
+
+        std::mt19937 random(opts.seed);
+        std::uniform_real_distribution<double> unit(0, 1);
+        std::vector<uint32_t> events;
+        for(int day = 0; day < opts.days; day++)
+        {
+            for(uint32_t hour = 0; hour < SLEEP_SCHEDULER_HOURS; hour++)
+            {
+                std::poisson_distribution<int> count(opts.events_per_day * hour_profile[hour] / profile_sum);
+                for(int n = count(random); n > 0; n--)
+                {
+                    double t = day * static_cast<double>(SLEEP_SCHEDULER_DAY_S) + hour * 3600.0 + unit(random) * 3600;
+                    events.push_back(static_cast<uint32_t>(t));
+                    while(unit(random) < opts.repeat_probability)
+                    {
+                        t += 20 + unit(random) * 70;
+                        events.push_back(static_cast<uint32_t>(t));
+                    }
+                }
+            }
+        }
+        std::sort(events.begin(), events.end());
+        return events;
+    }
+
+    sleep_scheduler_costs default_costs()
+    {
+        // The figures awake_window_after in main.cpp starts from before the first wake has been measured.
+        return
+        {
+            static_cast<uint32_t>(energy_charge_uc(energy_state::wifi_idle, 1000000)),
+            static_cast<uint32_t>(energy_charge_uc(energy_state::cpu_active, 200000) + energy_charge_uc(energy_state::wifi_scan, 300000)
+                + energy_charge_uc(energy_state::tls, 150000)),
+        };
+    }
+
+    struct policy_result
+    {
+        uint64_t wakes = 0;
+        double awake_s = 0;
+        double hold_sum_s = 0;
+        uint64_t events = 0;
+        uint64_t repeats = 0;
+        uint64_t repeats_cold = 0;
+
+        double charge_uc(const sleep_scheduler_costs& costs) const
+        {
+            return wakes * static_cast<double>(costs.wake_uc) + awake_s * costs.idle_uc_per_s;
+        }
+
+        double repeat_latency_ms() const
+        {
+            return repeats > 0 ? static_cast<double>(repeats_cold) / repeats * CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS : 0;
+        }
+    };
+
+    // Plays the events against hold_for(t), the seconds to stay awake after an event at t. Like the sleep timer of
+    // main.cpp, every event restarts the window.
+    template<typename hold_policy>
+    policy_result run_policy(const std::vector<uint32_t>& events, hold_policy&& hold_for)
+    {
+        policy_result result;
+        double awake_until = -1;
+        double last_event = -1;
+        for(uint32_t t : events)
+        {
+            bool cold = t >= awake_until;
+            result.wakes += cold ? 1 : 0;
+            if(!cold)
+            {
+                // The window still running is cut short by the new one.
+                result.awake_s -= awake_until - t;
+            }
+            if(last_event >= 0 && t - last_event < sleep_scheduler_gap_bounds_s[SLEEP_SCHEDULER_GAP_BUCKETS - 2])
+            {
+                result.repeats++;
+                result.repeats_cold += cold ? 1 : 0;
+            }
+            uint32_t hold_s = hold_for(t);
+            result.awake_s += hold_s;
+            result.hold_sum_s += hold_s;
+            result.events++;
+            awake_until = static_cast<double>(t) + hold_s;
+            last_event = t;
+        }
+        return result;
+    }
+
+    void print_result(const char* name, const policy_result& result, const sleep_scheduler_costs& costs, int days)
+    {
+        printf("%-12s %8.1f %8llu %10.2f %10.3f %12.0f %8.1f%%\n", name, result.events ? result.hold_sum_s / result.events : 0,
+               static_cast<unsigned long long>(result.wakes), result.awake_s / 3600, result.charge_uc(costs) / ENERGY_MAH_UC / days,
+               result.repeat_latency_ms(), result.events ? 100.0 * result.wakes / result.events : 0);
+    }
+
+    // Timer wakes a day and the mean wait of an event for the next timer wake, for a schedule of intervals.
+    template<typename interval_policy>
+    void timer_schedule(const std::vector<uint32_t>& events, interval_policy&& interval_at, double& wakes_per_day, double& mean_wait_s)
+    {
+        // The intervals repeat every day, so a day from midnight is enough.
+        std::vector<uint32_t> wakes;
+        for(uint32_t t = 0; t < SLEEP_SCHEDULER_DAY_S; t += std::max<uint32_t>(interval_at(t), 1))
+        {
+            wakes.push_back(t);
+        }
+        wakes_per_day = static_cast<double>(wakes.size());
+        double wait_s = 0;
+        for(uint32_t t : events)
+        {
+            uint32_t time_of_day = t % SLEEP_SCHEDULER_DAY_S;
+            auto next = std::upper_bound(wakes.begin(), wakes.end(), time_of_day);
+            wait_s += next != wakes.end() ? *next - time_of_day : SLEEP_SCHEDULER_DAY_S - time_of_day;
+        }
+        mean_wait_s = events.empty() ? 0 : wait_s / events.size();
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --days N             days to simulate (default 28)\n"
+            "  --events-per-day N   first rings a day (default 8)\n"
+            "  --repeat P           probability of a repeat ring after each ring (default 0.4)\n"
+            "  --seed N             random seed (default 1)\n", self);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> double
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return atof(argv[++i]);
+        };
+
+        if(arg == "--days") opts.days = static_cast<int>(next());
+        else if(arg == "--events-per-day") opts.events_per_day = next();
+        else if(arg == "--repeat") opts.repeat_probability = next();
+        else if(arg == "--seed") opts.seed = static_cast<unsigned>(next());
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(opts.days <= 0 || opts.repeat_probability < 0 || opts.repeat_probability >= 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<uint32_t> events = synthetic_events(opts);
+    sleep_scheduler_costs costs = default_costs();
+    printf("%zu event(s) over %d day(s); a wake costs %.1f mAs, a second awake %.1f mAs; repeats notified %d ms later after a cold wake, target %d ms\n\n",
+           events.size(), opts.days, costs.wake_uc / 1000.0, costs.idle_uc_per_s / 1000.0,
+           CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS, CONFIG_INTERCOM_SLEEP_SCHEDULER_LATENCY_TARGET_MS);
+
+    printf("%-12s %8s %8s %10s %10s %12s %9s\n", "policy", "hold_s", "wakes", "awake_h", "mAh/day", "repeat_ms", "cold");
+    std::vector<uint32_t> fixed_holds = {CONFIG_INTERCOM_SLEEP_SCHEDULER_MIN_HOLD, CONFIG_INTERCOM_DEEP_SLEEP_DELAY, CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD};
+    for(uint32_t bound : sleep_scheduler_gap_bounds_s)
+    {
+        if(bound > CONFIG_INTERCOM_SLEEP_SCHEDULER_MIN_HOLD && bound < CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD)
+        {
+            fixed_holds.push_back(bound);
+        }
+    }
+    std::sort(fixed_holds.begin(), fixed_holds.end());
+    fixed_holds.erase(std::unique(fixed_holds.begin(), fixed_holds.end()), fixed_holds.end());
+
+    std::vector<policy_result> fixed;
+    for(uint32_t hold_s : fixed_holds)
+    {
+        fixed.push_back(run_policy(events, [hold_s](uint32_t) { return hold_s; }));
+        char name[32];
+        snprintf(name, sizeof(name), "fixed %lu%s", static_cast<unsigned long>(hold_s), hold_s == CONFIG_INTERCOM_DEEP_SLEEP_DELAY ? "*" : "");
+        print_result(name, fixed.back(), costs, opts.days);
+    }
+    // The target, or what the longest window, the last, gives if it misses the target too.
+    double allowed_ms = std::max<double>(CONFIG_INTERCOM_SLEEP_SCHEDULER_LATENCY_TARGET_MS, fixed.back().repeat_latency_ms());
+
+    sleep_schedule_state state = {};
+    uint64_t learned = 0;
+    policy_result adaptive = run_policy(events, [&](uint32_t t)
+    {
+        sleep_scheduler_begin(state, t);
+        sleep_scheduler_record(state, t);
+        sleep_hold_choice choice = sleep_scheduler_choose_hold(state, costs, t);
+        learned += choice.learned ? 1 : 0;
+        return choice.hold_s;
+    });
+    print_result("adaptive", adaptive, costs, opts.days);
+    printf("(* the fixed CONFIG_INTERCOM_DEEP_SLEEP_DELAY; the scheduler chose from the history for %llu of %llu event(s); repeats may be %.0f ms late)\n",
+           static_cast<unsigned long long>(learned), static_cast<unsigned long long>(adaptive.events), allowed_ms);
+
+    double fixed_wakes;
+    double fixed_wait_s;
+    double adaptive_wakes;
+    double adaptive_wait_s;
+    timer_schedule(events, [](uint32_t) { return static_cast<uint32_t>(CONFIG_INTERCOM_DEEP_SLEEP_DURATION); }, fixed_wakes, fixed_wait_s);
+    // With what was learned by the end of the run.
+    timer_schedule(events, [&state](uint32_t t) { return sleep_scheduler_timer_interval(state, state.day * SLEEP_SCHEDULER_DAY_S + t); },
+                   adaptive_wakes, adaptive_wait_s);
+    printf("\ntimer wakes: every %d s, %.0f a day, an event waits %.1f s on average; by the hour, %.0f a day, %.1f s\n",
+           CONFIG_INTERCOM_DEEP_SLEEP_DURATION, fixed_wakes, fixed_wait_s, adaptive_wakes, adaptive_wait_s);
+
+    // Longer windows catch more repeats for more charge: the cheapest that catches as many is the shortest of them.
+    double latency_ms = adaptive.repeat_latency_ms();
+    double fixed_uc = fixed.back().charge_uc(costs);
+    for(size_t i = fixed.size(); i-- > 0 && fixed[i].repeat_latency_ms() <= latency_ms;)
+    {
+        fixed_uc = fixed[i].charge_uc(costs);
+    }
+    printf("the cheapest fixed window with repeats as fast costs %.3f mAh a day\n", fixed_uc / ENERGY_MAH_UC / opts.days);
+
+    bool latency_ok = latency_ms <= allowed_ms;
+    bool charge_ok = adaptive.charge_uc(costs) <= fixed_uc;
+    bool timer_ok = adaptive_wakes * adaptive_wait_s < fixed_wakes * fixed_wait_s;
+    printf("\nlatency %s, charge %s, timer %s\n%s\n", latency_ok ? "ok" : "FAIL", charge_ok ? "ok" : "FAIL", timer_ok ? "ok" : "FAIL",
+           latency_ok && charge_ok && timer_ok ? "PASS" : "FAIL");
+    return latency_ok && charge_ok && timer_ok ? 0 : 1;
+}
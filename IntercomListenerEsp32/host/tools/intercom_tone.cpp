@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "trace_corpus.hpp"
+#include "tone_detector.hpp"
+
+/*
+   Offline replay of sampled sensor lines through the firmware's tone detector, and its throughput.
+
+   A sample file holds ADC readings of one line at a fixed rate, after a small header:
+
+       # channel: ring
+       # label: ring
+       # rate_hz: 10000
+       300 297 2903 2895 ...
+
+   Every file is replayed through a fresh tone_block_detector and tone_tracker set up as the firmware sets
+   them up, and the first label is scored against the header like intercom_replay scores edge traces. Edge
+   traces (*.trace) given on the command line and the --synthetic ones are rendered to samples first, the
+   way the simulated ADC sees a line: one level near 2.2 V, the other near 0.25 V, with some noise.
+
+   --bench runs the detector of each line over a long buffer and reports samples per second on this host.
+*/
+
+namespace
+{
+    using namespace trace_corpus;
+
+    const uint32_t line_rate_hz = CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ / sensor_channel_count;
+    const int high_counts = 2900;
+    const int low_counts = 300;
+
+    struct sample_file
+    {
+        std::string name;
+        sensor_channel channel = sensor_channel_ring;
+        burst_label expected = burst_label::noise;
+        uint32_t rate_hz = line_rate_hz;
+        std::vector<uint16_t> samples;
+    };
+
+    bool load_samples(const std::string& path, sample_file& f)
+    {
+        std::ifstream in(path);
+        if(!in)
+        {
+            fprintf(stderr, "%s: cannot open\n", path.c_str());
+            return false;
+        }
+
+        f.name = std::filesystem::path(path).filename().string();
+        std::string line;
+        int line_number = 0;
+        while(std::getline(in, line))
+        {
+            line_number++;
+            if(line.empty())
+            {
+                continue;
+            }
+
+            if(line[0] == '#')
+            {
+                std::istringstream header(line.substr(1));
+                std::string key, value;
+                header >> key >> value;
+                if(key == "channel:")
+                {
+                    f.channel = value == "door" ? sensor_channel_door : sensor_channel_ring;
+                }
+                else if(key == "label:" && !parse_label(value, f.expected))
+                {
+                    fprintf(stderr, "%s:%d: unknown label '%s'\n", path.c_str(), line_number, value.c_str());
+                    return false;
+                }
+                else if(key == "rate_hz:")
+                {
+                    f.rate_hz = static_cast<uint32_t>(atol(value.c_str()));
+                }
+                continue;
+            }
+
+            std::istringstream fields(line);
+            long value;
+            while(fields >> value)
+            {
+                if(value < 0 || value > 4095)
+                {
+                    fprintf(stderr, "%s:%d: sample %ld out of the 12-bit range\n", path.c_str(), line_number, value);
+                    return false;
+                }
+                f.samples.push_back(static_cast<uint16_t>(value));
+            }
+            if(!fields.eof())
+            {
+                fprintf(stderr, "%s:%d: expected samples\n", path.c_str(), line_number);
+                return false;
+            }
+        }
+
+        if(f.rate_hz == 0)
+        {
+            fprintf(stderr, "%s: rate_hz must not be 0\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Samples an edge trace at rate_hz from 5 ms before its first edge to 5 ms after its last one.
+    sample_file render(const trace& t, uint32_t rate_hz, double noise_counts, std::mt19937& rng)
+    {
+        sample_file f;
+        f.name = t.name;
+        f.channel = t.channel;
+        f.expected = t.expected;
+        f.rate_hz = rate_hz;
+        if(t.edges.empty())
+        {
+            return f;
+        }
+
+        std::normal_distribution<double> noise(0.0, noise_counts);
+        std::uniform_real_distribution<double> phase(0.0, 1.0);
+        double period_us = 1e6 / rate_hz;
+        double start_us = t.edges.front().time_us - 5000 + phase(rng) * period_us;
+        double end_us = t.edges.back().time_us + 5000;
+        int level = idle_level;
+        size_t next = 0;
+        for(double time = start_us; time < end_us; time += period_us)
+        {
+            while(next < t.edges.size() && t.edges[next].time_us <= time)
+            {
+                level = t.edges[next++].level;
+            }
+            long value = std::lround((level ? high_counts : low_counts) + noise(rng));
+            f.samples.push_back(static_cast<uint16_t>(std::clamp<long>(value, 0, 4095)));
+        }
+        return f;
+    }
+
+    // Replays the samples and returns the first decisive label. A file that never produced a label counts as noise.
+    burst_label replay(const sample_file& f, tone_features& features)
+    {
+        tone_block_detector detector;
+        detector.setup(f.channel, f.rate_hz, CONFIG_INTERCOM_TONE_BLOCK_SAMPLES);
+        tone_tracker tracker(CONFIG_INTERCOM_TONE_MIN_BLOCKS);
+        const int64_t block_us = CONFIG_INTERCOM_TONE_BLOCK_SAMPLES * 1000000LL / f.rate_hz;
+
+        burst_label result = burst_label::none;
+        uint64_t pushed = 0;
+        auto push = [&](uint16_t sample)
+        {
+            pushed++;
+            if(!detector.push(sample))
+            {
+                return;
+            }
+            burst_label label = tracker.block(detector.result(), static_cast<int64_t>(pushed * 1000000ULL / f.rate_hz), block_us);
+            if(label != burst_label::none && (result == burst_label::none || result == burst_label::noise))
+            {
+                result = label;
+                features = tracker.features();
+            }
+        };
+
+        for(uint16_t sample : f.samples)
+        {
+            push(sample);
+        }
+        // The line stays where it ended until the tracker has closed the burst.
+        uint16_t last = f.samples.empty() ? low_counts : f.samples.back();
+        uint64_t tail = (BURST_IDLE_GAP_US + 2 * block_us) * f.rate_hz / 1000000ULL;
+        for(uint64_t i = 0; i < tail; i++)
+        {
+            push(last);
+        }
+        return result == burst_label::none ? burst_label::noise : result;
+    }
+
+    int label_index(burst_label label)
+    {
+        switch(label)
+        {
+            case burst_label::ring:
+                return 1;
+            case burst_label::door:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    bool write_samples(const sample_file& f, const std::string& source, const std::string& path)
+    {
+        FILE *out = fopen(path.c_str(), "w");
+        if(out == nullptr)
+        {
+            fprintf(stderr, "%s: cannot write\n", path.c_str());
+            return false;
+        }
+        fprintf(out, "# source: %s\n# channel: %s\n# label: %s\n# rate_hz: %u\n", source.c_str(),
+                sensor_channel_name(f.channel), burst_label_name(f.expected), static_cast<unsigned>(f.rate_hz));
+        for(size_t i = 0; i < f.samples.size(); i++)
+        {
+            fprintf(out, "%u%c", static_cast<unsigned>(f.samples[i]), i % 16 == 15 || i + 1 == f.samples.size() ? '\n' : ' ');
+        }
+        return fclose(out) == 0;
+    }
+
+    // Samples per second the detector of channel takes on this host, over seconds worth of a ringing line.
+    double bench(sensor_channel channel, const sample_file& signal, double seconds)
+    {
+        tone_block_detector detector;
+        detector.setup(channel, line_rate_hz, CONFIG_INTERCOM_TONE_BLOCK_SAMPLES);
+        uint64_t total = static_cast<uint64_t>(seconds * line_rate_hz);
+        total += signal.samples.size() - total % signal.samples.size();
+        uint64_t blocks = 0;
+        uint64_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(uint64_t done = 0; done < total; done += signal.samples.size())
+        {
+            for(uint16_t sample : signal.samples)
+            {
+                if(detector.push(sample))
+                {
+                    blocks++;
+                    checksum += detector.result().share_permille;
+                }
+            }
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        // Keeps the loop from being optimised away.
+        if(checksum == UINT64_MAX)
+        {
+            printf("%llu\n", static_cast<unsigned long long>(blocks));
+        }
+        return total / elapsed;
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options] [file...]\n"
+            "  Replays the given sample files (*.samples) and edge traces (*.trace), or every *.samples in %s\n"
+            "  when none are given.\n"
+            "  --synthetic N       also score N generated signals of each kind, rendered to samples\n"
+            "  --seed N            seed of the generator and of the rendering noise (default 1)\n"
+            "  --jitter P          timing jitter of generated signals in percent (default 10)\n"
+            "  --noise N           noise of rendered samples in ADC counts, standard deviation (default 8)\n"
+            "  --render TRACE OUT  write TRACE rendered to samples to OUT and exit\n"
+            "  --bench [S]         measure the detector over S seconds of samples per line (default 20)\n"
+            "  --verbose           print every file with its features\n", self, INTERCOM_TRACE_DIR);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> paths;
+    int synthetic = 0;
+    unsigned seed = 1;
+    double jitter = 0.10;
+    double noise_counts = 8;
+    double bench_seconds = 0;
+    std::string render_in;
+    std::string render_out;
+    bool verbose = false;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char*
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if(arg == "--synthetic") synthetic = atoi(next());
+        else if(arg == "--seed") seed = static_cast<unsigned>(atoi(next()));
+        else if(arg == "--jitter") jitter = atof(next()) / 100.0;
+        else if(arg == "--noise") noise_counts = atof(next());
+        else if(arg == "--render")
+        {
+            render_in = next();
+            render_out = next();
+        }
+        else if(arg == "--bench") bench_seconds = i + 1 < argc && argv[i + 1][0] != '-' ? atof(argv[++i]) : 20;
+        else if(arg == "--verbose") verbose = true;
+        else if(arg.rfind("--", 0) == 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else paths.push_back(arg);
+    }
+
+    std::mt19937 rng(seed);
+    if(!render_in.empty())
+    {
+        trace t;
+        if(!load_trace(render_in, t))
+        {
+            return 1;
+        }
+        std::string source = "rendered from " + t.name + " by intercom_tone --render";
+        return write_samples(render(t, line_rate_hz, noise_counts, rng), source, render_out) ? 0 : 1;
+    }
+
+    if(paths.empty())
+    {
+        for(auto& entry : std::filesystem::directory_iterator(INTERCOM_TRACE_DIR))
+        {
+            if(entry.path().extension() == ".samples")
+            {
+                paths.push_back(entry.path().string());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+    }
+
+    std::vector<sample_file> files;
+    for(const std::string& path : paths)
+    {
+        if(std::filesystem::path(path).extension() == ".trace")
+        {
+            trace t;
+            if(!load_trace(path, t))
+            {
+                return 1;
+            }
+            files.push_back(render(t, line_rate_hz, noise_counts, rng));
+            continue;
+        }
+
+        sample_file f;
+        if(!load_samples(path, f))
+        {
+            return 1;
+        }
+        files.push_back(std::move(f));
+    }
+
+    std::vector<trace> traces;
+    add_synthetic(traces, synthetic, seed, jitter);
+    for(const trace& t : traces)
+    {
+        files.push_back(render(t, line_rate_hz, noise_counts, rng));
+    }
+
+    int confusion[3][3] = {};
+    int correct = 0;
+    for(const sample_file& f : files)
+    {
+        tone_features features = {};
+        burst_label predicted = replay(f, features);
+        confusion[label_index(f.expected)][label_index(predicted)]++;
+        correct += predicted == f.expected;
+
+        if(verbose || (predicted != f.expected && f.name.rfind("synthetic", 0) != 0))
+        {
+            printf("%-32s %-6s -> %-6s %5u Hz, %4u/1000 of the energy, RMS %4u, %2u blocks, %6u us%s\n",
+                   f.name.c_str(), burst_label_name(f.expected), burst_label_name(predicted),
+                   features.peak_hz, features.share_permille, features.rms, features.tone_blocks, features.duration_us,
+                   predicted == f.expected ? "" : "  MISMATCH");
+        }
+    }
+
+    const char *names[3] = {"noise", "ring", "door"};
+    printf("\n%-10s %8s %8s %8s\n", "expected", "noise", "ring", "door");
+    for(int row = 0; row < 3; row++)
+    {
+        printf("%-10s %8d %8d %8d\n", names[row], confusion[row][0], confusion[row][1], confusion[row][2]);
+    }
+
+    int noise_total = confusion[0][0] + confusion[0][1] + confusion[0][2];
+    int signal_total = static_cast<int>(files.size()) - noise_total;
+    int false_wakes = confusion[0][1] + confusion[0][2];
+    int missed = confusion[1][0] + confusion[2][0];
+    printf("\n%zu sample files, %.1f%% correct, %d of %d noise files would start Wi-Fi, %d of %d rings missed\n",
+           files.size(), files.empty() ? 0.0 : 100.0 * correct / files.size(), false_wakes, noise_total, missed, signal_total);
+
+    if(bench_seconds > 0)
+    {
+        generator gen(seed, jitter);
+        printf("\nDetector throughput on this host, blocks of %d samples at %u Hz per line:\n",
+               CONFIG_INTERCOM_TONE_BLOCK_SAMPLES, static_cast<unsigned>(line_rate_hz));
+        for(size_t channel = 0; channel < sensor_channel_count; channel++)
+        {
+            sensor_channel line = static_cast<sensor_channel>(channel);
+            const shape& s = line == sensor_channel_ring ? ring_shape : door_shape;
+            sample_file signal = render(gen.signal("bench", line, burst_label::ring, s, 500), line_rate_hz, noise_counts, rng);
+            double rate = bench(line, signal, bench_seconds);
+            printf("%-6s %12.0f samples/s, %.4f%% of one core at the configured rate\n",
+                   sensor_channel_name(channel), rate, 100.0 * line_rate_hz / rate);
+        }
+    }
+
+    return correct == static_cast<int>(files.size()) ? 0 : 2;
+}
@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "trace_corpus.hpp"
+#include "ulp_fsm.hpp"
+#include "ulp_pulse_config.h"
+
+/*
+   Runs the ULP pulse detector of ulp/ulp_main.S on the simulated ULP over the sensor traces, see
+   trace_corpus.hpp, and checks which of them would wake the CPU.
+
+   Every trace is replayed at several phases of the ULP timer against the start of the burst. A ring or
+   door must wake the CPU at every phase with the channel of its line; noise must never wake it. Noise
+   that matches a signature in everything but the lead-in, like a ring coupled onto the door line, can
+   only be told apart by the CPU and is reported separately. Then the periods and duty cycle the ULP
+   measured on jitter-free signals are compared with the nominal ones, which checks the cycle budget of
+   the sample loops, and the share of time the ULP is busy on idle and humming lines is reported.
+*/
+
+extern "C" const char _binary_ulp_main_bin_start[];
+extern "C" const char _binary_ulp_main_bin_end[];
+
+namespace
+{
+    using namespace trace_corpus;
+    using sim::ulp_fsm::program;
+
+    constexpr size_t memory_words = CONFIG_ULP_COPROC_RESERVE_MEM / sizeof(uint32_t);
+
+    struct ulp_program
+    {
+        program code;
+        uint32_t entry;
+        uint32_t wake_channel;
+        uint32_t rejected_bursts;
+        uint32_t burst_pulses;
+        uint32_t burst_samples;
+        uint32_t burst_wake_samples;
+        uint32_t burst_period_min;
+        uint32_t burst_period_max;
+    };
+
+    struct run_result
+    {
+        bool woke = false;
+        uint32_t channel = ULP_WAKE_NONE;
+        // From the first edge of the trace.
+        int64_t latency_us = -1;
+        uint32_t pulses = 0;
+        uint32_t samples = 0;
+        uint32_t wake_samples = 0;
+        uint32_t period_min = 0;
+        uint32_t period_max = 0;
+        uint32_t rejected = 0;
+        uint32_t activations = 0;
+        uint64_t busy_cycles = 0;
+    };
+
+    bool load_program(ulp_program& ulp)
+    {
+        std::string source(_binary_ulp_main_bin_start, static_cast<size_t>(_binary_ulp_main_bin_end - _binary_ulp_main_bin_start));
+        source.resize(std::strlen(source.c_str()));
+        std::string error;
+        if(!sim::ulp_fsm::assemble(source, ulp.code, error))
+        {
+            fprintf(stderr, "ulp_main.S: %s\n", error.c_str());
+            return false;
+        }
+        if(ulp.code.words() > memory_words)
+        {
+            fprintf(stderr, "ulp_main.S: %zu words do not fit CONFIG_ULP_COPROC_RESERVE_MEM\n", ulp.code.words());
+            return false;
+        }
+        auto symbol = [&](const char *name, uint32_t& address)
+        {
+            auto found = ulp.code.symbols.find(name);
+            if(found == ulp.code.symbols.end())
+            {
+                fprintf(stderr, "ulp_main.S: no symbol %s\n", name);
+                return false;
+            }
+            address = found->second;
+            return true;
+        };
+        return symbol("entry", ulp.entry) && symbol("wake_channel", ulp.wake_channel) && symbol("rejected_bursts", ulp.rejected_bursts)
+            && symbol("burst_pulses", ulp.burst_pulses) && symbol("burst_samples", ulp.burst_samples)
+            && symbol("burst_wake_samples", ulp.burst_wake_samples) && symbol("burst_period_min", ulp.burst_period_min)
+            && symbol("burst_period_max", ulp.burst_period_max);
+    }
+
+    int level_at(const trace& t, int64_t time_ns)
+    {
+        auto after = std::upper_bound(t.edges.begin(), t.edges.end(), time_ns, [](int64_t time, const edge& e)
+        {
+            return time < e.time_us * 1000;
+        });
+        return after == t.edges.begin() ? idle_level : std::prev(after)->level;
+    }
+
+    int sensor_gpio(sensor_channel channel)
+    {
+        return sensor_channels[channel].gpio;
+    }
+
+    // One deep sleep with the trace on its line starting phase_us after the first ULP run. The other line stays idle.
+    run_result run(const ulp_program& ulp, const std::function<int(int64_t)>& line, sensor_channel channel,
+                   int64_t phase_us, int64_t duration_us, int64_t period_us)
+    {
+        std::vector<uint32_t> memory(memory_words, 0);
+        std::copy(ulp.code.data.begin(), ulp.code.data.end(), memory.begin() + static_cast<long>(ulp.code.text.size()));
+        int gpio = sensor_gpio(channel);
+        auto level = [&](int pin, int64_t time_ns)
+        {
+            int64_t trace_ns = time_ns - phase_us * 1000;
+            return pin == gpio && trace_ns >= 0 ? line(trace_ns) : idle_level;
+        };
+
+        sim::ulp_fsm::sleep_result sleep = sim::ulp_fsm::sleep(ulp.code, memory.data(), memory.size(), ulp.entry, period_us,
+                                                              (phase_us + duration_us) * 1000, level);
+        run_result result;
+        result.woke = sleep.woke;
+        result.channel = memory[ulp.wake_channel] & 0xffff;
+        result.latency_us = sleep.woke ? sleep.wake_ns / 1000 - phase_us : -1;
+        result.pulses = memory[ulp.burst_pulses] & 0xffff;
+        result.samples = memory[ulp.burst_samples] & 0xffff;
+        result.wake_samples = memory[ulp.burst_wake_samples] & 0xffff;
+        result.period_min = memory[ulp.burst_period_min] & 0xffff;
+        result.period_max = memory[ulp.burst_period_max] & 0xffff;
+        result.rejected = memory[ulp.rejected_bursts] & 0xffff;
+        result.activations = sleep.activations;
+        result.busy_cycles = sleep.busy_cycles;
+        return result;
+    }
+
+    run_result run_trace(const ulp_program& ulp, const trace& t, int64_t phase_us, int64_t period_us)
+    {
+        int64_t end_us = t.edges.empty() ? 0 : t.edges.back().time_us;
+        return run(ulp, [&](int64_t time_ns) { return level_at(t, time_ns); }, t.channel, phase_us,
+                   end_us + ULP_IDLE_GAP_US + 2 * period_us, period_us);
+    }
+
+    // Noise the ULP cannot reject: it has the period and duty of a signature of its line and differs only in the lead-in.
+    bool lead_in_only(const trace& t)
+    {
+        burst_features features = {};
+        replay(t, features);
+        for(burst_signature signature : burst_signatures)
+        {
+            signature.lead_in_min_us = 0;
+            signature.lead_in_max_us = UINT32_MAX;
+            if(burst_matches(signature, t.channel, features))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t expected_channel(const trace& t)
+    {
+        if(t.expected == burst_label::noise)
+        {
+            return ULP_WAKE_NONE;
+        }
+        // wake_channel is the sensor_channel + 1.
+        return t.channel + 1;
+    }
+
+    int64_t percentile(std::vector<int64_t> values, double fraction)
+    {
+        if(values.empty())
+        {
+            return 0;
+        }
+        std::sort(values.begin(), values.end());
+        return values[static_cast<size_t>(fraction * (values.size() - 1))];
+    }
+
+    void usage(const char *self)
+    {
+        fprintf(stderr,
+            "usage: %s [options] [trace...]\n"
+            "  Runs the ULP program over the given traces, or every *.trace in %s when none are given.\n"
+            "  --synthetic N   also run N generated traces of each kind (default 20)\n"
+            "  --seed N        seed of the generator (default 1)\n"
+            "  --jitter P      timing jitter of generated signals in percent (default 10)\n"
+            "  --phases N      ULP timer phases per trace (default 8)\n"
+            "  --period-ms N   ULP wakeup period before the phase skew (default %d)\n"
+            "  --verbose       print every run\n", self, INTERCOM_TRACE_DIR, CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> paths;
+    int synthetic = 20;
+    unsigned seed = 1;
+    double jitter = 0.10;
+    int phases = 8;
+    int64_t period_us = ulp_wake_period_us(CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS);
+    bool verbose = false;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char*
+        {
+            if(i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if(arg == "--synthetic") synthetic = atoi(next());
+        else if(arg == "--seed") seed = static_cast<unsigned>(atoi(next()));
+        else if(arg == "--jitter") jitter = atof(next()) / 100.0;
+        else if(arg == "--phases") phases = std::max(1, atoi(next()));
+        else if(arg == "--period-ms") period_us = ulp_wake_period_us(std::max(1, atoi(next())));
+        else if(arg == "--verbose") verbose = true;
+        else if(arg.rfind("--", 0) == 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else paths.push_back(arg);
+    }
+
+    ulp_program ulp;
+    if(!load_program(ulp))
+    {
+        return 1;
+    }
+    printf("ULP program: %zu instructions, %zu data words, %zu of %zu words reserved\n",
+           ulp.code.text.size(), ulp.code.data.size(), ulp.code.words(), memory_words);
+
+    if(paths.empty())
+    {
+        for(auto& entry : std::filesystem::directory_iterator(INTERCOM_TRACE_DIR))
+        {
+            if(entry.path().extension() == ".trace")
+            {
+                paths.push_back(entry.path().string());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+    }
+
+    std::vector<trace> traces;
+    for(const std::string& path : paths)
+    {
+        trace t;
+        if(!load_trace(path, t))
+        {
+            return 1;
+        }
+        traces.push_back(std::move(t));
+    }
+    add_synthetic(traces, synthetic, seed, jitter);
+
+    int failures = 0;
+    int signal_runs = 0;
+    int missed = 0;
+    int wrong_channel = 0;
+    int noise_runs = 0;
+    int false_wakes = 0;
+    int passed_on = 0;
+    int passed_on_runs = 0;
+    std::vector<int64_t> latencies;
+    for(const trace& t : traces)
+    {
+        uint32_t expected = expected_channel(t);
+        bool ambiguous = expected == ULP_WAKE_NONE && lead_in_only(t);
+        for(int phase = 0; phase < phases; phase++)
+        {
+            int64_t phase_us = period_us * phase / phases;
+            run_result r = run_trace(ulp, t, phase_us, period_us);
+            bool ok;
+            if(expected != ULP_WAKE_NONE)
+            {
+                signal_runs++;
+                missed += !r.woke;
+                wrong_channel += r.woke && r.channel != expected;
+                ok = r.woke && r.channel == expected;
+                if(r.woke)
+                {
+                    latencies.push_back(r.latency_us);
+                }
+            }
+            else if(ambiguous)
+            {
+                passed_on_runs++;
+                passed_on += r.woke;
+                ok = true;
+            }
+            else
+            {
+                noise_runs++;
+                false_wakes += r.woke;
+                ok = !r.woke;
+            }
+            failures += !ok;
+
+            if(verbose || (!ok && t.name.rfind("synthetic", 0) != 0))
+            {
+                uint32_t period_avg = r.pulses ? r.samples * ULP_SAMPLE_US / r.pulses : 0;
+                printf("%-32s %-6s phase %5lld us: %-5s channel %u, latency %6lld us, %3u pulses, period %4u us (%u-%u), duty %3u/1000, %u rejected%s\n",
+                       t.name.c_str(), burst_label_name(t.expected), static_cast<long long>(phase_us), r.woke ? "wake" : "sleep",
+                       r.channel, static_cast<long long>(r.latency_us), r.pulses, period_avg,
+                       r.period_min * ULP_SAMPLE_US, r.period_max * ULP_SAMPLE_US,
+                       r.samples ? r.wake_samples * 1000 / r.samples : 0, r.rejected, ok ? "" : "  FAIL");
+            }
+        }
+    }
+
+    printf("\n%zu traces x %d phases of the %.2f ms ULP period\n", traces.size(), phases, period_us / 1000.0);
+    printf("  signals: %d runs, %d missed, %d woke with the wrong channel\n", signal_runs, missed, wrong_channel);
+    printf("  noise:   %d runs, %d woke the CPU\n", noise_runs, false_wakes);
+    printf("  noise differing only in the lead-in, left to the CPU: %d of %d runs woke it\n", passed_on, passed_on_runs);
+    printf("  wake latency from the start of the burst: p50 %lld us, p95 %lld us, max %lld us\n",
+           static_cast<long long>(percentile(latencies, 0.50)), static_cast<long long>(percentile(latencies, 0.95)),
+           static_cast<long long>(percentile(latencies, 1.0)));
+
+    // The ULP counts periods in samples; any error in the loop cycle budget shows as a scaled period.
+    printf("\nMeasured on jitter-free signals, averaged over the phases:\n");
+    generator exact(seed, 0.0);
+    struct
+    {
+        const char *name;
+        sensor_channel channel;
+        burst_label label;
+        shape s;
+    } references[] = {{"ring", sensor_channel_ring, burst_label::ring, ring_shape}, {"door", sensor_channel_door, burst_label::door, door_shape}};
+    for(const auto& reference : references)
+    {
+        trace t = exact.signal(reference.name, reference.channel, reference.label, reference.s, 120);
+        double period_sum = 0;
+        double duty_sum = 0;
+        int woke = 0;
+        for(int phase = 0; phase < phases; phase++)
+        {
+            run_result r = run_trace(ulp, t, period_us * phase / phases, period_us);
+            if(r.woke && r.pulses > 0 && r.samples > 0)
+            {
+                period_sum += static_cast<double>(r.samples) * ULP_SAMPLE_US / r.pulses;
+                duty_sum += 1000.0 * r.wake_samples / r.samples;
+                woke++;
+            }
+        }
+        double period = woke ? period_sum / woke : 0;
+        double duty = woke ? duty_sum / woke : 0;
+        double nominal_duty = 1000.0 * reference.s.wake_us / reference.s.period_us;
+        double period_error = 100.0 * (period - reference.s.period_us) / reference.s.period_us;
+        bool ok = woke == phases && period_error > -1.0 && period_error < 1.0 && duty > nominal_duty - 10 && duty < nominal_duty + 10;
+        failures += !ok;
+        printf("  %s: period %.1f us against %lld (%+.2f%%), duty %.0f/1000 against %.0f%s\n", reference.name, period,
+               static_cast<long long>(reference.s.period_us), period_error, duty, nominal_duty, ok ? "" : "  FAIL");
+    }
+
+    // What the ULP costs while nothing happens, and on a line that hums all night.
+    const int64_t idle_us = 10000000;
+    run_result idle = run(ulp, [](int64_t) { return idle_level; }, sensor_channel_ring, 0, idle_us, period_us);
+    run_result hum = run(ulp, [](int64_t time_ns) { return (time_ns / 10000000) % 2 == 0 ? wake_level : idle_level; },
+                         sensor_channel_ring, 0, idle_us, period_us);
+    failures += idle.woke + hum.woke;
+    printf("\nULP busy over %lld s: %.3f%% with idle lines, %.1f%% with 50 Hz hum on the ring line (%u bursts rejected)%s\n",
+           static_cast<long long>(idle_us / 1000000),
+           100.0 * sim::ulp_fsm::cycles_to_ns(idle.busy_cycles) / (idle_us * 1000.0),
+           100.0 * sim::ulp_fsm::cycles_to_ns(hum.busy_cycles) / (idle_us * 1000.0), hum.rejected,
+           idle.woke || hum.woke ? "  FAIL" : "");
+
+    printf("\n%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 2;
+}
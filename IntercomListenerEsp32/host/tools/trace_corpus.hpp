@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "sdkconfig.h"
+#include "burst_classifier.hpp"
+
+/*
+   Sensor edge traces shared by the host tools: loading the recorded traces in traces/, generating
+   synthetic ones around the recorded shapes, and replaying a trace through the firmware's burst classifier.
+
+   A trace is a text file with a small header and one edge per line:
+
+       # channel: ring
+       # label: ring
+       0 0
+       500 1
+       7000 0
+
+   Each line holds the time in microseconds and the level the line went to. channel is the sensor line
+   the trace was recorded on, label what a human says it is (ring, door or noise).
+*/
+
+namespace trace_corpus
+{
+    const int wake_level = CONFIG_INTERCOM_WAKE_LEVEL;
+    const int idle_level = CONFIG_INTERCOM_WAKE_LEVEL ? 0 : 1;
+
+    struct edge
+    {
+        int64_t time_us;
+        int level;
+    };
+
+    struct trace
+    {
+        std::string name;
+        sensor_channel channel = sensor_channel_ring;
+        burst_label expected = burst_label::noise;
+        std::vector<edge> edges;
+    };
+
+    inline bool parse_label(const std::string& text, burst_label& label)
+    {
+        for(burst_label candidate : {burst_label::noise, burst_label::ring, burst_label::door})
+        {
+            if(text == burst_label_name(candidate))
+            {
+                label = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline bool load_trace(const std::string& path, trace& t)
+    {
+        std::ifstream in(path);
+        if(!in)
+        {
+            fprintf(stderr, "%s: cannot open\n", path.c_str());
+            return false;
+        }
+
+        t.name = std::filesystem::path(path).filename().string();
+        std::string line;
+        int line_number = 0;
+        while(std::getline(in, line))
+        {
+            line_number++;
+            if(line.empty())
+            {
+                continue;
+            }
+
+            if(line[0] == '#')
+            {
+                std::istringstream header(line.substr(1));
+                std::string key, value;
+                header >> key >> value;
+                if(key == "channel:")
+                {
+                    t.channel = value == "door" ? sensor_channel_door : sensor_channel_ring;
+                }
+                else if(key == "label:" && !parse_label(value, t.expected))
+                {
+                    fprintf(stderr, "%s:%d: unknown label '%s'\n", path.c_str(), line_number, value.c_str());
+                    return false;
+                }
+                continue;
+            }
+
+            edge e;
+            std::istringstream fields(line);
+            if(!(fields >> e.time_us >> e.level))
+            {
+                fprintf(stderr, "%s:%d: expected '<time_us> <level>'\n", path.c_str(), line_number);
+                return false;
+            }
+            t.edges.push_back(e);
+        }
+        return true;
+    }
+
+    // Replays the edges and returns the first decisive label. A trace that never produced a label counts as noise.
+    inline burst_label replay(const trace& t, burst_features& features)
+    {
+        burst_tracker tracker(t.channel, wake_level);
+        burst_label result = burst_label::none;
+        auto take = [&](burst_label label)
+        {
+            if(label != burst_label::none && (result == burst_label::none || result == burst_label::noise))
+            {
+                result = label;
+                features = tracker.features();
+            }
+        };
+
+        int64_t last = 0;
+        for(const edge& e : t.edges)
+        {
+            take(tracker.expire(e.time_us));
+            take(tracker.edge(e.level, e.time_us));
+            last = e.time_us;
+        }
+        take(tracker.expire(last + BURST_IDLE_GAP_US));
+        return result == burst_label::none ? burst_label::noise : result;
+    }
+
+    struct shape
+    {
+        int64_t drop_us;
+        int64_t lead_in_us;
+        int64_t period_us;
+        int64_t wake_us;
+    };
+
+    // Nominal shapes taken from the oscilloscope captures in the repository root.
+    const shape ring_shape = {500, 7000, 1000, 780};
+    const shape door_shape = {400, 16000, 840, 600};
+
+    class generator
+    {
+    private:
+        std::mt19937 rng;
+        double jitter;
+
+        int64_t vary(int64_t value, double fraction)
+        {
+            std::uniform_real_distribution<double> factor(1.0 - fraction, 1.0 + fraction);
+            return std::max<int64_t>(1, static_cast<int64_t>(value * factor(rng)));
+        }
+
+    public:
+        generator(unsigned seed, double jitter_fraction)
+            : rng(seed), jitter(jitter_fraction)
+        {
+        }
+
+        // A signal shape with the lead-in varying by twice the per-period jitter.
+        trace signal(const char *name, sensor_channel channel, burst_label expected, const shape& s, int pulses)
+        {
+            trace t;
+            t.name = name;
+            t.channel = channel;
+            t.expected = expected;
+            int64_t time = 0;
+            int64_t lead_in = vary(s.lead_in_us, jitter * 2);
+            t.edges.push_back({time, wake_level});
+            t.edges.push_back({time + vary(s.drop_us, jitter), idle_level});
+            time += lead_in;
+            for(int i = 0; i < pulses; i++)
+            {
+                int64_t period = vary(s.period_us, jitter);
+                int64_t wake = std::min(period - 1, vary(s.wake_us, jitter));
+                t.edges.push_back({time, wake_level});
+                t.edges.push_back({time + wake, idle_level});
+                time += period;
+            }
+            return t;
+        }
+
+        trace glitches(sensor_channel channel)
+        {
+            trace t;
+            t.name = "synthetic glitches";
+            t.channel = channel;
+            std::uniform_int_distribution<int64_t> width(2, 300);
+            std::uniform_int_distribution<int64_t> gap(100, 3000);
+            std::uniform_int_distribution<int> count(1, 12);
+            int64_t time = 0;
+            for(int i = count(rng); i > 0; i--)
+            {
+                t.edges.push_back({time, wake_level});
+                time += width(rng);
+                t.edges.push_back({time, idle_level});
+                time += gap(rng);
+            }
+            return t;
+        }
+
+        trace hum(sensor_channel channel)
+        {
+            trace t;
+            t.name = "synthetic mains hum";
+            t.channel = channel;
+            std::uniform_int_distribution<int> mains(0, 1);
+            int64_t period = vary(mains(rng) ? 20000 : 10000, 0.02);
+            for(int64_t time = 0; time < 200000; time += period)
+            {
+                t.edges.push_back({time, wake_level});
+                t.edges.push_back({time + period / 2, idle_level});
+            }
+            return t;
+        }
+
+        // Contact bounce: a handful of edges a few hundred microseconds apart, then the line settles.
+        trace bounce(sensor_channel channel)
+        {
+            trace t;
+            t.name = "synthetic bounce";
+            t.channel = channel;
+            std::uniform_int_distribution<int64_t> gap(20, 800);
+            std::uniform_int_distribution<int> count(2, 8);
+            int64_t time = 0;
+            for(int i = count(rng); i > 0; i--)
+            {
+                t.edges.push_back({time, wake_level});
+                time += gap(rng);
+                t.edges.push_back({time, idle_level});
+                time += gap(rng);
+            }
+            return t;
+        }
+    };
+
+    inline void add_synthetic(std::vector<trace>& traces, int count, unsigned seed, double jitter)
+    {
+        generator gen(seed, jitter);
+        for(int i = 0; i < count; i++)
+        {
+            traces.push_back(gen.signal("synthetic ring", sensor_channel_ring, burst_label::ring, ring_shape, 120));
+            traces.push_back(gen.signal("synthetic door", sensor_channel_door, burst_label::door, door_shape, 120));
+            // A signal coupled onto the other line has the wrong shape for that line.
+            traces.push_back(gen.signal("synthetic ring crosstalk", sensor_channel_door, burst_label::noise, ring_shape, 120));
+            sensor_channel channel = i % 2 == 0 ? sensor_channel_ring : sensor_channel_door;
+            traces.push_back(gen.glitches(channel));
+            traces.push_back(gen.hum(channel));
+            traces.push_back(gen.bounce(channel));
+        }
+    }
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_AUDIO_CLIP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_caps.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_level.h"
+#include "ima_adpcm.hpp"
+#include "notification_dispatcher.hpp"
+#include "sensor_channels.hpp"
+
+static const char* audio_log_tag = "audio";
+
+// A clip waiting for its upload, or on its way. Sequence numbers count blocks since the recording started.
+struct audio_clip
+{
+    size_t channel;
+    uint32_t first_block;
+    uint32_t end_block;
+    // Time of the ring, and when the clip stops recording.
+    int64_t trigger_us;
+    int64_t end_us;
+    // Given up on after this.
+    int64_t deadline_us;
+    uint8_t attempts;
+    int64_t next_attempt_us;
+};
+
+/*
+    Records the audio line for the whole awake window and keeps the last CONFIG_INTERCOM_AUDIO_BUFFER_KB of it
+    in PSRAM, so a ring can take the seconds before it along.
+
+    The ADC converts the line at the lowest multiple of the sample rate it supports, and the task averages the
+    conversions down to CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ, removes the bias with a slow high-pass and encodes
+    the samples as IMA-ADPCM. Only the DMA frame and the block being encoded are in internal RAM; every finished
+    block is copied into the PSRAM ring. A ring starts a clip that reaches CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS
+    back and ends CONFIG_INTERCOM_AUDIO_CLIP_MS after it. Until the clip is uploaded, the recording drops blocks
+    rather than overwrite it.
+
+    One clip at a time: a ring during a clip is in it, a ring while one waits for its upload gets none.
+*/
+class audio_recorder
+{
+public:
+    // Conversions per sample: the ADC does not run slower than SOC_ADC_SAMPLE_FREQ_THRES_LOW.
+    static constexpr uint32_t decimation = (SOC_ADC_SAMPLE_FREQ_THRES_LOW + CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ - 1) / CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ;
+    static constexpr uint32_t adc_rate_hz = CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ * decimation;
+    // 10 ms of conversions per DMA frame, four frames in the pool.
+    static constexpr uint32_t frame_bytes = adc_rate_hz / 100 * SOC_ADC_DIGI_RESULT_BYTES / SOC_ADC_DIGI_DATA_BYTES_PER_CONV * SOC_ADC_DIGI_DATA_BYTES_PER_CONV;
+    static constexpr uint32_t ring_blocks = CONFIG_INTERCOM_AUDIO_BUFFER_KB * 1024 / IMA_ADPCM_BLOCK_BYTES;
+    static constexpr int64_t block_us = IMA_ADPCM_BLOCK_SAMPLES * 1000000LL / CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ;
+    static constexpr uint32_t pre_trigger_blocks = static_cast<uint32_t>((CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS * 1000LL + block_us - 1) / block_us);
+
+private:
+    static_assert(adc_rate_hz <= SOC_ADC_SAMPLE_FREQ_THRES_HIGH, "Audio sample rate out of the ADC range");
+    static_assert(CONFIG_INTERCOM_AUDIO_GPIO_PIN >= 32 && CONFIG_INTERCOM_AUDIO_GPIO_PIN <= 39, "The audio line must be on ADC1, GPIO 32-39");
+    static_assert((CONFIG_INTERCOM_AUDIO_PRE_TRIGGER_MS + CONFIG_INTERCOM_AUDIO_CLIP_MS) * 1000LL / block_us + 2 < ring_blocks,
+        "CONFIG_INTERCOM_AUDIO_BUFFER_KB does not hold a whole clip");
+
+    enum class clip_state : uint8_t
+    {
+        idle,
+        recording,
+        ready,
+        uploading
+    };
+
+    // Time constant of the bias removal, as a power of two in samples: 128 ms at 8 kHz.
+    static constexpr int dc_shift = 10;
+
+    adc_continuous_handle_t handle = nullptr;
+    TaskHandle_t task_handle = nullptr;
+    uint8_t adc_channel = 0;
+    uint8_t* ring = nullptr;
+    std::atomic<uint32_t> written{0};
+    // When the last block was finished, which dates the others.
+    std::atomic<int64_t> last_block_us{0};
+    std::atomic<uint32_t> dropped_frames{0};
+    std::atomic<uint32_t> dropped_blocks{0};
+
+    // Written by the recorder task only.
+    ima_adpcm_encoder encoder;
+    uint32_t sum = 0;
+    uint32_t summed = 0;
+    int32_t dc = 0;
+    bool dc_settled = false;
+    alignas(4) uint8_t frame[frame_bytes] = {};
+
+    // Handed on by state: the main task fills it in while idle, the recorder ends it, the uploader takes it.
+    std::atomic<clip_state> state{clip_state::idle};
+    audio_clip clip = {};
+
+public:
+    audio_recorder() = default;
+    audio_recorder(audio_recorder const&) = delete;
+    audio_recorder& operator=(audio_recorder const&) = delete;
+
+    // Starts recording. Without the PSRAM ring no clips are recorded, the rest of the firmware runs as usual.
+    void setup()
+    {
+        esp_log_level_set(audio_log_tag, INTERCOM_LOG_LEVEL);
+
+        ring = static_cast<uint8_t*>(heap_caps_malloc(ring_blocks * IMA_ADPCM_BLOCK_BYTES, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+        if(ring == nullptr)
+        {
+            ESP_LOGE(audio_log_tag, "Could not allocate %d KiB of PSRAM for audio, no clips will be recorded", CONFIG_INTERCOM_AUDIO_BUFFER_KB);
+            return;
+        }
+
+        adc_unit_t unit;
+        adc_channel_t channel;
+        ESP_ERROR_CHECK(adc_continuous_io_to_channel(CONFIG_INTERCOM_AUDIO_GPIO_PIN, &unit, &channel));
+        adc_channel = static_cast<uint8_t>(channel);
+        xTaskCreate(audio_task_routine, "audio_task", 3072, this, configMAX_PRIORITIES - 2, &task_handle);
+
+        adc_continuous_handle_cfg_t handle_config = {};
+        handle_config.max_store_buf_size = frame_bytes * 4;
+        handle_config.conv_frame_size = frame_bytes;
+        ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &handle));
+
+        adc_digi_pattern_config_t pattern = {};
+        pattern.atten = ADC_ATTEN_DB_12;
+        pattern.channel = adc_channel;
+        pattern.unit = unit;
+        pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+
+        adc_continuous_config_t config = {};
+        config.pattern_num = 1;
+        config.adc_pattern = &pattern;
+        config.sample_freq_hz = adc_rate_hz;
+        config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+        config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+        ESP_ERROR_CHECK(adc_continuous_config(handle, &config));
+
+        adc_continuous_evt_cbs_t callbacks = {};
+        callbacks.on_conv_done = on_conv_done;
+        callbacks.on_pool_ovf = on_pool_overflow;
+        ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &callbacks, this));
+        ESP_ERROR_CHECK(adc_continuous_start(handle));
+
+        ESP_LOGI(audio_log_tag, "Recording GPIO %d at %d Hz (ADC at %lu Hz), %lld ms of history in %d KiB of PSRAM",
+            CONFIG_INTERCOM_AUDIO_GPIO_PIN, CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ, static_cast<unsigned long>(adc_rate_hz),
+            static_cast<long long>(ring_blocks * block_us / 1000), CONFIG_INTERCOM_AUDIO_BUFFER_KB);
+    }
+
+    // Starts a clip of the ring on channel at timestamp. Main task.
+    void trigger(size_t channel, int64_t timestamp)
+    {
+        if(ring == nullptr)
+        {
+            return;
+        }
+
+        clip_state current = state.load(std::memory_order_acquire);
+        if(current == clip_state::ready && esp_timer_get_time() >= clip.deadline_us
+            && state.compare_exchange_strong(current, clip_state::idle, std::memory_order_acq_rel))
+        {
+            ESP_LOGW(audio_log_tag, "Clip of the %s at %lld ms was never sent, dropped", sensor_channels[clip.channel].name,
+                static_cast<long long>(clip.trigger_us / 1000));
+            current = clip_state::idle;
+        }
+        if(current != clip_state::idle)
+        {
+            ESP_LOGI(audio_log_tag, "No clip of the %s, the clip of the %s is still %s", sensor_channels[channel].name,
+                sensor_channels[clip.channel].name, current == clip_state::recording ? "recording" : "waiting for its upload");
+            return;
+        }
+
+        // The block that holds timestamp, counted back from the last one finished. The oldest block is
+        // left out, the recorder may be overwriting it right now.
+        uint32_t end = written.load(std::memory_order_acquire);
+        int64_t behind_us = last_block_us.load(std::memory_order_relaxed) - timestamp;
+        uint32_t behind = behind_us > 0 ? static_cast<uint32_t>(behind_us / block_us) + 1 : 0;
+        uint32_t at = end > behind ? end - behind : 0;
+        uint32_t first = at > pre_trigger_blocks ? at - pre_trigger_blocks : 0;
+        uint32_t oldest = end + 2 > ring_blocks ? end + 2 - ring_blocks : 0;
+
+        clip.channel = channel;
+        clip.first_block = first > oldest ? first : oldest;
+        clip.end_block = 0;
+        clip.trigger_us = timestamp;
+        clip.end_us = timestamp + CONFIG_INTERCOM_AUDIO_CLIP_MS * 1000LL;
+        clip.deadline_us = clip.end_us + CONFIG_INTERCOM_NOTIFICATION_DEADLINE * 1000000LL;
+        clip.attempts = 0;
+        clip.next_attempt_us = 0;
+        state.store(clip_state::recording, std::memory_order_release);
+
+        ESP_LOGI(audio_log_tag, "Clip of the %s started, %lld ms before it kept", sensor_channels[channel].name,
+            static_cast<long long>((at > clip.first_block ? at - clip.first_block : 0) * block_us / 1000));
+    }
+
+    // A clip is recording or waiting for its upload, and not yet given up on. Keeps the chip awake.
+    bool busy() const
+    {
+        return state.load(std::memory_order_acquire) != clip_state::idle && esp_timer_get_time() < clip.deadline_us;
+    }
+
+    // Hands a clip that is due for an upload to the uploader, which reports back with finish(). Drops a clip past its deadline.
+    bool take(audio_clip& taken)
+    {
+        clip_state current = clip_state::ready;
+        int64_t now = esp_timer_get_time();
+        if(state.load(std::memory_order_acquire) != clip_state::ready || now < clip.next_attempt_us)
+        {
+            return false;
+        }
+        if(now >= clip.deadline_us)
+        {
+            if(state.compare_exchange_strong(current, clip_state::idle, std::memory_order_acq_rel))
+            {
+                ESP_LOGW(audio_log_tag, "Clip of the %s expired after %u attempt(s)", sensor_channels[clip.channel].name, static_cast<unsigned>(clip.attempts));
+            }
+            return false;
+        }
+        if(!state.compare_exchange_strong(current, clip_state::uploading, std::memory_order_acq_rel))
+        {
+            return false;
+        }
+        taken = clip;
+        return true;
+    }
+
+    // Outcome of the upload of the clip last taken: done with on success or a final status, tried again later otherwise.
+    void finish(int status_code)
+    {
+        int64_t now = esp_timer_get_time();
+        clip.attempts++;
+        if(status_code >= 200 && status_code < 300)
+        {
+            ESP_LOGI(audio_log_tag, "Clip of the %s sent %lld ms after the ring", sensor_channels[clip.channel].name,
+                static_cast<long long>((now - clip.trigger_us) / 1000));
+            state.store(clip_state::idle, std::memory_order_release);
+            return;
+        }
+
+        int64_t retry_at = now + notification_backoff_us(clip.attempts);
+        if(!notification_retryable(status_code) || clip.attempts >= CONFIG_INTERCOM_NOTIFICATION_MAX_ATTEMPTS || retry_at >= clip.deadline_us)
+        {
+            ESP_LOGW(audio_log_tag, "Clip of the %s dropped after %u attempt(s), status %d", sensor_channels[clip.channel].name,
+                static_cast<unsigned>(clip.attempts), status_code);
+            state.store(clip_state::idle, std::memory_order_release);
+            return;
+        }
+        clip.next_attempt_us = retry_at;
+        state.store(clip_state::ready, std::memory_order_release);
+    }
+
+    // The blocks from sequence on that lie in one piece in the ring, at most up to end.
+    const uint8_t* blocks(uint32_t sequence, uint32_t end, uint32_t& count) const
+    {
+        uint32_t slot = sequence % ring_blocks;
+        count = end - sequence < ring_blocks - slot ? end - sequence : ring_blocks - slot;
+        return ring + slot * IMA_ADPCM_BLOCK_BYTES;
+    }
+
+    uint32_t dropped_block_count() const
+    {
+        return dropped_blocks.load(std::memory_order_relaxed);
+    }
+
+private:
+    static bool IRAM_ATTR on_conv_done(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* user_data)
+    {
+        audio_recorder& self = *static_cast<audio_recorder*>(user_data);
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(self.task_handle, &higher_priority_task_woken);
+        return higher_priority_task_woken == pdTRUE;
+    }
+
+    static bool IRAM_ATTR on_pool_overflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* user_data)
+    {
+        static_cast<audio_recorder*>(user_data)->dropped_frames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void process(uint32_t length)
+    {
+        for(uint32_t offset = 0; offset + SOC_ADC_DIGI_RESULT_BYTES <= length; offset += SOC_ADC_DIGI_RESULT_BYTES)
+        {
+            const adc_digi_output_data_t* result = reinterpret_cast<const adc_digi_output_data_t*>(frame + offset);
+            if(result->type1.channel != adc_channel)
+            {
+                continue;
+            }
+            sum += result->type1.data;
+            if(++summed < decimation)
+            {
+                continue;
+            }
+
+            // 12 bit counts scaled to 16 bits, less the bias, which the high-pass follows at 8 fractional bits.
+            int32_t level = static_cast<int32_t>((sum << 4) / decimation);
+            sum = 0;
+            summed = 0;
+            if(!dc_settled)
+            {
+                dc = level << 8;
+                dc_settled = true;
+            }
+            dc += ((level << 8) - dc) >> dc_shift;
+            int32_t sample = level - (dc >> 8);
+            sample = sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample;
+            if(encoder.push(static_cast<int16_t>(sample)))
+            {
+                commit();
+            }
+        }
+    }
+
+    // Copies the finished block into the ring and ends the clip when it is long enough.
+    void commit()
+    {
+        uint32_t sequence = written.load(std::memory_order_relaxed);
+        clip_state current = state.load(std::memory_order_acquire);
+        if((current == clip_state::ready || current == clip_state::uploading) && sequence - clip.first_block >= ring_blocks)
+        {
+            dropped_blocks.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        memcpy(ring + sequence % ring_blocks * IMA_ADPCM_BLOCK_BYTES, encoder.block(), IMA_ADPCM_BLOCK_BYTES);
+        int64_t now = esp_timer_get_time();
+        last_block_us.store(now, std::memory_order_relaxed);
+        written.store(sequence + 1, std::memory_order_release);
+
+        if(current == clip_state::recording && (now >= clip.end_us || sequence + 1 - clip.first_block >= ring_blocks))
+        {
+            clip.end_block = sequence + 1;
+            state.store(clip_state::ready, std::memory_order_release);
+            ESP_LOGI(audio_log_tag, "Clip of the %s ready, %lu blocks (%lld ms)", sensor_channels[clip.channel].name,
+                static_cast<unsigned long>(clip.end_block - clip.first_block),
+                static_cast<long long>((clip.end_block - clip.first_block) * block_us / 1000));
+        }
+    }
+
+    static void audio_task_routine(void *pvParameters)
+    {
+        audio_recorder& self = *static_cast<audio_recorder*>(pvParameters);
+        uint32_t dropped_reported = 0;
+        while(true)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            uint32_t length = 0;
+            while(adc_continuous_read(self.handle, self.frame, frame_bytes, &length, 0) == ESP_OK)
+            {
+                self.process(length);
+            }
+
+            uint32_t dropped = self.dropped_frames.load(std::memory_order_relaxed);
+            if(dropped != dropped_reported)
+            {
+                ESP_LOGW(audio_log_tag, "ADC pool overflowed, %lu frame(s) dropped so far", static_cast<unsigned long>(dropped));
+                dropped_reported = dropped;
+            }
+        }
+    }
+};
+
+audio_recorder audio_clips;
+
+#endif
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sensor_channels.hpp"
+
+enum class burst_label : uint8_t
+{
+    none,
+    noise,
+    ring,
+    door
+};
+
+inline const char* burst_label_name(burst_label label)
+{
+    switch(label)
+    {
+        case burst_label::noise:
+            return "noise";
+        case burst_label::ring:
+            return "ring";
+        case burst_label::door:
+            return "door";
+        default:
+            return "none";
+    }
+}
+
+/*
+    Timing features of one burst on a sensor line.
+
+    The intercom signals start with a drop to the wake level followed by a plateau before the pulse
+    train (see "Door Ring 1.png" and "IntercomListener waveform 1.png"). lead_in_us spans the drop and
+    the plateau, from the first wake edge to the second. Every later wake edge starts a train period.
+*/
+struct burst_features
+{
+    uint32_t lead_in_us;
+    uint32_t period_min_us;
+    uint32_t period_max_us;
+    uint32_t period_avg_us;
+    uint32_t duty_permille;
+    uint32_t pulse_count;
+    uint32_t duration_us;
+};
+
+// A burst matches when it was seen on channel and every feature lies within the ranges.
+struct burst_signature
+{
+    burst_label label;
+    sensor_channel channel;
+    uint32_t lead_in_min_us;
+    uint32_t lead_in_max_us;
+    uint32_t period_min_us;
+    uint32_t period_max_us;
+    uint16_t duty_min_permille;
+    uint16_t duty_max_permille;
+    uint16_t min_pulses;
+};
+
+// Ranges around the oscilloscope captures: ~7 ms lead-in and ~1 kHz for the apartment ring,
+// ~16 ms lead-in and ~1.19 kHz for the door bell, both spending most of each period at the wake level.
+static constexpr burst_signature burst_signatures[] =
+{
+    {burst_label::ring, sensor_channel_ring, 2000, 10000, 600, 1600, 550, 920, 8},
+    {burst_label::door, sensor_channel_door, 11000, 26000, 600, 1600, 550, 920, 8},
+};
+
+// Silence that ends a burst. Longer than the door bell plateau, which has no edges.
+#define BURST_IDLE_GAP_US 30000
+
+// Longest plateau a signature accepts before the pulse train. A capture that ends bursts on a shorter silence splits them.
+constexpr uint32_t burst_lead_in_max_us()
+{
+    uint32_t longest = 0;
+    for(const burst_signature& signature : burst_signatures)
+    {
+        longest = signature.lead_in_max_us > longest ? signature.lead_in_max_us : longest;
+    }
+    return longest;
+}
+static_assert(BURST_IDLE_GAP_US > burst_lead_in_max_us(), "BURST_IDLE_GAP_US would split bursts with the longest lead-in");
+
+inline bool burst_matches(const burst_signature& signature, sensor_channel channel, const burst_features& features)
+{
+    return signature.channel == channel
+        && features.pulse_count >= signature.min_pulses
+        && features.lead_in_us >= signature.lead_in_min_us && features.lead_in_us <= signature.lead_in_max_us
+        && features.period_min_us >= signature.period_min_us && features.period_max_us <= signature.period_max_us
+        && features.duty_permille >= signature.duty_min_permille && features.duty_permille <= signature.duty_max_permille;
+}
+
+inline burst_label burst_classify(sensor_channel channel, const burst_features& features)
+{
+    for(const burst_signature& signature : burst_signatures)
+    {
+        if(burst_matches(signature, channel, features))
+        {
+            return signature.label;
+        }
+    }
+    return burst_label::none;
+}
+
+/*
+    Extracts burst features from the edge stream of one sensor line and labels the burst.
+
+    A burst is labelled as soon as it matches a signature, usually a few milliseconds into the pulse
+    train, so a ring does not have to end before it is reported. A burst that ends without matching
+    is labelled noise. Edges after the label are absorbed until the line has been idle for BURST_IDLE_GAP_US.
+*/
+class burst_tracker
+{
+private:
+    sensor_channel channel;
+    int wake_level;
+
+    bool active = false;
+    bool decided = false;
+    int level = 0;
+    int64_t first_edge_us = 0;
+    int64_t last_edge_us = 0;
+    int64_t last_wake_edge_us = 0;
+    uint32_t wake_edges = 0;
+    uint64_t wake_time_us = 0;
+    uint64_t period_sum_us = 0;
+    burst_features current = {};
+
+public:
+    burst_tracker(sensor_channel burst_channel, int burst_wake_level)
+        : channel(burst_channel), wake_level(burst_wake_level)
+    {
+    }
+
+    // Feeds one edge. Returns the label once per burst, burst_label::none otherwise.
+    // Call expire() with the edge timestamp first so a stale burst is closed before a new one starts.
+    burst_label edge(int edge_level, int64_t timestamp)
+    {
+        edge_level = edge_level ? 1 : 0;
+        if(!active)
+        {
+            if(edge_level != wake_level)
+            {
+                return burst_label::none;
+            }
+            start(timestamp);
+            return burst_label::none;
+        }
+
+        if(edge_level == level)
+        {
+            return burst_label::none;
+        }
+
+        burst_label label = burst_label::none;
+        if(edge_level == wake_level)
+        {
+            wake_edges++;
+            if(wake_edges == 2)
+            {
+                current.lead_in_us = static_cast<uint32_t>(timestamp - first_edge_us);
+            }
+            else
+            {
+                add_period(static_cast<uint32_t>(timestamp - last_wake_edge_us));
+            }
+            last_wake_edge_us = timestamp;
+
+            current.duration_us = static_cast<uint32_t>(timestamp - first_edge_us);
+            if(!decided)
+            {
+                label = burst_classify(channel, current);
+                decided = label != burst_label::none;
+            }
+        }
+        else if(wake_edges >= 2)
+        {
+            wake_time_us += timestamp - last_wake_edge_us;
+        }
+
+        level = edge_level;
+        last_edge_us = timestamp;
+        return label;
+    }
+
+    // Closes the burst once the line has been idle long enough. Returns noise if it never matched.
+    burst_label expire(int64_t now)
+    {
+        if(!active || now - last_edge_us < BURST_IDLE_GAP_US)
+        {
+            return burst_label::none;
+        }
+
+        active = false;
+        return decided ? burst_label::none : burst_label::noise;
+    }
+
+    bool is_active() const
+    {
+        return active;
+    }
+
+    // Time at which expire() will close the current burst.
+    int64_t idle_deadline() const
+    {
+        return last_edge_us + BURST_IDLE_GAP_US;
+    }
+
+    const burst_features& features() const
+    {
+        return current;
+    }
+
+private:
+    void start(int64_t timestamp)
+    {
+        active = true;
+        decided = false;
+        level = wake_level;
+        first_edge_us = timestamp;
+        last_edge_us = timestamp;
+        last_wake_edge_us = timestamp;
+        wake_edges = 1;
+        wake_time_us = 0;
+        period_sum_us = 0;
+        current = {};
+    }
+
+    void add_period(uint32_t period_us)
+    {
+        current.pulse_count++;
+        period_sum_us += period_us;
+        if(current.pulse_count == 1 || period_us < current.period_min_us)
+        {
+            current.period_min_us = period_us;
+        }
+        if(period_us > current.period_max_us)
+        {
+            current.period_max_us = period_us;
+        }
+
+        current.period_avg_us = static_cast<uint32_t>(period_sum_us / current.pulse_count);
+        // Edges closer than the timestamp resolution give zero-length periods; such a burst never matches anyway.
+        current.duty_permille = period_sum_us > 0 ? static_cast<uint32_t>(wake_time_us * 1000 / period_sum_us) : 0;
+    }
+};
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+
+#include <atomic>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_level.h"
+
+// Text of a command as it arrives, terminator included. Longer ones are cut.
+#define COMMAND_TEXT_MAX 64
+// Text of a reply, terminator included.
+#define COMMAND_REPLY_MAX 256
+// Commands taken from one poll. Later ones wait for the next.
+#define COMMAND_POLL_MAX 4
+// How long the task waits for the main task to answer a command before it moves on without a reply.
+#define COMMAND_ANSWER_TIMEOUT_MS 2000
+// Pause after a failed poll.
+#define COMMAND_RETRY_MS 2000
+// Room a poll leaves before the sleep deadline for its response and a reply.
+#define COMMAND_POLL_MARGIN_S 2
+
+static const char* command_log_tag = "commands";
+
+enum class command_kind : uint8_t
+{
+    status,
+    mute,
+    awake,
+    // Anything else that starts with a slash. Answered with the list of commands.
+    help
+};
+
+inline const char* command_kind_name(command_kind kind)
+{
+    switch(kind)
+    {
+        case command_kind::status:
+            return "status";
+        case command_kind::mute:
+            return "mute";
+        case command_kind::awake:
+            return "awake";
+        default:
+            return "help";
+    }
+}
+
+struct command_request
+{
+    command_kind kind;
+    // Minutes for mute and awake, -1 if none was given.
+    int32_t argument;
+    // When the poll that brought the command returned, esp_timer time. Latency is counted from here.
+    int64_t received_us;
+};
+
+// Reads "/mute 30" and the like, also "/mute@SomeBot 30" as group chats send it. Returns false for
+// text that is not a command.
+inline bool command_parse(const char* text, command_request& request)
+{
+    if(text[0] != '/')
+    {
+        return false;
+    }
+    const char* name = text + 1;
+    size_t name_length = strcspn(name, "@ ");
+    const char* rest = name + name_length;
+    rest += strcspn(rest, " ");
+    while(*rest == ' ')
+    {
+        rest++;
+    }
+
+    request = {};
+    request.argument = -1;
+    if(isdigit(static_cast<unsigned char>(*rest)))
+    {
+        long value = strtol(rest, nullptr, 10);
+        request.argument = value > INT32_MAX ? INT32_MAX : static_cast<int32_t>(value);
+    }
+
+    request.kind = command_kind::help;
+    for(command_kind kind : {command_kind::status, command_kind::mute, command_kind::awake})
+    {
+        const char* known = command_kind_name(kind);
+        if(strlen(known) == name_length && strncmp(known, name, name_length) == 0)
+        {
+            request.kind = kind;
+        }
+    }
+    return true;
+}
+
+// Where commands come from, such as Telegram getUpdates. Every hook runs on the command task, which
+// therefore owns the connection.
+struct command_transport
+{
+    // Names the source in logs.
+    const char* name;
+    // Waits up to timeout_s for commands and stores up to capacity of them. Returns how many, or -1 if the poll failed.
+    int (*poll)(int timeout_s, command_request* requests, size_t capacity);
+    // Answers the command taken last. Returns the HTTP status code, or -1 if no response arrived.
+    int (*reply)(const char* text);
+    void (*disconnect)();
+};
+
+/*
+    Receives remote commands on a task of its own while the chip is awake and online.
+
+    The task long-polls the transport, so a command arrives as soon as it is sent rather than at the
+    next poll, and hands each one to the main task through a queue, signalled by an event bit. The main
+    task acts on it and answers with answer(), which the task sends back. Round trips are timed from the
+    moment the poll returned to the moment the reply was acknowledged, and summed up when the task stops.
+
+    A poll never runs past the sleep deadline given with set_deadline(): its timeout is cut to what is left
+    of the awake window, so stop() on the way to deep sleep only waits for a poll that is about to end anyway.
+*/
+class command_channel
+{
+private:
+    enum class control_type : uint8_t
+    {
+        // Only wakes the task, e.g. after Wi-Fi came up or the deadline moved.
+        wake,
+        answer,
+        stop
+    };
+
+    struct control
+    {
+        control_type type;
+        char text[COMMAND_REPLY_MAX];
+    };
+
+    command_transport transport = {};
+    QueueHandle_t controls = nullptr;
+    QueueHandle_t requests = nullptr;
+    EventGroupHandle_t event_group = nullptr;
+    EventBits_t command_bit = 0;
+    EventBits_t stopped_bit = 0;
+    TaskHandle_t task_handle = nullptr;
+
+    std::atomic<bool> online{false};
+    std::atomic<int64_t> deadline_us{0};
+
+    // Owned by the command task.
+    command_request polled[COMMAND_POLL_MAX] = {};
+    uint32_t answered = 0;
+    int64_t latency_total_us = 0;
+    int64_t latency_max_us = 0;
+
+public:
+    command_channel() = default;
+    command_channel(command_channel const&) = delete;
+    command_channel& operator=(command_channel const&) = delete;
+
+    // Starts the task. command_bit is set in event_group whenever a command waits, stopped_bit once stop() is done.
+    void start(const command_transport& source, EventGroupHandle_t event_group_handle, EventBits_t command_event_bit, EventBits_t stopped_event_bit)
+    {
+        esp_log_level_set(command_log_tag, INTERCOM_LOG_LEVEL);
+        transport = source;
+        event_group = event_group_handle;
+        command_bit = command_event_bit;
+        stopped_bit = stopped_event_bit;
+        controls = xQueueCreate(4, sizeof(control));
+        requests = xQueueCreate(1, sizeof(command_request));
+        xTaskCreate(command_task_routine, "commands", CONFIG_INTERCOM_TELEGRAM_COMMAND_TASK_STACK, this, tskIDLE_PRIORITY + 1, &task_handle);
+    }
+
+    // Tells the task whether the network is up. It only polls while it is.
+    void set_online(bool is_online)
+    {
+        if(online.exchange(is_online) != is_online)
+        {
+            wake();
+        }
+    }
+
+    // When the chip goes to sleep, esp_timer time. Polls end before it.
+    void set_deadline(int64_t sleep_at_us)
+    {
+        if(deadline_us.exchange(sleep_at_us) < sleep_at_us)
+        {
+            wake();
+        }
+    }
+
+    // Takes the next command, if any. Call after command_bit was set and answer every command taken.
+    bool take(command_request& request)
+    {
+        return requests != nullptr && xQueueReceive(requests, &request, 0) == pdTRUE;
+    }
+
+    void answer(const char* text)
+    {
+        control c;
+        c.type = control_type::answer;
+        strncpy(c.text, text, sizeof(c.text) - 1);
+        c.text[sizeof(c.text) - 1] = '\0';
+        xQueueSend(controls, &c, 0);
+    }
+
+    // Ends the task after the poll in progress, e.g. before deep sleep.
+    void stop(TickType_t ticks_to_wait)
+    {
+        if(task_handle == nullptr)
+        {
+            return;
+        }
+        control c;
+        c.type = control_type::stop;
+        c.text[0] = '\0';
+        xQueueSendToFront(controls, &c, ticks_to_wait);
+        xEventGroupWaitBits(event_group, stopped_bit, pdTRUE, pdTRUE, ticks_to_wait);
+    }
+
+private:
+    static void command_task_routine(void* pvParameters)
+    {
+        command_channel* channel = static_cast<command_channel*>(pvParameters);
+        if(channel != nullptr)
+        {
+            channel->run();
+        }
+        vTaskDelete(nullptr);
+    }
+
+    void wake()
+    {
+        if(controls == nullptr)
+        {
+            return;
+        }
+        control c;
+        c.type = control_type::wake;
+        c.text[0] = '\0';
+        // A full queue wakes the task anyway.
+        xQueueSendToFront(controls, &c, 0);
+    }
+
+    void run()
+    {
+        while(true)
+        {
+            int timeout_s = poll_timeout_s();
+            // Waits for the network or a later deadline. Answers that come in here were given up on.
+            TickType_t wait = !online.load() || timeout_s < 1 ? portMAX_DELAY : 0;
+            control c;
+            bool stopping = false;
+            while(!stopping && xQueueReceive(controls, &c, wait) == pdTRUE)
+            {
+                stopping = c.type == control_type::stop;
+                wait = 0;
+            }
+            if(stopping)
+            {
+                shut_down();
+                return;
+            }
+            timeout_s = poll_timeout_s();
+            if(!online.load() || timeout_s < 1)
+            {
+                continue;
+            }
+
+            int count = transport.poll(timeout_s, polled, COMMAND_POLL_MAX);
+            if(count < 0)
+            {
+                if(xQueueReceive(controls, &c, pdMS_TO_TICKS(COMMAND_RETRY_MS)) == pdTRUE && c.type == control_type::stop)
+                {
+                    shut_down();
+                    return;
+                }
+                continue;
+            }
+            for(int i = 0; i < count; i++)
+            {
+                if(!handle(polled[i]))
+                {
+                    shut_down();
+                    return;
+                }
+            }
+        }
+    }
+
+    // Seconds a poll may wait from now, less than 1 if none fits before the deadline.
+    int poll_timeout_s() const
+    {
+        int64_t left_s = (deadline_us.load() - esp_timer_get_time()) / 1000000 - COMMAND_POLL_MARGIN_S;
+        return static_cast<int>(left_s < CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S ? left_s : CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S);
+    }
+
+    // Hands a command to the main task and sends its answer back. Returns false if the task is to stop.
+    bool handle(const command_request& request)
+    {
+        if(xQueueSend(requests, &request, 0) != pdTRUE)
+        {
+            ESP_LOGW(command_log_tag, "%s: /%s dropped, the last command is still unanswered", transport.name, command_kind_name(request.kind));
+            return true;
+        }
+        xEventGroupSetBits(event_group, command_bit);
+
+        control c;
+        int64_t wait_until = request.received_us + COMMAND_ANSWER_TIMEOUT_MS * 1000LL;
+        while(true)
+        {
+            int64_t left_us = wait_until - esp_timer_get_time();
+            if(left_us <= 0 || xQueueReceive(controls, &c, pdMS_TO_TICKS((left_us + 999) / 1000)) != pdTRUE)
+            {
+                ESP_LOGW(command_log_tag, "%s: /%s not answered within %d ms", transport.name, command_kind_name(request.kind), COMMAND_ANSWER_TIMEOUT_MS);
+                // Not taken: the main task is not to answer it late, in place of the next one.
+                command_request stale;
+                xQueueReceive(requests, &stale, 0);
+                return true;
+            }
+            if(c.type == control_type::stop)
+            {
+                return false;
+            }
+            if(c.type == control_type::answer)
+            {
+                break;
+            }
+        }
+
+        int64_t answered_at = esp_timer_get_time();
+        int status_code = transport.reply(c.text);
+        int64_t now = esp_timer_get_time();
+        int64_t latency_us = now - request.received_us;
+        ESP_LOGI(command_log_tag, "%s: /%s answered in %lld ms (%lld ms in the main task, %lld ms for the reply), status %d", transport.name,
+            command_kind_name(request.kind), static_cast<long long>(latency_us / 1000), static_cast<long long>((answered_at - request.received_us) / 1000),
+            static_cast<long long>((now - answered_at) / 1000), status_code);
+        if(status_code >= 200 && status_code < 300)
+        {
+            answered++;
+            latency_total_us += latency_us;
+            latency_max_us = latency_us > latency_max_us ? latency_us : latency_max_us;
+        }
+        return true;
+    }
+
+    void shut_down()
+    {
+        if(transport.disconnect != nullptr)
+        {
+            transport.disconnect();
+        }
+        if(answered > 0)
+        {
+            ESP_LOGI(command_log_tag, "%s: %lu command(s) answered this wake, round trip %lld ms on average, %lld ms at most", transport.name,
+                static_cast<unsigned long>(answered), static_cast<long long>(latency_total_us / answered / 1000), static_cast<long long>(latency_max_us / 1000));
+        }
+        task_handle = nullptr;
+        xEventGroupSetBits(event_group, stopped_bit);
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_attr.h"
+
+// One sensor edge as seen by the GPIO interrupt.
+struct edge_record
+{
+    // CPU cycle count, or the low bits of esp_timer time with CONFIG_INTERCOM_LIGHT_SLEEP.
+    uint32_t cycles;
+    uint8_t channel;
+    uint8_t level;
+};
+
+/*
+    Lock-free single-producer/single-consumer journal of sensor edges.
+
+    The GPIO interrupt is the only producer and the main task the only consumer. One handler on one
+    core serves every sensor line, so pushes never run concurrently.
+    head and tail are free-running counters: head is the number of records ever pushed, tail the number
+    consumed. An edge that does not fit is dropped and counted, the journal never blocks the interrupt.
+*/
+template<size_t Capacity>
+class edge_journal
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "edge_journal capacity must be a power of two");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "edge_journal requires lock-free 32-bit atomics");
+
+private:
+    edge_record records[Capacity] = {};
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<uint32_t> max_depth{0};
+
+public:
+    constexpr edge_journal() = default;
+    edge_journal(edge_journal const&) = delete;
+    edge_journal& operator=(edge_journal const&) = delete;
+
+    // Producer side. Safe to call from an IRAM interrupt handler.
+    bool IRAM_ATTR push(const edge_record& record)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t depth = h - tail.load(std::memory_order_acquire);
+        if(depth >= Capacity)
+        {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        records[h & (Capacity - 1)] = record;
+        head.store(h + 1, std::memory_order_release);
+        if(depth + 1 > max_depth.load(std::memory_order_relaxed))
+        {
+            max_depth.store(depth + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer side. Copies up to max_count of the oldest records into out and returns how many were copied.
+    size_t drain(edge_record* out, size_t max_count)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t available = head.load(std::memory_order_acquire) - t;
+        size_t count = available < max_count ? available : max_count;
+        for(size_t i = 0; i < count; i++)
+        {
+            out[i] = records[(t + i) & (Capacity - 1)];
+        }
+        tail.store(t + static_cast<uint32_t>(count), std::memory_order_release);
+        return count;
+    }
+
+    uint32_t recorded() const
+    {
+        return head.load(std::memory_order_acquire);
+    }
+
+    uint32_t overflows() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    // Deepest the journal has been since boot.
+    uint32_t high_watermark() const
+    {
+        return max_depth.load(std::memory_order_relaxed);
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+};
@@ -0,0 +1,366 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+
+#include <atomic>
+#include <initializer_list>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "log_level.h"
+
+#define ENERGY_ACCOUNT_MAGIC 0x454e4131
+#define ENERGY_DAY_US (24LL * 3600 * 1000000)
+// One mAh in microcoulombs, the unit charge is counted in.
+#define ENERGY_MAH_UC 3600000ULL
+
+static const char* energy_log_tag = "energy";
+
+// What the chip is doing, as far as its current draw goes. Every microsecond of a cycle is in exactly one of them.
+enum class energy_state : uint8_t
+{
+    deep_sleep,
+    // Awake with the radio off: boot, setup, sensor work, the flash writes before sleep.
+    cpu_active,
+    // From the Wi-Fi start request to association: driver init, RF calibration, scan and connect.
+    wifi_scan,
+    // Associated and waiting: DHCP, the keep-alive connections, the rest of the wake.
+    wifi_idle,
+    // TCP connect and TLS handshake, the CPU busy with the key exchange and the radio with the records.
+    tls,
+    // Automatic light sleep while every task waits, between the beacons if associated.
+    light_sleep,
+    count
+};
+
+inline const char* energy_state_name(energy_state state)
+{
+    switch(state)
+    {
+        case energy_state::deep_sleep:
+            return "sleep";
+        case energy_state::cpu_active:
+            return "cpu";
+        case energy_state::wifi_scan:
+            return "scan";
+        case energy_state::wifi_idle:
+            return "idle";
+        case energy_state::tls:
+            return "tls";
+        case energy_state::light_sleep:
+            return "light";
+        default:
+            return "unknown";
+    }
+}
+
+// Whole-board current in each state: deep and light sleep in uA, the rest in mA.
+struct energy_currents
+{
+    uint32_t sleep_ua;
+    uint32_t cpu_ma;
+    uint32_t wifi_scan_ma;
+    uint32_t wifi_idle_ma;
+    uint32_t tls_ma;
+    uint32_t light_sleep_ua;
+};
+
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+#define ENERGY_LIGHT_SLEEP_UA CONFIG_INTERCOM_ENERGY_LIGHT_SLEEP_UA
+#else
+// Nothing is booked to light sleep without it.
+#define ENERGY_LIGHT_SLEEP_UA 0
+#endif
+
+inline constexpr energy_currents energy_kconfig_currents =
+{
+    CONFIG_INTERCOM_ENERGY_SLEEP_UA, CONFIG_INTERCOM_ENERGY_CPU_MA, CONFIG_INTERCOM_ENERGY_WIFI_SCAN_MA,
+    CONFIG_INTERCOM_ENERGY_WIFI_IDLE_MA, CONFIG_INTERCOM_ENERGY_TLS_MA, ENERGY_LIGHT_SLEEP_UA
+};
+
+// Charge drawn in duration_us of state, in microcoulombs: uA times s, or mA times ms.
+constexpr uint64_t energy_charge_uc(energy_state state, uint64_t duration_us, const energy_currents& currents = energy_kconfig_currents)
+{
+    switch(state)
+    {
+        case energy_state::deep_sleep:
+            return currents.sleep_ua * duration_us / 1000000;
+        case energy_state::cpu_active:
+            return currents.cpu_ma * duration_us / 1000;
+        case energy_state::wifi_scan:
+            return currents.wifi_scan_ma * duration_us / 1000;
+        case energy_state::wifi_idle:
+            return currents.wifi_idle_ma * duration_us / 1000;
+        case energy_state::tls:
+            return currents.tls_ma * duration_us / 1000;
+        case energy_state::light_sleep:
+            return currents.light_sleep_ua * duration_us / 1000000;
+        default:
+            return 0;
+    }
+}
+
+struct energy_totals
+{
+    uint64_t state_us[static_cast<size_t>(energy_state::count)];
+    uint64_t charge_uc;
+    uint32_t wakes;
+};
+
+/*
+    Time and charge per power state, kept in RTC slow memory across deep sleep.
+
+    Meant to be declared RTC_DATA_ATTR, like wake_profile_log: magic tells a ledger written by an earlier wake
+    from the zeroed memory of a power-on. Days are 24 hour spans of the RTC clock from power-on, there is no
+    wall clock without SNTP. A wake counts with the sleep that led up to it, so wake is what one ring cost.
+*/
+struct energy_ledger
+{
+    uint32_t magic;
+    // RTC clock at the last deep sleep entry, -1 before the first.
+    int64_t sleep_entered_us;
+    int64_t day_started_us;
+    int64_t powered_on_us;
+    energy_totals wake;
+    energy_totals today;
+    energy_totals yesterday;
+    energy_totals total;
+};
+
+// Radio time of the current wake, kept by energy_radio. Not in RTC memory: a wake starts with the radio off.
+struct energy_meter
+{
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    energy_state radio = energy_state::cpu_active;
+    int64_t radio_since_us = 0;
+    uint64_t radio_us[static_cast<size_t>(energy_state::count)] = {};
+    // Part of radio_us spent in light sleep, by the radio state it slept in.
+    uint64_t light_us[static_cast<size_t>(energy_state::count)] = {};
+    std::atomic<uint64_t> tls_us{0};
+};
+
+// Defined in main.cpp, the ledger RTC_DATA_ATTR. Wi-Fi and TLS timings from every module go here.
+extern energy_ledger energy_account;
+extern energy_meter energy_wake;
+
+// The RTC clock keeps counting through deep sleep and starts over on power-on, gettimeofday reads it.
+inline int64_t energy_rtc_time_us()
+{
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+inline void energy_add(energy_ledger& ledger, energy_state state, uint64_t duration_us)
+{
+    uint64_t charge = energy_charge_uc(state, duration_us);
+    for(energy_totals* totals : {&ledger.wake, &ledger.today, &ledger.total})
+    {
+        totals->state_us[static_cast<size_t>(state)] += duration_us;
+        totals->charge_uc += charge;
+    }
+}
+
+// Starts the days that ended before now.
+inline void energy_roll_days(energy_ledger& ledger, int64_t now_us)
+{
+    while(now_us >= ledger.day_started_us + ENERGY_DAY_US)
+    {
+        ledger.yesterday = ledger.today;
+        memset(&ledger.today, 0, sizeof(ledger.today));
+        ledger.day_started_us += ENERGY_DAY_US;
+    }
+}
+
+// Books a sleep to the days it spans.
+inline void energy_add_sleep(energy_ledger& ledger, int64_t from_us, int64_t to_us)
+{
+    while(from_us < to_us)
+    {
+        energy_roll_days(ledger, from_us);
+        int64_t day_end = ledger.day_started_us + ENERGY_DAY_US;
+        int64_t until = to_us < day_end ? to_us : day_end;
+        energy_add(ledger, energy_state::deep_sleep, static_cast<uint64_t>(until - from_us));
+        from_us = until;
+    }
+}
+
+// Books the deep sleep that ended with this boot and starts the account of a new wake. Call first thing in app_main.
+inline void energy_begin(energy_ledger& ledger)
+{
+    int64_t now = energy_rtc_time_us();
+    // esp_timer counts from reset, so this is when the chip woke up.
+    int64_t woke_at = now - esp_timer_get_time();
+    if(ledger.magic != ENERGY_ACCOUNT_MAGIC)
+    {
+        memset(&ledger, 0, sizeof(ledger));
+        ledger.magic = ENERGY_ACCOUNT_MAGIC;
+        ledger.sleep_entered_us = -1;
+        ledger.day_started_us = woke_at;
+        ledger.powered_on_us = woke_at;
+    }
+    memset(&ledger.wake, 0, sizeof(ledger.wake));
+    if(ledger.sleep_entered_us >= 0 && woke_at > ledger.sleep_entered_us)
+    {
+        energy_add_sleep(ledger, ledger.sleep_entered_us, woke_at);
+    }
+    energy_roll_days(ledger, woke_at);
+    energy_wake.radio_since_us = esp_timer_get_time();
+}
+
+// Moves the radio into state: wifi_scan, wifi_idle, or cpu_active for off. Safe from any task.
+inline void energy_radio(energy_state state)
+{
+    int64_t now = esp_timer_get_time();
+    while(energy_wake.lock.test_and_set(std::memory_order_acquire))
+    {
+    }
+    energy_wake.radio_us[static_cast<size_t>(energy_wake.radio)] += static_cast<uint64_t>(now - energy_wake.radio_since_us);
+    energy_wake.radio = state;
+    energy_wake.radio_since_us = now;
+    energy_wake.lock.clear(std::memory_order_release);
+}
+
+// Follows association and loss of it. Runs on the event loop task; the radio is switched on by the Wi-Fi start.
+inline void energy_on_wifi_event(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    if(event_base != WIFI_EVENT)
+    {
+        return;
+    }
+    if(event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        energy_radio(energy_state::wifi_idle);
+    }
+    else if(event_id == WIFI_EVENT_STA_DISCONNECTED)
+    {
+        // wifi.c reconnects right away.
+        energy_radio(energy_state::wifi_scan);
+    }
+}
+
+inline void energy_add_tls(uint32_t duration_us)
+{
+    energy_wake.tls_us.fetch_add(duration_us, std::memory_order_relaxed);
+}
+
+/*
+    Takes sleep_us of light sleep out of the radio state it happened in. Called from the light sleep exit
+    callback with the scheduler stopped, so the task that may hold the lock runs on the other core.
+*/
+inline IRAM_ATTR void energy_add_light_sleep(uint64_t sleep_us)
+{
+    while(energy_wake.lock.test_and_set(std::memory_order_acquire))
+    {
+    }
+    energy_wake.light_us[static_cast<size_t>(energy_wake.radio)] += sleep_us;
+    energy_wake.lock.clear(std::memory_order_release);
+}
+
+/*
+    Charge of one second awake and associated with nothing to do: the average over the idle and light sleep
+    time since power-on, which has the beacon wakes in it, or the idle current before any.
+*/
+inline uint64_t energy_hold_uc_per_s(const energy_ledger& ledger)
+{
+    uint64_t idle_us = ledger.total.state_us[static_cast<size_t>(energy_state::wifi_idle)];
+    uint64_t light_us = ledger.total.state_us[static_cast<size_t>(energy_state::light_sleep)];
+    if(light_us == 0)
+    {
+        return energy_charge_uc(energy_state::wifi_idle, 1000000);
+    }
+    uint64_t charge_uc = energy_charge_uc(energy_state::wifi_idle, idle_us) + energy_charge_uc(energy_state::light_sleep, light_us);
+    return charge_uc * 1000000 / (idle_us + light_us);
+}
+
+// Prints charge as mAh with three decimals, without floating point.
+#define ENERGY_MAH_FORMAT "%llu.%03llu"
+#define ENERGY_MAH_ARGS(charge_uc) static_cast<unsigned long long>((charge_uc) / ENERGY_MAH_UC), \
+    static_cast<unsigned long long>((charge_uc) % ENERGY_MAH_UC * 1000 / ENERGY_MAH_UC)
+
+// Logs what the wake cost and where the day stands against the budget.
+inline void energy_report(const energy_ledger& ledger, int64_t now_us)
+{
+    esp_log_level_set(energy_log_tag, INTERCOM_LOG_LEVEL);
+    const energy_totals& wake = ledger.wake;
+    auto ms = [&wake](energy_state state) { return static_cast<unsigned long long>(wake.state_us[static_cast<size_t>(state)] / 1000); };
+    ESP_LOGI(energy_log_tag, "Wake %lu: " ENERGY_MAH_FORMAT " mAh after %llu s of sleep; awake ms: cpu %llu, scan %llu, idle %llu, tls %llu, light %llu",
+        static_cast<unsigned long>(ledger.total.wakes), ENERGY_MAH_ARGS(wake.charge_uc), ms(energy_state::deep_sleep) / 1000,
+        ms(energy_state::cpu_active), ms(energy_state::wifi_scan), ms(energy_state::wifi_idle), ms(energy_state::tls),
+        ms(energy_state::light_sleep));
+
+    // Battery life from the average since power-on, which a busy hour does not swing.
+    uint64_t powered_s = static_cast<uint64_t>((now_us - ledger.powered_on_us) / 1000000);
+    uint64_t daily_uc = powered_s > 0 ? ledger.total.charge_uc * (ENERGY_DAY_US / 1000000) / powered_s : 0;
+    uint64_t budget_uc = CONFIG_INTERCOM_ENERGY_DAILY_BUDGET_UAH * 3600ULL;
+    unsigned long days_left = daily_uc > 0 ? static_cast<unsigned long>(CONFIG_INTERCOM_ENERGY_BATTERY_MAH * ENERGY_MAH_UC / daily_uc) : 0;
+    esp_log_level_t level = ledger.today.charge_uc > budget_uc ? ESP_LOG_WARN : ESP_LOG_INFO;
+    ESP_LOG_LEVEL(level, energy_log_tag, "Day %lu h in: " ENERGY_MAH_FORMAT " of " ENERGY_MAH_FORMAT " mAh budget in %lu wake(s), yesterday "
+        ENERGY_MAH_FORMAT " mAh; " ENERGY_MAH_FORMAT " mAh a day since power-on, %lu day(s) on a %d mAh battery",
+        static_cast<unsigned long>((now_us - ledger.day_started_us) / 3600000000LL), ENERGY_MAH_ARGS(ledger.today.charge_uc), ENERGY_MAH_ARGS(budget_uc),
+        static_cast<unsigned long>(ledger.today.wakes), ENERGY_MAH_ARGS(ledger.yesterday.charge_uc), ENERGY_MAH_ARGS(daily_uc),
+        days_left, CONFIG_INTERCOM_ENERGY_BATTERY_MAH);
+}
+
+// Books the awake time of this wake and notes when the sleep starts. Call with the radio off, just before deep sleep.
+inline void energy_finish(energy_ledger& ledger)
+{
+    energy_radio(energy_state::cpu_active);
+    uint64_t awake_us = static_cast<uint64_t>(esp_timer_get_time());
+    uint64_t scan_us = energy_wake.radio_us[static_cast<size_t>(energy_state::wifi_scan)];
+    uint64_t associated_us = energy_wake.radio_us[static_cast<size_t>(energy_state::wifi_idle)];
+    uint64_t radio_us = scan_us + associated_us;
+    uint64_t cpu_us = awake_us > radio_us ? awake_us - radio_us : 0;
+
+    uint64_t light_us[static_cast<size_t>(energy_state::count)];
+    while(energy_wake.lock.test_and_set(std::memory_order_acquire))
+    {
+    }
+    memcpy(light_us, energy_wake.light_us, sizeof(light_us));
+    energy_wake.lock.clear(std::memory_order_release);
+    uint64_t slept_us = 0;
+    auto take_slept = [&](uint64_t& span_us, energy_state state)
+    {
+        uint64_t slept = light_us[static_cast<size_t>(state)];
+        slept = slept < span_us ? slept : span_us;
+        span_us -= slept;
+        slept_us += slept;
+    };
+    take_slept(cpu_us, energy_state::cpu_active);
+    take_slept(scan_us, energy_state::wifi_scan);
+    take_slept(associated_us, energy_state::wifi_idle);
+    // Handshakes happen while associated. A failed one may have lost the association half way.
+    uint64_t tls_us = energy_wake.tls_us.load();
+    tls_us = tls_us < associated_us ? tls_us : associated_us;
+
+    int64_t now = energy_rtc_time_us();
+    energy_roll_days(ledger, now);
+    energy_add(ledger, energy_state::cpu_active, cpu_us);
+    energy_add(ledger, energy_state::wifi_scan, scan_us);
+    energy_add(ledger, energy_state::wifi_idle, associated_us - tls_us);
+    energy_add(ledger, energy_state::tls, tls_us);
+    energy_add(ledger, energy_state::light_sleep, slept_us);
+    ledger.wake.wakes++;
+    ledger.today.wakes++;
+    ledger.total.wakes++;
+
+    energy_report(ledger, now);
+    ledger.sleep_entered_us = energy_rtc_time_us();
+}
+
+#define ENERGY_RADIO(state) energy_radio(state)
+#define ENERGY_TLS(duration_us) energy_add_tls(duration_us)
+
+#else
+
+#define ENERGY_RADIO(state) ((void)0)
+#define ENERGY_TLS(duration_us) ((void)(duration_us))
+
+#endif
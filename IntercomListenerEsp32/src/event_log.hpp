@@ -0,0 +1,904 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "log_level.h"
+
+static const char* event_log_tag = "events";
+
+// What a record is about. The meaning of flags and value depends on it.
+enum class event_kind : uint8_t
+{
+    // First boot with RTC memory lost. The clock starts over from here. value is the wake cause.
+    power_on = 1,
+    // A signal on a sensor line. flags holds the channel, EVENT_FLAG_COOLDOWN and EVENT_FLAG_MUTED, value the
+    // ms from reset to the start of the signal.
+    sensor,
+    // flags is the notification_kind, value the ms from the event to delivery.
+    notification_delivered,
+    // flags is the notification_kind, value the status code of the last attempt as int32_t.
+    notification_failed,
+    // flags is the event_error, value an esp_err_t or a count.
+    error
+};
+
+// flags of sensor records: the index in sensor_channels in the high nibble.
+#define EVENT_FLAG_COOLDOWN 0x01
+// Not notified because the chat muted notifications.
+#define EVENT_FLAG_MUTED 0x02
+#define EVENT_FLAG_CHANNEL(channel) ((channel) << 4)
+#define EVENT_FLAGS_CHANNEL(flags) ((flags) >> 4)
+
+enum class event_error : uint8_t
+{
+    wifi_connect = 1,
+    // value is the number of edges dropped since boot.
+    edge_journal_overflow,
+    // Events dropped because the log could not be written. value is the number dropped.
+    event_log_write
+};
+
+inline const char* event_kind_name(event_kind kind)
+{
+    switch(kind)
+    {
+        case event_kind::power_on:
+            return "power_on";
+        case event_kind::sensor:
+            return "sensor";
+        case event_kind::notification_delivered:
+            return "delivered";
+        case event_kind::notification_failed:
+            return "failed";
+        case event_kind::error:
+            return "error";
+        default:
+            return "unknown";
+    }
+}
+
+inline const char* event_error_name(event_error error)
+{
+    switch(error)
+    {
+        case event_error::wifi_connect:
+            return "wifi_connect";
+        case event_error::edge_journal_overflow:
+            return "edge_journal_overflow";
+        case event_error::event_log_write:
+            return "event_log_write";
+        default:
+            return "unknown";
+    }
+}
+
+// One event, 16 bytes: 254 of them fit a flash sector next to the segment header and footer.
+struct event_record
+{
+    // gettimeofday time. Without SNTP that is the time since power-on: the RTC timer keeps counting through
+    // deep sleep and starts over after a power loss, which a power_on record marks.
+    uint32_t time_s;
+    uint16_t time_ms;
+    event_kind kind;
+    uint8_t flags;
+    uint32_t value;
+    // Low bits of the wake cycle the event was recorded in.
+    uint16_t wake;
+    // CRC-16 of the bytes above. Protects against a write cut short by a reset.
+    uint16_t crc;
+};
+
+static_assert(sizeof(event_record) == 16, "event_record must stay 16 bytes, the on-flash format depends on it");
+
+// CRC-16/CCITT-FALSE. Bitwise: records are small and written a few at a time.
+inline uint16_t event_log_crc16(const void* data, size_t length)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint16_t crc = 0xffff;
+    for(size_t i = 0; i < length; i++)
+    {
+        crc ^= static_cast<uint16_t>(bytes[i]) << 8;
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// CRC-32 (IEEE). Continue a running CRC by passing it back in as crc.
+inline uint32_t event_log_crc32(const void* data, size_t length, uint32_t crc = 0)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+    {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+inline bool event_log_erased(const void* data, size_t length)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for(size_t i = 0; i < length; i++)
+    {
+        if(bytes[i] != 0xff)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void event_record_seal(event_record& record)
+{
+    record.crc = event_log_crc16(&record, offsetof(event_record, crc));
+}
+
+inline bool event_record_valid(const event_record& record)
+{
+    return !event_log_erased(&record, sizeof(record)) && record.crc == event_log_crc16(&record, offsetof(event_record, crc));
+}
+
+/*
+    On-flash layout: the partition is a ring of segments, one flash sector each. A segment starts with a
+    header in slot 0 and takes records in the slots after it, strictly in order, each written once. When
+    it is full, a footer in the last slot seals it with the time range and count of its records and a
+    CRC-32 over all of them, and the next segment is erased and opened with the next sequence number.
+    The log never rewrites a byte in place, so every sector is erased once per trip around the ring:
+    wear is spread evenly without bookkeeping, and the oldest segment is the one dropped.
+
+    The footers are the time index. A query reads two slots per sealed segment and only opens the
+    segments whose time range overlaps the one asked for.
+*/
+#define EVENT_LOG_PARTITION_LABEL "events"
+#define EVENT_LOG_PARTITION_SUBTYPE 0x40
+#define EVENT_LOG_SEGMENT_SIZE 4096
+#define EVENT_LOG_SLOTS (EVENT_LOG_SEGMENT_SIZE / sizeof(event_record))
+#define EVENT_LOG_FOOTER_SLOT (EVENT_LOG_SLOTS - 1)
+#define EVENT_LOG_RECORDS_PER_SEGMENT (EVENT_LOG_SLOTS - 2)
+// Segments beyond this are left unused, which keeps the index small: 64 sectors are 256 KiB.
+#define EVENT_LOG_MAX_SEGMENTS 64
+#define EVENT_LOG_SEGMENT_MAGIC 0x45564c31
+#define EVENT_LOG_FORMAT_VERSION 2
+
+struct event_segment_header
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint16_t record_size;
+    uint16_t version;
+    // CRC-32 of the bytes above.
+    uint32_t crc;
+};
+
+struct event_segment_footer
+{
+    uint32_t min_time_s;
+    uint32_t max_time_s;
+    // CRC-32 over the raw bytes of every record slot, written or not.
+    uint32_t records_crc;
+    uint16_t count;
+    // CRC-16 of the bytes above.
+    uint16_t crc;
+};
+
+static_assert(sizeof(event_segment_header) == sizeof(event_record) && sizeof(event_segment_footer) == sizeof(event_record),
+    "Segment header and footer take one record slot each");
+
+enum class event_segment_state : uint8_t
+{
+    erased,
+    // Has a header and takes records.
+    open,
+    // Full, with a valid footer.
+    sealed,
+    // A header that does not check out. Skipped, and reused when the ring comes around to it.
+    corrupt
+};
+
+struct event_segment_info
+{
+    event_segment_state state;
+    uint16_t count;
+    uint32_t sequence;
+    uint32_t min_time_s;
+    uint32_t max_time_s;
+};
+
+// Where the next record goes. sequence is that of the open segment, 0 before the first one.
+struct event_log_cursor
+{
+    uint32_t sequence;
+    uint16_t segment;
+    // Next free slot. EVENT_LOG_FOOTER_SLOT once the segment is full, EVENT_LOG_SLOTS once it is sealed.
+    uint16_t slot;
+};
+
+// Flash access, so the same code runs against a partition on the chip and against a dump on a PC.
+struct event_log_storage
+{
+    void* context;
+    size_t size;
+    esp_err_t (*read)(void* context, size_t offset, void* data, size_t length);
+    esp_err_t (*write)(void* context, size_t offset, const void* data, size_t length);
+    esp_err_t (*erase)(void* context, size_t offset, size_t length);
+};
+
+inline event_log_storage event_log_partition_storage(const esp_partition_t* partition)
+{
+    event_log_storage storage = {};
+    storage.context = const_cast<esp_partition_t*>(partition);
+    storage.size = partition->size;
+    storage.read = [](void* context, size_t offset, void* data, size_t length)
+    {
+        return esp_partition_read(static_cast<const esp_partition_t*>(context), offset, data, length);
+    };
+    storage.write = [](void* context, size_t offset, const void* data, size_t length)
+    {
+        return esp_partition_write(static_cast<const esp_partition_t*>(context), offset, data, length);
+    };
+    storage.erase = [](void* context, size_t offset, size_t length)
+    {
+        return esp_partition_erase_range(static_cast<const esp_partition_t*>(context), offset, length);
+    };
+    return storage;
+}
+
+/*
+    The segment ring on one storage. Not thread-safe.
+
+    scan() reads the header and footer of every segment and finds the end of the open one. resume()
+    instead trusts a cursor kept from an earlier boot, after checking the header of its segment and the
+    slot it points at; a cursor saved before a reset that cut a write short points at a written slot
+    and falls back to scan(). A scan treats such a torn record as used and carries on after it.
+*/
+class event_log_store
+{
+public:
+    static constexpr size_t chunk_records = 16;
+
+    void attach(const event_log_storage& target)
+    {
+        storage = target;
+        segment_count = storage.size / EVENT_LOG_SEGMENT_SIZE;
+        if(segment_count > EVENT_LOG_MAX_SEGMENTS)
+        {
+            segment_count = EVENT_LOG_MAX_SEGMENTS;
+        }
+        scanned = false;
+        cursor = {};
+    }
+
+    size_t segments() const
+    {
+        return segment_count;
+    }
+
+    // Valid after scan().
+    const event_segment_info& segment(size_t index) const
+    {
+        return infos[index];
+    }
+
+    const event_log_cursor& position() const
+    {
+        return cursor;
+    }
+
+    esp_err_t scan()
+    {
+        if(segment_count < 2)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        scanned = false;
+        cursor = {};
+        size_t newest = segment_count;
+        for(size_t index = 0; index < segment_count; index++)
+        {
+            esp_err_t err = read_info(index, infos[index]);
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            const event_segment_info& info = infos[index];
+            if((info.state == event_segment_state::open || info.state == event_segment_state::sealed)
+                && (newest == segment_count || info.sequence > infos[newest].sequence))
+            {
+                newest = index;
+            }
+        }
+
+        if(newest < segment_count)
+        {
+            cursor.sequence = infos[newest].sequence;
+            cursor.segment = static_cast<uint16_t>(newest);
+            if(infos[newest].state == event_segment_state::sealed)
+            {
+                cursor.slot = EVENT_LOG_SLOTS;
+            }
+            else
+            {
+                esp_err_t err = find_end(newest, cursor.slot);
+                if(err != ESP_OK)
+                {
+                    return err;
+                }
+            }
+        }
+        scanned = true;
+        return ESP_OK;
+    }
+
+    esp_err_t resume(const event_log_cursor& saved)
+    {
+        if(segment_count < 2)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if(saved.sequence != 0 && saved.segment < segment_count && saved.slot >= 1 && saved.slot <= EVENT_LOG_SLOTS)
+        {
+            event_segment_header header;
+            esp_err_t err = storage.read(storage.context, slot_offset(saved.segment, 0), &header, sizeof(header));
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            bool matches = header_valid(header) && header.sequence == saved.sequence;
+            if(matches && saved.slot < EVENT_LOG_SLOTS)
+            {
+                event_record slot;
+                err = storage.read(storage.context, slot_offset(saved.segment, saved.slot), &slot, sizeof(slot));
+                if(err != ESP_OK)
+                {
+                    return err;
+                }
+                matches = event_log_erased(&slot, sizeof(slot));
+            }
+            if(matches)
+            {
+                cursor = saved;
+                return ESP_OK;
+            }
+            ESP_LOGW(event_log_tag, "Saved position in segment %u does not match the flash, scanning", static_cast<unsigned>(saved.segment));
+        }
+        return scan();
+    }
+
+    // Writes the records in order, sealing and opening segments as they fill. Call scan() or resume() first.
+    esp_err_t append(const event_record* records, size_t count)
+    {
+        while(count > 0)
+        {
+            if(cursor.sequence == 0 || cursor.slot >= EVENT_LOG_FOOTER_SLOT)
+            {
+                esp_err_t err = open_next();
+                if(err != ESP_OK)
+                {
+                    return err;
+                }
+            }
+
+            size_t room = EVENT_LOG_FOOTER_SLOT - cursor.slot;
+            size_t batch = count < room ? count : room;
+            esp_err_t err = storage.write(storage.context, slot_offset(cursor.segment, cursor.slot), records, batch * sizeof(event_record));
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            if(scanned)
+            {
+                event_segment_info& info = infos[cursor.segment];
+                for(size_t i = 0; i < batch; i++)
+                {
+                    include(info, records[i]);
+                }
+            }
+            cursor.slot = static_cast<uint16_t>(cursor.slot + batch);
+            records += batch;
+            count -= batch;
+        }
+        return ESP_OK;
+    }
+
+    /*
+        Calls visit(record) for every intact record from from_s to to_s inclusive, oldest segment first and
+        in write order within a segment, until visit returns false. Scans first if needed. Returns the
+        number of records visited; segments_read, if given, counts the segments whose records were read.
+    */
+    template<typename visitor>
+    size_t query(uint32_t from_s, uint32_t to_s, visitor&& visit, size_t* segments_read = nullptr)
+    {
+        size_t visited = 0;
+        if(!scanned && scan() != ESP_OK)
+        {
+            return 0;
+        }
+
+        uint16_t order[EVENT_LOG_MAX_SEGMENTS];
+        size_t used = 0;
+        for(size_t index = 0; index < segment_count; index++)
+        {
+            const event_segment_info& info = infos[index];
+            if((info.state != event_segment_state::open && info.state != event_segment_state::sealed) || info.count == 0
+                || info.max_time_s < from_s || info.min_time_s > to_s)
+            {
+                continue;
+            }
+            // Insertion sort by sequence, the list is short.
+            size_t j = used++;
+            for(; j > 0 && infos[order[j - 1]].sequence > info.sequence; j--)
+            {
+                order[j] = order[j - 1];
+            }
+            order[j] = static_cast<uint16_t>(index);
+        }
+
+        for(size_t i = 0; i < used; i++)
+        {
+            if(segments_read != nullptr)
+            {
+                (*segments_read)++;
+            }
+            size_t end = order[i] == cursor.segment && cursor.slot < EVENT_LOG_FOOTER_SLOT ? cursor.slot : EVENT_LOG_FOOTER_SLOT;
+            event_record chunk[chunk_records];
+            for(size_t slot = 1; slot < end; slot += chunk_records)
+            {
+                size_t n = end - slot < chunk_records ? end - slot : chunk_records;
+                if(storage.read(storage.context, slot_offset(order[i], slot), chunk, n * sizeof(event_record)) != ESP_OK)
+                {
+                    return visited;
+                }
+                for(size_t k = 0; k < n; k++)
+                {
+                    const event_record& record = chunk[k];
+                    if(!event_record_valid(record) || record.time_s < from_s || record.time_s > to_s)
+                    {
+                        continue;
+                    }
+                    visited++;
+                    if(!visit(record))
+                    {
+                        return visited;
+                    }
+                }
+            }
+        }
+        return visited;
+    }
+
+    // Checks the CRC-32 in the footer of a sealed segment against its records.
+    esp_err_t verify(size_t index)
+    {
+        event_segment_footer footer;
+        esp_err_t err = storage.read(storage.context, slot_offset(index, EVENT_LOG_FOOTER_SLOT), &footer, sizeof(footer));
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        if(!footer_valid(footer))
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        uint32_t crc = 0;
+        err = fold_records(index, EVENT_LOG_FOOTER_SLOT, [&crc](const event_record* chunk, size_t n)
+        {
+            crc = event_log_crc32(chunk, n * sizeof(event_record), crc);
+        });
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        return crc == footer.records_crc ? ESP_OK : ESP_ERR_INVALID_CRC;
+    }
+
+private:
+    static size_t slot_offset(size_t index, size_t slot)
+    {
+        return index * EVENT_LOG_SEGMENT_SIZE + slot * sizeof(event_record);
+    }
+
+    static bool header_valid(const event_segment_header& header)
+    {
+        return header.magic == EVENT_LOG_SEGMENT_MAGIC && header.record_size == sizeof(event_record)
+            && header.version == EVENT_LOG_FORMAT_VERSION && header.sequence != 0
+            && header.crc == event_log_crc32(&header, offsetof(event_segment_header, crc));
+    }
+
+    static bool footer_valid(const event_segment_footer& footer)
+    {
+        return !event_log_erased(&footer, sizeof(footer)) && footer.crc == event_log_crc16(&footer, offsetof(event_segment_footer, crc));
+    }
+
+    static void include(event_segment_info& info, const event_record& record)
+    {
+        if(info.count == 0 || record.time_s < info.min_time_s)
+        {
+            info.min_time_s = record.time_s;
+        }
+        if(info.count == 0 || record.time_s > info.max_time_s)
+        {
+            info.max_time_s = record.time_s;
+        }
+        info.count++;
+    }
+
+    // Calls fold(chunk, n) over the raw record slots from 1 to end.
+    template<typename folder>
+    esp_err_t fold_records(size_t index, size_t end, folder&& fold)
+    {
+        event_record chunk[chunk_records];
+        for(size_t slot = 1; slot < end; slot += chunk_records)
+        {
+            size_t n = end - slot < chunk_records ? end - slot : chunk_records;
+            esp_err_t err = storage.read(storage.context, slot_offset(index, slot), chunk, n * sizeof(event_record));
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            fold(chunk, n);
+        }
+        return ESP_OK;
+    }
+
+    // Time range and count of the intact records in slots 1 to end.
+    esp_err_t summarize(size_t index, size_t end, event_segment_info& info)
+    {
+        info.count = 0;
+        info.min_time_s = 0;
+        info.max_time_s = 0;
+        return fold_records(index, end, [&info](const event_record* chunk, size_t n)
+        {
+            for(size_t k = 0; k < n; k++)
+            {
+                if(event_record_valid(chunk[k]))
+                {
+                    include(info, chunk[k]);
+                }
+            }
+        });
+    }
+
+    esp_err_t read_info(size_t index, event_segment_info& info)
+    {
+        info = {};
+        event_segment_header header;
+        esp_err_t err = storage.read(storage.context, slot_offset(index, 0), &header, sizeof(header));
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        if(event_log_erased(&header, sizeof(header)))
+        {
+            info.state = event_segment_state::erased;
+            return ESP_OK;
+        }
+        if(!header_valid(header))
+        {
+            info.state = event_segment_state::corrupt;
+            return ESP_OK;
+        }
+        info.sequence = header.sequence;
+
+        event_segment_footer footer;
+        err = storage.read(storage.context, slot_offset(index, EVENT_LOG_FOOTER_SLOT), &footer, sizeof(footer));
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        if(footer_valid(footer))
+        {
+            info.state = event_segment_state::sealed;
+            info.count = footer.count;
+            info.min_time_s = footer.min_time_s;
+            info.max_time_s = footer.max_time_s;
+            return ESP_OK;
+        }
+
+        // Open, or full with a footer cut short by a reset. Either way the records tell the time range.
+        uint16_t end;
+        err = find_end(index, end);
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        info.state = event_segment_state::open;
+        return summarize(index, end, info);
+    }
+
+    // First erased slot of a segment, by bisection: slots are written in order. EVENT_LOG_FOOTER_SLOT when full.
+    esp_err_t find_end(size_t index, uint16_t& end)
+    {
+        size_t low = 1;
+        size_t high = EVENT_LOG_FOOTER_SLOT;
+        while(low < high)
+        {
+            size_t middle = (low + high) / 2;
+            event_record slot;
+            esp_err_t err = storage.read(storage.context, slot_offset(index, middle), &slot, sizeof(slot));
+            if(err != ESP_OK)
+            {
+                return err;
+            }
+            if(event_log_erased(&slot, sizeof(slot)))
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        end = static_cast<uint16_t>(low);
+        return ESP_OK;
+    }
+
+    esp_err_t seal(size_t index)
+    {
+        event_segment_info info = {};
+        event_segment_footer footer = {};
+        esp_err_t err = fold_records(index, EVENT_LOG_FOOTER_SLOT, [&](const event_record* chunk, size_t n)
+        {
+            footer.records_crc = event_log_crc32(chunk, n * sizeof(event_record), footer.records_crc);
+            for(size_t k = 0; k < n; k++)
+            {
+                if(event_record_valid(chunk[k]))
+                {
+                    include(info, chunk[k]);
+                }
+            }
+        });
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        footer.min_time_s = info.min_time_s;
+        footer.max_time_s = info.max_time_s;
+        footer.count = info.count;
+        footer.crc = event_log_crc16(&footer, offsetof(event_segment_footer, crc));
+        err = storage.write(storage.context, slot_offset(index, EVENT_LOG_FOOTER_SLOT), &footer, sizeof(footer));
+        if(err == ESP_OK && scanned)
+        {
+            infos[index].state = event_segment_state::sealed;
+        }
+        return err;
+    }
+
+    // Seals the full segment, if any, then erases the one after it and starts it with the next sequence number.
+    esp_err_t open_next()
+    {
+        size_t index = 0;
+        uint32_t sequence = 1;
+        if(cursor.sequence != 0)
+        {
+            if(cursor.slot == EVENT_LOG_FOOTER_SLOT)
+            {
+                esp_err_t err = seal(cursor.segment);
+                if(err != ESP_OK)
+                {
+                    return err;
+                }
+            }
+            index = (cursor.segment + 1) % segment_count;
+            sequence = cursor.sequence + 1;
+        }
+
+        esp_err_t err = storage.erase(storage.context, index * EVENT_LOG_SEGMENT_SIZE, EVENT_LOG_SEGMENT_SIZE);
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        event_segment_header header = {EVENT_LOG_SEGMENT_MAGIC, sequence, sizeof(event_record), EVENT_LOG_FORMAT_VERSION, 0};
+        header.crc = event_log_crc32(&header, offsetof(event_segment_header, crc));
+        err = storage.write(storage.context, slot_offset(index, 0), &header, sizeof(header));
+        if(err != ESP_OK)
+        {
+            return err;
+        }
+        if(scanned)
+        {
+            infos[index] = {event_segment_state::open, 0, sequence, 0, 0};
+        }
+        cursor = {sequence, static_cast<uint16_t>(index), 1};
+        return ESP_OK;
+    }
+
+    event_log_storage storage = {};
+    size_t segment_count = 0;
+    bool scanned = false;
+    event_log_cursor cursor = {};
+    event_segment_info infos[EVENT_LOG_MAX_SEGMENTS];
+};
+
+#if CONFIG_INTERCOM_EVENT_LOG
+
+#define EVENT_LOG_MAGIC 0x45564c53
+// Room for a second batch, so a busy wake does not write in the middle of handling the events.
+#define EVENT_LOG_PENDING (2 * CONFIG_INTERCOM_EVENT_LOG_BATCH)
+
+/*
+    Events not written yet and where the next ones go, kept in RTC slow memory.
+
+    Meant to be declared RTC_DATA_ATTR, like wake_profile_log: magic tells state left by an earlier wake
+    from the zeroed memory of a power-on. Events collect here across wakes and reach flash in batches,
+    so most wakes do not touch flash at all, and a flush needs no scan thanks to the saved cursor.
+*/
+struct event_log_state
+{
+    uint32_t magic;
+    uint16_t wake;
+    uint16_t pending_count;
+    // Events lost to flash errors since power-on.
+    uint32_t dropped;
+    event_log_cursor cursor;
+    event_record pending[EVENT_LOG_PENDING];
+};
+
+/*
+    The event history of the device. Records go to RTC memory right away and to the "events" partition
+    once CONFIG_INTERCOM_EVENT_LOG_BATCH of them are pending on the way to deep sleep, or whenever the
+    buffer is full. For the main task only.
+*/
+class event_log
+{
+public:
+    // Call once per boot, before the first record. Returns true on power-on, when RTC memory starts blank.
+    bool begin(event_log_state& rtc_state)
+    {
+        esp_log_level_set(event_log_tag, INTERCOM_LOG_LEVEL);
+        state = &rtc_state;
+        bool power_on = state->magic != EVENT_LOG_MAGIC;
+        if(power_on)
+        {
+            memset(state, 0, sizeof(*state));
+            state->magic = EVENT_LOG_MAGIC;
+        }
+        state->wake++;
+        return power_on;
+    }
+
+    // Records an event that happened at timestamp_us, esp_timer time. -1 means now.
+    void record(event_kind kind, uint8_t flags, uint32_t value, int64_t timestamp_us = -1)
+    {
+        if(state == nullptr)
+        {
+            return;
+        }
+
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        int64_t time_us = static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_usec;
+        if(timestamp_us >= 0)
+        {
+            time_us -= esp_timer_get_time() - timestamp_us;
+        }
+        if(time_us < 0)
+        {
+            time_us = 0;
+        }
+
+        if(state->pending_count == EVENT_LOG_PENDING && flush(true) != ESP_OK)
+        {
+            // Keeps the newest events. The count goes out with the next successful write.
+            memmove(state->pending, state->pending + 1, (EVENT_LOG_PENDING - 1) * sizeof(event_record));
+            state->pending_count--;
+            state->dropped++;
+        }
+
+        event_record& record = state->pending[state->pending_count++];
+        record.time_s = static_cast<uint32_t>(time_us / 1000000);
+        record.time_ms = static_cast<uint16_t>(time_us / 1000 % 1000);
+        record.kind = kind;
+        record.flags = flags;
+        record.value = value;
+        record.wake = state->wake;
+        event_record_seal(record);
+    }
+
+    // Writes the pending events once a batch is complete, or whatever is pending if force is set.
+    esp_err_t flush(bool force)
+    {
+        if(state == nullptr || state->pending_count == 0 || (!force && state->pending_count < CONFIG_INTERCOM_EVENT_LOG_BATCH))
+        {
+            return ESP_OK;
+        }
+        esp_err_t err = attach();
+        if(err == ESP_OK)
+        {
+            err = store.resume(state->cursor);
+        }
+        if(err == ESP_OK)
+        {
+            err = store.append(state->pending, state->pending_count);
+        }
+        if(err != ESP_OK)
+        {
+            ESP_LOGW(event_log_tag, "Writing %u event(s) failed: %s", static_cast<unsigned>(state->pending_count), esp_err_to_name(err));
+            return err;
+        }
+
+        ESP_LOGI(event_log_tag, "Wrote %u event(s), segment %lu slot %u", static_cast<unsigned>(state->pending_count),
+            static_cast<unsigned long>(store.position().sequence), static_cast<unsigned>(store.position().slot));
+        state->cursor = store.position();
+        state->pending_count = 0;
+        if(state->dropped > 0)
+        {
+            uint32_t dropped = state->dropped;
+            state->dropped = 0;
+            record(event_kind::error, static_cast<uint8_t>(event_error::event_log_write), dropped);
+        }
+        return ESP_OK;
+    }
+
+    // Like event_log_store::query, over flash and then the events still pending. Reads every segment header.
+    template<typename visitor>
+    size_t query(uint32_t from_s, uint32_t to_s, visitor&& visit)
+    {
+        size_t visited = 0;
+        bool more = true;
+        auto forward = [&](const event_record& record)
+        {
+            more = visit(record);
+            return more;
+        };
+        if(attach() == ESP_OK && store.scan() == ESP_OK)
+        {
+            visited = store.query(from_s, to_s, forward);
+        }
+        for(size_t i = 0; more && state != nullptr && i < state->pending_count; i++)
+        {
+            const event_record& record = state->pending[i];
+            if(record.time_s >= from_s && record.time_s <= to_s)
+            {
+                visited++;
+                forward(record);
+            }
+        }
+        return visited;
+    }
+
+private:
+    esp_err_t attach()
+    {
+        if(partition != nullptr)
+        {
+            return ESP_OK;
+        }
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, static_cast<esp_partition_subtype_t>(EVENT_LOG_PARTITION_SUBTYPE),
+            EVENT_LOG_PARTITION_LABEL);
+        if(partition == nullptr)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        store.attach(event_log_partition_storage(partition));
+        return ESP_OK;
+    }
+
+    event_log_state* state = nullptr;
+    const esp_partition_t* partition = nullptr;
+    event_log_store store;
+};
+
+// Defined in main.cpp, next to its RTC_DATA_ATTR state.
+extern event_log event_history;
+
+#define EVENT_LOG(kind, flags, value, timestamp_us) event_history.record((kind), static_cast<uint8_t>(flags), static_cast<uint32_t>(value), (timestamp_us))
+
+#else
+
+#define EVENT_LOG(kind, flags, value, timestamp_us) ((void)(flags), (void)(value), (void)(timestamp_us))
+
+#endif
@@ -5,12 +5,23 @@
 #include "freertos/queue.h"
 
 #define EVENT_TIMER_ALARM BIT0
-#define EVENT_RING_SENSOR_START BIT1
-#define EVENT_RING_SENSOR_END BIT2
+// A burst completed on one of the RMT captures, or the tone of one was recognised by the ADC capture.
+#define EVENT_SENSOR_BURST BIT1
+// The line of an open burst went quiet for long enough to close it.
+#define EVENT_BURST_DEADLINE BIT2
 #define EVENT_WIFI_CONNECTED BIT3
 #define EVENT_WIFI_DISCONNECTED BIT4
 #define EVENT_WIFI_FAIL BIT5
-#define EVENT_DOOR_SENSOR_START BIT6
-#define EVENT_DOOR_SENSOR_END BIT7
+#define EVENT_SENSOR_EDGE BIT8
+#define EVENT_NOTIFICATION_RESULT BIT9
+// Not part of EVENT_ALL: only waited for while going to sleep.
+#define EVENT_NOTIFICATION_STOPPED BIT10
+// Not part of EVENT_ALL: clear while wifi_init_sta runs on the Wi-Fi start task.
+#define EVENT_WIFI_STARTED BIT11
 
-#define EVENT_ALL (BIT0 | BIT1 | BIT2 | BIT3 | BIT4 | BIT5 | BIT6 | BIT7)
+// A remote command waits for the main task.
+#define EVENT_COMMAND BIT12
+// Not part of EVENT_ALL: only waited for while going to sleep.
+#define EVENT_COMMANDS_STOPPED BIT13
+
+#define EVENT_ALL (BIT0 | BIT1 | BIT2 | BIT3 | BIT4 | BIT5 | BIT8 | BIT9 | BIT12)
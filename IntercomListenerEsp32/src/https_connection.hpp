@@ -0,0 +1,611 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include "log_level.h"
+#include "tls_transport.hpp"
+#include "energy_account.hpp"
+#include "wake_profile.hpp"
+#if CONFIG_INTERCOM_WAKE_PROFILE
+#include "lwip/netdb.h"
+#endif
+
+#define HTTPS_CONNECTION_PORT 443
+#define HTTPS_CONNECTION_TIMEOUT_MS 10000
+#define HTTPS_CONNECTION_HEAD_BUFFER 512
+#define HTTPS_CONNECTION_RESPONSE_BUFFER 512
+
+// What request() returns when no status code came back. The request did not go out in full, so the server cannot have acted on it.
+#define HTTPS_STATUS_NOT_SENT -1
+// The request went out but no response arrived, so the server may or may not have acted on it.
+#define HTTPS_STATUS_NO_RESPONSE -2
+
+static const char* https_log_tag = "https";
+
+class https_connection;
+
+// A request body that is written piece by piece instead of being held in memory. write() hands every piece
+// to https_connection::write_body() and returns false to abandon the request. It runs once per request,
+// since a request is only retried when none of it went out. A length of HTTPS_BODY_CHUNKED sends the body
+// with chunked transfer encoding, for a producer that does not know its size up front.
+#define HTTPS_BODY_CHUNKED -1
+
+struct https_body_source
+{
+    int length;
+    bool (*write)(https_connection& connection, void* context);
+    void* context;
+};
+
+// Takes the body of a response piece by piece as it is read, straight from the receive buffer, instead of
+// response() keeping its first HTTPS_CONNECTION_RESPONSE_BUFFER bytes.
+struct https_body_sink
+{
+    void (*read)(const char* data, int length, void* context);
+    void* context;
+};
+
+// How the body of the last request from a https_body_source went out.
+struct https_upload_stats
+{
+    // Body bytes handed to write_body(), without chunk framing.
+    int bytes;
+    // From the request head to the last byte of the body.
+    int64_t duration_us;
+    // Internal heap taken during the upload beyond what was in use at its start, at the lowest point.
+    size_t heap_used;
+    bool chunked;
+};
+
+/*
+    One long-lived HTTPS/1.1 connection to a single host, on a tls_transport.
+
+    The socket and TLS session stay open between requests unless the server answers "Connection: close",
+    so every request after the first skips DNS, TCP and the TLS handshake. The connection can be opened
+    ahead of time with warm_up(). The server or a NAT may have dropped it while idle, so a reused connection
+    is checked before the request goes out, and a request that fails on one before any of it was written is
+    retried once on a fresh one. A request that failed after that may have reached the server, e.g. when
+    only the response was lost, and is not repeated here: the caller owns retries and deduplication.
+    Response bodies may come with a Content-Length or in chunked transfer encoding; a response that
+    gives neither on a kept-alive connection is taken as it stands and the connection closed.
+
+    A tls_transport rather than esp_http_client because it keeps the client session. Given a
+    tls_session_slot in RTC memory, the session is saved after every handshake and offered on the next
+    connect, also after deep sleep, so the server can resume it without a certificate chain or key exchange.
+*/
+class https_connection
+{
+private:
+    const char* host;
+    tls_session_slot* session_slot;
+    int timeout_ms;
+    const https_body_sink* body_sink = nullptr;
+    tls_transport transport;
+    int64_t last_activity = -1;
+    // Bytes of the request in progress that went out.
+    int request_written = 0;
+    uint32_t connections_opened = 0;
+    uint32_t requests_sent = 0;
+
+    https_upload_stats upload = {};
+    size_t upload_heap_free = 0;
+
+    char receive_buffer[HTTPS_CONNECTION_HEAD_BUFFER + 1] = {0};
+    // Bytes of the response read into receive_buffer but not taken yet.
+    int unread_start = 0;
+    int unread_end = 0;
+    char response_buffer[HTTPS_CONNECTION_RESPONSE_BUFFER + 1] = {0};
+    int response_length = 0;
+
+public:
+    // timeout_ms bounds connecting and every read, so it must exceed the time the server may hold a long poll.
+    explicit https_connection(const char* hostname, tls_session_slot* slot = nullptr, int read_timeout_ms = HTTPS_CONNECTION_TIMEOUT_MS)
+        : host(hostname), session_slot(slot), timeout_ms(read_timeout_ms)
+    {
+    }
+
+    https_connection(https_connection const&) = delete;
+    https_connection& operator=(https_connection const&) = delete;
+
+    ~https_connection()
+    {
+        close();
+    }
+
+    // Sends a request and returns the HTTP status code, or HTTPS_STATUS_NOT_SENT or HTTPS_STATUS_NO_RESPONSE.
+    int request(const char* method, const char* path, const char* content_type = nullptr, const char* body = nullptr, int body_length = 0)
+    {
+        return request(method, path, content_type, body, body_length, nullptr);
+    }
+
+    // Same, with the body written by source while the request goes out.
+    int request(const char* method, const char* path, const char* content_type, const https_body_source& source)
+    {
+        return request(method, path, content_type, nullptr, source.length, &source);
+    }
+
+    // Same, with the response body handed to sink as it arrives. response() stays empty.
+    int request(const char* method, const char* path, const https_body_sink& sink)
+    {
+        body_sink = &sink;
+        int status_code = request(method, path, nullptr, nullptr, 0, nullptr);
+        body_sink = nullptr;
+        return status_code;
+    }
+
+    // Writes a piece of the body of a request in progress. Only valid inside https_body_source::write.
+    // On a chunked body every piece goes out as one chunk.
+    bool write_body(const void* data, int length)
+    {
+        if(!transport.is_open())
+        {
+            return false;
+        }
+        if(length <= 0)
+        {
+            // A zero size chunk would end the body.
+            return true;
+        }
+        if(upload.chunked)
+        {
+            char size[12];
+            int size_length = snprintf(size, sizeof(size), "%x\r\n", static_cast<unsigned>(length));
+            if(!write_all(size, size_length) || !write_all(static_cast<const char*>(data), length) || !write_all("\r\n", 2))
+            {
+                return false;
+            }
+        }
+        else if(!write_all(static_cast<const char*>(data), length))
+        {
+            return false;
+        }
+        upload.bytes += length;
+        size_t heap_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        if(heap_free < upload_heap_free && upload_heap_free - heap_free > upload.heap_used)
+        {
+            upload.heap_used = upload_heap_free - heap_free;
+        }
+        return true;
+    }
+
+    // Opens the connection and completes the TLS handshake with a cheap request, so the next one is a single round trip.
+    bool warm_up(const char* path)
+    {
+        if(transport.is_open())
+        {
+            return true;
+        }
+        int64_t start = esp_timer_get_time();
+        int status_code = request("GET", path);
+        ESP_LOGI(https_log_tag, "Connection to %s warmed up in %lld ms, status %d", host, static_cast<long long>((esp_timer_get_time() - start) / 1000), status_code);
+        return status_code > 0;
+    }
+
+    // Refreshes an idle connection before the server times it out. Cheap no-op otherwise.
+    void keep_warm(const char* path, int64_t max_idle_us)
+    {
+        if(transport.is_open() && esp_timer_get_time() - last_activity > max_idle_us)
+        {
+            ESP_LOGD(https_log_tag, "Refreshing idle connection to %s", host);
+            request("GET", path);
+        }
+    }
+
+    // Drops the socket, e.g. when Wi-Fi went down. The next request reconnects. The saved session is kept.
+    void close()
+    {
+        transport.close();
+    }
+
+    bool is_connected() const
+    {
+        return transport.is_open();
+    }
+
+    const char* response() const
+    {
+        return response_buffer;
+    }
+
+    int response_size() const
+    {
+        return response_length;
+    }
+
+    uint32_t connection_count() const
+    {
+        return connections_opened;
+    }
+
+    uint32_t request_count() const
+    {
+        return requests_sent;
+    }
+
+    const https_upload_stats& upload_stats() const
+    {
+        return upload;
+    }
+
+private:
+    int request(const char* method, const char* path, const char* content_type, const char* body, int body_length, const https_body_source* source)
+    {
+        if(transport.is_open() && is_stale())
+        {
+            ESP_LOGW(https_log_tag, "Kept-alive connection to %s was closed while idle, reconnecting", host);
+            close();
+        }
+        bool reused = transport.is_open();
+        int status_code = exchange(method, path, content_type, body, body_length, source);
+        if(status_code < 0 && reused && request_written == 0)
+        {
+            ESP_LOGW(https_log_tag, "Request on kept-alive connection to %s failed before it went out, reconnecting", host);
+            close();
+            status_code = exchange(method, path, content_type, body, body_length, source);
+        }
+
+        if(status_code < 0)
+        {
+            ESP_LOGE(https_log_tag, "Request to %s failed, %s", host, status_code == HTTPS_STATUS_NO_RESPONSE ? "no response" : "not sent");
+            return status_code;
+        }
+
+        ESP_LOGD(https_log_tag, "%s %d, %d byte(s), connection %s", host, status_code, response_length, reused ? "reused" : "new");
+        return status_code;
+    }
+
+    bool connect()
+    {
+        esp_log_level_set(https_log_tag, INTERCOM_LOG_LEVEL);
+        esp_log_level_set(tls_log_tag, INTERCOM_LOG_LEVEL);
+
+#if CONFIG_INTERCOM_WAKE_PROFILE
+        // Resolved here only to time the lookup on its own. The connect then finds the address in the lwIP DNS cache.
+        int64_t lookup_start = esp_timer_get_time();
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if(getaddrinfo(host, nullptr, &hints, &addresses) == 0)
+        {
+            freeaddrinfo(addresses);
+            WAKE_PROBE(wake_phase::dns, lookup_start);
+        }
+#endif
+
+        int64_t start = esp_timer_get_time();
+        bool connected = transport.open(host, HTTPS_CONNECTION_PORT, true, timeout_ms, session_slot);
+        uint32_t duration_us = transport.connect_us();
+        // Failed handshakes cost as much.
+        ENERGY_TLS(duration_us);
+        bool offered = transport.session_offered();
+        bool resumed = transport.session_resumed();
+
+        if(!connected)
+        {
+            ESP_LOGE(https_log_tag, "Could not connect to %s", host);
+            return false;
+        }
+
+        connections_opened++;
+        WAKE_PROBE_DETAIL(wake_phase::tls_connect, start, resumed);
+        ESP_LOGI(https_log_tag, "Connected to %s in %lu ms, %s handshake%s", host, static_cast<unsigned long>(duration_us / 1000),
+            resumed ? "resumed" : "full", offered && !resumed ? " (session rejected)" : "");
+        return true;
+    }
+
+    // Whether the idle connection was closed or reset by the other end. An idle connection has nothing to
+    // read, so anything readable, the end of the stream included, means it cannot take another request.
+    bool is_stale()
+    {
+        char byte;
+        ssize_t peeked = recv(transport.socket(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return peeked >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+
+    bool write_all(const char* data, int length)
+    {
+        while(length > 0)
+        {
+            ssize_t written = transport.write(data, length);
+            if(written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            length -= written;
+            request_written += written;
+        }
+        return true;
+    }
+
+    // One request and its response. Returns the status code, or HTTPS_STATUS_NOT_SENT or HTTPS_STATUS_NO_RESPONSE
+    // depending on whether the connection failed before or after the request was out.
+    int exchange(const char* method, const char* path, const char* content_type, const char* body, int body_length, const https_body_source* source)
+    {
+        request_written = 0;
+        if(!transport.is_open() && !connect())
+        {
+            return HTTPS_STATUS_NOT_SENT;
+        }
+
+        bool chunked = source != nullptr && source->length == HTTPS_BODY_CHUNKED;
+        char length_header[32];
+        snprintf(length_header, sizeof(length_header), chunked ? "Transfer-Encoding: chunked" : "Content-Length: %d", body_length);
+        char head[HTTPS_CONNECTION_HEAD_BUFFER];
+        int head_length = snprintf(head, sizeof(head),
+            "%s %s HTTP/1.1\r\n"
+            "Host: %s\r\n"
+            "User-Agent: IntercomListener\r\n"
+            "%s%s%s"
+            "%s\r\n\r\n",
+            method, path, host,
+            content_type != nullptr ? "Content-Type: " : "", content_type != nullptr ? content_type : "", content_type != nullptr ? "\r\n" : "",
+            length_header);
+        if(head_length >= static_cast<int>(sizeof(head)))
+        {
+            ESP_LOGE(https_log_tag, "Request head for %s does not fit %d bytes", path, HTTPS_CONNECTION_HEAD_BUFFER);
+            return HTTPS_STATUS_NOT_SENT;
+        }
+
+        requests_sent++;
+        int64_t sent_at = esp_timer_get_time();
+        bool sent = write_all(head, head_length);
+        if(sent && source != nullptr)
+        {
+            upload = {};
+            upload.chunked = chunked;
+            upload_heap_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+            sent = source->write(*this, source->context) && (!chunked || write_all("0\r\n\r\n", 5));
+            upload.duration_us = esp_timer_get_time() - sent_at;
+        }
+        else if(sent && body_length > 0)
+        {
+            sent = write_all(body, body_length);
+        }
+        if(!sent)
+        {
+            close();
+            return HTTPS_STATUS_NOT_SENT;
+        }
+
+        int status_code = read_response();
+        last_activity = esp_timer_get_time();
+        if(status_code < 0)
+        {
+            return HTTPS_STATUS_NO_RESPONSE;
+        }
+        // A long poll takes as long as the server holds it, which says nothing about the network.
+        if(body_sink == nullptr)
+        {
+            WAKE_PROBE(wake_phase::http_response, sent_at);
+        }
+        return status_code;
+    }
+
+    /*
+        Reads the response head and body. The body is kept up to HTTPS_CONNECTION_RESPONSE_BUFFER bytes, the rest is
+        discarded. Interim 1xx responses are skipped; 204 and 304 have no body. A body runs for its Content-Length,
+        is decoded from chunked transfer encoding, or runs until the server closes the connection if it said it would.
+        A kept-alive response with none of these has no end to wait for: the connection is closed instead.
+    */
+    int read_response()
+    {
+        response_length = 0;
+        response_buffer[0] = '\0';
+        unread_start = 0;
+        unread_end = 0;
+
+        int status_code = -1;
+        int minor_version = 1;
+        long content_length = -1;
+        bool chunked = false;
+        bool server_closes = false;
+        do
+        {
+            char* line = take_line();
+            if(line == nullptr || sscanf(line, "HTTP/1.%d %d", &minor_version, &status_code) != 2)
+            {
+                close();
+                return -1;
+            }
+            content_length = -1;
+            chunked = false;
+            // HTTP/1.0 closes after every response unless asked to keep the connection.
+            server_closes = minor_version == 0;
+            while((line = take_line()) != nullptr && *line != '\0')
+            {
+                const char* value = line + strcspn(line, ":");
+                value += *value == ':' ? 1 + strspn(value + 1, " ") : 0;
+                if(strncasecmp(line, "Content-Length:", 15) == 0)
+                {
+                    content_length = strtol(value, nullptr, 10);
+                }
+                else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+                {
+                    chunked = strstr(value, "chunked") != nullptr;
+                }
+                else if(strncasecmp(line, "Connection:", 11) == 0)
+                {
+                    server_closes = strncasecmp(value, "close", 5) == 0 || (server_closes && strncasecmp(value, "keep-alive", 10) != 0);
+                }
+            }
+            if(line == nullptr)
+            {
+                close();
+                return -1;
+            }
+        }
+        while(status_code >= 100 && status_code < 200);
+
+        bool complete;
+        if(status_code == 204 || status_code == 304)
+        {
+            complete = true;
+        }
+        else if(chunked)
+        {
+            complete = take_chunked_body();
+        }
+        else if(content_length >= 0)
+        {
+            complete = take_body(content_length);
+        }
+        else if(server_closes)
+        {
+            // The body runs until the server closes the connection.
+            while(take_body(HTTPS_CONNECTION_HEAD_BUFFER))
+            {
+            }
+            close();
+            return status_code;
+        }
+        else
+        {
+            ESP_LOGW(https_log_tag, "Response %d from %s has no length on a kept-alive connection, closing it", status_code, host);
+            keep_body(receive_buffer + unread_start, unread_end - unread_start);
+            close();
+            return status_code;
+        }
+
+        if(!complete)
+        {
+            close();
+            return -1;
+        }
+        if(server_closes)
+        {
+            close();
+        }
+        return status_code;
+    }
+
+    // Reads more of the response into receive_buffer, after the bytes not taken yet, which move to its start.
+    // Returns false if the connection failed or ended, or the buffer is full.
+    bool fill()
+    {
+        if(unread_start > 0)
+        {
+            memmove(receive_buffer, receive_buffer + unread_start, unread_end - unread_start);
+            unread_end -= unread_start;
+            unread_start = 0;
+        }
+        if(unread_end == HTTPS_CONNECTION_HEAD_BUFFER)
+        {
+            return false;
+        }
+        ssize_t count = transport.read(receive_buffer + unread_end, HTTPS_CONNECTION_HEAD_BUFFER - unread_end);
+        if(count <= 0)
+        {
+            return false;
+        }
+        unread_end += count;
+        return true;
+    }
+
+    // Takes the next line of the head or of the chunk framing, without its CRLF. Valid until the next call.
+    // nullptr if the connection failed first or the line does not fit the buffer.
+    char* take_line()
+    {
+        int scanned = unread_start;
+        while(true)
+        {
+            for(; scanned + 1 < unread_end; scanned++)
+            {
+                if(receive_buffer[scanned] == '\r' && receive_buffer[scanned + 1] == '\n')
+                {
+                    char* line = receive_buffer + unread_start;
+                    receive_buffer[scanned] = '\0';
+                    unread_start = scanned + 2;
+                    return line;
+                }
+            }
+            scanned -= unread_start;
+            if(!fill())
+            {
+                if(unread_end == HTTPS_CONNECTION_HEAD_BUFFER)
+                {
+                    ESP_LOGE(https_log_tag, "Response line from %s does not fit %d bytes", host, HTTPS_CONNECTION_HEAD_BUFFER);
+                }
+                return nullptr;
+            }
+        }
+    }
+
+    // Hands the next length bytes of the body to keep_body. Returns false if the connection failed or ended first.
+    bool take_body(long length)
+    {
+        while(length > 0)
+        {
+            if(unread_start == unread_end && !fill())
+            {
+                return false;
+            }
+            long count = unread_end - unread_start < length ? unread_end - unread_start : length;
+            keep_body(receive_buffer + unread_start, count);
+            unread_start += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    // Takes a body in chunked transfer encoding: chunks of a hex size line and data, a chunk of size 0, and trailers
+    // up to an empty line. Only the data reaches keep_body.
+    bool take_chunked_body()
+    {
+        while(true)
+        {
+            char* line = take_line();
+            if(line == nullptr)
+            {
+                return false;
+            }
+            char* end = nullptr;
+            unsigned long size = strtoul(line, &end, 16);
+            if(end == line)
+            {
+                ESP_LOGE(https_log_tag, "Malformed chunk size from %s", host);
+                return false;
+            }
+            if(size == 0)
+            {
+                break;
+            }
+            if(!take_body(static_cast<long>(size)) || (line = take_line()) == nullptr || *line != '\0')
+            {
+                return false;
+            }
+        }
+        char* trailer;
+        while((trailer = take_line()) != nullptr && *trailer != '\0')
+        {
+        }
+        return trailer != nullptr;
+    }
+
+    void keep_body(const char* data, long length)
+    {
+        if(body_sink != nullptr)
+        {
+            if(length > 0)
+            {
+                body_sink->read(data, static_cast<int>(length), body_sink->context);
+            }
+            return;
+        }
+        long copied = length < HTTPS_CONNECTION_RESPONSE_BUFFER - response_length ? length : HTTPS_CONNECTION_RESPONSE_BUFFER - response_length;
+        if(copied > 0)
+        {
+            memcpy(response_buffer + response_length, data, copied);
+            response_length += copied;
+            response_buffer[response_length] = '\0';
+        }
+    }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// One block of mono IMA-ADPCM as WAV lays it out: a four byte header that holds the first sample and the
+// step index, then two samples per byte, the earlier one in the low nibble.
+#define IMA_ADPCM_BLOCK_BYTES 256
+#define IMA_ADPCM_BLOCK_SAMPLES ((IMA_ADPCM_BLOCK_BYTES - 4) * 2 + 1)
+// RIFF header, fmt chunk with the samples per block, fact chunk and the head of the data chunk.
+#define IMA_ADPCM_WAV_HEADER_BYTES 60
+
+static constexpr int16_t ima_adpcm_steps[89] =
+{
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060,
+    1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+    7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static constexpr int8_t ima_adpcm_index_steps[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+// Moves predictor and index by one code, as encoder and decoder both do.
+inline void ima_adpcm_step(uint8_t code, int32_t& predictor, int& index)
+{
+    int32_t step = ima_adpcm_steps[index];
+    int32_t difference = step >> 3;
+    if(code & 4)
+    {
+        difference += step;
+    }
+    if(code & 2)
+    {
+        difference += step >> 1;
+    }
+    if(code & 1)
+    {
+        difference += step >> 2;
+    }
+    predictor += code & 8 ? -difference : difference;
+    predictor = predictor > INT16_MAX ? INT16_MAX : predictor < INT16_MIN ? INT16_MIN : predictor;
+    index += ima_adpcm_index_steps[code];
+    index = index < 0 ? 0 : index > 88 ? 88 : index;
+}
+
+/*
+    Encodes 16 bit samples into IMA-ADPCM blocks one sample at a time, four bits each.
+
+    Every block starts over from the sample in its header, so blocks decode on their own and a clip can
+    start at any of them. The step index carries over from one block to the next.
+*/
+class ima_adpcm_encoder
+{
+private:
+    uint8_t data[IMA_ADPCM_BLOCK_BYTES] = {};
+    size_t filled = 0;
+    int32_t predictor = 0;
+    int index = 0;
+
+public:
+    // Feeds one sample. Returns true when it completes a block, which block() holds until the next call.
+    bool push(int16_t sample)
+    {
+        if(filled == 0)
+        {
+            predictor = sample;
+            data[0] = static_cast<uint8_t>(sample);
+            data[1] = static_cast<uint8_t>(static_cast<uint16_t>(sample) >> 8);
+            data[2] = static_cast<uint8_t>(index);
+            data[3] = 0;
+            filled = 1;
+            return false;
+        }
+
+        uint8_t code = encode(sample);
+        uint8_t& byte = data[4 + (filled - 1) / 2];
+        byte = (filled - 1) % 2 == 0 ? code : static_cast<uint8_t>(byte | code << 4);
+        if(++filled < IMA_ADPCM_BLOCK_SAMPLES)
+        {
+            return false;
+        }
+        filled = 0;
+        return true;
+    }
+
+    const uint8_t* block() const
+    {
+        return data;
+    }
+
+private:
+    uint8_t encode(int16_t sample)
+    {
+        int32_t difference = sample - predictor;
+        uint8_t code = 0;
+        if(difference < 0)
+        {
+            code = 8;
+            difference = -difference;
+        }
+        int32_t step = ima_adpcm_steps[index];
+        if(difference >= step)
+        {
+            code |= 4;
+            difference -= step;
+        }
+        if(difference >= step >> 1)
+        {
+            code |= 2;
+            difference -= step >> 1;
+        }
+        if(difference >= step >> 2)
+        {
+            code |= 1;
+        }
+        ima_adpcm_step(code, predictor, index);
+        return code;
+    }
+};
+
+// Decodes one block into IMA_ADPCM_BLOCK_SAMPLES samples. The firmware only encodes; tools and the bench listen.
+inline void ima_adpcm_decode_block(const uint8_t* block, int16_t* samples)
+{
+    int32_t predictor = static_cast<int16_t>(block[0] | block[1] << 8);
+    int index = block[2] > 88 ? 88 : block[2];
+    samples[0] = static_cast<int16_t>(predictor);
+    for(size_t i = 1; i < IMA_ADPCM_BLOCK_SAMPLES; i++)
+    {
+        uint8_t byte = block[4 + (i - 1) / 2];
+        ima_adpcm_step((i - 1) % 2 == 0 ? byte & 0x0f : byte >> 4, predictor, index);
+        samples[i] = static_cast<int16_t>(predictor);
+    }
+}
+
+// Writes the header of a mono IMA-ADPCM WAV file of blocks blocks at sample_rate_hz.
+inline void ima_adpcm_wav_header(uint8_t (&header)[IMA_ADPCM_WAV_HEADER_BYTES], uint32_t sample_rate_hz, uint32_t blocks)
+{
+    uint32_t data_bytes = blocks * IMA_ADPCM_BLOCK_BYTES;
+    uint8_t* p = header;
+    auto bytes = [&p](const char* text)
+    {
+        memcpy(p, text, 4);
+        p += 4;
+    };
+    auto u16 = [&p](uint32_t value)
+    {
+        *p++ = static_cast<uint8_t>(value);
+        *p++ = static_cast<uint8_t>(value >> 8);
+    };
+    auto u32 = [&u16](uint32_t value)
+    {
+        u16(value & 0xffff);
+        u16(value >> 16);
+    };
+
+    bytes("RIFF");
+    u32(IMA_ADPCM_WAV_HEADER_BYTES - 8 + data_bytes);
+    bytes("WAVE");
+    bytes("fmt ");
+    u32(20);
+    // WAVE_FORMAT_IMA_ADPCM, mono.
+    u16(0x0011);
+    u16(1);
+    u32(sample_rate_hz);
+    u32(static_cast<uint32_t>(static_cast<uint64_t>(sample_rate_hz) * IMA_ADPCM_BLOCK_BYTES / IMA_ADPCM_BLOCK_SAMPLES));
+    u16(IMA_ADPCM_BLOCK_BYTES);
+    u16(4);
+    u16(2);
+    u16(IMA_ADPCM_BLOCK_SAMPLES);
+    bytes("fact");
+    u32(4);
+    u32(blocks * IMA_ADPCM_BLOCK_SAMPLES);
+    bytes("data");
+    u32(data_bytes);
+}
@@ -0,0 +1,545 @@
+#pragma once
+
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Containers nested deeper than this are still parsed, but values in them match no path.
+#define JSON_READER_DEPTH_MAX 8
+// Nesting beyond this is refused.
+#define JSON_READER_NESTING_MAX 32
+// Longest key kept for path matching, terminator included. Longer keys match nothing.
+#define JSON_READER_KEY_MAX 16
+
+// Where the value being read sits: one frame per enclosing container, with the key or index of the value in it.
+class json_path
+{
+public:
+    struct frame
+    {
+        bool array;
+        bool truncated;
+        uint16_t index;
+        char key[JSON_READER_KEY_MAX];
+    };
+
+    // Whether the path is exactly keys, outermost first. "[]" stands for any index of an array.
+    bool is(std::initializer_list<const char*> keys) const
+    {
+        if(keys.size() != depth || depth > JSON_READER_DEPTH_MAX)
+        {
+            return false;
+        }
+        const frame* f = frames;
+        for(const char* key : keys)
+        {
+            if(f->array ? strcmp(key, "[]") != 0 : f->truncated || strcmp(key, f->key) != 0)
+            {
+                return false;
+            }
+            f++;
+        }
+        return true;
+    }
+
+    size_t depth = 0;
+    frame frames[JSON_READER_DEPTH_MAX] = {};
+};
+
+// Callbacks of json_reader. Derive and hide the ones of interest; the reader calls them on the derived type.
+struct json_reader_handler
+{
+    // A piece of a string value as it lies in the input, escapes decoded. last is set on the final piece,
+    // which may be empty.
+    void on_string(const json_path&, const char*, size_t, bool) {}
+    // A number. integer is false if it had a fraction or exponent; value then holds its integer part.
+    void on_number(const json_path&, int64_t, bool) {}
+    // true, false or null, the latter as false.
+    void on_literal(const json_path&, bool) {}
+    // The object or array at path ended.
+    void on_end(const json_path&) {}
+};
+
+/*
+    Parses JSON as it arrives, one piece at a time, without a document tree and without copying values.
+
+    feed() takes the input in pieces of any size, such as the reads from a connection, and calls the handler
+    for every value with its path. String values are handed over as they lie in the piece, in several calls
+    if they span pieces or contain escapes; only keys are copied, into the path. State is a few hundred bytes
+    whatever the size of the document. The first syntax error stops the reader and ok() turns false.
+*/
+class json_reader
+{
+private:
+    enum class state : uint8_t
+    {
+        value,
+        // After '[': a value or ']'.
+        value_or_end,
+        // After '{': a key or '}'.
+        key_or_end,
+        key,
+        colon,
+        after_value,
+        string,
+        escape,
+        unicode,
+        number,
+        literal,
+        done,
+        failed
+    };
+
+    json_path path;
+    // One bit per open container, set for arrays, including those deeper than the path keeps.
+    uint32_t nesting = 0;
+    size_t open = 0;
+    state current = state::value;
+
+    bool reading_key = false;
+    size_t key_length = 0;
+    // \u escapes: the hex digits read and a high surrogate waiting for its low half.
+    uint8_t hex_digits = 0;
+    uint32_t code_point = 0;
+    uint32_t high_surrogate = 0;
+
+    int64_t number = 0;
+    bool negative = false;
+    bool integer = true;
+    bool fraction = false;
+
+    const char* literal_text = nullptr;
+    size_t literal_matched = 0;
+
+public:
+    template<typename handler>
+    bool feed(const char* data, size_t length, handler& h)
+    {
+        const char* end = data + length;
+        const char* p = data;
+        while(p < end && current != state::failed)
+        {
+            switch(current)
+            {
+                case state::string:
+                    p = read_string(p, end, h);
+                    continue;
+                case state::number:
+                    if(read_number(*p))
+                    {
+                        p++;
+                        continue;
+                    }
+                    // The character after a number belongs to what follows it.
+                    finish_number(h);
+                    continue;
+                case state::literal:
+                    read_literal(*p++, h);
+                    continue;
+                case state::escape:
+                    read_escape(*p++, h);
+                    continue;
+                case state::unicode:
+                    read_unicode(*p++, h);
+                    continue;
+                default:
+                    break;
+            }
+
+            char c = *p++;
+            if(c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            {
+                continue;
+            }
+            structural(c, h);
+        }
+        return current != state::failed;
+    }
+
+    // Ends the input. A number at the very end of it is only complete here.
+    template<typename handler>
+    bool finish(handler& h)
+    {
+        if(current == state::number)
+        {
+            finish_number(h);
+        }
+        if(current != state::done)
+        {
+            current = state::failed;
+        }
+        return ok();
+    }
+
+    bool ok() const
+    {
+        return current != state::failed;
+    }
+
+    bool complete() const
+    {
+        return current == state::done;
+    }
+
+private:
+    template<typename handler>
+    void structural(char c, handler& h)
+    {
+        switch(current)
+        {
+            case state::value:
+            case state::value_or_end:
+                if(current == state::value_or_end && c == ']')
+                {
+                    close(h);
+                    return;
+                }
+                begin_value(c, h);
+                return;
+            case state::key_or_end:
+            case state::key:
+                if(current == state::key_or_end && c == '}')
+                {
+                    close(h);
+                    return;
+                }
+                if(c != '"')
+                {
+                    fail();
+                    return;
+                }
+                reading_key = true;
+                key_length = 0;
+                if(path.depth <= JSON_READER_DEPTH_MAX)
+                {
+                    json_path::frame& f = path.frames[path.depth - 1];
+                    f.key[0] = '\0';
+                    f.truncated = false;
+                }
+                current = state::string;
+                return;
+            case state::colon:
+                current = c == ':' ? state::value : state::failed;
+                return;
+            case state::after_value:
+            {
+                bool in_array = (nesting >> (open - 1)) & 1;
+                if(c == ',')
+                {
+                    if(in_array && path.depth <= JSON_READER_DEPTH_MAX)
+                    {
+                        path.frames[path.depth - 1].index++;
+                    }
+                    current = in_array ? state::value : state::key;
+                }
+                else if(c == (in_array ? ']' : '}'))
+                {
+                    close(h);
+                }
+                else
+                {
+                    fail();
+                }
+                return;
+            }
+            default:
+                // Anything but whitespace after the document.
+                fail();
+                return;
+        }
+    }
+
+    template<typename handler>
+    void begin_value(char c, handler& h)
+    {
+        if(c == '{' || c == '[')
+        {
+            if(open == JSON_READER_NESTING_MAX)
+            {
+                fail();
+                return;
+            }
+            bool array = c == '[';
+            nesting = array ? nesting | (1u << open) : nesting & ~(1u << open);
+            open++;
+            if(++path.depth <= JSON_READER_DEPTH_MAX)
+            {
+                json_path::frame& f = path.frames[path.depth - 1];
+                f = {};
+                f.array = array;
+            }
+            current = array ? state::value_or_end : state::key_or_end;
+        }
+        else if(c == '"')
+        {
+            reading_key = false;
+            current = state::string;
+        }
+        else if(c == '-' || (c >= '0' && c <= '9'))
+        {
+            number = 0;
+            negative = c == '-';
+            integer = true;
+            fraction = false;
+            current = state::number;
+            if(!negative)
+            {
+                read_number(c);
+            }
+        }
+        else if(c == 't' || c == 'f' || c == 'n')
+        {
+            literal_text = c == 't' ? "true" : c == 'f' ? "false" : "null";
+            literal_matched = 1;
+            current = state::literal;
+        }
+        else
+        {
+            fail();
+        }
+    }
+
+    template<typename handler>
+    void close(handler& h)
+    {
+        open--;
+        path.depth--;
+        h.on_end(path);
+        value_done();
+    }
+
+    void value_done()
+    {
+        current = open == 0 ? state::done : state::after_value;
+    }
+
+    void fail()
+    {
+        current = state::failed;
+    }
+
+    // Hands over the run of plain characters up to the next quote or backslash.
+    template<typename handler>
+    const char* read_string(const char* p, const char* end, handler& h)
+    {
+        const char* run = p;
+        while(p < end && *p != '"' && *p != '\\')
+        {
+            if(static_cast<unsigned char>(*p) < 0x20)
+            {
+                fail();
+                return end;
+            }
+            p++;
+        }
+        if(p > run)
+        {
+            string_piece(run, p - run, false, h);
+        }
+        if(p == end)
+        {
+            return p;
+        }
+        if(*p == '\\')
+        {
+            current = state::escape;
+            return p + 1;
+        }
+        // The closing quote.
+        if(high_surrogate != 0)
+        {
+            high_surrogate = 0;
+            emit_code_point(0xfffd, h);
+        }
+        string_piece(p, 0, true, h);
+        if(reading_key)
+        {
+            current = state::colon;
+        }
+        else
+        {
+            value_done();
+        }
+        return p + 1;
+    }
+
+    template<typename handler>
+    void string_piece(const char* data, size_t length, bool last, handler& h)
+    {
+        if(high_surrogate != 0 && length > 0)
+        {
+            // A high surrogate not followed by an escaped low one.
+            high_surrogate = 0;
+            emit_piece("\xef\xbf\xbd", 3, false, h);
+        }
+        emit_piece(data, length, last, h);
+    }
+
+    template<typename handler>
+    void emit_piece(const char* data, size_t length, bool last, handler& h)
+    {
+        if(!reading_key)
+        {
+            h.on_string(path, data, length, last);
+            return;
+        }
+        if(path.depth > JSON_READER_DEPTH_MAX)
+        {
+            return;
+        }
+        json_path::frame& f = path.frames[path.depth - 1];
+        if(key_length + length >= JSON_READER_KEY_MAX)
+        {
+            f.truncated = true;
+            return;
+        }
+        memcpy(f.key + key_length, data, length);
+        key_length += length;
+        f.key[key_length] = '\0';
+    }
+
+    template<typename handler>
+    void read_escape(char c, handler& h)
+    {
+        current = state::string;
+        char decoded;
+        switch(c)
+        {
+            case '"': decoded = '"'; break;
+            case '\\': decoded = '\\'; break;
+            case '/': decoded = '/'; break;
+            case 'b': decoded = '\b'; break;
+            case 'f': decoded = '\f'; break;
+            case 'n': decoded = '\n'; break;
+            case 'r': decoded = '\r'; break;
+            case 't': decoded = '\t'; break;
+            case 'u':
+                hex_digits = 0;
+                code_point = 0;
+                current = state::unicode;
+                return;
+            default:
+                fail();
+                return;
+        }
+        string_piece(&decoded, 1, false, h);
+    }
+
+    template<typename handler>
+    void read_unicode(char c, handler& h)
+    {
+        uint32_t digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 16;
+        if(digit == 16)
+        {
+            fail();
+            return;
+        }
+        code_point = code_point << 4 | digit;
+        if(++hex_digits < 4)
+        {
+            return;
+        }
+        current = state::string;
+
+        if(code_point >= 0xd800 && code_point < 0xdc00)
+        {
+            if(high_surrogate != 0)
+            {
+                emit_code_point(0xfffd, h);
+            }
+            high_surrogate = code_point;
+            return;
+        }
+        if(code_point >= 0xdc00 && code_point < 0xe000)
+        {
+            uint32_t high = high_surrogate;
+            high_surrogate = 0;
+            emit_code_point(high != 0 ? 0x10000 + ((high - 0xd800) << 10) + (code_point - 0xdc00) : 0xfffd, h);
+            return;
+        }
+        if(high_surrogate != 0)
+        {
+            high_surrogate = 0;
+            emit_code_point(0xfffd, h);
+        }
+        emit_code_point(code_point, h);
+    }
+
+    // UTF-8 of one code point, handed over like any other piece.
+    template<typename handler>
+    void emit_code_point(uint32_t value, handler& h)
+    {
+        char utf8[4];
+        size_t length;
+        if(value < 0x80)
+        {
+            utf8[0] = static_cast<char>(value);
+            length = 1;
+        }
+        else if(value < 0x800)
+        {
+            utf8[0] = static_cast<char>(0xc0 | value >> 6);
+            utf8[1] = static_cast<char>(0x80 | (value & 0x3f));
+            length = 2;
+        }
+        else if(value < 0x10000)
+        {
+            utf8[0] = static_cast<char>(0xe0 | value >> 12);
+            utf8[1] = static_cast<char>(0x80 | ((value >> 6) & 0x3f));
+            utf8[2] = static_cast<char>(0x80 | (value & 0x3f));
+            length = 3;
+        }
+        else
+        {
+            utf8[0] = static_cast<char>(0xf0 | value >> 18);
+            utf8[1] = static_cast<char>(0x80 | ((value >> 12) & 0x3f));
+            utf8[2] = static_cast<char>(0x80 | ((value >> 6) & 0x3f));
+            utf8[3] = static_cast<char>(0x80 | (value & 0x3f));
+            length = 4;
+        }
+        emit_piece(utf8, length, false, h);
+    }
+
+    // Takes one more character of a number. Returns false at the first one that is not part of it.
+    bool read_number(char c)
+    {
+        if(c >= '0' && c <= '9')
+        {
+            if(!fraction)
+            {
+                number = number > (INT64_MAX - 9) / 10 ? INT64_MAX : number * 10 + (c - '0');
+            }
+            return true;
+        }
+        if(c == '.' || c == 'e' || c == 'E' || ((c == '+' || c == '-') && fraction))
+        {
+            integer = false;
+            fraction = true;
+            return true;
+        }
+        return false;
+    }
+
+    template<typename handler>
+    void finish_number(handler& h)
+    {
+        h.on_number(path, negative ? -number : number, integer);
+        value_done();
+    }
+
+    template<typename handler>
+    void read_literal(char c, handler& h)
+    {
+        if(c != literal_text[literal_matched])
+        {
+            fail();
+            return;
+        }
+        if(literal_text[++literal_matched] == '\0')
+        {
+            h.on_literal(path, literal_text[0] == 't');
+            value_done();
+        }
+    }
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Longest escape of one byte: a control character becomes \u00XX.
+#define JSON_ESCAPE_MAX 6
+
+constexpr size_t json_escaped_size(char c)
+{
+    return c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t' ? 2
+        : static_cast<unsigned char>(c) < 0x20 ? JSON_ESCAPE_MAX : 1;
+}
+
+// Escaped length of a string, usable on literals and Kconfig strings at compile time.
+constexpr size_t json_escaped_length(const char* text)
+{
+    size_t length = 0;
+    for(; *text != '\0'; text++)
+    {
+        length += json_escaped_size(*text);
+    }
+    return length;
+}
+
+// Upper bound of the escaped length of any string of length bytes.
+constexpr size_t json_escaped_max(size_t length)
+{
+    return length * JSON_ESCAPE_MAX;
+}
+
+/*
+    Writes JSON straight into a caller-provided buffer, without allocating.
+
+    Size the buffer at compile time from json_escaped_length and json_escaped_max so the worst case
+    fits; the writer still checks every byte and refuses to run past the end, so ok() is false
+    rather than memory being overwritten if a size calculation was wrong. Keys are literals
+    and written as they are.
+*/
+class json_writer
+{
+private:
+    char* buffer;
+    size_t capacity;
+    size_t length = 0;
+    bool overflow = false;
+    bool first = true;
+
+public:
+    template<size_t N>
+    explicit json_writer(char (&storage)[N])
+        : buffer(storage), capacity(N - 1)
+    {
+        static_assert(N > 1, "json_writer needs room for the terminator");
+        buffer[0] = '\0';
+    }
+
+    json_writer& begin_object()
+    {
+        separate();
+        put('{');
+        first = true;
+        return *this;
+    }
+
+    json_writer& end_object()
+    {
+        put('}');
+        first = false;
+        return *this;
+    }
+
+    template<size_t K>
+    json_writer& key(const char (&name)[K])
+    {
+        separate();
+        put('"');
+        append(name, K - 1);
+        append("\":", 2);
+        first = true;
+        return *this;
+    }
+
+    json_writer& string(const char* value)
+    {
+        separate();
+        put('"');
+        for(const char* c = value; *c != '\0'; c++)
+        {
+            escape(*c);
+        }
+        put('"');
+        return *this;
+    }
+
+    json_writer& number(int64_t value)
+    {
+        separate();
+        char digits[21];
+        size_t count = 0;
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do
+        {
+            digits[count++] = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        }
+        while(magnitude > 0);
+        if(value < 0)
+        {
+            put('-');
+        }
+        while(count > 0)
+        {
+            put(digits[--count]);
+        }
+        return *this;
+    }
+
+    json_writer& boolean(bool value)
+    {
+        separate();
+        if(value)
+        {
+            append("true", 4);
+        }
+        else
+        {
+            append("false", 5);
+        }
+        return *this;
+    }
+
+    bool ok() const
+    {
+        return !overflow;
+    }
+
+    const char* data() const
+    {
+        return buffer;
+    }
+
+    int size() const
+    {
+        return static_cast<int>(length);
+    }
+
+private:
+    // A comma before every value or key but the first in an object. A value right after its key needs none.
+    void separate()
+    {
+        if(!first)
+        {
+            put(',');
+        }
+        first = false;
+    }
+
+    void put(char c)
+    {
+        if(length >= capacity)
+        {
+            overflow = true;
+            return;
+        }
+        buffer[length++] = c;
+        buffer[length] = '\0';
+    }
+
+    void append(const char* text, size_t count)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            put(text[i]);
+        }
+    }
+
+    void escape(char c)
+    {
+        switch(c)
+        {
+            case '"': append("\\\"", 2); return;
+            case '\\': append("\\\\", 2); return;
+            case '\b': append("\\b", 2); return;
+            case '\f': append("\\f", 2); return;
+            case '\n': append("\\n", 2); return;
+            case '\r': append("\\r", 2); return;
+            case '\t': append("\\t", 2); return;
+        }
+        if(static_cast<unsigned char>(c) < 0x20)
+        {
+            static const char hex[] = "0123456789abcdef";
+            char code[JSON_ESCAPE_MAX] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xf], hex[c & 0xf]};
+            append(code, sizeof(code));
+            return;
+        }
+        put(c);
+    }
+};
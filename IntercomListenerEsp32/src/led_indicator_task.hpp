@@ -1,10 +1,25 @@
 #pragma once
 
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "sdkconfig.h"
 #include "driver/gpio.h"
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+#include "driver/rmt_tx.h"
+#endif
+
+// Longest pattern, in on and off steps.
+#define LED_PATTERN_MAX_STEPS 12
+// RMT symbols of the longest pattern. A looping pattern has to fit the 64 of one memory block.
+#define LED_PATTERN_MAX_SYMBOLS 16
+// 100 us per RMT tick. The REF_TICK clock keeps it while DFS moves the APB clock.
+#define LED_PATTERN_RESOLUTION_HZ 10000
+// Longest half of an RMT symbol; a longer step takes several.
+#define LED_PATTERN_MAX_HALF_TICKS 30000
 
 enum class led_indicator_code
 {
@@ -16,33 +31,186 @@ enum class led_indicator_code
     unknown_error
 };
 
+enum class led_color : uint8_t
+{
+    red,
+    green,
+    blue
+};
+
+// Indexed by led_color. -1 for an LED that is not fitted.
+inline constexpr int led_pins[] =
+{
+    CONFIG_INTERCOM_LED_RED_GPIO_PIN,
+    CONFIG_INTERCOM_LED_GREEN_GPIO_PIN,
+    CONFIG_INTERCOM_LED_BLUE_GPIO_PIN
+};
+
+inline constexpr size_t led_color_count = sizeof(led_pins) / sizeof(led_pins[0]);
+
+/*
+    How one code shows on one LED: step durations in ms, on and off in turn, starting with on.
+    A looping pattern is the background and repeats until another one takes its place. Any other plays once,
+    then the background comes back; a pattern that plays once preempts another one unless its priority is
+    lower, in which case it waits for its turn.
+*/
+struct led_pattern
+{
+    led_indicator_code code;
+    led_color color;
+    uint8_t priority;
+    bool loop;
+    uint16_t steps_ms[LED_PATTERN_MAX_STEPS];
+};
+
+// Indexed by led_indicator_code. A pattern without steps keeps its LED off.
+inline constexpr led_pattern led_patterns[] =
+{
+    {led_indicator_code::none, led_color::green, 0, true, {}},
+    {led_indicator_code::idle, led_color::green, 0, true, {50, 50, 50, 850}},
+    {led_indicator_code::wakeup, led_color::green, 1, false, {500, 500}},
+    {led_indicator_code::wifi_error, led_color::red, 2, false, {500, 100, 100, 100, 100, 1100}},
+    {led_indicator_code::http_error, led_color::red, 2, false, {500, 100, 100, 100, 100, 100, 100, 100, 100, 1100}},
+    {led_indicator_code::unknown_error, led_color::red, 3, false, {2000, 1000}},
+};
+
+inline constexpr size_t led_pattern_count = sizeof(led_patterns) / sizeof(led_patterns[0]);
+
+constexpr size_t led_pattern_steps(const led_pattern& pattern)
+{
+    size_t count = 0;
+    while(count < LED_PATTERN_MAX_STEPS && pattern.steps_ms[count] != 0)
+    {
+        count++;
+    }
+    return count;
+}
+
+constexpr size_t led_pattern_symbols(const led_pattern& pattern)
+{
+    size_t halves = 0;
+    for(size_t i = 0; i < led_pattern_steps(pattern); i++)
+    {
+        uint32_t ticks = pattern.steps_ms[i] * (LED_PATTERN_RESOLUTION_HZ / 1000);
+        halves += (ticks + LED_PATTERN_MAX_HALF_TICKS - 1) / LED_PATTERN_MAX_HALF_TICKS;
+    }
+    return (halves + 1) / 2;
+}
+
+constexpr bool led_patterns_valid()
+{
+    for(size_t i = 0; i < led_pattern_count; i++)
+    {
+        if(static_cast<size_t>(led_patterns[i].code) != i || led_pattern_symbols(led_patterns[i]) > LED_PATTERN_MAX_SYMBOLS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(led_patterns_valid(), "led_patterns must follow led_indicator_code and fit LED_PATTERN_MAX_SYMBOLS");
+
+// True for an LED that is fitted and shows a pattern.
+constexpr bool led_color_in_use(led_color color)
+{
+    if(led_pins[static_cast<size_t>(color)] < 0)
+    {
+        return false;
+    }
+    for(const led_pattern& pattern : led_patterns)
+    {
+        if(pattern.color == color && led_pattern_steps(pattern) > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Plays led_patterns. The task only runs when a code is set or a pattern that plays once ends: with
+    CONFIG_INTERCOM_LED_PATTERN_RMT every LED in use has an RMT transmit channel, which plays the pattern,
+    looping ones included, while the CPU does nothing. Without it the task steps through the pattern itself,
+    sleeping until the next step.
+*/
 class led_indicator_task
 {
 private:
     static const char* log_tag;
 
-    TaskHandle_t task_handle;
-    led_indicator_code current_code = led_indicator_code::none;
-    led_indicator_code pending_code = led_indicator_code::none;
+    std::atomic<TaskHandle_t> task_handle{nullptr};
+    // Codes set since the task last looked, one bit per led_indicator_code.
+    std::atomic<uint32_t> requested{0};
+
+    // Owned by the task.
+    const led_pattern* playing = nullptr;
+    const led_pattern* queued = nullptr;
+    const led_pattern* background = &led_patterns[static_cast<size_t>(led_indicator_code::idle)];
+
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+    rmt_channel_handle_t channels[led_color_count] = {};
+    rmt_encoder_handle_t encoder = nullptr;
+    rmt_symbol_word_t symbols[led_pattern_count][LED_PATTERN_MAX_SYMBOLS] = {};
+#else
+    size_t step = 0;
+    TickType_t step_end = 0;
+    bool finished = false;
+#endif
+
 public:
-    led_indicator_task()
+    // Does no work of its own: a static instance is constructed before app_main, where it would hold up the boot.
+    led_indicator_task() = default;
+
+    // Configures the LED pins and starts the task. Codes set before are shown once it runs.
+    void start()
     {
-        ESP_LOGD(log_tag, "led_indicator_task ctor called");
+        if(task_handle.load() != nullptr)
+        {
+            return;
+        }
 
-#if CONFIG_INTERCOM_LED_GREEN_GPIO_PIN >= 0
-        gpio_set_direction(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), GPIO_MODE_OUTPUT);
-        gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 0);
-#endif
-#if CONFIG_INTERCOM_LED_RED_GPIO_PIN >= 0
-        gpio_set_direction(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), GPIO_MODE_OUTPUT);
-        gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-#endif
-#if CONFIG_INTERCOM_LED_BLUE_GPIO_PIN >= 0
-        gpio_set_direction(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_BLUE_GPIO_PIN), GPIO_MODE_OUTPUT);
-        gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_BLUE_GPIO_PIN), 0);
+        for(int pin : led_pins)
+        {
+            if(pin >= 0)
+            {
+                gpio_set_direction(static_cast<gpio_num_t>(pin), GPIO_MODE_OUTPUT);
+                gpio_set_level(static_cast<gpio_num_t>(pin), 0);
+            }
+        }
+
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+        rmt_copy_encoder_config_t encoder_config = {};
+        ESP_ERROR_CHECK(rmt_new_copy_encoder(&encoder_config, &encoder));
+        for(size_t color = 0; color < led_color_count; color++)
+        {
+            if(!led_color_in_use(static_cast<led_color>(color)))
+            {
+                continue;
+            }
+            rmt_tx_channel_config_t channel_config = {};
+            channel_config.gpio_num = static_cast<gpio_num_t>(led_pins[color]);
+            channel_config.clk_src = RMT_CLK_SRC_REF_TICK;
+            channel_config.resolution_hz = LED_PATTERN_RESOLUTION_HZ;
+            channel_config.mem_block_symbols = 64;
+            channel_config.trans_queue_depth = 1;
+            ESP_ERROR_CHECK(rmt_new_tx_channel(&channel_config, &channels[color]));
+
+            rmt_tx_event_callbacks_t callbacks = {};
+            callbacks.on_trans_done = on_transmit_done;
+            ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(channels[color], &callbacks, this));
+            ESP_ERROR_CHECK(rmt_enable(channels[color]));
+        }
+        for(size_t i = 0; i < led_pattern_count; i++)
+        {
+            encode(led_patterns[i], symbols[i]);
+        }
 #endif
 
-        xTaskCreate(led_indicator_task_routine, "led_indicator_task", 1024, this, tskIDLE_PRIORITY, &task_handle);
+        TaskHandle_t handle = nullptr;
+        xTaskCreate(led_indicator_task_routine, "led_indicator_task", 2048, this, tskIDLE_PRIORITY, &handle);
+        task_handle.store(handle);
+        xTaskNotifyGive(handle);
         ESP_LOGD(log_tag, "led_indicator_task: task created");
     }
 
@@ -51,24 +219,32 @@ public:
 
     void print_stack_info()
     {
-        if(task_handle != nullptr)
+        TaskHandle_t handle = task_handle.load();
+        if(handle != nullptr)
         {
-            uint32_t stack_words_extra = uxTaskGetStackHighWaterMark2(task_handle);
+            uint32_t stack_words_extra = uxTaskGetStackHighWaterMark2(handle);
             ESP_LOGD(log_tag, "led_indicator_task has %lu extra stack words", stack_words_extra);
         }
     }
 
     ~led_indicator_task()
     {
-        if(task_handle != nullptr)
+        TaskHandle_t handle = task_handle.load();
+        if(handle != nullptr)
         {
-            vTaskDelete(task_handle);
+            vTaskDelete(handle);
         }
     }
 
+    // Safe from any task.
     void set_code(led_indicator_code code)
     {
-        pending_code = code;
+        requested.fetch_or(1u << static_cast<uint32_t>(code));
+        TaskHandle_t handle = task_handle.load();
+        if(handle != nullptr)
+        {
+            xTaskNotifyGive(handle);
+        }
         ESP_LOGD(log_tag, "set_code: %d", static_cast<int>(code));
     }
 
@@ -83,96 +259,197 @@ private:
 
         while(true)
         {
-            if(task->pending_code == led_indicator_code::none)
+            ulTaskNotifyTake(pdTRUE, task->wait_ticks());
+            task->update();
+        }
+    }
+
+    void update()
+    {
+#if !CONFIG_INTERCOM_LED_PATTERN_RMT
+        advance();
+#endif
+        if(playing != nullptr && !playing->loop && is_finished())
+        {
+            const led_pattern* next = queued != nullptr ? queued : background;
+            queued = nullptr;
+            play(*next);
+        }
+
+        uint32_t codes = requested.exchange(0);
+        while(codes != 0)
+        {
+            // The most important code first, so that the others queue behind it rather than preempt it.
+            size_t chosen = 0;
+            for(size_t i = 0; i < led_pattern_count; i++)
             {
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                continue;
+                if((codes & (1u << i)) != 0 && ((codes & (1u << chosen)) == 0 || led_patterns[i].priority >= led_patterns[chosen].priority))
+                {
+                    chosen = i;
+                }
             }
+            codes &= ~(1u << chosen);
+            request(led_patterns[chosen]);
+        }
+    }
 
-            task->current_code = task->pending_code;
-            task->pending_code = led_indicator_code::idle;
-
-            switch (task->current_code)
+    void request(const led_pattern& pattern)
+    {
+        if(pattern.loop)
+        {
+            background = &pattern;
+            if(playing == nullptr || (playing->loop && playing != &pattern))
             {
-            case led_indicator_code::idle:
-#if CONFIG_INTERCOM_LED_GREEN_GPIO_PIN >= 0
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 1);
-                vTaskDelay(50 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 0);
-                vTaskDelay(50 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 1);
-                vTaskDelay(50 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 0);
-#endif
-                vTaskDelay(850 / portTICK_PERIOD_MS);
-            
-                break;
-
-            case led_indicator_code::wakeup:
-                ESP_LOGD(log_tag, "wakeup");
-#if CONFIG_INTERCOM_LED_GREEN_GPIO_PIN >= 0
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 1);
-                vTaskDelay(500 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN), 0);
-                vTaskDelay(500 / portTICK_PERIOD_MS);
+                play(pattern);
+            }
+        }
+        else if(playing == nullptr || playing->loop || pattern.priority >= playing->priority)
+        {
+            play(pattern);
+        }
+        else if(queued == nullptr || pattern.priority >= queued->priority)
+        {
+            queued = &pattern;
+        }
+    }
+
+    void play(const led_pattern& pattern)
+    {
+        if(playing != nullptr)
+        {
+            stop(*playing);
+        }
+        playing = &pattern;
+        ESP_LOGD(log_tag, "playing %d", static_cast<int>(pattern.code));
+
+        size_t color = static_cast<size_t>(pattern.color);
+        if(led_pins[color] < 0 || led_pattern_steps(pattern) == 0)
+        {
+            return;
+        }
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+        rmt_transmit_config_t transmit_config = {};
+        transmit_config.loop_count = pattern.loop ? -1 : 0;
+        transmit_config.flags.eot_level = 0;
+        size_t index = static_cast<size_t>(pattern.code);
+        ESP_ERROR_CHECK(rmt_transmit(channels[color], encoder, symbols[index], led_pattern_symbols(pattern) * sizeof(rmt_symbol_word_t), &transmit_config));
+#else
+        step = 0;
+        finished = false;
+        step_end = xTaskGetTickCount() + pdMS_TO_TICKS(pattern.steps_ms[0]);
+        gpio_set_level(static_cast<gpio_num_t>(led_pins[color]), 1);
 #endif
-                break;
-
-            case led_indicator_code::wifi_error:
-                ESP_LOGD(log_tag, "wifi_error");
-#if CONFIG_INTERCOM_LED_RED_GPIO_PIN >= 0
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 1);
-                vTaskDelay(500 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                for(int i = 0; i < 2; i++)
+    }
+
+#if CONFIG_INTERCOM_LED_PATTERN_RMT
+    void stop(const led_pattern& pattern)
+    {
+        rmt_channel_handle_t channel = channels[static_cast<size_t>(pattern.color)];
+        if(channel != nullptr && rmt_tx_wait_all_done(channel, 0) != ESP_OK)
+        {
+            // Disabling aborts the transmission and leaves the pin at the end-of-transmission level.
+            ESP_ERROR_CHECK(rmt_disable(channel));
+            ESP_ERROR_CHECK(rmt_enable(channel));
+        }
+    }
+
+    bool is_finished() const
+    {
+        rmt_channel_handle_t channel = channels[static_cast<size_t>(playing->color)];
+        return channel == nullptr || led_pattern_steps(*playing) == 0 || rmt_tx_wait_all_done(channel, 0) == ESP_OK;
+    }
+
+    TickType_t wait_ticks() const
+    {
+        return portMAX_DELAY;
+    }
+
+    // Steps longer than an RMT half symbol are split; an odd half count ends on a zero duration, the end marker.
+    static void encode(const led_pattern& pattern, rmt_symbol_word_t* out)
+    {
+        size_t half = 0;
+        for(size_t i = 0; i < led_pattern_steps(pattern); i++)
+        {
+            uint32_t level = i % 2 == 0 ? 1 : 0;
+            uint32_t ticks = pattern.steps_ms[i] * (LED_PATTERN_RESOLUTION_HZ / 1000);
+            while(ticks > 0)
+            {
+                uint32_t part = ticks < LED_PATTERN_MAX_HALF_TICKS ? ticks : LED_PATTERN_MAX_HALF_TICKS;
+                rmt_symbol_word_t& symbol = out[half / 2];
+                if(half % 2 == 0)
                 {
-                    gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 1);
-                    vTaskDelay(100 / portTICK_PERIOD_MS);
-                    gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-                    vTaskDelay(100 / portTICK_PERIOD_MS);
+                    symbol.level0 = level;
+                    symbol.duration0 = part;
                 }
-#endif
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
-                break;
-
-            case led_indicator_code::http_error:
-                ESP_LOGD(log_tag, "http_error");
-#if CONFIG_INTERCOM_LED_RED_GPIO_PIN >= 0
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 1);
-                vTaskDelay(500 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                for(int i = 0; i < 4; i++)
+                else
                 {
-                    gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 1);
-                    vTaskDelay(100 / portTICK_PERIOD_MS);
-                    gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-                    vTaskDelay(100 / portTICK_PERIOD_MS);
+                    symbol.level1 = level;
+                    symbol.duration1 = part;
                 }
-#endif
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
-                break;
-
-            case led_indicator_code::unknown_error:
-                ESP_LOGD(log_tag, "unknown_error");
-#if CONFIG_INTERCOM_LED_RED_GPIO_PIN >= 0
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 1);
-                vTaskDelay(2000 / portTICK_PERIOD_MS);
-                gpio_set_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN), 0);
-#endif
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
-                task->current_code = led_indicator_code::idle;
-                break;    
-
-            default:
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
-                break;
+                ticks -= part;
+                half++;
             }
+        }
+    }
+
+    static bool IRAM_ATTR on_transmit_done(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *edata, void *user_ctx)
+    {
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(static_cast<led_indicator_task*>(user_ctx)->task_handle.load(), &higher_priority_task_woken);
+        return higher_priority_task_woken == pdTRUE;
+    }
+#else
+    void stop(const led_pattern& pattern)
+    {
+        int pin = led_pins[static_cast<size_t>(pattern.color)];
+        if(pin >= 0)
+        {
+            gpio_set_level(static_cast<gpio_num_t>(pin), 0);
+        }
+    }
 
-            task->current_code = task->pending_code;
+    bool is_finished() const
+    {
+        return finished || led_pins[static_cast<size_t>(playing->color)] < 0 || led_pattern_steps(*playing) == 0;
+    }
+
+    TickType_t wait_ticks() const
+    {
+        if(playing == nullptr || finished || led_pins[static_cast<size_t>(playing->color)] < 0 || led_pattern_steps(*playing) == 0)
+        {
+            return portMAX_DELAY;
+        }
+        TickType_t now = xTaskGetTickCount();
+        return static_cast<int32_t>(step_end - now) > 0 ? step_end - now : 0;
+    }
+
+    // Moves through the steps that ended by now.
+    void advance()
+    {
+        if(playing == nullptr || finished || led_pins[static_cast<size_t>(playing->color)] < 0)
+        {
+            return;
+        }
+        size_t steps = led_pattern_steps(*playing);
+        TickType_t now = xTaskGetTickCount();
+        while(steps > 0 && static_cast<int32_t>(now - step_end) >= 0)
+        {
+            step++;
+            if(step == steps)
+            {
+                if(!playing->loop)
+                {
+                    finished = true;
+                    gpio_set_level(static_cast<gpio_num_t>(led_pins[static_cast<size_t>(playing->color)]), 0);
+                    return;
+                }
+                step = 0;
+            }
+            step_end += pdMS_TO_TICKS(playing->steps_ms[step]);
+            gpio_set_level(static_cast<gpio_num_t>(led_pins[static_cast<size_t>(playing->color)]), step % 2 == 0 ? 1 : 0);
         }
     }
+#endif
 };
 
-const char* led_indicator_task::log_tag = "led_indicator_task";
\ No newline at end of file
+const char* led_indicator_task::log_tag = "led_indicator_task";
@@ -1,5 +1,6 @@
 #include "sdkconfig.h"
 #include "stdio.h"
+#include <sys/time.h>
 #include "esp_sleep.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -15,6 +16,25 @@
 #include "esp_timer.h"
 #include "esp_event.h"
 #include "telegram.hpp"
+#include "mqtt.hpp"
+#include "sensor_inputs.hpp"
+#include "audio_clip.hpp"
+#include "notification_dispatcher.hpp"
+#include "notification_outbox.hpp"
+#include "command_channel.hpp"
+#include "wake_profile.hpp"
+#include "event_log.hpp"
+#include "energy_account.hpp"
+#include "sleep_scheduler.hpp"
+#include "power_management.hpp"
+#include "esp_wifi.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+#include "esp32/ulp.h"
+#include "ulp_main.h"
+#include "ulp_pulse_config.h"
+#endif
 
 extern "C" bool wifi_init_sta(EventGroupHandle_t event_group_handle);
 extern "C" bool wifi_deinit_and_stop(void);
@@ -23,276 +43,1023 @@ const char* main_log_tag = "Main";
 
 EventGroupHandle_t main_event_group;
 led_indicator_task led_indicator;
-int64_t ring_sensor_timestamp = -1;
-int64_t ring_notification_timestamp = -1;
-bool ring_notification_pending = false;
+timer_wheel timers;
+// Sets EVENT_TIMER_ALARM once the device has been idle long enough to sleep.
+timer_entry sleep_deadline;
+
+// Detection and notification state of one sensor line, indexed like sensor_channels.
+struct sensor_state
+{
+    int64_t sensor_timestamp = -1;
+    int64_t notification_timestamp = -1;
+    bool notification_pending = false;
+};
 
-int64_t door_sensor_timestamp = -1;
-int64_t door_notification_timestamp = -1;
-bool door_notification_pending = false;
+using sensor_lines = sensor_inputs<sensor_channels>;
+// The GPIO interrupt writes the edge journal in here, also while the cache is off.
+DRAM_ATTR sensor_lines sensors;
+sensor_state sensor_states[sensor_channel_count];
 
 #if CONFIG_INTERCOM_BOOT_NOTIFICATION
 bool boot_notification_pending = false;
 #endif
 
+#if CONFIG_INTERCOM_WAKE_PROFILE
+RTC_DATA_ATTR wake_profile_log wake_profile;
+#endif
+
+#if CONFIG_INTERCOM_EVENT_LOG
+RTC_DATA_ATTR event_log_state event_history_state;
+event_log event_history;
+#endif
+
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+RTC_DATA_ATTR energy_ledger energy_account;
+energy_meter energy_wake;
+#endif
+
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+const char* scheduler_log_tag = "Scheduler";
+RTC_DATA_ATTR sleep_schedule_state sleep_schedule;
+
+// RTC clock seconds of timestamp, esp_timer time.
+uint32_t sleep_scheduler_time_s(int64_t timestamp)
+{
+    return static_cast<uint32_t>((energy_rtc_time_us() - (esp_timer_get_time() - timestamp)) / 1000000);
+}
+
+#if CONFIG_INTERCOM_EVENT_LOG
+// After a power loss the schedule starts blank, but the history in flash still knows how events follow each
+// other. Hours are not taken over: the RTC clock started over, so they would fall on the wrong ones.
+void sleep_scheduler_seed_gaps()
+{
+    bool has_previous = false;
+    uint32_t previous_s = 0;
+    event_history.query(0, UINT32_MAX, [&](const event_record& record)
+    {
+        if(record.kind == event_kind::power_on)
+        {
+            has_previous = false;
+        }
+        else if(record.kind == event_kind::sensor)
+        {
+            if(has_previous && record.time_s >= previous_s)
+            {
+                sleep_scheduler_learn_gap(sleep_schedule, record.time_s - previous_s);
+            }
+            has_previous = true;
+            previous_s = record.time_s;
+        }
+        return true;
+    });
+    ESP_LOGI(scheduler_log_tag, "%u gap(s) taken from the event history", static_cast<unsigned>(sleep_schedule.gaps_seen));
+}
+#endif
+#endif
+
+// Learns from an event at timestamp, esp_timer time, and returns how many seconds to stay awake after it.
+int awake_window_after(int64_t timestamp)
+{
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    uint32_t time_s = sleep_scheduler_time_s(timestamp);
+    sleep_scheduler_record(sleep_schedule, time_s);
+
+    // Until a wake has been measured, a boot, a scan and a full handshake.
+    uint32_t wake_uc = sleep_schedule.wake_uc;
+    if(wake_uc == 0)
+    {
+        wake_uc = static_cast<uint32_t>(energy_charge_uc(energy_state::cpu_active, 200000) + energy_charge_uc(energy_state::wifi_scan, 300000)
+            + energy_charge_uc(energy_state::tls, 150000));
+    }
+    // With light sleep a second of holding costs what the ones before did, beacon wakes included.
+    sleep_scheduler_costs costs = {static_cast<uint32_t>(energy_hold_uc_per_s(energy_account)), wake_uc};
+    sleep_hold_choice choice = sleep_scheduler_choose_hold(sleep_schedule, costs, time_s);
+    if(choice.learned)
+    {
+        ESP_LOGI(scheduler_log_tag, "Awake for %lu s: next event missed with p=%.2f, %.0f uC and %.0f ms extra latency for a repeat expected",
+            static_cast<unsigned long>(choice.hold_s), choice.miss_probability, choice.expected_uc, choice.latency_ms);
+    }
+    else
+    {
+        ESP_LOGD(scheduler_log_tag, "Awake for %lu s, %u of %u gaps seen", static_cast<unsigned long>(choice.hold_s),
+            static_cast<unsigned>(sleep_schedule.gaps_seen), static_cast<unsigned>(SLEEP_SCHEDULER_MIN_GAPS));
+    }
+    return static_cast<int>(choice.hold_s);
+#else
+    (void)timestamp;
+    return CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
+#endif
+}
+
+#if !CONFIG_INTERCOM_TELEGRAM_ENABLED && !CONFIG_INTERCOM_MQTT_ENABLED
+int log_notification(const notification_batch& batch)
+{
+    ESP_LOGI(main_log_tag, "Notification: %s", batch.text);
+    return 200;
+}
+#endif
+
+// Every notification goes to each of these, through a dispatcher of its own.
+const notification_transport notification_sinks[] =
+{
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    {"telegram", telegram_send_notification, telegram_connect, telegram_keep_warm, telegram_disconnect},
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    {"mqtt", mqtt_send_notification, mqtt_connect, mqtt_keep_warm, mqtt_disconnect},
+#endif
+#if !CONFIG_INTERCOM_TELEGRAM_ENABLED && !CONFIG_INTERCOM_MQTT_ENABLED
+    {"log", log_notification, nullptr, nullptr, nullptr},
+#endif
+};
+constexpr size_t notification_sink_count = sizeof(notification_sinks) / sizeof(notification_sinks[0]);
+notification_dispatcher notifications[notification_sink_count];
+bool network_online = false;
+
+#if CONFIG_INTERCOM_OUTBOX
+RTC_DATA_ATTR outbox_state outbox_memory;
+notification_outbox<notification_sink_count> outbox;
+// Set when a connection came up or a backlog went out, until every sink has what it owes on its way.
+bool outbox_flush_due = false;
+// The station gave up connecting. Undelivered notifications are kept for the next wake rather than waited for.
+bool wifi_failed = false;
+#endif
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+const command_transport command_source = {"telegram", telegram_poll_commands, telegram_reply_command, telegram_disconnect_commands};
+command_channel commands;
+// gettimeofday seconds until which signals are logged but not notified. The RTC clock counts on through deep
+// sleep, and both start over on power loss.
+RTC_DATA_ATTR uint32_t muted_until_s;
+// esp_timer time that /awake holds the sleep deadline at, -1 without a hold.
+int64_t awake_held_until_us = -1;
+int64_t sleep_at_us = 0;
+uint32_t delivered_this_wake = 0;
+uint32_t failed_this_wake = 0;
+
+uint32_t rtc_time_s()
+{
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return static_cast<uint32_t>(now.tv_sec);
+}
+#endif
+
+// RTC slow memory, which keeps RTC_DATA_ATTR data through deep sleep, less what the ULP program reserves for itself.
+#define RTC_SLOW_MEM_BYTES 8192
+#if CONFIG_ULP_COPROC_ENABLED
+#define RTC_SLOW_MEM_ULP_BYTES CONFIG_ULP_COPROC_RESERVE_MEM
+#else
+#define RTC_SLOW_MEM_ULP_BYTES 0
+#endif
+// The Wi-Fi fast-connect cache in wifi.c and what ESP-IDF keeps there itself.
+#define RTC_SLOW_MEM_OTHER_BYTES 256
+
+// Everything this file keeps in RTC memory. The linker only notices once rtc_slow_seg overflows and names no variable.
+constexpr size_t rtc_data_bytes = 0
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    + sizeof(wake_profile)
+#endif
+#if CONFIG_INTERCOM_EVENT_LOG
+    + sizeof(event_history_state)
+#endif
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    + sizeof(energy_account)
+#endif
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    + sizeof(sleep_schedule)
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+    + sizeof(outbox_memory)
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    + sizeof(telegram_tls_session)
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    + sizeof(telegram_update_offset) + sizeof(muted_until_s)
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    + sizeof(mqtt_session)
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED && CONFIG_INTERCOM_MQTT_TLS
+    + sizeof(mqtt_tls_session)
+#endif
+    ;
+static_assert(rtc_data_bytes + RTC_SLOW_MEM_OTHER_BYTES <= RTC_SLOW_MEM_BYTES - RTC_SLOW_MEM_ULP_BYTES,
+    "RTC_DATA_ATTR data does not fit RTC slow memory, lower INTERCOM_TLS_SESSION_CACHE_SIZE or drop a feature that keeps state there");
+
+#define BOOT_NOTIFICATION_TEXT "Intercom Listener booted!"
+// Longest suffix the dispatcher adds to a merged notification.
+#define NOTIFICATION_REPEAT_SUFFIX " (65535 times in 99999 s)"
+
+// Every kind, each merged and separated by a newline, goes out in one request.
+constexpr size_t notification_texts_size()
+{
+    size_t size = sizeof(BOOT_NOTIFICATION_TEXT) + sizeof(NOTIFICATION_REPEAT_SUFFIX) - 1;
+    for(const sensor_channel_config& channel : sensor_channels)
+    {
+        size_t length = 0;
+        while(channel.text[length] != '\0')
+        {
+            length++;
+        }
+        size += length + 1 + sizeof(NOTIFICATION_REPEAT_SUFFIX) - 1;
+    }
+    return size;
+}
+static_assert(notification_texts_size() <= NOTIFICATION_TEXT_MAX, "Notification texts do not fit one request");
+
+#if CONFIG_INTERCOM_OUTBOX
+const char* notification_text(notification_kind kind)
+{
+    return kind == notification_kind::boot ? BOOT_NOTIFICATION_TEXT : sensor_channels[static_cast<size_t>(kind)].text;
+}
+#endif
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+#define EDGE_JOURNAL_DRAIN_BATCH 16
+
+uint32_t sensor_journal_overflows = 0;
+
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+std::array<burst_tracker, sensor_channel_count> burst_trackers = sensor_lines::make_trackers();
+// Set EVENT_BURST_DEADLINE when the line of an open burst has been quiet long enough to close it.
+timer_entry burst_deadlines[sensor_channel_count];
+#endif
+#endif
+
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+uint32_t noise_bursts = 0;
+#endif
+
+// Lines that woke the chip, as a bit per channel index, count as the start of their signal.
+// Returns how many seconds to stay awake.
+int on_sensor_wakeup(uint32_t channels)
+{
+    int64_t now = esp_timer_get_time();
+    for(size_t i = 0; i < sensor_channel_count; i++)
+    {
+        if(channels & (1u << i))
+        {
+            sensor_states[i].sensor_timestamp = now;
+            sensor_states[i].notification_pending = true;
+            ESP_LOGD(main_log_tag, "%s notification pending after wake-up", sensor_channels[i].name);
+        }
+    }
+    return channels != 0 ? awake_window_after(now) : CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
+}
+
 #ifdef CONFIG_INTERCOM_DEEP_SLEEP_ENABLED
 
 extern const uint8_t ulp_main_bin_start[] asm("_binary_ulp_main_bin_start");
 extern const uint8_t ulp_main_bin_end[]   asm("_binary_ulp_main_bin_end");
 
-#if CONFIG_ULP_COPROC_ENABLED
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+// The ULP program checks the period, duty cycle and pulse count of the signatures with its own constants.
+constexpr bool ulp_covers_signatures()
+{
+    for(const burst_signature& signature : burst_signatures)
+    {
+        if(signature.period_min_us != ULP_PERIOD_MIN_US || signature.period_max_us != ULP_PERIOD_MAX_US
+            || signature.min_pulses != ULP_MIN_PULSES
+            || signature.duty_min_permille < ULP_DUTY_MIN_PERMILLE || signature.duty_min_permille > ULP_DUTY_MIN_PERMILLE + 5
+            || signature.duty_max_permille > ULP_DUTY_MAX_PERMILLE || signature.duty_max_permille < ULP_DUTY_MAX_PERMILLE - 5)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(ulp_covers_signatures(), "ulp_pulse_config.h is out of step with burst_signatures");
+static_assert(ULP_IDLE_GAP_US == BURST_IDLE_GAP_US, "ulp_pulse_config.h is out of step with BURST_IDLE_GAP_US");
+static_assert(sensor_channel_count == 2
+    && sensor_channels[sensor_channel_ring].gpio == CONFIG_INTERCOM_RING_GPIO_PIN && sensor_channels[sensor_channel_ring].wake_level == CONFIG_INTERCOM_WAKE_LEVEL
+    && sensor_channels[sensor_channel_door].gpio == CONFIG_INTERCOM_DOOR_GPIO_PIN && sensor_channels[sensor_channel_door].wake_level == CONFIG_INTERCOM_WAKE_LEVEL
+    && ULP_WAKE_RING == sensor_channel_ring + 1 && ULP_WAKE_DOOR == sensor_channel_door + 1,
+    "ulp_main.S samples the ring and door lines of sensor_channels and nothing else");
+static_assert(ulp_phase_step_permille(ulp_wake_period_us(CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS), ULP_RING_PERIOD_US) >= 250
+    && ulp_phase_step_permille(ulp_wake_period_us(CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS), ULP_DOOR_PERIOD_US) >= 250,
+    "ULP runs would sample the ring or door signal at nearly the same phase every time");
+
+// Hands both sensor lines to the RTC domain and starts the pulse detector in ulp/ulp_main.S, which runs
+// every CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS until it wakes the CPU. Loading also clears its statistics.
 void init_ulp()
 {
-    ESP_LOGI(main_log_tag, "init_ulp called");
     esp_err_t err = ulp_load_binary(0, ulp_main_bin_start, (ulp_main_bin_end - ulp_main_bin_start) / sizeof(uint32_t));
     ESP_ERROR_CHECK(err);
+    sensor_lines::hold_for_sleep();
 
-    ulp_set_wakeup_period(0, 5 * 1000 * 1000);
+    ESP_ERROR_CHECK(ulp_set_wakeup_period(0, ulp_wake_period_us(CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS)));
     err = ulp_run(&ulp_entry - RTC_SLOW_MEM);
     ESP_ERROR_CHECK(err);
-    ESP_LOGI(main_log_tag, "ulp_run called");
 }
-#endif
 
-void enter_deep_sleep()
+// The ULP only wakes the CPU for a burst that matched. Its statistics stay in RTC memory until the next sleep.
+// Returns how many seconds to stay awake.
+int on_ulp_wakeup()
 {
-    ESP_LOGI(main_log_tag, "Preparing for deep-sleep...");
-    wifi_deinit_and_stop();
+    uint32_t channel = ulp_wake_channel & UINT16_MAX;
+    uint32_t pulses = ulp_burst_pulses & UINT16_MAX;
+    uint32_t samples = ulp_burst_samples & UINT16_MAX;
+    uint32_t wake_samples = ulp_burst_wake_samples & UINT16_MAX;
+    ESP_LOGI(main_log_tag, "Wake up by ULP: %s, %lu pulses of %lu-%lu us, duty %lu/1000; %lu bursts rejected in %lu checks",
+        channel != ULP_WAKE_NONE ? sensor_channel_name(channel - 1) : "no channel",
+        static_cast<unsigned long>(pulses),
+        static_cast<unsigned long>((ulp_burst_period_min & UINT16_MAX) * ULP_SAMPLE_US),
+        static_cast<unsigned long>((ulp_burst_period_max & UINT16_MAX) * ULP_SAMPLE_US),
+        static_cast<unsigned long>(samples > 0 ? wake_samples * 1000 / samples : 0),
+        static_cast<unsigned long>(ulp_rejected_bursts & UINT16_MAX),
+        static_cast<unsigned long>(ulp_activations & UINT16_MAX));
 
-#if CONFIG_ULP_COPROC_ENABLED
-    init_ulp();
+    if(channel != ULP_WAKE_NONE && channel <= sensor_channel_count)
+    {
+        return on_sensor_wakeup(1u << (channel - 1));
+    }
+    return CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
+}
 #endif
 
-    
-#if CONFIG_INTERCOM_WAKE_LEVEL == 0
-    esp_sleep_enable_ext0_wakeup(static_cast<gpio_num_t>(CONFIG_INTERCOM_RING_GPIO_PIN), CONFIG_INTERCOM_WAKE_LEVEL);
-    ESP_LOGI(main_log_tag, "EXT0 Configured to Ring pin (%d)", CONFIG_INTERCOM_RING_GPIO_PIN);
-    esp_sleep_enable_ext1_wakeup(1 << CONFIG_INTERCOM_DOOR_GPIO_PIN, esp_sleep_ext1_wakeup_mode_t::ESP_EXT1_WAKEUP_ALL_LOW);
-    ESP_LOGI(main_log_tag, "EXT1 Configured to Door Bell pin (%d)", CONFIG_INTERCOM_DOOR_GPIO_PIN);
-#else
-    uin64_t mask = (1 << CONFIG_INTERCOM_RING_GPIO_PIN) | (1 << INTERCOM_DOOR_GPIO_PIN);
-    esp_sleep_enable_ext1_wakeup(mask, esp_sleep_ext1_wakeup_mode_t::ESP_EXT1_WAKEUP_ANY_HIGH);
-    ESP_LOGI(main_log_tag, "EXT1 Configured to Ring pin (%d) and Door Bell pin (%d)", CONFIG_INTERCOM_RING_GPIO_PIN, CONFIG_INTERCOM_DOOR_GPIO_PIN);
 #endif
 
-#ifdef CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED
-    ESP_LOGI(main_log_tag, "Waking up in %d seconds...", CONFIG_INTERCOM_DEEP_SLEEP_DURATION);
-    esp_sleep_enable_timer_wakeup(1000000 * CONFIG_INTERCOM_DEEP_SLEEP_DURATION);
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+// Converts a journaled cycle count to esp_timer time. Valid for edges younger than one CCOUNT wrap (~17 s at 240 MHz,
+// 71 min for the microseconds of light sleep builds).
+int64_t edge_timestamp(const edge_record& record, int64_t now, uint32_t now_cycles, uint32_t cycles_per_us)
+{
+    return now - static_cast<int64_t>((now_cycles - record.cycles) / cycles_per_us);
+}
 #endif
-    ESP_LOGI(main_log_tag, "Sleeping...");
-    esp_deep_sleep_start();
+
+#if CONFIG_INTERCOM_WAKE_PROFILE
+// Start of the Wi-Fi phase in progress, esp_timer time.
+int64_t wifi_phase_started_at = 0;
+
+// Milestones of this boot in esp_timer time, which counts from reset. -1 until reached.
+struct startup_milestones
+{
+    int64_t app_main = -1;
+    int64_t nvs_ready = -1;
+    int64_t wifi_requested = -1;
+    int64_t sensors_ready = -1;
+    int64_t radio_on = -1;
+    int64_t associated = -1;
+    int64_t got_ip = -1;
+    bool reported = false;
+};
+
+startup_milestones startup;
+
+// One line per wake, logged by the main task once the station has an address and the notifications are on their way.
+void log_startup_report()
+{
+    if(startup.reported || startup.got_ip < 0)
+    {
+        return;
+    }
+    startup.reported = true;
+    ESP_LOGI(main_log_tag, "Startup (ms after reset): app_main %lld, NVS %lld, Wi-Fi requested %lld, sensors %lld, radio on %lld, associated %lld, IP %lld",
+        startup.app_main / 1000, startup.nvs_ready / 1000, startup.wifi_requested / 1000, startup.sensors_ready / 1000,
+        startup.radio_on / 1000, startup.associated / 1000, startup.got_ip / 1000);
+}
+
+// Times the Wi-Fi phases off the same events wifi.c handles. Runs on the event loop task.
+void on_wifi_timing_event(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    int64_t now = esp_timer_get_time();
+    if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    {
+        WAKE_PROBE(wake_phase::wifi_start, wifi_phase_started_at);
+        if(startup.radio_on < 0)
+        {
+            startup.radio_on = now;
+            WAKE_PROBE(wake_phase::radio_on, 0);
+        }
+    }
+    else if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        WAKE_PROBE(wake_phase::wifi_associate, wifi_phase_started_at);
+        if(startup.associated < 0)
+        {
+            startup.associated = now;
+        }
+    }
+    else if(event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        WAKE_PROBE(wake_phase::wifi_ip, wifi_phase_started_at);
+        if(startup.got_ip < 0)
+        {
+            startup.got_ip = now;
+        }
+    }
+    else if(!(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED))
+    {
+        return;
+    }
+    // The next phase starts here. After a disconnect wifi.c reconnects right away.
+    wifi_phase_started_at = now;
+}
+#endif
+
+void start_wifi()
+{
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    wifi_phase_started_at = esp_timer_get_time();
+    if(startup.wifi_requested < 0)
+    {
+        startup.wifi_requested = wifi_phase_started_at;
+    }
+#endif
+    ENERGY_RADIO(energy_state::wifi_scan);
+    bool wifi_ok = wifi_init_sta(main_event_group);
+    if(!wifi_ok)
+    {
+        led_indicator.set_code(led_indicator_code::wifi_error);
+    }
+}
+
+#if CONFIG_INTERCOM_EARLY_WIFI_START
+// Driver init and RF calibration block for a while. Done here, they overlap the rest of app_main.
+void wifi_start_task_routine(void* arg)
+{
+    start_wifi();
+    xEventGroupSetBits(main_event_group, EVENT_WIFI_STARTED);
+    vTaskDelete(nullptr);
+}
+
+void start_wifi_early()
+{
+    xEventGroupClearBits(main_event_group, EVENT_WIFI_STARTED);
+    // Above the main task and the dispatcher, so the radio comes up first whenever they are all ready to run.
+    if(xTaskCreate(wifi_start_task_routine, "wifi_start", 4096, nullptr, tskIDLE_PRIORITY + 2, nullptr) != pdPASS)
+    {
+        ESP_LOGE(main_log_tag, "Failed to create the Wi-Fi start task, starting Wi-Fi in place");
+        start_wifi();
+        xEventGroupSetBits(main_event_group, EVENT_WIFI_STARTED);
+    }
 }
 #endif
 
-void ring_isr_handler(void *arg)
+void restart_sleep_timer(int seconds)
 {
-    auto trigger_gpio_int = reinterpret_cast<uint32_t>(arg);
-    gpio_num_t trigger_gpio = static_cast<gpio_num_t>(trigger_gpio_int);
+    int64_t delay_us = seconds * 1000000LL;
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    // Nothing brings sleep forward while /awake holds it off.
+    int64_t now = esp_timer_get_time();
+    delay_us = awake_held_until_us - now > delay_us ? awake_held_until_us - now : delay_us;
+    sleep_at_us = now + delay_us;
+    commands.set_deadline(sleep_at_us);
+#endif
+    ESP_LOGD(main_log_tag, "Sleep in %lld s", static_cast<long long>(delay_us / 1000000));
+    timers.start(sleep_deadline, delay_us);
+}
 
-    uint32_t event_bits = 0;
-    int ring_level = gpio_get_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_RING_GPIO_PIN));
-    if(ring_level == CONFIG_INTERCOM_WAKE_LEVEL)
+// Handles the start of a signal on channel detected at timestamp.
+void on_sensor_start(size_t channel, int64_t timestamp, bool& wifi_should_connect)
+{
+    if(!wifi_should_connect)
     {
-        event_bits |= EVENT_RING_SENSOR_START;
+        wifi_should_connect = true;
+        start_wifi();
     }
-    else
+
+    sensor_state& state = sensor_states[channel];
+    if(state.sensor_timestamp == -1 || (timestamp - state.sensor_timestamp > sensor_channels[channel].detection_cooldown_ms * 1000LL))
     {
-        event_bits |= EVENT_RING_SENSOR_END;
+        restart_sleep_timer(awake_window_after(timestamp));
+        state.sensor_timestamp = timestamp;
+        state.notification_pending = true;
+        ESP_LOGD(main_log_tag, "%s notification pending after a signal", sensor_channels[channel].name);
     }
+}
 
-    int door_level = gpio_get_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_DOOR_GPIO_PIN));
-    if(door_level == CONFIG_INTERCOM_WAKE_LEVEL)
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+// Only bursts that match a signature of their channel count as a signal. Everything else is dropped.
+void on_signal_label(size_t channel, burst_label label, int64_t timestamp, bool& wifi_should_connect)
+{
+    if(label == burst_label::noise)
     {
-        event_bits |= EVENT_DOOR_SENSOR_START;
+        noise_bursts++;
+        ESP_LOGD(main_log_tag, "%lu noise burst(s) rejected so far", static_cast<unsigned long>(noise_bursts));
     }
     else
     {
-        event_bits |= EVENT_DOOR_SENSOR_END;
+        on_sensor_start(channel, timestamp, wifi_should_connect);
     }
-    
-    int higherPriorityTaskWoken = false;
-    int result = xEventGroupSetBitsFromISR(main_event_group, event_bits, &higherPriorityTaskWoken);
-    if(result != pdFAIL)
+}
+#endif
+
+#if CONFIG_INTERCOM_BURST_CLASSIFIER && !CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+void on_burst_label(size_t channel, burst_label label, const burst_features& features, int64_t timestamp, bool& wifi_should_connect)
+{
+    if(label == burst_label::none)
     {
-        portYIELD_FROM_ISR(higherPriorityTaskWoken);
+        return;
     }
+
+    ESP_LOGI(main_log_tag, "Burst classified as %s: lead-in %lu us, period %lu us (%lu-%lu), duty %lu/1000, %lu pulses",
+        burst_label_name(label), static_cast<unsigned long>(features.lead_in_us), static_cast<unsigned long>(features.period_avg_us),
+        static_cast<unsigned long>(features.period_min_us), static_cast<unsigned long>(features.period_max_us),
+        static_cast<unsigned long>(features.duty_permille), static_cast<unsigned long>(features.pulse_count));
+    on_signal_label(channel, label, timestamp, wifi_should_connect);
 }
+#endif
 
-void setup_ring_sensor()
+#if CONFIG_INTERCOM_BURST_CLASSIFIER && CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+// Closes bursts whose line went quiet and keeps a deadline on the wheel for every burst still open.
+void expire_bursts(bool& wifi_should_connect)
 {
-    gpio_num_t ring_in = static_cast<gpio_num_t>(CONFIG_INTERCOM_RING_GPIO_PIN);
-    gpio_num_t door_in = static_cast<gpio_num_t>(CONFIG_INTERCOM_DOOR_GPIO_PIN);
-    ESP_ERROR_CHECK(rtc_gpio_deinit(ring_in));
-    ESP_ERROR_CHECK(rtc_gpio_deinit(door_in));
-    ESP_ERROR_CHECK(gpio_set_direction(ring_in, gpio_mode_t::GPIO_MODE_INPUT));
-    ESP_ERROR_CHECK(gpio_set_direction(door_in, gpio_mode_t::GPIO_MODE_INPUT));
+    int64_t now = esp_timer_get_time();
+    for(size_t i = 0; i < sensor_channel_count; i++)
+    {
+        burst_tracker& tracker = burst_trackers[i];
+        on_burst_label(i, tracker.expire(now), tracker.features(), now, wifi_should_connect);
+        if(tracker.is_active())
+        {
+            timers.start_at(burst_deadlines[i], tracker.idle_deadline());
+        }
+        else
+        {
+            timers.cancel(burst_deadlines[i]);
+        }
+    }
+}
+#endif
 
-#if CONFIG_INTERCOM_RING_GPIO_PIN_PULL_DOWN
-    ESP_ERROR_CHECK(gpio_set_pull_mode(ring_in, GPIO_PULLDOWN_ONLY));
-#elif CONFIG_INTERCOM_RING_GPIO_PIN_PULL_UP
-    ESP_ERROR_CHECK(gpio_set_pull_mode(ring_in, GPIO_PULLUP_ONLY));
-#endif 
+// Hands a notification to every sink, or to none while one of them is full, so that no sink gets an event twice.
+bool submit_to_sinks(notification_kind kind, const char* text, int64_t created_us)
+{
+    for(const notification_dispatcher& dispatcher : notifications)
+    {
+        if(!dispatcher.has_room())
+        {
+            return false;
+        }
+    }
+#if CONFIG_INTERCOM_OUTBOX
+    uint32_t id = outbox.take_id();
+#else
+    uint32_t id = 0;
+#endif
+    for(size_t sink = 0; sink < notification_sink_count; sink++)
+    {
+        if(!notifications[sink].submit(kind, text, created_us, id))
+        {
+            ESP_LOGW(main_log_tag, "%s notification to %s lost", notification_kind_name(kind), notification_sinks[sink].name);
+        }
+    }
+    return true;
+}
 
-#if CONFIG_INTERCOM_DOOR_GPIO_PIN_PULL_DOWN
-    ESP_ERROR_CHECK(gpio_set_pull_mode(door_in, GPIO_PULLDOWN_ONLY));
-#elif CONFIG_INTERCOM_RING_GPIO_PIN_PULL_UP
-    ESP_ERROR_CHECK(gpio_set_pull_mode(door_in, GPIO_PULLUP_ONLY));
-#endif 
+bool notifications_busy()
+{
+    for(const notification_dispatcher& dispatcher : notifications)
+    {
+        if(dispatcher.busy())
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-    int ring_level = gpio_get_level(ring_in);
-    ESP_LOGI(main_log_tag, "Setting ring sensor pin to GPIO %d", CONFIG_INTERCOM_RING_GPIO_PIN);
-    ESP_LOGD(main_log_tag, "Current level of Ring GPIO %d: %d", CONFIG_INTERCOM_RING_GPIO_PIN, ring_level);
+// With the outbox, a wake whose Wi-Fi gave up sleeps rather than wait out the deadline of what it could not send:
+// the notifications are kept for the next connection, an audio clip is dropped.
+bool sending_given_up()
+{
+#if CONFIG_INTERCOM_OUTBOX
+    return wifi_failed;
+#else
+    return false;
+#endif
+}
 
-    int door_level = gpio_get_level(door_in);
-    ESP_LOGI(main_log_tag, "Setting door bell sensor pin to GPIO %d", CONFIG_INTERCOM_DOOR_GPIO_PIN);
-    ESP_LOGD(main_log_tag, "Current level of Door GPIO %d: %d", CONFIG_INTERCOM_DOOR_GPIO_PIN, door_level);
+void set_network_online(bool online)
+{
+    network_online = online;
+    for(notification_dispatcher& dispatcher : notifications)
+    {
+        dispatcher.set_online(online);
+    }
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    commands.set_online(online);
+#endif
+}
 
-    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+// Hands the notification of a pending event to the sinks. While one of them is full the event stays pending.
+void submit_notification(size_t channel)
+{
+    sensor_state& state = sensor_states[channel];
+    if(state.notification_timestamp != -1
+        && state.sensor_timestamp - state.notification_timestamp <= sensor_channels[channel].notification_cooldown_ms * 1000LL)
+    {
+        ESP_LOGD(main_log_tag, "%s notification suppressed by cooldown", sensor_channels[channel].name);
+        EVENT_LOG(event_kind::sensor, EVENT_FLAG_CHANNEL(channel) | EVENT_FLAG_COOLDOWN, state.sensor_timestamp / 1000, state.sensor_timestamp);
+        state.notification_pending = false;
+        return;
+    }
 
-    ESP_ERROR_CHECK(gpio_set_intr_type(ring_in, gpio_int_type_t::GPIO_INTR_ANYEDGE));
-    ESP_ERROR_CHECK(gpio_intr_enable(ring_in));
-    ESP_ERROR_CHECK(gpio_set_intr_type(door_in, gpio_int_type_t::GPIO_INTR_ANYEDGE));
-    ESP_ERROR_CHECK(gpio_intr_enable(door_in));
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    if(rtc_time_s() < muted_until_s)
+    {
+        ESP_LOGI(main_log_tag, "%s notification muted for %lu more s", sensor_channels[channel].name, static_cast<unsigned long>(muted_until_s - rtc_time_s()));
+        EVENT_LOG(event_kind::sensor, EVENT_FLAG_CHANNEL(channel) | EVENT_FLAG_MUTED, state.sensor_timestamp / 1000, state.sensor_timestamp);
+        state.notification_pending = false;
+        return;
+    }
+#endif
 
-    
-    ESP_ERROR_CHECK(gpio_isr_handler_add(ring_in, ring_isr_handler, (void*)ring_in));
-    ESP_ERROR_CHECK(gpio_isr_handler_add(door_in, ring_isr_handler, (void*)door_in));
+    if(submit_to_sinks(sensor_notification(channel), sensor_channels[channel].text, state.sensor_timestamp))
+    {
+        EVENT_LOG(event_kind::sensor, EVENT_FLAG_CHANNEL(channel), state.sensor_timestamp / 1000, state.sensor_timestamp);
+        state.notification_timestamp = state.sensor_timestamp;
+        state.notification_pending = false;
+#if CONFIG_INTERCOM_AUDIO_CLIP
+        audio_clips.trigger(channel, state.sensor_timestamp);
+#endif
+    }
 }
 
-void send_ring_notification()
+#if CONFIG_INTERCOM_OUTBOX
+// Keeps an event a sink did not deliver for the next connection, or settles a backlog. What the server refused
+// for good would only be refused again and is not kept.
+void settle_outbox(size_t sink, const notification_result& result)
 {
-    ESP_LOGD(main_log_tag, "send_ring_notification called");
+    if(result.kind != notification_kind::backlog)
+    {
+        if(result.outcome != notification_outcome::delivered && result.outcome != notification_outcome::rejected)
+        {
+            outbox.store(sink, result);
+        }
+    }
+    else if(result.outcome == notification_outcome::delivered || result.outcome == notification_outcome::rejected)
+    {
+        outbox.acknowledge(sink);
+        // Kinds that did not fit the backlog go in the next one.
+        outbox_flush_due = true;
+    }
+    else
+    {
+        outbox.release(sink, result.unconfirmed);
+    }
+}
 
-#ifdef CONFIG_INTERCOM_TELEGRAM_ENABLED
-    int status_code = telegram_send_notification("Intercom Ring!");
-    if(status_code != 200)
+// Hands each sink a backlog of what it owes. Returns false while a sink that owes events had no room for it.
+bool flush_outbox()
+{
+    bool done = true;
+    for(size_t sink = 0; sink < notification_sink_count; sink++)
     {
-        led_indicator.set_code(led_indicator_code::http_error);
+        notification_message backlog;
+        if(outbox.sending(sink) || !outbox.compose(sink, notification_text, backlog))
+        {
+            continue;
+        }
+        if(notifications[sink].submit(backlog))
+        {
+            ESP_LOGI(main_log_tag, "Backlog of %u event(s), ids %lu to %lu, handed to %s%s", static_cast<unsigned>(backlog.count),
+                static_cast<unsigned long>(backlog.first_id), static_cast<unsigned long>(backlog.id), notification_sinks[sink].name,
+                backlog.unconfirmed ? " as a possible repeat" : "");
+        }
+        else
+        {
+            outbox.release(sink, false);
+            done = false;
+        }
     }
+    return done;
+}
+#endif
+
+void on_notification_results()
+{
+    for(size_t sink = 0; sink < notification_sink_count; sink++)
+    {
+        notification_result result;
+        while(notifications[sink].take_result(result))
+        {
+            ESP_LOGI(main_log_tag, "%s notification to %s (%u event(s)) %s after %u attempt(s), status %d, %lld ms after the event",
+                notification_kind_name(result.kind), notification_sinks[sink].name, static_cast<unsigned>(result.events),
+                notification_outcome_name(result.outcome), static_cast<unsigned>(result.attempts), result.status_code,
+                static_cast<long long>(result.latency_us / 1000));
+            if(result.outcome != notification_outcome::delivered)
+            {
+                EVENT_LOG(event_kind::notification_failed, result.kind, result.status_code, -1);
+                led_indicator.set_code(led_indicator_code::http_error);
+            }
+            else
+            {
+                EVENT_LOG(event_kind::notification_delivered, result.kind, result.latency_us / 1000, -1);
+            }
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+            (result.outcome == notification_outcome::delivered ? delivered_this_wake : failed_this_wake) += result.events;
+#endif
+#if CONFIG_INTERCOM_OUTBOX
+            settle_outbox(sink, result);
 #endif
+        }
+    }
 }
 
-void send_door_notification()
+void enter_deep_sleep()
 {
-    ESP_LOGD(main_log_tag, "send_door_notification called");
+    ESP_LOGI(main_log_tag, "Preparing for deep-sleep...");
+    // Makes room in the result queues for what the dispatchers give up on.
+    on_notification_results();
+    // Waits for a request in progress, then closes the connection on the dispatcher task.
+    for(notification_dispatcher& dispatcher : notifications)
+    {
+        dispatcher.stop(NOTIFICATION_STOP_TIMEOUT_MS / portTICK_PERIOD_MS);
+    }
+    // Notifications the dispatchers gave up on go to the outbox.
+    on_notification_results();
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    // The poll in progress ends before the sleep deadline, unless the deadline was brought forward after it started.
+    commands.stop((CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S + 10) * 1000 / portTICK_PERIOD_MS);
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_ENABLED
+    telegram_log_stats();
+#endif
+#if CONFIG_INTERCOM_MQTT_ENABLED
+    mqtt_log_stats();
+#endif
+#if CONFIG_INTERCOM_EARLY_WIFI_START
+    // Only a wake shorter than the driver init could get here first.
+    xEventGroupWaitBits(main_event_group, EVENT_WIFI_STARTED, pdFALSE, pdTRUE, portMAX_DELAY);
+#endif
+    wifi_deinit_and_stop();
+
+#if CONFIG_INTERCOM_EVENT_LOG
+    // With the radio off, so the flash writes do not add to the peak current.
+    event_history.flush(false);
+#endif
 
-#ifdef CONFIG_INTERCOM_TELEGRAM_ENABLED
-    int status_code = telegram_send_notification("Door Bell Ring!");
-    if(status_code != 200)
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    WAKE_PROBE(wake_phase::awake, 0);
+    // At the end of the wake rather than at the start of the next, so the log output never delays a notification.
+    if(CONFIG_INTERCOM_WAKE_PROFILE_REPORT_INTERVAL > 0 && wake_profile.cycle % CONFIG_INTERCOM_WAKE_PROFILE_REPORT_INTERVAL == 0)
     {
-        led_indicator.set_code(led_indicator_code::http_error);
+        wake_profile_report(wake_profile, CONFIG_INTERCOM_WAKE_PROFILE_REPORT_CYCLES);
     }
 #endif
+
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+    init_ulp();
+    ESP_ERROR_CHECK(esp_sleep_enable_ulp_wakeup());
+    ESP_LOGI(main_log_tag, "ULP checks Ring pin (%d) and Door Bell pin (%d) every %d ms", CONFIG_INTERCOM_RING_GPIO_PIN, CONFIG_INTERCOM_DOOR_GPIO_PIN, CONFIG_INTERCOM_ULP_WAKE_PERIOD_MS);
+#else
+    sensor_lines::enable_wakeup();
+#endif
+
+#ifdef CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    uint32_t sleep_duration = sleep_scheduler_timer_interval(sleep_schedule, static_cast<uint32_t>(energy_rtc_time_us() / 1000000));
+#else
+    uint32_t sleep_duration = CONFIG_INTERCOM_DEEP_SLEEP_DURATION;
+#endif
+    ESP_LOGI(main_log_tag, "Waking up in %lu seconds...", static_cast<unsigned long>(sleep_duration));
+    esp_sleep_enable_timer_wakeup(1000000ULL * sleep_duration);
+#endif
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    // Last, so that the awake time takes in as much of the wake as it can.
+    energy_finish(energy_account);
+#endif
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    // What it took to connect is what the next event pays if it finds the chip asleep. The idle hold is not part of it.
+    if(energy_account.wake.state_us[static_cast<size_t>(energy_state::wifi_scan)] > 0)
+    {
+        uint64_t wake_uc = 0;
+        for(energy_state state : {energy_state::cpu_active, energy_state::wifi_scan, energy_state::tls})
+        {
+            wake_uc += energy_charge_uc(state, energy_account.wake.state_us[static_cast<size_t>(state)]);
+        }
+        sleep_scheduler_observe_wake(sleep_schedule, static_cast<uint32_t>(wake_uc));
+    }
+#endif
+    ESP_LOGI(main_log_tag, "Sleeping...");
+    esp_deep_sleep_start();
 }
 
-#if CONFIG_INTERCOM_BOOT_NOTIFICATION
-void send_boot_notification()
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+// Acts on a remote command and writes the answer to it into reply.
+void answer_command(const command_request& request, char* reply, size_t size)
 {
-    ESP_LOGD(main_log_tag, "send_boot_notification called");
+    int64_t now = esp_timer_get_time();
+    uint32_t now_s = rtc_time_s();
+    switch(request.kind)
+    {
+        case command_kind::status:
+        {
+            int length = snprintf(reply, size, "Awake for %lld s, sleeping in %lld s. ", static_cast<long long>(now / 1000000),
+                static_cast<long long>((sleep_at_us - now) / 1000000));
+            if(now_s < muted_until_s)
+            {
+                length += snprintf(reply + length, size - length, "Muted for %lu more min. ", static_cast<unsigned long>((muted_until_s - now_s + 59) / 60));
+            }
+            length += snprintf(reply + length, size - length, "This wake: %lu notification(s) delivered, %lu failed.",
+                static_cast<unsigned long>(delivered_this_wake), static_cast<unsigned long>(failed_this_wake));
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+            // The ledger takes in a wake when it ends.
+            uint64_t today_uah = energy_account.today.charge_uc / 3600;
+            snprintf(reply + length, size - length, " Before this wake today: %lu wake(s), %llu.%llu mAh.",
+                static_cast<unsigned long>(energy_account.today.wakes), static_cast<unsigned long long>(today_uah / 1000),
+                static_cast<unsigned long long>(today_uah % 1000 / 100));
+#endif
+            break;
+        }
+        case command_kind::mute:
+        {
+            int32_t minutes = request.argument < 0 ? 60 : request.argument;
+            minutes = minutes < CONFIG_INTERCOM_TELEGRAM_COMMAND_MUTE_MAX_MIN ? minutes : CONFIG_INTERCOM_TELEGRAM_COMMAND_MUTE_MAX_MIN;
+            muted_until_s = minutes > 0 ? now_s + minutes * 60 : 0;
+            if(minutes > 0)
+            {
+                snprintf(reply, size, "Muted for %ld min.", static_cast<long>(minutes));
+            }
+            else
+            {
+                snprintf(reply, size, "Notifications are on.");
+            }
+            break;
+        }
+        case command_kind::awake:
+        {
+            int32_t minutes = request.argument < 0 ? 10 : request.argument;
+            minutes = minutes < CONFIG_INTERCOM_TELEGRAM_COMMAND_AWAKE_MAX_MIN ? minutes : CONFIG_INTERCOM_TELEGRAM_COMMAND_AWAKE_MAX_MIN;
+            awake_held_until_us = minutes > 0 ? now + minutes * 60000000LL : -1;
+            restart_sleep_timer(minutes > 0 ? minutes * 60 : CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT);
+            snprintf(reply, size, "Sleeping in %lld s.", static_cast<long long>((sleep_at_us - now) / 1000000));
+            break;
+        }
+        default:
+            snprintf(reply, size, "Commands: /status, /mute N (minutes, 0 to unmute), /awake N (minutes, 0 to sleep soon)");
+            break;
+    }
+}
 
-#ifdef CONFIG_INTERCOM_TELEGRAM_ENABLED
-    int status_code = telegram_send_notification("Intercom Listener booted!");
-    if(status_code != 200)
+void on_commands()
+{
+    command_request request;
+    while(commands.take(request))
     {
-        led_indicator.set_code(led_indicator_code::http_error);
+        char reply[COMMAND_REPLY_MAX];
+        answer_command(request, reply, sizeof(reply));
+        ESP_LOGI(main_log_tag, "Command /%s: %s", command_kind_name(request.kind), reply);
+        commands.answer(reply);
     }
-#endif
 }
 #endif
 
 extern "C" void app_main() 
 {
     esp_log_level_set(main_log_tag, INTERCOM_LOG_LEVEL);
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    energy_begin(energy_account);
+#endif
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    esp_log_level_set(scheduler_log_tag, INTERCOM_LOG_LEVEL);
+#if CONFIG_INTERCOM_EVENT_LOG
+    bool schedule_blank = sleep_schedule.magic != SLEEP_SCHEDULER_MAGIC;
+#endif
+    sleep_scheduler_begin(sleep_schedule, static_cast<uint32_t>(energy_rtc_time_us() / 1000000));
+#endif
     // rtc_gpio_deinit(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_RED_GPIO_PIN));
     // rtc_gpio_deinit(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_GREEN_GPIO_PIN));
     // rtc_gpio_deinit(static_cast<gpio_num_t>(CONFIG_INTERCOM_LED_BLUE_GPIO_PIN));
 
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    startup.app_main = esp_timer_get_time();
+    wake_profile_begin(wake_profile);
+    WAKE_PROBE_DETAIL(wake_phase::boot, 0, esp_sleep_get_wakeup_cause());
+#endif
+
     main_event_group = xEventGroupCreate();
+    xEventGroupSetBits(main_event_group, EVENT_WIFI_STARTED);
+    timers.setup();
+    timers.bind(sleep_deadline, main_event_group, EVENT_TIMER_ALARM);
+#if CONFIG_INTERCOM_BURST_CLASSIFIER && CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+    for(timer_entry& deadline : burst_deadlines)
+    {
+        timers.bind(deadline, main_event_group, EVENT_BURST_DEADLINE);
+    }
+#endif
 
+    int64_t phase_start = esp_timer_get_time();
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
+    WAKE_PROBE(wake_phase::nvs_init, phase_start);
 
     ESP_ERROR_CHECK(ret);
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    startup.nvs_ready = esp_timer_get_time();
+#endif
+    phase_start = esp_timer_get_time();
     ESP_ERROR_CHECK(esp_netif_init());
+    WAKE_PROBE(wake_phase::netif_init, phase_start);
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-
-    setup_ring_sensor();
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &on_wifi_timing_event, nullptr, nullptr));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &on_wifi_timing_event, nullptr, nullptr));
+#endif
+#if CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &energy_on_wifi_event, nullptr, nullptr));
+#endif
     led_indicator.set_code(led_indicator_code::wakeup);
 
     esp_sleep_source_t wakeup_reason = esp_sleep_get_wakeup_cause();
+#if CONFIG_INTERCOM_EVENT_LOG
+    if(event_history.begin(event_history_state))
+    {
+        EVENT_LOG(event_kind::power_on, 0, wakeup_reason, -1);
+    }
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+    if(schedule_blank)
+    {
+        sleep_scheduler_seed_gaps();
+    }
+#endif
+#endif
 
-    int timer_alarm_time = CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
-    bool wifi_should_connect = true;
-    if(wakeup_reason == ESP_SLEEP_WAKEUP_EXT0)
+    // NVS and the event loop are all the station needs. A timer wake only connects if a sensor line
+    // turns out to be active, which takes the sensor pins, so it keeps the old order.
+    bool wifi_started_early = false;
+#if CONFIG_INTERCOM_EARLY_WIFI_START
+    if(wakeup_reason != ESP_SLEEP_WAKEUP_TIMER)
     {
-        ESP_LOGI(main_log_tag, "Wake up by EXT0");
-        ring_sensor_timestamp = esp_timer_get_time();
-        ring_notification_pending = true;
-        ESP_LOGD(main_log_tag, "ring_notification_pending set to true");
+        start_wifi_early();
+        wifi_started_early = true;
     }
-    else if(wakeup_reason == ESP_SLEEP_WAKEUP_EXT1)
+#endif
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    telegram_begin_commands();
+#endif
+    for(size_t sink = 0; sink < notification_sink_count; sink++)
     {
-        ESP_LOGI(main_log_tag, "Wake up by EXT1");
-#if CONFIG_INTERCOM_WAKE_LEVEL == 0
-        door_sensor_timestamp = esp_timer_get_time();
-        door_notification_pending = true;
-        ESP_LOGD(main_log_tag, "door_notification_pending set to true in EXT1 handler");
-#else
-        
-        uint64_t wakeup_bits = esp_sleep_get_ext1_wakeup_status();
-        if(wakeup_bits == 0)
-        {
-            ESP_LOGE(main_log_tag, "wakeup_bits is 0!");
-        }
+        notifications[sink].start(notification_sinks[sink], main_event_group, EVENT_NOTIFICATION_RESULT, EVENT_NOTIFICATION_STOPPED);
+    }
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    commands.start(command_source, main_event_group, EVENT_COMMAND, EVENT_COMMANDS_STOPPED);
+#endif
 
-        if(wakeup_bits & (1 << CONFIG_INTERCOM_RING_GPIO_PIN))
-        {
-            ring_sensor_timestamp = esp_timer_get_time();
-            ring_notification_pending = true;
-            ESP_LOGD(main_log_tag, "ring_notification_pending set to true in EXT1 handler");
-        }
-        
-        if(wakeup_bits & (1 << CONFIG_INTERCOM_DOOR_GPIO_PIN))
-        {
-            door_sensor_timestamp = esp_timer_get_time();
-            door_notification_pending = true;
-            ESP_LOGD(main_log_tag, "door_notification_pending set to true in EXT1 handler");
-        }
+    phase_start = esp_timer_get_time();
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT || CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+    sensors.setup(main_event_group, EVENT_SENSOR_BURST);
+#else
+    sensors.setup(main_event_group, EVENT_SENSOR_EDGE);
+#endif
+    WAKE_PROBE(wake_phase::sensor_setup, phase_start);
+#if CONFIG_INTERCOM_WAKE_PROFILE
+    startup.sensors_ready = esp_timer_get_time();
+#endif
+#if CONFIG_INTERCOM_AUDIO_CLIP
+    // Right after the sensors, so a cold wake loses as little of the ring as possible.
+    audio_clips.setup();
+#endif
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+    power_setup();
 #endif
-        
+    led_indicator.start();
+#if CONFIG_INTERCOM_OUTBOX
+    outbox.begin(outbox_memory);
+    if(outbox.size() > 0)
+    {
+        ESP_LOGI(main_log_tag, "%u undelivered event(s) wait for the network", static_cast<unsigned>(outbox.size()));
+    }
+#endif
+
+    int timer_alarm_time = CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
+    bool wifi_should_connect = true;
+    if(wakeup_reason == ESP_SLEEP_WAKEUP_EXT0 || wakeup_reason == ESP_SLEEP_WAKEUP_EXT1)
+    {
+        ESP_LOGI(main_log_tag, "Wake up by %s", wakeup_reason == ESP_SLEEP_WAKEUP_EXT0 ? "EXT0" : "EXT1");
+        timer_alarm_time = on_sensor_wakeup(sensor_lines::woken_by(wakeup_reason));
+    }
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+    else if(wakeup_reason == ESP_SLEEP_WAKEUP_ULP)
+    {
+        timer_alarm_time = on_ulp_wakeup();
     }
+#endif
     else if(wakeup_reason == ESP_SLEEP_WAKEUP_TIMER)
     {
         ESP_LOGI(main_log_tag, "Wake up by TIMER");
-        int ring_level = gpio_get_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_RING_GPIO_PIN));
-        int door_level = gpio_get_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_DOOR_GPIO_PIN));
-        
-        bool sensed = false;
-        if(ring_level == CONFIG_INTERCOM_WAKE_LEVEL)
-        {
-            ring_sensor_timestamp = esp_timer_get_time();
-            ring_notification_pending = true;
-            sensed = true;
-            ESP_LOGD(main_log_tag, "ring_notification_pending set to true by Timer wakeup handler");
-        }
-
-        if(door_level == CONFIG_INTERCOM_WAKE_LEVEL)
-        {
-            door_sensor_timestamp = esp_timer_get_time();
-            door_notification_pending = true;
-            sensed = true;
-            ESP_LOGD(main_log_tag, "door_notification_pending set to true by Timer wakeup handler");
-        }
-
-        if(!sensed)
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+        // A level sample cannot tell a ring from line noise. Stay awake briefly and let the classifier decide.
+        timer_alarm_time = CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT;
+        wifi_should_connect = false;
+#else
+        uint32_t active = sensor_lines::active();
+        timer_alarm_time = on_sensor_wakeup(active);
+        if(active == 0)
         {
             timer_alarm_time = CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT;
             wifi_should_connect = false;
         }
+#endif
     }
     else
     {
@@ -302,140 +1069,198 @@ extern "C" void app_main()
 #endif
     }
 
-    if(wifi_should_connect)
+    if(wifi_should_connect && !wifi_started_early)
     {
-        bool wifi_ok = wifi_init_sta(main_event_group);
-        if(!wifi_ok)
-        {
-            led_indicator.set_code(led_indicator_code::wifi_error);
-        }
+        start_wifi();
     }
 
-    timer_setup(timer_alarm_time, main_event_group);
-    
-    bool wifi_connected = false;
+    restart_sleep_timer(timer_alarm_time);
+
+    // Every deadline of this loop is on the timer wheel, so it only runs when there is something to do.
     while(1)
     {
-        EventBits_t event_bits = xEventGroupWaitBits(main_event_group, EVENT_ALL, pdTRUE, pdFALSE, 10000 / portTICK_PERIOD_MS);
+        EventBits_t event_bits = xEventGroupWaitBits(main_event_group, EVENT_ALL, pdTRUE, pdFALSE, portMAX_DELAY);
 
         if((event_bits & EVENT_WIFI_CONNECTED) == EVENT_WIFI_CONNECTED)
         {
             ESP_LOGI(main_log_tag, "wifi connected");
-            wifi_connected = true;
+            set_network_online(true);
+#if CONFIG_INTERCOM_OUTBOX
+            wifi_failed = false;
+            outbox_flush_due = true;
+#endif
+#if CONFIG_INTERCOM_WAKE_PROFILE
+            log_startup_report();
+#endif
         }
 
         if((event_bits & EVENT_WIFI_DISCONNECTED) == EVENT_WIFI_DISCONNECTED)
         {
             ESP_LOGI(main_log_tag, "wifi disconnected");
-            wifi_connected = false;
+            set_network_online(false);
         }
 
         if((event_bits & EVENT_WIFI_FAIL) == EVENT_WIFI_FAIL)
         {
             ESP_LOGE(main_log_tag, "wifi failed to connect");
+            EVENT_LOG(event_kind::error, event_error::wifi_connect, 0, -1);
             led_indicator.set_code(led_indicator_code::wifi_error);
-            wifi_connected = false;
+            set_network_online(false);
+#if CONFIG_INTERCOM_OUTBOX
+            wifi_failed = true;
+#endif
         }
 
-        if((event_bits & EVENT_RING_SENSOR_START) == EVENT_RING_SENSOR_START)
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT
+        if((event_bits & EVENT_SENSOR_BURST) == EVENT_SENSOR_BURST)
         {
-            ESP_LOGD(main_log_tag, "Ring start detected!");
-            if(!wifi_should_connect)
+            for(size_t i = 0; i < sensor_channel_count; i++)
             {
-                wifi_should_connect = true;
-                bool wifi_ok = wifi_init_sta(main_event_group);
-                if(!wifi_ok)
+                pulse_burst burst = {};
+                if(!sensors.captures[i].take_burst(burst))
                 {
-                    led_indicator.set_code(led_indicator_code::wifi_error);
+                    continue;
                 }
+                ESP_LOGI(main_log_tag, "%s burst: %lu pulses, %lu us, %lu Hz", sensor_channels[i].name,
+                    static_cast<unsigned long>(burst.pulse_count), static_cast<unsigned long>(burst.duration_us), static_cast<unsigned long>(burst.frequency_hz));
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+                on_burst_label(i, burst.label, burst.features, burst.start_timestamp, wifi_should_connect);
+#else
+                on_sensor_start(i, burst.start_timestamp, wifi_should_connect);
+#endif
             }
-
-            int64_t timestamp = esp_timer_get_time();
-            if(ring_sensor_timestamp == -1 || (timestamp - ring_sensor_timestamp > CONFIG_INTERCOM_RING_DETECTION_COOLDOWN * 1000LL))
+        }
+#elif CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+        if((event_bits & EVENT_SENSOR_BURST) == EVENT_SENSOR_BURST)
+        {
+            for(size_t i = 0; i < sensor_channel_count; i++)
             {
-                timer_reset(CONFIG_INTERCOM_DEEP_SLEEP_DELAY);
-                ring_sensor_timestamp = timestamp;
-                ring_notification_pending = true;
-                ESP_LOGD(main_log_tag, "ring_notification_pending set to true by GPIO Interrupt");
+                tone_event tone = {};
+                if(!sensors.tones.take(i, tone))
+                {
+                    continue;
+                }
+                ESP_LOGI(main_log_tag, "%s tone classified as %s: %lu Hz, %lu/1000 of the line energy, RMS %lu, %lu block(s), %lu us",
+                    sensor_channels[i].name, burst_label_name(tone.label), static_cast<unsigned long>(tone.features.peak_hz),
+                    static_cast<unsigned long>(tone.features.share_permille), static_cast<unsigned long>(tone.features.rms),
+                    static_cast<unsigned long>(tone.features.tone_blocks), static_cast<unsigned long>(tone.features.duration_us));
+                on_signal_label(i, tone.label, tone.start_timestamp, wifi_should_connect);
             }
         }
-
-        if((event_bits & EVENT_DOOR_SENSOR_START) == EVENT_DOOR_SENSOR_START)
+#else
+        if((event_bits & EVENT_SENSOR_EDGE) == EVENT_SENSOR_EDGE)
         {
-            ESP_LOGD(main_log_tag, "Door start detected!");
-            if(!wifi_should_connect)
+            // Edges are replayed in order with their own timestamps, however long the loop was busy.
+            edge_record edges[EDGE_JOURNAL_DRAIN_BATCH];
+            size_t count;
+            while((count = sensors.journal.drain(edges, EDGE_JOURNAL_DRAIN_BATCH)) > 0)
             {
-                wifi_should_connect = true;
-                bool wifi_ok = wifi_init_sta(main_event_group);
-                if(!wifi_ok)
+                int64_t now = esp_timer_get_time();
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+                // The interrupt timed the edges with esp_timer.
+                uint32_t now_cycles = static_cast<uint32_t>(now);
+                uint32_t cycles_per_us = 1;
+#else
+                uint32_t now_cycles = esp_cpu_get_cycle_count();
+                uint32_t cycles_per_us = esp_rom_get_cpu_ticks_per_us();
+#endif
+                for(size_t i = 0; i < count; i++)
                 {
-                    led_indicator.set_code(led_indicator_code::wifi_error);
+                    const edge_record& edge = edges[i];
+                    int64_t timestamp = edge_timestamp(edge, now, now_cycles, cycles_per_us);
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+                    burst_tracker& tracker = burst_trackers[edge.channel];
+                    on_burst_label(edge.channel, tracker.expire(timestamp), tracker.features(), timestamp, wifi_should_connect);
+                    on_burst_label(edge.channel, tracker.edge(edge.level, timestamp), tracker.features(), timestamp, wifi_should_connect);
+#else
+                    bool start = edge.level == sensor_channels[edge.channel].wake_level;
+                    ESP_LOGD(main_log_tag, "%s %s detected at %lld us", sensor_channels[edge.channel].name, start ? "start" : "end", static_cast<long long>(timestamp));
+                    if(start)
+                    {
+                        on_sensor_start(edge.channel, timestamp, wifi_should_connect);
+                    }
+#endif
                 }
             }
 
-            int64_t timestamp = esp_timer_get_time();
-            if(door_sensor_timestamp == -1 || (timestamp - door_sensor_timestamp > CONFIG_INTERCOM_RING_DETECTION_COOLDOWN * 1000LL))
+            uint32_t overflows = sensors.journal.overflows();
+            if(overflows != sensor_journal_overflows)
             {
-                timer_reset(CONFIG_INTERCOM_DEEP_SLEEP_DELAY);
-                door_sensor_timestamp = timestamp;
-                door_notification_pending = true;
-                ESP_LOGD(main_log_tag, "door_notification_pending set to true by GPIO Interrupt");
+                ESP_LOGW(main_log_tag, "Edge journal overflowed, %lu edge(s) dropped so far (high watermark %lu of %u)",
+                    static_cast<unsigned long>(overflows), static_cast<unsigned long>(sensors.journal.high_watermark()), static_cast<unsigned>(sensors.journal.capacity()));
+                EVENT_LOG(event_kind::error, event_error::edge_journal_overflow, overflows - sensor_journal_overflows, -1);
+                sensor_journal_overflows = overflows;
             }
         }
 
-        if((event_bits & EVENT_RING_SENSOR_END) == EVENT_RING_SENSOR_END)
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+        if((event_bits & (EVENT_SENSOR_EDGE | EVENT_BURST_DEADLINE)) != 0)
         {
-            ESP_LOGD(main_log_tag, "Ring end detected!");
+            expire_bursts(wifi_should_connect);
         }
+#endif
+#endif
 
-        if((event_bits & EVENT_DOOR_SENSOR_END) == EVENT_DOOR_SENSOR_END)
+        // Delivery waits for Wi-Fi on the dispatcher task, the events are handed over right away.
+        for(size_t i = 0; i < sensor_channel_count; i++)
         {
-            ESP_LOGD(main_log_tag, "Door end detected!");
+            if(sensor_states[i].notification_pending)
+            {
+                submit_notification(i);
+            }
         }
 
-        if(wifi_connected && ring_notification_pending)
+#if CONFIG_INTERCOM_BOOT_NOTIFICATION
+        if(boot_notification_pending && submit_to_sinks(notification_kind::boot, BOOT_NOTIFICATION_TEXT, esp_timer_get_time()))
         {
-            int64_t timestamp = esp_timer_get_time();
-            if(ring_notification_timestamp == -1 || (timestamp - ring_notification_timestamp > CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN * 1000LL))
-            {
-                ring_notification_timestamp = timestamp;
-                send_ring_notification();
-            }
-            
-            // Clear pending flag, since we don't want deferred notification
-            ring_notification_pending = false;
+            boot_notification_pending = false;
         }
+#endif
 
-        if(wifi_connected && door_notification_pending)
+        if((event_bits & EVENT_NOTIFICATION_RESULT) == EVENT_NOTIFICATION_RESULT)
         {
-            int64_t timestamp = esp_timer_get_time();
-            if(door_notification_timestamp == -1 || (timestamp - door_notification_timestamp > CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN * 1000LL))
-            {
-                door_notification_timestamp = timestamp;
-                send_door_notification();
-            }
-            
-            // Clear pending flag, since we don't want deferred notification
-            door_notification_pending = false;
+            on_notification_results();
         }
 
-#if CONFIG_INTERCOM_BOOT_NOTIFICATION
-        if(wifi_connected && boot_notification_pending)
+#if CONFIG_INTERCOM_OUTBOX
+        // After the events of this loop, so a backlog and a new event can share a request.
+        if(outbox_flush_due && network_online)
         {
-            send_boot_notification();
-            boot_notification_pending = false;
+            outbox_flush_due = !flush_outbox();
+        }
+#endif
+
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+        if((event_bits & EVENT_COMMAND) == EVENT_COMMAND)
+        {
+            on_commands();
         }
 #endif
 
-        if((event_bits & EVENT_TIMER_ALARM) == EVENT_TIMER_ALARM)
+        // An alarm from before the last restart of the sleep timer no longer stands.
+        if((event_bits & EVENT_TIMER_ALARM) == EVENT_TIMER_ALARM && timers.take_expired(sleep_deadline))
         {
             ESP_LOGI(main_log_tag, "sleep timer expired");
-            int ring_level = gpio_get_level(static_cast<gpio_num_t>(CONFIG_INTERCOM_RING_GPIO_PIN));
-            if(ring_level == CONFIG_INTERCOM_WAKE_LEVEL)
+            uint32_t active = sensor_lines::active();
+            if(active != 0)
+            {
+                ESP_LOGW(main_log_tag, "Sensor line(s) 0x%lx still at the wake level. Extending timer.", static_cast<unsigned long>(active));
+                restart_sleep_timer(CONFIG_INTERCOM_DEEP_SLEEP_DELAY);
+            }
+            else if(!sending_given_up() && notifications_busy())
             {
-                ESP_LOGW(main_log_tag, "Ring sensor still at level %d. Extending timer.", ring_level);
-                timer_reset(CONFIG_INTERCOM_DEEP_SLEEP_DELAY);
+                // Bounded by the notification deadline.
+                ESP_LOGI(main_log_tag, "Notification delivery in progress. Extending timer.");
+                restart_sleep_timer(CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT);
             }
+#if CONFIG_INTERCOM_AUDIO_CLIP
+            else if(!sending_given_up() && audio_clips.busy())
+            {
+                // Bounded by the clip length and the notification deadline.
+                ESP_LOGI(main_log_tag, "Audio clip not sent yet. Extending timer.");
+                restart_sleep_timer(CONFIG_INTERCOM_DEEP_SLEEP_DELAY_SHORT);
+            }
+#endif
             else
             {
 #if CONFIG_INTERCOM_DEEP_SLEEP_ENABLED
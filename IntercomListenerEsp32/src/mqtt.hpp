@@ -0,0 +1,148 @@
+#pragma once
+
+#if CONFIG_INTERCOM_MQTT_ENABLED
+
+#include <stdio.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "json_writer.hpp"
+#include "mqtt_connection.hpp"
+#include "notification_dispatcher.hpp"
+
+// One payload. Notification texts are short literals; a text that does not fit is refused like an oversized Telegram message.
+#define MQTT_PAYLOAD_SIZE 224
+// Bit of the last byte of a binary payload.
+#define MQTT_PAYLOAD_FLAG_REPEAT 0x01
+
+static_assert(CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE <= MQTT_CONNECTION_MAX_IN_FLIGHT, "A batch must fit one publish");
+
+// Survives deep sleep: the broker keeps the session, this remembers that it does and where the packet identifiers are.
+RTC_DATA_ATTR mqtt_session_state mqtt_session;
+#if CONFIG_INTERCOM_MQTT_TLS
+RTC_DATA_ATTR tls_session_slot mqtt_tls_session;
+mqtt_connection mqtt_broker(CONFIG_INTERCOM_MQTT_HOST, CONFIG_INTERCOM_MQTT_PORT, true,
+    {CONFIG_INTERCOM_MQTT_CLIENT_ID, CONFIG_INTERCOM_MQTT_USERNAME, CONFIG_INTERCOM_MQTT_PASSWORD, CONFIG_INTERCOM_MQTT_KEEP_ALIVE},
+    mqtt_session, &mqtt_tls_session);
+#else
+mqtt_connection mqtt_broker(CONFIG_INTERCOM_MQTT_HOST, CONFIG_INTERCOM_MQTT_PORT, false,
+    {CONFIG_INTERCOM_MQTT_CLIENT_ID, CONFIG_INTERCOM_MQTT_USERNAME, CONFIG_INTERCOM_MQTT_PASSWORD, CONFIG_INTERCOM_MQTT_KEEP_ALIVE},
+    mqtt_session);
+#endif
+
+constexpr size_t mqtt_event_name_max()
+{
+    size_t longest = sizeof("boot") - 1;
+    for(const sensor_channel_config& channel : sensor_channels)
+    {
+        size_t length = 0;
+        while(channel.name[length] != '\0')
+        {
+            length++;
+        }
+        longest = length > longest ? length : longest;
+    }
+    return longest;
+}
+
+// Topic and payload of every message of a batch, nothing is allocated per notification.
+char mqtt_topics[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE][sizeof(CONFIG_INTERCOM_MQTT_TOPIC) + 1 + mqtt_event_name_max()];
+char mqtt_payloads[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE][MQTT_PAYLOAD_SIZE];
+
+// Writes the payload of one message into payload. Returns its length, 0 if it does not fit.
+size_t mqtt_encode_payload(const notification_message& message, int64_t now, char (&payload)[MQTT_PAYLOAD_SIZE])
+{
+    int64_t age_ms = (now - message.created_us) / 1000;
+    int64_t span_ms = (message.last_us - message.created_us) / 1000;
+#if CONFIG_INTERCOM_MQTT_PAYLOAD_BINARY
+    uint32_t age = static_cast<uint32_t>(age_ms);
+    uint32_t span = static_cast<uint32_t>(span_ms);
+    uint32_t id = message.id;
+    uint32_t first_id = message.first_id;
+    uint8_t fields[] =
+    {
+        static_cast<uint8_t>(message.kind),
+        static_cast<uint8_t>(message.count), static_cast<uint8_t>(message.count >> 8),
+        static_cast<uint8_t>(age), static_cast<uint8_t>(age >> 8), static_cast<uint8_t>(age >> 16), static_cast<uint8_t>(age >> 24),
+        static_cast<uint8_t>(span), static_cast<uint8_t>(span >> 8), static_cast<uint8_t>(span >> 16), static_cast<uint8_t>(span >> 24),
+        static_cast<uint8_t>(id), static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id >> 16), static_cast<uint8_t>(id >> 24),
+        static_cast<uint8_t>(first_id), static_cast<uint8_t>(first_id >> 8), static_cast<uint8_t>(first_id >> 16), static_cast<uint8_t>(first_id >> 24),
+        static_cast<uint8_t>(message.unconfirmed ? MQTT_PAYLOAD_FLAG_REPEAT : 0)
+    };
+    memcpy(payload, fields, sizeof(fields));
+    return sizeof(fields);
+#else
+    json_writer body(payload);
+    body.begin_object()
+        .key("event").string(notification_kind_name(message.kind))
+        .key("text").string(message.text)
+        .key("count").number(message.count)
+        .key("age_ms").number(age_ms)
+        .key("span_ms").number(span_ms)
+        .key("id").number(message.id)
+        .key("first_id").number(message.first_id)
+        .key("repeat").boolean(message.unconfirmed)
+        .end_object();
+    return body.ok() ? static_cast<size_t>(body.size()) : 0;
+#endif
+}
+
+// Opens the connection and the broker session ahead of the first notification.
+bool mqtt_connect()
+{
+    esp_log_level_set(mqtt_log_tag, INTERCOM_LOG_LEVEL);
+    return mqtt_broker.open() == 200;
+}
+
+void mqtt_keep_warm()
+{
+    mqtt_broker.keep_warm();
+}
+
+void mqtt_disconnect()
+{
+    mqtt_broker.close();
+}
+
+void mqtt_log_stats()
+{
+    mqtt_session_log_stats(mqtt_session);
+#if CONFIG_INTERCOM_MQTT_TLS
+    tls_session_log_stats(mqtt_tls_session);
+#endif
+}
+
+// Publishes every message of the batch to <topic prefix>/<event>, each with a payload of its own. One an earlier attempt
+// may have published already is flagged as a repeat in its payload, for consumers to drop by its ids.
+int mqtt_send_notification(const notification_batch& batch)
+{
+    esp_log_level_set(mqtt_log_tag, INTERCOM_LOG_LEVEL);
+
+    int64_t start = esp_timer_get_time();
+    mqtt_message messages[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE];
+    for(size_t i = 0; i < batch.count; i++)
+    {
+        const notification_message& message = *batch.messages[i];
+        snprintf(mqtt_topics[i], sizeof(mqtt_topics[i]), "%s/%s", CONFIG_INTERCOM_MQTT_TOPIC, notification_kind_name(message.kind));
+        size_t length = mqtt_encode_payload(message, start, mqtt_payloads[i]);
+        if(length == 0)
+        {
+            // Reported as 413 Payload Too Large, which is not retried.
+            ESP_LOGE(mqtt_log_tag, "%s notification does not fit the %d byte payload buffer", notification_kind_name(message.kind), MQTT_PAYLOAD_SIZE);
+            return 413;
+        }
+        messages[i] = {mqtt_topics[i], mqtt_payloads[i], length};
+    }
+
+    bool reused = mqtt_broker.is_connected();
+    int status_code = mqtt_broker.publish(messages, batch.count);
+    ESP_LOGI(mqtt_log_tag, "%u message(s) published with status %d in %lld ms on %s connection", static_cast<unsigned>(batch.count), status_code,
+        static_cast<long long>((esp_timer_get_time() - start) / 1000), reused ? "a kept-alive" : "a new");
+    if(status_code < 0)
+    {
+        return status_code == MQTT_STATUS_NO_ACK ? NOTIFICATION_STATUS_UNCONFIRMED : NOTIFICATION_STATUS_NOT_SENT;
+    }
+    return status_code;
+}
+
+#endif
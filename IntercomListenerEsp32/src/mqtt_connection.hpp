@@ -0,0 +1,600 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "log_level.h"
+#include "tls_transport.hpp"
+#include "energy_account.hpp"
+
+#define MQTT_CONNECTION_TIMEOUT_MS 10000
+// CONNECT with its credentials, or the fixed header, topic and packet identifier of one PUBLISH.
+#define MQTT_CONNECTION_PACKET_BUFFER 256
+// Longest fixed header: the type byte and four bytes of remaining length.
+#define MQTT_CONNECTION_FIXED_HEADER_MAX 5
+#define MQTT_CONNECTION_RECEIVE_BUFFER 16
+// PUBLISH packets one publish() call can have in flight.
+#define MQTT_CONNECTION_MAX_IN_FLIGHT 16
+#define MQTT_SESSION_MAGIC 0x4d515431
+// What publish() returns when the broker acknowledged nothing: no PUBLISH went out in full.
+#define MQTT_STATUS_NOT_SENT -1
+// A PUBLISH went out but its PUBACK never arrived, so the broker may have taken it.
+#define MQTT_STATUS_NO_ACK -2
+
+static const char* mqtt_log_tag = "mqtt";
+
+// MQTT 3.1.1 control packet types, the high nibble of the first byte.
+enum class mqtt_packet : uint8_t
+{
+    connect = 1,
+    connack = 2,
+    publish = 3,
+    puback = 4,
+    pingreq = 12,
+    pingresp = 13,
+    disconnect = 14
+};
+
+#define MQTT_CONNECT_FLAG_USERNAME 0x80
+#define MQTT_CONNECT_FLAG_PASSWORD 0x40
+#define MQTT_CONNACK_SESSION_PRESENT 0x01
+#define MQTT_PUBLISH_FLAG_DUP 0x08
+#define MQTT_PUBLISH_FLAG_QOS1 0x02
+
+// Who the client is to the broker. The strings must outlive the connection, Kconfig literals in practice.
+struct mqtt_client_options
+{
+    const char* client_id;
+    // Empty for none.
+    const char* username;
+    const char* password;
+    uint16_t keep_alive_s;
+};
+
+/*
+    What the client keeps of its broker session through deep sleep.
+
+    Meant to be declared RTC_DATA_ATTR; magic tells a state written by an earlier wake from the zeroes of
+    power-on. The broker holds the session itself, this only remembers that it should, and keeps counting
+    packet identifiers so a new wake never reuses one the broker may still associate with an earlier message.
+*/
+struct mqtt_session_state
+{
+    uint32_t magic;
+    uint16_t next_packet_id;
+    // The broker accepted this client before, so the next CONNECT should find the session present.
+    bool established;
+    uint32_t sessions_new;
+    uint32_t sessions_resumed;
+    // The broker answered CONNECT without the session it had before.
+    uint32_t sessions_lost;
+    // PUBLISH packets acknowledged by the broker.
+    uint32_t published;
+    // PUBLISH packets sent again, flagged DUP, after the connection broke before their PUBACK.
+    uint32_t redelivered;
+};
+
+inline void mqtt_session_init(mqtt_session_state& state)
+{
+    if(state.magic != MQTT_SESSION_MAGIC)
+    {
+        state = {};
+        state.magic = MQTT_SESSION_MAGIC;
+        state.next_packet_id = 1;
+    }
+}
+
+inline void mqtt_session_log_stats(const mqtt_session_state& state)
+{
+    ESP_LOGI(mqtt_log_tag, "MQTT sessions: %lu resumed, %lu new, %lu lost by the broker; %lu message(s) acknowledged, %lu redelivered",
+        static_cast<unsigned long>(state.sessions_resumed), static_cast<unsigned long>(state.sessions_new),
+        static_cast<unsigned long>(state.sessions_lost), static_cast<unsigned long>(state.published),
+        static_cast<unsigned long>(state.redelivered));
+}
+
+// One application message. The pointers must stay valid until publish() returns.
+struct mqtt_message
+{
+    const char* topic;
+    const char* payload;
+    size_t length;
+};
+
+// Lays out a packet body first and then puts the fixed header in front of it, so the remaining length needs no second pass.
+class mqtt_packet_builder
+{
+private:
+    uint8_t buffer[MQTT_CONNECTION_FIXED_HEADER_MAX + MQTT_CONNECTION_PACKET_BUFFER];
+    size_t start = MQTT_CONNECTION_FIXED_HEADER_MAX;
+    size_t end = MQTT_CONNECTION_FIXED_HEADER_MAX;
+    bool overflow = false;
+
+public:
+    void byte(uint8_t value)
+    {
+        if(end >= sizeof(buffer))
+        {
+            overflow = true;
+            return;
+        }
+        buffer[end++] = value;
+    }
+
+    void word(uint16_t value)
+    {
+        byte(static_cast<uint8_t>(value >> 8));
+        byte(static_cast<uint8_t>(value));
+    }
+
+    // A UTF-8 string field: two bytes of length, then the bytes.
+    void string(const char* value)
+    {
+        size_t length = strlen(value);
+        if(length > 0xffff)
+        {
+            overflow = true;
+            return;
+        }
+        word(static_cast<uint16_t>(length));
+        for(size_t i = 0; i < length; i++)
+        {
+            byte(static_cast<uint8_t>(value[i]));
+        }
+    }
+
+    // Puts the fixed header in front of the body. trailing counts bytes sent after the packet, a PUBLISH payload.
+    void finish(mqtt_packet type, uint8_t flags, size_t trailing = 0)
+    {
+        size_t remaining = end - MQTT_CONNECTION_FIXED_HEADER_MAX + trailing;
+        uint8_t encoded[MQTT_CONNECTION_FIXED_HEADER_MAX - 1];
+        size_t count = 0;
+        do
+        {
+            uint8_t digit = remaining % 128;
+            remaining /= 128;
+            encoded[count++] = remaining > 0 ? digit | 0x80 : digit;
+        }
+        while(remaining > 0 && count < sizeof(encoded));
+        overflow |= remaining > 0;
+
+        start = MQTT_CONNECTION_FIXED_HEADER_MAX - count - 1;
+        buffer[start] = static_cast<uint8_t>(static_cast<uint8_t>(type) << 4 | flags);
+        memcpy(buffer + start + 1, encoded, count);
+    }
+
+    bool ok() const
+    {
+        return !overflow;
+    }
+
+    const uint8_t* data() const
+    {
+        return buffer + start;
+    }
+
+    size_t size() const
+    {
+        return end - start;
+    }
+};
+
+/*
+    One long-lived MQTT 3.1.1 connection to a broker, on a tls_transport like https_connection.
+
+    The client connects without a clean session, so the broker keeps its session from one connection to the
+    next and through deep sleep, and publishes with QoS 1: every message is stored by the broker once its
+    PUBACK arrives. All messages of a publish() call are written back to back and their PUBACKs collected
+    afterwards, one round trip for the lot. A call that fails on a reused connection is retried once on a
+    fresh one, sending the unacknowledged messages again with their packet identifiers and the DUP flag, as
+    the protocol asks of a client that resumes its session.
+
+    Plain TCP unless use_tls is set. The TLS session is then kept in a tls_session_slot like Telegram's.
+*/
+class mqtt_connection
+{
+private:
+    const char* host;
+    int port;
+    bool use_tls;
+    mqtt_client_options options;
+    mqtt_session_state& session;
+    tls_session_slot* session_slot;
+    tls_transport transport;
+    int64_t last_activity = -1;
+    uint32_t connections_opened = 0;
+
+    uint8_t receive_buffer[MQTT_CONNECTION_RECEIVE_BUFFER] = {0};
+
+public:
+    mqtt_connection(const char* hostname, int port_number, bool tls_enabled, const mqtt_client_options& client, mqtt_session_state& state,
+        tls_session_slot* slot = nullptr)
+        : host(hostname), port(port_number), use_tls(tls_enabled), options(client), session(state), session_slot(slot)
+    {
+    }
+
+    mqtt_connection(mqtt_connection const&) = delete;
+    mqtt_connection& operator=(mqtt_connection const&) = delete;
+
+    ~mqtt_connection()
+    {
+        close();
+    }
+
+    /*
+        Connects and opens the session unless the connection is up already. Returns 200 on success and
+        MQTT_STATUS_NOT_SENT if the broker could not be reached. A refused CONNECT maps to the HTTP status with the same meaning, so the
+        dispatcher's retry policy applies: 503 for a broker that is unavailable, 401 and 403 for credentials
+        it does not accept, 400 for a protocol version or client identifier it rejects.
+    */
+    int open()
+    {
+        if(transport.is_open())
+        {
+            return 200;
+        }
+        if(!connect())
+        {
+            return MQTT_STATUS_NOT_SENT;
+        }
+
+        mqtt_packet_builder packet;
+        packet.string("MQTT");
+        packet.byte(4);
+        uint8_t flags = 0;
+        if(options.username[0] != '\0')
+        {
+            flags |= MQTT_CONNECT_FLAG_USERNAME;
+        }
+        if(options.password[0] != '\0')
+        {
+            flags |= MQTT_CONNECT_FLAG_PASSWORD;
+        }
+        // No clean session flag: the broker keeps the session when the connection ends.
+        packet.byte(flags);
+        packet.word(options.keep_alive_s);
+        packet.string(options.client_id);
+        if(options.username[0] != '\0')
+        {
+            packet.string(options.username);
+        }
+        if(options.password[0] != '\0')
+        {
+            packet.string(options.password);
+        }
+        packet.finish(mqtt_packet::connect, 0);
+        if(!packet.ok())
+        {
+            ESP_LOGE(mqtt_log_tag, "CONNECT does not fit %d bytes", MQTT_CONNECTION_PACKET_BUFFER);
+            close(false);
+            return 400;
+        }
+
+        uint8_t header = 0;
+        size_t length = 0;
+        if(!write_all(packet.data(), packet.size()) || !read_packet(header, length))
+        {
+            close(false);
+            return MQTT_STATUS_NOT_SENT;
+        }
+        if(header >> 4 != static_cast<uint8_t>(mqtt_packet::connack) || length < 2)
+        {
+            ESP_LOGE(mqtt_log_tag, "%s answered CONNECT with packet 0x%02x", host, header);
+            close(false);
+            return MQTT_STATUS_NOT_SENT;
+        }
+
+        uint8_t return_code = receive_buffer[1];
+        if(return_code != 0)
+        {
+            ESP_LOGE(mqtt_log_tag, "%s refused the connection with return code %u", host, return_code);
+            close(false);
+            return connack_status(return_code);
+        }
+
+        bool session_present = (receive_buffer[0] & MQTT_CONNACK_SESSION_PRESENT) != 0;
+        if(session_present)
+        {
+            session.sessions_resumed++;
+        }
+        else
+        {
+            session.sessions_new++;
+            if(session.established)
+            {
+                session.sessions_lost++;
+                ESP_LOGW(mqtt_log_tag, "%s no longer holds the session of %s", host, options.client_id);
+            }
+        }
+        session.established = true;
+        last_activity = esp_timer_get_time();
+        ESP_LOGI(mqtt_log_tag, "Connected to %s:%d, session %s", host, port, session_present ? "resumed" : "new");
+        return 200;
+    }
+
+    // Publishes every message with QoS 1 and returns 200 once the broker acknowledged all of them. Otherwise
+    // the status of a refused connection, or MQTT_STATUS_NOT_SENT or MQTT_STATUS_NO_ACK if the connection broke on the way.
+    int publish(const mqtt_message* messages, size_t count)
+    {
+        if(count > MQTT_CONNECTION_MAX_IN_FLIGHT)
+        {
+            ESP_LOGE(mqtt_log_tag, "%u messages do not fit one publish", static_cast<unsigned>(count));
+            return 413;
+        }
+
+        uint16_t packet_ids[MQTT_CONNECTION_MAX_IN_FLIGHT];
+        bool acknowledged[MQTT_CONNECTION_MAX_IN_FLIGHT] = {};
+        for(size_t i = 0; i < count; i++)
+        {
+            packet_ids[i] = take_packet_id();
+        }
+
+        bool reused = transport.is_open();
+        int status_code = exchange(messages, count, packet_ids, acknowledged, false);
+        if(status_code < 0 && reused)
+        {
+            ESP_LOGW(mqtt_log_tag, "Publish on kept-alive connection to %s failed, reconnecting", host);
+            close(false);
+            int first_status = status_code;
+            status_code = exchange(messages, count, packet_ids, acknowledged, true);
+            // What went out the first time may still have reached the broker.
+            status_code = status_code != 200 && first_status == MQTT_STATUS_NO_ACK ? first_status : status_code;
+        }
+        if(status_code < 0)
+        {
+            ESP_LOGE(mqtt_log_tag, "Publish to %s failed", host);
+        }
+        return status_code;
+    }
+
+    // Pings an idle connection before the broker's keep-alive timer runs out. Cheap no-op otherwise.
+    void keep_warm()
+    {
+        if(!transport.is_open() || esp_timer_get_time() - last_activity < options.keep_alive_s * 500000LL)
+        {
+            return;
+        }
+
+        ESP_LOGD(mqtt_log_tag, "Pinging idle connection to %s", host);
+        static const uint8_t ping[] = {static_cast<uint8_t>(mqtt_packet::pingreq) << 4, 0};
+        if(!write_all(ping, sizeof(ping)))
+        {
+            close(false);
+            return;
+        }
+        uint8_t header = 0;
+        size_t length = 0;
+        do
+        {
+            if(!read_packet(header, length))
+            {
+                ESP_LOGW(mqtt_log_tag, "No PINGRESP from %s, connection dropped", host);
+                close(false);
+                return;
+            }
+        }
+        while(header >> 4 != static_cast<uint8_t>(mqtt_packet::pingresp));
+        last_activity = esp_timer_get_time();
+    }
+
+    // Ends the connection, with a DISCONNECT the broker takes as a clean goodbye unless graceful is false.
+    // The broker keeps the session either way.
+    void close(bool graceful = true)
+    {
+        if(!transport.is_open())
+        {
+            return;
+        }
+        if(graceful)
+        {
+            static const uint8_t disconnect[] = {static_cast<uint8_t>(mqtt_packet::disconnect) << 4, 0};
+            write_all(disconnect, sizeof(disconnect));
+        }
+        transport.close();
+    }
+
+    bool is_connected() const
+    {
+        return transport.is_open();
+    }
+
+    uint32_t connection_count() const
+    {
+        return connections_opened;
+    }
+
+private:
+    static int connack_status(uint8_t return_code)
+    {
+        switch(return_code)
+        {
+            case 3:
+                // Server unavailable.
+                return 503;
+            case 4:
+                // Bad user name or password.
+                return 401;
+            case 5:
+                // Not authorized.
+                return 403;
+            default:
+                // Unacceptable protocol version or identifier rejected.
+                return 400;
+        }
+    }
+
+    // Identifiers run from 1 to 65535; 0 is not a valid one.
+    uint16_t take_packet_id()
+    {
+        mqtt_session_init(session);
+        uint16_t id = session.next_packet_id;
+        session.next_packet_id = id == 0xffff ? 1 : id + 1;
+        return id;
+    }
+
+    // Writes the messages not yet acknowledged and waits for their PUBACKs.
+    int exchange(const mqtt_message* messages, size_t count, const uint16_t* packet_ids, bool* acknowledged, bool redelivery)
+    {
+        int status_code = open();
+        if(status_code != 200)
+        {
+            return status_code;
+        }
+
+        size_t waiting = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            if(acknowledged[i])
+            {
+                continue;
+            }
+            mqtt_packet_builder packet;
+            packet.string(messages[i].topic);
+            packet.word(packet_ids[i]);
+            packet.finish(mqtt_packet::publish, MQTT_PUBLISH_FLAG_QOS1 | (redelivery ? MQTT_PUBLISH_FLAG_DUP : 0), messages[i].length);
+            if(!packet.ok())
+            {
+                ESP_LOGE(mqtt_log_tag, "Topic %s does not fit %d bytes", messages[i].topic, MQTT_CONNECTION_PACKET_BUFFER);
+                return 413;
+            }
+            if(!write_all(packet.data(), packet.size()) || !write_all(messages[i].payload, messages[i].length))
+            {
+                close(false);
+                return waiting > 0 ? MQTT_STATUS_NO_ACK : MQTT_STATUS_NOT_SENT;
+            }
+            waiting++;
+            if(redelivery)
+            {
+                session.redelivered++;
+            }
+        }
+
+        while(waiting > 0)
+        {
+            uint8_t header = 0;
+            size_t length = 0;
+            if(!read_packet(header, length))
+            {
+                close(false);
+                return MQTT_STATUS_NO_ACK;
+            }
+            if(header >> 4 != static_cast<uint8_t>(mqtt_packet::puback) || length < 2)
+            {
+                continue;
+            }
+            uint16_t id = static_cast<uint16_t>(receive_buffer[0] << 8 | receive_buffer[1]);
+            for(size_t i = 0; i < count; i++)
+            {
+                if(!acknowledged[i] && packet_ids[i] == id)
+                {
+                    acknowledged[i] = true;
+                    session.published++;
+                    waiting--;
+                    break;
+                }
+            }
+        }
+        last_activity = esp_timer_get_time();
+        return 200;
+    }
+
+    bool connect()
+    {
+        esp_log_level_set(mqtt_log_tag, INTERCOM_LOG_LEVEL);
+        esp_log_level_set(tls_log_tag, INTERCOM_LOG_LEVEL);
+        mqtt_session_init(session);
+
+        bool connected = transport.open(host, port, use_tls, MQTT_CONNECTION_TIMEOUT_MS, use_tls ? session_slot : nullptr);
+        uint32_t duration_us = transport.connect_us();
+        if(use_tls)
+        {
+            // A plain TCP connect is no more than associated idle time.
+            ENERGY_TLS(duration_us);
+        }
+        bool resumed = transport.session_resumed();
+
+        if(!connected)
+        {
+            ESP_LOGE(mqtt_log_tag, "Could not connect to %s:%d", host, port);
+            return false;
+        }
+
+        connections_opened++;
+        ESP_LOGD(mqtt_log_tag, "%s to %s:%d in %lu ms", use_tls ? (resumed ? "Resumed TLS" : "Full TLS") : "TCP", host, port,
+            static_cast<unsigned long>(duration_us / 1000));
+        return true;
+    }
+
+    bool write_all(const void* data, size_t length)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        while(length > 0)
+        {
+            ssize_t written = transport.write(bytes, length);
+            if(written <= 0)
+            {
+                return false;
+            }
+            bytes += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    bool read_all(uint8_t* data, size_t length)
+    {
+        while(length > 0)
+        {
+            ssize_t count = transport.read(data, length);
+            if(count <= 0)
+            {
+                return false;
+            }
+            data += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    // Reads one packet. Keeps the first MQTT_CONNECTION_RECEIVE_BUFFER bytes of its body in receive_buffer
+    // and discards the rest, which only a PUBLISH from the broker could need.
+    bool read_packet(uint8_t& header, size_t& length)
+    {
+        if(!read_all(&header, 1))
+        {
+            return false;
+        }
+        length = 0;
+        for(int i = 0; ; i++)
+        {
+            uint8_t digit;
+            if(i == MQTT_CONNECTION_FIXED_HEADER_MAX - 1 || !read_all(&digit, 1))
+            {
+                return false;
+            }
+            length |= static_cast<size_t>(digit & 0x7f) << (7 * i);
+            if((digit & 0x80) == 0)
+            {
+                break;
+            }
+        }
+
+        size_t kept = length < sizeof(receive_buffer) ? length : sizeof(receive_buffer);
+        if(!read_all(receive_buffer, kept))
+        {
+            return false;
+        }
+        for(size_t skipped = kept; skipped < length; )
+        {
+            uint8_t discard[MQTT_CONNECTION_RECEIVE_BUFFER];
+            size_t chunk = length - skipped < sizeof(discard) ? length - skipped : sizeof(discard);
+            if(!read_all(discard, chunk))
+            {
+                return false;
+            }
+            skipped += chunk;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include "https_connection.hpp"
+
+#define MULTIPART_BOUNDARY "IntercomListenerFormBoundary"
+#define MULTIPART_CONTENT_TYPE "multipart/form-data; boundary=" MULTIPART_BOUNDARY
+// Longest part head: boundary, Content-Disposition with name and file name, Content-Type.
+#define MULTIPART_PART_HEAD_MAX 256
+
+/*
+    Writes a multipart/form-data body into a request in progress, from inside https_body_source::write.
+
+    Nothing is held beyond the head of the current part, which is formatted on the stack: field values
+    and file content go to the connection as they are handed in, so a file of any size is sent from
+    wherever it lies, PSRAM or flash, in pieces of whatever size the producer has. Names and file names
+    are written as they are and must not contain quotes. Once a write fails the writer drops the rest and
+    ok() turns false, so a producer can write everything and check once.
+*/
+class multipart_writer
+{
+private:
+    https_connection& connection;
+    bool failed = false;
+    bool first = true;
+
+public:
+    explicit multipart_writer(https_connection& target)
+        : connection(target)
+    {
+    }
+
+    multipart_writer& field(const char* name, const char* value)
+    {
+        part_head(name, nullptr, nullptr);
+        return write(value, strlen(value));
+    }
+
+    // Starts a file part. Its content follows in write() calls, as many as it takes.
+    multipart_writer& file(const char* name, const char* filename, const char* content_type)
+    {
+        part_head(name, filename, content_type);
+        return *this;
+    }
+
+    multipart_writer& write(const void* data, size_t length)
+    {
+        if(!failed && !connection.write_body(data, static_cast<int>(length)))
+        {
+            failed = true;
+        }
+        return *this;
+    }
+
+    // Writes the closing boundary. Returns whether the whole body went out.
+    bool end()
+    {
+        static const char tail[] = "\r\n--" MULTIPART_BOUNDARY "--\r\n";
+        write(tail, sizeof(tail) - 1);
+        return ok();
+    }
+
+    bool ok() const
+    {
+        return !failed;
+    }
+
+private:
+    void part_head(const char* name, const char* filename, const char* content_type)
+    {
+        char head[MULTIPART_PART_HEAD_MAX];
+        int length = snprintf(head, sizeof(head), "%s--" MULTIPART_BOUNDARY "\r\nContent-Disposition: form-data; name=\"%s\"%s%s%s%s%s\r\n\r\n",
+            first ? "" : "\r\n", name,
+            filename != nullptr ? "; filename=\"" : "", filename != nullptr ? filename : "", filename != nullptr ? "\"" : "",
+            content_type != nullptr ? "\r\nContent-Type: " : "", content_type != nullptr ? content_type : "");
+        first = false;
+        if(length >= static_cast<int>(sizeof(head)))
+        {
+            failed = true;
+            return;
+        }
+        write(head, length);
+    }
+};
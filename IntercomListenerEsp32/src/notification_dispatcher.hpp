@@ -0,0 +1,647 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "log_level.h"
+#include "sensor_channels.hpp"
+
+// Long enough for a request in progress to time out.
+#define NOTIFICATION_STOP_TIMEOUT_MS 20000
+// Text of one request, terminator included. Coalesced notifications that do not fit go out in the next one.
+#define NOTIFICATION_TEXT_MAX 192
+// What a transport returns when no status came back: the request did not go out in full, so nothing was delivered.
+#define NOTIFICATION_STATUS_NOT_SENT -1
+// The request went out but no response arrived, so it may have been delivered.
+#define NOTIFICATION_STATUS_UNCONFIRMED -2
+
+static const char* dispatch_log_tag = "dispatch";
+
+// What a notification is about: a sensor line, by its index in sensor_channels, the boot, or events that
+// could not be delivered when they happened.
+enum class notification_kind : uint8_t
+{
+    backlog = 0xfe,
+    boot = 0xff
+};
+
+inline notification_kind sensor_notification(size_t channel)
+{
+    return static_cast<notification_kind>(channel);
+}
+
+inline const char* notification_kind_name(notification_kind kind)
+{
+    switch(kind)
+    {
+        case notification_kind::boot:
+            return "boot";
+        case notification_kind::backlog:
+            return "backlog";
+        default:
+            return sensor_channel_name(static_cast<size_t>(kind));
+    }
+}
+
+enum class notification_outcome : uint8_t
+{
+    delivered,
+    // The server refused the request for good, e.g. 400 or 403. Retrying would not help.
+    rejected,
+    // Every attempt failed.
+    failed,
+    // The deadline passed before the notification could be delivered.
+    expired,
+    // The dispatcher was stopped, e.g. for deep sleep, before the notification could be delivered.
+    stopped
+};
+
+inline const char* notification_outcome_name(notification_outcome outcome)
+{
+    switch(outcome)
+    {
+        case notification_outcome::delivered:
+            return "delivered";
+        case notification_outcome::rejected:
+            return "rejected";
+        case notification_outcome::failed:
+            return "failed";
+        case notification_outcome::expired:
+            return "expired";
+        default:
+            return "stopped";
+    }
+}
+
+struct notification_message
+{
+    notification_kind kind;
+    // Must outlive the delivery, string literals in practice.
+    const char* text;
+    // When the event happened, esp_timer time. Latency is counted from here.
+    int64_t created_us;
+    int64_t deadline_us;
+    // Repeats merged into this message and when the last of them happened.
+    uint16_t count;
+    int64_t last_us;
+    // Tell consumers that drop repeats which events these are, 0 for none. Ids run from first_id to id, the newest;
+    // ids of other kinds can fall in between. A message sent again covers the same ids, or more if events joined it.
+    uint32_t first_id;
+    uint32_t id;
+    // An attempt at it went out without an answer, so it may have been delivered already.
+    bool unconfirmed;
+};
+
+struct notification_result
+{
+    notification_kind kind;
+    notification_outcome outcome;
+    // HTTP status of the last attempt, or NOTIFICATION_STATUS_NOT_SENT or NOTIFICATION_STATUS_UNCONFIRMED.
+    int status_code;
+    uint8_t attempts;
+    // Events the notification stood for, more than one if repeats were merged into it.
+    uint16_t events;
+    int64_t latency_us;
+    // Of the message as it was sent, after merging.
+    uint32_t first_id;
+    uint32_t id;
+    int64_t created_us;
+    int64_t last_us;
+    // Some attempt went out without an answer: the sink may have delivered it even if the outcome says otherwise.
+    bool unconfirmed;
+};
+
+// What one request carries: the texts of the due messages joined line by line, and the messages themselves, oldest first.
+struct notification_batch
+{
+    const char* text;
+    const notification_message* const* messages;
+    size_t count;
+    // Some of the messages may have been delivered by an earlier attempt. The sink sends them so that a repeat
+    // can be told apart and does not alert twice.
+    bool unconfirmed;
+};
+
+// The network side of delivery, one sink such as Telegram or MQTT. Every hook runs on the dispatcher task,
+// which therefore owns the connection. Only send is required.
+struct notification_transport
+{
+    // Names the sink in logs.
+    const char* name;
+    // Returns the HTTP status code, NOTIFICATION_STATUS_NOT_SENT or NOTIFICATION_STATUS_UNCONFIRMED. Sinks that do not
+    // speak HTTP map their outcome onto one.
+    int (*send)(const notification_batch& batch);
+    // Opens the connection ahead of the first notification.
+    bool (*connect)();
+    // Called about once a second while online and idle.
+    void (*keep_warm)();
+    void (*disconnect)();
+};
+
+// Network errors, rate limiting and server errors are worth another attempt. Other statuses are final.
+inline bool notification_retryable(int status_code)
+{
+    return status_code < 0 || status_code == 429 || status_code >= 500;
+}
+
+// Delay before attempt number attempts + 1: the base delay, doubled after every failure, capped.
+inline int64_t notification_backoff_us(uint8_t attempts)
+{
+    int64_t delay_ms = CONFIG_INTERCOM_NOTIFICATION_RETRY_BASE_MS;
+    for(uint8_t i = 1; i < attempts && delay_ms < CONFIG_INTERCOM_NOTIFICATION_RETRY_MAX_MS; i++)
+    {
+        delay_ms *= 2;
+    }
+    return (delay_ms < CONFIG_INTERCOM_NOTIFICATION_RETRY_MAX_MS ? delay_ms : CONFIG_INTERCOM_NOTIFICATION_RETRY_MAX_MS) * 1000LL;
+}
+
+/*
+    Delivers notifications on a task of its own, so the main loop never waits for the network.
+
+    The main task submits messages into a fixed-size queue and gets a notification_result back through
+    a second queue for each of them, signalled by an event bit. A message waits while Wi-Fi is down and
+    is retried with exponential backoff after a failure, up to CONFIG_INTERCOM_NOTIFICATION_MAX_ATTEMPTS
+    times. It is given up once its deadline passes, or as soon as the next attempt would fall after it.
+    A message whose request went out without an answer stays unconfirmed: later attempts tell the sink that
+    it may be a repeat, and so does its result.
+    Messages are sent oldest first, and all messages due at the same time share one request: their
+    texts are joined line by line into a buffer owned by the task. A message of a kind that is already
+    waiting is merged into the waiting one and only counted. At most CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE are in flight; submit()
+    refuses more, so the caller can keep the event and try again later.
+
+    One dispatcher serves one sink. Sinks that run side by side each get a dispatcher of their own, so a slow
+    or unreachable one never holds up the others.
+*/
+class notification_dispatcher
+{
+private:
+    enum class command_type : uint8_t
+    {
+        message,
+        // Only wakes the task, e.g. after Wi-Fi came up.
+        wake,
+        stop
+    };
+
+    struct command
+    {
+        command_type type;
+        notification_message message;
+    };
+
+    struct entry
+    {
+        bool used;
+        uint8_t attempts;
+        int last_status;
+        int64_t next_attempt_us;
+        notification_message message;
+    };
+
+    notification_transport transport = {};
+    QueueHandle_t commands = nullptr;
+    QueueHandle_t results = nullptr;
+    EventGroupHandle_t event_group = nullptr;
+    EventBits_t result_bit = 0;
+    EventBits_t stopped_bit = 0;
+    TaskHandle_t task_handle = nullptr;
+
+    std::atomic<bool> online{false};
+    std::atomic<uint32_t> in_flight{0};
+
+    // Owned by the dispatcher task.
+    entry pending[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE] = {};
+    entry* batch[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE] = {};
+    const notification_message* batch_messages[CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE] = {};
+    char text[NOTIFICATION_TEXT_MAX] = {};
+    bool connected = false;
+
+public:
+    notification_dispatcher() = default;
+    notification_dispatcher(notification_dispatcher const&) = delete;
+    notification_dispatcher& operator=(notification_dispatcher const&) = delete;
+
+    // Starts the task. result_bit is set in event_group whenever a result is ready, stopped_bit once stop() is done.
+    void start(const notification_transport& network, EventGroupHandle_t event_group_handle, EventBits_t result_event_bit, EventBits_t stopped_event_bit)
+    {
+        esp_log_level_set(dispatch_log_tag, INTERCOM_LOG_LEVEL);
+        transport = network;
+        event_group = event_group_handle;
+        result_bit = result_event_bit;
+        stopped_bit = stopped_event_bit;
+        commands = xQueueCreate(CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE, sizeof(command));
+        results = xQueueCreate(CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE, sizeof(notification_result));
+        xTaskCreate(dispatcher_task_routine, "notification_dispatcher", CONFIG_INTERCOM_NOTIFICATION_TASK_STACK, this, tskIDLE_PRIORITY + 1, &task_handle);
+    }
+
+    // Queues a notification of an event at created_us without blocking. Returns false if CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE
+    // are already in flight.
+    bool submit(notification_kind kind, const char* text, int64_t created_us, uint32_t id)
+    {
+        notification_message message = {};
+        message.kind = kind;
+        message.text = text;
+        message.created_us = created_us;
+        message.deadline_us = created_us + CONFIG_INTERCOM_NOTIFICATION_DEADLINE * 1000000LL;
+        message.count = 1;
+        message.last_us = created_us;
+        message.first_id = id;
+        message.id = id;
+        return submit(message);
+    }
+
+    // Queues a message with a deadline of its own, such as one that stands for events of an earlier wake.
+    bool submit(const notification_message& message)
+    {
+        if(in_flight.fetch_add(1) >= CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE)
+        {
+            in_flight--;
+            ESP_LOGW(dispatch_log_tag, "%s: queue full, %s notification deferred", transport.name, notification_kind_name(message.kind));
+            return false;
+        }
+
+        command cmd = {};
+        cmd.type = command_type::message;
+        cmd.message = message;
+        if(xQueueSend(commands, &cmd, 0) != pdTRUE)
+        {
+            in_flight--;
+            return false;
+        }
+        return true;
+    }
+
+    // Whether submit() would take another notification. Only submit() takes room, so it stays true for its caller.
+    bool has_room() const
+    {
+        return in_flight.load() < CONFIG_INTERCOM_NOTIFICATION_QUEUE_SIZE;
+    }
+
+    // Tells the task whether the network is up. Messages wait while it is not.
+    void set_online(bool is_online)
+    {
+        if(online.exchange(is_online) != is_online)
+        {
+            command cmd = {};
+            cmd.type = command_type::wake;
+            // A full queue wakes the task anyway.
+            xQueueSendToFront(commands, &cmd, 0);
+        }
+    }
+
+    // Takes the next result, if any. Call after result_bit was set until it returns false.
+    bool take_result(notification_result& result)
+    {
+        return results != nullptr && xQueueReceive(results, &result, 0) == pdTRUE;
+    }
+
+    // Whether some notification is still waiting for delivery.
+    bool busy() const
+    {
+        return in_flight.load() > 0;
+    }
+
+    // Closes the connection on the task and ends it, e.g. before deep sleep. Undelivered messages are given up
+    // with the stopped outcome, so take the results once it returns.
+    void stop(TickType_t ticks_to_wait)
+    {
+        if(task_handle == nullptr)
+        {
+            return;
+        }
+        command cmd = {};
+        cmd.type = command_type::stop;
+        xQueueSendToFront(commands, &cmd, ticks_to_wait);
+        xEventGroupWaitBits(event_group, stopped_bit, pdTRUE, pdTRUE, ticks_to_wait);
+    }
+
+private:
+    static void dispatcher_task_routine(void* pvParameters)
+    {
+        notification_dispatcher* dispatcher = static_cast<notification_dispatcher*>(pvParameters);
+        if(dispatcher != nullptr)
+        {
+            dispatcher->run();
+        }
+        vTaskDelete(nullptr);
+    }
+
+    void run()
+    {
+        while(true)
+        {
+            command cmd;
+            if(xQueueReceive(commands, &cmd, wait_ticks(esp_timer_get_time())) == pdTRUE)
+            {
+                // Take everything that queued up before sending, so the oldest goes first.
+                do
+                {
+                    if(cmd.type == command_type::stop)
+                    {
+                        shut_down();
+                        return;
+                    }
+                    if(cmd.type == command_type::message)
+                    {
+                        add(cmd.message);
+                    }
+                }
+                while(xQueueReceive(commands, &cmd, 0) == pdTRUE);
+            }
+            dispatch();
+        }
+    }
+
+    void add(const notification_message& message)
+    {
+        for(entry& e : pending)
+        {
+            if(e.used && e.message.kind == message.kind)
+            {
+                merge(e, message);
+                return;
+            }
+        }
+        for(entry& e : pending)
+        {
+            if(!e.used)
+            {
+                e = {};
+                e.used = true;
+                e.message = message;
+                e.next_attempt_us = message.created_us + CONFIG_INTERCOM_NOTIFICATION_COALESCE_MS * 1000LL;
+                return;
+            }
+        }
+        // submit() admits no more than there are entries.
+        ESP_LOGE(dispatch_log_tag, "%s: no room for %s notification", transport.name, notification_kind_name(message.kind));
+        in_flight--;
+    }
+
+    // Counts a repeat of a waiting notification instead of sending it again. The merged message keeps
+    // the first event's time for latency, takes the later deadline and covers the ids of both.
+    void merge(entry& e, const notification_message& message)
+    {
+        e.message.count += message.count;
+        e.message.first_id = message.first_id < e.message.first_id ? message.first_id : e.message.first_id;
+        e.message.id = message.id > e.message.id ? message.id : e.message.id;
+        e.message.unconfirmed |= message.unconfirmed;
+        e.message.last_us = message.last_us > e.message.last_us ? message.last_us : e.message.last_us;
+        e.message.deadline_us = message.deadline_us > e.message.deadline_us ? message.deadline_us : e.message.deadline_us;
+        in_flight--;
+        ESP_LOGI(dispatch_log_tag, "%s: %s notification merged, %u events", transport.name, notification_kind_name(e.message.kind),
+            static_cast<unsigned>(e.message.count));
+    }
+
+    void dispatch()
+    {
+        bool is_online = online.load();
+        if(!is_online && connected)
+        {
+            disconnect();
+        }
+
+        bool any_pending = false;
+        while(true)
+        {
+            int64_t now = esp_timer_get_time();
+            size_t due = 0;
+            for(entry& e : pending)
+            {
+                if(!e.used)
+                {
+                    continue;
+                }
+                if(now >= e.message.deadline_us)
+                {
+                    finish(e, notification_outcome::expired, now);
+                    continue;
+                }
+                any_pending = true;
+                if(is_online && e.next_attempt_us <= now)
+                {
+                    batch[due++] = &e;
+                }
+            }
+            if(due == 0)
+            {
+                break;
+            }
+            attempt(due);
+            is_online = online.load();
+        }
+
+        if(is_online && !any_pending)
+        {
+            if(!connected && transport.connect != nullptr)
+            {
+                transport.connect();
+            }
+            connected = true;
+            if(transport.keep_warm != nullptr)
+            {
+                transport.keep_warm();
+            }
+        }
+    }
+
+    // Sends the due entries in batch as one request and settles each of them with its status.
+    void attempt(size_t due)
+    {
+        size_t count = compose(due);
+        bool unconfirmed = false;
+        for(size_t i = 0; i < count; i++)
+        {
+            batch_messages[i] = &batch[i]->message;
+            unconfirmed |= batch[i]->message.unconfirmed;
+        }
+        connected = true;
+        int status_code = transport.send({text, batch_messages, count, unconfirmed});
+        int64_t now = esp_timer_get_time();
+        if(count > 1)
+        {
+            ESP_LOGI(dispatch_log_tag, "%s: %u notifications sent in one request", transport.name, static_cast<unsigned>(count));
+        }
+        for(size_t i = 0; i < count; i++)
+        {
+            settle(*batch[i], status_code, now);
+        }
+    }
+
+    // Joins the texts of the due entries into text, oldest first, and moves the ones that fit to the
+    // front of batch. Returns how many fit; the rest stay due for the next request. The first always
+    // goes, truncated if need be.
+    size_t compose(size_t due)
+    {
+        for(size_t i = 1; i < due; i++)
+        {
+            for(size_t j = i; j > 0 && batch[j]->message.created_us < batch[j - 1]->message.created_us; j--)
+            {
+                entry* swap = batch[j];
+                batch[j] = batch[j - 1];
+                batch[j - 1] = swap;
+            }
+        }
+
+        size_t length = 0;
+        size_t count = 0;
+        for(size_t i = 0; i < due; i++)
+        {
+            const notification_message& message = batch[i]->message;
+            const char* separator = count > 0 ? "\n" : "";
+            int written;
+            // A backlog counts the events it lists in its own text.
+            if(message.count > 1 && message.kind != notification_kind::backlog)
+            {
+                written = snprintf(text + length, sizeof(text) - length, "%s%s (%u times in %lld s)", separator, message.text,
+                    static_cast<unsigned>(message.count), static_cast<long long>((message.last_us - message.created_us + 999999) / 1000000));
+            }
+            else
+            {
+                written = snprintf(text + length, sizeof(text) - length, "%s%s", separator, message.text);
+            }
+
+            if(written < 0 || length + written >= sizeof(text))
+            {
+                if(count > 0)
+                {
+                    text[length] = '\0';
+                    break;
+                }
+                written = static_cast<int>(sizeof(text) - 1);
+            }
+            length += written;
+            batch[count++] = batch[i];
+        }
+        return count;
+    }
+
+    void settle(entry& e, int status_code, int64_t now)
+    {
+        e.attempts++;
+        e.last_status = status_code;
+        e.message.unconfirmed |= status_code == NOTIFICATION_STATUS_UNCONFIRMED;
+        if(e.last_status >= 200 && e.last_status < 300)
+        {
+            finish(e, notification_outcome::delivered, now);
+            return;
+        }
+        if(!notification_retryable(e.last_status))
+        {
+            finish(e, notification_outcome::rejected, now);
+            return;
+        }
+        if(e.attempts >= CONFIG_INTERCOM_NOTIFICATION_MAX_ATTEMPTS)
+        {
+            finish(e, notification_outcome::failed, now);
+            return;
+        }
+
+        e.next_attempt_us = now + notification_backoff_us(e.attempts);
+        if(e.next_attempt_us >= e.message.deadline_us)
+        {
+            finish(e, notification_outcome::expired, now);
+            return;
+        }
+        ESP_LOGW(dispatch_log_tag, "%s: %s notification attempt %u failed with %d, retrying in %lld ms", transport.name, notification_kind_name(e.message.kind),
+            static_cast<unsigned>(e.attempts), e.last_status, static_cast<long long>((e.next_attempt_us - now) / 1000));
+    }
+
+    void finish(entry& e, notification_outcome outcome, int64_t now)
+    {
+        notification_result result = {};
+        result.kind = e.message.kind;
+        result.outcome = outcome;
+        result.status_code = e.attempts > 0 ? e.last_status : NOTIFICATION_STATUS_NOT_SENT;
+        result.attempts = e.attempts;
+        result.events = e.message.count;
+        result.latency_us = now - e.message.created_us;
+        result.first_id = e.message.first_id;
+        result.id = e.message.id;
+        result.created_us = e.message.created_us;
+        result.last_us = e.message.last_us;
+        result.unconfirmed = e.message.unconfirmed;
+        e.used = false;
+        in_flight--;
+
+        if(xQueueSend(results, &result, 0) != pdTRUE)
+        {
+            ESP_LOGW(dispatch_log_tag, "%s: result queue full, %s result of %s notification lost", transport.name,
+                notification_outcome_name(outcome), notification_kind_name(result.kind));
+        }
+        xEventGroupSetBits(event_group, result_bit);
+    }
+
+    // Sleeps until the earliest retry or deadline. While online, wakes every second to keep the connection warm.
+    TickType_t wait_ticks(int64_t now) const
+    {
+        int64_t wake_at = INT64_MAX;
+        bool is_online = online.load();
+        for(const entry& e : pending)
+        {
+            if(e.used)
+            {
+                int64_t at = is_online && e.next_attempt_us < e.message.deadline_us ? e.next_attempt_us : e.message.deadline_us;
+                wake_at = at < wake_at ? at : wake_at;
+            }
+        }
+        if(is_online && wake_at - now > 1000000)
+        {
+            wake_at = now + 1000000;
+        }
+        if(wake_at == INT64_MAX)
+        {
+            return portMAX_DELAY;
+        }
+        if(wake_at <= now)
+        {
+            return 0;
+        }
+        return static_cast<TickType_t>((wake_at - now + 999) / 1000 / portTICK_PERIOD_MS + 1);
+    }
+
+    void disconnect()
+    {
+        if(transport.disconnect != nullptr)
+        {
+            transport.disconnect();
+        }
+        connected = false;
+    }
+
+    void shut_down()
+    {
+        disconnect();
+        // Messages still in the command queue were never taken; take them so they are given up like the others.
+        command cmd;
+        while(xQueueReceive(commands, &cmd, 0) == pdTRUE)
+        {
+            if(cmd.type == command_type::message)
+            {
+                add(cmd.message);
+            }
+        }
+        uint32_t dropped = in_flight.load();
+        if(dropped > 0)
+        {
+            ESP_LOGW(dispatch_log_tag, "%s: %lu undelivered notification(s) given up", transport.name, static_cast<unsigned long>(dropped));
+        }
+        int64_t now = esp_timer_get_time();
+        for(entry& e : pending)
+        {
+            if(e.used)
+            {
+                finish(e, notification_outcome::stopped, now);
+            }
+        }
+        task_handle = nullptr;
+        xEventGroupSetBits(event_group, stopped_bit);
+    }
+};
@@ -0,0 +1,581 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_OUTBOX
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "log_level.h"
+#include "notification_dispatcher.hpp"
+#include "sensor_channels.hpp"
+
+#define OUTBOX_MAGIC 0x4f425831
+#define OUTBOX_NVS_NAMESPACE "outbox"
+#define OUTBOX_NVS_KEY "spill"
+// Ids reserved in NVS at a time. After a power loss the rest of the last reservation is skipped, so an id is never handed out twice.
+#define OUTBOX_ID_BLOCK 1024
+// Sinks an entry can be owed to, a bit each.
+#define OUTBOX_SINKS_MAX 8
+// The clock of the entry started over since: a power loss came between the event and now.
+#define OUTBOX_ENTRY_CLOCK_LOST 0x01
+#define OUTBOX_TEXT_HEAD "Not delivered in time:"
+
+static const char* outbox_log_tag = "outbox";
+
+// One event, or repeats of it merged by the dispatcher, that some sink did not deliver.
+struct outbox_entry
+{
+    uint32_t id;
+    // When the event happened, seconds on the RTC clock.
+    uint32_t time_s;
+    // Events the entry stands for, and the seconds from the first to the last.
+    uint16_t count;
+    uint16_t span_s;
+    notification_kind kind;
+    // Sinks that still owe the event, a bit per index in the sink table, and those a backlog with it is on its way to.
+    uint8_t owed;
+    uint8_t sending;
+    // OUTBOX_ENTRY_*.
+    uint8_t flags;
+    // Sinks an attempt went out to without an answer: they may have delivered it already.
+    uint8_t unconfirmed;
+    uint8_t reserved;
+    // How far below id the first of its merged events is.
+    uint16_t id_span;
+};
+static_assert(sizeof(outbox_entry) == 20, "outbox_entry is stored as it is, keep it packed");
+
+// Survives deep sleep in RTC memory. Entries that did not fit were spilled to NVS, which also survives power loss.
+struct outbox_state
+{
+    uint32_t magic;
+    uint32_t next_id;
+    // First id not reserved in NVS.
+    uint32_t id_limit;
+    uint16_t count;
+    // Entries in NVS, all older than those in here.
+    uint16_t spilled;
+    outbox_entry entries[CONFIG_INTERCOM_OUTBOX_RTC_SIZE];
+};
+
+// A spill moves every entry in RTC memory to NVS at once, dropping the oldest there to make room.
+static_assert(CONFIG_INTERCOM_OUTBOX_FLASH_SIZE >= CONFIG_INTERCOM_OUTBOX_RTC_SIZE,
+    "INTERCOM_OUTBOX_FLASH_SIZE must hold at least INTERCOM_OUTBOX_RTC_SIZE entries");
+
+// The NVS blob, of which only count entries are written.
+struct outbox_spill
+{
+    uint32_t id_limit;
+    uint32_t count;
+    outbox_entry entries[CONFIG_INTERCOM_OUTBOX_FLASH_SIZE];
+};
+
+inline uint32_t outbox_rtc_time_s()
+{
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    return static_cast<uint32_t>(now.tv_sec);
+}
+
+// Writes an age such as "45 s", "12 min", "3 h" or "2 d". Returns what snprintf returns.
+inline int outbox_format_age(char* text, size_t size, uint32_t age_s)
+{
+    if(age_s < 120)
+    {
+        return snprintf(text, size, "%lu s", static_cast<unsigned long>(age_s));
+    }
+    if(age_s < 120 * 60)
+    {
+        return snprintf(text, size, "%lu min", static_cast<unsigned long>(age_s / 60));
+    }
+    if(age_s < 48 * 3600)
+    {
+        return snprintf(text, size, "%lu h", static_cast<unsigned long>(age_s / 3600));
+    }
+    return snprintf(text, size, "%lu d", static_cast<unsigned long>(age_s / 86400));
+}
+
+/*
+    Keeps the events a sink could not deliver until a later connection, also through deep sleep.
+
+    The main task stores every result that was not delivered, with the time of the event on the RTC clock
+    and a bit for the sink that owes it; an event that failed on two sinks is one entry with two bits,
+    found by its id. Entries live in RTC memory; once CONFIG_INTERCOM_OUTBOX_RTC_SIZE are waiting, they
+    are spilled to an NVS blob of CONFIG_INTERCOM_OUTBOX_FLASH_SIZE, which also survives power loss and
+    drops its oldest entries when full.
+
+    Once the network is up, compose() sums up everything a sink owes in one backlog message, a line per
+    kind with its count and age. The entries stay where they are until the result of that message comes
+    back: acknowledge() removes them for that sink, release() leaves them for the next connection. An
+    event is therefore in at most one delivered message per sink. Its id goes out with it (the backlog
+    carries the range from its oldest to its newest id), and ids are reserved in NVS in blocks, so they
+    never repeat, not even after a power loss.
+
+    An entry a request went out for without an answer may have been delivered. It stays unconfirmed for
+    that sink, in RTC memory or NVS like the entry, and the next backlog with it is sent as a possible
+    repeat, which the sink delivers without alerting again. A backlog is recorded as in flight before it
+    goes out, in NVS too for spilled entries, so one cut short by a reset or a power loss counts as
+    unconfirmed as well.
+
+    Owned by the main task.
+*/
+template<size_t sink_count>
+class notification_outbox
+{
+private:
+    static_assert(sink_count <= OUTBOX_SINKS_MAX, "An entry has a bit per sink");
+
+    // One line of a backlog: every entry of one kind.
+    struct kind_summary
+    {
+        notification_kind kind;
+        uint32_t events;
+        uint32_t first_s;
+        uint32_t last_s;
+        bool clock_lost;
+    };
+
+    outbox_state* state = nullptr;
+    outbox_spill spill = {};
+    // The backlog text in flight to each sink. The dispatcher holds on to it until the result comes back.
+    char texts[sink_count][NOTIFICATION_TEXT_MAX] = {};
+
+public:
+    notification_outbox() = default;
+    notification_outbox(notification_outbox const&) = delete;
+    notification_outbox& operator=(notification_outbox const&) = delete;
+
+    // Takes over the state in RTC memory, or starts over from the NVS copy after a power loss. Call after nvs_flash_init().
+    void begin(outbox_state& memory)
+    {
+        esp_log_level_set(outbox_log_tag, INTERCOM_LOG_LEVEL);
+        state = &memory;
+        if(state->magic != OUTBOX_MAGIC)
+        {
+            memset(state, 0, sizeof(*state));
+            state->magic = OUTBOX_MAGIC;
+            load();
+            // The RTC clock started over, so the ages of the entries are unknown.
+            for(uint32_t i = 0; i < spill.count; i++)
+            {
+                spill.entries[i].flags |= OUTBOX_ENTRY_CLOCK_LOST;
+            }
+            state->spilled = static_cast<uint16_t>(spill.count);
+            state->next_id = spill.id_limit > 0 ? spill.id_limit : 1;
+            reserve_ids();
+            if(spill.count > 0)
+            {
+                ESP_LOGI(outbox_log_tag, "RTC memory lost, %lu undelivered event(s) restored from NVS", static_cast<unsigned long>(spill.count));
+            }
+        }
+        else if(state->spilled > 0)
+        {
+            load();
+            state->spilled = static_cast<uint16_t>(spill.count);
+        }
+        else
+        {
+            spill.id_limit = state->id_limit;
+        }
+
+        // A backlog still in flight was cut short by a reset or a power loss, and may have gone out.
+        update_entries([](outbox_entry& e)
+        {
+            e.unconfirmed |= e.sending;
+            e.sending = 0;
+        });
+    }
+
+    // A new id for an event.
+    uint32_t take_id()
+    {
+        if(state->next_id >= state->id_limit)
+        {
+            reserve_ids();
+        }
+        uint32_t id = state->next_id++;
+        state->next_id = state->next_id == 0 ? 1 : state->next_id;
+        return id;
+    }
+
+    // Keeps an event that sink did not deliver. result is what the dispatcher reported for it.
+    void store(size_t sink, const notification_result& result)
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        uint8_t unconfirmed = result.unconfirmed ? bit : 0;
+        outbox_entry* known = nullptr;
+        bool known_spilled = false;
+        for(uint32_t i = 0; result.id != 0 && i < spill.count && known == nullptr; i++)
+        {
+            known = spill.entries[i].id == result.id ? &spill.entries[i] : nullptr;
+            known_spilled = known != nullptr;
+        }
+        for(uint16_t i = 0; result.id != 0 && i < state->count && known == nullptr; i++)
+        {
+            known = state->entries[i].id == result.id ? &state->entries[i] : nullptr;
+        }
+        if(known != nullptr)
+        {
+            known->owed |= bit;
+            known->unconfirmed |= unconfirmed;
+            if(known_spilled)
+            {
+                save();
+            }
+            return;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        uint32_t now_s = outbox_rtc_time_s();
+        int64_t age_s = (now_us - result.created_us) / 1000000;
+        int64_t span_s = (result.last_us - result.created_us) / 1000000;
+        outbox_entry e = {};
+        e.id = result.id;
+        e.id_span = static_cast<uint16_t>(result.id - result.first_id < UINT16_MAX ? result.id - result.first_id : UINT16_MAX);
+        e.time_s = age_s < now_s ? static_cast<uint32_t>(now_s - age_s) : 0;
+        e.count = result.events;
+        e.span_s = static_cast<uint16_t>(span_s < UINT16_MAX ? span_s : UINT16_MAX);
+        e.kind = result.kind;
+        e.owed = bit;
+        e.unconfirmed = unconfirmed;
+
+        if(state->count == CONFIG_INTERCOM_OUTBOX_RTC_SIZE)
+        {
+            spill_entries();
+        }
+        state->entries[state->count++] = e;
+        ESP_LOGI(outbox_log_tag, "%s event %lu kept for sink %u, %u in RTC memory, %u in NVS", notification_kind_name(e.kind),
+            static_cast<unsigned long>(e.id), static_cast<unsigned>(sink), static_cast<unsigned>(state->count), static_cast<unsigned>(state->spilled));
+    }
+
+    // Whether sink owes events that are not on their way yet.
+    bool owes(size_t sink) const
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        bool owed = false;
+        for_each_entry([&](const outbox_entry& e) { owed |= (e.owed & bit) != 0 && (e.sending & bit) == 0; });
+        return owed;
+    }
+
+    // Whether a backlog is on its way to sink.
+    bool sending(size_t sink) const
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        bool any = false;
+        for_each_entry([&](const outbox_entry& e) { any |= (e.sending & bit) != 0; });
+        return any;
+    }
+
+    // Sums up what sink owes in one backlog message, oldest kind first, and records it as on its way. Kinds that do not
+    // fit the text wait for the next backlog. text_of gives the notification text of a kind. Returns false if nothing is owed.
+    bool compose(size_t sink, const char* (*text_of)(notification_kind), notification_message& message)
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        kind_summary kinds[sensor_channel_count + 1] = {};
+        size_t kind_count = 0;
+        for_each_entry([&](const outbox_entry& e)
+        {
+            if((e.owed & bit) == 0 || (e.sending & bit) != 0)
+            {
+                return;
+            }
+            size_t k = 0;
+            while(k < kind_count && kinds[k].kind != e.kind)
+            {
+                k++;
+            }
+            if(k == kind_count)
+            {
+                if(kind_count == sizeof(kinds) / sizeof(kinds[0]))
+                {
+                    return;
+                }
+                kinds[kind_count++] = {e.kind, 0, e.time_s, e.time_s, false};
+            }
+            kind_summary& summary = kinds[k];
+            summary.events += e.count;
+            summary.first_s = e.time_s < summary.first_s ? e.time_s : summary.first_s;
+            summary.last_s = e.time_s + e.span_s > summary.last_s ? e.time_s + e.span_s : summary.last_s;
+            summary.clock_lost |= (e.flags & OUTBOX_ENTRY_CLOCK_LOST) != 0;
+        });
+        if(kind_count == 0)
+        {
+            return false;
+        }
+        // Entries are in the order their results came back, not the order of the events.
+        for(size_t i = 1; i < kind_count; i++)
+        {
+            for(size_t j = i; j > 0 && kinds[j].first_s < kinds[j - 1].first_s; j--)
+            {
+                kind_summary swap = kinds[j];
+                kinds[j] = kinds[j - 1];
+                kinds[j - 1] = swap;
+            }
+        }
+
+        char* text = texts[sink];
+        uint32_t now_s = outbox_rtc_time_s();
+        size_t length = static_cast<size_t>(snprintf(text, NOTIFICATION_TEXT_MAX, "%s", OUTBOX_TEXT_HEAD));
+        uint32_t events = 0;
+        uint32_t first_s = UINT32_MAX;
+        uint32_t last_s = 0;
+        bool included[sizeof(kinds) / sizeof(kinds[0])] = {};
+        for(size_t k = 0; k < kind_count; k++)
+        {
+            char line[NOTIFICATION_TEXT_MAX];
+            if(!format_line(kinds[k], text_of(kinds[k].kind), now_s, line, sizeof(line)) || length + 1 + strlen(line) >= NOTIFICATION_TEXT_MAX)
+            {
+                continue;
+            }
+            length += snprintf(text + length, NOTIFICATION_TEXT_MAX - length, "\n%s", line);
+            included[k] = true;
+            events += kinds[k].events;
+            first_s = kinds[k].clock_lost || kinds[k].first_s > now_s ? now_s : (kinds[k].first_s < first_s ? kinds[k].first_s : first_s);
+            last_s = kinds[k].clock_lost || kinds[k].last_s > now_s ? now_s : (kinds[k].last_s > last_s ? kinds[k].last_s : last_s);
+        }
+
+        uint32_t first_id = UINT32_MAX;
+        uint32_t newest_id = 0;
+        bool unconfirmed = false;
+        if(events == 0)
+        {
+            return false;
+        }
+        // Written to NVS before the backlog goes out if it holds spilled entries.
+        update_entries([&](outbox_entry& e)
+        {
+            for(size_t k = 0; k < kind_count; k++)
+            {
+                if(included[k] && kinds[k].kind == e.kind && (e.owed & bit) != 0 && (e.sending & bit) == 0)
+                {
+                    e.sending |= bit;
+                    first_id = e.id - e.id_span < first_id ? e.id - e.id_span : first_id;
+                    newest_id = e.id > newest_id ? e.id : newest_id;
+                    unconfirmed |= (e.unconfirmed & bit) != 0;
+                }
+            }
+        });
+
+        int64_t now_us = esp_timer_get_time();
+        message = {};
+        message.kind = notification_kind::backlog;
+        message.text = text;
+        message.created_us = now_us - static_cast<int64_t>(now_s - first_s) * 1000000;
+        message.last_us = now_us - static_cast<int64_t>(now_s - last_s) * 1000000;
+        message.deadline_us = now_us + CONFIG_INTERCOM_NOTIFICATION_DEADLINE * 1000000LL;
+        message.count = static_cast<uint16_t>(events < UINT16_MAX ? events : UINT16_MAX);
+        message.first_id = newest_id > 0 ? first_id : 0;
+        message.id = newest_id;
+        message.unconfirmed = unconfirmed;
+        return true;
+    }
+
+    // The backlog reached sink, or was refused for good: its events are no longer owed there.
+    void acknowledge(size_t sink)
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        bool spill_changed = false;
+        for(uint32_t i = 0; i < spill.count; i++)
+        {
+            spill_changed |= (spill.entries[i].sending & bit) != 0;
+        }
+        for_each_entry([bit](outbox_entry& e)
+        {
+            if((e.sending & bit) != 0)
+            {
+                e.owed &= static_cast<uint8_t>(~bit);
+                e.sending &= static_cast<uint8_t>(~bit);
+                e.unconfirmed &= static_cast<uint8_t>(~bit);
+            }
+        });
+
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < spill.count; i++)
+        {
+            if(spill.entries[i].owed != 0)
+            {
+                spill.entries[kept++] = spill.entries[i];
+            }
+        }
+        spill.count = kept;
+        state->spilled = static_cast<uint16_t>(kept);
+        uint16_t rtc_kept = 0;
+        for(uint16_t i = 0; i < state->count; i++)
+        {
+            if(state->entries[i].owed != 0)
+            {
+                state->entries[rtc_kept++] = state->entries[i];
+            }
+        }
+        state->count = rtc_kept;
+        if(spill_changed)
+        {
+            save();
+        }
+    }
+
+    // The backlog did not reach sink. Its events wait for the next connection, unconfirmed if it may have gone out.
+    void release(size_t sink, bool unconfirmed)
+    {
+        uint8_t bit = static_cast<uint8_t>(1u << sink);
+        update_entries([bit, unconfirmed](outbox_entry& e)
+        {
+            if((e.sending & bit) != 0)
+            {
+                e.unconfirmed |= unconfirmed ? bit : 0;
+                e.sending &= static_cast<uint8_t>(~bit);
+            }
+        });
+    }
+
+    size_t size() const
+    {
+        return state->count + spill.count;
+    }
+
+private:
+    template<typename F>
+    void for_each_entry(F f)
+    {
+        for(uint32_t i = 0; i < spill.count; i++)
+        {
+            f(spill.entries[i]);
+        }
+        for(uint16_t i = 0; i < state->count; i++)
+        {
+            f(state->entries[i]);
+        }
+    }
+
+    // Like for_each_entry, and writes NVS if f changed a spilled entry, so that NVS holds what RTC memory does.
+    template<typename F>
+    void update_entries(F f)
+    {
+        bool spill_changed = false;
+        for(uint32_t i = 0; i < spill.count; i++)
+        {
+            outbox_entry before = spill.entries[i];
+            f(spill.entries[i]);
+            spill_changed |= memcmp(&before, &spill.entries[i], sizeof(before)) != 0;
+        }
+        for(uint16_t i = 0; i < state->count; i++)
+        {
+            f(state->entries[i]);
+        }
+        if(spill_changed)
+        {
+            save();
+        }
+    }
+
+    template<typename F>
+    void for_each_entry(F f) const
+    {
+        for(uint32_t i = 0; i < spill.count; i++)
+        {
+            f(spill.entries[i]);
+        }
+        for(uint16_t i = 0; i < state->count; i++)
+        {
+            f(state->entries[i]);
+        }
+    }
+
+    // "Intercom Ring! (3 times, 2 h to 12 min ago)" and the like. Returns false if it does not fit.
+    static bool format_line(const kind_summary& summary, const char* text, uint32_t now_s, char* line, size_t size)
+    {
+        char first[16];
+        char last[16];
+        int length;
+        if(summary.clock_lost)
+        {
+            length = summary.events > 1 ? snprintf(line, size, "%s (%lu times, before a power loss)", text, static_cast<unsigned long>(summary.events))
+                : snprintf(line, size, "%s (before a power loss)", text);
+        }
+        else
+        {
+            outbox_format_age(first, sizeof(first), summary.first_s < now_s ? now_s - summary.first_s : 0);
+            outbox_format_age(last, sizeof(last), summary.last_s < now_s ? now_s - summary.last_s : 0);
+            length = summary.events > 1 && strcmp(first, last) != 0
+                ? snprintf(line, size, "%s (%lu times, %s to %s ago)", text, static_cast<unsigned long>(summary.events), first, last)
+                : summary.events > 1 ? snprintf(line, size, "%s (%lu times, %s ago)", text, static_cast<unsigned long>(summary.events), first)
+                : snprintf(line, size, "%s (%s ago)", text, first);
+        }
+        return length > 0 && static_cast<size_t>(length) < size;
+    }
+
+    // Moves the entries in RTC memory to NVS, dropping the oldest there if need be.
+    void spill_entries()
+    {
+        uint32_t room = CONFIG_INTERCOM_OUTBOX_FLASH_SIZE - spill.count;
+        if(state->count > room)
+        {
+            uint32_t dropped = state->count - room;
+            ESP_LOGE(outbox_log_tag, "NVS full, %lu oldest undelivered event(s) dropped", static_cast<unsigned long>(dropped));
+            memmove(spill.entries, spill.entries + dropped, (spill.count - dropped) * sizeof(outbox_entry));
+            spill.count -= dropped;
+        }
+        memcpy(spill.entries + spill.count, state->entries, state->count * sizeof(outbox_entry));
+        spill.count += state->count;
+        state->spilled = static_cast<uint16_t>(spill.count);
+        state->count = 0;
+        save();
+        ESP_LOGW(outbox_log_tag, "RTC memory full, %lu undelivered event(s) now in NVS", static_cast<unsigned long>(spill.count));
+    }
+
+    void reserve_ids()
+    {
+        state->id_limit = state->next_id + OUTBOX_ID_BLOCK;
+        spill.id_limit = state->id_limit;
+        save();
+    }
+
+    void load()
+    {
+        spill = {};
+        nvs_handle_t handle;
+        if(nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        {
+            return;
+        }
+        size_t length = sizeof(spill);
+        const size_t head = offsetof(outbox_spill, entries);
+        if(nvs_get_blob(handle, OUTBOX_NVS_KEY, &spill, &length) != ESP_OK || length < head
+            || spill.count > CONFIG_INTERCOM_OUTBOX_FLASH_SIZE || length != head + spill.count * sizeof(outbox_entry))
+        {
+            uint32_t id_limit = length >= head ? spill.id_limit : 0;
+            spill = {};
+            spill.id_limit = id_limit;
+        }
+        nvs_close(handle);
+    }
+
+    void save()
+    {
+        nvs_handle_t handle;
+        esp_err_t err = nvs_open(OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &handle);
+        if(err == ESP_OK)
+        {
+            err = nvs_set_blob(handle, OUTBOX_NVS_KEY, &spill, offsetof(outbox_spill, entries) + spill.count * sizeof(outbox_entry));
+            if(err == ESP_OK)
+            {
+                err = nvs_commit(handle);
+            }
+            nvs_close(handle);
+        }
+        if(err != ESP_OK)
+        {
+            ESP_LOGW(outbox_log_tag, "Could not write the outbox to NVS: %s", esp_err_to_name(err));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "log_level.h"
+#include "energy_account.hpp"
+
+static const char* power_log_tag = "power";
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS && CONFIG_INTERCOM_ENERGY_ACCOUNTING
+// Runs on the core that slept, right after it woke, interrupts still off.
+static IRAM_ATTR esp_err_t power_on_light_sleep_exit(int64_t sleep_time_us, void* arg)
+{
+    if(sleep_time_us > 0)
+    {
+        energy_add_light_sleep(static_cast<uint64_t>(sleep_time_us));
+    }
+    return ESP_OK;
+}
+#endif
+
+/*
+    Lets the clock drop to CONFIG_INTERCOM_LIGHT_SLEEP_MIN_FREQ_MHZ and the idle task enter light sleep for
+    the rest of the wake. Call once the sensor lines can wake the chip: a light sleep before that would only
+    end on a timer.
+*/
+inline void power_setup()
+{
+    esp_log_level_set(power_log_tag, INTERCOM_LOG_LEVEL);
+    esp_pm_config_t config = {};
+    config.max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    config.min_freq_mhz = CONFIG_INTERCOM_LIGHT_SLEEP_MIN_FREQ_MHZ;
+    config.light_sleep_enable = true;
+    ESP_ERROR_CHECK(esp_pm_configure(&config));
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS && CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    esp_pm_sleep_cbs_register_config_t callbacks = {};
+    callbacks.exit_cb = power_on_light_sleep_exit;
+    ESP_ERROR_CHECK(esp_pm_light_sleep_register_cbs(&callbacks));
+#elif CONFIG_INTERCOM_ENERGY_ACCOUNTING
+    ESP_LOGW(power_log_tag, "Without PM_LIGHT_SLEEP_CALLBACKS the time in light sleep is booked as awake");
+#endif
+    ESP_LOGI(power_log_tag, "Light sleep while idle, CPU at %d to %d MHz", config.min_freq_mhz, config.max_freq_mhz);
+}
+
+#endif
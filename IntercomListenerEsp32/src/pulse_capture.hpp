@@ -0,0 +1,212 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "driver/rmt_rx.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_level.h"
+#include "burst_classifier.hpp"
+
+// RMT memory is shared by all channels: 8 blocks of 64 symbols on ESP32. Ring and door take 4 blocks each.
+#define PULSE_CAPTURE_MAX_SYMBOLS 256
+#define PULSE_CAPTURE_RESOLUTION_HZ 1000000
+
+static const char* pulse_capture_log_tag = "pulse_capture";
+
+static_assert(CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD > burst_lead_in_max_us(),
+    "CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD must exceed the longest lead-in in burst_signatures, or the receiver splits those bursts");
+
+// Summary of one completed pulse train, measured by the RMT peripheral.
+struct pulse_burst
+{
+    uint32_t pulse_count;
+    uint32_t duration_us;
+    uint32_t frequency_hz;
+    bool truncated;
+    int64_t start_timestamp;
+    int64_t end_timestamp;
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+    burst_label label;
+    burst_features features;
+#endif
+};
+
+/*
+    Captures the ring or door line with an RMT receive channel instead of per-edge GPIO interrupts.
+    The peripheral records the whole burst into its memory and raises a single interrupt once the line
+    has been idle for CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD microseconds.
+*/
+class pulse_capture
+{
+private:
+    struct receive_done
+    {
+        pulse_capture* capture;
+        size_t num_symbols;
+    };
+
+    static inline QueueHandle_t done_queue = nullptr;
+    static inline TaskHandle_t task_handle = nullptr;
+
+    rmt_channel_handle_t channel = nullptr;
+    rmt_symbol_word_t symbols[PULSE_CAPTURE_MAX_SYMBOLS];
+    rmt_receive_config_t receive_config = {};
+    QueueHandle_t burst_mailbox = nullptr;
+    EventGroupHandle_t event_group = nullptr;
+    EventBits_t event_bits = 0;
+    int wake_level = 0;
+    sensor_channel channel_id = sensor_channel_ring;
+
+public:
+    pulse_capture() = default;
+    pulse_capture(pulse_capture const&) = delete;
+    pulse_capture& operator=(pulse_capture const&) = delete;
+
+    // Sets event_bits in event_group once per completed burst on gpio.
+    void setup(gpio_num_t gpio, sensor_channel id, int level, EventGroupHandle_t group, EventBits_t bits)
+    {
+        esp_log_level_set(pulse_capture_log_tag, INTERCOM_LOG_LEVEL);
+
+        channel_id = id;
+        wake_level = level;
+        event_group = group;
+        event_bits = bits;
+        burst_mailbox = xQueueCreate(1, sizeof(pulse_burst));
+
+        if(done_queue == nullptr)
+        {
+            done_queue = xQueueCreate(4, sizeof(receive_done));
+            xTaskCreate(pulse_capture_task_routine, "pulse_capture_task", 2048, nullptr, configMAX_PRIORITIES - 2, &task_handle);
+        }
+
+        rmt_rx_channel_config_t channel_config = {};
+        channel_config.gpio_num = gpio;
+        channel_config.clk_src = RMT_CLK_SRC_DEFAULT;
+        channel_config.resolution_hz = PULSE_CAPTURE_RESOLUTION_HZ;
+        channel_config.mem_block_symbols = PULSE_CAPTURE_MAX_SYMBOLS;
+        ESP_ERROR_CHECK(rmt_new_rx_channel(&channel_config, &channel));
+
+        rmt_rx_event_callbacks_t callbacks = {};
+        callbacks.on_recv_done = on_receive_done;
+        ESP_ERROR_CHECK(rmt_rx_register_event_callbacks(channel, &callbacks, this));
+        ESP_ERROR_CHECK(rmt_enable(channel));
+
+        receive_config.signal_range_min_ns = CONFIG_INTERCOM_CAPTURE_GLITCH_FILTER_NS;
+        receive_config.signal_range_max_ns = CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD * 1000U;
+        ESP_ERROR_CHECK(rmt_receive(channel, symbols, sizeof(symbols), &receive_config));
+
+        ESP_LOGI(pulse_capture_log_tag, "RMT capture armed on GPIO %d", gpio);
+    }
+
+    // Fetches the most recent burst. Returns false if none completed since the last call.
+    bool take_burst(pulse_burst& burst)
+    {
+        return burst_mailbox != nullptr && xQueueReceive(burst_mailbox, &burst, 0) == pdTRUE;
+    }
+
+private:
+    static bool IRAM_ATTR on_receive_done(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata, void *user_ctx)
+    {
+        receive_done done = {static_cast<pulse_capture*>(user_ctx), edata->num_symbols};
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        xQueueSendFromISR(done_queue, &done, &higher_priority_task_woken);
+        return higher_priority_task_woken == pdTRUE;
+    }
+
+    pulse_burst summarize(size_t num_symbols) const
+    {
+        pulse_burst burst = {};
+        uint32_t duration_ticks = 0;
+        for(size_t i = 0; i < num_symbols; i++)
+        {
+            const rmt_symbol_word_t& symbol = symbols[i];
+            if(symbol.duration0 != 0 && symbol.level0 == wake_level)
+            {
+                burst.pulse_count++;
+            }
+            if(symbol.duration1 != 0 && symbol.level1 == wake_level)
+            {
+                burst.pulse_count++;
+            }
+            duration_ticks += symbol.duration0 + symbol.duration1;
+        }
+
+        burst.duration_us = static_cast<uint32_t>(duration_ticks * (1000000ULL / PULSE_CAPTURE_RESOLUTION_HZ));
+        burst.frequency_hz = burst.duration_us != 0 ? static_cast<uint32_t>(burst.pulse_count * 1000000ULL / burst.duration_us) : 0;
+        burst.truncated = num_symbols >= PULSE_CAPTURE_MAX_SYMBOLS;
+        burst.end_timestamp = esp_timer_get_time() - CONFIG_INTERCOM_CAPTURE_IDLE_THRESHOLD;
+        burst.start_timestamp = burst.end_timestamp - burst.duration_us;
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+        classify(burst, num_symbols);
+#endif
+        return burst;
+    }
+
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+    // Replays the captured segments as edges through the same classifier the GPIO path uses.
+    void classify(pulse_burst& burst, size_t num_symbols) const
+    {
+        burst_tracker tracker(channel_id, wake_level);
+        burst.label = burst_label::none;
+        int64_t t = 0;
+        for(size_t i = 0; i < num_symbols && burst.label == burst_label::none; i++)
+        {
+            const rmt_symbol_word_t& symbol = symbols[i];
+            if(symbol.duration0 != 0)
+            {
+                burst.label = tracker.edge(symbol.level0, t);
+                t += symbol.duration0;
+            }
+            if(symbol.duration1 != 0 && burst.label == burst_label::none)
+            {
+                burst.label = tracker.edge(symbol.level1, t);
+                t += symbol.duration1;
+            }
+        }
+
+        if(burst.label == burst_label::none)
+        {
+            burst.label = tracker.expire(t + BURST_IDLE_GAP_US);
+        }
+        burst.features = tracker.features();
+    }
+#endif
+
+    static void pulse_capture_task_routine(void *pvParameters)
+    {
+        receive_done done;
+        while(true)
+        {
+            if(xQueueReceive(done_queue, &done, portMAX_DELAY) != pdTRUE)
+            {
+                continue;
+            }
+
+            pulse_capture* capture = done.capture;
+            pulse_burst burst = capture->summarize(done.num_symbols);
+
+            // The symbol buffer is consumed, so the channel can listen for the next burst straight away.
+            esp_err_t err = rmt_receive(capture->channel, capture->symbols, sizeof(capture->symbols), &capture->receive_config);
+            if(err != ESP_OK)
+            {
+                ESP_LOGE(pulse_capture_log_tag, "rmt_receive failed: %s", esp_err_to_name(err));
+            }
+
+            ESP_LOGD(pulse_capture_log_tag, "Burst: %lu pulses in %lu us (%lu Hz)%s",
+                static_cast<unsigned long>(burst.pulse_count), static_cast<unsigned long>(burst.duration_us),
+                static_cast<unsigned long>(burst.frequency_hz), burst.truncated ? ", truncated" : "");
+
+            xQueueOverwrite(capture->burst_mailbox, &burst);
+            xEventGroupSetBits(capture->event_group, capture->event_bits);
+        }
+    }
+};
+
+#endif
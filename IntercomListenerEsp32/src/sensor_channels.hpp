@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+enum class sensor_pull : uint8_t
+{
+    floating,
+    down,
+    up
+};
+
+// One sensor line: where it is, how it idles and what it is called in logs and notifications.
+struct sensor_channel_config
+{
+    int gpio;
+    // Level of the line while the signal is present. Also the level that wakes the chip.
+    int wake_level;
+    sensor_pull pull;
+    // A start within this long of the previous one belongs to the same signal.
+    uint32_t detection_cooldown_ms;
+    // A signal within this long of the last notification is logged but not sent.
+    uint32_t notification_cooldown_ms;
+    const char* name;
+    const char* text;
+};
+
+#if CONFIG_INTERCOM_RING_GPIO_PIN_PULL_DOWN
+#define INTERCOM_RING_PULL sensor_pull::down
+#elif CONFIG_INTERCOM_RING_GPIO_PIN_PULL_UP
+#define INTERCOM_RING_PULL sensor_pull::up
+#else
+#define INTERCOM_RING_PULL sensor_pull::floating
+#endif
+
+#if CONFIG_INTERCOM_DOOR_GPIO_PIN_PULL_DOWN
+#define INTERCOM_DOOR_PULL sensor_pull::down
+#elif CONFIG_INTERCOM_DOOR_GPIO_PIN_PULL_UP
+#define INTERCOM_DOOR_PULL sensor_pull::up
+#else
+#define INTERCOM_DOOR_PULL sensor_pull::floating
+#endif
+
+// Index of each line in sensor_channels. Edge records, burst signatures and notifications refer to lines by it.
+enum sensor_channel : uint8_t
+{
+    sensor_channel_ring,
+    sensor_channel_door
+};
+
+// Every sensor line the firmware listens to. A line added here is set up, woken on, classified and
+// notified like the others; only the ULP detector and the RMT memory split are sized for two.
+// inline rather than static: sensor_inputs takes the table as a template argument, which has to name the
+// same object in every translation unit.
+inline constexpr sensor_channel_config sensor_channels[] =
+{
+    {CONFIG_INTERCOM_RING_GPIO_PIN, CONFIG_INTERCOM_WAKE_LEVEL, INTERCOM_RING_PULL,
+        CONFIG_INTERCOM_RING_DETECTION_COOLDOWN, CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN, "ring", "Intercom Ring!"},
+    {CONFIG_INTERCOM_DOOR_GPIO_PIN, CONFIG_INTERCOM_WAKE_LEVEL, INTERCOM_DOOR_PULL,
+        CONFIG_INTERCOM_RING_DETECTION_COOLDOWN, CONFIG_INTERCOM_RING_NOTIFICATION_COOLDOWN, "door", "Door Bell Ring!"},
+};
+
+inline constexpr size_t sensor_channel_count = sizeof(sensor_channels) / sizeof(sensor_channels[0]);
+
+static_assert(sensor_channel_count <= 16, "Event log records keep the channel in four bits");
+
+inline const char* sensor_channel_name(size_t channel)
+{
+    return channel < sensor_channel_count ? sensor_channels[channel].name : "unknown";
+}
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <array>
+#include <iterator>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_intr_alloc.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "log_level.h"
+#include "sensor_channels.hpp"
+#include "burst_classifier.hpp"
+#include "edge_journal.hpp"
+#include "pulse_capture.hpp"
+#include "tone_capture.hpp"
+
+static const char* sensor_log_tag = "sensors";
+
+// GPIOs the RTC domain can read, the only ones that can wake the chip from deep sleep.
+constexpr bool sensor_rtc_gpio(int gpio)
+{
+    return gpio == 0 || gpio == 2 || gpio == 4 || (gpio >= 12 && gpio <= 15) || (gpio >= 25 && gpio <= 27) || (gpio >= 32 && gpio <= 39);
+}
+
+/*
+    How the sensor lines wake the chip from deep sleep.
+
+    EXT1 can wake on any of its pins going high, but on low levels only once all of them are low, so it
+    takes a single active-low line. EXT0 takes one more line of either level. Every active-high line
+    goes to EXT1, the first active-low line to EXT0 and a second one to EXT1 if no active-high line uses it.
+*/
+struct sensor_wakeup_plan
+{
+    // Index of the line on EXT0, -1 for none.
+    int ext0_channel = -1;
+    uint64_t ext1_mask = 0;
+    // EXT1 waits for ESP_EXT1_WAKEUP_ALL_LOW on a single line instead of ESP_EXT1_WAKEUP_ANY_HIGH.
+    bool ext1_all_low = false;
+    // False if the lines do not fit EXT0 and EXT1 as above.
+    bool fits = true;
+};
+
+template<size_t Count>
+constexpr sensor_wakeup_plan sensor_plan_wakeup(const sensor_channel_config (&channels)[Count])
+{
+    sensor_wakeup_plan plan;
+    for(const sensor_channel_config& channel : channels)
+    {
+        if(channel.wake_level != 0)
+        {
+            plan.ext1_mask |= 1ULL << channel.gpio;
+        }
+    }
+    for(size_t i = 0; i < Count; i++)
+    {
+        if(channels[i].wake_level != 0)
+        {
+            continue;
+        }
+        if(plan.ext0_channel < 0)
+        {
+            plan.ext0_channel = static_cast<int>(i);
+        }
+        else if(plan.ext1_mask == 0)
+        {
+            plan.ext1_mask = 1ULL << channels[i].gpio;
+            plan.ext1_all_low = true;
+        }
+        else
+        {
+            plan.fits = false;
+        }
+    }
+    return plan;
+}
+
+/*
+    Every line of a sensor_channel_config table: pad setup, edge capture, deep sleep wake-up and the
+    line levels, with one loop or fold over the table instead of code per line.
+
+    With GPIO capture one interrupt serves all lines. It reads the interrupt status and the input
+    registers once, journals an edge for every line whose status bit is set and wakes the main task.
+    Pins, masks and the wake-up plan are worked out at compile time, so the handler touches no table in
+    flash and keeps running while the cache is off for a flash write.
+
+    With light sleep the interrupts are level-triggered, as only a level wakes the chip from it. Each
+    line waits for the level it is not at, and the handler flips that after every edge.
+
+    With ADC capture the pads belong to the ADC and the lines are read as samples, see tone_capture.
+*/
+template<const auto& Channels>
+class sensor_inputs
+{
+public:
+    static constexpr size_t count = std::size(Channels);
+    static constexpr sensor_wakeup_plan wakeup = sensor_plan_wakeup(Channels);
+
+private:
+    static_assert(count > 0 && count <= 32, "Channel masks are 32 bits");
+    static_assert(wakeup.fits, "EXT0 and EXT1 take any number of active-high lines but at most two active-low ones, "
+        "the second only without active-high lines");
+
+    static constexpr bool rtc_gpios()
+    {
+        for(const sensor_channel_config& channel : Channels)
+        {
+            if(!sensor_rtc_gpio(channel.gpio))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(rtc_gpios(), "Every sensor line must be on an RTC GPIO to wake the chip");
+
+    // Sensor pins in the layout of GPIO_IN_REG and GPIO_IN1_REG, which holds GPIO 32 and up.
+    static constexpr uint32_t pin_mask(bool high)
+    {
+        uint32_t mask = 0;
+        for(const sensor_channel_config& channel : Channels)
+        {
+            if((channel.gpio >= 32) == high)
+            {
+                mask |= 1u << (channel.gpio % 32);
+            }
+        }
+        return mask;
+    }
+    static constexpr uint32_t pins_low = pin_mask(false);
+    static constexpr uint32_t pins_high = pin_mask(true);
+
+public:
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT
+    static_assert(count <= 2, "Each RMT capture takes half of the RMT memory");
+
+    pulse_capture captures[count];
+#elif CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+    tone_capture<Channels> tones;
+#else
+    edge_journal<CONFIG_INTERCOM_EDGE_JOURNAL_SIZE> journal;
+#endif
+
+private:
+    EventGroupHandle_t event_group = nullptr;
+    EventBits_t event_bits = 0;
+
+public:
+    sensor_inputs() = default;
+    sensor_inputs(sensor_inputs const&) = delete;
+    sensor_inputs& operator=(sensor_inputs const&) = delete;
+
+    static gpio_num_t pin(size_t channel)
+    {
+        return static_cast<gpio_num_t>(Channels[channel].gpio);
+    }
+
+    // Takes the pads back from the RTC domain and starts capturing. event_bits are set in group once per
+    // batch of edges, or once per burst with RMT and ADC capture.
+    void setup(EventGroupHandle_t group, EventBits_t bits)
+    {
+        esp_log_level_set(sensor_log_tag, INTERCOM_LOG_LEVEL);
+        event_group = group;
+        event_bits = bits;
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+        // The ADC driver sets the pads up for analog input itself.
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+        for(size_t i = 0; i < count; i++)
+        {
+            ESP_ERROR_CHECK(rtc_gpio_hold_dis(pin(i)));
+        }
+#endif
+        tones.setup(group, bits);
+#else
+        for(size_t i = 0; i < count; i++)
+        {
+            gpio_num_t gpio = pin(i);
+#if CONFIG_INTERCOM_ULP_PULSE_WAKE
+            ESP_ERROR_CHECK(rtc_gpio_hold_dis(gpio));
+#endif
+            ESP_ERROR_CHECK(rtc_gpio_deinit(gpio));
+            ESP_ERROR_CHECK(gpio_set_direction(gpio, gpio_mode_t::GPIO_MODE_INPUT));
+            if(Channels[i].pull == sensor_pull::down)
+            {
+                ESP_ERROR_CHECK(gpio_set_pull_mode(gpio, GPIO_PULLDOWN_ONLY));
+            }
+            else if(Channels[i].pull == sensor_pull::up)
+            {
+                ESP_ERROR_CHECK(gpio_set_pull_mode(gpio, GPIO_PULLUP_ONLY));
+            }
+            ESP_LOGI(sensor_log_tag, "Setting %s sensor pin to GPIO %d, level %d", Channels[i].name, gpio, gpio_get_level(gpio));
+        }
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_RMT
+        // One interrupt per completed burst instead of one per edge.
+        for(size_t i = 0; i < count; i++)
+        {
+            captures[i].setup(pin(i), static_cast<sensor_channel>(i), Channels[i].wake_level, group, bits);
+        }
+#else
+        ESP_ERROR_CHECK(gpio_isr_register(on_gpio_interrupt, this, ESP_INTR_FLAG_IRAM, nullptr));
+        for(size_t i = 0; i < count; i++)
+        {
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+            // A line that changes before the interrupt is enabled is at the level it waits for, which fires at once.
+            ESP_ERROR_CHECK(gpio_wakeup_enable(pin(i), gpio_get_level(pin(i)) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL));
+#else
+            ESP_ERROR_CHECK(gpio_set_intr_type(pin(i), gpio_int_type_t::GPIO_INTR_ANYEDGE));
+#endif
+            ESP_ERROR_CHECK(gpio_intr_enable(pin(i)));
+        }
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+        ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+#endif
+#endif
+#endif
+    }
+
+    // Hands the pads to the RTC domain for the ULP, held so they keep their configuration while the
+    // digital domain is powered down. Released in setup().
+    static void hold_for_sleep()
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            gpio_num_t gpio = pin(i);
+            ESP_ERROR_CHECK(rtc_gpio_init(gpio));
+            ESP_ERROR_CHECK(rtc_gpio_set_direction(gpio, RTC_GPIO_MODE_INPUT_ONLY));
+            if(Channels[i].pull == sensor_pull::down)
+            {
+                ESP_ERROR_CHECK(rtc_gpio_pulldown_en(gpio));
+            }
+            else if(Channels[i].pull == sensor_pull::up)
+            {
+                ESP_ERROR_CHECK(rtc_gpio_pullup_en(gpio));
+            }
+            ESP_ERROR_CHECK(rtc_gpio_hold_en(gpio));
+        }
+    }
+
+    // Arms EXT0 and EXT1 as worked out in wakeup.
+    static void enable_wakeup()
+    {
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+        // The GPIO wakeup is for light sleep only; deep sleep takes EXT0 and EXT1.
+        ESP_ERROR_CHECK(esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO));
+#endif
+        if constexpr(wakeup.ext0_channel >= 0)
+        {
+            ESP_ERROR_CHECK(esp_sleep_enable_ext0_wakeup(pin(wakeup.ext0_channel), Channels[wakeup.ext0_channel].wake_level));
+            ESP_LOGI(sensor_log_tag, "EXT0 configured to %s pin (%d)", Channels[wakeup.ext0_channel].name, Channels[wakeup.ext0_channel].gpio);
+        }
+        if constexpr(wakeup.ext1_mask != 0)
+        {
+            ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup(wakeup.ext1_mask,
+                wakeup.ext1_all_low ? ESP_EXT1_WAKEUP_ALL_LOW : ESP_EXT1_WAKEUP_ANY_HIGH));
+            ESP_LOGI(sensor_log_tag, "EXT1 configured to GPIO mask 0x%llx", static_cast<unsigned long long>(wakeup.ext1_mask));
+        }
+    }
+
+    // Lines that woke the chip through EXT0 or EXT1, as a bit per channel index.
+    static uint32_t woken_by(esp_sleep_source_t cause)
+    {
+        if constexpr(wakeup.ext0_channel >= 0)
+        {
+            if(cause == ESP_SLEEP_WAKEUP_EXT0)
+            {
+                return 1u << wakeup.ext0_channel;
+            }
+        }
+        if(cause != ESP_SLEEP_WAKEUP_EXT1)
+        {
+            return 0;
+        }
+
+        // With ALL_LOW the single line on EXT1 is the one. ANY_HIGH reports the pins that were high.
+        uint64_t status = wakeup.ext1_all_low ? wakeup.ext1_mask : esp_sleep_get_ext1_wakeup_status();
+        uint32_t channels = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            if(wakeup.ext1_mask & status & (1ULL << Channels[i].gpio))
+            {
+                channels |= 1u << i;
+            }
+        }
+        if(channels == 0)
+        {
+            ESP_LOGE(sensor_log_tag, "EXT1 wake-up without a sensor pin, status 0x%llx", static_cast<unsigned long long>(status));
+        }
+        return channels;
+    }
+
+    // Lines at their wake level right now, as a bit per channel index. One read of the input registers.
+    // With ADC capture, the lines inside a burst.
+    static uint32_t active()
+    {
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+        return tone_capture<Channels>::active();
+#else
+        uint32_t in = REG_READ(GPIO_IN_REG);
+        uint32_t in_high = pins_high != 0 ? REG_READ(GPIO_IN1_REG) : 0;
+        uint32_t channels = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            const sensor_channel_config& channel = Channels[i];
+            uint32_t level = ((channel.gpio >= 32 ? in_high : in) >> (channel.gpio % 32)) & 1;
+            if(static_cast<int>(level) == channel.wake_level)
+            {
+                channels |= 1u << i;
+            }
+        }
+        return channels;
+#endif
+    }
+
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+    static std::array<burst_tracker, count> make_trackers()
+    {
+        return make_trackers(std::make_index_sequence<count>());
+    }
+#endif
+
+private:
+#if CONFIG_INTERCOM_BURST_CLASSIFIER
+    template<size_t... Index>
+    static std::array<burst_tracker, count> make_trackers(std::index_sequence<Index...>)
+    {
+        return {burst_tracker(static_cast<sensor_channel>(Index), Channels[Index].wake_level)...};
+    }
+#endif
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_GPIO_ISR
+    // Journals the edge of line Index if its status bit is set. Pin and bit are constants here.
+    static IRAM_ATTR void clear_status(uint32_t status, uint32_t status_high)
+    {
+        REG_WRITE(GPIO_STATUS_W1TC_REG, status);
+        if constexpr(pins_high != 0)
+        {
+            REG_WRITE(GPIO_STATUS1_W1TC_REG, status_high);
+        }
+    }
+
+    template<size_t Index>
+    IRAM_ATTR bool journal_edge(uint32_t cycles, uint32_t status, uint32_t status_high, uint32_t in, uint32_t in_high)
+    {
+        constexpr int gpio = Channels[Index].gpio;
+        constexpr uint32_t bit = 1u << (gpio % 32);
+        if(((gpio >= 32 ? status_high : status) & bit) == 0)
+        {
+            return false;
+        }
+
+        edge_record record;
+        record.cycles = cycles;
+        record.channel = static_cast<uint8_t>(Index);
+        record.level = ((gpio >= 32 ? in_high : in) & bit) != 0 ? 1 : 0;
+        journal.push(record);
+        return true;
+    }
+
+    template<size_t... Index>
+    IRAM_ATTR bool journal_edges(std::index_sequence<Index...>, uint32_t cycles, uint32_t status, uint32_t status_high, uint32_t in, uint32_t in_high)
+    {
+        return (journal_edge<Index>(cycles, status, status_high, in, in_high) | ...);
+    }
+
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+    // Makes line Index wait for the level it was read not to be at, if its status bit is set.
+    template<size_t Index>
+    static IRAM_ATTR void await_other_level(uint32_t status, uint32_t status_high, uint32_t in, uint32_t in_high)
+    {
+        constexpr int gpio = Channels[Index].gpio;
+        constexpr uint32_t bit = 1u << (gpio % 32);
+        if(((gpio >= 32 ? status_high : status) & bit) != 0)
+        {
+            bool high = ((gpio >= 32 ? in_high : in) & bit) != 0;
+            REG_SET_FIELD(GPIO_PIN0_REG + 4 * gpio, GPIO_PIN0_INT_TYPE, high ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+        }
+    }
+
+    template<size_t... Index>
+    static IRAM_ATTR void await_other_levels(std::index_sequence<Index...>, uint32_t status, uint32_t status_high, uint32_t in, uint32_t in_high)
+    {
+        (await_other_level<Index>(status, status_high, in, in_high), ...);
+    }
+#endif
+
+    /*
+        Time of an edge, on the clock the main task converts back to esp_timer time. The cycle counter stops
+        in light sleep and changes rate with the CPU clock, so with light sleep it is esp_timer itself.
+    */
+    static IRAM_ATTR uint32_t edge_clock()
+    {
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+        return static_cast<uint32_t>(esp_timer_get_time());
+#else
+        return esp_cpu_get_cycle_count();
+#endif
+    }
+
+    static void IRAM_ATTR on_gpio_interrupt(void* arg)
+    {
+        sensor_inputs& self = *static_cast<sensor_inputs*>(arg);
+        uint32_t cycles = edge_clock();
+
+        uint32_t status = REG_READ(GPIO_STATUS_REG) & pins_low;
+        uint32_t status_high = pins_high != 0 ? REG_READ(GPIO_STATUS1_REG) & pins_high : 0;
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+        // A level stays asserted, so the lines wait for the other level before their status is cleared. A line
+        // that changed again since the read is at the level it waits for, and raises the interrupt once more.
+        uint32_t in = REG_READ(GPIO_IN_REG);
+        uint32_t in_high = pins_high != 0 ? REG_READ(GPIO_IN1_REG) : 0;
+        await_other_levels(std::make_index_sequence<count>(), status, status_high, in, in_high);
+        clear_status(status, status_high);
+#else
+        // Cleared before the inputs are read, so an edge after the read raises the interrupt again.
+        clear_status(status, status_high);
+        uint32_t in = REG_READ(GPIO_IN_REG);
+        uint32_t in_high = pins_high != 0 ? REG_READ(GPIO_IN1_REG) : 0;
+#endif
+
+        // Every edge is journaled with its cycle count; the event bits only wake the main task to drain it.
+        if(!self.journal_edges(std::make_index_sequence<count>(), cycles, status, status_high, in, in_high))
+        {
+            return;
+        }
+
+        int higher_priority_task_woken = false;
+        int result = xEventGroupSetBitsFromISR(self.event_group, self.event_bits, &higher_priority_task_woken);
+        if(result != pdFAIL)
+        {
+            portYIELD_FROM_ISR(higher_priority_task_woken);
+        }
+    }
+#endif
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_SLEEP_SCHEDULER
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SLEEP_SCHEDULER_MAGIC 0x53534331
+#define SLEEP_SCHEDULER_HOURS 24
+#define SLEEP_SCHEDULER_GAP_BUCKETS 12
+// Weight of one event or one day. Weights lose an eighth every day, which gives the history a half-life of about five days.
+#define SLEEP_SCHEDULER_WEIGHT 256
+// Gaps seen before the history is trusted. Until then the awake window is CONFIG_INTERCOM_DEEP_SLEEP_DELAY.
+#define SLEEP_SCHEDULER_MIN_GAPS 8
+#define SLEEP_SCHEDULER_DAY_S (24 * 3600)
+
+// Upper bounds of the gap buckets in seconds. The last bucket takes every longer gap: an event that far from the
+// one before is no repeat, it comes at the rate of its hour.
+inline constexpr uint32_t sleep_scheduler_gap_bounds_s[SLEEP_SCHEDULER_GAP_BUCKETS - 1] = {10, 20, 30, 45, 60, 90, 120, 180, 300, 600, 1800};
+
+/*
+    What the scheduler learned of the events, kept in RTC slow memory across deep sleep.
+
+    Meant to be declared RTC_DATA_ATTR, like energy_ledger. Times are seconds of the RTC clock, which starts at
+    power-on: hours are hours of the RTC day, not of the wall clock, which is all a daily pattern needs. Every
+    weight is in units of SLEEP_SCHEDULER_WEIGHT and decays once a day, so old habits fade.
+*/
+struct sleep_schedule_state
+{
+    uint32_t magic;
+    // Events in each hour of the day.
+    uint32_t hour_weight[SLEEP_SCHEDULER_HOURS];
+    // Time from an event to the next one.
+    uint32_t gap_weight[SLEEP_SCHEDULER_GAP_BUCKETS];
+    // Days observed, decayed like the rest.
+    uint32_t day_weight;
+    uint32_t day;
+    uint32_t last_event_s;
+    bool has_last_event;
+    uint16_t gaps_seen;
+    // Charge of a wake that reconnects for an event, averaged over the last ones, uC. 0 until measured.
+    uint32_t wake_uc;
+};
+
+// What staying awake and waking up cost, in microcoulombs.
+struct sleep_scheduler_costs
+{
+    uint32_t idle_uc_per_s;
+    uint32_t wake_uc;
+};
+
+struct sleep_hold_choice
+{
+    uint32_t hold_s;
+    // Probability that the next event comes after the hold and has to wake the chip.
+    float miss_probability;
+    // Charge until the next event, uC.
+    float expected_uc;
+    // Expected extra notification latency of a repeat, ms.
+    float latency_ms;
+    // False while the history is too short; the hold is then the configured delay.
+    bool learned;
+};
+
+inline uint32_t sleep_scheduler_hour(uint32_t time_s)
+{
+    return time_s / 3600 % SLEEP_SCHEDULER_HOURS;
+}
+
+// Fades the weights for every day that passed up to time_s.
+inline void sleep_scheduler_advance(sleep_schedule_state& state, uint32_t time_s)
+{
+    uint32_t today = time_s / SLEEP_SCHEDULER_DAY_S;
+    // After two months without a wake the history is gone either way.
+    uint32_t days = today <= state.day ? 0 : today - state.day < 64 ? today - state.day : 64;
+    for(uint32_t d = 0; d < days; d++)
+    {
+        for(uint32_t& weight : state.hour_weight)
+        {
+            weight -= weight >> 3;
+        }
+        for(uint32_t& weight : state.gap_weight)
+        {
+            weight -= weight >> 3;
+        }
+        state.day_weight = state.day_weight - (state.day_weight >> 3) + SLEEP_SCHEDULER_WEIGHT;
+    }
+    state.day = today > state.day ? today : state.day;
+}
+
+// Starts the wake. Call with the RTC time once per boot.
+inline void sleep_scheduler_begin(sleep_schedule_state& state, uint32_t now_s)
+{
+    if(state.magic != SLEEP_SCHEDULER_MAGIC)
+    {
+        memset(&state, 0, sizeof(state));
+        state.magic = SLEEP_SCHEDULER_MAGIC;
+        state.day = now_s / SLEEP_SCHEDULER_DAY_S;
+        state.day_weight = SLEEP_SCHEDULER_WEIGHT;
+    }
+    sleep_scheduler_advance(state, now_s);
+}
+
+inline size_t sleep_scheduler_gap_bucket(uint32_t gap_s)
+{
+    size_t bucket = 0;
+    while(bucket < SLEEP_SCHEDULER_GAP_BUCKETS - 1 && gap_s >= sleep_scheduler_gap_bounds_s[bucket])
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+inline void sleep_scheduler_learn_gap(sleep_schedule_state& state, uint32_t gap_s)
+{
+    state.gap_weight[sleep_scheduler_gap_bucket(gap_s)] += SLEEP_SCHEDULER_WEIGHT;
+    state.gaps_seen = state.gaps_seen < UINT16_MAX ? state.gaps_seen + 1 : UINT16_MAX;
+}
+
+// Learns from an event at time_s. Events come in order; an earlier one is counted for its hour only.
+inline void sleep_scheduler_record(sleep_schedule_state& state, uint32_t time_s)
+{
+    sleep_scheduler_advance(state, time_s);
+    state.hour_weight[sleep_scheduler_hour(time_s)] += SLEEP_SCHEDULER_WEIGHT;
+    if(state.has_last_event && time_s >= state.last_event_s)
+    {
+        sleep_scheduler_learn_gap(state, time_s - state.last_event_s);
+    }
+    if(!state.has_last_event || time_s >= state.last_event_s)
+    {
+        state.last_event_s = time_s;
+        state.has_last_event = true;
+    }
+}
+
+// Averages the charge of a wake that had to connect, with a weight of one in four for the newest.
+inline void sleep_scheduler_observe_wake(sleep_schedule_state& state, uint32_t charge_uc)
+{
+    state.wake_uc = state.wake_uc == 0 ? charge_uc : state.wake_uc - state.wake_uc / 4 + charge_uc / 4;
+}
+
+// Events per second in hour, with a prior of one event a day spread over all hours so that no hour is certain to be quiet.
+inline float sleep_scheduler_rate(const sleep_schedule_state& state, uint32_t hour)
+{
+    float prior = static_cast<float>(SLEEP_SCHEDULER_WEIGHT) / SLEEP_SCHEDULER_HOURS;
+    return (state.hour_weight[hour] + prior) / state.day_weight / 3600.0f;
+}
+
+inline float sleep_scheduler_gap_total(const sleep_schedule_state& state)
+{
+    float total = 0;
+    for(uint32_t weight : state.gap_weight)
+    {
+        total += weight;
+    }
+    return total;
+}
+
+// Share of the events that are no repeat. With every gap faded away there are no repeats to expect.
+inline float sleep_scheduler_other_share(const sleep_schedule_state& state)
+{
+    float total = sleep_scheduler_gap_total(state);
+    return total > 0 ? state.gap_weight[SLEEP_SCHEDULER_GAP_BUCKETS - 1] / total : 1.0f;
+}
+
+// Share of the repeats that come more than t after the event before, the gaps spread evenly within their bucket.
+inline float sleep_scheduler_repeats_after(const sleep_schedule_state& state, float t)
+{
+    float repeats = 0;
+    float later = 0;
+    for(size_t b = 0; b < SLEEP_SCHEDULER_GAP_BUCKETS - 1; b++)
+    {
+        float low = b == 0 ? 0.0f : sleep_scheduler_gap_bounds_s[b - 1];
+        float high = sleep_scheduler_gap_bounds_s[b];
+        float beyond = t <= low ? 1.0f : t < high ? (high - t) / (high - low) : 0.0f;
+        repeats += state.gap_weight[b];
+        later += state.gap_weight[b] * beyond;
+    }
+    return repeats > 0 ? later / repeats : 0.0f;
+}
+
+// Chances of the next event arriving more than t after the last: repeats follow the learned gaps, spread
+// evenly within their bucket; everything else comes at the rate of the hour. integral is that of the
+// probability from 0 to t, the expected time awake with a hold of t.
+inline float sleep_scheduler_survival(const sleep_schedule_state& state, float rate, float t, float& integral)
+{
+    float total = sleep_scheduler_gap_total(state);
+    total = total > 0 ? total : 1.0f;
+    float other = sleep_scheduler_other_share(state);
+    float survival = other * expf(-rate * t);
+    integral = other * (rate > 0 ? (1 - expf(-rate * t)) / rate : t);
+    for(size_t b = 0; b < SLEEP_SCHEDULER_GAP_BUCKETS - 1; b++)
+    {
+        float share = state.gap_weight[b] / total;
+        float low = b == 0 ? 0.0f : sleep_scheduler_gap_bounds_s[b - 1];
+        float high = sleep_scheduler_gap_bounds_s[b];
+        if(t <= low)
+        {
+            survival += share;
+            integral += share * t;
+            continue;
+        }
+        float within = (t < high ? t : high) - low;
+        survival += t < high ? share * (1 - within / (high - low)) : 0;
+        integral += share * (low + within - within * within / (2 * (high - low)));
+    }
+    return survival;
+}
+
+/*
+    Picks how long to stay awake after an event at now_s. Each candidate hold costs the idle time until the next
+    event or the end of the hold, plus a new wake if the next event comes later. The latency is the expected one
+    of a repeat, an event within half an hour of the one before, which is late when it finds the chip asleep:
+    among the holds that keep it within the target, the cheapest wins. Where even the longest hold cannot, as
+    repeats after longer gaps than it are late whatever the hold, only holds as good as the longest one qualify.
+    Deterministic for a given state.
+*/
+inline sleep_hold_choice sleep_scheduler_choose_hold(const sleep_schedule_state& state, const sleep_scheduler_costs& costs, uint32_t now_s)
+{
+    sleep_hold_choice best = {};
+    if(state.magic != SLEEP_SCHEDULER_MAGIC || state.gaps_seen < SLEEP_SCHEDULER_MIN_GAPS)
+    {
+        best.hold_s = CONFIG_INTERCOM_DEEP_SLEEP_DELAY;
+        return best;
+    }
+
+    float rate = sleep_scheduler_rate(state, sleep_scheduler_hour(now_s));
+    uint32_t candidates[SLEEP_SCHEDULER_GAP_BUCKETS + 1];
+    size_t count = 0;
+    candidates[count++] = CONFIG_INTERCOM_SLEEP_SCHEDULER_MIN_HOLD;
+    for(uint32_t bound : sleep_scheduler_gap_bounds_s)
+    {
+        if(bound > CONFIG_INTERCOM_SLEEP_SCHEDULER_MIN_HOLD && bound < CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD)
+        {
+            candidates[count++] = bound;
+        }
+    }
+    candidates[count++] = CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD;
+
+    float floor_ms = sleep_scheduler_repeats_after(state, CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_HOLD) * CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS;
+    float allowed_ms = floor_ms > CONFIG_INTERCOM_SLEEP_SCHEDULER_LATENCY_TARGET_MS ? floor_ms : CONFIG_INTERCOM_SLEEP_SCHEDULER_LATENCY_TARGET_MS;
+    bool found = false;
+    for(size_t i = 0; i < count; i++)
+    {
+        float t = static_cast<float>(candidates[i]);
+        sleep_hold_choice choice = {};
+        choice.latency_ms = sleep_scheduler_repeats_after(state, t) * CONFIG_INTERCOM_SLEEP_SCHEDULER_COLD_LATENCY_MS;
+        if(choice.latency_ms > allowed_ms)
+        {
+            continue;
+        }
+        float awake_s;
+        choice.hold_s = candidates[i];
+        choice.miss_probability = sleep_scheduler_survival(state, rate, t, awake_s);
+        choice.expected_uc = awake_s * costs.idle_uc_per_s + choice.miss_probability * costs.wake_uc;
+        choice.learned = true;
+        // On equal charge the shorter hold, which comes first.
+        if(!found || choice.expected_uc < best.expected_uc)
+        {
+            best = choice;
+            found = true;
+        }
+    }
+    return best;
+}
+
+#ifdef CONFIG_INTERCOM_DEEP_SLEEP_DURATION_ENABLED
+// Timer wake interval for a sleep that starts at now_s. Spends the timer wakes where the events are: keeping the
+// average wait of an event for the next timer wake at that of the fixed CONFIG_INTERCOM_DEEP_SLEEP_DURATION, the
+// fewest wakes a day come with an interval inversely proportional to the square root of the hour's rate.
+inline uint32_t sleep_scheduler_timer_interval(const sleep_schedule_state& state, uint32_t now_s)
+{
+    if(state.magic != SLEEP_SCHEDULER_MAGIC)
+    {
+        return CONFIG_INTERCOM_DEEP_SLEEP_DURATION;
+    }
+    float rates = 0;
+    float roots = 0;
+    for(uint32_t hour = 0; hour < SLEEP_SCHEDULER_HOURS; hour++)
+    {
+        float rate = sleep_scheduler_rate(state, hour);
+        rates += rate;
+        roots += sqrtf(rate);
+    }
+    float interval = CONFIG_INTERCOM_DEEP_SLEEP_DURATION * rates / (roots * sqrtf(sleep_scheduler_rate(state, sleep_scheduler_hour(now_s))));
+    float shortest = CONFIG_INTERCOM_DEEP_SLEEP_DURATION / 4 > 0 ? CONFIG_INTERCOM_DEEP_SLEEP_DURATION / 4 : 1;
+    float longest = CONFIG_INTERCOM_SLEEP_SCHEDULER_MAX_DURATION;
+    return static_cast<uint32_t>(interval < shortest ? shortest : interval > longest ? longest : interval);
+}
+#endif
+
+#endif
@@ -2,17 +2,18 @@
 
 #if CONFIG_INTERCOM_TELEGRAM_ENABLED
 
-#include "esp_http_client.h"
-#include <string>
+#include "esp_attr.h"
 #include "esp_log.h"
-#include "esp_tls.h"
-#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
-#include "esp_crt_bundle.h"
-#endif
+#include "esp_timer.h"
+#include "https_connection.hpp"
+#include "json_writer.hpp"
+#include "json_reader.hpp"
+#include "multipart_writer.hpp"
+#include "command_channel.hpp"
+#include "notification_dispatcher.hpp"
+#include "audio_clip.hpp"
 
 #define TELEGRAM_HOSTNAME "api.telegram.org"
-#define MAX_HTTP_OUTPUT_BUFFER 512
-#define MAX_HTTP_INPUT_BUFFER 512
 
 #ifndef MIN
 # define MIN(a,b) ((a) < (b) ? (a) : (b))
@@ -23,109 +24,335 @@ const char *tg_log_tag = "telegram";
 extern const char postman_root_cert_pem_start[] asm("_binary_postman_root_cert_pem_start");
 extern const char postman_root_cert_pem_end[]   asm("_binary_postman_root_cert_pem_end");
 
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+// Survives deep sleep, so the first notification after a wake can resume the previous TLS session.
+RTC_DATA_ATTR tls_session_slot telegram_tls_session;
+https_connection telegram_connection(TELEGRAM_HOSTNAME, &telegram_tls_session);
+
+#define TELEGRAM_PATH(method) "/bot" CONFIG_INTERCOM_TELEGRAM_API_KEY "/" method
+
+// The sendMessage body with empty strings, as json_writer lays it out.
+#define TELEGRAM_MESSAGE_SKELETON "{\"chat_id\":\"\",\"text\":\"\",\"parse_mode\":\"HTML\",\"disable_notification\":false}"
+
+// Added to a notification an earlier attempt may have delivered already. It goes out silently.
+#define TELEGRAM_REPEAT_NOTE "\n(sent again, may be a repeat)"
+
+// Room for the longest body: the chat id as configured and a notification text of nothing but control characters.
+constexpr size_t telegram_message_body_size = sizeof(TELEGRAM_MESSAGE_SKELETON)
+    + json_escaped_length(CONFIG_INTERCOM_TELEGRAM_CHAT_ID) + json_escaped_max(NOTIFICATION_TEXT_MAX - 1) + json_escaped_length(TELEGRAM_REPEAT_NOTE);
+static_assert(telegram_message_body_size <= 2048, "sendMessage body buffer too large, lower NOTIFICATION_TEXT_MAX");
+
+// Every request body is assembled here, nothing is allocated per message.
+char telegram_message_body[telegram_message_body_size];
+
+// Opens the connection ahead of the first notification. getMe is the cheapest authenticated Bot API call.
+bool telegram_connect()
+{
+#if CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE
+    esp_log_level_set(tg_log_tag, INTERCOM_LOG_LEVEL);
+    return telegram_connection.warm_up(TELEGRAM_PATH("getMe"));
+#else
+    return false;
+#endif
+}
+
+// What a sendDocument body is written from: the caption and a producer that writes the file content.
+struct telegram_document
 {
-    // static char *output_buffer;  // Buffer to store response of http request from event handler
-    // static int output_len;       // Stores number of bytes read
-    switch(evt->event_id)
+    const char* filename;
+    const char* content_type;
+    const char* caption;
+    bool (*produce)(multipart_writer& form, void* context);
+    void* context;
+};
+
+bool telegram_write_document(https_connection& connection, void* context)
+{
+    const telegram_document& document = *static_cast<const telegram_document*>(context);
+    multipart_writer form(connection);
+    form.field("chat_id", CONFIG_INTERCOM_TELEGRAM_CHAT_ID)
+        .field("caption", document.caption)
+        .file("document", document.filename, document.content_type);
+    return form.ok() && document.produce(form, document.context) && form.end();
+}
+
+// Uploads a file as a document, streamed from produce() in chunked transfer encoding: neither the body nor
+// the file is assembled in RAM, and produce() does not need to know the size up front. Returns the status code.
+int telegram_send_document(const char* filename, const char* content_type, const char* caption,
+    bool (*produce)(multipart_writer& form, void* context), void* context)
+{
+    telegram_document document = {filename, content_type, caption, produce, context};
+    https_body_source source = {HTTPS_BODY_CHUNKED, telegram_write_document, &document};
+    int status_code = telegram_connection.request("POST", TELEGRAM_PATH("sendDocument"), MULTIPART_CONTENT_TYPE, source);
+
+    const https_upload_stats& upload = telegram_connection.upload_stats();
+    long long duration_ms = upload.duration_us / 1000;
+    ESP_LOGI(tg_log_tag, "sendDocument %s: %d bytes in %lld ms, %lld KiB/s, %u bytes of heap at peak, status %d", filename, upload.bytes, duration_ms,
+        duration_ms > 0 ? upload.bytes * 1000LL / 1024 / duration_ms : 0LL, static_cast<unsigned>(upload.heap_used), status_code);
+
+#if !CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE
+    telegram_connection.close();
+#endif
+    return status_code;
+}
+
+#if CONFIG_INTERCOM_AUDIO_CLIP
+bool telegram_produce_clip(multipart_writer& form, void* context)
+{
+    const audio_clip& clip = *static_cast<const audio_clip*>(context);
+    uint8_t wav_header[IMA_ADPCM_WAV_HEADER_BYTES];
+    ima_adpcm_wav_header(wav_header, CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ, clip.end_block - clip.first_block);
+    form.write(wav_header, sizeof(wav_header));
+    // Straight from the ring: the blocks are not copied into internal RAM first.
+    for(uint32_t sequence = clip.first_block; sequence < clip.end_block && form.ok();)
+    {
+        uint32_t count;
+        const uint8_t* blocks = audio_clips.blocks(sequence, clip.end_block, count);
+        form.write(blocks, count * IMA_ADPCM_BLOCK_BYTES);
+        sequence += count;
+    }
+    return form.ok();
+}
+
+// Uploads a finished audio clip as a WAV document, if one is due. sendVoice and sendAudio only take OGG/Opus
+// and MP3, which the firmware does not encode; a document is played by the Telegram apps all the same.
+void telegram_send_audio_clip()
+{
+    audio_clip clip;
+    if(!audio_clips.take(clip))
     {
-        case HTTP_EVENT_ERROR:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_ERROR");
-            break;
+        return;
+    }
+
+    long long duration_ms = static_cast<long long>(clip.end_block - clip.first_block) * IMA_ADPCM_BLOCK_SAMPLES * 1000 / CONFIG_INTERCOM_AUDIO_SAMPLE_RATE_HZ;
+    char caption[NOTIFICATION_TEXT_MAX];
+    snprintf(caption, sizeof(caption), "%s %lld.%lld s", sensor_channels[clip.channel].text, duration_ms / 1000, duration_ms % 1000 / 100);
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%s.wav", sensor_channels[clip.channel].name);
+    audio_clips.finish(telegram_send_document(filename, "audio/wav", caption, telegram_produce_clip, &clip));
+}
+#endif
 
-        case HTTP_EVENT_ON_CONNECTED:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_ON_CONNECTED");
-            break;
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+// Long polls hold their request open, so they get a connection of their own and never stand in the way of a notification.
+// Its session stays in DRAM rather than taking a second RTC slot, see telegram_begin_commands.
+tls_session_slot telegram_updates_tls_session;
+https_connection telegram_updates_connection(TELEGRAM_HOSTNAME, &telegram_updates_tls_session, (CONFIG_INTERCOM_TELEGRAM_COMMAND_POLL_S + 10) * 1000);
+// The update_id after the last update taken, so that every command is handled once, also across deep sleep.
+RTC_DATA_ATTR int64_t telegram_update_offset;
 
-        case HTTP_EVENT_HEADER_SENT:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_HEADER_SENT");
-            break;
+// A reply as sendMessage takes it. Owned by the command task, like telegram_updates_connection.
+constexpr size_t telegram_command_body_size = sizeof(TELEGRAM_MESSAGE_SKELETON)
+    + json_escaped_length(CONFIG_INTERCOM_TELEGRAM_CHAT_ID) + json_escaped_max(COMMAND_REPLY_MAX - 1);
+char telegram_command_body[telegram_command_body_size];
 
-        case HTTP_EVENT_ON_HEADER:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-            break;
+/*
+    Picks the commands out of a getUpdates response while it streams in: update_id, the chat and the text of
+    each message, and nothing else. Only messages from CONFIG_INTERCOM_TELEGRAM_CHAT_ID count; anyone can
+    write to a bot.
+*/
+struct telegram_update_reader : json_reader_handler
+{
+    command_request* requests;
+    size_t capacity;
+    size_t count = 0;
+    bool ok = false;
+    int64_t last_update_id = -1;
 
-        case HTTP_EVENT_ON_DATA:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            break;
+    // Of the update being read.
+    int64_t update_id = -1;
+    int64_t chat_id = 0;
+    char text[COMMAND_TEXT_MAX] = {};
+    size_t text_length = 0;
 
-        case HTTP_EVENT_ON_FINISH:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_ON_FINISH");
-            break;
+    telegram_update_reader(command_request* storage, size_t size)
+        : requests(storage), capacity(size)
+    {
+    }
 
-        case HTTP_EVENT_DISCONNECTED:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_DISCONNECTED");
-            break;
+    void on_literal(const json_path& path, bool value)
+    {
+        if(path.is({"ok"}))
+        {
+            ok = value;
+        }
+    }
 
-        case HTTP_EVENT_REDIRECT:
-            ESP_LOGD(tg_log_tag, "HTTP_EVENT_REDIRECT");
-            break;
+    void on_number(const json_path& path, int64_t value, bool)
+    {
+        if(path.is({"result", "[]", "update_id"}))
+        {
+            update_id = value;
+        }
+        else if(path.is({"result", "[]", "message", "chat", "id"}))
+        {
+            chat_id = value;
+        }
+    }
 
-        default:
-            ESP_LOGW(tg_log_tag, "Unexpected HTTP event: %d", evt->event_id);
-            break;
+    void on_string(const json_path& path, const char* data, size_t length, bool)
+    {
+        if(path.is({"result", "[]", "message", "text"}))
+        {
+            size_t room = sizeof(text) - 1 - text_length;
+            length = length < room ? length : room;
+            memcpy(text + text_length, data, length);
+            text_length += length;
+            text[text_length] = '\0';
+        }
     }
 
-    return ESP_OK;
+    void on_end(const json_path& path)
+    {
+        if(!path.is({"result", "[]"}))
+        {
+            return;
+        }
+        last_update_id = update_id > last_update_id ? update_id : last_update_id;
+        command_request request;
+        if(text_length > 0 && command_parse(text, request))
+        {
+            if(chat_id != strtoll(CONFIG_INTERCOM_TELEGRAM_CHAT_ID, nullptr, 10))
+            {
+                ESP_LOGW(tg_log_tag, "Command from chat %lld ignored", static_cast<long long>(chat_id));
+            }
+            else if(count < capacity)
+            {
+                request.received_us = esp_timer_get_time();
+                requests[count++] = request;
+            }
+        }
+        update_id = -1;
+        chat_id = 0;
+        text_length = 0;
+        text[0] = '\0';
+    }
+};
+
+struct telegram_update_stream
+{
+    json_reader reader;
+    telegram_update_reader updates;
+};
+
+// Waits for new messages with getUpdates. Telegram answers as soon as one arrives, or with none after timeout_s.
+int telegram_poll_commands(int timeout_s, command_request* requests, size_t capacity)
+{
+    char path[sizeof(TELEGRAM_PATH("getUpdates")) + 128];
+    snprintf(path, sizeof(path), TELEGRAM_PATH("getUpdates") "?offset=%lld&limit=%u&timeout=%d&allowed_updates=%%5B%%22message%%22%%5D",
+        static_cast<long long>(telegram_update_offset), static_cast<unsigned>(capacity), timeout_s);
+
+    telegram_update_stream stream = {json_reader(), telegram_update_reader(requests, capacity)};
+    https_body_sink sink = {};
+    sink.read = [](const char* data, int length, void* context)
+    {
+        telegram_update_stream& s = *static_cast<telegram_update_stream*>(context);
+        s.reader.feed(data, length, s.updates);
+    };
+    sink.context = &stream;
+
+    int status_code = telegram_updates_connection.request("GET", path, sink);
+    if(status_code != 200 || !stream.reader.finish(stream.updates) || !stream.updates.ok)
+    {
+        ESP_LOGW(tg_log_tag, "getUpdates failed, status %d%s", status_code, status_code == 200 ? ", response not understood" : "");
+        return -1;
+    }
+    if(stream.updates.last_update_id >= 0)
+    {
+        // Confirmed to Telegram with the next poll.
+        telegram_update_offset = stream.updates.last_update_id + 1;
+    }
+    return static_cast<int>(stream.updates.count);
+}
+
+int telegram_reply_command(const char* text)
+{
+    json_writer body(telegram_command_body);
+    body.begin_object()
+        .key("chat_id").string(CONFIG_INTERCOM_TELEGRAM_CHAT_ID)
+        .key("text").string(text)
+        .end_object();
+    if(!body.ok())
+    {
+        return 413;
+    }
+    return telegram_updates_connection.request("POST", TELEGRAM_PATH("sendMessage"), "application/json", body.data(), body.size());
+}
+
+/*
+    Call once per wake before either connection is used. The long-poll connection starts from a copy of the
+    notification connection's session: a ticket for the host is good for both.
+*/
+void telegram_begin_commands()
+{
+    telegram_updates_tls_session = tls_session_seed(telegram_tls_session);
 }
 
-int telegram_send_notification(const char* text)
+void telegram_disconnect_commands()
+{
+    telegram_updates_connection.close();
+}
+#endif
+
+// Call periodically while awake. Refreshes the connection before it idles out, and sends what waits for an idle moment.
+void telegram_keep_warm()
+{
+#if CONFIG_INTERCOM_AUDIO_CLIP
+    telegram_send_audio_clip();
+#endif
+#if CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE
+    telegram_connection.keep_warm(TELEGRAM_PATH("getMe"), CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE_REFRESH * 1000000LL);
+#endif
+}
+
+void telegram_disconnect()
+{
+    telegram_connection.close();
+}
+
+void telegram_log_stats()
+{
+    tls_session_log_stats(telegram_tls_session);
+#if CONFIG_INTERCOM_TELEGRAM_COMMANDS
+    tls_session_log_stats(telegram_updates_tls_session);
+#endif
+}
+
+int telegram_send_notification(const notification_batch& batch)
 {
     esp_log_level_set(tg_log_tag, INTERCOM_LOG_LEVEL);    
 
     ESP_LOGD(tg_log_tag, "telegram_send_notification called");
-    char local_response_buffer[MAX_HTTP_OUTPUT_BUFFER + 1] = {0};
-    /**
-     * NOTE: All the configuration parameters for http_client must be spefied either in URL or as host and path parameters.
-     * If host and path parameters are not set, query parameter will be ignored. In such cases,
-     * query parameter should be specified in URL.
-     *
-     * If URL as well as host and path parameters are specified, values of host and path will be considered.
-     */
-    esp_http_client_config_t config = {};
-    config.host = TELEGRAM_HOSTNAME;
-    config.path = "/bot" CONFIG_INTERCOM_TELEGRAM_API_KEY "/sendMessage";
-    config.event_handler = _http_event_handler;
-    config.user_data = local_response_buffer;        // Pass address of local buffer to get response
-    config.disable_auto_redirect = true;
-    config.crt_bundle_attach = esp_crt_bundle_attach;
-    config.transport_type = HTTP_TRANSPORT_OVER_SSL;
-
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    ESP_LOGD(tg_log_tag, "esp_http_client_init called");
-    // POST
-    const char* post_data_base = 
-        "{" \
-            "\"chat_id\": \"" CONFIG_INTERCOM_TELEGRAM_CHAT_ID "\", " \
-            "\"text\": \"%s\", " \
-            "\"parse_mode\": \"HTML\", " \
-            "\"disable_notification\": false" \
-        "}";
-
-    char post_data[MAX_HTTP_INPUT_BUFFER];
-    int post_data_len = sprintf(post_data, post_data_base, text);
-    ESP_LOGI(tg_log_tag, "JSON Payload len: %d, text: %s", post_data_len, post_data);
-
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_post_field(client, post_data, post_data_len);
-    esp_err_t err = esp_http_client_perform(client);
-
-    int status_code = esp_http_client_get_status_code(client);
-
-    if (err == ESP_OK) 
-    {
-        ESP_LOGI(tg_log_tag, "HTTP POST Status = %d, content_length = %" PRId64,
-                status_code,
-                esp_http_client_get_content_length(client));
-    } else 
+    // sendMessage has no idempotency key, so what may have arrived already is marked and does not ring the phone again.
+    char text[NOTIFICATION_TEXT_MAX + sizeof(TELEGRAM_REPEAT_NOTE)];
+    snprintf(text, sizeof(text), "%s%s", batch.text, batch.unconfirmed ? TELEGRAM_REPEAT_NOTE : "");
+    json_writer body(telegram_message_body);
+    body.begin_object()
+        .key("chat_id").string(CONFIG_INTERCOM_TELEGRAM_CHAT_ID)
+        .key("text").string(text)
+        .key("parse_mode").string("HTML")
+        .key("disable_notification").boolean(batch.unconfirmed)
+        .end_object();
+    if(!body.ok())
     {
-        ESP_LOGE(tg_log_tag, "HTTP POST request failed: %s", esp_err_to_name(err));
-        status_code = -1;
+        // Only a text longer than NOTIFICATION_TEXT_MAX gets here. Reported as 413 Payload Too Large, which is not retried.
+        ESP_LOGE(tg_log_tag, "Notification text does not fit the %u byte body buffer", static_cast<unsigned>(sizeof(telegram_message_body)));
+        return 413;
     }
+    ESP_LOGI(tg_log_tag, "JSON Payload len: %d, text: %s", body.size(), body.data());
 
-    esp_http_client_cleanup(client);
+    bool reused = telegram_connection.is_connected();
+    int64_t start = esp_timer_get_time();
+    int status_code = telegram_connection.request("POST", TELEGRAM_PATH("sendMessage"), "application/json", body.data(), body.size());
+    ESP_LOGI(tg_log_tag, "HTTP POST Status = %d in %lld ms on %s connection", status_code,
+        static_cast<long long>((esp_timer_get_time() - start) / 1000), reused ? "a kept-alive" : "a new");
 
+#if !CONFIG_INTERCOM_TELEGRAM_KEEP_ALIVE
+    telegram_connection.close();
+#endif
+    if(status_code < 0)
+    {
+        return status_code == HTTPS_STATUS_NO_RESPONSE ? NOTIFICATION_STATUS_UNCONFIRMED : NOTIFICATION_STATUS_NOT_SENT;
+    }
     return status_code;
 }
 
@@ -1,107 +1,319 @@
 #pragma once
 
-#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "freertos/queue.h"
-#include "driver/timer.h"
-#include "soc/rtc.h"
-#include "events.h"
+#include "freertos/event_groups.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
 #include "log_level.h"
 
-#define TIMER_DIVIDER         (16)  //  Hardware timer clock divider
+// Width of a wheel slot. Deadlines still expire to the microsecond, the tick only picks their slot.
+#define TIMER_WHEEL_TICK_US 10000
+// A power of two. One turn of the wheel is 1.28 s; a later deadline waits in its slot for its turn.
+#define TIMER_WHEEL_SLOTS 128
+// Expirations posted per pass of the alarm callback, which cannot set event bits inside the critical section.
+#define TIMER_WHEEL_POST_BATCH 8
 
 static const char* timer_log_tag = "timer";
 
-EventGroupHandle_t timer_event_group;
-
-uint32_t get_apb_freq()
+struct timer_link
 {
-    return 80000000;
-}
+    timer_link* prev = nullptr;
+    timer_link* next = nullptr;
+};
 
-struct timer_info 
+/*
+    A one-shot or periodic deadline. The owner keeps it, in static memory or a long-lived object, and must not
+    move it while it is armed. On expiry the wheel sets its bits in the owner's event group.
+*/
+struct timer_entry : timer_link
 {
-    timer_group_t timer_group;
-    timer_idx_t timer_idx;
-    int alarm_interval;
-    bool auto_reload;
+    int64_t deadline_us = 0;
+    int64_t tick = 0;
+    uint32_t period_us = 0;
+    EventGroupHandle_t owner = nullptr;
+    EventBits_t bits = 0;
+    bool expired = false;
 };
 
-bool IRAM_ATTR timer_group_isr_callback(void *args)
+/*
+    Any number of deadlines on one esp_timer: a hashed timing wheel of TIMER_WHEEL_SLOTS doubly linked lists.
+    Starting, restarting and cancelling a deadline are O(1) and safe from any task. The esp_timer is armed for
+    the earliest deadline only, so nothing ticks while no deadline is due; its callback runs on the esp_timer
+    task, expires what is due and arms the esp_timer for the next deadline, found by walking the slots from the
+    current tick up to the first one in use.
+*/
+class timer_wheel
 {
-    BaseType_t high_task_awoken = pdFALSE;
+public:
+    timer_wheel()
+    {
+        for(timer_link& slot : slots)
+        {
+            slot.prev = &slot;
+            slot.next = &slot;
+        }
+    }
 
-    //xQueueSendFromISR(timer_queue, &evt, &high_task_awoken);
-    int higherPriorityTaskWoken = false;
-    int result = xEventGroupSetBitsFromISR(timer_event_group, EVENT_TIMER_ALARM, &higherPriorityTaskWoken);
-    if(result != pdFAIL)
+    void setup()
     {
-        portYIELD_FROM_ISR(higherPriorityTaskWoken);
+        esp_log_level_set(timer_log_tag, INTERCOM_LOG_LEVEL);
+        esp_timer_create_args_t args = {};
+        args.callback = &timer_wheel::on_alarm;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "timer_wheel";
+        ESP_ERROR_CHECK(esp_timer_create(&args, &alarm));
+        cursor = esp_timer_get_time() / TIMER_WHEEL_TICK_US;
     }
 
-    return high_task_awoken == pdTRUE;
-}
+    // Sets where the expirations of entry go. Call before the first start.
+    void bind(timer_entry& entry, EventGroupHandle_t owner, EventBits_t bits)
+    {
+        portENTER_CRITICAL(&lock);
+        entry.owner = owner;
+        entry.bits = bits;
+        portEXIT_CRITICAL(&lock);
+    }
 
-void timer_set_alarm_interval(int timer_interval_sec)
-{
-    const auto group = timer_group_t::TIMER_GROUP_0;
-    const auto index = timer_idx_t::TIMER_0;
-    
-    const uint32_t timer_scale = rtc_clk_apb_freq_get() / TIMER_DIVIDER;
-    ESP_ERROR_CHECK(timer_set_alarm_value(group, index, timer_interval_sec * timer_scale));
-}
-
-void timer_reset(int timer_interval_sec = 0)
-{
-    ESP_LOGI(timer_log_tag, "timer_reset called");
-    const auto group = timer_group_t::TIMER_GROUP_0;
-    const auto index = timer_idx_t::TIMER_0;
+    // Arms entry for delay_us from now, then every period_us unless 0. An armed entry starts over.
+    void start(timer_entry& entry, int64_t delay_us, uint32_t period_us = 0)
+    {
+        start_at(entry, esp_timer_get_time() + delay_us, period_us);
+    }
+
+    // Like start, for a deadline in esp_timer time.
+    void start_at(timer_entry& entry, int64_t deadline_us, uint32_t period_us = 0)
+    {
+        portENTER_CRITICAL(&lock);
+        if(entry.next != nullptr)
+        {
+            unlink(entry);
+        }
+        entry.deadline_us = deadline_us;
+        entry.period_us = period_us;
+        entry.expired = false;
+        insert(entry);
+        bool earlier = deadline_us < armed_us;
+        if(earlier)
+        {
+            armed_us = deadline_us;
+        }
+        portEXIT_CRITICAL(&lock);
+        if(earlier)
+        {
+            arm();
+        }
+    }
 
-    ESP_ERROR_CHECK(timer_set_counter_value(group, index, 0));
-    ESP_ERROR_CHECK(timer_set_alarm(group, index, TIMER_ALARM_EN));
+    // The alarm stays armed; if it was for this entry, it finds nothing due and moves on to the next.
+    void cancel(timer_entry& entry)
+    {
+        portENTER_CRITICAL(&lock);
+        if(entry.next != nullptr)
+        {
+            unlink(entry);
+        }
+        entry.expired = false;
+        portEXIT_CRITICAL(&lock);
+    }
 
-    if(timer_interval_sec != 0)
+    /*
+        True once per expiry since entry was last started. The bits of an expiry can still be on their way while
+        the owner starts or cancels the entry; this tells them from an expiry that still stands.
+    */
+    bool take_expired(timer_entry& entry)
     {
-        timer_set_alarm_interval(timer_interval_sec);
+        portENTER_CRITICAL(&lock);
+        bool expired = entry.expired;
+        entry.expired = false;
+        portEXIT_CRITICAL(&lock);
+        return expired;
     }
-}
 
-void timer_setup(int timer_interval_sec, EventGroupHandle_t event_group_handle)
-{
-    esp_log_level_set(timer_log_tag, INTERCOM_LOG_LEVEL);    
-
-    timer_event_group = event_group_handle;
-
-    const auto group = timer_group_t::TIMER_GROUP_0;
-    const auto index = timer_idx_t::TIMER_0;
-    const auto reload = timer_autoreload_t::TIMER_AUTORELOAD_DIS;
-
-    /* Select and initialize basic parameters of the timer */
-    timer_config_t config = {};
-    config.divider = TIMER_DIVIDER;
-    config.counter_dir = TIMER_COUNT_UP;
-    config.counter_en = TIMER_PAUSE;
-    config.alarm_en = TIMER_ALARM_EN;
-    config.auto_reload = reload;
-
-    timer_init(group, index, &config);
-
-    /* Timer's counter will initially start from value below.
-       Also, if auto_reload is set, this value will be automatically reload on alarm */
-    timer_set_counter_value(group, index, 0);
-
-    /* Configure the alarm value and the interrupt on alarm. */
-    const uint32_t timer_scale = rtc_clk_apb_freq_get() / TIMER_DIVIDER;
-    timer_set_alarm_value(group, index, timer_interval_sec * timer_scale);
-    timer_enable_intr(group, index);
-
-    timer_info *info = new timer_info();
-    info->timer_group = group;
-    info->timer_idx = index;
-    info->auto_reload = reload;
-    info->alarm_interval = timer_interval_sec;
-    timer_isr_callback_add(group, index, timer_group_isr_callback, info, 0);
-
-    timer_start(group, index);
-}
\ No newline at end of file
+    bool is_armed(timer_entry& entry)
+    {
+        portENTER_CRITICAL(&lock);
+        bool armed = entry.next != nullptr;
+        portEXIT_CRITICAL(&lock);
+        return armed;
+    }
+
+private:
+    struct expiration
+    {
+        EventGroupHandle_t owner;
+        EventBits_t bits;
+    };
+
+    static void on_alarm(void* arg)
+    {
+        static_cast<timer_wheel*>(arg)->expire(esp_timer_get_time());
+    }
+
+    void expire(int64_t now)
+    {
+        bool more = true;
+        while(more)
+        {
+            expiration posts[TIMER_WHEEL_POST_BATCH];
+            size_t count = 0;
+
+            portENTER_CRITICAL(&lock);
+            armed_us = INT64_MAX;
+            int64_t now_tick = now / TIMER_WHEEL_TICK_US;
+            // A slot holds every turn of the wheel, so one turn visits every deadline that can be due.
+            int64_t first_tick = now_tick - cursor >= TIMER_WHEEL_SLOTS ? now_tick - TIMER_WHEEL_SLOTS + 1 : cursor;
+            for(int64_t tick = first_tick; tick <= now_tick && count < TIMER_WHEEL_POST_BATCH; tick++)
+            {
+                timer_link& head = slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+                for(timer_link* link = head.next; link != &head && count < TIMER_WHEEL_POST_BATCH;)
+                {
+                    timer_link* next = link->next;
+                    timer_entry* entry = static_cast<timer_entry*>(link);
+                    if(entry->deadline_us <= now)
+                    {
+                        unlink(*entry);
+                        entry->expired = true;
+                        posts[count++] = {entry->owner, entry->bits};
+                        if(entry->period_us > 0)
+                        {
+                            // Missed periods are skipped, not made up for.
+                            entry->deadline_us += static_cast<int64_t>(entry->period_us) * ((now - entry->deadline_us) / entry->period_us + 1);
+                            insert(*entry);
+                        }
+                    }
+                    link = next;
+                }
+            }
+            more = count == TIMER_WHEEL_POST_BATCH;
+            bool rearm = false;
+            if(!more)
+            {
+                // Deadlines later in this tick stay in its slot.
+                cursor = now_tick;
+                armed_us = find_next_deadline();
+                rearm = armed_us != INT64_MAX;
+            }
+            portEXIT_CRITICAL(&lock);
+            if(rearm)
+            {
+                arm();
+            }
+
+            for(size_t i = 0; i < count; i++)
+            {
+                if(posts[i].owner != nullptr)
+                {
+                    xEventGroupSetBits(posts[i].owner, posts[i].bits);
+                }
+            }
+        }
+    }
+
+    /*
+        The earliest deadline, INT64_MAX for none. Lock held. Walks the ticks from the cursor and stops at the first
+        one that holds a deadline of its own turn: every later tick holds later deadlines only. All entries are
+        looked at only when none is due within a turn of the wheel.
+    */
+    int64_t find_next_deadline() const
+    {
+        if(armed_count == 0)
+        {
+            return INT64_MAX;
+        }
+        int64_t later_turns = INT64_MAX;
+        for(int64_t tick = cursor; tick < cursor + TIMER_WHEEL_SLOTS; tick++)
+        {
+            int64_t earliest = INT64_MAX;
+            const timer_link& head = slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+            for(const timer_link* link = head.next; link != &head; link = link->next)
+            {
+                const timer_entry* entry = static_cast<const timer_entry*>(link);
+                int64_t& best = entry->tick == tick ? earliest : later_turns;
+                if(entry->deadline_us < best)
+                {
+                    best = entry->deadline_us;
+                }
+            }
+            if(earliest != INT64_MAX)
+            {
+                return earliest;
+            }
+        }
+        return later_turns;
+    }
+
+    // Lock held.
+    void insert(timer_entry& entry)
+    {
+        // A deadline already past goes in the current slot, the next alarm takes it.
+        int64_t tick = entry.deadline_us / TIMER_WHEEL_TICK_US;
+        entry.tick = tick > cursor ? tick : cursor;
+        timer_link& head = slots[entry.tick & (TIMER_WHEEL_SLOTS - 1)];
+        entry.prev = &head;
+        entry.next = head.next;
+        head.next->prev = &entry;
+        head.next = &entry;
+        armed_count++;
+    }
+
+    // Lock held.
+    void unlink(timer_entry& entry)
+    {
+        entry.prev->next = entry.next;
+        entry.next->prev = entry.prev;
+        entry.prev = nullptr;
+        entry.next = nullptr;
+        armed_count--;
+    }
+
+    /*
+        Points the esp_timer at armed_us. Called without the lock: esp_timer takes a lock of its own, and a failure
+        must not stop the chip inside a critical section. Two callers may race here; each checks afterwards that
+        the deadline it armed for still stands and arms again if not, so the last one leaves the current deadline.
+    */
+    void arm()
+    {
+        portENTER_CRITICAL(&lock);
+        int64_t deadline_us = armed_us;
+        portEXIT_CRITICAL(&lock);
+        while(true)
+        {
+            esp_timer_stop(alarm);
+            if(deadline_us != INT64_MAX)
+            {
+                int64_t delay_us = deadline_us - esp_timer_get_time();
+                esp_err_t err = esp_timer_start_once(alarm, delay_us > 0 ? static_cast<uint64_t>(delay_us) : 0);
+                // ESP_ERR_INVALID_STATE: a racing caller started it in between, and checks its own deadline.
+                if(err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+                {
+                    ESP_LOGE(timer_log_tag, "Could not arm the alarm: %s", esp_err_to_name(err));
+                    return;
+                }
+            }
+
+            portENTER_CRITICAL(&lock);
+            bool current = armed_us == deadline_us;
+            deadline_us = armed_us;
+            portEXIT_CRITICAL(&lock);
+            if(current)
+            {
+                return;
+            }
+        }
+    }
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    timer_link slots[TIMER_WHEEL_SLOTS];
+    esp_timer_handle_t alarm = nullptr;
+    // Last tick the alarm callback went through; no deadline sits in an earlier one.
+    int64_t cursor = 0;
+    int64_t armed_us = INT64_MAX;
+    size_t armed_count = 0;
+};
+
+// Defined in main.cpp.
+extern timer_wheel timers;
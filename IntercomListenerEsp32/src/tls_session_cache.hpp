@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+#include "mbedtls/ssl.h"
+#endif
+
+#define TLS_SESSION_MAGIC 0x544c5331
+
+static const char* tls_log_tag = "tls";
+
+// Handshake counters since power-on. They live next to the session in RTC memory, so they add up across deep sleep.
+struct tls_handshake_stats
+{
+    uint32_t full;
+    uint32_t resumed;
+    // Handshakes that offered a session the server did not accept, included in full.
+    uint32_t rejected;
+    uint64_t full_us;
+    uint64_t resumed_us;
+    uint32_t last_us;
+};
+
+/*
+    One TLS session kept in RTC slow memory for the next wake.
+
+    Meant to be declared RTC_DATA_ATTR. RTC memory is zeroed on power-on and kept through deep sleep, so
+    magic tells a slot written by an earlier wake from a fresh one. The session is stored serialized by
+    mbedtls_ssl_session_save, because the live mbedtls_ssl_session points into heap that does not survive.
+*/
+struct tls_session_slot
+{
+    uint32_t magic;
+    uint32_t host_hash;
+    uint32_t length;
+    tls_handshake_stats stats;
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+    uint8_t data[CONFIG_INTERCOM_TLS_SESSION_CACHE_SIZE];
+#endif
+};
+
+inline uint32_t tls_host_hash(const char* host)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const char* c = host; *c != '\0'; c++)
+    {
+        hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+    }
+    return hash;
+}
+
+inline void tls_session_init(tls_session_slot& slot)
+{
+    if(slot.magic != TLS_SESSION_MAGIC)
+    {
+        memset(&slot, 0, sizeof(slot));
+        slot.magic = TLS_SESSION_MAGIC;
+    }
+}
+
+// A slot that offers the session saved in from, with handshake counters of its own.
+inline tls_session_slot tls_session_seed(const tls_session_slot& from)
+{
+    tls_session_slot slot = from;
+    slot.stats = {};
+    return slot;
+}
+
+inline void tls_session_forget(tls_session_slot& slot)
+{
+    slot.length = 0;
+}
+
+inline void tls_session_record_handshake(tls_session_slot& slot, bool offered, bool resumed, uint32_t duration_us)
+{
+    tls_session_init(slot);
+    slot.stats.last_us = duration_us;
+    if(resumed)
+    {
+        slot.stats.resumed++;
+        slot.stats.resumed_us += duration_us;
+    }
+    else
+    {
+        slot.stats.full++;
+        slot.stats.full_us += duration_us;
+        slot.stats.rejected += offered ? 1 : 0;
+    }
+}
+
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+// Restores the session saved for host into session, which the caller initialized. Returns false if there is none.
+inline bool tls_session_load(tls_session_slot& slot, const char* host, mbedtls_ssl_session& session)
+{
+    tls_session_init(slot);
+    if(slot.length == 0 || slot.host_hash != tls_host_hash(host))
+    {
+        return false;
+    }
+
+    int err = mbedtls_ssl_session_load(&session, slot.data, slot.length);
+    if(err != 0)
+    {
+        ESP_LOGW(tls_log_tag, "Saved TLS session for %s is unusable (-0x%04x)", host, static_cast<unsigned>(-err));
+        tls_session_forget(slot);
+        return false;
+    }
+    return true;
+}
+
+// Saves the session of an established connection. Returns false if it does not fit the slot.
+inline bool tls_session_store(tls_session_slot& slot, const char* host, const mbedtls_ssl_context& ssl)
+{
+    tls_session_init(slot);
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    size_t length = 0;
+    int err = mbedtls_ssl_get_session(&ssl, &session);
+    if(err == 0)
+    {
+        err = mbedtls_ssl_session_save(&session, slot.data, sizeof(slot.data), &length);
+    }
+    mbedtls_ssl_session_free(&session);
+    if(err != 0)
+    {
+        // Most of a saved session is the peer certificate. Disabling MBEDTLS_SSL_KEEP_PEER_CERTIFICATE shrinks it to ~200 bytes.
+        ESP_LOGW(tls_log_tag, "TLS session for %s needs %u bytes, cache holds %u", host, static_cast<unsigned>(length), static_cast<unsigned>(sizeof(slot.data)));
+        tls_session_forget(slot);
+        return false;
+    }
+    slot.host_hash = tls_host_hash(host);
+    slot.length = static_cast<uint32_t>(length);
+    return true;
+}
+#endif
+
+inline void tls_session_log_stats(const tls_session_slot& slot)
+{
+    const tls_handshake_stats& s = slot.stats;
+    ESP_LOGI(tls_log_tag, "TLS handshakes: %lu resumed (avg %lu ms), %lu full (avg %lu ms, %lu after a rejected resumption)",
+        static_cast<unsigned long>(s.resumed), static_cast<unsigned long>(s.resumed ? s.resumed_us / s.resumed / 1000 : 0),
+        static_cast<unsigned long>(s.full), static_cast<unsigned long>(s.full ? s.full_us / s.full / 1000 : 0),
+        static_cast<unsigned long>(s.rejected));
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "sdkconfig.h"
+#include "tls_session_cache.hpp"
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION && !defined(MBEDTLS_X509_TRUSTED_CERTIFICATE_CALLBACK)
+#error "TLS session resumption tells a resumed handshake by its trusted CA callback, enable CONFIG_MBEDTLS_X509_TRUSTED_CERT_CALLBACK"
+#endif
+
+// The mbedTLS state of one connection. On the heap while connected, as esp_tls keeps it, so a closed or plain connection costs none.
+struct tls_transport_state
+{
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    // Set when the server sent a certificate chain to verify, which it only does in a full handshake.
+    bool chain_verified;
+};
+
+/*
+    The socket under https_connection and mqtt_connection, with TLS on mbedTLS directly or plain TCP.
+
+    esp_tls only opens the TCP connection. The handshake runs on an mbedTLS context of our own because
+    esp_tls has no public way to offer a session restored from saved bytes, while here it is offered with
+    mbedtls_ssl_set_session and saved with mbedtls_ssl_get_session after every handshake.
+
+    Whether the server resumed the session is taken from the handshake itself: a full one verifies the
+    server's certificate chain, an abbreviated one has none. The chain is seen through a trusted CA callback
+    that offers no CA of its own, in place of the empty chain esp_crt_bundle_attach installs, so the
+    certificate bundle still decides whether the chain is trusted.
+*/
+class tls_transport
+{
+private:
+    mbedtls_net_context net;
+    tls_transport_state* state = nullptr;
+    bool offered = false;
+    bool resumed = false;
+    uint32_t handshake_us = 0;
+
+public:
+    tls_transport()
+    {
+        mbedtls_net_init(&net);
+    }
+
+    tls_transport(tls_transport const&) = delete;
+    tls_transport& operator=(tls_transport const&) = delete;
+
+    ~tls_transport()
+    {
+        close();
+    }
+
+    /*
+        Connects to host, with a TLS handshake when secure is set. timeout_ms bounds connecting and every read.
+        Given a slot, the session saved there is offered and the one established is saved back, and the handshake
+        is counted in its stats. A session that breaks the handshake is forgotten.
+    */
+    bool open(const char* host, int port, bool secure, int timeout_ms, tls_session_slot* slot = nullptr)
+    {
+        offered = false;
+        resumed = false;
+        int64_t start = esp_timer_get_time();
+
+        esp_tls_cfg_t config = {};
+        config.timeout_ms = timeout_ms;
+        config.is_plain_tcp = true;
+        esp_tls_last_error_t error = {};
+        int fd = -1;
+        if(esp_tls_plain_tcp_connect(host, strlen(host), port, &config, &error, &fd) != ESP_OK)
+        {
+            handshake_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+            return false;
+        }
+        net.fd = fd;
+        if(!secure)
+        {
+            handshake_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+            return true;
+        }
+
+        bool connected = handshake(host, slot);
+        handshake_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+        if(!connected)
+        {
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+            if(offered)
+            {
+                // A session that breaks the handshake is not offered again.
+                tls_session_forget(*slot);
+            }
+#endif
+            close();
+            return false;
+        }
+        if(slot != nullptr)
+        {
+            tls_session_record_handshake(*slot, offered, resumed, handshake_us);
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if(state != nullptr)
+        {
+            mbedtls_ssl_free(&state->ssl);
+            mbedtls_ssl_config_free(&state->conf);
+            mbedtls_ctr_drbg_free(&state->drbg);
+            mbedtls_entropy_free(&state->entropy);
+            free(state);
+            state = nullptr;
+        }
+        mbedtls_net_free(&net);
+    }
+
+    bool is_open() const
+    {
+        return net.fd >= 0;
+    }
+
+    int socket() const
+    {
+        return net.fd;
+    }
+
+    // Whether the last open() offered a saved session and whether the server resumed it.
+    bool session_offered() const
+    {
+        return offered;
+    }
+
+    bool session_resumed() const
+    {
+        return resumed;
+    }
+
+    // Duration of the last open(), connecting and handshake, failed or not.
+    uint32_t connect_us() const
+    {
+        return handshake_us;
+    }
+
+    // Returns the bytes written, or -1 once the connection failed.
+    ssize_t write(const void* data, size_t length)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        int written;
+        do
+        {
+            written = state != nullptr ? mbedtls_ssl_write(&state->ssl, bytes, length) : mbedtls_net_send(&net, bytes, length);
+        }
+        while(written == MBEDTLS_ERR_SSL_WANT_WRITE || written == MBEDTLS_ERR_SSL_WANT_READ);
+        return written > 0 ? written : -1;
+    }
+
+    // Returns the bytes read, 0 at the end of the stream, or -1 on an error or timeout.
+    ssize_t read(void* data, size_t length)
+    {
+        unsigned char* bytes = static_cast<unsigned char*>(data);
+        int received;
+        do
+        {
+            received = state != nullptr ? mbedtls_ssl_read(&state->ssl, bytes, length) : mbedtls_net_recv(&net, bytes, length);
+        }
+        while(received == MBEDTLS_ERR_SSL_WANT_READ || received == MBEDTLS_ERR_SSL_WANT_WRITE);
+        return received >= 0 ? received : -1;
+    }
+
+private:
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+    static int on_trusted_ca(void* context, mbedtls_x509_crt const* child, mbedtls_x509_crt** candidates)
+    {
+        static_cast<tls_transport_state*>(context)->chain_verified = true;
+        *candidates = nullptr;
+        return 0;
+    }
+#endif
+
+    bool handshake(const char* host, tls_session_slot* slot)
+    {
+        state = static_cast<tls_transport_state*>(calloc(1, sizeof(tls_transport_state)));
+        if(state == nullptr)
+        {
+            return false;
+        }
+        mbedtls_ssl_init(&state->ssl);
+        mbedtls_ssl_config_init(&state->conf);
+        mbedtls_ctr_drbg_init(&state->drbg);
+        mbedtls_entropy_init(&state->entropy);
+
+        int err = mbedtls_ctr_drbg_seed(&state->drbg, mbedtls_entropy_func, &state->entropy, nullptr, 0);
+        if(err == 0)
+        {
+            err = mbedtls_ssl_config_defaults(&state->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+        }
+        if(err != 0)
+        {
+            ESP_LOGE(tls_log_tag, "TLS setup for %s failed (-0x%04x)", host, static_cast<unsigned>(-err));
+            return false;
+        }
+        mbedtls_ssl_conf_authmode(&state->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_rng(&state->conf, mbedtls_ctr_drbg_random, &state->drbg);
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        esp_crt_bundle_attach(&state->conf);
+#endif
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+        mbedtls_ssl_conf_ca_cb(&state->conf, on_trusted_ca, state);
+#endif
+
+        err = mbedtls_ssl_setup(&state->ssl, &state->conf);
+        if(err == 0)
+        {
+            err = mbedtls_ssl_set_hostname(&state->ssl, host);
+        }
+        if(err != 0)
+        {
+            ESP_LOGE(tls_log_tag, "TLS setup for %s failed (-0x%04x)", host, static_cast<unsigned>(-err));
+            return false;
+        }
+        mbedtls_ssl_set_bio(&state->ssl, &net, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+        if(slot != nullptr)
+        {
+            mbedtls_ssl_session session;
+            mbedtls_ssl_session_init(&session);
+            offered = tls_session_load(*slot, host, session) && mbedtls_ssl_set_session(&state->ssl, &session) == 0;
+            mbedtls_ssl_session_free(&session);
+        }
+#endif
+
+        while((err = mbedtls_ssl_handshake(&state->ssl)) != 0)
+        {
+            if(err != MBEDTLS_ERR_SSL_WANT_READ && err != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                ESP_LOGE(tls_log_tag, "TLS handshake with %s failed (-0x%04x)", host, static_cast<unsigned>(-err));
+                return false;
+            }
+        }
+
+#if CONFIG_INTERCOM_TLS_SESSION_RESUMPTION
+        resumed = offered && !state->chain_verified;
+        if(slot != nullptr)
+        {
+            // Saved after resumptions too: the server may have issued a new ticket.
+            tls_session_store(*slot, host, state->ssl);
+        }
+#endif
+        return true;
+    }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_SENSOR_CAPTURE_ADC
+
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_adc/adc_continuous.h"
+#include "soc/soc_caps.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_level.h"
+#include "sensor_channels.hpp"
+#include "tone_detector.hpp"
+
+#if !CONFIG_INTERCOM_BURST_CLASSIFIER
+#error "ADC capture labels bursts by their tone and needs CONFIG_INTERCOM_BURST_CLASSIFIER"
+#endif
+
+static const char* tone_capture_log_tag = "tone_capture";
+
+// ADC1 channel that reads gpio, -1 for pins ADC1 does not reach. ADC2 is taken by Wi-Fi.
+constexpr int tone_adc1_channel(int gpio)
+{
+    switch(gpio)
+    {
+        case 36:
+            return 0;
+        case 37:
+            return 1;
+        case 38:
+            return 2;
+        case 39:
+            return 3;
+        case 32:
+            return 4;
+        case 33:
+            return 5;
+        case 34:
+            return 6;
+        case 35:
+            return 7;
+        default:
+            return -1;
+    }
+}
+
+// A labelled burst, handed from the capture task to the main task.
+struct tone_event
+{
+    burst_label label;
+    tone_features features;
+    int64_t start_timestamp;
+};
+
+/*
+    Samples the sensor lines with the ADC in continuous mode and labels bursts by their tone.
+
+    The ADC converts the lines in turn, CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ conversions a second in all,
+    and DMA moves the results into a pool of two frames: the driver fills one while the task works
+    through the other. A frame holds a block of CONFIG_INTERCOM_TONE_BLOCK_SAMPLES samples per line. The
+    only interrupt is the driver's at the end of a frame, which wakes the task; the task runs every sample
+    through the Goertzel bins of its line and hands a labelled burst to the main task once per burst.
+*/
+template<const auto& Channels>
+class tone_capture
+{
+public:
+    static constexpr size_t count = std::size(Channels);
+    static constexpr uint32_t line_rate_hz = CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ / count;
+    static constexpr size_t block_samples = CONFIG_INTERCOM_TONE_BLOCK_SAMPLES;
+    static constexpr uint32_t frame_bytes = block_samples * count * SOC_ADC_DIGI_RESULT_BYTES;
+    static constexpr int64_t block_us = block_samples * 1000000LL / line_rate_hz;
+
+private:
+    static constexpr bool adc1_lines()
+    {
+        for(const sensor_channel_config& channel : Channels)
+        {
+            if(tone_adc1_channel(channel.gpio) < 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(adc1_lines(), "ADC capture takes the sensor lines on ADC1, GPIO 32-39");
+    static_assert(count <= SOC_ADC_PATT_LEN_MAX, "One conversion pattern entry per line");
+    static_assert(CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ >= SOC_ADC_SAMPLE_FREQ_THRES_LOW
+        && CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ <= SOC_ADC_SAMPLE_FREQ_THRES_HIGH, "ADC sample rate out of range");
+    static_assert(frame_bytes % SOC_ADC_DIGI_DATA_BYTES_PER_CONV == 0, "Frames hold whole conversions");
+    static_assert(tone_bins_fit(line_rate_hz, block_samples),
+        "Every tone signature needs a bin below Nyquist, and at most TONE_MAX_BINS per line");
+
+    // Line of each ADC1 channel, 0xff for channels without one.
+    static constexpr std::array<uint8_t, 16> make_lines()
+    {
+        std::array<uint8_t, 16> lines = {};
+        for(uint8_t& line : lines)
+        {
+            line = 0xff;
+        }
+        for(size_t i = 0; i < count; i++)
+        {
+            lines[tone_adc1_channel(Channels[i].gpio)] = static_cast<uint8_t>(i);
+        }
+        return lines;
+    }
+    static constexpr std::array<uint8_t, 16> lines_by_adc_channel = make_lines();
+
+    // Lines inside a burst, as a bit per channel index. Written by the capture task only.
+    static inline std::atomic<uint32_t> active_lines{0};
+
+    adc_continuous_handle_t handle = nullptr;
+    TaskHandle_t task_handle = nullptr;
+    tone_block_detector detectors[count];
+    tone_tracker trackers[count];
+    QueueHandle_t mailboxes[count] = {};
+    EventGroupHandle_t event_group = nullptr;
+    EventBits_t event_bits = 0;
+    std::atomic<uint32_t> dropped_frames{0};
+    uint8_t frame[frame_bytes] = {};
+
+public:
+    tone_capture() = default;
+    tone_capture(tone_capture const&) = delete;
+    tone_capture& operator=(tone_capture const&) = delete;
+
+    // Starts sampling. event_bits are set in group once per labelled burst.
+    void setup(EventGroupHandle_t group, EventBits_t bits)
+    {
+        esp_log_level_set(tone_capture_log_tag, INTERCOM_LOG_LEVEL);
+        event_group = group;
+        event_bits = bits;
+
+        adc_digi_pattern_config_t pattern[count] = {};
+        for(size_t i = 0; i < count; i++)
+        {
+            detectors[i].setup(static_cast<sensor_channel>(i), line_rate_hz, block_samples);
+            trackers[i] = tone_tracker(CONFIG_INTERCOM_TONE_MIN_BLOCKS);
+            mailboxes[i] = xQueueCreate(1, sizeof(tone_event));
+
+            pattern[i].atten = ADC_ATTEN_DB_12;
+            pattern[i].channel = static_cast<uint8_t>(tone_adc1_channel(Channels[i].gpio));
+            pattern[i].unit = ADC_UNIT_1;
+            pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        }
+        xTaskCreate(tone_capture_task_routine, "tone_capture_task", 3072, this, configMAX_PRIORITIES - 2, &task_handle);
+
+        adc_continuous_handle_cfg_t handle_config = {};
+        handle_config.max_store_buf_size = frame_bytes * 2;
+        handle_config.conv_frame_size = frame_bytes;
+        ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &handle));
+
+        adc_continuous_config_t config = {};
+        config.pattern_num = count;
+        config.adc_pattern = pattern;
+        config.sample_freq_hz = CONFIG_INTERCOM_ADC_SAMPLE_RATE_HZ;
+        config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+        config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+        ESP_ERROR_CHECK(adc_continuous_config(handle, &config));
+
+        adc_continuous_evt_cbs_t callbacks = {};
+        callbacks.on_conv_done = on_conv_done;
+        callbacks.on_pool_ovf = on_pool_overflow;
+        ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &callbacks, this));
+        ESP_ERROR_CHECK(adc_continuous_start(handle));
+
+        ESP_LOGI(tone_capture_log_tag, "ADC capture at %lu Hz per line, blocks of %u samples (%lld us)",
+            static_cast<unsigned long>(line_rate_hz), static_cast<unsigned>(block_samples), static_cast<long long>(block_us));
+    }
+
+    // Fetches the last burst labelled on line. Returns false if none was since the last call.
+    bool take(size_t line, tone_event& event)
+    {
+        return mailboxes[line] != nullptr && xQueueReceive(mailboxes[line], &event, 0) == pdTRUE;
+    }
+
+    // Lines inside a burst right now, as a bit per channel index.
+    static uint32_t active()
+    {
+        return active_lines.load(std::memory_order_relaxed);
+    }
+
+private:
+    static bool IRAM_ATTR on_conv_done(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* user_data)
+    {
+        tone_capture& self = *static_cast<tone_capture*>(user_data);
+        BaseType_t higher_priority_task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(self.task_handle, &higher_priority_task_woken);
+        return higher_priority_task_woken == pdTRUE;
+    }
+
+    static bool IRAM_ATTR on_pool_overflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* user_data)
+    {
+        static_cast<tone_capture*>(user_data)->dropped_frames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Runs the samples of a frame through the detectors of their lines. Blocks are timed by now, the time
+    // the frame was read, which is within a frame of when they ended.
+    void process(uint32_t length, int64_t now)
+    {
+        bool labelled = false;
+        uint32_t active_mask = active_lines.load(std::memory_order_relaxed);
+        for(uint32_t offset = 0; offset + SOC_ADC_DIGI_RESULT_BYTES <= length; offset += SOC_ADC_DIGI_RESULT_BYTES)
+        {
+            const adc_digi_output_data_t* result = reinterpret_cast<const adc_digi_output_data_t*>(frame + offset);
+            uint8_t line = lines_by_adc_channel[result->type1.channel];
+            if(line >= count || !detectors[line].push(result->type1.data))
+            {
+                continue;
+            }
+
+            tone_tracker& tracker = trackers[line];
+            burst_label label = tracker.block(detectors[line].result(), now, block_us);
+            if(label != burst_label::none)
+            {
+                tone_event event = {label, tracker.features(), tracker.start()};
+                xQueueOverwrite(mailboxes[line], &event);
+                labelled = true;
+            }
+            active_mask = tracker.is_active() ? active_mask | (1u << line) : active_mask & ~(1u << line);
+        }
+
+        active_lines.store(active_mask, std::memory_order_relaxed);
+        if(labelled)
+        {
+            xEventGroupSetBits(event_group, event_bits);
+        }
+    }
+
+    static void tone_capture_task_routine(void *pvParameters)
+    {
+        tone_capture& self = *static_cast<tone_capture*>(pvParameters);
+        uint32_t dropped_reported = 0;
+        while(true)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            uint32_t length = 0;
+            while(adc_continuous_read(self.handle, self.frame, frame_bytes, &length, 0) == ESP_OK)
+            {
+                self.process(length, esp_timer_get_time());
+            }
+
+            uint32_t dropped = self.dropped_frames.load(std::memory_order_relaxed);
+            if(dropped != dropped_reported)
+            {
+                ESP_LOGW(tone_capture_log_tag, "ADC pool overflowed, %lu frame(s) dropped so far", static_cast<unsigned long>(dropped));
+                dropped_reported = dropped;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sensor_channels.hpp"
+#include "burst_classifier.hpp"
+
+// A block of samples matches when the tone in it lies between min_hz and max_hz and the block was taken on channel.
+struct tone_signature
+{
+    burst_label label;
+    sensor_channel channel;
+    uint32_t min_hz;
+    uint32_t max_hz;
+};
+
+// The pulse trains of burst_signatures as tones: ~0.9-1 kHz for the apartment ring, ~1.19 kHz for the door bell.
+static constexpr tone_signature tone_signatures[] =
+{
+    {burst_label::ring, sensor_channel_ring, 850, 1090},
+    {burst_label::door, sensor_channel_door, 1100, 1320},
+};
+
+// Blocks quieter than this RMS, in ADC counts, are silence. Well above the noise of the conditioned line.
+#define TONE_MIN_RMS 40
+// Share of the block energy, in 1/1000, that the bins of a signature must hold. A pulse train at the
+// duty cycle of the intercom signals has about half of its energy in the fundamental, mains hum and
+// glitches put a few percent into the band at most.
+#define TONE_MIN_SHARE_PERMILLE 250
+// Goertzel bins per line, over all signatures of the line.
+#define TONE_MAX_BINS 8
+
+// First and last bin of a block of block_samples at sample_rate_hz that fall into the band of signature.
+constexpr uint32_t tone_first_bin(const tone_signature& signature, uint32_t sample_rate_hz, size_t block_samples)
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(signature.min_hz) * block_samples + sample_rate_hz - 1) / sample_rate_hz);
+}
+
+constexpr uint32_t tone_last_bin(const tone_signature& signature, uint32_t sample_rate_hz, size_t block_samples)
+{
+    return static_cast<uint32_t>(static_cast<uint64_t>(signature.max_hz) * block_samples / sample_rate_hz);
+}
+
+// True if every signature gets at least one bin below Nyquist and no line needs more than TONE_MAX_BINS.
+constexpr bool tone_bins_fit(uint32_t sample_rate_hz, size_t block_samples)
+{
+    for(size_t channel = 0; channel < sensor_channel_count; channel++)
+    {
+        uint32_t bins = 0;
+        for(const tone_signature& signature : tone_signatures)
+        {
+            if(signature.channel != channel)
+            {
+                continue;
+            }
+            uint32_t first = tone_first_bin(signature, sample_rate_hz, block_samples);
+            uint32_t last = tone_last_bin(signature, sample_rate_hz, block_samples);
+            if(first == 0 || last < first || 2 * last >= block_samples)
+            {
+                return false;
+            }
+            bins += last - first + 1;
+        }
+        if(bins > TONE_MAX_BINS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What one block of samples holds.
+struct tone_block
+{
+    // Signature whose bins hold at least TONE_MIN_SHARE_PERMILLE of the energy, none otherwise.
+    burst_label label;
+    // Centre of the strongest bin of the best signature.
+    uint32_t peak_hz;
+    // Share of the block energy in the bins of the best signature, in 1/1000.
+    uint32_t share_permille;
+    // RMS of the block around its mean, in ADC counts.
+    uint32_t rms;
+};
+
+/*
+    Goertzel filters at the bins of the tone signatures of one line, run over blocks of samples.
+
+    The work per sample is integer: the coefficients are Q14 and each sample costs one 32x32 multiply
+    per bin plus the sums for the block energy. The bins are whole multiples of the block's frequency
+    resolution, so they do not overlap and their energies add up. The block mean is taken off the next
+    block, which keeps the DC of the line out of the bins.
+*/
+class tone_block_detector
+{
+private:
+    struct bin
+    {
+        int32_t coefficient;
+        uint32_t hz;
+        uint8_t signature;
+    };
+
+    bin bins[TONE_MAX_BINS] = {};
+    size_t bin_count = 0;
+    size_t block_samples = 0;
+
+    int32_t s1[TONE_MAX_BINS] = {};
+    int32_t s2[TONE_MAX_BINS] = {};
+    int32_t dc = 0;
+    bool dc_known = false;
+    size_t filled = 0;
+    int64_t sum = 0;
+    uint64_t sum_squares = 0;
+    tone_block last = {};
+
+public:
+    // Sets up the bins of the signatures of channel for blocks of samples at sample_rate_hz. Check the
+    // parameters with tone_bins_fit; bins past TONE_MAX_BINS are left out.
+    void setup(sensor_channel channel, uint32_t sample_rate_hz, size_t samples)
+    {
+        block_samples = samples;
+        bin_count = 0;
+        for(size_t s = 0; s < sizeof(tone_signatures) / sizeof(tone_signatures[0]); s++)
+        {
+            const tone_signature& signature = tone_signatures[s];
+            if(signature.channel != channel)
+            {
+                continue;
+            }
+            uint32_t last_bin = tone_last_bin(signature, sample_rate_hz, samples);
+            for(uint32_t k = tone_first_bin(signature, sample_rate_hz, samples); k <= last_bin && bin_count < TONE_MAX_BINS; k++)
+            {
+                bin& b = bins[bin_count++];
+                b.coefficient = static_cast<int32_t>(lround(2.0 * cos(2.0 * M_PI * k / samples) * (1 << 14)));
+                b.hz = static_cast<uint32_t>(static_cast<uint64_t>(k) * sample_rate_hz / samples);
+                b.signature = static_cast<uint8_t>(s);
+            }
+        }
+        restart();
+    }
+
+    // Forgets the block in progress and the DC of the line.
+    void restart()
+    {
+        dc_known = false;
+        start_block();
+    }
+
+    // Feeds one sample. Returns true when it completes a block, whose result() is valid until the next one.
+    bool push(int32_t sample)
+    {
+        if(!dc_known)
+        {
+            dc = sample;
+            dc_known = true;
+        }
+
+        int32_t x = sample - dc;
+        sum += x;
+        sum_squares += static_cast<uint32_t>(x * x);
+        for(size_t i = 0; i < bin_count; i++)
+        {
+            int32_t s = x + static_cast<int32_t>((static_cast<int64_t>(bins[i].coefficient) * s1[i]) >> 14) - s2[i];
+            s2[i] = s1[i];
+            s1[i] = s;
+        }
+
+        if(++filled < block_samples)
+        {
+            return false;
+        }
+        finish_block();
+        return true;
+    }
+
+    const tone_block& result() const
+    {
+        return last;
+    }
+
+private:
+    void start_block()
+    {
+        for(size_t i = 0; i < bin_count; i++)
+        {
+            s1[i] = 0;
+            s2[i] = 0;
+        }
+        filled = 0;
+        sum = 0;
+        sum_squares = 0;
+    }
+
+    void finish_block()
+    {
+        const uint64_t n = block_samples;
+        // Energy around the block mean, whatever the DC estimate was.
+        uint64_t square_of_sum = static_cast<uint64_t>(sum * sum) / n;
+        uint64_t energy = sum_squares > square_of_sum ? sum_squares - square_of_sum : 0;
+
+        last = {};
+        last.label = burst_label::none;
+        last.rms = static_cast<uint32_t>(sqrt(static_cast<double>(energy / n)));
+        if(last.rms >= TONE_MIN_RMS)
+        {
+            // A tone of amplitude A on a bin has power (A n / 2)^2 and the block energy n A^2 / 2,
+            // so 2 power / (n energy) is the share of the energy in that bin.
+            uint64_t scale = n * energy / 2000;
+            uint64_t best_power = 0;
+            for(size_t s = 0; s < sizeof(tone_signatures) / sizeof(tone_signatures[0]); s++)
+            {
+                uint64_t power = 0;
+                uint64_t peak_power = 0;
+                uint32_t peak_hz = 0;
+                for(size_t i = 0; i < bin_count; i++)
+                {
+                    if(bins[i].signature != s)
+                    {
+                        continue;
+                    }
+                    int64_t p = static_cast<int64_t>(s1[i]) * s1[i] + static_cast<int64_t>(s2[i]) * s2[i]
+                        - ((static_cast<int64_t>(bins[i].coefficient) * s1[i]) >> 14) * s2[i];
+                    uint64_t bin_power = p > 0 ? static_cast<uint64_t>(p) : 0;
+                    power += bin_power;
+                    if(bin_power > peak_power)
+                    {
+                        peak_power = bin_power;
+                        peak_hz = bins[i].hz;
+                    }
+                }
+                if(power > best_power)
+                {
+                    best_power = power;
+                    last.peak_hz = peak_hz;
+                    last.share_permille = static_cast<uint32_t>(scale != 0 ? power / scale : 0);
+                    last.label = last.share_permille >= TONE_MIN_SHARE_PERMILLE ? tone_signatures[s].label : burst_label::none;
+                }
+            }
+            if(last.share_permille > 1000)
+            {
+                last.share_permille = 1000;
+            }
+        }
+
+        dc += static_cast<int32_t>(sum / static_cast<int64_t>(n));
+        start_block();
+    }
+};
+
+// Tone features of one burst, taken from the block that decided its label.
+struct tone_features
+{
+    uint32_t peak_hz;
+    uint32_t share_permille;
+    uint32_t rms;
+    // Blocks in a row that held the tone.
+    uint32_t tone_blocks;
+    uint32_t duration_us;
+};
+
+/*
+    Labels bursts on one sensor line from its tone blocks, like burst_tracker does from edges.
+
+    A burst starts with the first block that is not silent. It is labelled once min_tone_blocks blocks in
+    a row hold the tone of the same signature, and labelled noise if the line falls silent for
+    BURST_IDLE_GAP_US before that. Blocks after the label are absorbed until the line is silent again.
+*/
+class tone_tracker
+{
+private:
+    uint32_t min_tone_blocks;
+
+    bool active = false;
+    bool decided = false;
+    burst_label run_label = burst_label::none;
+    uint32_t run = 0;
+    int64_t start_us = 0;
+    int64_t last_sound_us = 0;
+    tone_features current = {};
+
+public:
+    explicit tone_tracker(uint32_t min_blocks = 3)
+        : min_tone_blocks(min_blocks)
+    {
+    }
+
+    // Feeds the block that ended at end_us and spanned block_us. Returns the label once per burst,
+    // burst_label::none otherwise.
+    burst_label block(const tone_block& result, int64_t end_us, int64_t block_us)
+    {
+        bool sound = result.rms >= TONE_MIN_RMS;
+        if(!active)
+        {
+            if(!sound)
+            {
+                return burst_label::none;
+            }
+            active = true;
+            decided = false;
+            run_label = burst_label::none;
+            run = 0;
+            start_us = end_us - block_us;
+            current = {};
+        }
+
+        if(sound)
+        {
+            last_sound_us = end_us;
+            current.duration_us = static_cast<uint32_t>(end_us - start_us);
+        }
+        else if(end_us - last_sound_us >= BURST_IDLE_GAP_US)
+        {
+            active = false;
+            return decided ? burst_label::none : burst_label::noise;
+        }
+
+        if(decided)
+        {
+            return burst_label::none;
+        }
+        if(result.label == burst_label::none || result.label != run_label)
+        {
+            run = 0;
+        }
+        run_label = result.label;
+        if(result.label == burst_label::none)
+        {
+            return burst_label::none;
+        }
+
+        run++;
+        current.peak_hz = result.peak_hz;
+        current.share_permille = result.share_permille;
+        current.rms = result.rms;
+        current.tone_blocks = run;
+        if(run < min_tone_blocks)
+        {
+            return burst_label::none;
+        }
+        decided = true;
+        return result.label;
+    }
+
+    bool is_active() const
+    {
+        return active;
+    }
+
+    // Start of the current or last burst, on the clock of the block times.
+    int64_t start() const
+    {
+        return start_us;
+    }
+
+    const tone_features& features() const
+    {
+        return current;
+    }
+};
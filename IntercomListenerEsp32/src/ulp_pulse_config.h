@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+    Constants shared by the ULP pulse detector in ulp/ulp_main.S and the code that loads it.
+    Preprocessor only apart from the C++ block at the end: the ULP assembler includes this file too.
+*/
+
+#include "sdkconfig.h"
+
+// The ULP FSM runs from RTC_FAST_CLK, the 8 MHz RC oscillator. It is not calibrated; a few percent off
+// shifts every measured period by as much, well inside the signature ranges.
+#define ULP_CLOCK_MHZ 8
+
+// One pass of either sample loop, padded with WAIT to the same length. See the cycle counts in ulp_main.S.
+#define ULP_SAMPLE_CYCLES 80
+#define ULP_SAMPLE_US (ULP_SAMPLE_CYCLES / ULP_CLOCK_MHZ)
+#define ULP_US_TO_SAMPLES(us) ((us) / ULP_SAMPLE_US)
+
+// Pulse train of a ring or door signal, the same ranges as burst_signatures. The lead-in before the train
+// is not checked: the ULP looks at the lines every few milliseconds and usually starts inside the train.
+#define ULP_PERIOD_MIN_US 600
+#define ULP_PERIOD_MAX_US 1600
+#define ULP_MIN_PULSES 8
+// Time at the wake level over the measured periods. The ULP has no multiply or divide and compares against
+// sums of shifted totals: 1/2 + 1/32 + 1/64 and 1 - 1/16 - 1/64 of the total, 547 and 922 permille.
+#define ULP_DUTY_MIN_PERMILLE 547
+#define ULP_DUTY_MAX_PERMILLE 922
+// Silence, or a line held at the wake level, that ends a capture. Same as BURST_IDLE_GAP_US.
+#define ULP_IDLE_GAP_US 30000
+// Periods of the oscilloscope captures. The ULP timer period is skewed against them, see ulp_wake_period_us().
+#define ULP_RING_PERIOD_US 1000
+#define ULP_DOOR_PERIOD_US 840
+
+#define ULP_PERIOD_MIN_SAMPLES ULP_US_TO_SAMPLES(ULP_PERIOD_MIN_US)
+#define ULP_PERIOD_MAX_SAMPLES ULP_US_TO_SAMPLES(ULP_PERIOD_MAX_US)
+#define ULP_IDLE_GAP_SAMPLES ULP_US_TO_SAMPLES(ULP_IDLE_GAP_US)
+
+// Values of wake_channel: sensor_channel + 1, 0 while nothing matched.
+#define ULP_WAKE_NONE 0
+#define ULP_WAKE_RING 1
+#define ULP_WAKE_DOOR 2
+
+// RTC IO number of the GPIOs the RTC domain can read. Any other GPIO leaves an undefined name behind.
+#define ULP_RTC_IO_OF_GPIO_36 0
+#define ULP_RTC_IO_OF_GPIO_37 1
+#define ULP_RTC_IO_OF_GPIO_38 2
+#define ULP_RTC_IO_OF_GPIO_39 3
+#define ULP_RTC_IO_OF_GPIO_34 4
+#define ULP_RTC_IO_OF_GPIO_35 5
+#define ULP_RTC_IO_OF_GPIO_25 6
+#define ULP_RTC_IO_OF_GPIO_26 7
+#define ULP_RTC_IO_OF_GPIO_33 8
+#define ULP_RTC_IO_OF_GPIO_32 9
+#define ULP_RTC_IO_OF_GPIO_4 10
+#define ULP_RTC_IO_OF_GPIO_0 11
+#define ULP_RTC_IO_OF_GPIO_2 12
+#define ULP_RTC_IO_OF_GPIO_15 13
+#define ULP_RTC_IO_OF_GPIO_13 14
+#define ULP_RTC_IO_OF_GPIO_12 15
+#define ULP_RTC_IO_OF_GPIO_14 16
+#define ULP_RTC_IO_OF_GPIO_27 17
+#define ULP_RTC_IO_PASTE(gpio) ULP_RTC_IO_OF_GPIO_##gpio
+#define ULP_RTC_IO(gpio) ULP_RTC_IO_PASTE(gpio)
+
+#define ULP_RING_RTC_IO ULP_RTC_IO(CONFIG_INTERCOM_RING_GPIO_PIN)
+#define ULP_DOOR_RTC_IO ULP_RTC_IO(CONFIG_INTERCOM_DOOR_GPIO_PIN)
+
+// Both lines are read with one register read: a window of RTC_GPIO_IN bits from the lower pin to the higher.
+#if ULP_RING_RTC_IO < ULP_DOOR_RTC_IO
+#define ULP_PIN_WINDOW_LOW ULP_RING_RTC_IO
+#define ULP_PIN_WINDOW_WIDTH (ULP_DOOR_RTC_IO - ULP_RING_RTC_IO + 1)
+#else
+#define ULP_PIN_WINDOW_LOW ULP_DOOR_RTC_IO
+#define ULP_PIN_WINDOW_WIDTH (ULP_RING_RTC_IO - ULP_DOOR_RTC_IO + 1)
+#endif
+#if ULP_PIN_WINDOW_WIDTH > 16
+#error "The ring and door RTC IOs must lie within 16 bits of each other for the ULP to read both at once"
+#endif
+#define ULP_RING_SHIFT (ULP_RING_RTC_IO - ULP_PIN_WINDOW_LOW)
+#define ULP_DOOR_SHIFT (ULP_DOOR_RTC_IO - ULP_PIN_WINDOW_LOW)
+
+#ifdef __cplusplus
+#include <stdint.h>
+
+// Distance of the phase at which one ULP run samples a pulse train from that of the run before, in permille of
+// the train period, 0 to 500.
+constexpr uint32_t ulp_phase_step_permille(uint32_t timer_us, uint32_t signal_period_us)
+{
+    uint32_t step = timer_us % signal_period_us * 1000 / signal_period_us;
+    return step < 500 ? step : 1000 - step;
+}
+
+// A timer period that is a multiple of the signal period reads every pulse at the same phase, and all runs
+// during a ring may land in the idle part of the period. The configured period is lengthened by less than
+// a millisecond so that successive runs walk through the phase of both captured signals.
+constexpr uint32_t ulp_wake_period_us(uint32_t period_ms)
+{
+    uint32_t best_us = period_ms * 1000;
+    uint32_t best_step = 0;
+    for(uint32_t skew_us = 0; skew_us < 1000; skew_us += 10)
+    {
+        uint32_t ring_step = ulp_phase_step_permille(period_ms * 1000 + skew_us, ULP_RING_PERIOD_US);
+        uint32_t door_step = ulp_phase_step_permille(period_ms * 1000 + skew_us, ULP_DOOR_PERIOD_US);
+        uint32_t step = ring_step < door_step ? ring_step : door_step;
+        if(step > best_step)
+        {
+            best_step = step;
+            best_us = period_ms * 1000 + skew_us;
+        }
+    }
+    return best_us;
+}
+#endif
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#if CONFIG_INTERCOM_WAKE_PROFILE
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "log_level.h"
+
+#define WAKE_PROFILE_MAGIC 0x57505231
+// Power-of-two millisecond buckets: below 1 ms, [1, 2), [2, 4), ... and everything from 4096 ms on.
+#define WAKE_PROFILE_BUCKETS 14
+
+static const char* profile_log_tag = "profile";
+
+// Steps between a wake and the next deep sleep, in the order they usually happen.
+enum class wake_phase : uint8_t
+{
+    // From reset to app_main. detail is the esp_sleep_source_t wake cause.
+    boot,
+    nvs_init,
+    netif_init,
+    sensor_setup,
+    // From wifi_init_sta to WIFI_EVENT_STA_START.
+    wifi_start,
+    // From the start of the station, or a reconnect, to WIFI_EVENT_STA_CONNECTED.
+    wifi_associate,
+    // From association to IP_EVENT_STA_GOT_IP: the DHCP exchange, or next to nothing with a cached address.
+    wifi_ip,
+    dns,
+    // TCP connect and TLS handshake. detail is 1 if the session was resumed.
+    tls_connect,
+    // From the first byte of a request to the end of the response.
+    http_response,
+    // Everything from reset to deep sleep entry.
+    awake,
+    // From reset to WIFI_EVENT_STA_START: how soon the radio is up.
+    radio_on,
+    count
+};
+
+inline const char* wake_phase_name(wake_phase phase)
+{
+    switch(phase)
+    {
+        case wake_phase::boot:
+            return "boot";
+        case wake_phase::nvs_init:
+            return "nvs_init";
+        case wake_phase::netif_init:
+            return "netif_init";
+        case wake_phase::sensor_setup:
+            return "sensor_setup";
+        case wake_phase::wifi_start:
+            return "wifi_start";
+        case wake_phase::wifi_associate:
+            return "wifi_associate";
+        case wake_phase::wifi_ip:
+            return "wifi_ip";
+        case wake_phase::dns:
+            return "dns";
+        case wake_phase::tls_connect:
+            return "tls_connect";
+        case wake_phase::http_response:
+            return "http_response";
+        case wake_phase::radio_on:
+            return "radio_on";
+        default:
+            return "awake";
+    }
+}
+
+// One timing probe, 8 bytes.
+struct wake_probe
+{
+    // Low bits of the wake cycle the probe was taken in.
+    uint16_t cycle;
+    wake_phase phase;
+    uint8_t detail;
+    uint32_t duration_us;
+};
+
+/*
+    Timing probes of the last wake cycles, kept in RTC slow memory.
+
+    Meant to be declared RTC_DATA_ATTR, like tls_session_slot: magic tells a log written by an earlier
+    wake from the zeroed memory of a power-on. The probes form a ring of CONFIG_INTERCOM_WAKE_PROFILE_RECORDS,
+    so the oldest cycles are overwritten first. head counts every probe ever taken. Probes are taken on the
+    main task, the event loop and the notification task; each one claims its slot with an atomic increment.
+*/
+struct wake_profile_log
+{
+    uint32_t magic;
+    uint16_t cycle;
+    uint32_t head;
+    wake_probe probes[CONFIG_INTERCOM_WAKE_PROFILE_RECORDS];
+};
+
+static_assert((CONFIG_INTERCOM_WAKE_PROFILE_RECORDS & (CONFIG_INTERCOM_WAKE_PROFILE_RECORDS - 1)) == 0,
+    "CONFIG_INTERCOM_WAKE_PROFILE_RECORDS must be a power of two");
+
+struct wake_phase_summary
+{
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t max_us;
+    uint32_t buckets[WAKE_PROFILE_BUCKETS];
+};
+
+// Starts the probes of a new wake cycle. Call first thing in app_main.
+inline void wake_profile_begin(wake_profile_log& log)
+{
+    if(log.magic != WAKE_PROFILE_MAGIC)
+    {
+        memset(&log, 0, sizeof(log));
+        log.magic = WAKE_PROFILE_MAGIC;
+    }
+    log.cycle++;
+}
+
+inline void wake_profile_record(wake_profile_log& log, wake_phase phase, uint32_t duration_us, uint8_t detail = 0)
+{
+    uint32_t slot = std::atomic_ref<uint32_t>(log.head).fetch_add(1, std::memory_order_relaxed);
+    log.probes[slot & (CONFIG_INTERCOM_WAKE_PROFILE_RECORDS - 1)] = {log.cycle, phase, detail, duration_us};
+}
+
+inline size_t wake_profile_bucket(uint32_t duration_us)
+{
+    uint32_t ms = duration_us / 1000;
+    size_t bucket = 0;
+    while(ms > 0 && bucket < WAKE_PROFILE_BUCKETS - 1)
+    {
+        ms >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Statistics of one phase over the last cycles, the current one included. Uses a static scratch buffer, so call from one task only.
+inline wake_phase_summary wake_profile_summarize(const wake_profile_log& log, wake_phase phase, uint16_t cycles)
+{
+    static uint32_t durations[CONFIG_INTERCOM_WAKE_PROFILE_RECORDS];
+    wake_phase_summary summary = {};
+    if(log.magic != WAKE_PROFILE_MAGIC)
+    {
+        return summary;
+    }
+
+    uint32_t stored = log.head < CONFIG_INTERCOM_WAKE_PROFILE_RECORDS ? log.head : CONFIG_INTERCOM_WAKE_PROFILE_RECORDS;
+    for(uint32_t i = 0; i < stored; i++)
+    {
+        const wake_probe& probe = log.probes[i];
+        if(probe.phase != phase || static_cast<uint16_t>(log.cycle - probe.cycle) >= cycles)
+        {
+            continue;
+        }
+        // Insertion sort, the buffer is small.
+        uint32_t j = summary.count++;
+        for(; j > 0 && durations[j - 1] > probe.duration_us; j--)
+        {
+            durations[j] = durations[j - 1];
+        }
+        durations[j] = probe.duration_us;
+        summary.buckets[wake_profile_bucket(probe.duration_us)]++;
+    }
+
+    if(summary.count > 0)
+    {
+        summary.min_us = durations[0];
+        summary.p50_us = durations[(summary.count * 50 + 99) / 100 - 1];
+        summary.p90_us = durations[(summary.count * 90 + 99) / 100 - 1];
+        summary.max_us = durations[summary.count - 1];
+    }
+    return summary;
+}
+
+// Logs a histogram per phase over the last cycles, e.g. every few wakes or on request.
+inline void wake_profile_report(const wake_profile_log& log, uint16_t cycles)
+{
+    esp_log_level_set(profile_log_tag, INTERCOM_LOG_LEVEL);
+    ESP_LOGI(profile_log_tag, "Wake cycle %u, phases over the last %u cycle(s) in ms:", static_cast<unsigned>(log.cycle), static_cast<unsigned>(cycles));
+    for(uint8_t p = 0; p < static_cast<uint8_t>(wake_phase::count); p++)
+    {
+        wake_phase phase = static_cast<wake_phase>(p);
+        wake_phase_summary summary = wake_profile_summarize(log, phase, cycles);
+        if(summary.count == 0)
+        {
+            continue;
+        }
+
+        char histogram[WAKE_PROFILE_BUCKETS * 16] = {0};
+        size_t length = 0;
+        for(size_t b = 0; b < WAKE_PROFILE_BUCKETS && length < sizeof(histogram); b++)
+        {
+            if(summary.buckets[b] == 0)
+            {
+                continue;
+            }
+            if(b == 0)
+            {
+                length += snprintf(histogram + length, sizeof(histogram) - length, " <1:%lu", static_cast<unsigned long>(summary.buckets[b]));
+            }
+            else
+            {
+                length += snprintf(histogram + length, sizeof(histogram) - length, " %lu+:%lu", 1UL << (b - 1), static_cast<unsigned long>(summary.buckets[b]));
+            }
+        }
+        // Whole milliseconds: the histogram is about where the time goes, not about microseconds.
+        ESP_LOGI(profile_log_tag, "  %-14s n %3lu  min %6lu  p50 %6lu  p90 %6lu  max %6lu |%s", wake_phase_name(phase),
+            static_cast<unsigned long>(summary.count), static_cast<unsigned long>(summary.min_us / 1000), static_cast<unsigned long>(summary.p50_us / 1000),
+            static_cast<unsigned long>(summary.p90_us / 1000), static_cast<unsigned long>(summary.max_us / 1000), histogram);
+    }
+}
+
+// Defined RTC_DATA_ATTR in main.cpp. Probes from every module go here.
+extern wake_profile_log wake_profile;
+
+// Records a phase that started at start_us, esp_timer time, and ends now.
+#define WAKE_PROBE(phase, start_us) wake_profile_record(wake_profile, (phase), static_cast<uint32_t>(esp_timer_get_time() - (start_us)))
+#define WAKE_PROBE_DETAIL(phase, start_us, detail) \
+    wake_profile_record(wake_profile, (phase), static_cast<uint32_t>(esp_timer_get_time() - (start_us)), static_cast<uint8_t>(detail))
+
+#else
+
+#define WAKE_PROBE(phase, start_us) ((void)(start_us))
+#define WAKE_PROBE_DETAIL(phase, start_us, detail) ((void)(start_us), (void)(detail))
+
+#endif
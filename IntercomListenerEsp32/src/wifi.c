@@ -2,6 +2,139 @@
 #include "log_level.h"
 #include "events.h"
 
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+static void fast_connect_load(void)
+{
+    if(fast_connect.magic == WIFI_FAST_CONNECT_MAGIC)
+    {
+        return;
+    }
+
+    // RTC memory was lost, e.g. after a power cut. The NVS copy still names the AP.
+    memset(&fast_connect, 0, sizeof(fast_connect));
+    fast_connect.magic = WIFI_FAST_CONNECT_MAGIC;
+    nvs_handle_t handle;
+    if(nvs_open(WIFI_FAST_CONNECT_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    size_t length = sizeof(fast_connect.ap);
+    if(nvs_get_blob(handle, WIFI_FAST_CONNECT_NVS_KEY, &fast_connect.ap, &length) == ESP_OK && length == sizeof(fast_connect.ap))
+    {
+        fast_connect.valid = true;
+        ESP_LOGI(wifi_log_tag, "Cached AP restored from NVS");
+    }
+    else
+    {
+        memset(&fast_connect.ap, 0, sizeof(fast_connect.ap));
+    }
+    nvs_close(handle);
+}
+
+static void fast_connect_save(const wifi_fast_connect_ap_t* ap)
+{
+    if(fast_connect.valid && memcmp(&fast_connect.ap, ap, sizeof(*ap)) == 0)
+    {
+        return;
+    }
+    memcpy(&fast_connect.ap, ap, sizeof(*ap));
+    fast_connect.valid = true;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(WIFI_FAST_CONNECT_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if(err == ESP_OK)
+    {
+        err = nvs_set_blob(handle, WIFI_FAST_CONNECT_NVS_KEY, ap, sizeof(*ap));
+        if(err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if(err != ESP_OK)
+    {
+        ESP_LOGW(wifi_log_tag, "Could not back up the cached AP to NVS: %s", esp_err_to_name(err));
+    }
+}
+
+static void fast_connect_forget(void)
+{
+    fast_connect.valid = false;
+    fast_connect.lease_valid = false;
+    fast_connect.failures = 0;
+
+    nvs_handle_t handle;
+    if(nvs_open(WIFI_FAST_CONNECT_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        if(nvs_erase_key(handle, WIFI_FAST_CONNECT_NVS_KEY) == ESP_OK)
+        {
+            nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+}
+
+// The address may be reused while the DHCP server still holds the lease for us.
+static bool fast_connect_lease_usable(void)
+{
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT_IP_MAX_AGE > 0
+    int64_t now = time(NULL);
+    return fast_connect.lease_valid && now >= fast_connect.ip_acquired_at
+        && now - fast_connect.ip_acquired_at < CONFIG_INTERCOM_WIFI_FAST_CONNECT_IP_MAX_AGE;
+#else
+    return false;
+#endif
+}
+
+// Skips DHCP by applying the cached address. esp_netif raises IP_EVENT_STA_GOT_IP for it.
+static bool fast_connect_apply_ip(void)
+{
+    esp_err_t err = esp_netif_dhcpc_stop(sta_netif);
+    if(err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED)
+    {
+        return false;
+    }
+    dhcp_stopped = true;
+    esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &fast_connect.ap.dns);
+    return esp_netif_set_ip_info(sta_netif, &fast_connect.ap.ip_info) == ESP_OK;
+}
+
+static void dhcp_restart(void)
+{
+    if(dhcp_stopped)
+    {
+        esp_netif_dhcpc_start(sta_netif);
+        dhcp_stopped = false;
+    }
+}
+#endif
+
+static void set_station_config(bool use_cached_ap)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = CONFIG_INTERCOM_WIFI_SSID,
+            .password = CONFIG_INTERCOM_WIFI_PASSWORD,
+            .threshold.authmode = INTERCOM_WIFI_SCAN_AUTH_MODE_THRESHOLD,
+            #ifdef INTERCOM_WIFI_SAE_MODE
+            .sae_pwe_h2e = INTERCOM_WIFI_SAE_MODE,
+            .sae_h2e_identifier = INTERCOM_WIFI_H2E_IDENTIFIER,
+            #endif
+        },
+    };
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+    // With both BSSID and channel the driver probes the one AP instead of scanning every channel.
+    fast_attempt = use_cached_ap;
+    if(use_cached_ap)
+    {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, fast_connect.ap.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = fast_connect.ap.channel;
+    }
+#endif
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
@@ -9,6 +142,22 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     {
         esp_wifi_connect();
     } 
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        associated = true;
+        memset(&connected_ap, 0, sizeof(connected_ap));
+        memcpy(connected_ap.bssid, event->bssid, sizeof(connected_ap.bssid));
+        connected_ap.channel = event->channel;
+
+        fast_ip = fast_attempt && fast_connect_lease_usable() && fast_connect_apply_ip();
+        if(!fast_ip)
+        {
+            dhcp_restart();
+        }
+    }
+#endif
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) 
     {
         if(!wifi_enabled)
@@ -17,6 +166,19 @@ static void event_handler(void* arg, esp_event_base_t event_base,
              xEventGroupSetBits(wifi_event_group, EVENT_WIFI_DISCONNECTED);
             return;
         }
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+        // Only a failed association counts against the cached AP, not a connection that dropped later.
+        bool association_failed = !associated;
+        associated = false;
+        if(fast_attempt && association_failed && ++fast_connect.failures >= CONFIG_INTERCOM_WIFI_FAST_CONNECT_MAX_FAILURES)
+        {
+            ESP_LOGW(wifi_log_tag, "Cached AP not found %d time(s), falling back to a full scan", fast_connect.failures);
+            fast_connect_forget();
+            set_station_config(false);
+            esp_wifi_connect();
+            return;
+        }
+#endif
         if (retry_num < CONFIG_INTERCOM_WIFI_MAXIMUM_RETRY) 
         {
             esp_wifi_connect();
@@ -31,7 +193,27 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     } 
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(wifi_log_tag, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        const char* path = "scan, DHCP";
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+        if(fast_ip)
+        {
+            path = "cached AP and address";
+            connected_ap.ip_info = fast_connect.ap.ip_info;
+            memcpy(&connected_ap.dns, &fast_connect.ap.dns, sizeof(connected_ap.dns));
+        }
+        else
+        {
+            path = fast_attempt ? "cached AP, DHCP" : path;
+            connected_ap.ip_info = event->ip_info;
+            esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &connected_ap.dns);
+            fast_connect.ip_acquired_at = time(NULL);
+            fast_connect.lease_valid = true;
+        }
+        fast_connect.failures = 0;
+        fast_connect_save(&connected_ap);
+#endif
+        ESP_LOGI(wifi_log_tag, "got ip:" IPSTR " in %lld ms (%s)", IP2STR(&event->ip_info.ip),
+            (long long)((esp_timer_get_time() - connect_started_at) / 1000), path);
         retry_num = 0;
         xEventGroupSetBits(wifi_event_group, EVENT_WIFI_CONNECTED);
     }
@@ -54,8 +236,13 @@ bool wifi_init_sta(EventGroupHandle_t event_group_handle)
 {
     esp_log_level_set(wifi_log_tag, INTERCOM_LOG_LEVEL);
     wifi_event_group = event_group_handle;
+    connect_started_at = esp_timer_get_time();
 
-    esp_netif_create_default_wifi_sta();
+    // The netif outlives esp_wifi_deinit; a second default STA netif cannot be created.
+    if(sta_netif == NULL)
+    {
+        sta_netif = esp_netif_create_default_wifi_sta();
+    }
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -71,23 +258,22 @@ bool wifi_init_sta(EventGroupHandle_t event_group_handle)
                                                         NULL,
                                                         &instance_got_ip));
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = CONFIG_INTERCOM_WIFI_SSID,
-            .password = CONFIG_INTERCOM_WIFI_PASSWORD,
-            .threshold.authmode = INTERCOM_WIFI_SCAN_AUTH_MODE_THRESHOLD,
-            #ifdef INTERCOM_WIFI_SAE_MODE
-            .sae_pwe_h2e = INTERCOM_WIFI_SAE_MODE,
-            .sae_h2e_identifier = INTERCOM_WIFI_H2E_IDENTIFIER,
-            #endif
-        },
-    };
+    bool use_cached_ap = false;
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+    fast_connect_load();
+    associated = false;
+    use_cached_ap = fast_connect.valid && fast_connect.failures < CONFIG_INTERCOM_WIFI_FAST_CONNECT_MAX_FAILURES;
+#endif
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    set_station_config(use_cached_ap);
+#if CONFIG_INTERCOM_LIGHT_SLEEP
+    // Modem sleep from one DTIM beacon to the next. WIFI_PS_NONE would keep the chip out of light sleep.
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+#endif
     wifi_enabled = true;
     ESP_ERROR_CHECK(esp_wifi_start());
 
     ESP_LOGD(wifi_log_tag, "wifi_init_sta finished.");
 
     return true;
-}
\ No newline at end of file
+}
@@ -9,6 +9,11 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_netif.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include <time.h>
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -65,3 +70,41 @@ EventGroupHandle_t wifi_event_group;
 
 static esp_event_handler_instance_t instance_any_id;
 static esp_event_handler_instance_t instance_got_ip;
+static esp_netif_t *sta_netif = NULL;
+static int64_t connect_started_at = 0;
+
+#if CONFIG_INTERCOM_WIFI_FAST_CONNECT
+#define WIFI_FAST_CONNECT_MAGIC 0x57464331
+#define WIFI_FAST_CONNECT_NVS_NAMESPACE "wifi_fast"
+#define WIFI_FAST_CONNECT_NVS_KEY "ap"
+
+/* The access point and address of the last successful connection. Mirrored to NVS, which is only
+ * written when one of them changes, so a power loss costs a scan but not the cached AP. */
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+} wifi_fast_connect_ap_t;
+
+/* Kept in RTC memory across deep sleep. ip_acquired_at is time() of the last DHCP lease, which keeps
+ * counting through deep sleep. The lease itself is not backed up: after a power loss DHCP runs again. */
+typedef struct
+{
+    uint32_t magic;
+    bool valid;
+    bool lease_valid;
+    uint8_t failures;
+    int64_t ip_acquired_at;
+    wifi_fast_connect_ap_t ap;
+} wifi_fast_connect_t;
+
+static RTC_DATA_ATTR wifi_fast_connect_t fast_connect;
+// Whether the current attempt names the cached AP, and whether it applies the cached address instead of DHCP.
+static bool fast_attempt = false;
+static bool fast_ip = false;
+static bool associated = false;
+static bool dhcp_stopped = false;
+static wifi_fast_connect_ap_t connected_ap;
+#endif